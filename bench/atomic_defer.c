@@ -0,0 +1,128 @@
+// contention benchmark for kyros_loop_atomic_defer
+// N producer threads post tasks to a single loop, compared against a spin lock + LIFO list
+// (the path kyros_loop_atomic_defer used before the lock-free queue) and against the
+// batched kyros_loop_atomic_submit path
+#include <kyros.h>
+#include <kyros_internal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <uv.h>
+
+#define DEFAULT_PRODUCERS 8
+#define DEFAULT_TASKS_PER_PRODUCER 1'000'000
+
+static _Atomic(uint64_t) executed = 0;
+
+static void count_task(void* ctx)
+{
+    atomic_fetch_add_explicit(&executed, 1, memory_order_relaxed);
+}
+
+typedef struct {
+    atomic_flag lock;
+    kyros_task* queue;
+} spin_lock_queue;
+
+typedef struct {
+    kyros_loop* loop;
+    spin_lock_queue* queue;
+    uint64_t tasks;
+} producer_args;
+
+static void spin_lock_producer(void* arg)
+{
+    producer_args* args = arg;
+    auto queue = args->queue;
+    for (uint64_t i = 0; i < args->tasks; i++) {
+        kyros_lock(&queue->lock, {
+            auto task = (kyros_task*)kyros_alloc(sizeof(kyros_task));
+            task->task = count_task;
+            task->ctx = NULL;
+            task->next = queue->queue;
+            queue->queue = task;
+        });
+    }
+}
+
+static void atomic_defer_producer(void* arg)
+{
+    producer_args* args = arg;
+    for (uint64_t i = 0; i < args->tasks; i++) {
+        kyros_loop_atomic_defer(args->loop, count_task, NULL);
+    }
+}
+
+static void atomic_submit_producer(void* arg)
+{
+    producer_args* args = arg;
+    for (uint64_t i = 0; i < args->tasks; i++) {
+        kyros_loop_atomic_submit(args->loop, count_task, NULL);
+    }
+    kyros_loop_atomic_flush(args->loop);
+}
+
+static double run_producers(void (*producer)(void*), producer_args* args, uint32_t producers, void (*consume)(producer_args* args, uint64_t total))
+{
+    uv_thread_t threads[producers];
+    atomic_store(&executed, 0);
+    auto start = uv_hrtime();
+    for (uint32_t i = 0; i < producers; i++) {
+        uv_thread_create(&threads[i], producer, args);
+    }
+    consume(args, args->tasks * producers);
+    for (uint32_t i = 0; i < producers; i++) {
+        uv_thread_join(&threads[i]);
+    }
+    return (double)(uv_hrtime() - start) / 1e9;
+}
+
+static void spin_lock_consume(producer_args* args, uint64_t total)
+{
+    auto queue = args->queue;
+    while (atomic_load_explicit(&executed, memory_order_relaxed) < total) {
+        kyros_task* task;
+        kyros_lock(&queue->lock, {
+            task = queue->queue;
+            queue->queue = NULL;
+        });
+        while (task) {
+            auto next_task = task->next;
+            task->task(task->ctx);
+            kyros_lock(&queue->lock, {
+                kyros_free(task);
+            });
+            task = next_task;
+        }
+    }
+}
+
+static void atomic_defer_consume(producer_args* args, uint64_t total)
+{
+    while (atomic_load_explicit(&executed, memory_order_relaxed) < total) {
+        kyros_loop_run_once(args->loop);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    kyros_init();
+    uint32_t producers = argc > 1 ? (uint32_t)atoi(argv[1]) : DEFAULT_PRODUCERS;
+    uint64_t tasks = argc > 2 ? (uint64_t)atoll(argv[2]) : DEFAULT_TASKS_PER_PRODUCER;
+    auto loop = kyros_loop_create(NULL);
+
+    spin_lock_queue queue = { .lock = ATOMIC_FLAG_INIT, .queue = NULL };
+    producer_args args = { .loop = loop, .queue = &queue, .tasks = tasks };
+    const double total = (double)(tasks * producers);
+
+    auto spin_lock_time = run_producers(spin_lock_producer, &args, producers, spin_lock_consume);
+    printf("spin lock:      %u producers %10.0f tasks/s\n", producers, total / spin_lock_time);
+
+    auto atomic_defer_time = run_producers(atomic_defer_producer, &args, producers, atomic_defer_consume);
+    printf("atomic defer:   %u producers %10.0f tasks/s (%.2fx)\n", producers, total / atomic_defer_time, spin_lock_time / atomic_defer_time);
+
+    auto atomic_submit_time = run_producers(atomic_submit_producer, &args, producers, atomic_defer_consume);
+    printf("atomic submit:  %u producers %10.0f tasks/s (%.2fx)\n", producers, total / atomic_submit_time, spin_lock_time / atomic_submit_time);
+
+    kyros_loop_unref(loop);
+    return 0;
+}
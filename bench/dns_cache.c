@@ -0,0 +1,110 @@
+// host name lookups per second: N threads resolve the same names through the process DNS cache (one loop each,
+// hits are answered before kyros_dns_lookup returns) and through a blocking getaddrinfo per lookup, which is what
+// every kyros_socket_connect to a host name cost before the cache
+// usage: dns_cache [threads] [lookups per thread]
+#include <kyros.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <uv.h>
+
+#define DEFAULT_THREADS 4
+#define DEFAULT_LOOKUPS 1'000'000
+#define GETADDRINFO_LOOKUPS 2'000
+#define NAME_COUNT 64
+
+static char names[NAME_COUNT][32];
+static _Atomic(uint64_t) failures = 0;
+
+typedef struct {
+    uint64_t lookups;
+} worker_args;
+
+static void lookup_callback(const struct sockaddr_storage* addresses, uint32_t count, int32_t error, void* ctx)
+{
+    if (error || !count) {
+        atomic_fetch_add_explicit(&failures, 1, memory_order_relaxed);
+    }
+}
+
+// answers every name with 127.0.0.1 so the misses don't depend on the network
+static int32_t stub_resolver(const char* host, struct sockaddr_storage* addresses, uint32_t capacity, uint32_t* ttl, void* ctx)
+{
+    auto address = (struct sockaddr_in*)addresses;
+    memset(addresses, 0, sizeof(struct sockaddr_storage));
+    address->sin_family = AF_INET;
+    address->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    return 1;
+}
+
+static void cache_worker(void* arg)
+{
+    worker_args* args = arg;
+    auto loop = kyros_loop_create(NULL);
+    // the first round misses and waits for the resolver threads, the others hit
+    for (uint32_t i = 0; i < NAME_COUNT; i++) {
+        kyros_dns_lookup(loop, names[i], KYROS_SOCKET_IP_FAMILY_ANY, lookup_callback, NULL);
+    }
+    kyros_loop_run_forever(loop);
+    for (uint64_t i = 0; i < args->lookups; i++) {
+        kyros_dns_lookup(loop, names[i % NAME_COUNT], KYROS_SOCKET_IP_FAMILY_ANY, lookup_callback, NULL);
+    }
+    kyros_loop_unref(loop);
+}
+
+static void getaddrinfo_worker(void* arg)
+{
+    worker_args* args = arg;
+    uv_loop_t loop;
+    uv_loop_init(&loop);
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    for (uint64_t i = 0; i < args->lookups; i++) {
+        uv_getaddrinfo_t request;
+        if (uv_getaddrinfo(&loop, &request, NULL, "localhost", NULL, &hints) < 0) {
+            atomic_fetch_add_explicit(&failures, 1, memory_order_relaxed);
+            continue;
+        }
+        uv_freeaddrinfo(request.addrinfo);
+    }
+    uv_loop_close(&loop);
+}
+
+static double run_workers(void (*worker)(void*), uint32_t threads, uint64_t lookups)
+{
+    uv_thread_t handles[threads];
+    worker_args args = { .lookups = lookups };
+    auto start = uv_hrtime();
+    for (uint32_t i = 0; i < threads; i++) {
+        uv_thread_create(&handles[i], worker, &args);
+    }
+    for (uint32_t i = 0; i < threads; i++) {
+        uv_thread_join(&handles[i]);
+    }
+    return (double)(uv_hrtime() - start) / 1e9;
+}
+
+int main(int argc, char** argv)
+{
+    kyros_init();
+    uint32_t threads = argc > 1 && atoi(argv[1]) > 0 ? (uint32_t)atoi(argv[1]) : DEFAULT_THREADS;
+    uint64_t lookups = argc > 2 && atoll(argv[2]) > 0 ? (uint64_t)atoll(argv[2]) : DEFAULT_LOOKUPS;
+
+    for (uint32_t i = 0; i < NAME_COUNT; i++) {
+        snprintf(names[i], sizeof(names[i]), "host-%u.bench.test", i);
+    }
+    kyros_dns_configure((kyros_dns_options) { .resolver = stub_resolver });
+
+    auto cache_time = run_workers(cache_worker, threads, lookups);
+    printf("dns cache:    %u threads %12.0f lookups/s\n", threads, (double)(lookups * threads) / cache_time);
+
+    auto getaddrinfo_time = run_workers(getaddrinfo_worker, threads, GETADDRINFO_LOOKUPS);
+    printf("getaddrinfo:  %u threads %12.0f lookups/s\n", threads, (double)(GETADDRINFO_LOOKUPS * threads) / getaddrinfo_time);
+
+    auto stats = kyros_dns_get_stats();
+    printf("hits %llu, misses %llu, failures %llu\n", (unsigned long long)stats.hits, (unsigned long long)stats.misses,
+        (unsigned long long)atomic_load(&failures));
+    return 0;
+}
@@ -0,0 +1,156 @@
+// TechEmpower style plaintext: pipelined "GET /plaintext" answered with "Hello, World!" on one server loop
+// the clients share another loop and thread, each connection keeps PIPELINE requests in flight and sends the next
+// batch once the whole previous one came back, the server cpu time per request is what the HTTP layer costs
+// usage: http_plaintext [connections] [pipeline] [seconds] [uring]
+#include <kyros.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <uv.h>
+
+#define DEFAULT_CONNECTIONS 256
+#define DEFAULT_PIPELINE 16
+#define DEFAULT_SECONDS 3
+#define MAX_PIPELINE 256
+#define SERVER_PORT 39331
+
+#define REQUEST "GET /plaintext HTTP/1.1\r\nHost: localhost\r\nAccept: text/plain\r\nConnection: keep-alive\r\n\r\n"
+// every response has the same size, the Date header is fixed length
+#define RESPONSE "HTTP/1.1 200 OK\r\nDate: Sun, 06 Nov 1994 08:49:37 GMT\r\nContent-Type: text/plain\r\nContent-Length: 13\r\n\r\nHello, World!"
+#define REQUEST_SIZE (sizeof(REQUEST) - 1)
+#define RESPONSE_SIZE (sizeof(RESPONSE) - 1)
+
+static kyros_loop* loop;
+static kyros_loop* client_loop;
+static char batch[REQUEST_SIZE * MAX_PIPELINE];
+static uint32_t connections;
+static uint32_t pipeline;
+static uint32_t seconds;
+static uint64_t responses;
+static bool done;
+
+///
+/// Server
+///
+
+static void onrequest(kyros_http_request* request, kyros_http_response* response, void* ctx)
+{
+    kyros_http_response_write_header(response, "Content-Type", 12, "text/plain", 10);
+    kyros_http_response_end(response, "Hello, World!", 13);
+}
+
+///
+/// Clients
+///
+
+// each client has its own handler so ctx points to its state
+typedef struct {
+    kyros_socket_handler handler;
+    kyros_socket socket;
+    uint64_t received;
+} client;
+
+static client* clients;
+
+static void stop_task(void* ctx)
+{
+    kyros_loop_stop(ctx);
+}
+
+static bool client_ondata(kyros_socket socket, const char* data, uint64_t length, void* ctx)
+{
+    client* self = ctx;
+    self->received += length;
+    // responses come back in pieces, only a whole batch sends the next one
+    if (self->received < RESPONSE_SIZE * pipeline) {
+        return true;
+    }
+    self->received -= RESPONSE_SIZE * pipeline;
+    responses += pipeline;
+    if (!done) {
+        kyros_socket_write(socket, batch, REQUEST_SIZE * pipeline, false);
+    }
+    return true;
+}
+
+static void client_onstatus(kyros_socket socket, kyros_socket_error error, void* ctx)
+{
+    if (kyros_socket_get_state(socket) == KYROS_SOCKET_STATE_OPEN) {
+        kyros_socket_write(socket, batch, REQUEST_SIZE * pipeline, false);
+    }
+}
+
+static void client_timeout(void* ctx)
+{
+    done = true;
+    kyros_loop_stop(client_loop);
+    kyros_loop_atomic_defer(loop, stop_task, loop);
+}
+
+static void run_clients(void* arg)
+{
+    kyros_socket_source server = { .type = KYROS_SOCKET_SOURCE_HOSTPORT, .value.host_port = { .host = "127.0.0.1", .port = SERVER_PORT } };
+    for (uint32_t i = 0; i < connections; i++) {
+        clients[i] = (client) { .handler = { .ctx = &clients[i], .ondata = client_ondata, .onstatus = client_onstatus, .ref_count = 1 } };
+        clients[i].socket = kyros_socket_connect(client_loop, server, (kryos_socket_options) { .no_delay = true }, &clients[i].handler);
+    }
+    auto timer = kyros_loop_timer(client_loop, client_timeout, NULL, (uint64_t)seconds * 1000, 0, false);
+    kyros_loop_run_forever(client_loop);
+    kyros_timer_unref(timer);
+    for (uint32_t i = 0; i < connections; i++) {
+        kyros_socket_close(clients[i].socket);
+    }
+    kyros_loop_run_once(client_loop);
+}
+
+///
+/// Bench
+///
+
+static double thread_cpu_time()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
+    return (double)time.tv_sec + (double)time.tv_nsec / 1e9;
+}
+
+int main(int argc, char** argv)
+{
+    kyros_init();
+    connections = argc > 1 && atoi(argv[1]) > 0 ? (uint32_t)atoi(argv[1]) : DEFAULT_CONNECTIONS;
+    pipeline = argc > 2 && atoi(argv[2]) > 0 ? (uint32_t)atoi(argv[2]) : DEFAULT_PIPELINE;
+    seconds = argc > 3 && atoi(argv[3]) > 0 ? (uint32_t)atoi(argv[3]) : DEFAULT_SECONDS;
+    auto engine = argc > 4 && !strcmp(argv[4], "uring") ? KYROS_LOOP_IO_URING : KYROS_LOOP_IO_POLL;
+    if (pipeline > MAX_PIPELINE) {
+        pipeline = MAX_PIPELINE;
+    }
+    for (uint32_t i = 0; i < pipeline; i++) {
+        memcpy(batch + i * REQUEST_SIZE, REQUEST, REQUEST_SIZE);
+    }
+    clients = calloc(connections, sizeof(client));
+    loop = kyros_loop_create_with_options(NULL, (kyros_loop_options) { .io_engine = engine });
+    client_loop = kyros_loop_create(NULL);
+
+    kyros_socket_source source = { .type = KYROS_SOCKET_SOURCE_HOSTPORT, .value.host_port = { .host = "127.0.0.1", .port = SERVER_PORT } };
+    auto server = kyros_http_server_listen(loop, source, (kryos_socket_options) { .no_delay = true }, (kyros_http_server_options) { .onrequest = onrequest });
+    if (!server) {
+        printf("could not listen on %u\n", SERVER_PORT);
+        return 1;
+    }
+
+    auto start = uv_hrtime();
+    auto cpu_start = thread_cpu_time();
+    uv_thread_t thread;
+    uv_thread_create(&thread, run_clients, NULL);
+    kyros_loop_run_forever(loop);
+    auto cpu = thread_cpu_time() - cpu_start;
+    uv_thread_join(&thread);
+    auto elapsed = uv_hrtime() - start;
+    printf("%s, %u connections, pipeline %u: %12.0f req/s, server cpu %6.2f s (%5.3f us/req, %10.0f req/s per core)\n",
+        engine == KYROS_LOOP_IO_URING ? "io_uring" : "poll", connections, pipeline, (double)responses * 1e9 / (double)elapsed,
+        cpu, cpu * 1e6 / (double)responses, (double)responses / cpu);
+    kyros_http_server_close(server);
+    kyros_loop_run_once(loop);
+    return 0;
+}
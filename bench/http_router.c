@@ -0,0 +1,184 @@
+// route lookup of a REST like API (2000 routes by default, a tenth with a wildcard tail), kyros_http_router_match vs
+// trying every pattern in registration order segment by segment, the latency is the one of a batch of lookups divided by
+// its size (a clock read costs about as much as a lookup) and p99 is over the batches
+// usage: http_router [routes] [lookups]
+#include <kyros.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <uv.h>
+
+#define DEFAULT_ROUTES 2000
+#define DEFAULT_LOOKUPS 1'000'000
+#define BATCH 16
+#define FORMS 10
+
+// every resource gets FORMS patterns for GET and POST
+static const char* forms[FORMS] = {
+    "/api/v1/resource%u",
+    "/api/v1/resource%u/:id",
+    "/api/v1/resource%u/:id/items",
+    "/api/v1/resource%u/:id/items/:item",
+    "/api/v1/resource%u/:id/items/:item/history",
+    "/api/v1/resource%u/:id/owners",
+    "/api/v1/resource%u/:id/owners/:owner",
+    "/api/v1/resource%u/search",
+    "/api/v1/resource%u/stats/:period",
+    "/api/v2/resource%u/*rest",
+};
+
+typedef struct {
+    char pattern[64];
+    const char* method;
+} route;
+
+static route* routes;
+static char (*paths)[96];
+static const char** methods;
+static uint32_t route_count;
+static uint32_t path_count;
+
+static void handler(kyros_http_request* request, kyros_http_response* response, const kyros_http_header* params, uint32_t param_count, void* ctx) { }
+
+/// @brief a request path for pattern, the params get values
+static void fill_path(char* out, uint32_t size, const char* pattern)
+{
+    uint32_t length = 0;
+    for (auto p = pattern; *p && length < size - 16;) {
+        if ((*p == ':' || *p == '*') && p[-1] == '/') {
+            length += (uint32_t)snprintf(out + length, size - length, *p == ':' ? "%u" : "%u/x.json", (uint32_t)rand() % 100000);
+            while (*p && *p != '/') {
+                p++;
+            }
+            continue;
+        }
+        out[length++] = *p++;
+    }
+    out[length] = 0;
+}
+
+///
+/// Linear baseline
+///
+
+static bool linear_matches(const char* pattern, const char* path, const char* end)
+{
+    while (*pattern && path <= end) {
+        if (*pattern == '*' && pattern[-1] == '/') {
+            return true;
+        }
+        if (*pattern == ':' && pattern[-1] == '/') {
+            auto slash = (const char*)memchr(path, '/', end - path);
+            auto segment_end = slash ? slash : end;
+            if (segment_end == path) {
+                return false;
+            }
+            path = segment_end;
+            while (*pattern && *pattern != '/') {
+                pattern++;
+            }
+            continue;
+        }
+        if (path == end || *pattern != *path) {
+            return false;
+        }
+        pattern++;
+        path++;
+    }
+    return !*pattern && path == end;
+}
+
+static const route* linear_match(const char* method, const char* path, uint32_t length)
+{
+    for (uint32_t i = 0; i < route_count; i++) {
+        if (!strcmp(routes[i].method, method) && linear_matches(routes[i].pattern, path, path + length)) {
+            return &routes[i];
+        }
+    }
+    return NULL;
+}
+
+///
+/// Runs
+///
+
+static int compare(const void* a, const void* b)
+{
+    auto x = *(const double*)a;
+    auto y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+static void report(const char* name, double* batches, uint32_t count, uint32_t found)
+{
+    double total = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        total += batches[i];
+    }
+    qsort(batches, count, sizeof(double), compare);
+    printf("%-6s %u routes: mean %7.1f ns p50 %7.1f ns p99 %7.1f ns per lookup (%u found)\n", name, route_count, total / count,
+        batches[count / 2], batches[count * 99 / 100], found);
+}
+
+static void run(bool radix, kyros_http_router* router, uint32_t lookups)
+{
+    auto batch_count = lookups / BATCH;
+    auto batches = (double*)malloc(sizeof(double) * batch_count);
+    uint32_t found = 0;
+    kyros_http_header params[16];
+    for (uint32_t b = 0; b < batch_count; b++) {
+        auto start = uv_hrtime();
+        for (uint32_t i = 0; i < BATCH; i++) {
+            auto index = (b * BATCH + i) % path_count;
+            auto path = paths[index];
+            auto length = (uint32_t)strlen(path);
+            if (radix) {
+                uint32_t param_count;
+                void* ctx;
+                found += kyros_http_router_match(router, methods[index], (uint32_t)strlen(methods[index]), path, length, params, &param_count, &ctx) != NULL;
+            } else {
+                found += linear_match(methods[index], path, length) != NULL;
+            }
+        }
+        batches[b] = (double)(uv_hrtime() - start) / BATCH;
+    }
+    report(radix ? "radix" : "linear", batches, batch_count, found);
+    free(batches);
+}
+
+int main(int argc, char** argv)
+{
+    kyros_init();
+    srand(1);
+    auto requested = argc > 1 && atoi(argv[1]) > 0 ? (uint32_t)atoi(argv[1]) : DEFAULT_ROUTES;
+    auto lookups = argc > 2 && atoi(argv[2]) > 0 ? (uint32_t)atoi(argv[2]) : DEFAULT_LOOKUPS;
+    auto resources = (requested + FORMS * 2 - 1) / (FORMS * 2);
+    route_count = resources * FORMS * 2;
+    routes = calloc(route_count, sizeof(route));
+    auto router = kyros_http_router_create();
+    for (uint32_t i = 0; i < route_count; i++) {
+        snprintf(routes[i].pattern, sizeof(routes[i].pattern), forms[i / 2 % FORMS], i / (FORMS * 2));
+        routes[i].method = i & 1 ? "POST" : "GET";
+        if (!kyros_http_router_add(router, routes[i].method, routes[i].pattern, handler, &routes[i])) {
+            printf("could not add %s %s\n", routes[i].method, routes[i].pattern);
+            return 1;
+        }
+    }
+    kyros_http_router_compile(router);
+    // requests hit the routes uniformly, the paths stay in cache like a receive buffer would
+    path_count = 4096;
+    paths = malloc(sizeof(*paths) * path_count);
+    methods = malloc(sizeof(const char*) * path_count);
+    for (uint32_t i = 0; i < path_count; i++) {
+        auto target = &routes[(uint32_t)rand() % route_count];
+        fill_path(paths[i], sizeof(paths[i]), target->pattern);
+        methods[i] = target->method;
+    }
+    run(true, router, lookups);
+    run(false, router, lookups / 20);
+    kyros_http_router_destroy(router);
+    free(paths);
+    free(methods);
+    free(routes);
+    return 0;
+}
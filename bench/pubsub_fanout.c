@@ -0,0 +1,255 @@
+// fan-out of one message to many websockets: every subscriber gets its copy written with kyros_websocket_send
+// (framed and compressed once per subscriber) or the message is published once with kyros_pubsub_publish
+// (framed and compressed once, queued by reference), without compression and with the shared streams
+// the clients run in another process (this binary with "client" as first argument), the cpu is the one the
+// server thread spends in the send loop or the publish per message delivered (the server auto corks, so a batch is one
+// write per socket either way)
+// usage: pubsub_fanout [subscribers] [messages]
+#include <kyros.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#define DEFAULT_SUBSCRIBERS 1000
+#define DEFAULT_MESSAGES 2000
+#define MESSAGE_SIZE 512
+#define BATCH 16
+#define SERVER_PORT 39351
+
+extern char** environ;
+
+typedef enum {
+    MODE_SEND = 0,
+    MODE_PUBLISH = 1,
+} fanout_mode;
+
+static const char* mode_names[] = { "send", "publish" };
+static const char* compression_names[] = { "none", "shared" };
+static char message[MESSAGE_SIZE];
+static uint32_t subscribers;
+static uint32_t messages;
+
+// price updates, the field names repeat and the values do not
+static void create_message()
+{
+    srand(1);
+    uint32_t length = (uint32_t)snprintf(message, MESSAGE_SIZE, "{\"type\":\"update\",\"ticks\":[");
+    while (length < MESSAGE_SIZE - 100) {
+        length += (uint32_t)snprintf(message + length, MESSAGE_SIZE - length, "{\"symbol\":\"SYM%03d\",\"bid\":%d.%02d,\"ask\":%d.%02d},",
+            rand() % 500, rand() % 1000, rand() % 100, rand() % 1000, rand() % 100);
+    }
+    memcpy(message + length - 1, "]}", 2);
+    memset(message + length + 1, ' ', MESSAGE_SIZE - length - 1);
+}
+
+static void raise_fd_limit()
+{
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+}
+
+///
+/// Clients (child process)
+///
+
+static uint32_t clients_done;
+static uint32_t clients_closed;
+
+static void client_onopen(kyros_websocket* websocket, void* ctx)
+{
+    kyros_websocket_send(websocket, "subscribe", 9, KYROS_WEBSOCKET_TEXT);
+}
+
+static void client_onmessage(kyros_websocket* websocket, const char* data, uint64_t length, kyros_websocket_opcode opcode, void* ctx)
+{
+    auto received = (uintptr_t*)ctx;
+    if (++*received == messages) {
+        clients_done++;
+        kyros_websocket_close(websocket, 1000, NULL, 0);
+    }
+}
+
+static void client_onclose(kyros_websocket* websocket, uint16_t code, const char* reason, uint32_t reason_length, void* ctx)
+{
+    if (++clients_closed == subscribers) {
+        kyros_loop_stop(kyros_socket_get_loop(kyros_websocket_get_socket(websocket)));
+    }
+}
+
+static int run_clients()
+{
+    auto loop = kyros_loop_create(NULL);
+    auto received = (uintptr_t*)calloc(subscribers, sizeof(uintptr_t));
+    kyros_socket_source server = { .type = KYROS_SOCKET_SOURCE_HOSTPORT, .value.host_port = { .host = "127.0.0.1", .port = SERVER_PORT } };
+    for (uint32_t i = 0; i < subscribers; i++) {
+        kyros_websocket_connect(loop, server, (kryos_socket_options) { .no_delay = true }, NULL, NULL,
+            (kyros_websocket_options) { .onopen = client_onopen, .onmessage = client_onmessage, .onclose = client_onclose,
+                .ctx = &received[i], .compression = KYROS_WEBSOCKET_COMPRESSION_SHARED });
+    }
+    kyros_loop_run_forever(loop);
+    if (clients_done != subscribers) {
+        printf("only %u of %u clients got every message\n", clients_done, subscribers);
+    }
+    free(received);
+    return 0;
+}
+
+///
+/// Server
+///
+
+static kyros_loop* loop;
+static kyros_pubsub* pubsub;
+static fanout_mode mode;
+static kyros_websocket_compression compression;
+static kyros_websocket** websockets;
+static uint32_t subscribed;
+static uint32_t closed;
+static uint32_t published;
+static double cpu;
+static double wall_start;
+
+static double thread_cpu_time()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
+    return (double)time.tv_sec + (double)time.tv_nsec / 1e9;
+}
+
+static double wall_time()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (double)time.tv_sec + (double)time.tv_nsec / 1e9;
+}
+
+// a few messages per loop iteration, so the sockets get to flush in between
+static void publish_batch(void* ctx)
+{
+    auto start = thread_cpu_time();
+    for (uint32_t i = 0; i < BATCH && published < messages; i++, published++) {
+        if (mode == MODE_PUBLISH) {
+            kyros_pubsub_publish(pubsub, loop, "prices/SYM", 10, message, MESSAGE_SIZE, KYROS_WEBSOCKET_TEXT);
+            continue;
+        }
+        for (uint32_t j = 0; j < subscribers; j++) {
+            if (websockets[j]) {
+                kyros_websocket_send(websockets[j], message, MESSAGE_SIZE, KYROS_WEBSOCKET_TEXT);
+            }
+        }
+    }
+    cpu += thread_cpu_time() - start;
+    if (published < messages) {
+        kyros_loop_defer(loop, publish_batch, NULL);
+    }
+}
+
+static void server_onmessage(kyros_websocket* websocket, const char* data, uint64_t length, kyros_websocket_opcode opcode, void* ctx)
+{
+    if (mode == MODE_PUBLISH) {
+        kyros_pubsub_subscribe(pubsub, websocket, "prices/+", 8);
+    }
+    websockets[subscribed] = websocket;
+    *(uint32_t*)ctx = subscribed;
+    if (++subscribed == subscribers) {
+        wall_start = wall_time();
+        publish_batch(NULL);
+    }
+}
+
+static void server_onclose(kyros_websocket* websocket, uint16_t code, const char* reason, uint32_t reason_length, void* ctx)
+{
+    websockets[*(uint32_t*)ctx] = NULL;
+    free(ctx);
+    if (++closed == subscribers) {
+        kyros_loop_stop(loop);
+    }
+}
+
+static void onrequest(kyros_http_request* request, kyros_http_response* response, void* ctx)
+{
+    uint32_t key_length;
+    uint32_t extensions_length = 0;
+    auto key = kyros_websocket_get_key(request, &key_length);
+    auto extensions = kyros_http_request_get_header(request, "sec-websocket-extensions", 24, &extensions_length);
+    kyros_websocket_upgrade(response, key, key_length, extensions, extensions_length,
+        (kyros_websocket_options) { .onmessage = server_onmessage, .onclose = server_onclose,
+            .ctx = calloc(1, sizeof(uint32_t)), .compression = compression });
+}
+
+static pid_t spawn(const char* self, const char* role, uint32_t role_mode)
+{
+    char mode_argument[16];
+    char subscribers_argument[16];
+    char messages_argument[16];
+    snprintf(mode_argument, sizeof(mode_argument), "%u", role_mode);
+    snprintf(subscribers_argument, sizeof(subscribers_argument), "%u", subscribers);
+    snprintf(messages_argument, sizeof(messages_argument), "%u", messages);
+    char* arguments[] = { (char*)self, (char*)role, mode_argument, subscribers_argument, messages_argument, NULL };
+    pid_t child;
+    if (posix_spawn(&child, self, NULL, NULL, arguments, environ)) {
+        printf("could not start %s\n", self);
+        exit(1);
+    }
+    return child;
+}
+
+static int run_server(const char* self)
+{
+    loop = kyros_loop_create(NULL);
+    pubsub = kyros_pubsub_create();
+    websockets = calloc(subscribers, sizeof(kyros_websocket*));
+    kyros_socket_source source = { .type = KYROS_SOCKET_SOURCE_HOSTPORT, .value.host_port = { .host = "127.0.0.1", .port = SERVER_PORT } };
+    // a batch reaches every socket with one syscall
+    kryos_socket_options options = { .no_delay = true, .cork_behavior = KYROS_SOCKET_AUTO_CORK };
+    auto server = kyros_http_server_listen(loop, source, options, (kyros_http_server_options) { .onrequest = onrequest });
+    if (!server) {
+        printf("could not listen on %u\n", SERVER_PORT);
+        exit(1);
+    }
+    auto child = spawn(self, "client", 0);
+    kyros_loop_run_forever(loop);
+    auto wall = wall_time() - wall_start;
+    waitpid(child, NULL, 0);
+    kyros_http_server_close(server);
+    kyros_loop_run_once(loop);
+    kyros_pubsub_destroy(pubsub);
+    auto deliveries = (double)subscribers * messages;
+    printf("%-7s %-6s %u subscribers: %10.0f deliveries/s, server cpu %6.3f s (%6.1f ns per delivery)\n", mode_names[mode],
+        compression_names[compression], subscribers, deliveries / wall, cpu, cpu * 1e9 / deliveries);
+    free(websockets);
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    kyros_init();
+    raise_fd_limit();
+    create_message();
+    // children get the role, the mode and then the same arguments
+    auto role = argc > 2 && (!strcmp(argv[1], "client") || !strcmp(argv[1], "server")) ? argv[1] : NULL;
+    auto arguments = role ? argv + 2 : argv;
+    auto count = role ? argc - 2 : argc;
+    subscribers = count > 1 && atoi(arguments[1]) > 0 ? (uint32_t)atoi(arguments[1]) : DEFAULT_SUBSCRIBERS;
+    messages = count > 2 && atoi(arguments[2]) > 0 ? (uint32_t)atoi(arguments[2]) : DEFAULT_MESSAGES;
+    if (role && !strcmp(role, "client")) {
+        return run_clients();
+    }
+    if (role) {
+        // mode and compression packed in one argument
+        auto packed = (uint32_t)atoi(argv[2]);
+        mode = (fanout_mode)(packed & 1);
+        compression = (kyros_websocket_compression)(packed >> 1);
+        return run_server(argv[0]);
+    }
+    for (uint32_t i = 0; i < 4; i++) {
+        waitpid(spawn(argv[0], "server", i), NULL, 0);
+    }
+    return 0;
+}
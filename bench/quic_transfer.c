@@ -0,0 +1,154 @@
+// bulk transfer over one QUIC connection on loopback: the client writes MEGABYTES on a single stream and the
+// server counts what arrives, client and server share a loop so the cpu is the whole cost of both ends
+// (packet protection, acks, loss recovery and congestion control included)
+// usage: quic_transfer [megabytes] [nopace]
+#include <kyros.h>
+#include <openssl/ec.h>
+#include <openssl/evp.h>
+#include <openssl/obj_mac.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <uv.h>
+
+#define DEFAULT_MEGABYTES 256
+#define CHUNK_SIZE 65536
+#define SERVER_PORT 39391
+
+static kyros_loop* loop;
+static kyros_quic_listener* listener;
+static char chunk[CHUNK_SIZE];
+static uint64_t total;
+static uint64_t written;
+static uint64_t received;
+static uint64_t stream_id;
+static uint64_t start;
+static uint64_t elapsed;
+static kyros_quic_stats stats;
+
+static double cpu_time()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &time);
+    return (double)time.tv_sec + (double)time.tv_nsec / 1e9;
+}
+
+static EVP_PKEY* create_key()
+{
+    auto ec_key = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
+    EC_KEY_generate_key(ec_key);
+    auto key = EVP_PKEY_new();
+    EVP_PKEY_assign_EC_KEY(key, ec_key);
+    return key;
+}
+
+static X509* create_certificate(EVP_PKEY* key)
+{
+    auto certificate = X509_new();
+    X509_set_version(certificate, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(certificate), 1);
+    X509_gmtime_adj(X509_getm_notBefore(certificate), 0);
+    X509_gmtime_adj(X509_getm_notAfter(certificate), 3600);
+    X509_set_pubkey(certificate, key);
+    auto name = X509_get_subject_name(certificate);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char*)"localhost", -1, -1, 0);
+    X509_set_issuer_name(certificate, name);
+    X509_sign(certificate, key, EVP_sha256());
+    return certificate;
+}
+
+///
+/// Server
+///
+
+static void server_onstream(kyros_quic_connection* connection, uint64_t id, const char* data, uint64_t length, bool fin, void* ctx)
+{
+    received += length;
+    if (fin) {
+        elapsed = uv_hrtime() - start;
+        kyros_quic_stream_write(connection, id, NULL, 0, true);
+    }
+}
+
+///
+/// Client
+///
+
+// writes until the stream buffers are full, ondrain asks for more
+static void client_pump(kyros_quic_connection* connection)
+{
+    while (written < total) {
+        auto length = total - written < CHUNK_SIZE ? total - written : CHUNK_SIZE;
+        written += length;
+        if (!kyros_quic_stream_write(connection, stream_id, chunk, length, written == total)) {
+            break;
+        }
+    }
+}
+
+static void client_onopen(kyros_quic_connection* connection, void* ctx)
+{
+    stream_id = kyros_quic_open_stream(connection, true);
+    start = uv_hrtime();
+    client_pump(connection);
+}
+
+static void client_ondrain(kyros_quic_connection* connection, uint64_t id, void* ctx)
+{
+    client_pump(connection);
+}
+
+static void client_onstream(kyros_quic_connection* connection, uint64_t id, const char* data, uint64_t length, bool fin, void* ctx)
+{
+    if (fin) {
+        stats = kyros_quic_get_stats(connection);
+        kyros_quic_close(connection, 0, NULL, 0);
+        kyros_quic_listener_close(listener);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    kyros_init();
+    total = (uint64_t)(argc > 1 && atoi(argv[1]) > 0 ? atoi(argv[1]) : DEFAULT_MEGABYTES) << 20;
+    auto disable_pacing = argc > 2 && !strcmp(argv[2], "nopace");
+    memset(chunk, 'x', CHUNK_SIZE);
+    loop = kyros_loop_create(NULL);
+
+    auto key = create_key();
+    auto certificate = create_certificate(key);
+    auto server_ctx = SSL_CTX_new(TLS_method());
+    SSL_CTX_use_certificate(server_ctx, certificate);
+    SSL_CTX_use_PrivateKey(server_ctx, key);
+    auto client_ctx = SSL_CTX_new(TLS_method());
+
+    kyros_quic_options options = { .alpn = "bench", .disable_pacing = disable_pacing };
+    kyros_socket_source source = { .type = KYROS_SOCKET_SOURCE_HOSTPORT, .value.host_port = { .host = "127.0.0.1", .port = SERVER_PORT } };
+    listener = kyros_quic_listen(loop, source, server_ctx, options, (kyros_quic_handler) { .onstream = server_onstream });
+    if (!listener) {
+        printf("could not listen on %u (QUIC needs BoringSSL)\n", SERVER_PORT);
+        return 1;
+    }
+    auto cpu = cpu_time();
+    kyros_quic_connect(loop, source, client_ctx, "localhost", options,
+        (kyros_quic_handler) { .onopen = client_onopen, .ondrain = client_ondrain, .onstream = client_onstream });
+    kyros_loop_run_forever(loop);
+    cpu = cpu_time() - cpu;
+
+    if (received != total) {
+        printf("transfer failed, %llu of %llu bytes arrived\n", (unsigned long long)received, (unsigned long long)total);
+        return 1;
+    }
+    printf("%s, %llu MiB: %8.1f MiB/s, cpu %6.3f s (%5.2f ns per byte), %llu packets sent, %llu lost, srtt %llu us\n",
+        disable_pacing ? "unpaced" : "paced", (unsigned long long)(total >> 20), (double)total / (1 << 20) * 1e9 / (double)elapsed, cpu,
+        cpu * 1e9 / (double)total, (unsigned long long)stats.packets_sent, (unsigned long long)stats.packets_lost,
+        (unsigned long long)stats.smoothed_rtt);
+    SSL_CTX_free(client_ctx);
+    SSL_CTX_free(server_ctx);
+    X509_free(certificate);
+    EVP_PKEY_free(key);
+    return 0;
+}
@@ -0,0 +1,163 @@
+// echo server scaling with kyros_server_group, from 1 pinned loop up to one per cpu, 64 byte ping-pong
+// the clients run in this process too (one thread and loop per server loop), so on a single machine the
+// numbers are the scaling of the whole thing, use numa_nodes or a second machine to keep them apart
+// pass "hash" as the second argument to let SO_REUSEPORT hash instead of the cpu steering program
+#include <kyros.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <uv.h>
+
+#define DEFAULT_SECONDS 3
+#define CONNECTIONS_PER_THREAD 64
+#define MESSAGE_SIZE 64
+#define SERVER_PORT 39321
+
+static char message[MESSAGE_SIZE];
+static uint32_t seconds;
+static bool cpu_steering = true;
+
+///
+/// Server
+///
+
+static bool server_ondata(kyros_socket socket, const char* data, uint64_t length, void* ctx)
+{
+    kyros_socket_write(socket, data, length, false);
+    return true;
+}
+
+///
+/// Clients
+///
+
+typedef struct client_thread client_thread;
+
+// each connection has its own handler so ctx points to its state
+typedef struct {
+    kyros_socket_handler handler;
+    kyros_socket socket;
+    client_thread* thread;
+    uint64_t received;
+} client_connection;
+
+struct client_thread {
+    kyros_loop* loop;
+    uv_thread_t thread;
+    uint64_t round_trips;
+    bool done;
+    client_connection connections[CONNECTIONS_PER_THREAD];
+};
+
+static bool client_ondata(kyros_socket socket, const char* data, uint64_t length, void* ctx)
+{
+    client_connection* connection = ctx;
+    connection->received += length;
+    // the echo can come back in pieces, only a whole message ends a round trip
+    while (connection->received >= MESSAGE_SIZE) {
+        connection->received -= MESSAGE_SIZE;
+        connection->thread->round_trips++;
+        if (!connection->thread->done) {
+            kyros_socket_write(socket, message, MESSAGE_SIZE, false);
+        }
+    }
+    return true;
+}
+
+static void client_onstatus(kyros_socket socket, kyros_socket_error error, void* ctx)
+{
+    if (kyros_socket_get_state(socket) == KYROS_SOCKET_STATE_OPEN) {
+        kyros_socket_write(socket, message, MESSAGE_SIZE, false);
+    }
+}
+
+static void client_timeout(void* ctx)
+{
+    client_thread* thread = ctx;
+    thread->done = true;
+    kyros_loop_stop(thread->loop);
+}
+
+static void run_client(void* arg)
+{
+    client_thread* thread = arg;
+    kyros_socket_source server = { .type = KYROS_SOCKET_SOURCE_HOSTPORT, .value.host_port = { .host = "127.0.0.1", .port = SERVER_PORT } };
+    thread->round_trips = 0;
+    thread->done = false;
+    for (uint32_t i = 0; i < CONNECTIONS_PER_THREAD; i++) {
+        auto connection = &thread->connections[i];
+        *connection = (client_connection) {
+            .handler = { .ctx = connection, .ondata = client_ondata, .onstatus = client_onstatus, .ref_count = 1 },
+            .thread = thread,
+        };
+        connection->socket = kyros_socket_connect(thread->loop, server, (kryos_socket_options) { .no_delay = true }, &connection->handler);
+    }
+    auto timer = kyros_loop_timer(thread->loop, client_timeout, thread, (uint64_t)seconds * 1000, 0, false);
+    kyros_loop_run_forever(thread->loop);
+    kyros_timer_unref(timer);
+    for (uint32_t i = 0; i < CONNECTIONS_PER_THREAD; i++) {
+        kyros_socket_close(thread->connections[i].socket);
+    }
+    kyros_loop_run_once(thread->loop);
+}
+
+///
+/// Bench
+///
+
+static double bench(uint32_t loops, client_thread* clients)
+{
+    static kyros_socket_handler server_handler = { .ondata = server_ondata, .ref_count = 1 };
+    kyros_socket_source server = { .type = KYROS_SOCKET_SOURCE_HOSTPORT, .value.host_port = { .host = "127.0.0.1", .port = SERVER_PORT } };
+    auto group = kyros_server_group_create(server, (kryos_socket_options) { .no_delay = true }, &server_handler,
+        (kyros_server_group_options) { .loop_count = loops, .pin_threads = true, .cpu_steering = cpu_steering });
+    if (!kyros_server_group_start(group)) {
+        printf("could not listen on %u\n", SERVER_PORT);
+        exit(1);
+    }
+
+    auto start = uv_hrtime();
+    for (uint32_t i = 0; i < loops; i++) {
+        uv_thread_create(&clients[i].thread, run_client, &clients[i]);
+    }
+    uint64_t round_trips = 0;
+    for (uint32_t i = 0; i < loops; i++) {
+        uv_thread_join(&clients[i].thread);
+        round_trips += clients[i].round_trips;
+    }
+    auto elapsed = uv_hrtime() - start;
+    kyros_server_group_destroy(group);
+    return (double)round_trips * 1e9 / (double)elapsed;
+}
+
+int main(int argc, char** argv)
+{
+    kyros_init();
+    uint32_t cpus = uv_available_parallelism();
+    uint32_t max_loops = argc > 1 && atoi(argv[1]) > 0 ? (uint32_t)atoi(argv[1]) : cpus;
+    cpu_steering = !(argc > 2 && !strcmp(argv[2], "hash"));
+    seconds = argc > 3 ? (uint32_t)atoi(argv[3]) : DEFAULT_SECONDS;
+    memset(message, 'k', MESSAGE_SIZE);
+
+    auto clients = (client_thread*)calloc(max_loops, sizeof(client_thread));
+    for (uint32_t i = 0; i < max_loops; i++) {
+        clients[i].loop = kyros_loop_create(NULL);
+    }
+    printf("%u cpus, %u connections per loop, %s\n", cpus, CONNECTIONS_PER_THREAD, cpu_steering ? "cpu steering" : "reuseport hash");
+    double baseline = 0;
+    // 1, 2, 4... and max_loops
+    uint32_t loops = 1;
+    while (true) {
+        auto requests = bench(loops, clients);
+        if (loops == 1) {
+            baseline = requests;
+        }
+        printf("%3u loops %12.0f req/s %10.0f req/s per loop %6.2fx (%3.0f%% of linear)\n", loops, requests,
+            requests / loops, requests / baseline, requests / baseline / loops * 100);
+        if (loops == max_loops) {
+            break;
+        }
+        loops = loops * 2 < max_loops ? loops * 2 : max_loops;
+    }
+    return 0;
+}
@@ -0,0 +1,146 @@
+// echo round trips over many loopback connections, KYROS_LOOP_IO_POLL vs KYROS_LOOP_IO_URING
+// the server has its own loop and thread (the engine being measured), the clients share another
+// one that always polls, so the cpu time of the server thread is what the engine costs
+#include <kyros.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <uv.h>
+
+#define DEFAULT_CONNECTIONS 512
+#define DEFAULT_ROUNDS 2000
+#define MESSAGE_SIZE 64
+#define SERVER_PORT 39311
+
+static const char* engine_names[] = { "poll", "io_uring" };
+
+static kyros_loop* loop;
+static kyros_loop* client_loop;
+static char message[MESSAGE_SIZE];
+static uint32_t connections;
+static uint32_t rounds;
+static uint32_t finished;
+
+///
+/// Server
+///
+
+static bool server_ondata(kyros_socket socket, const char* data, uint64_t length, void* ctx)
+{
+    kyros_socket_write(socket, data, length, false);
+    return true;
+}
+
+///
+/// Clients
+///
+
+// each client has its own handler so ctx points to its state
+typedef struct {
+    kyros_socket_handler handler;
+    kyros_socket socket;
+    uint64_t received;
+    uint32_t rounds;
+} client;
+
+static client* clients;
+
+static void stop_task(void* ctx)
+{
+    kyros_loop_stop(ctx);
+}
+
+static bool client_ondata(kyros_socket socket, const char* data, uint64_t length, void* ctx)
+{
+    client* self = ctx;
+    self->received += length;
+    // the echo can come back in pieces, only a whole message ends a round
+    while (self->received >= MESSAGE_SIZE) {
+        self->received -= MESSAGE_SIZE;
+        if (++self->rounds == rounds) {
+            if (++finished == connections) {
+                kyros_loop_stop(client_loop);
+                kyros_loop_atomic_defer(loop, stop_task, loop);
+            }
+            return true;
+        }
+        kyros_socket_write(socket, message, MESSAGE_SIZE, false);
+    }
+    return true;
+}
+
+static void client_onstatus(kyros_socket socket, kyros_socket_error error, void* ctx)
+{
+    if (kyros_socket_get_state(socket) == KYROS_SOCKET_STATE_OPEN) {
+        kyros_socket_write(socket, message, MESSAGE_SIZE, false);
+    }
+}
+
+static void run_clients(void* arg)
+{
+    kyros_socket_source server = { .type = KYROS_SOCKET_SOURCE_HOSTPORT, .value.host_port = { .host = "127.0.0.1", .port = SERVER_PORT } };
+    for (uint32_t i = 0; i < connections; i++) {
+        clients[i] = (client) { .handler = { .ctx = &clients[i], .ondata = client_ondata, .onstatus = client_onstatus, .ref_count = 1 } };
+        clients[i].socket = kyros_socket_connect(client_loop, server, (kryos_socket_options) { 0 }, &clients[i].handler);
+    }
+    kyros_loop_run_forever(client_loop);
+    for (uint32_t i = 0; i < connections; i++) {
+        kyros_socket_close(clients[i].socket);
+    }
+    // let the closes run before the next engine listens again
+    kyros_loop_run_once(client_loop);
+}
+
+static double thread_cpu_time()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
+    return (double)time.tv_sec + (double)time.tv_nsec / 1e9;
+}
+
+static void bench(kyros_loop_io_engine engine)
+{
+    loop = kyros_loop_create_with_options(NULL, (kyros_loop_options) { .io_engine = engine });
+    if (kyros_loop_get_io_engine(loop) != engine) {
+        printf("%-9s not available\n", engine_names[engine]);
+        return;
+    }
+    finished = 0;
+    static kyros_socket_handler server_handler = { .ondata = server_ondata, .ref_count = 1 };
+    kyros_socket_source server = { .type = KYROS_SOCKET_SOURCE_HOSTPORT, .value.host_port = { .host = "127.0.0.1", .port = SERVER_PORT } };
+    auto listener = kyros_socket_listen(loop, server, (kryos_socket_options) { 0 }, &server_handler);
+    if (!listener.tagged_ptr) {
+        printf("could not listen on %u\n", SERVER_PORT);
+        exit(1);
+    }
+
+    auto start = uv_hrtime();
+    auto cpu_start = thread_cpu_time();
+    uv_thread_t thread;
+    uv_thread_create(&thread, run_clients, NULL);
+    kyros_loop_run_forever(loop);
+    auto cpu = thread_cpu_time() - cpu_start;
+    uv_thread_join(&thread);
+    auto elapsed = uv_hrtime() - start;
+    auto total = (double)connections * (double)rounds;
+    auto stats = kyros_loop_get_stats(loop);
+    printf("%-9s %10.0f req/s %6.2f s server cpu %6.2f s (%5.2f us/req) submits %llu completions %llu\n", engine_names[engine],
+        total * 1e9 / (double)elapsed, (double)elapsed / 1e9, cpu, cpu * 1e6 / total,
+        (unsigned long long)stats.uring_submits, (unsigned long long)stats.uring_completions);
+    kyros_socket_close(listener);
+    kyros_loop_run_once(loop);
+}
+
+int main(int argc, char** argv)
+{
+    kyros_init();
+    connections = argc > 1 ? (uint32_t)atoi(argv[1]) : DEFAULT_CONNECTIONS;
+    rounds = argc > 2 ? (uint32_t)atoi(argv[2]) : DEFAULT_ROUNDS;
+    memset(message, 'k', MESSAGE_SIZE);
+    clients = calloc(connections, sizeof(client));
+    client_loop = kyros_loop_create(NULL);
+    bench(KYROS_LOOP_IO_POLL);
+    bench(KYROS_LOOP_IO_URING);
+    return 0;
+}
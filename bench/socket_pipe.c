@@ -0,0 +1,192 @@
+// l4 proxy throughput over loopback, client -> proxy -> sink
+// kyros_socket_pipe (spliced through a kernel pipe) vs copying in ondata with kyros_socket_write
+// the proxy has its own loop and thread, client and sink share another one, so the cpu time of the
+// proxy thread is what the proxy costs
+#include <kyros.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <uv.h>
+
+#define DEFAULT_GIGABYTES 10
+#define WRITE_SIZE 65536
+#define PROXY_PORT 39301
+#define SINK_PORT 39302
+
+typedef enum {
+    MODE_SPLICE = 0,
+    MODE_COPY = 1,
+} bench_mode;
+
+static const char* mode_names[] = { "kyros_socket_pipe", "ondata + write" };
+
+static kyros_loop* loop;
+static kyros_loop* peer_loop;
+static bench_mode mode;
+static char payload[WRITE_SIZE];
+static uint64_t total;
+static uint64_t sent;
+static uint64_t received;
+
+///
+/// Client
+///
+
+static void client_fill(kyros_socket socket)
+{
+    while (sent < total) {
+        uint64_t length = total - sent < WRITE_SIZE ? total - sent : WRITE_SIZE;
+        sent += length;
+        if (!kyros_socket_write(socket, payload, length, sent == total)) {
+            return;
+        }
+    }
+}
+
+static void client_ondrain(kyros_socket socket, void* ctx)
+{
+    client_fill(socket);
+}
+
+static void client_onstatus(kyros_socket socket, kyros_socket_error error, void* ctx)
+{
+    if (kyros_socket_get_state(socket) == KYROS_SOCKET_STATE_OPEN) {
+        client_fill(socket);
+    }
+}
+
+///
+/// Proxy
+///
+
+// one proxied connection per run
+typedef struct {
+    kyros_socket downstream;
+    kyros_socket upstream;
+} proxy_pair;
+
+static proxy_pair pair;
+
+static void upstream_ondrain(kyros_socket socket, void* ctx)
+{
+    kyros_socket_resume(pair.downstream);
+}
+
+static bool proxy_ondata(kyros_socket socket, const char* data, uint64_t length, void* ctx)
+{
+    // only called in copy mode, piped sockets don't get ondata
+    if (!kyros_socket_write(pair.upstream, data, length, false)) {
+        kyros_socket_pause(socket);
+    }
+    return true;
+}
+
+static void proxy_onstatus(kyros_socket socket, kyros_socket_error error, void* ctx)
+{
+    static kyros_socket_handler upstream_handler = { .ondrain = upstream_ondrain, .ref_count = 1 };
+    kyros_socket_source sink = { .type = KYROS_SOCKET_SOURCE_HOSTPORT, .value.host_port = { .host = "127.0.0.1", .port = SINK_PORT } };
+    auto state = kyros_socket_get_state(socket);
+    if (state == KYROS_SOCKET_STATE_OPEN) {
+        pair.downstream = socket;
+        pair.upstream = kyros_socket_connect(loop, sink, (kryos_socket_options) { .allow_half_open = true }, &upstream_handler);
+        if (mode == MODE_SPLICE) {
+            kyros_socket_pipe(socket, pair.upstream, true);
+        }
+    } else if (mode == MODE_COPY && (state == KYROS_SOCKET_STATE_READABLE_ENDED || state == KYROS_SOCKET_STATE_CLOSED)) {
+        kyros_socket_write(pair.upstream, NULL, 0, true);
+    }
+}
+
+///
+/// Sink
+///
+
+static bool sink_ondata(kyros_socket socket, const char* data, uint64_t length, void* ctx)
+{
+    received += length;
+    return true;
+}
+
+static void stop_task(void* ctx)
+{
+    kyros_loop_stop(ctx);
+}
+
+static void sink_onstatus(kyros_socket socket, kyros_socket_error error, void* ctx)
+{
+    auto state = kyros_socket_get_state(socket);
+    if (state == KYROS_SOCKET_STATE_READABLE_ENDED || state == KYROS_SOCKET_STATE_CLOSED) {
+        kyros_loop_stop(peer_loop);
+        kyros_loop_atomic_defer(loop, stop_task, loop);
+    }
+}
+
+static void peers(void* arg)
+{
+    static kyros_socket_handler sink_handler = { .ondata = sink_ondata, .onstatus = sink_onstatus, .ref_count = 1 };
+    static kyros_socket_handler client_handler = { .ondrain = client_ondrain, .onstatus = client_onstatus, .ref_count = 1 };
+    kyros_socket_source sink = { .type = KYROS_SOCKET_SOURCE_HOSTPORT, .value.host_port = { .host = "127.0.0.1", .port = SINK_PORT } };
+    kyros_socket_source proxy = { .type = KYROS_SOCKET_SOURCE_HOSTPORT, .value.host_port = { .host = "127.0.0.1", .port = PROXY_PORT } };
+    auto sink_listener = kyros_socket_listen(peer_loop, sink, (kryos_socket_options) { .allow_half_open = true }, &sink_handler);
+    if (!sink_listener.tagged_ptr) {
+        printf("could not listen on %u\n", SINK_PORT);
+        exit(1);
+    }
+    auto client = kyros_socket_connect(peer_loop, proxy, (kryos_socket_options) { .allow_half_open = true }, &client_handler);
+    kyros_loop_run_forever(peer_loop);
+    kyros_socket_close(client);
+    kyros_socket_close(sink_listener);
+    // let the closes run before the next mode listens again
+    kyros_loop_run_once(peer_loop);
+}
+
+static double thread_cpu_time()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
+    return (double)time.tv_sec + (double)time.tv_nsec / 1e9;
+}
+
+static void bench(bench_mode bench_mode, uint64_t bytes)
+{
+    mode = bench_mode;
+    total = bytes;
+    sent = 0;
+    received = 0;
+    static kyros_socket_handler proxy_handler = { .ondata = proxy_ondata, .onstatus = proxy_onstatus, .ref_count = 1 };
+    kyros_socket_source proxy = { .type = KYROS_SOCKET_SOURCE_HOSTPORT, .value.host_port = { .host = "127.0.0.1", .port = PROXY_PORT } };
+    auto proxy_listener = kyros_socket_listen(loop, proxy, (kryos_socket_options) { .allow_half_open = true }, &proxy_handler);
+    if (!proxy_listener.tagged_ptr) {
+        printf("could not listen on %u\n", PROXY_PORT);
+        exit(1);
+    }
+
+    auto start = uv_hrtime();
+    auto cpu_start = thread_cpu_time();
+    uv_thread_t thread;
+    uv_thread_create(&thread, peers, NULL);
+    kyros_loop_run_forever(loop);
+    auto cpu = thread_cpu_time() - cpu_start;
+    uv_thread_join(&thread);
+    auto elapsed = uv_hrtime() - start;
+    printf("%-18s %6.2f GB/s %6.2f s proxy cpu %6.2f s (%5.3f s/GB) received %llu/%llu\n", mode_names[mode],
+        (double)received / (double)elapsed, (double)elapsed / 1e9, cpu, cpu * 1e9 / (double)received,
+        (unsigned long long)received, (unsigned long long)total);
+    kyros_socket_close(pair.downstream);
+    kyros_socket_close(pair.upstream);
+    kyros_socket_close(proxy_listener);
+    kyros_loop_run_once(loop);
+}
+
+int main(int argc, char** argv)
+{
+    kyros_init();
+    uint64_t gigabytes = argc > 1 ? (uint64_t)atoi(argv[1]) : DEFAULT_GIGABYTES;
+    memset(payload, 'k', WRITE_SIZE);
+    loop = kyros_loop_create(NULL);
+    peer_loop = kyros_loop_create(NULL);
+    bench(MODE_SPLICE, gigabytes * 1'000'000'000);
+    bench(MODE_COPY, gigabytes * 1'000'000'000);
+    return 0;
+}
@@ -0,0 +1,186 @@
+// requests per second over loopback, one request at a time: every request checks a connection out of a kyros_socket_pool
+// (an idle keep-alive connection after the first one) vs a new connection per request, plain tcp and tls
+// usage: socket_pool [requests] [port]
+#include <kyros.h>
+#include <openssl/ec.h>
+#include <openssl/evp.h>
+#include <openssl/obj_mac.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <uv.h>
+
+#define DEFAULT_REQUESTS 20'000
+#define DEFAULT_PORT 39800
+
+typedef struct {
+    kyros_loop* loop;
+    kyros_socket_pool* pool;
+    kyros_socket_source source;
+    SSL_CTX* tls;
+    kyros_socket_handler handler;
+    uint64_t remaining;
+    uint64_t failures;
+} bench_state;
+
+static void bench_next(bench_state* state);
+
+static EVP_PKEY* create_key()
+{
+    auto ec_key = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
+    EC_KEY_generate_key(ec_key);
+    auto key = EVP_PKEY_new();
+    EVP_PKEY_assign_EC_KEY(key, ec_key);
+    return key;
+}
+
+static X509* create_certificate(EVP_PKEY* key)
+{
+    auto certificate = X509_new();
+    X509_set_version(certificate, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(certificate), 1);
+    X509_gmtime_adj(X509_getm_notBefore(certificate), 0);
+    X509_gmtime_adj(X509_getm_notAfter(certificate), 3600);
+    X509_set_pubkey(certificate, key);
+    X509_sign(certificate, key, EVP_sha256());
+    return certificate;
+}
+
+// the server answers every read with a response
+static bool server_data(kyros_socket socket, const char* data, uint64_t length, void* ctx)
+{
+    kyros_socket_write(socket, "pong", 4, false);
+    return true;
+}
+
+static bool client_data(kyros_socket socket, const char* data, uint64_t length, void* ctx)
+{
+    bench_state* state = ctx;
+    if (state->pool) {
+        kyros_socket_pool_release(socket, true);
+    } else {
+        kyros_socket_close(socket);
+    }
+    bench_next(state);
+    return true;
+}
+
+static void client_status(kyros_socket socket, kyros_socket_error error, void* ctx)
+{
+    bench_state* state = ctx;
+    auto status = kyros_socket_get_state(socket);
+    if (state->pool) {
+        return;
+    }
+    // a new connection per request sends it once open (secure over tls)
+    if (status == KYROS_SOCKET_STATE_SECURE || (status == KYROS_SOCKET_STATE_OPEN && !state->tls)) {
+        kyros_socket_write(socket, "ping", 4, false);
+    } else if (status == KYROS_SOCKET_STATE_CLOSED && error.type != KYROS_SOCKET_ERROR_NO_ERROR) {
+        state->failures++;
+        bench_next(state);
+    }
+}
+
+static void checkout_callback(kyros_socket socket, kyros_socket_error error, void* ctx)
+{
+    bench_state* state = ctx;
+    if (error.type != KYROS_SOCKET_ERROR_NO_ERROR) {
+        state->failures++;
+        bench_next(state);
+        return;
+    }
+    kyros_socket_write(socket, "ping", 4, false);
+}
+
+static void bench_next(bench_state* state)
+{
+    if (!state->remaining) {
+        kyros_loop_stop(state->loop);
+        return;
+    }
+    state->remaining--;
+    if (state->pool) {
+        kyros_socket_pool_checkout(state->pool, state->source, state->tls, &state->handler, checkout_callback, state);
+        return;
+    }
+    kyros_socket_connect(state->loop, state->source, (kryos_socket_options) { .no_delay = true, .tls = state->tls }, &state->handler);
+}
+
+static void bench_start(void* ctx)
+{
+    bench_next(ctx);
+}
+
+static double run(kyros_loop* loop, uint16_t port, SSL_CTX* tls, bool pooled, uint64_t requests, kyros_socket_pool_stats* stats)
+{
+    bench_state state = {
+        .loop = loop,
+        .source = { .type = KYROS_SOCKET_SOURCE_HOSTPORT, .value.host_port = { .host = "127.0.0.1", .port = port } },
+        .tls = tls,
+        .remaining = requests,
+    };
+    state.handler = (kyros_socket_handler) { .ctx = &state, .ondata = client_data, .onstatus = client_status, .ref_count = 1 };
+    if (pooled) {
+        state.pool = kyros_socket_pool_create(loop, (kyros_socket_pool_options) { .socket_options = { .no_delay = true } });
+    }
+    auto start = uv_hrtime();
+    kyros_loop_defer(loop, bench_start, &state);
+    kyros_loop_run_forever(loop);
+    auto seconds = (double)(uv_hrtime() - start) / 1e9;
+    if (state.pool) {
+        *stats = kyros_socket_pool_get_stats(state.pool);
+        kyros_socket_pool_destroy(state.pool);
+    }
+    if (state.failures) {
+        printf("%llu failed requests\n", (unsigned long long)state.failures);
+    }
+    return (double)requests / seconds;
+}
+
+int main(int argc, char** argv)
+{
+    kyros_init();
+    uint64_t requests = argc > 1 && atoll(argv[1]) > 0 ? (uint64_t)atoll(argv[1]) : DEFAULT_REQUESTS;
+    uint16_t port = argc > 2 && atoi(argv[2]) > 0 ? (uint16_t)atoi(argv[2]) : DEFAULT_PORT;
+
+    auto key = create_key();
+    auto certificate = create_certificate(key);
+    auto server_tls = SSL_CTX_new(TLS_method());
+    SSL_CTX_use_certificate(server_tls, certificate);
+    SSL_CTX_use_PrivateKey(server_tls, key);
+    auto client_tls = SSL_CTX_new(TLS_method());
+
+    auto loop = kyros_loop_create(NULL);
+    kyros_socket_handler server_handler = { .ondata = server_data, .ref_count = 1 };
+    kyros_socket listeners[2];
+    for (uint32_t i = 0; i < 2; i++) {
+        kyros_socket_source source = { .type = KYROS_SOCKET_SOURCE_HOSTPORT, .value.host_port = { .host = "127.0.0.1", .port = (uint16_t)(port + i) } };
+        listeners[i] = kyros_socket_listen(loop, source, (kryos_socket_options) { .no_delay = true, .tls = i ? server_tls : NULL }, &server_handler);
+        if (!listeners[i].tagged_ptr) {
+            printf("could not listen on port %u\n", port + i);
+            return 1;
+        }
+    }
+
+    for (uint32_t i = 0; i < 2; i++) {
+        auto tls = i ? client_tls : NULL;
+        auto name = i ? "tls" : "tcp";
+        kyros_socket_pool_stats stats = { 0 };
+        // tls connects are slower, a tenth of the requests keeps the runs about as long
+        auto count = i ? requests / 10 : requests;
+        auto connect_rate = run(loop, (uint16_t)(port + i), tls, false, count, &stats);
+        printf("%s connect per request: %12.0f requests/s\n", name, connect_rate);
+        auto pool_rate = run(loop, (uint16_t)(port + i), tls, true, count, &stats);
+        printf("%s pooled:              %12.0f requests/s (%.1fx), connected %llu, reused %llu\n", name, pool_rate, pool_rate / connect_rate,
+            (unsigned long long)stats.connected, (unsigned long long)stats.reused);
+    }
+
+    for (uint32_t i = 0; i < 2; i++) {
+        kyros_socket_close(listeners[i]);
+    }
+    kyros_loop_run_once(loop);
+    SSL_CTX_free(client_tls);
+    SSL_CTX_free(server_tls);
+    return 0;
+}
@@ -0,0 +1,76 @@
+// re-arms 1M timers, kyros timer wheel (1ms and 4ms granularity) vs one uv_timer_t per timer
+// this is the socket inactivity timeout pattern: every read pushes the deadline forward
+#include <kyros.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <uv.h>
+
+#define DEFAULT_TIMERS 1'000'000
+#define DEFAULT_ROUNDS 10
+#define TIMEOUT 30'000
+
+static void noop_task(void* ctx) { }
+static void noop_uv_callback(uv_timer_t* timer) { }
+
+static void bench_wheel(uint32_t granularity, uint32_t count, uint32_t rounds)
+{
+    auto uv_loop = (uv_loop_t*)malloc(sizeof(uv_loop_t));
+    uv_loop_init(uv_loop);
+    auto loop = kyros_loop_create_with_options(uv_loop, (kyros_loop_options) { .timer_granularity = granularity });
+    auto timers = (kyros_timer**)malloc(sizeof(kyros_timer*) * count);
+    auto start = uv_hrtime();
+    for (uint32_t i = 0; i < count; i++) {
+        timers[i] = kyros_loop_timer(loop, noop_task, NULL, TIMEOUT, 0, false);
+    }
+    auto inserted = uv_hrtime();
+    for (uint32_t round = 0; round < rounds; round++) {
+        uv_update_time(uv_loop);
+        for (uint32_t i = 0; i < count; i++) {
+            kyros_timer_set_times(timers[i], TIMEOUT + (i & 1023), 0);
+        }
+    }
+    auto end = uv_hrtime();
+    printf("kyros wheel %ums: insert %6.1f ns/op re-arm %6.1f ns/op\n", granularity ? granularity : 1,
+        (double)(inserted - start) / count, (double)(end - inserted) / ((double)count * rounds));
+    for (uint32_t i = 0; i < count; i++) {
+        kyros_timer_unref(timers[i]);
+    }
+    free(timers);
+}
+
+static void bench_uv(uint32_t count, uint32_t rounds)
+{
+    uv_loop_t uv_loop;
+    uv_loop_init(&uv_loop);
+    auto timers = (uv_timer_t*)malloc(sizeof(uv_timer_t) * count);
+    auto start = uv_hrtime();
+    for (uint32_t i = 0; i < count; i++) {
+        uv_timer_init(&uv_loop, &timers[i]);
+        uv_timer_start(&timers[i], noop_uv_callback, TIMEOUT, 0);
+    }
+    auto inserted = uv_hrtime();
+    for (uint32_t round = 0; round < rounds; round++) {
+        uv_update_time(&uv_loop);
+        for (uint32_t i = 0; i < count; i++) {
+            uv_timer_start(&timers[i], noop_uv_callback, TIMEOUT + (i & 1023), 0);
+        }
+    }
+    auto end = uv_hrtime();
+    printf("uv_timer_t:      insert %6.1f ns/op re-arm %6.1f ns/op\n",
+        (double)(inserted - start) / count, (double)(end - inserted) / ((double)count * rounds));
+    for (uint32_t i = 0; i < count; i++) {
+        uv_timer_stop(&timers[i]);
+    }
+    free(timers);
+}
+
+int main(int argc, char** argv)
+{
+    kyros_init();
+    uint32_t count = argc > 1 ? (uint32_t)atoi(argv[1]) : DEFAULT_TIMERS;
+    uint32_t rounds = argc > 2 ? (uint32_t)atoi(argv[2]) : DEFAULT_ROUNDS;
+    bench_uv(count, rounds);
+    bench_wheel(0, count, rounds);
+    bench_wheel(4, count, rounds);
+    return 0;
+}
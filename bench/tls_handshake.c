@@ -0,0 +1,139 @@
+// handshakes per second, full vs resumed (TLS 1.3 tickets and TLS 1.2 session ids through
+// the sharded kyros_tls_session_cache), in memory with a BIO pair so only the TLS cost is measured
+#include <kyros.h>
+#include <openssl/bio.h>
+#include <openssl/ec.h>
+#include <openssl/evp.h>
+#include <openssl/obj_mac.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <uv.h>
+
+#define DEFAULT_HANDSHAKES 5'000
+
+typedef enum {
+    MODE_FULL = 0,
+    MODE_TICKET = 1,
+    MODE_SESSION_ID = 2,
+} bench_mode;
+
+static const char* mode_names[] = { "full (TLS 1.3)", "ticket (TLS 1.3)", "session id (TLS 1.2)" };
+
+static EVP_PKEY* create_key()
+{
+    auto ec_key = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
+    EC_KEY_generate_key(ec_key);
+    auto key = EVP_PKEY_new();
+    EVP_PKEY_assign_EC_KEY(key, ec_key);
+    return key;
+}
+
+static X509* create_certificate(EVP_PKEY* key)
+{
+    auto certificate = X509_new();
+    X509_set_version(certificate, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(certificate), 1);
+    X509_gmtime_adj(X509_getm_notBefore(certificate), 0);
+    X509_gmtime_adj(X509_getm_notAfter(certificate), 3600);
+    X509_set_pubkey(certificate, key);
+    auto name = X509_get_subject_name(certificate);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char*)"localhost", -1, -1, 0);
+    X509_set_issuer_name(certificate, name);
+    X509_sign(certificate, key, EVP_sha256());
+    return certificate;
+}
+
+/// @brief returns true if the session was resumed
+static bool handshake(SSL_CTX* server_ctx, SSL_CTX* client_ctx, SSL_SESSION** session)
+{
+    auto client = SSL_new(client_ctx);
+    auto server = SSL_new(server_ctx);
+    BIO* client_bio;
+    BIO* server_bio;
+    BIO_new_bio_pair(&client_bio, 0, &server_bio, 0);
+    SSL_set_bio(client, client_bio, client_bio);
+    SSL_set_bio(server, server_bio, server_bio);
+    SSL_set_connect_state(client);
+    SSL_set_accept_state(server);
+    if (*session) {
+        SSL_set_session(client, *session);
+    }
+    for (uint32_t i = 0; i < 32; i++) {
+        auto client_done = SSL_do_handshake(client) == 1;
+        auto server_done = SSL_do_handshake(server) == 1;
+        if (client_done && server_done) {
+            break;
+        }
+    }
+    // TLS 1.3 tickets arrive after the handshake
+    char byte;
+    SSL_read(client, &byte, 1);
+    auto resumed = SSL_session_reused(client);
+    // TLS 1.3 tickets are single use, always keep the newest session
+    if (*session) {
+        SSL_SESSION_free(*session);
+    }
+    *session = SSL_get1_session(client);
+    // freeing without a shutdown marks the session as bad and drops it from the caches
+    SSL_set_shutdown(client, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+    SSL_set_shutdown(server, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+    SSL_free(client);
+    SSL_free(server);
+    return resumed;
+}
+
+static void bench(bench_mode mode, EVP_PKEY* key, X509* certificate, uint32_t count)
+{
+    auto cache = kyros_tls_session_cache_create((kyros_tls_session_cache_options) { 0 });
+    auto server_ctx = SSL_CTX_new(TLS_method());
+    SSL_CTX_use_certificate(server_ctx, certificate);
+    SSL_CTX_use_PrivateKey(server_ctx, key);
+    SSL_CTX_set_session_id_context(server_ctx, (const unsigned char*)"bench", 5);
+    kyros_tls_session_cache_attach_server(cache, server_ctx, NULL);
+    auto client_ctx = SSL_CTX_new(TLS_method());
+    SSL_CTX_set_session_cache_mode(client_ctx, SSL_SESS_CACHE_CLIENT);
+    if (mode == MODE_SESSION_ID) {
+        SSL_CTX_set_max_proto_version(server_ctx, TLS1_2_VERSION);
+        SSL_CTX_set_options(server_ctx, SSL_OP_NO_TICKET);
+    }
+
+    SSL_SESSION* session = NULL;
+    // warm up, also gets the first session
+    handshake(server_ctx, client_ctx, &session);
+    uint32_t resumed = 0;
+    auto start = uv_hrtime();
+    for (uint32_t i = 0; i < count; i++) {
+        SSL_SESSION* none = NULL;
+        resumed += handshake(server_ctx, client_ctx, mode == MODE_FULL ? &none : &session);
+        if (none) {
+            SSL_SESSION_free(none);
+        }
+    }
+    auto elapsed = uv_hrtime() - start;
+    auto stats = kyros_tls_session_cache_get_stats(cache);
+    printf("%-22s %8.0f handshakes/s resumed %u/%u cache hits %llu misses %llu\n", mode_names[mode],
+        (double)count * 1e9 / (double)elapsed, resumed, count,
+        (unsigned long long)stats.hits, (unsigned long long)stats.misses);
+    if (session) {
+        SSL_SESSION_free(session);
+    }
+    SSL_CTX_free(client_ctx);
+    SSL_CTX_free(server_ctx);
+    kyros_tls_session_cache_destroy(cache);
+}
+
+int main(int argc, char** argv)
+{
+    kyros_init();
+    uint32_t count = argc > 1 ? (uint32_t)atoi(argv[1]) : DEFAULT_HANDSHAKES;
+    auto key = create_key();
+    auto certificate = create_certificate(key);
+    bench(MODE_FULL, key, certificate, count);
+    bench(MODE_TICKET, key, certificate, count);
+    bench(MODE_SESSION_ID, key, certificate, count);
+    X509_free(certificate);
+    EVP_PKEY_free(key);
+    return 0;
+}
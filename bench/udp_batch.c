@@ -0,0 +1,156 @@
+// datagrams of 1200 bytes (a QUIC packet) over loopback, BATCH written per loop iteration from one socket to another:
+// kyros udp sockets (one sendmmsg per iteration with the datagrams coalesced by UDP GSO, recvmmsg with UDP GRO) vs
+// libuv uv_udp_t (uv_udp_try_send and a recvmsg per datagram), the cpu is the one of the process per datagram received
+// usage: udp_batch [datagrams]
+#include <kyros.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <uv.h>
+
+#define DEFAULT_DATAGRAMS 1'000'000
+#define DATAGRAM_SIZE 1200
+#define BATCH 32
+#define SERVER_PORT 39381
+#define IDLE_TIMEOUT 1000
+
+static kyros_loop* loop;
+static char datagram[DATAGRAM_SIZE];
+static uint32_t datagrams;
+static uint32_t sent;
+static uint32_t received;
+static uint64_t last_receive;
+
+static double cpu_time()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &time);
+    return (double)time.tv_sec + (double)time.tv_nsec / 1e9;
+}
+
+static void on_received(uint32_t count)
+{
+    received += count;
+    last_receive = uv_now((uv_loop_t*)loop);
+    if (received == datagrams) {
+        kyros_loop_stop(loop);
+    }
+}
+
+// loopback drops what the receiver could not keep up with, stop once nothing arrives for a while
+static void check_idle(void* ctx)
+{
+    if (sent == datagrams && uv_now((uv_loop_t*)loop) - last_receive >= IDLE_TIMEOUT) {
+        kyros_loop_stop(loop);
+    }
+}
+
+static void report(const char* name, double wall, double cpu)
+{
+    printf("%-6s %u datagrams: %10.0f datagrams/s received, cpu %6.3f s (%6.1f ns per datagram), %u lost\n", name, sent,
+        received / wall, cpu, cpu * 1e9 / received, sent - received);
+}
+
+///
+/// kyros
+///
+
+static kyros_socket sender;
+
+static void kyros_ondatagrams(kyros_socket socket, const kyros_udp_datagram* batch, uint32_t count, void* ctx)
+{
+    on_received(count);
+}
+
+static void kyros_send_batch(void* ctx)
+{
+    for (uint32_t i = 0; i < BATCH && sent < datagrams; i++, sent++) {
+        kyros_socket_write(sender, datagram, DATAGRAM_SIZE, false);
+    }
+    if (sent < datagrams) {
+        kyros_loop_defer(loop, kyros_send_batch, NULL);
+    }
+}
+
+static void run_kyros()
+{
+    static kyros_socket_handler handler = { .ondatagrams = kyros_ondatagrams, .ref_count = 1 };
+    kyros_socket_source source = { .type = KYROS_SOCKET_SOURCE_HOSTPORT, .value.host_port = { .host = "127.0.0.1", .port = SERVER_PORT, .use_udp = true } };
+    auto receiver = kyros_socket_listen(loop, source, (kryos_socket_options) { 0 }, &handler);
+    sender = kyros_socket_connect(loop, source, (kryos_socket_options) { 0 }, NULL);
+    auto start = uv_hrtime();
+    auto cpu = cpu_time();
+    kyros_send_batch(NULL);
+    kyros_loop_run_forever(loop);
+    report("kyros", (double)(uv_hrtime() - start) / 1e9, cpu_time() - cpu);
+    kyros_socket_close(sender);
+    kyros_socket_close(receiver);
+    kyros_loop_run_once(loop);
+}
+
+///
+/// libuv
+///
+
+static uv_udp_t uv_receiver;
+static uv_udp_t uv_sender;
+static char receive_buffer[65536];
+
+static void uv_alloc(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buffer)
+{
+    *buffer = uv_buf_init(receive_buffer, sizeof(receive_buffer));
+}
+
+static void uv_receive(uv_udp_t* handle, ssize_t length, const uv_buf_t* buffer, const struct sockaddr* peer, unsigned flags)
+{
+    if (length > 0) {
+        on_received(1);
+    }
+}
+
+static void uv_send_batch(void* ctx)
+{
+    auto buffer = uv_buf_init(datagram, DATAGRAM_SIZE);
+    for (uint32_t i = 0; i < BATCH && sent < datagrams; i++, sent++) {
+        uv_udp_try_send(&uv_sender, &buffer, 1, NULL);
+    }
+    if (sent < datagrams) {
+        kyros_loop_defer(loop, uv_send_batch, NULL);
+    }
+}
+
+static void run_libuv()
+{
+    struct sockaddr_in address;
+    uv_ip4_addr("127.0.0.1", SERVER_PORT, &address);
+    uv_udp_init((uv_loop_t*)loop, &uv_receiver);
+    uv_udp_bind(&uv_receiver, (const struct sockaddr*)&address, 0);
+    uv_udp_recv_start(&uv_receiver, uv_alloc, uv_receive);
+    uv_udp_init((uv_loop_t*)loop, &uv_sender);
+    uv_udp_connect(&uv_sender, (const struct sockaddr*)&address);
+    auto start = uv_hrtime();
+    auto cpu = cpu_time();
+    uv_send_batch(NULL);
+    kyros_loop_run_forever(loop);
+    report("libuv", (double)(uv_hrtime() - start) / 1e9, cpu_time() - cpu);
+    uv_close((uv_handle_t*)&uv_sender, NULL);
+    uv_close((uv_handle_t*)&uv_receiver, NULL);
+    kyros_loop_run_once(loop);
+}
+
+int main(int argc, char** argv)
+{
+    kyros_init();
+    datagrams = argc > 1 && atoi(argv[1]) > 0 ? (uint32_t)atoi(argv[1]) : DEFAULT_DATAGRAMS;
+    memset(datagram, 'x', DATAGRAM_SIZE);
+    loop = kyros_loop_create(NULL);
+    auto idle = kyros_loop_timer(loop, check_idle, NULL, 100, 100, false);
+    run_kyros();
+    sent = 0;
+    received = 0;
+    run_libuv();
+    kyros_timer_stop(idle);
+    return 0;
+}
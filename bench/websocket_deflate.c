@@ -0,0 +1,245 @@
+// permessage-deflate cost per connection: the server echoes JSON-like messages to websockets that each keep one in flight,
+// once with no compression, once with the shared streams of the loop and once with a dedicated window per connection
+// every mode gets a fresh server process and the clients run in another one (this binary with "server" or "client" as first
+// argument), so the memory is the growth of the server peak RSS divided by the connections, and the cpu is the one of the
+// server thread per byte of message echoed
+// usage: websocket_deflate [connections] [seconds]
+#include <kyros.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <uv.h>
+
+#define DEFAULT_CONNECTIONS 1000
+#define DEFAULT_SECONDS 3
+#define MESSAGES 16
+#define MESSAGE_SIZE 1024
+#define SERVER_PORT 39341
+
+extern char** environ;
+
+static const char* mode_names[] = { "none", "shared", "dedicated" };
+static char messages[MESSAGES][MESSAGE_SIZE];
+static uint32_t connections;
+static uint32_t seconds;
+
+// ticker updates, the field names repeat across messages and the values do not
+static void create_messages()
+{
+    srand(1);
+    for (uint32_t i = 0; i < MESSAGES; i++) {
+        uint32_t length = 0;
+        length += (uint32_t)snprintf(messages[i], MESSAGE_SIZE, "{\"type\":\"update\",\"sequence\":%u,\"ticks\":[", rand());
+        while (length < MESSAGE_SIZE - 100) {
+            length += (uint32_t)snprintf(messages[i] + length, MESSAGE_SIZE - length,
+                "{\"symbol\":\"SYM%03d\",\"bid\":%d.%02d,\"ask\":%d.%02d,\"volume\":%d},", rand() % 500, rand() % 1000,
+                rand() % 100, rand() % 1000, rand() % 100, rand() % 100000);
+        }
+        memcpy(messages[i] + length - 1, "]}", 2);
+        memset(messages[i] + length + 1, ' ', MESSAGE_SIZE - length - 1);
+    }
+}
+
+static void raise_fd_limit()
+{
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+}
+
+///
+/// Clients (child process)
+///
+
+typedef struct {
+    kyros_websocket* websocket;
+    uint32_t next;
+} client;
+
+static client* clients;
+static uint32_t clients_closed;
+static bool done;
+
+static void client_onopen(kyros_websocket* websocket, void* ctx)
+{
+    client* self = ctx;
+    kyros_websocket_send(websocket, messages[self->next++ % MESSAGES], MESSAGE_SIZE, KYROS_WEBSOCKET_TEXT);
+}
+
+static void client_onmessage(kyros_websocket* websocket, const char* data, uint64_t length, kyros_websocket_opcode opcode, void* ctx)
+{
+    client* self = ctx;
+    if (!done) {
+        kyros_websocket_send(websocket, messages[self->next++ % MESSAGES], MESSAGE_SIZE, KYROS_WEBSOCKET_TEXT);
+    }
+}
+
+static void client_onclose(kyros_websocket* websocket, uint16_t code, const char* reason, uint32_t reason_length, void* ctx)
+{
+    client* self = ctx;
+    self->websocket = NULL;
+    if (++clients_closed == connections) {
+        kyros_loop_stop(kyros_socket_get_loop(kyros_websocket_get_socket(websocket)));
+    }
+}
+
+static void client_timeout(void* ctx)
+{
+    done = true;
+    for (uint32_t i = 0; i < connections; i++) {
+        if (clients[i].websocket) {
+            kyros_websocket_close(clients[i].websocket, 1000, NULL, 0);
+        }
+    }
+}
+
+static int run_clients()
+{
+    auto loop = kyros_loop_create(NULL);
+    clients = calloc(connections, sizeof(client));
+    kyros_socket_source server = { .type = KYROS_SOCKET_SOURCE_HOSTPORT, .value.host_port = { .host = "127.0.0.1", .port = SERVER_PORT } };
+    for (uint32_t i = 0; i < connections; i++) {
+        clients[i].next = i;
+        // the dedicated offer takes whatever the server answers, so its mode is the one measured
+        clients[i].websocket = kyros_websocket_connect(loop, server, (kryos_socket_options) { .no_delay = true }, NULL, NULL,
+            (kyros_websocket_options) { .onopen = client_onopen, .onmessage = client_onmessage, .onclose = client_onclose,
+                .ctx = &clients[i], .compression = KYROS_WEBSOCKET_COMPRESSION_DEDICATED });
+    }
+    auto timer = kyros_loop_timer(loop, client_timeout, NULL, (uint64_t)seconds * 1000, 0, false);
+    kyros_loop_run_forever(loop);
+    kyros_timer_unref(timer);
+    return 0;
+}
+
+///
+/// Server
+///
+
+typedef struct {
+    bool answered;
+} server_connection;
+
+static kyros_loop* loop;
+static kyros_websocket_compression mode;
+static uint32_t answered;
+static uint32_t closed;
+static uint64_t echoed;
+static long peak_rss;
+static double cpu_start;
+
+static double thread_cpu_time()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
+    return (double)time.tv_sec + (double)time.tv_nsec / 1e9;
+}
+
+static long max_rss()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+static void server_onmessage(kyros_websocket* websocket, const char* data, uint64_t length, kyros_websocket_opcode opcode, void* ctx)
+{
+    server_connection* connection = ctx;
+    kyros_websocket_send(websocket, data, length, opcode);
+    echoed += length;
+    if (!connection->answered) {
+        connection->answered = true;
+        // every connection has been through its streams once, the throughput is measured from here
+        if (++answered == connections) {
+            peak_rss = max_rss();
+            echoed = 0;
+            cpu_start = thread_cpu_time();
+        }
+    }
+}
+
+static void server_onclose(kyros_websocket* websocket, uint16_t code, const char* reason, uint32_t reason_length, void* ctx)
+{
+    free(ctx);
+    if (++closed == connections) {
+        kyros_loop_stop(loop);
+    }
+}
+
+static void onrequest(kyros_http_request* request, kyros_http_response* response, void* ctx)
+{
+    uint32_t key_length;
+    uint32_t extensions_length = 0;
+    auto key = kyros_websocket_get_key(request, &key_length);
+    auto extensions = kyros_http_request_get_header(request, "sec-websocket-extensions", 24, &extensions_length);
+    kyros_websocket_upgrade(response, key, key_length, extensions, extensions_length,
+        (kyros_websocket_options) { .onmessage = server_onmessage, .onclose = server_onclose,
+            .ctx = calloc(1, sizeof(server_connection)), .compression = mode });
+}
+
+static pid_t spawn(const char* self, const char* role, uint32_t role_mode)
+{
+    char mode_argument[16];
+    char connections_argument[16];
+    char seconds_argument[16];
+    snprintf(mode_argument, sizeof(mode_argument), "%u", role_mode);
+    snprintf(connections_argument, sizeof(connections_argument), "%u", connections);
+    snprintf(seconds_argument, sizeof(seconds_argument), "%u", seconds);
+    char* arguments[] = { (char*)self, (char*)role, mode_argument, connections_argument, seconds_argument, NULL };
+    pid_t child;
+    if (posix_spawn(&child, self, NULL, NULL, arguments, environ)) {
+        printf("could not start %s\n", self);
+        exit(1);
+    }
+    return child;
+}
+
+static int run_server(const char* self)
+{
+    loop = kyros_loop_create(NULL);
+    kyros_socket_source source = { .type = KYROS_SOCKET_SOURCE_HOSTPORT, .value.host_port = { .host = "127.0.0.1", .port = SERVER_PORT } };
+    auto server = kyros_http_server_listen(loop, source, (kryos_socket_options) { .no_delay = true }, (kyros_http_server_options) { .onrequest = onrequest });
+    if (!server) {
+        printf("could not listen on %u\n", SERVER_PORT);
+        exit(1);
+    }
+    auto rss_start = max_rss();
+    auto child = spawn(self, "client", 0);
+    kyros_loop_run_forever(loop);
+    auto cpu = thread_cpu_time() - cpu_start;
+    waitpid(child, NULL, 0);
+    kyros_http_server_close(server);
+    kyros_loop_run_once(loop);
+    // ru_maxrss is in KiB
+    printf("%-9s %u connections: %8.1f KiB per connection, %10.0f msg/s, server cpu %6.2f s (%6.2f ns/byte)\n", mode_names[mode],
+        connections, (double)(peak_rss - rss_start) / connections, (double)echoed / MESSAGE_SIZE / seconds, cpu, cpu * 1e9 / (double)echoed);
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    kyros_init();
+    raise_fd_limit();
+    create_messages();
+    // children get the role, the mode and then the same arguments
+    auto role = argc > 2 && (!strcmp(argv[1], "client") || !strcmp(argv[1], "server")) ? argv[1] : NULL;
+    auto arguments = role ? argv + 2 : argv;
+    auto count = role ? argc - 2 : argc;
+    connections = count > 1 && atoi(arguments[1]) > 0 ? (uint32_t)atoi(arguments[1]) : DEFAULT_CONNECTIONS;
+    seconds = count > 2 && atoi(arguments[2]) > 0 ? (uint32_t)atoi(arguments[2]) : DEFAULT_SECONDS;
+    if (role && !strcmp(role, "client")) {
+        return run_clients();
+    }
+    if (role) {
+        mode = (kyros_websocket_compression)atoi(argv[2]);
+        return run_server(argv[0]);
+    }
+    for (uint32_t i = 0; i < 3; i++) {
+        waitpid(spawn(argv[0], "server", i), NULL, 0);
+    }
+    return 0;
+}
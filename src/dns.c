@@ -0,0 +1,628 @@
+#include <kyros.h>
+#include <kyros_bsd.h>
+#include <kyros_internal.h>
+
+#include <stdio.h>
+#include <string.h>
+
+// one cache per process, every loop resolves through it
+static uv_once_t kyros_dns_once = UV_ONCE_INIT;
+static kyros_dns_cache kyros_dns;
+
+static inline uint64_t kyros_dns_now()
+{
+    return uv_hrtime() / 1000000;
+}
+
+/// @brief FNV-1a of the lowercase name
+static uint64_t kyros_dns_hash(const char* host, uint32_t length)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (uint32_t i = 0; i < length; i++) {
+        hash = (hash ^ (uint8_t)host[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static inline kyros_dns_shard* kyros_dns_shard_of(uint64_t hash)
+{
+    return &kyros_dns.shards[hash & (KYROS_DNS_CACHE_SHARDS - 1)];
+}
+
+///
+/// Records
+///
+
+static kyros_dns_record* kyros_dns_record_create(uint32_t count)
+{
+    auto record = (kyros_dns_record*)kyros_alloc(sizeof(kyros_dns_record) + sizeof(struct sockaddr_storage) * count);
+    atomic_init(&record->ref_count, 1);
+    record->count = count;
+    return record;
+}
+
+static inline void kyros_dns_record_ref(kyros_dns_record* record)
+{
+    atomic_fetch_add_explicit(&record->ref_count, 1, memory_order_relaxed);
+}
+
+void kyros_dns_record_unref(kyros_dns_record* record)
+{
+    if (atomic_fetch_sub_explicit(&record->ref_count, 1, memory_order_acq_rel) == 1) {
+        kyros_free(record);
+    }
+}
+
+uint32_t kyros_dns_record_addresses(kyros_dns_record* record, kyros_socket_ip_family family, uint16_t port, struct sockaddr_storage* addresses, uint32_t capacity)
+{
+    auto wanted = kyros_socket_family_hint(family);
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < record->count && count < capacity; i++) {
+        auto address = &record->addresses[i];
+        if (wanted != AF_UNSPEC && address->ss_family != wanted) {
+            continue;
+        }
+        addresses[count] = *address;
+        if (address->ss_family == AF_INET) {
+            ((struct sockaddr_in*)&addresses[count])->sin_port = htons(port);
+        } else {
+            ((struct sockaddr_in6*)&addresses[count])->sin6_port = htons(port);
+        }
+        count++;
+    }
+    return count;
+}
+
+///
+/// Entries
+///
+
+static kyros_dns_entry* kyros_dns_entry_create(const char* host, uint32_t length, uint64_t hash)
+{
+    auto entry = (kyros_dns_entry*)kyros_alloc(sizeof(kyros_dns_entry) + length + 1);
+    *entry = (kyros_dns_entry) { .hash = hash, .host_length = (uint8_t)length };
+    memcpy(entry->host, host, length);
+    entry->host[length] = 0;
+    return entry;
+}
+
+static void kyros_dns_entry_free(kyros_dns_entry* entry)
+{
+    if (entry->record) {
+        kyros_dns_record_unref(entry->record);
+    }
+    kyros_free(entry);
+}
+
+/// @brief under the shard lock, true if the last reference is gone and the caller must free it once unlocked
+static inline bool kyros_dns_entry_release(kyros_dns_entry* entry)
+{
+    return --entry->ref_count == 0;
+}
+
+static kyros_dns_entry* kyros_dns_find(kyros_dns_shard* shard, uint64_t hash, const char* host, uint32_t length)
+{
+    auto index = (uint32_t)(hash >> 8);
+    for (uint32_t i = 0; i < KYROS_DNS_CACHE_PROBES; i++) {
+        auto entry = shard->entries[(index + i) & shard->mask];
+        if (entry && entry->hash == hash && entry->host_length == length && !memcmp(entry->host, host, length)) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/// @brief link entry in the table (with a new reference), returns the entry it replaced, the caller releases it
+/// entry is not cached if every slot of the probe window is pinned
+static kyros_dns_entry* kyros_dns_insert(kyros_dns_shard* shard, kyros_dns_entry* entry)
+{
+    auto index = (uint32_t)(entry->hash >> 8);
+    kyros_dns_entry** target = NULL;
+    for (uint32_t i = 0; i < KYROS_DNS_CACHE_PROBES; i++) {
+        auto slot = &shard->entries[(index + i) & shard->mask];
+        if (!*slot) {
+            target = slot;
+            break;
+        }
+        // otherwise the one that stops being usable first
+        if (!(*slot)->pinned && (!target || (*slot)->stale_until < (*target)->stale_until)) {
+            target = slot;
+        }
+    }
+    if (!target) {
+        return NULL;
+    }
+    auto replaced = *target;
+    *target = entry;
+    entry->ref_count++;
+    if (replaced) {
+        atomic_fetch_add_explicit(&kyros_dns.evicted, 1, memory_order_relaxed);
+    }
+    return replaced;
+}
+
+/// @brief drop the entries of a shard (the pinned ones too if keep_pinned is false), slots > 0 replaces the table
+static void kyros_dns_shard_reset(kyros_dns_shard* shard, bool keep_pinned, uint32_t slots)
+{
+    // released entries are chained through next_job, nothing queued can reach a ref_count of 0
+    kyros_dns_entry* released = NULL;
+    uv_mutex_lock(&shard->lock);
+    if (shard->entries) {
+        for (uint32_t i = 0; i <= shard->mask; i++) {
+            auto entry = shard->entries[i];
+            if (!entry || (keep_pinned && entry->pinned)) {
+                continue;
+            }
+            shard->entries[i] = NULL;
+            if (kyros_dns_entry_release(entry)) {
+                entry->next_job = released;
+                released = entry;
+            }
+        }
+    }
+    if (slots) {
+        kyros_free(shard->entries);
+        shard->entries = (kyros_dns_entry**)kyros_calloc(slots, sizeof(kyros_dns_entry*));
+        shard->mask = slots - 1;
+    }
+    uv_mutex_unlock(&shard->lock);
+    while (released) {
+        auto next = released->next_job;
+        kyros_dns_entry_free(released);
+        released = next;
+    }
+}
+
+///
+/// Resolver threads
+///
+
+/// @brief getaddrinfo through libuv for its error codes, loop is private to the thread and never runs
+static int32_t kyros_dns_getaddrinfo(uv_loop_t* loop, const char* host, struct sockaddr_storage* addresses, uint32_t capacity)
+{
+    struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM,
+    };
+    uv_getaddrinfo_t request;
+    auto status = uv_getaddrinfo(loop, &request, NULL, host, NULL, &hints);
+    if (status < 0) {
+        return status;
+    }
+    uint32_t count = 0;
+    for (auto address = request.addrinfo; address && count < capacity; address = address->ai_next) {
+        if ((address->ai_family != AF_INET && address->ai_family != AF_INET6) || address->ai_addrlen > sizeof(struct sockaddr_storage)) {
+            continue;
+        }
+        memset(&addresses[count], 0, sizeof(struct sockaddr_storage));
+        memcpy(&addresses[count], address->ai_addr, address->ai_addrlen);
+        count++;
+    }
+    uv_freeaddrinfo(request.addrinfo);
+    return (int32_t)count;
+}
+
+/// @brief runs in the thread of the loop that asked, waiter->loop is not kept alive for it anymore
+static void kyros_dns_deliver(void* ctx)
+{
+    kyros_dns_waiter* waiter = ctx;
+    kyros_loop_keep_alive(waiter->loop, -1);
+    waiter->callback(waiter, waiter->record, waiter->error);
+}
+
+/// @brief store the answer (record is NULL on failure) and wake every lookup waiting for it, releases the reference of the resolution
+static void kyros_dns_complete(kyros_dns_entry* entry, kyros_dns_record* record, int32_t error, uint32_t ttl)
+{
+    auto shard = kyros_dns_shard_of(entry->hash);
+    auto now = kyros_dns_now();
+    kyros_dns_record* replaced = NULL;
+    uv_mutex_lock(&shard->lock);
+    if (record) {
+        replaced = entry->record;
+        entry->record = record;
+        entry->error = 0;
+        entry->expires = now + (uint64_t)ttl * 1000;
+        entry->stale_until = entry->expires + (uint64_t)kyros_dns.stale_ttl * 1000;
+    } else if (entry->record && now < entry->stale_until) {
+        // a failed refresh keeps the stale answer, it is tried again once a failure would have been forgotten
+        entry->expires = now + (uint64_t)kyros_dns.negative_ttl * 1000;
+    } else {
+        replaced = entry->record;
+        entry->record = NULL;
+        entry->error = error;
+        entry->expires = now + (uint64_t)kyros_dns.negative_ttl * 1000;
+        entry->stale_until = entry->expires;
+    }
+    entry->resolving = false;
+    auto waiters = entry->waiters;
+    entry->waiters = NULL;
+    for (auto waiter = waiters; waiter; waiter = waiter->next) {
+        waiter->record = entry->record;
+        waiter->error = entry->record ? 0 : entry->error;
+        if (waiter->record) {
+            kyros_dns_record_ref(waiter->record);
+        }
+    }
+    auto release = kyros_dns_entry_release(entry);
+    uv_mutex_unlock(&shard->lock);
+    if (replaced) {
+        kyros_dns_record_unref(replaced);
+    }
+    if (release) {
+        kyros_dns_entry_free(entry);
+    }
+    while (waiters) {
+        // the loop can free the waiter as soon as it is deferred
+        auto next = waiters->next;
+        kyros_loop_atomic_defer(waiters->loop, kyros_dns_deliver, waiters);
+        waiters = next;
+    }
+}
+
+static void kyros_dns_run(uv_loop_t* loop, kyros_dns_entry* entry)
+{
+    struct sockaddr_storage addresses[KYROS_DNS_MAX_ADDRESSES];
+    auto ttl = kyros_dns.ttl;
+    int32_t result;
+    if (kyros_dns.resolver) {
+        result = kyros_dns.resolver(entry->host, addresses, KYROS_DNS_MAX_ADDRESSES, &ttl, kyros_dns.resolver_ctx);
+        if (result > KYROS_DNS_MAX_ADDRESSES) {
+            result = KYROS_DNS_MAX_ADDRESSES;
+        }
+    } else {
+        result = kyros_dns_getaddrinfo(loop, entry->host, addresses, KYROS_DNS_MAX_ADDRESSES);
+    }
+    if (result <= 0) {
+        kyros_dns_complete(entry, NULL, result < 0 ? result : UV_EAI_NONAME, ttl);
+        return;
+    }
+    auto record = kyros_dns_record_create((uint32_t)result);
+    memcpy(record->addresses, addresses, sizeof(struct sockaddr_storage) * (uint32_t)result);
+    kyros_dns_complete(entry, record, 0, ttl);
+}
+
+static void kyros_dns_thread(void* arg)
+{
+    uv_loop_t loop;
+    uv_loop_init(&loop);
+    for (;;) {
+        uv_mutex_lock(&kyros_dns.queue_lock);
+        while (!kyros_dns.queue_head) {
+            kyros_dns.idle_threads++;
+            uv_cond_wait(&kyros_dns.queue_ready, &kyros_dns.queue_lock);
+            kyros_dns.idle_threads--;
+        }
+        auto entry = kyros_dns.queue_head;
+        kyros_dns.queue_head = entry->next_job;
+        if (!kyros_dns.queue_head) {
+            kyros_dns.queue_tail = NULL;
+        }
+        uv_mutex_unlock(&kyros_dns.queue_lock);
+        kyros_dns_run(&loop, entry);
+    }
+}
+
+/// @brief hand entry to a resolver thread, it holds a reference for the resolution
+static void kyros_dns_enqueue(kyros_dns_entry* entry)
+{
+    atomic_fetch_add_explicit(&kyros_dns.resolutions, 1, memory_order_relaxed);
+    uv_mutex_lock(&kyros_dns.queue_lock);
+    entry->next_job = NULL;
+    if (kyros_dns.queue_tail) {
+        kyros_dns.queue_tail->next_job = entry;
+    } else {
+        kyros_dns.queue_head = entry;
+    }
+    kyros_dns.queue_tail = entry;
+    if (kyros_dns.idle_threads) {
+        uv_cond_signal(&kyros_dns.queue_ready);
+    } else if (kyros_dns.thread_count < KYROS_DNS_THREADS) {
+        // the threads live as long as the process
+        uv_thread_t thread;
+        if (uv_thread_create(&thread, kyros_dns_thread, NULL) == 0) {
+            kyros_dns.thread_count++;
+        } else if (!kyros_dns.thread_count) {
+            panic("could not start a dns resolver thread");
+        }
+    }
+    uv_mutex_unlock(&kyros_dns.queue_lock);
+}
+
+///
+/// Cache
+///
+
+static void kyros_dns_apply(kyros_dns_options options)
+{
+    kyros_dns.resolver = options.resolver;
+    kyros_dns.resolver_ctx = options.resolver_ctx;
+    kyros_dns.ttl = options.ttl ? options.ttl : KYROS_DNS_DEFAULT_TTL;
+    kyros_dns.negative_ttl = options.negative_ttl ? options.negative_ttl : KYROS_DNS_DEFAULT_NEGATIVE_TTL;
+    kyros_dns.stale_ttl = options.stale_ttl ? options.stale_ttl : KYROS_DNS_DEFAULT_STALE_TTL;
+    auto max_entries = options.max_entries ? options.max_entries : KYROS_DNS_DEFAULT_ENTRIES;
+    // power of 2 slots per shard, at least the probe window
+    uint32_t slots = KYROS_DNS_CACHE_PROBES;
+    while ((uint64_t)slots * KYROS_DNS_CACHE_SHARDS < max_entries) {
+        slots <<= 1;
+    }
+    for (uint32_t i = 0; i < KYROS_DNS_CACHE_SHARDS; i++) {
+        kyros_dns_shard_reset(&kyros_dns.shards[i], false, slots);
+    }
+}
+
+static void kyros_dns_init()
+{
+    for (uint32_t i = 0; i < KYROS_DNS_CACHE_SHARDS; i++) {
+        uv_mutex_init(&kyros_dns.shards[i].lock);
+        kyros_dns.shards[i].entries = NULL;
+    }
+    uv_mutex_init(&kyros_dns.queue_lock);
+    uv_cond_init(&kyros_dns.queue_ready);
+    kyros_dns_apply((kyros_dns_options) { 0 });
+}
+
+/// @brief lowercase copy of host in name, returns its length or 0 if it is not a usable name
+static uint32_t kyros_dns_normalize(const char* host, uint32_t length, char* name)
+{
+    if (!length || length > KYROS_DNS_MAX_HOST) {
+        return 0;
+    }
+    for (uint32_t i = 0; i < length; i++) {
+        auto c = host[i];
+        name[i] = c >= 'A' && c <= 'Z' ? (char)(c + ('a' - 'A')) : c;
+    }
+    return length;
+}
+
+bool kyros_dns_resolve(const char* host, kyros_dns_waiter* waiter, kyros_dns_record** record, int32_t* error)
+{
+    uv_once(&kyros_dns_once, kyros_dns_init);
+    *record = NULL;
+    *error = 0;
+    char name[KYROS_DNS_MAX_HOST];
+    auto length = kyros_dns_normalize(host, (uint32_t)strnlen(host, KYROS_DNS_MAX_HOST + 1), name);
+    if (!length) {
+        *error = UV_EINVAL;
+        return true;
+    }
+    auto hash = kyros_dns_hash(name, length);
+    auto shard = kyros_dns_shard_of(hash);
+    auto now = kyros_dns_now();
+    kyros_dns_entry* job = NULL;
+    kyros_dns_entry* replaced = NULL;
+    bool hit = true;
+    uv_mutex_lock(&shard->lock);
+    auto entry = kyros_dns_find(shard, hash, name, length);
+    if (entry && (entry->pinned || now < entry->expires)) {
+        if (entry->record) {
+            *record = entry->record;
+            kyros_dns_record_ref(entry->record);
+        } else {
+            *error = entry->error;
+        }
+        atomic_fetch_add_explicit(entry->record ? &kyros_dns.hits : &kyros_dns.negative_hits, 1, memory_order_relaxed);
+    } else if (entry && entry->record && now < entry->stale_until) {
+        // stale while revalidate, one refresh at a time
+        *record = entry->record;
+        kyros_dns_record_ref(entry->record);
+        if (!entry->resolving) {
+            job = entry;
+        }
+        atomic_fetch_add_explicit(&kyros_dns.stale_hits, 1, memory_order_relaxed);
+    } else {
+        hit = false;
+        if (!entry) {
+            entry = kyros_dns_entry_create(name, length, hash);
+            replaced = kyros_dns_insert(shard, entry);
+        }
+        if (!entry->resolving) {
+            job = entry;
+        }
+        waiter->next = entry->waiters;
+        entry->waiters = waiter;
+        atomic_fetch_add_explicit(&kyros_dns.misses, 1, memory_order_relaxed);
+    }
+    if (job) {
+        job->resolving = true;
+        job->ref_count++;
+    }
+    auto release = replaced && kyros_dns_entry_release(replaced);
+    uv_mutex_unlock(&shard->lock);
+    if (release) {
+        kyros_dns_entry_free(replaced);
+    }
+    if (!hit) {
+        kyros_loop_keep_alive(waiter->loop, 1);
+    }
+    if (job) {
+        kyros_dns_enqueue(job);
+    }
+    return hit;
+}
+
+///
+/// Hosts file
+///
+
+/// @brief next whitespace separated token of *cursor (NUL terminated in place), NULL at the end of the line
+static char* kyros_dns_next_token(char** cursor)
+{
+    auto p = *cursor;
+    while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') {
+        p++;
+    }
+    if (!*p) {
+        return NULL;
+    }
+    auto token = p;
+    while (*p && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') {
+        p++;
+    }
+    if (*p) {
+        *p++ = 0;
+    }
+    *cursor = p;
+    return token;
+}
+
+/// @brief add address to the pinned entry of name
+static void kyros_dns_pin(const char* name, uint32_t length, const struct sockaddr_storage* address)
+{
+    auto hash = kyros_dns_hash(name, length);
+    auto shard = kyros_dns_shard_of(hash);
+    kyros_dns_record* replaced = NULL;
+    kyros_dns_entry* evicted = NULL;
+    kyros_dns_entry* unused = NULL;
+    uv_mutex_lock(&shard->lock);
+    auto entry = kyros_dns_find(shard, hash, name, length);
+    if (!entry) {
+        entry = kyros_dns_entry_create(name, length, hash);
+        entry->pinned = true;
+        entry->expires = UINT64_MAX;
+        entry->stale_until = UINT64_MAX;
+        evicted = kyros_dns_insert(shard, entry);
+        if (evicted && !kyros_dns_entry_release(evicted)) {
+            evicted = NULL;
+        }
+        // a probe window full of pinned names, the hosts file is bigger than the cache
+        if (!entry->ref_count) {
+            unused = entry;
+        }
+    }
+    if (!unused && (!entry->record || entry->record->count < KYROS_DNS_MAX_ADDRESSES)) {
+        // nobody looked it up yet, but records are never changed once created
+        auto count = entry->record ? entry->record->count : 0;
+        auto record = kyros_dns_record_create(count + 1);
+        if (count) {
+            memcpy(record->addresses, entry->record->addresses, sizeof(struct sockaddr_storage) * count);
+        }
+        record->addresses[count] = *address;
+        replaced = entry->record;
+        entry->record = record;
+    }
+    uv_mutex_unlock(&shard->lock);
+    if (replaced) {
+        kyros_dns_record_unref(replaced);
+    }
+    if (evicted) {
+        kyros_dns_entry_free(evicted);
+    }
+    if (unused) {
+        kyros_dns_entry_free(unused);
+    }
+}
+
+static bool kyros_dns_load_hosts(const char* path)
+{
+    auto file = fopen(path, "r");
+    if (!file) {
+        return false;
+    }
+    char line[1024];
+    while (fgets(line, sizeof(line), file)) {
+        auto comment = strchr(line, '#');
+        if (comment) {
+            *comment = 0;
+        }
+        auto cursor = line;
+        auto token = kyros_dns_next_token(&cursor);
+        if (!token) {
+            continue;
+        }
+        struct sockaddr_storage address;
+        memset(&address, 0, sizeof(address));
+        if (uv_inet_pton(AF_INET, token, &((struct sockaddr_in*)&address)->sin_addr) == 0) {
+            address.ss_family = AF_INET;
+        } else if (uv_inet_pton(AF_INET6, token, &((struct sockaddr_in6*)&address)->sin6_addr) == 0) {
+            address.ss_family = AF_INET6;
+        } else {
+            continue;
+        }
+        while ((token = kyros_dns_next_token(&cursor))) {
+            char name[KYROS_DNS_MAX_HOST];
+            auto length = kyros_dns_normalize(token, (uint32_t)strlen(token), name);
+            if (length) {
+                kyros_dns_pin(name, length, &address);
+            }
+        }
+    }
+    fclose(file);
+    return true;
+}
+
+///
+/// Public API
+///
+
+typedef struct {
+    kyros_dns_waiter waiter;
+    kyros_dns_callback callback;
+    void* ctx;
+    kyros_socket_ip_family family;
+} kyros_dns_lookup_request;
+
+/// @brief takes the record reference
+static void kyros_dns_lookup_complete(kyros_dns_callback callback, void* ctx, kyros_socket_ip_family family, kyros_dns_record* record, int32_t error)
+{
+    struct sockaddr_storage addresses[KYROS_DNS_MAX_ADDRESSES];
+    uint32_t count = 0;
+    if (record) {
+        count = kyros_dns_record_addresses(record, family, 0, addresses, KYROS_DNS_MAX_ADDRESSES);
+        kyros_dns_record_unref(record);
+        if (!count) {
+            error = UV_EAI_ADDRFAMILY;
+        }
+    }
+    callback(addresses, count, error, ctx);
+}
+
+static void kyros_dns_lookup_callback(kyros_dns_waiter* waiter, kyros_dns_record* record, int32_t error)
+{
+    auto request = kyros_container_of(waiter, kyros_dns_lookup_request, waiter);
+    kyros_dns_lookup_complete(request->callback, request->ctx, request->family, record, error);
+    kyros_free(request);
+}
+
+bool kyros_dns_configure(kyros_dns_options options)
+{
+    uv_once(&kyros_dns_once, kyros_dns_init);
+    kyros_dns_apply(options);
+    return !options.hosts_file || kyros_dns_load_hosts(options.hosts_file);
+}
+
+void kyros_dns_lookup(kyros_loop* loop, const char* host, kyros_socket_ip_family family, kyros_dns_callback callback, void* ctx)
+{
+    auto request = (kyros_dns_lookup_request*)kyros_alloc(sizeof(kyros_dns_lookup_request));
+    *request = (kyros_dns_lookup_request) {
+        .waiter = { .loop = loop, .callback = kyros_dns_lookup_callback },
+        .callback = callback,
+        .ctx = ctx,
+        .family = family,
+    };
+    kyros_dns_record* record;
+    int32_t error;
+    if (kyros_dns_resolve(host, &request->waiter, &record, &error)) {
+        kyros_free(request);
+        kyros_dns_lookup_complete(callback, ctx, family, record, error);
+    }
+}
+
+kyros_dns_stats kyros_dns_get_stats()
+{
+    return (kyros_dns_stats) {
+        .hits = atomic_load_explicit(&kyros_dns.hits, memory_order_relaxed),
+        .stale_hits = atomic_load_explicit(&kyros_dns.stale_hits, memory_order_relaxed),
+        .negative_hits = atomic_load_explicit(&kyros_dns.negative_hits, memory_order_relaxed),
+        .misses = atomic_load_explicit(&kyros_dns.misses, memory_order_relaxed),
+        .resolutions = atomic_load_explicit(&kyros_dns.resolutions, memory_order_relaxed),
+        .evicted = atomic_load_explicit(&kyros_dns.evicted, memory_order_relaxed),
+    };
+}
+
+void kyros_dns_clear()
+{
+    uv_once(&kyros_dns_once, kyros_dns_init);
+    for (uint32_t i = 0; i < KYROS_DNS_CACHE_SHARDS; i++) {
+        kyros_dns_shard_reset(&kyros_dns.shards[i], true, 0);
+    }
+}
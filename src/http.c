@@ -0,0 +1,904 @@
+#include <kyros.h>
+#include <kyros_internal.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+static inline kyros_http_connection* kyros_http_connection_from_response(kyros_http_response* response)
+{
+    return kyros_container_of(response, kyros_http_connection, response);
+}
+
+static inline kyros_http2_stream* kyros_http2_stream_from_response(kyros_http_response* response)
+{
+    return kyros_container_of(response, kyros_http2_stream, response);
+}
+
+static inline kyros_http3_stream* kyros_http3_stream_from_response(kyros_http_response* response)
+{
+    return kyros_container_of(response, kyros_http3_stream, response);
+}
+
+///
+/// Formatting
+///
+
+static const char* kyros_http_reason(uint16_t status)
+{
+    switch (status) {
+    case 100: return "Continue";
+    case 101: return "Switching Protocols";
+    case 200: return "OK";
+    case 201: return "Created";
+    case 202: return "Accepted";
+    case 204: return "No Content";
+    case 206: return "Partial Content";
+    case 301: return "Moved Permanently";
+    case 302: return "Found";
+    case 303: return "See Other";
+    case 304: return "Not Modified";
+    case 307: return "Temporary Redirect";
+    case 308: return "Permanent Redirect";
+    case 400: return "Bad Request";
+    case 401: return "Unauthorized";
+    case 403: return "Forbidden";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 408: return "Request Timeout";
+    case 409: return "Conflict";
+    case 411: return "Length Required";
+    case 413: return "Content Too Large";
+    case 414: return "URI Too Long";
+    case 415: return "Unsupported Media Type";
+    case 426: return "Upgrade Required";
+    case 429: return "Too Many Requests";
+    case 431: return "Request Header Fields Too Large";
+    case 500: return "Internal Server Error";
+    case 501: return "Not Implemented";
+    case 502: return "Bad Gateway";
+    case 503: return "Service Unavailable";
+    case 504: return "Gateway Timeout";
+    default: return "";
+    }
+}
+
+uint32_t kyros_http_format_decimal(char* out, uint64_t value)
+{
+    char digits[20];
+    uint32_t length = 0;
+    do {
+        digits[length++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value);
+    for (uint32_t i = 0; i < length; i++) {
+        out[i] = digits[length - 1 - i];
+    }
+    return length;
+}
+
+static uint32_t kyros_http_format_hex(char* out, uint64_t value)
+{
+    static const char hex[] = "0123456789abcdef";
+    uint32_t length = value ? (uint32_t)(67 - __builtin_clzg(value)) / 4 : 1;
+    for (uint32_t i = length; i > 0; i--) {
+        out[i - 1] = hex[value & 0xf];
+        value >>= 4;
+    }
+    return length;
+}
+
+void kyros_http_server_refresh_date(kyros_http_server* server)
+{
+    // time() is a vDSO read, formatting only happens once per second
+    auto now = time(NULL);
+    if ((uint64_t)now == server->date_second) {
+        return;
+    }
+    server->date_second = (uint64_t)now;
+    static const char days[7][4] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+    static const char months[12][4] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+    struct tm tm;
+#ifdef _WIN32
+    gmtime_s(&tm, &now);
+#else
+    gmtime_r(&now, &tm);
+#endif
+    // fixed length (IMF-fixdate), see KYROS_HTTP_DATE_LENGTH
+    snprintf(server->date, sizeof(server->date), "Date: %s, %02d %s %04d %02d:%02d:%02d GMT\r\n", days[tm.tm_wday], tm.tm_mday,
+        months[tm.tm_mon], tm.tm_year + 1900, tm.tm_hour, tm.tm_min, tm.tm_sec);
+}
+
+///
+/// Output
+///
+
+/// @brief send what the batch gathered, the output is empty and has no owner after it
+static void kyros_http_server_flush(kyros_http_server* server, bool end)
+{
+    auto owner = server->output_owner;
+    if (!owner) {
+        return;
+    }
+    auto length = server->output_length;
+    server->output_owner = NULL;
+    server->output_length = 0;
+    if (!owner->closed) {
+        kyros_socket_write(owner->socket, server->output, length, end);
+    }
+}
+
+/// @brief room for length bytes at the end of the output of connection
+static char* kyros_http_output(kyros_http_connection* connection, uint64_t length)
+{
+    auto server = connection->server;
+    if (server->output_owner != connection) {
+        // another connection answers out of its batch, keep the order of each socket
+        kyros_http_server_flush(server, false);
+        server->output_owner = connection;
+    }
+    auto needed = server->output_length + length;
+    if (needed > server->output_capacity) {
+        auto capacity = server->output_capacity ? server->output_capacity * 2 : KYROS_HTTP_DIRECT_WRITE;
+        while (capacity < needed) {
+            capacity *= 2;
+        }
+        server->output = (char*)kyros_resize(server->output, capacity);
+        server->output_capacity = capacity;
+    }
+    auto out = server->output + server->output_length;
+    server->output_length = needed;
+    return out;
+}
+
+static inline void kyros_http_append(kyros_http_connection* connection, const char* data, uint64_t length)
+{
+    memcpy(kyros_http_output(connection, length), data, length);
+}
+
+static void kyros_http_append_body(kyros_http_connection* connection, const char* data, uint64_t length)
+{
+    if (length < KYROS_HTTP_DIRECT_WRITE) {
+        kyros_http_append(connection, data, length);
+        return;
+    }
+    // the head goes first, then the body without copying it
+    kyros_http_output(connection, 0);
+    kyros_http_server_flush(connection->server, false);
+    if (!connection->closed) {
+        kyros_socket_write(connection->socket, data, length, false);
+    }
+}
+
+static void kyros_http_write_status_line(kyros_http_connection* connection, uint16_t status)
+{
+    m_assert(status >= 100 && status <= 999, "kyros_http_response status must have 3 digits");
+    auto server = connection->server;
+    kyros_http_server_refresh_date(server);
+    auto reason = kyros_http_reason(status);
+    auto reason_length = (uint32_t)strlen(reason);
+    // HTTP/1.1 200 OK\r\nDate: ...\r\n
+    auto out = kyros_http_output(connection, 9 + 3 + 1 + reason_length + 2 + KYROS_HTTP_DATE_LENGTH);
+    memcpy(out, "HTTP/1.1 ", 9);
+    out[9] = (char)('0' + status / 100);
+    out[10] = (char)('0' + status / 10 % 10);
+    out[11] = (char)('0' + status % 10);
+    out[12] = ' ';
+    memcpy(out + 13, reason, reason_length);
+    memcpy(out + 13 + reason_length, "\r\n", 2);
+    memcpy(out + 15 + reason_length, server->date, KYROS_HTTP_DATE_LENGTH);
+    connection->status_written = true;
+    // no body at all, not even an empty one
+    connection->bodyless_status = status < 200 || status == 204 || status == 304;
+}
+
+/// @brief framing and connection headers then the empty line, length is the whole body when the response ends
+static void kyros_http_end_headers(kyros_http_connection* connection, bool ending, uint64_t length)
+{
+    if (!connection->status_written) {
+        kyros_http_write_status_line(connection, 200);
+    }
+    char head[96];
+    uint32_t size = 0;
+    if (!connection->has_content_length && !connection->bodyless_status) {
+        if (ending) {
+            memcpy(head, "Content-Length: ", 16);
+            size = 16 + kyros_http_format_decimal(head + 16, length);
+            memcpy(head + size, "\r\n", 2);
+            size += 2;
+        } else if (!connection->http10) {
+            memcpy(head, "Transfer-Encoding: chunked\r\n", 28);
+            size = 28;
+            connection->chunked = true;
+        } else {
+            // HTTP/1.0 has no chunked encoding, closing ends the body
+            connection->keep_alive = false;
+        }
+    }
+    if (!connection->has_connection) {
+        if (!connection->keep_alive) {
+            memcpy(head + size, "Connection: close\r\n", 19);
+            size += 19;
+        } else if (connection->http10) {
+            memcpy(head + size, "Connection: keep-alive\r\n", 24);
+            size += 24;
+        }
+    }
+    memcpy(head + size, "\r\n", 2);
+    size += 2;
+    kyros_http_append(connection, head, size);
+    connection->headers_ended = true;
+}
+
+static void kyros_http_write_chunk(kyros_http_connection* connection, const char* data, uint64_t length)
+{
+    char size[20];
+    auto size_length = kyros_http_format_hex(size, length);
+    memcpy(size + size_length, "\r\n", 2);
+    kyros_http_append(connection, size, size_length + 2);
+    kyros_http_append_body(connection, data, length);
+    kyros_http_append(connection, "\r\n", 2);
+}
+
+///
+/// Connection
+///
+
+void kyros_http_server_release(kyros_http_server* server)
+{
+    if (!server->closed || server->handler.ref_count) {
+        return;
+    }
+    if (server->output) {
+        kyros_free(server->output);
+    }
+    if (server->scratch) {
+        kyros_free(server->scratch);
+    }
+    if (server->decoded) {
+        kyros_free(server->decoded);
+    }
+    kyros_free(server);
+}
+
+static void kyros_http_connection_free(kyros_http_connection* connection)
+{
+    auto server = connection->server;
+    if (server->output_owner == connection) {
+        server->output_owner = NULL;
+        server->output_length = 0;
+    }
+    if (connection->input) {
+        kyros_free(connection->input);
+    }
+    kyros_free(connection);
+    // the connection kept the ref its socket took on the server handler
+    server->handler.ref_count--;
+    kyros_http_server_release(server);
+}
+
+static inline bool kyros_http_connection_writable(kyros_http_connection* connection)
+{
+    if (connection->closed) {
+        return false;
+    }
+    auto tcp = (kyros_socket_internal_tcp*)kyros_get_socket_internal(connection->socket);
+    return !tcp->socket.over_high_watermark;
+}
+
+/// @brief end of a batch (or of a response call made out of one), returns false if the connection was freed
+static bool kyros_http_connection_leave(kyros_http_connection* connection)
+{
+    // still in the batch while writing, a write error closes the socket right away
+    kyros_http_server_flush(connection->server, false);
+    connection->in_batch = false;
+    if (connection->closed) {
+        if (!connection->resume_scheduled) {
+            kyros_http_connection_free(connection);
+        }
+        return false;
+    }
+    return true;
+}
+
+static void kyros_http_connection_buffer(kyros_http_connection* connection, const char* data, uint64_t length)
+{
+    auto needed = connection->input_length + length;
+    if (needed > connection->input_capacity) {
+        auto capacity = connection->input_capacity ? connection->input_capacity * 2 : 4096;
+        while (capacity < needed) {
+            capacity *= 2;
+        }
+        // the parser reads ahead in vectors
+        connection->input = (char*)kyros_resize(connection->input, capacity + KYROS_RECV_BUFFER_PADDING);
+        connection->input_capacity = capacity;
+    }
+    memcpy(connection->input + connection->input_length, data, length);
+    connection->input_length = needed;
+}
+
+static void kyros_http_connection_dispatch(kyros_http_connection* connection, kyros_http_request* request)
+{
+    connection->responding = true;
+    connection->keep_alive = request->keep_alive;
+    connection->http10 = request->minor_version == 0;
+    connection->head_request = request->method_length == 4 && !memcmp(request->method, "HEAD", 4);
+    auto server = connection->server;
+    server->options.onrequest(request, &connection->response, server->options.ctx);
+    if (connection->responding && !connection->closed) {
+        // answered later, what comes next waits so the responses stay in order
+        kyros_socket_pause(connection->socket);
+    }
+}
+
+/// @brief answer with an error and close, the rest of the input is dropped
+static void kyros_http_connection_fail(kyros_http_connection* connection, uint16_t status)
+{
+    auto response = &connection->response;
+    connection->responding = true;
+    connection->keep_alive = false;
+    connection->http10 = false;
+    connection->head_request = false;
+    kyros_http_response_write_status(response, status);
+    kyros_http_response_end(response, NULL, 0);
+}
+
+/// @brief answer the whole requests of data in order, returns the bytes consumed
+static uint64_t kyros_http_connection_process(kyros_http_connection* connection, const char* data, uint64_t length)
+{
+    auto server = connection->server;
+    auto max_header_size = server->options.max_header_size;
+    auto max_body_size = server->options.max_body_size;
+    uint64_t consumed = 0;
+    while (consumed < length && !connection->responding && !connection->closing && !connection->closed) {
+        auto p = data + consumed;
+        auto available = length - consumed;
+        if (available < connection->body_wait) {
+            // the Content-Length body is not all there yet, no need to parse the head again
+            break;
+        }
+        if (connection->body_head) {
+            // only what came after the chunks scanned by the last read is looked at
+            auto body = kyros_http_chunked_scan(p + connection->body_head, available - connection->body_head, max_body_size, &connection->body_chunked);
+            if (body == KYROS_HTTP_PARSE_INCOMPLETE) {
+                break;
+            }
+        }
+        kyros_http_request request;
+        kyros_http_header headers[KYROS_HTTP_MAX_HEADERS];
+        kyros_http_framing framing;
+        auto head = kyros_http_parse_request(p, available, &request, headers, KYROS_HTTP_MAX_HEADERS, &framing);
+        if (head == KYROS_HTTP_PARSE_INCOMPLETE) {
+            if (available > max_header_size) {
+                kyros_http_connection_fail(connection, 431);
+            }
+            break;
+        }
+        if (head < 0 || (uint64_t)head > max_header_size) {
+            kyros_http_connection_fail(connection, head == KYROS_HTTP_PARSE_ERROR ? 400 : 431);
+            break;
+        }
+        uint64_t total = (uint64_t)head;
+        if (framing.chunked) {
+            if (!connection->body_head) {
+                connection->body_chunked = (kyros_http_chunked_state) { 0 };
+            }
+            auto body = kyros_http_chunked_scan(p + head, available - (uint64_t)head, max_body_size, &connection->body_chunked);
+            if (body == KYROS_HTTP_PARSE_INCOMPLETE) {
+                connection->body_head = (uint64_t)head;
+                break;
+            }
+            if (body < 0) {
+                kyros_http_connection_fail(connection, body == KYROS_HTTP_PARSE_ERROR ? 400 : 413);
+                break;
+            }
+            auto body_length = connection->body_chunked.body_length;
+            if (body_length > server->scratch_capacity) {
+                server->scratch = (char*)kyros_resize(server->scratch, body_length);
+                server->scratch_capacity = body_length;
+            }
+            kyros_http_chunked_decode(p + head, (uint64_t)body, server->scratch);
+            request.body = body_length ? server->scratch : NULL;
+            request.body_length = body_length;
+            total += (uint64_t)body;
+        } else if (framing.content_length > 0) {
+            if ((uint64_t)framing.content_length > max_body_size) {
+                kyros_http_connection_fail(connection, 413);
+                break;
+            }
+            if (available - (uint64_t)head < (uint64_t)framing.content_length) {
+                connection->body_wait = total + (uint64_t)framing.content_length;
+                break;
+            }
+            request.body = p + head;
+            request.body_length = (uint64_t)framing.content_length;
+            total += request.body_length;
+        }
+        consumed += total;
+        connection->body_head = 0;
+        connection->body_wait = 0;
+        kyros_http_connection_dispatch(connection, &request);
+    }
+    return consumed;
+}
+
+static void kyros_http_connection_process_input(kyros_http_connection* connection)
+{
+    auto consumed = kyros_http_connection_process(connection, connection->input, connection->input_length);
+    if (connection->closed && !connection->upgraded) {
+        return;
+    }
+    connection->input_length -= consumed;
+    if (connection->input_length) {
+        memmove(connection->input, connection->input + consumed, connection->input_length);
+    }
+}
+
+/// @brief what an upgraded connection read after its request goes to the new handler, then the connection is released
+static void kyros_http_connection_hand_over(kyros_http_connection* connection)
+{
+    auto socket = connection->socket;
+    auto tcp = (kyros_socket_internal_tcp*)kyros_get_socket_internal(socket);
+    if (connection->input_length && !kyros_socket_is_closed(socket)) {
+        kyros_socket_emit_data(tcp, connection->input, connection->input_length);
+    }
+    if (!kyros_socket_is_closed(socket)) {
+        kyros_socket_resume(socket);
+    }
+    kyros_http_connection_free(connection);
+    kyros_socket_unref(socket);
+}
+
+static void kyros_http_connection_resume(void* ctx)
+{
+    kyros_http_connection* connection = ctx;
+    connection->resume_scheduled = false;
+    if (connection->upgraded) {
+        kyros_http_connection_hand_over(connection);
+        return;
+    }
+    if (connection->closed) {
+        if (!connection->in_batch) {
+            kyros_http_connection_free(connection);
+        }
+        return;
+    }
+    if (connection->responding || connection->closing) {
+        return;
+    }
+    connection->in_batch = true;
+    kyros_http_connection_process_input(connection);
+    if (kyros_http_connection_leave(connection) && !connection->responding && !connection->closing) {
+        kyros_socket_resume(connection->socket);
+    }
+}
+
+/// @brief HTTP/2 with prior knowledge starts with the connection preface instead of a request, returns true if data was taken
+static bool kyros_http_connection_prior_knowledge(kyros_http_connection* connection, const char* data, uint64_t length)
+{
+    if (connection->input_length) {
+        // the start of the preface is buffered, what follows goes with it either way
+        kyros_http_connection_buffer(connection, data, length);
+        data = connection->input;
+        length = connection->input_length;
+    }
+    if (!kyros_http2_is_preface(data, length)) {
+        connection->started = true;
+        return false;
+    }
+    if (length < KYROS_HTTP2_PREFACE_LENGTH) {
+        if (!connection->input_length) {
+            kyros_http_connection_buffer(connection, data, length);
+        }
+        return true;
+    }
+    // the socket handler becomes the HTTP/2 connection, it keeps the server ref of this one
+    kyros_http2_connection_create(connection->server, connection->socket, data, length);
+    if (connection->input) {
+        kyros_free(connection->input);
+    }
+    kyros_free(connection);
+    return true;
+}
+
+static bool kyros_http_connection_ondata(kyros_socket socket, const char* data, uint64_t length, void* ctx)
+{
+    kyros_http_connection* connection = ctx;
+    if (connection->closing) {
+        return true;
+    }
+    if (!connection->started) {
+        auto buffered = connection->input_length;
+        if (kyros_http_connection_prior_knowledge(connection, data, length)) {
+            return true;
+        }
+        if (buffered) {
+            // already in the input with the partial preface
+            connection->in_batch = true;
+            kyros_http_connection_process_input(connection);
+            kyros_http_connection_leave(connection);
+            return true;
+        }
+    }
+    if (connection->input_length || connection->responding) {
+        // behind a partial request, or read before the pause of a pending response
+        kyros_http_connection_buffer(connection, data, length);
+        if (connection->responding) {
+            return true;
+        }
+        connection->in_batch = true;
+        kyros_http_connection_process_input(connection);
+    } else {
+        // in place, only what is left of a partial request is copied
+        connection->in_batch = true;
+        auto consumed = kyros_http_connection_process(connection, data, length);
+        if (consumed < length && !connection->closing && (!connection->closed || connection->upgraded)) {
+            kyros_http_connection_buffer(connection, data + consumed, length - consumed);
+        }
+    }
+    kyros_http_connection_leave(connection);
+    return true;
+}
+
+static void kyros_http_connection_onstatus(kyros_socket socket, kyros_socket_error error, void* ctx)
+{
+    kyros_http_connection* connection = ctx;
+    auto state = kyros_socket_get_state(socket);
+    if (state == KYROS_SOCKET_STATE_READABLE_ENDED) {
+        // half open, the pending responses are sent then the writable side is closed
+        connection->keep_alive = false;
+        if (!connection->responding && !connection->closing) {
+            connection->closing = true;
+            kyros_http_output(connection, 0);
+            kyros_http_server_flush(connection->server, true);
+        }
+        return;
+    }
+    if (state != KYROS_SOCKET_STATE_CLOSED) {
+        return;
+    }
+    // the handler goes away with the connection, the socket must not release it again
+    auto tcp = (kyros_socket_internal_tcp*)kyros_get_socket_internal(socket);
+    tcp->handlers = NULL;
+    connection->closed = true;
+    if (connection->responding && connection->onabort) {
+        connection->onabort(&connection->response, connection->onabort_ctx);
+    }
+    if (!connection->in_batch && !connection->resume_scheduled) {
+        kyros_http_connection_free(connection);
+    }
+}
+
+bool kyros_http_connection_upgrade(kyros_http_response* response, const char* head, uint64_t length, kyros_socket_handler* handler)
+{
+    auto connection = kyros_http_connection_from_response(response);
+    m_assert(response->version == 1 && connection->responding && !connection->status_written, "kyros_http_response upgraded after its head");
+    if (connection->closed) {
+        return false;
+    }
+    auto entered = !connection->in_batch;
+    connection->in_batch = true;
+    kyros_http_append(connection, head, length);
+    kyros_http_server_flush(connection->server, false);
+    if (connection->closed) {
+        if (entered) {
+            kyros_http_connection_leave(connection);
+        }
+        return false;
+    }
+    connection->responding = false;
+    connection->onabort = NULL;
+    connection->upgraded = true;
+    connection->closed = true;
+    auto tcp = (kyros_socket_internal_tcp*)kyros_get_socket_internal(connection->socket);
+    tcp->handlers = handler;
+    // the rest of the input is handed over on the next tick, not from inside the caller, nothing is read before it
+    kyros_socket_pause(connection->socket);
+    kyros_socket_ref(connection->socket);
+    if (!connection->resume_scheduled) {
+        connection->resume_scheduled = true;
+        kyros_loop_defer(connection->server->loop, kyros_http_connection_resume, connection);
+    }
+    if (entered) {
+        kyros_http_connection_leave(connection);
+    }
+    return true;
+}
+
+///
+/// Server
+///
+
+static void kyros_http_server_onstatus(kyros_socket socket, kyros_socket_error error, void* ctx)
+{
+    kyros_http_server* server = ctx;
+    auto tcp = (kyros_socket_internal_tcp*)kyros_get_socket_internal(socket);
+    auto state = kyros_socket_get_state(socket);
+    if (state == KYROS_SOCKET_STATE_CLOSED) {
+        // tls handshake failed, there is no connection to release it
+        tcp->handlers = NULL;
+        server->handler.ref_count--;
+        kyros_http_server_release(server);
+        return;
+    }
+    // tls sockets become connections once secure
+    if (state != KYROS_SOCKET_STATE_SECURE && (state != KYROS_SOCKET_STATE_OPEN || tcp->socket.tag == KYROS_SOCKET_TLS)) {
+        return;
+    }
+    if (server->options.http2 && tcp->socket.tag == KYROS_SOCKET_TLS) {
+        const unsigned char* protocol;
+        unsigned int protocol_length;
+        SSL_get0_alpn_selected(kyros_socket_get_ssl(socket), &protocol, &protocol_length);
+        if (protocol_length == 2 && !memcmp(protocol, "h2", 2)) {
+            kyros_http2_connection_create(server, socket, NULL, 0);
+            return;
+        }
+    }
+    auto connection = (kyros_http_connection*)kyros_calloc(1, sizeof(kyros_http_connection));
+    connection->handler = (kyros_socket_handler) {
+        .ctx = connection,
+        .ondata = kyros_http_connection_ondata,
+        .onstatus = kyros_http_connection_onstatus,
+        .ref_count = 1,
+    };
+    connection->response.version = 1;
+    connection->server = server;
+    connection->socket = socket;
+    // h2c is only looked for before the first request (and never over tls, that is ALPN)
+    connection->started = !server->options.http2 || tcp->socket.tag == KYROS_SOCKET_TLS;
+    // the ref the socket has on the server handler is now the one of the connection
+    tcp->handlers = &connection->handler;
+}
+
+/// @brief h2 when the client offers it, http/1.1 otherwise
+static int kyros_http_alpn_select(SSL* ssl, const unsigned char** out, unsigned char* out_length, const unsigned char* in, unsigned int in_length, void* arg)
+{
+    static const unsigned char protocols[] = "\x02h2\x08http/1.1";
+    if (SSL_select_next_proto((unsigned char**)out, out_length, protocols, sizeof(protocols) - 1, in, in_length) != OPENSSL_NPN_NEGOTIATED) {
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    return SSL_TLSEXT_ERR_OK;
+}
+
+///
+/// Public API
+///
+
+kyros_http_server* kyros_http_server_listen(kyros_loop* loop, kyros_socket_source source, kryos_socket_options options, kyros_http_server_options http_options)
+{
+    m_assert(http_options.onrequest, "kyros_http_server_listen needs onrequest");
+    auto server = (kyros_http_server*)kyros_calloc(1, sizeof(kyros_http_server));
+    server->handler = (kyros_socket_handler) { .ctx = server, .onstatus = kyros_http_server_onstatus, .ref_count = 1 };
+    server->options = http_options;
+    if (!server->options.max_header_size) {
+        server->options.max_header_size = KYROS_HTTP_MAX_HEADER_SIZE;
+    }
+    if (!server->options.max_body_size) {
+        server->options.max_body_size = KYROS_HTTP_MAX_BODY_SIZE;
+    }
+    server->loop = loop;
+    server->listener = kyros_socket_listen(loop, source, options, &server->handler);
+    if (!server->listener.tagged_ptr) {
+        kyros_free(server);
+        return NULL;
+    }
+    if (http_options.http2 && options.tls) {
+        SSL_CTX_set_alpn_select_cb(options.tls, kyros_http_alpn_select, NULL);
+    }
+    return server;
+}
+
+bool kyros_http_server_listen_http3(kyros_http_server* server, kyros_socket_source source, SSL_CTX* tls, kyros_quic_options quic_options)
+{
+    m_assert(!server->quic_listener, "kyros_http_server_listen_http3 called twice");
+    if (server->closed) {
+        return false;
+    }
+    if (!quic_options.alpn) {
+        quic_options.alpn = "h3";
+    }
+    server->quic_listener = kyros_quic_listen(server->loop, source, tls, quic_options, kyros_http3_handler(server));
+    return server->quic_listener;
+}
+
+void kyros_http_server_close(kyros_http_server* server)
+{
+    if (server->closed) {
+        return;
+    }
+    server->closed = true;
+    kyros_socket_close(server->listener);
+    if (server->quic_listener) {
+        // the HTTP/3 connections close with it, their streams are aborted
+        kyros_quic_listener_close(server->quic_listener);
+        server->quic_listener = NULL;
+    }
+    server->handler.ref_count--;
+    kyros_http_server_release(server);
+}
+
+const char* kyros_http_request_get_header(kyros_http_request* request, const char* name, uint32_t name_length, uint32_t* length)
+{
+    for (uint32_t i = 0; i < request->header_count; i++) {
+        auto header = &request->headers[i];
+        if (kyros_http_header_name_equals(header->name, header->name_length, name, name_length)) {
+            *length = header->value_length;
+            return header->value;
+        }
+    }
+    return NULL;
+}
+
+void kyros_http_response_write_status(kyros_http_response* response, uint16_t status)
+{
+    if (response->version == 2) {
+        kyros_http2_write_status(kyros_http2_stream_from_response(response), status);
+        return;
+    }
+    if (response->version == 3) {
+        kyros_http3_write_status(kyros_http3_stream_from_response(response), status);
+        return;
+    }
+    auto connection = kyros_http_connection_from_response(response);
+    m_assert(connection->responding && !connection->status_written, "kyros_http_response_write_status must come first");
+    if (connection->closed) {
+        return;
+    }
+    kyros_http_write_status_line(connection, status);
+}
+
+void kyros_http_response_write_header(kyros_http_response* response, const char* name, uint32_t name_length, const char* value, uint32_t value_length)
+{
+    if (response->version == 2) {
+        kyros_http2_write_header(kyros_http2_stream_from_response(response), name, name_length, value, value_length);
+        return;
+    }
+    if (response->version == 3) {
+        kyros_http3_write_header(kyros_http3_stream_from_response(response), name, name_length, value, value_length);
+        return;
+    }
+    auto connection = kyros_http_connection_from_response(response);
+    m_assert(connection->responding && !connection->headers_ended, "kyros_http_response_write_header after the body");
+    if (connection->closed) {
+        return;
+    }
+    if (!connection->status_written) {
+        kyros_http_write_status_line(connection, 200);
+    }
+    if (kyros_http_header_name_equals(name, name_length, "content-length", 14)) {
+        connection->has_content_length = true;
+    } else if (kyros_http_header_name_equals(name, name_length, "connection", 10)) {
+        connection->has_connection = true;
+        connection->keep_alive = connection->keep_alive && kyros_http_header_name_equals(value, value_length, "keep-alive", 10);
+    }
+    auto out = kyros_http_output(connection, (uint64_t)name_length + value_length + 4);
+    memcpy(out, name, name_length);
+    memcpy(out + name_length, ": ", 2);
+    memcpy(out + name_length + 2, value, value_length);
+    memcpy(out + name_length + 2 + value_length, "\r\n", 2);
+}
+
+bool kyros_http_response_write(kyros_http_response* response, const char* data, uint64_t length)
+{
+    if (response->version == 2) {
+        return kyros_http2_write(kyros_http2_stream_from_response(response), data, length);
+    }
+    if (response->version == 3) {
+        return kyros_http3_write(kyros_http3_stream_from_response(response), data, length);
+    }
+    auto connection = kyros_http_connection_from_response(response);
+    m_assert(connection->responding, "kyros_http_response_write after end");
+    if (connection->closed) {
+        return false;
+    }
+    // out of a batch (answered later) it is sent right away
+    auto entered = !connection->in_batch;
+    connection->in_batch = true;
+    if (!connection->headers_ended) {
+        kyros_http_end_headers(connection, false, 0);
+    }
+    if (length && !connection->head_request && !connection->bodyless_status) {
+        if (connection->chunked) {
+            kyros_http_write_chunk(connection, data, length);
+        } else {
+            kyros_http_append_body(connection, data, length);
+        }
+    }
+    if (entered && !kyros_http_connection_leave(connection)) {
+        return false;
+    }
+    return kyros_http_connection_writable(connection);
+}
+
+bool kyros_http_response_end(kyros_http_response* response, const char* data, uint64_t length)
+{
+    if (response->version == 2) {
+        return kyros_http2_end(kyros_http2_stream_from_response(response), data, length);
+    }
+    if (response->version == 3) {
+        return kyros_http3_end(kyros_http3_stream_from_response(response), data, length);
+    }
+    auto connection = kyros_http_connection_from_response(response);
+    m_assert(connection->responding, "kyros_http_response_end called twice");
+    if (connection->closed) {
+        return false;
+    }
+    auto entered = !connection->in_batch;
+    connection->in_batch = true;
+    auto has_body = !connection->head_request && !connection->bodyless_status;
+    if (!connection->headers_ended) {
+        kyros_http_end_headers(connection, true, length);
+        if (length && has_body) {
+            kyros_http_append_body(connection, data, length);
+        }
+    } else if (connection->chunked) {
+        if (length) {
+            kyros_http_write_chunk(connection, data, length);
+        }
+        kyros_http_append(connection, "0\r\n\r\n", 5);
+    } else if (length && has_body) {
+        kyros_http_append_body(connection, data, length);
+    }
+
+    connection->responding = false;
+    connection->status_written = false;
+    connection->headers_ended = false;
+    connection->chunked = false;
+    connection->has_content_length = false;
+    connection->has_connection = false;
+    connection->bodyless_status = false;
+    connection->onabort = NULL;
+    connection->onabort_ctx = NULL;
+    if (!connection->keep_alive && !connection->closed) {
+        connection->closing = true;
+        kyros_http_output(connection, 0);
+        kyros_http_server_flush(connection->server, true);
+    }
+    if (!entered) {
+        // the batch goes on with the next pipelined request
+        return kyros_http_connection_writable(connection);
+    }
+    if (!kyros_http_connection_leave(connection)) {
+        return false;
+    }
+    if (!connection->closing) {
+        if (connection->input_length) {
+            // what was pipelined behind this response, not from inside the caller
+            connection->resume_scheduled = true;
+            kyros_loop_defer(connection->server->loop, kyros_http_connection_resume, connection);
+        } else {
+            kyros_socket_resume(connection->socket);
+        }
+    }
+    return kyros_http_connection_writable(connection);
+}
+
+void kyros_http_response_onabort(kyros_http_response* response, void (*onabort)(kyros_http_response* response, void* ctx), void* ctx)
+{
+    if (response->version == 2) {
+        auto stream = kyros_http2_stream_from_response(response);
+        stream->onabort = onabort;
+        stream->onabort_ctx = ctx;
+        return;
+    }
+    if (response->version == 3) {
+        auto stream = kyros_http3_stream_from_response(response);
+        stream->onabort = onabort;
+        stream->onabort_ctx = ctx;
+        return;
+    }
+    auto connection = kyros_http_connection_from_response(response);
+    connection->onabort = onabort;
+    connection->onabort_ctx = ctx;
+}
+
+kyros_socket kyros_http_response_get_socket(kyros_http_response* response)
+{
+    if (response->version == 2) {
+        return kyros_http2_stream_from_response(response)->connection->socket;
+    }
+    if (response->version == 3) {
+        return kyros_quic_get_socket(kyros_http3_stream_from_response(response)->connection->quic);
+    }
+    return kyros_http_connection_from_response(response)->socket;
+}
@@ -0,0 +1,1342 @@
+#include <kyros.h>
+#include <kyros_internal.h>
+
+#include <string.h>
+
+// RFC 9113, every stream of a connection writes its frames in the connection output and the loop hooks
+// send it with a single write per iteration, so the DATA of many streams ends up in one TLS record
+
+#define KYROS_HTTP2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define KYROS_HTTP2_FRAME_HEADER 9
+#define KYROS_HTTP2_DEFAULT_WINDOW 65535
+#define KYROS_HTTP2_MAX_WINDOW 0x7fffffff
+#define KYROS_HTTP2_TABLE_SIZE 4096 // the HPACK dynamic table of the encoder never grows past the default
+
+typedef enum {
+    KYROS_HTTP2_DATA = 0x0,
+    KYROS_HTTP2_HEADERS = 0x1,
+    KYROS_HTTP2_PRIORITY = 0x2,
+    KYROS_HTTP2_RST_STREAM = 0x3,
+    KYROS_HTTP2_SETTINGS = 0x4,
+    KYROS_HTTP2_PUSH_PROMISE = 0x5,
+    KYROS_HTTP2_PING = 0x6,
+    KYROS_HTTP2_GOAWAY = 0x7,
+    KYROS_HTTP2_WINDOW_UPDATE = 0x8,
+    KYROS_HTTP2_CONTINUATION = 0x9,
+} kyros_http2_frame_type;
+
+typedef enum {
+    KYROS_HTTP2_FLAG_END_STREAM = 0x1,
+    KYROS_HTTP2_FLAG_ACK = 0x1,
+    KYROS_HTTP2_FLAG_END_HEADERS = 0x4,
+    KYROS_HTTP2_FLAG_PADDED = 0x8,
+    KYROS_HTTP2_FLAG_PRIORITY = 0x20,
+} kyros_http2_flag;
+
+typedef enum {
+    KYROS_HTTP2_NO_ERROR = 0x0,
+    KYROS_HTTP2_PROTOCOL_ERROR = 0x1,
+    KYROS_HTTP2_INTERNAL_ERROR = 0x2,
+    KYROS_HTTP2_FLOW_CONTROL_ERROR = 0x3,
+    KYROS_HTTP2_STREAM_CLOSED = 0x5,
+    KYROS_HTTP2_FRAME_SIZE_ERROR = 0x6,
+    KYROS_HTTP2_REFUSED_STREAM = 0x7,
+    KYROS_HTTP2_CANCEL = 0x8,
+    KYROS_HTTP2_COMPRESSION_ERROR = 0x9,
+    KYROS_HTTP2_ENHANCE_YOUR_CALM = 0xb,
+} kyros_http2_error;
+
+typedef enum {
+    KYROS_HTTP2_SETTINGS_HEADER_TABLE_SIZE = 0x1,
+    KYROS_HTTP2_SETTINGS_ENABLE_PUSH = 0x2,
+    KYROS_HTTP2_SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+    KYROS_HTTP2_SETTINGS_INITIAL_WINDOW_SIZE = 0x4,
+    KYROS_HTTP2_SETTINGS_MAX_FRAME_SIZE = 0x5,
+    KYROS_HTTP2_SETTINGS_MAX_HEADER_LIST_SIZE = 0x6,
+} kyros_http2_setting;
+
+static inline uint32_t kyros_http2_read24(const char* p)
+{
+    auto u = (const uint8_t*)p;
+    return (uint32_t)u[0] << 16 | (uint32_t)u[1] << 8 | u[2];
+}
+
+static inline uint32_t kyros_http2_read32(const char* p)
+{
+    auto u = (const uint8_t*)p;
+    return (uint32_t)u[0] << 24 | (uint32_t)u[1] << 16 | (uint32_t)u[2] << 8 | u[3];
+}
+
+static inline void kyros_http2_write32(char* p, uint32_t value)
+{
+    p[0] = (char)(value >> 24);
+    p[1] = (char)(value >> 16);
+    p[2] = (char)(value >> 8);
+    p[3] = (char)value;
+}
+
+static inline void kyros_http2_frame_header(char* out, uint32_t length, kyros_http2_frame_type type, uint8_t flags, uint32_t stream_id)
+{
+    out[0] = (char)(length >> 16);
+    out[1] = (char)(length >> 8);
+    out[2] = (char)length;
+    out[3] = (char)type;
+    out[4] = (char)flags;
+    kyros_http2_write32(out + 5, stream_id);
+}
+
+///
+/// Output
+///
+
+static void kyros_http2_queue(kyros_http2_connection* connection)
+{
+    if (connection->send_queued || connection->closed || connection->ended) {
+        return;
+    }
+    auto internal = kyros_get_internal_loop(connection->server->loop);
+    connection->send_queued = true;
+    connection->send_next = internal->http2_sends;
+    internal->http2_sends = connection;
+}
+
+/// @brief room for length bytes at the end of the output, output_length is not moved
+static char* kyros_http2_reserve(kyros_http2_connection* connection, uint64_t length)
+{
+    auto needed = connection->output_length + length;
+    if (needed > connection->output_capacity) {
+        auto capacity = connection->output_capacity ? connection->output_capacity * 2 : KYROS_HTTP2_MAX_FRAME_SIZE;
+        while (capacity < needed) {
+            capacity *= 2;
+        }
+        connection->output = (char*)kyros_resize(connection->output, capacity);
+        connection->output_capacity = capacity;
+    }
+    kyros_http2_queue(connection);
+    return connection->output + connection->output_length;
+}
+
+static inline char* kyros_http2_output(kyros_http2_connection* connection, uint64_t length)
+{
+    auto out = kyros_http2_reserve(connection, length);
+    connection->output_length += length;
+    return out;
+}
+
+static void kyros_http2_send_rst(kyros_http2_connection* connection, uint32_t stream_id, kyros_http2_error code)
+{
+    auto out = kyros_http2_output(connection, KYROS_HTTP2_FRAME_HEADER + 4);
+    kyros_http2_frame_header(out, 4, KYROS_HTTP2_RST_STREAM, 0, stream_id);
+    kyros_http2_write32(out + KYROS_HTTP2_FRAME_HEADER, code);
+}
+
+static void kyros_http2_send_window_update(kyros_http2_connection* connection, uint32_t stream_id, uint32_t increment)
+{
+    auto out = kyros_http2_output(connection, KYROS_HTTP2_FRAME_HEADER + 4);
+    kyros_http2_frame_header(out, 4, KYROS_HTTP2_WINDOW_UPDATE, 0, stream_id);
+    kyros_http2_write32(out + KYROS_HTTP2_FRAME_HEADER, increment);
+}
+
+/// @brief the output is sent then the socket ends, nothing else is processed
+static void kyros_http2_connection_finish(kyros_http2_connection* connection)
+{
+    connection->ending = true;
+    kyros_http2_queue(connection);
+}
+
+/// @brief connection error, GOAWAY with the last stream we processed
+static void kyros_http2_connection_error(kyros_http2_connection* connection, kyros_http2_error code)
+{
+    if (connection->ending) {
+        return;
+    }
+    auto out = kyros_http2_output(connection, KYROS_HTTP2_FRAME_HEADER + 8);
+    kyros_http2_frame_header(out, 8, KYROS_HTTP2_GOAWAY, 0, 0);
+    kyros_http2_write32(out + KYROS_HTTP2_FRAME_HEADER, connection->last_stream_id);
+    kyros_http2_write32(out + KYROS_HTTP2_FRAME_HEADER + 4, code);
+    kyros_http2_connection_finish(connection);
+}
+
+static inline bool kyros_http2_connection_writable(kyros_http2_connection* connection)
+{
+    if (connection->closed || connection->ending) {
+        return false;
+    }
+    auto tcp = (kyros_socket_internal_tcp*)kyros_get_socket_internal(connection->socket);
+    return !tcp->socket.over_high_watermark;
+}
+
+///
+/// Streams
+///
+
+static kyros_http2_stream** kyros_http2_stream_slot(kyros_http2_connection* connection, uint32_t id)
+{
+    // never full, there are twice as many slots as streams
+    uint32_t mask = KYROS_HTTP2_STREAM_TABLE - 1;
+    for (uint32_t i = (id >> 1) & mask;; i = (i + 1) & mask) {
+        auto stream = connection->streams[i];
+        if (!stream || stream->id == id) {
+            return &connection->streams[i];
+        }
+    }
+}
+
+static inline kyros_http2_stream* kyros_http2_stream_find(kyros_http2_connection* connection, uint32_t id)
+{
+    return *kyros_http2_stream_slot(connection, id);
+}
+
+static kyros_http2_stream* kyros_http2_stream_create(kyros_http2_connection* connection, uint32_t id)
+{
+    auto stream = (kyros_http2_stream*)kyros_calloc(1, sizeof(kyros_http2_stream));
+    stream->response.version = 2;
+    stream->connection = connection;
+    stream->id = id;
+    stream->send_window = connection->peer_initial_window;
+    stream->recv_window = KYROS_HTTP2_STREAM_WINDOW;
+    stream->content_length = -1;
+    *kyros_http2_stream_slot(connection, id) = stream;
+    connection->stream_count++;
+    return stream;
+}
+
+static void kyros_http2_stream_free_request(kyros_http2_stream* stream)
+{
+    if (stream->head) {
+        kyros_free(stream->head);
+        stream->head = NULL;
+    }
+    if (stream->headers) {
+        kyros_free(stream->headers);
+        stream->headers = NULL;
+    }
+    if (stream->body) {
+        kyros_free(stream->body);
+        stream->body = NULL;
+    }
+}
+
+/// @brief freed once out of the table and the user is done with the response
+static void kyros_http2_stream_release(kyros_http2_stream* stream)
+{
+    if (!stream->closed || stream->responding || stream->in_dispatch) {
+        return;
+    }
+    kyros_http2_stream_free_request(stream);
+    if (stream->fields) {
+        kyros_free(stream->fields);
+    }
+    if (stream->pending) {
+        kyros_free(stream->pending);
+    }
+    kyros_free(stream);
+}
+
+static void kyros_http2_stream_unblock(kyros_http2_stream* stream)
+{
+    auto connection = stream->connection;
+    kyros_http2_stream* previous = NULL;
+    for (auto current = connection->blocked_head; current != stream; current = current->blocked_next) {
+        previous = current;
+    }
+    if (previous) {
+        previous->blocked_next = stream->blocked_next;
+    } else {
+        connection->blocked_head = stream->blocked_next;
+    }
+    if (connection->blocked_tail == stream) {
+        connection->blocked_tail = previous;
+    }
+    stream->blocked_next = NULL;
+    stream->blocked = false;
+}
+
+/// @brief out of the stream table, frames for it are ignored from now on
+static void kyros_http2_stream_remove(kyros_http2_stream* stream)
+{
+    if (stream->closed) {
+        return;
+    }
+    auto connection = stream->connection;
+    stream->closed = true;
+    if (stream->blocked) {
+        kyros_http2_stream_unblock(stream);
+    }
+    // backward shift, the entries after the hole that can move closer to their home slot do
+    uint32_t mask = KYROS_HTTP2_STREAM_TABLE - 1;
+    auto hole = (uint32_t)(kyros_http2_stream_slot(connection, stream->id) - connection->streams);
+    connection->streams[hole] = NULL;
+    for (auto i = (hole + 1) & mask; connection->streams[i]; i = (i + 1) & mask) {
+        auto home = (connection->streams[i]->id >> 1) & mask;
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            connection->streams[hole] = connection->streams[i];
+            connection->streams[i] = NULL;
+            hole = i;
+        }
+    }
+    connection->stream_count--;
+    if (connection->goaway_received && !connection->stream_count) {
+        kyros_http2_connection_finish(connection);
+    }
+}
+
+static inline void kyros_http2_stream_close(kyros_http2_stream* stream)
+{
+    kyros_http2_stream_remove(stream);
+    kyros_http2_stream_release(stream);
+}
+
+/// @brief reset by the peer or the connection is gone, stream is invalid after it
+static void kyros_http2_stream_abort(kyros_http2_stream* stream)
+{
+    kyros_http2_stream_remove(stream);
+    if (stream->responding) {
+        if (stream->onabort) {
+            stream->onabort(&stream->response, stream->onabort_ctx);
+        }
+        stream->responding = false;
+    }
+    kyros_http2_stream_release(stream);
+}
+
+/// @brief stream error, the connection goes on
+static void kyros_http2_stream_reset(kyros_http2_stream* stream, kyros_http2_error code)
+{
+    kyros_http2_send_rst(stream->connection, stream->id, code);
+    kyros_http2_stream_abort(stream);
+}
+
+static void kyros_http2_stream_sent_end(kyros_http2_stream* stream)
+{
+    stream->end_sent = true;
+    if (stream->request_ended) {
+        kyros_http2_stream_close(stream);
+    }
+}
+
+///
+/// Sending
+///
+
+/// @brief HEADERS frame around the block at out + KYROS_HTTP2_FRAME_HEADER, split in CONTINUATION frames if the peer needs it, returns the bytes
+static uint64_t kyros_http2_frame_block(kyros_http2_connection* connection, char* out, uint32_t stream_id, uint64_t length, bool end_stream)
+{
+    uint8_t end_flag = end_stream ? KYROS_HTTP2_FLAG_END_STREAM : 0;
+    uint64_t max = connection->peer_max_frame_size;
+    if (length <= max) {
+        kyros_http2_frame_header(out, (uint32_t)length, KYROS_HTTP2_HEADERS, KYROS_HTTP2_FLAG_END_HEADERS | end_flag, stream_id);
+        return KYROS_HTTP2_FRAME_HEADER + length;
+    }
+    // each fragment moves right by the frame headers before it, from the last so nothing is overwritten
+    auto frames = (length + max - 1) / max;
+    for (auto i = frames - 1; i > 0; i--) {
+        auto fragment = length - i * max < max ? length - i * max : max;
+        auto frame = out + i * (KYROS_HTTP2_FRAME_HEADER + max);
+        memmove(frame + KYROS_HTTP2_FRAME_HEADER, out + KYROS_HTTP2_FRAME_HEADER + i * max, fragment);
+        kyros_http2_frame_header(frame, (uint32_t)fragment, KYROS_HTTP2_CONTINUATION, i == frames - 1 ? KYROS_HTTP2_FLAG_END_HEADERS : 0, stream_id);
+    }
+    kyros_http2_frame_header(out, (uint32_t)max, KYROS_HTTP2_HEADERS, end_flag, stream_id);
+    return length + frames * KYROS_HTTP2_FRAME_HEADER;
+}
+
+static unsigned char* kyros_http2_encode(kyros_http2_connection* connection, unsigned char* dst, unsigned char* end, const char* buffer, uint32_t name_length, uint32_t value_length)
+{
+    lsxpack_header_t header;
+    lsxpack_header_set_offset2(&header, buffer, 0, name_length, name_length, value_length);
+    auto next = lshpack_enc_encode(&connection->encoder, dst, end, &header);
+    m_assert(next != dst, "kyros_http2 header block reserve is too small");
+    return next;
+}
+
+/// @brief the HEADERS of the response, content-length is added when ending without one
+static void kyros_http2_send_headers(kyros_http2_stream* stream, bool end_stream, bool ending, uint64_t length)
+{
+    auto connection = stream->connection;
+    auto server = connection->server;
+    kyros_http_server_refresh_date(server);
+    // a field encodes to at most its length + 11 and each stored field has 8 bytes of lengths
+    uint64_t block_reserve = stream->fields_length + stream->fields_length / 2 + 128;
+    auto reserve = block_reserve + KYROS_HTTP2_FRAME_HEADER * (block_reserve / connection->peer_max_frame_size + 2);
+    auto out = kyros_http2_reserve(connection, reserve);
+    auto start = (unsigned char*)out + KYROS_HTTP2_FRAME_HEADER;
+    auto end = (unsigned char*)out + reserve;
+    auto dst = start;
+    if (connection->table_size_update) {
+        // dynamic table size update, 001 and a 5 bit prefix integer
+        connection->table_size_update = false;
+        auto capacity = connection->encoder_capacity;
+        if (capacity < 31) {
+            *dst++ = (unsigned char)(0x20 | capacity);
+        } else {
+            *dst++ = 0x3f;
+            capacity -= 31;
+            while (capacity >= 128) {
+                *dst++ = (unsigned char)(0x80 | (capacity & 0x7f));
+                capacity >>= 7;
+            }
+            *dst++ = (unsigned char)capacity;
+        }
+    }
+    // the encoder takes offsets in one buffer, names and values are put together
+    char field[48];
+    auto status = stream->status ? stream->status : 200;
+    memcpy(field, ":status", 7);
+    field[7] = (char)('0' + status / 100);
+    field[8] = (char)('0' + status / 10 % 10);
+    field[9] = (char)('0' + status % 10);
+    dst = kyros_http2_encode(connection, dst, end, field, 7, 3);
+    memcpy(field, "date", 4);
+    // "Date: " and "\r\n" are not part of the value
+    memcpy(field + 4, server->date + 6, KYROS_HTTP_DATE_LENGTH - 8);
+    dst = kyros_http2_encode(connection, dst, end, field, 4, KYROS_HTTP_DATE_LENGTH - 8);
+    for (uint32_t offset = 0; offset < stream->fields_length;) {
+        uint32_t lengths[2];
+        memcpy(lengths, stream->fields + offset, sizeof(lengths));
+        dst = kyros_http2_encode(connection, dst, end, stream->fields + offset + sizeof(lengths), lengths[0], lengths[1]);
+        offset += (uint32_t)sizeof(lengths) + lengths[0] + lengths[1];
+    }
+    if (ending && !stream->has_content_length && !stream->bodyless_status) {
+        memcpy(field, "content-length", 14);
+        dst = kyros_http2_encode(connection, dst, end, field, 14, kyros_http_format_decimal(field + 14, length));
+    }
+    connection->output_length += kyros_http2_frame_block(connection, out, stream->id, (uint64_t)(dst - start), end_stream);
+    stream->headers_sent = true;
+    if (stream->fields) {
+        kyros_free(stream->fields);
+        stream->fields = NULL;
+        stream->fields_length = 0;
+        stream->fields_capacity = 0;
+    }
+}
+
+/// @brief DATA frames of what both windows allow, returns the bytes sent
+static uint64_t kyros_http2_send_data(kyros_http2_stream* stream, const char* data, uint64_t length, bool end_stream)
+{
+    auto connection = stream->connection;
+    uint64_t sent = 0;
+    for (;;) {
+        auto window = stream->send_window < connection->send_window ? stream->send_window : connection->send_window;
+        auto chunk = length - sent;
+        if (chunk > connection->peer_max_frame_size) {
+            chunk = connection->peer_max_frame_size;
+        }
+        if (window <= 0) {
+            chunk = 0;
+        } else if (chunk > (uint64_t)window) {
+            chunk = (uint64_t)window;
+        }
+        auto last = sent + chunk == length;
+        if (!chunk && !last) {
+            return sent;
+        }
+        auto out = kyros_http2_output(connection, KYROS_HTTP2_FRAME_HEADER + chunk);
+        kyros_http2_frame_header(out, (uint32_t)chunk, KYROS_HTTP2_DATA, last && end_stream ? KYROS_HTTP2_FLAG_END_STREAM : 0, stream->id);
+        memcpy(out + KYROS_HTTP2_FRAME_HEADER, data + sent, chunk);
+        sent += chunk;
+        stream->send_window -= (int64_t)chunk;
+        connection->send_window -= (int64_t)chunk;
+        if (last) {
+            return sent;
+        }
+    }
+}
+
+static void kyros_http2_stream_buffer(kyros_http2_stream* stream, const char* data, uint64_t length)
+{
+    if (stream->pending_offset) {
+        memmove(stream->pending, stream->pending + stream->pending_offset, stream->pending_length);
+        stream->pending_offset = 0;
+    }
+    auto needed = stream->pending_length + length;
+    if (needed > stream->pending_capacity) {
+        auto capacity = stream->pending_capacity ? stream->pending_capacity * 2 : KYROS_HTTP2_MAX_FRAME_SIZE;
+        while (capacity < needed) {
+            capacity *= 2;
+        }
+        stream->pending = (char*)kyros_resize(stream->pending, capacity);
+        stream->pending_capacity = capacity;
+    }
+    memcpy(stream->pending + stream->pending_length, data, length);
+    stream->pending_length = needed;
+}
+
+/// @brief body of the response, what the windows do not allow yet waits in the stream (in order)
+static void kyros_http2_stream_send(kyros_http2_stream* stream, const char* data, uint64_t length, bool end_stream)
+{
+    if (stream->blocked) {
+        kyros_http2_stream_buffer(stream, data, length);
+        stream->end_pending = end_stream;
+        return;
+    }
+    auto sent = kyros_http2_send_data(stream, data, length, end_stream);
+    if (sent < length) {
+        kyros_http2_stream_buffer(stream, data + sent, length - sent);
+        stream->end_pending = end_stream;
+        auto connection = stream->connection;
+        stream->blocked = true;
+        if (connection->blocked_tail) {
+            connection->blocked_tail->blocked_next = stream;
+        } else {
+            connection->blocked_head = stream;
+        }
+        connection->blocked_tail = stream;
+        return;
+    }
+    if (end_stream) {
+        kyros_http2_stream_sent_end(stream);
+    }
+}
+
+/// @brief the windows grew, the blocked streams send in the order they got blocked
+static void kyros_http2_connection_unblock(kyros_http2_connection* connection)
+{
+    auto stream = connection->blocked_head;
+    while (stream && connection->send_window > 0) {
+        auto next = stream->blocked_next;
+        if (stream->send_window > 0) {
+            auto sent = kyros_http2_send_data(stream, stream->pending + stream->pending_offset, stream->pending_length, stream->end_pending);
+            stream->pending_offset += sent;
+            stream->pending_length -= sent;
+            if (!stream->pending_length) {
+                stream->pending_offset = 0;
+                kyros_http2_stream_unblock(stream);
+                if (stream->end_pending) {
+                    kyros_http2_stream_sent_end(stream);
+                }
+            }
+        }
+        stream = next;
+    }
+}
+
+///
+/// Receiving
+///
+
+/// @brief fields of a header block into server->decoded and server->field_offsets, returns the count or -1 on a compression error
+/// the decoder must see every block, past max_header_size (or KYROS_HTTP2_MAX_FIELDS) the fields are decoded but not kept
+static int32_t kyros_http2_decode(kyros_http2_connection* connection, const char* block, uint32_t length, uint32_t* size)
+{
+    auto server = connection->server;
+    auto max_header_size = server->options.max_header_size;
+    auto src = (const unsigned char*)block;
+    auto end = src + length;
+    uint32_t offset = 0;
+    uint32_t total = 0;
+    int32_t count = 0;
+    auto grow = server->decoded_capacity < 256;
+    while (src < end) {
+        if (grow) {
+            grow = false;
+            auto capacity = server->decoded_capacity ? server->decoded_capacity * 2 : 4096;
+            // the validation reads ahead in vectors
+            server->decoded = (char*)kyros_resize(server->decoded, capacity + KYROS_RECV_BUFFER_PADDING);
+            server->decoded_capacity = capacity;
+        }
+        lsxpack_header_t header;
+        lsxpack_header_prepare_decode(&header, server->decoded + offset, 0, server->decoded_capacity - offset);
+        auto result = lshpack_dec_decode(&connection->decoder, &src, end, &header);
+        if (result == LSHPACK_ERR_MORE_BUF) {
+            if (server->decoded_capacity - offset >= LSXPACK_MAX_STRLEN) {
+                // a single field bigger than the decoder can describe
+                return -1;
+            }
+            grow = true;
+            continue;
+        }
+        if (result != LSHPACK_OK) {
+            return -1;
+        }
+        auto field_size = (uint32_t)lsxpack_header_get_dec_size(&header);
+        total += field_size;
+        if (total <= max_header_size && count < KYROS_HTTP2_MAX_FIELDS) {
+            auto field = server->field_offsets[count];
+            field[0] = offset + header.name_offset;
+            field[1] = header.name_len;
+            field[2] = offset + header.val_offset;
+            field[3] = header.val_len;
+            offset += field_size;
+        }
+        count++;
+    }
+    *size = total;
+    return count;
+}
+
+/// @brief request of the fields kyros_http2_decode kept, false if it is malformed
+static bool kyros_http2_stream_parse(kyros_http2_stream* stream, uint32_t count, kyros_http_header* headers, uint32_t* header_count)
+{
+    auto server = stream->connection->server;
+    kyros_http_fields fields = { .content_length = -1 };
+    if (!kyros_http_parse_fields(server->decoded, server->field_offsets, count, &fields, headers, header_count)) {
+        return false;
+    }
+    stream->method = fields.method;
+    stream->target = fields.target;
+    stream->method_length = fields.method_length;
+    stream->target_length = fields.target_length;
+    stream->content_length = fields.content_length;
+    return true;
+}
+
+static void kyros_http2_stream_dispatch(kyros_http2_stream* stream, const kyros_http_header* headers, uint32_t header_count)
+{
+    auto server = stream->connection->server;
+    kyros_http_request request = {
+        .method = stream->method,
+        .target = stream->target,
+        .headers = headers,
+        .body = stream->body_length ? stream->body : NULL,
+        .body_length = stream->body_length,
+        .method_length = stream->method_length,
+        .target_length = stream->target_length,
+        .header_count = header_count,
+        .minor_version = 0,
+        .keep_alive = true,
+        .http2 = true,
+    };
+    stream->head_request = stream->method_length == 4 && !memcmp(stream->method, "HEAD", 4);
+    stream->responding = true;
+    stream->in_dispatch = true;
+    server->options.onrequest(&request, &stream->response, server->options.ctx);
+    stream->in_dispatch = false;
+    // the request is only valid during onrequest
+    kyros_http2_stream_free_request(stream);
+    stream->method = NULL;
+    stream->target = NULL;
+    kyros_http2_stream_release(stream);
+}
+
+/// @brief answer with an error before the request is complete, the rest of it is refused with RST_STREAM NO_ERROR
+static void kyros_http2_stream_fail(kyros_http2_stream* stream, uint16_t status)
+{
+    auto connection = stream->connection;
+    auto id = stream->id;
+    bool request_ended = stream->request_ended;
+    stream->responding = true;
+    kyros_http2_write_status(stream, status);
+    // closes the stream if the request ended
+    kyros_http2_end(stream, NULL, 0);
+    if (!request_ended) {
+        kyros_http2_send_rst(connection, id, KYROS_HTTP2_NO_ERROR);
+        kyros_http2_stream_close(stream);
+    }
+}
+
+static void kyros_http2_stream_request_end(kyros_http2_stream* stream, const kyros_http_header* headers, uint32_t header_count)
+{
+    stream->request_ended = true;
+    if (stream->content_length >= 0 && (uint64_t)stream->content_length != stream->body_length) {
+        kyros_http2_stream_reset(stream, KYROS_HTTP2_PROTOCOL_ERROR);
+        return;
+    }
+    kyros_http2_stream_dispatch(stream, headers, header_count);
+}
+
+static void kyros_http2_on_header_block(kyros_http2_connection* connection, const char* block, uint32_t length)
+{
+    auto id = connection->block_stream;
+    bool end_stream = connection->block_end_stream;
+    connection->block_stream = 0;
+    connection->block_length = 0;
+    uint32_t size;
+    auto count = kyros_http2_decode(connection, block, length, &size);
+    if (count < 0) {
+        kyros_http2_connection_error(connection, KYROS_HTTP2_COMPRESSION_ERROR);
+        return;
+    }
+    auto stream = kyros_http2_stream_find(connection, id);
+    if (stream) {
+        // trailers, decoded for the dynamic table and dropped
+        if (stream->request_ended) {
+            kyros_http2_stream_reset(stream, KYROS_HTTP2_STREAM_CLOSED);
+        } else if (!end_stream) {
+            kyros_http2_stream_reset(stream, KYROS_HTTP2_PROTOCOL_ERROR);
+        } else {
+            kyros_http2_stream_request_end(stream, stream->headers, stream->header_count);
+        }
+        return;
+    }
+    if (!(id & 1) || id <= connection->last_stream_id) {
+        kyros_http2_connection_error(connection, id & 1 ? KYROS_HTTP2_STREAM_CLOSED : KYROS_HTTP2_PROTOCOL_ERROR);
+        return;
+    }
+    connection->last_stream_id = id;
+    if (connection->stream_count >= KYROS_HTTP2_MAX_STREAMS) {
+        kyros_http2_send_rst(connection, id, KYROS_HTTP2_REFUSED_STREAM);
+        return;
+    }
+    auto server = connection->server;
+    stream = kyros_http2_stream_create(connection, id);
+    stream->request_ended = end_stream;
+    if (size > server->options.max_header_size || count > KYROS_HTTP2_MAX_FIELDS) {
+        kyros_http2_stream_fail(stream, 431);
+        return;
+    }
+    kyros_http_header headers[KYROS_HTTP2_MAX_FIELDS + 1];
+    uint32_t header_count;
+    if (!kyros_http2_stream_parse(stream, (uint32_t)count, headers, &header_count)) {
+        kyros_http2_stream_reset(stream, KYROS_HTTP2_PROTOCOL_ERROR);
+        return;
+    }
+    if (stream->content_length > 0 && (uint64_t)stream->content_length > server->options.max_body_size) {
+        kyros_http2_stream_fail(stream, 413);
+        return;
+    }
+    if (end_stream) {
+        // most requests, straight from the decoded block
+        kyros_http2_stream_request_end(stream, headers, header_count);
+        return;
+    }
+    // the body comes in DATA frames, the head moves to the stream
+    auto decoded = server->decoded;
+    stream->head = (char*)kyros_alloc(size ? size : 1);
+    memcpy(stream->head, decoded, size);
+    stream->headers = (kyros_http_header*)kyros_alloc(sizeof(kyros_http_header) * (header_count ? header_count : 1));
+    stream->header_count = header_count;
+    for (uint32_t i = 0; i < header_count; i++) {
+        stream->headers[i] = (kyros_http_header) {
+            .name = kyros_http_rebase(headers[i].name, decoded, size, stream->head),
+            .value = kyros_http_rebase(headers[i].value, decoded, size, stream->head),
+            .name_length = headers[i].name_length,
+            .value_length = headers[i].value_length,
+        };
+    }
+    stream->method = kyros_http_rebase(stream->method, decoded, size, stream->head);
+    stream->target = kyros_http_rebase(stream->target, decoded, size, stream->head);
+    if (stream->content_length > 0) {
+        stream->body = (char*)kyros_alloc((uint64_t)stream->content_length);
+        stream->body_capacity = (uint64_t)stream->content_length;
+    }
+}
+
+static void kyros_http2_block_append(kyros_http2_connection* connection, const char* data, uint32_t length)
+{
+    auto needed = connection->block_length + length;
+    if (needed > connection->server->options.max_header_size + KYROS_HTTP2_MAX_FRAME_SIZE) {
+        // an endless header block
+        kyros_http2_connection_error(connection, KYROS_HTTP2_ENHANCE_YOUR_CALM);
+        return;
+    }
+    if (needed > connection->block_capacity) {
+        auto capacity = connection->block_capacity ? connection->block_capacity * 2 : KYROS_HTTP2_MAX_FRAME_SIZE;
+        while (capacity < needed) {
+            capacity *= 2;
+        }
+        connection->block = (char*)kyros_resize(connection->block, capacity);
+        connection->block_capacity = capacity;
+    }
+    memcpy(connection->block + connection->block_length, data, length);
+    connection->block_length = needed;
+}
+
+static void kyros_http2_on_headers(kyros_http2_connection* connection, uint8_t flags, uint32_t id, const char* payload, uint32_t length)
+{
+    if (!id) {
+        kyros_http2_connection_error(connection, KYROS_HTTP2_PROTOCOL_ERROR);
+        return;
+    }
+    uint32_t padding = 0;
+    if (flags & KYROS_HTTP2_FLAG_PADDED) {
+        if (!length) {
+            kyros_http2_connection_error(connection, KYROS_HTTP2_FRAME_SIZE_ERROR);
+            return;
+        }
+        padding = (uint8_t)payload[0];
+        payload++;
+        length--;
+    }
+    if (flags & KYROS_HTTP2_FLAG_PRIORITY) {
+        // stream dependency and weight, priorities are not used
+        if (length < 5) {
+            kyros_http2_connection_error(connection, KYROS_HTTP2_FRAME_SIZE_ERROR);
+            return;
+        }
+        payload += 5;
+        length -= 5;
+    }
+    if (padding > length) {
+        kyros_http2_connection_error(connection, KYROS_HTTP2_PROTOCOL_ERROR);
+        return;
+    }
+    length -= padding;
+    connection->block_stream = id;
+    connection->block_end_stream = flags & KYROS_HTTP2_FLAG_END_STREAM;
+    if (flags & KYROS_HTTP2_FLAG_END_HEADERS) {
+        kyros_http2_on_header_block(connection, payload, length);
+        return;
+    }
+    connection->block_length = 0;
+    kyros_http2_block_append(connection, payload, length);
+}
+
+static void kyros_http2_on_continuation(kyros_http2_connection* connection, uint8_t flags, uint32_t id, const char* payload, uint32_t length)
+{
+    if (id != connection->block_stream) {
+        kyros_http2_connection_error(connection, KYROS_HTTP2_PROTOCOL_ERROR);
+        return;
+    }
+    kyros_http2_block_append(connection, payload, length);
+    if (!connection->ending && (flags & KYROS_HTTP2_FLAG_END_HEADERS)) {
+        kyros_http2_on_header_block(connection, connection->block, connection->block_length);
+    }
+}
+
+static void kyros_http2_on_data(kyros_http2_connection* connection, uint8_t flags, uint32_t id, const char* payload, uint32_t length)
+{
+    if (!id) {
+        kyros_http2_connection_error(connection, KYROS_HTTP2_PROTOCOL_ERROR);
+        return;
+    }
+    // padding counts for flow control
+    auto frame_length = length;
+    if (flags & KYROS_HTTP2_FLAG_PADDED) {
+        if (!length || (uint8_t)payload[0] >= length) {
+            kyros_http2_connection_error(connection, KYROS_HTTP2_PROTOCOL_ERROR);
+            return;
+        }
+        length -= 1 + (uint8_t)payload[0];
+        payload++;
+    }
+    connection->recv_window -= frame_length;
+    if (connection->recv_window < 0) {
+        kyros_http2_connection_error(connection, KYROS_HTTP2_FLOW_CONTROL_ERROR);
+        return;
+    }
+    if (connection->recv_window <= KYROS_HTTP2_CONNECTION_WINDOW / 2) {
+        kyros_http2_send_window_update(connection, 0, (uint32_t)(KYROS_HTTP2_CONNECTION_WINDOW - connection->recv_window));
+        connection->recv_window = KYROS_HTTP2_CONNECTION_WINDOW;
+    }
+    auto stream = kyros_http2_stream_find(connection, id);
+    if (!stream || stream->request_ended) {
+        if (id > connection->last_stream_id) {
+            kyros_http2_connection_error(connection, KYROS_HTTP2_PROTOCOL_ERROR);
+        } else if (stream) {
+            kyros_http2_stream_reset(stream, KYROS_HTTP2_STREAM_CLOSED);
+        }
+        // otherwise refused or reset by us, its frames can still be in flight
+        return;
+    }
+    stream->recv_window -= frame_length;
+    if (stream->recv_window < 0) {
+        kyros_http2_stream_reset(stream, KYROS_HTTP2_FLOW_CONTROL_ERROR);
+        return;
+    }
+    auto needed = stream->body_length + length;
+    if (needed > connection->server->options.max_body_size) {
+        kyros_http2_stream_fail(stream, 413);
+        return;
+    }
+    if (needed > stream->body_capacity) {
+        auto capacity = stream->body_capacity ? stream->body_capacity * 2 : KYROS_HTTP2_MAX_FRAME_SIZE;
+        while (capacity < needed) {
+            capacity *= 2;
+        }
+        stream->body = (char*)kyros_resize(stream->body, capacity);
+        stream->body_capacity = capacity;
+    }
+    memcpy(stream->body + stream->body_length, payload, length);
+    stream->body_length = needed;
+    if (flags & KYROS_HTTP2_FLAG_END_STREAM) {
+        kyros_http2_stream_request_end(stream, stream->headers, stream->header_count);
+        return;
+    }
+    if (stream->recv_window <= KYROS_HTTP2_STREAM_WINDOW / 2) {
+        kyros_http2_send_window_update(connection, id, (uint32_t)(KYROS_HTTP2_STREAM_WINDOW - stream->recv_window));
+        stream->recv_window = KYROS_HTTP2_STREAM_WINDOW;
+    }
+}
+
+static void kyros_http2_on_settings(kyros_http2_connection* connection, uint8_t flags, uint32_t id, const char* payload, uint32_t length)
+{
+    if (id) {
+        kyros_http2_connection_error(connection, KYROS_HTTP2_PROTOCOL_ERROR);
+        return;
+    }
+    if (flags & KYROS_HTTP2_FLAG_ACK) {
+        if (length) {
+            kyros_http2_connection_error(connection, KYROS_HTTP2_FRAME_SIZE_ERROR);
+        }
+        return;
+    }
+    if (length % 6) {
+        kyros_http2_connection_error(connection, KYROS_HTTP2_FRAME_SIZE_ERROR);
+        return;
+    }
+    int64_t window_delta = 0;
+    for (uint32_t i = 0; i < length; i += 6) {
+        auto setting = (uint16_t)((uint8_t)payload[i] << 8 | (uint8_t)payload[i + 1]);
+        auto value = kyros_http2_read32(payload + i + 2);
+        switch (setting) {
+        case KYROS_HTTP2_SETTINGS_HEADER_TABLE_SIZE: {
+            auto capacity = value < KYROS_HTTP2_TABLE_SIZE ? value : KYROS_HTTP2_TABLE_SIZE;
+            if (capacity != connection->encoder_capacity) {
+                connection->encoder_capacity = capacity;
+                connection->table_size_update = true;
+                lshpack_enc_set_max_capacity(&connection->encoder, capacity);
+            }
+            break;
+        }
+        case KYROS_HTTP2_SETTINGS_ENABLE_PUSH:
+            if (value > 1) {
+                kyros_http2_connection_error(connection, KYROS_HTTP2_PROTOCOL_ERROR);
+                return;
+            }
+            break;
+        case KYROS_HTTP2_SETTINGS_INITIAL_WINDOW_SIZE:
+            if (value > KYROS_HTTP2_MAX_WINDOW) {
+                kyros_http2_connection_error(connection, KYROS_HTTP2_FLOW_CONTROL_ERROR);
+                return;
+            }
+            window_delta += (int64_t)value - connection->peer_initial_window;
+            connection->peer_initial_window = value;
+            break;
+        case KYROS_HTTP2_SETTINGS_MAX_FRAME_SIZE:
+            if (value < KYROS_HTTP2_MAX_FRAME_SIZE || value > 0xffffff) {
+                kyros_http2_connection_error(connection, KYROS_HTTP2_PROTOCOL_ERROR);
+                return;
+            }
+            connection->peer_max_frame_size = value;
+            break;
+        default:
+            // MAX_CONCURRENT_STREAMS and MAX_HEADER_LIST_SIZE limit pushes and requests, we send neither
+            break;
+        }
+    }
+    connection->settings_received = true;
+    auto out = kyros_http2_output(connection, KYROS_HTTP2_FRAME_HEADER);
+    kyros_http2_frame_header(out, 0, KYROS_HTTP2_SETTINGS, KYROS_HTTP2_FLAG_ACK, 0);
+    if (!window_delta) {
+        return;
+    }
+    // the change applies to the window of every open stream, it can go negative
+    for (uint32_t i = 0; i < KYROS_HTTP2_STREAM_TABLE; i++) {
+        auto stream = connection->streams[i];
+        if (!stream) {
+            continue;
+        }
+        stream->send_window += window_delta;
+        if (stream->send_window > KYROS_HTTP2_MAX_WINDOW) {
+            kyros_http2_connection_error(connection, KYROS_HTTP2_FLOW_CONTROL_ERROR);
+            return;
+        }
+    }
+    if (window_delta > 0) {
+        kyros_http2_connection_unblock(connection);
+    }
+}
+
+static void kyros_http2_on_window_update(kyros_http2_connection* connection, uint32_t id, const char* payload, uint32_t length)
+{
+    if (length != 4) {
+        kyros_http2_connection_error(connection, KYROS_HTTP2_FRAME_SIZE_ERROR);
+        return;
+    }
+    auto increment = kyros_http2_read32(payload) & KYROS_HTTP2_MAX_WINDOW;
+    if (!id) {
+        connection->send_window += increment;
+        if (!increment || connection->send_window > KYROS_HTTP2_MAX_WINDOW) {
+            kyros_http2_connection_error(connection, increment ? KYROS_HTTP2_FLOW_CONTROL_ERROR : KYROS_HTTP2_PROTOCOL_ERROR);
+            return;
+        }
+        kyros_http2_connection_unblock(connection);
+        return;
+    }
+    auto stream = kyros_http2_stream_find(connection, id);
+    if (!stream) {
+        if (id > connection->last_stream_id) {
+            kyros_http2_connection_error(connection, KYROS_HTTP2_PROTOCOL_ERROR);
+        }
+        return;
+    }
+    stream->send_window += increment;
+    if (!increment || stream->send_window > KYROS_HTTP2_MAX_WINDOW) {
+        kyros_http2_stream_reset(stream, increment ? KYROS_HTTP2_FLOW_CONTROL_ERROR : KYROS_HTTP2_PROTOCOL_ERROR);
+        return;
+    }
+    if (stream->blocked) {
+        kyros_http2_connection_unblock(connection);
+    }
+}
+
+static void kyros_http2_on_frame(kyros_http2_connection* connection, kyros_http2_frame_type type, uint8_t flags, uint32_t id, const char* payload, uint32_t length)
+{
+    // the first frame is SETTINGS and a header block is never interleaved
+    if ((!connection->settings_received && type != KYROS_HTTP2_SETTINGS) || (connection->block_stream && type != KYROS_HTTP2_CONTINUATION)) {
+        kyros_http2_connection_error(connection, KYROS_HTTP2_PROTOCOL_ERROR);
+        return;
+    }
+    switch (type) {
+    case KYROS_HTTP2_DATA:
+        kyros_http2_on_data(connection, flags, id, payload, length);
+        break;
+    case KYROS_HTTP2_HEADERS:
+        kyros_http2_on_headers(connection, flags, id, payload, length);
+        break;
+    case KYROS_HTTP2_CONTINUATION:
+        kyros_http2_on_continuation(connection, flags, id, payload, length);
+        break;
+    case KYROS_HTTP2_SETTINGS:
+        kyros_http2_on_settings(connection, flags, id, payload, length);
+        break;
+    case KYROS_HTTP2_WINDOW_UPDATE:
+        kyros_http2_on_window_update(connection, id, payload, length);
+        break;
+    case KYROS_HTTP2_PING:
+        if (id || length != 8) {
+            kyros_http2_connection_error(connection, id ? KYROS_HTTP2_PROTOCOL_ERROR : KYROS_HTTP2_FRAME_SIZE_ERROR);
+        } else if (!(flags & KYROS_HTTP2_FLAG_ACK)) {
+            auto out = kyros_http2_output(connection, KYROS_HTTP2_FRAME_HEADER + 8);
+            kyros_http2_frame_header(out, 8, KYROS_HTTP2_PING, KYROS_HTTP2_FLAG_ACK, 0);
+            memcpy(out + KYROS_HTTP2_FRAME_HEADER, payload, 8);
+        }
+        break;
+    case KYROS_HTTP2_RST_STREAM: {
+        if (!id || length != 4) {
+            kyros_http2_connection_error(connection, id ? KYROS_HTTP2_FRAME_SIZE_ERROR : KYROS_HTTP2_PROTOCOL_ERROR);
+            break;
+        }
+        auto stream = kyros_http2_stream_find(connection, id);
+        if (stream) {
+            kyros_http2_stream_abort(stream);
+        } else if (id > connection->last_stream_id) {
+            kyros_http2_connection_error(connection, KYROS_HTTP2_PROTOCOL_ERROR);
+        }
+        break;
+    }
+    case KYROS_HTTP2_GOAWAY:
+        if (id || length < 8) {
+            kyros_http2_connection_error(connection, id ? KYROS_HTTP2_PROTOCOL_ERROR : KYROS_HTTP2_FRAME_SIZE_ERROR);
+            break;
+        }
+        // no new streams, the open ones are answered
+        connection->goaway_received = true;
+        if (!connection->stream_count) {
+            kyros_http2_connection_finish(connection);
+        }
+        break;
+    case KYROS_HTTP2_PRIORITY:
+        if (!id || length != 5) {
+            kyros_http2_connection_error(connection, id ? KYROS_HTTP2_FRAME_SIZE_ERROR : KYROS_HTTP2_PROTOCOL_ERROR);
+        }
+        break;
+    case KYROS_HTTP2_PUSH_PROMISE:
+        // clients can not push
+        kyros_http2_connection_error(connection, KYROS_HTTP2_PROTOCOL_ERROR);
+        break;
+    default:
+        // unknown frames are ignored
+        break;
+    }
+}
+
+/// @brief the preface then every whole frame of data, returns the bytes consumed
+static uint64_t kyros_http2_connection_process(kyros_http2_connection* connection, const char* data, uint64_t length)
+{
+    uint64_t consumed = 0;
+    if (!connection->preface_received) {
+        auto prefix = length < KYROS_HTTP2_PREFACE_LENGTH ? length : KYROS_HTTP2_PREFACE_LENGTH;
+        if (memcmp(data, KYROS_HTTP2_PREFACE, prefix)) {
+            kyros_http2_connection_error(connection, KYROS_HTTP2_PROTOCOL_ERROR);
+            return length;
+        }
+        if (length < KYROS_HTTP2_PREFACE_LENGTH) {
+            return 0;
+        }
+        connection->preface_received = true;
+        consumed = KYROS_HTTP2_PREFACE_LENGTH;
+    }
+    while (!connection->ending && !connection->closed && length - consumed >= KYROS_HTTP2_FRAME_HEADER) {
+        auto p = data + consumed;
+        auto frame_length = kyros_http2_read24(p);
+        if (frame_length > KYROS_HTTP2_MAX_FRAME_SIZE) {
+            kyros_http2_connection_error(connection, KYROS_HTTP2_FRAME_SIZE_ERROR);
+            break;
+        }
+        if (length - consumed < KYROS_HTTP2_FRAME_HEADER + frame_length) {
+            break;
+        }
+        consumed += KYROS_HTTP2_FRAME_HEADER + frame_length;
+        auto id = kyros_http2_read32(p + 5) & KYROS_HTTP2_MAX_WINDOW;
+        kyros_http2_on_frame(connection, (kyros_http2_frame_type)(uint8_t)p[3], (uint8_t)p[4], id, p + KYROS_HTTP2_FRAME_HEADER, frame_length);
+    }
+    return consumed;
+}
+
+///
+/// Connection
+///
+
+static void kyros_http2_connection_free(kyros_http2_connection* connection)
+{
+    auto server = connection->server;
+    if (connection->send_queued) {
+        auto internal = kyros_get_internal_loop(server->loop);
+        auto next = &internal->http2_sends;
+        while (*next != connection) {
+            next = &(*next)->send_next;
+        }
+        *next = connection->send_next;
+    }
+    lshpack_enc_cleanup(&connection->encoder);
+    lshpack_dec_cleanup(&connection->decoder);
+    if (connection->input) {
+        kyros_free(connection->input);
+    }
+    if (connection->output) {
+        kyros_free(connection->output);
+    }
+    if (connection->block) {
+        kyros_free(connection->block);
+    }
+    kyros_free(connection);
+    // the connection kept the ref its socket took on the server handler
+    server->handler.ref_count--;
+    kyros_http_server_release(server);
+}
+
+/// @brief end of a batch, returns false if the connection was freed
+static bool kyros_http2_connection_leave(kyros_http2_connection* connection)
+{
+    connection->in_batch = false;
+    if (connection->closed) {
+        kyros_http2_connection_free(connection);
+        return false;
+    }
+    return true;
+}
+
+static void kyros_http2_connection_buffer(kyros_http2_connection* connection, const char* data, uint64_t length)
+{
+    auto needed = connection->input_length + length;
+    if (needed > connection->input_capacity) {
+        auto capacity = connection->input_capacity ? connection->input_capacity * 2 : KYROS_HTTP2_FRAME_HEADER + KYROS_HTTP2_MAX_FRAME_SIZE;
+        while (capacity < needed) {
+            capacity *= 2;
+        }
+        connection->input = (char*)kyros_resize(connection->input, capacity);
+        connection->input_capacity = capacity;
+    }
+    memcpy(connection->input + connection->input_length, data, length);
+    connection->input_length = needed;
+}
+
+static bool kyros_http2_connection_ondata(kyros_socket socket, const char* data, uint64_t length, void* ctx)
+{
+    kyros_http2_connection* connection = ctx;
+    if (connection->ending) {
+        return true;
+    }
+    connection->in_batch = true;
+    if (connection->input_length) {
+        // behind a partial frame
+        kyros_http2_connection_buffer(connection, data, length);
+        auto consumed = kyros_http2_connection_process(connection, connection->input, connection->input_length);
+        connection->input_length -= consumed;
+        if (connection->input_length) {
+            memmove(connection->input, connection->input + consumed, connection->input_length);
+        }
+    } else {
+        auto consumed = kyros_http2_connection_process(connection, data, length);
+        if (consumed < length && !connection->ending && !connection->closed) {
+            kyros_http2_connection_buffer(connection, data + consumed, length - consumed);
+        }
+    }
+    kyros_http2_connection_leave(connection);
+    return true;
+}
+
+static void kyros_http2_connection_onstatus(kyros_socket socket, kyros_socket_error error, void* ctx)
+{
+    kyros_http2_connection* connection = ctx;
+    auto state = kyros_socket_get_state(socket);
+    if (state == KYROS_SOCKET_STATE_READABLE_ENDED) {
+        // half open, like a GOAWAY the open streams are answered first
+        connection->goaway_received = true;
+        if (!connection->stream_count) {
+            kyros_http2_connection_finish(connection);
+        }
+        return;
+    }
+    if (state != KYROS_SOCKET_STATE_CLOSED) {
+        return;
+    }
+    // the handler goes away with the connection, the socket must not release it again
+    auto tcp = (kyros_socket_internal_tcp*)kyros_get_socket_internal(socket);
+    tcp->handlers = NULL;
+    connection->closed = true;
+    // a removal can shift another stream into the same slot
+    for (uint32_t i = 0; i < KYROS_HTTP2_STREAM_TABLE; i++) {
+        while (connection->streams[i]) {
+            kyros_http2_stream_abort(connection->streams[i]);
+        }
+    }
+    if (!connection->in_batch) {
+        kyros_http2_connection_free(connection);
+    }
+}
+
+///
+/// Internal API
+///
+
+void kyros_http2_connection_create(kyros_http_server* server, kyros_socket socket, const char* data, uint64_t length)
+{
+    auto connection = (kyros_http2_connection*)kyros_calloc(1, sizeof(kyros_http2_connection));
+    connection->handler = (kyros_socket_handler) {
+        .ctx = connection,
+        .ondata = kyros_http2_connection_ondata,
+        .onstatus = kyros_http2_connection_onstatus,
+        .ref_count = 1,
+    };
+    connection->server = server;
+    connection->socket = socket;
+    lshpack_enc_init(&connection->encoder);
+    lshpack_dec_init(&connection->decoder);
+    connection->send_window = KYROS_HTTP2_DEFAULT_WINDOW;
+    connection->recv_window = KYROS_HTTP2_CONNECTION_WINDOW;
+    connection->peer_initial_window = KYROS_HTTP2_DEFAULT_WINDOW;
+    connection->peer_max_frame_size = KYROS_HTTP2_MAX_FRAME_SIZE;
+    connection->encoder_capacity = KYROS_HTTP2_TABLE_SIZE;
+    // the ref the socket has on the server handler is now the one of the connection
+    auto tcp = (kyros_socket_internal_tcp*)kyros_get_socket_internal(socket);
+    tcp->handlers = &connection->handler;
+
+    // our SETTINGS then the rest of the connection window, the server preface
+    static const uint16_t settings[3] = {
+        KYROS_HTTP2_SETTINGS_MAX_CONCURRENT_STREAMS,
+        KYROS_HTTP2_SETTINGS_INITIAL_WINDOW_SIZE,
+        KYROS_HTTP2_SETTINGS_MAX_HEADER_LIST_SIZE,
+    };
+    uint32_t values[3] = { KYROS_HTTP2_MAX_STREAMS, KYROS_HTTP2_STREAM_WINDOW, server->options.max_header_size };
+    auto out = kyros_http2_output(connection, KYROS_HTTP2_FRAME_HEADER + 3 * 6 + KYROS_HTTP2_FRAME_HEADER + 4);
+    kyros_http2_frame_header(out, 3 * 6, KYROS_HTTP2_SETTINGS, 0, 0);
+    for (uint32_t i = 0; i < 3; i++) {
+        auto setting = out + KYROS_HTTP2_FRAME_HEADER + i * 6;
+        setting[0] = (char)(settings[i] >> 8);
+        setting[1] = (char)settings[i];
+        kyros_http2_write32(setting + 2, values[i]);
+    }
+    out += KYROS_HTTP2_FRAME_HEADER + 3 * 6;
+    kyros_http2_frame_header(out, 4, KYROS_HTTP2_WINDOW_UPDATE, 0, 0);
+    kyros_http2_write32(out + KYROS_HTTP2_FRAME_HEADER, KYROS_HTTP2_CONNECTION_WINDOW - KYROS_HTTP2_DEFAULT_WINDOW);
+    if (length) {
+        kyros_http2_connection_ondata(socket, data, length, connection);
+    }
+}
+
+bool kyros_http2_is_preface(const char* data, uint64_t length)
+{
+    return !memcmp(data, KYROS_HTTP2_PREFACE, length < KYROS_HTTP2_PREFACE_LENGTH ? length : KYROS_HTTP2_PREFACE_LENGTH);
+}
+
+void kyros_http2_flush_sends(kyros_loop_internal* internal)
+{
+    while (internal->http2_sends) {
+        auto connection = internal->http2_sends;
+        internal->http2_sends = connection->send_next;
+        connection->send_next = NULL;
+        connection->send_queued = false;
+        auto length = connection->output_length;
+        connection->output_length = 0;
+        // a write error closes the socket right away, the connection is freed after it
+        connection->in_batch = true;
+        kyros_socket_write(connection->socket, connection->output, length, connection->ending);
+        connection->ended = connection->ending;
+        kyros_http2_connection_leave(connection);
+    }
+}
+
+///
+/// Response
+///
+
+void kyros_http2_write_status(kyros_http2_stream* stream, uint16_t status)
+{
+    m_assert(stream->responding && !stream->status && !stream->fields_length && !stream->headers_sent, "kyros_http_response_write_status must come first");
+    m_assert(status >= 100 && status <= 999, "kyros_http_response status must have 3 digits");
+    stream->status = status;
+    // no body at all, not even an empty one
+    stream->bodyless_status = status < 200 || status == 204 || status == 304;
+}
+
+void kyros_http2_write_header(kyros_http2_stream* stream, const char* name, uint32_t name_length, const char* value, uint32_t value_length)
+{
+    m_assert(stream->responding && !stream->headers_sent, "kyros_http_response_write_header after the body");
+    m_assert(name_length + value_length < LSXPACK_MAX_STRLEN, "kyros_http_response_write_header field too large for HTTP/2");
+    if (stream->closed) {
+        return;
+    }
+    // connection specific fields are HTTP/1 only
+    if (kyros_http_header_name_equals(name, name_length, "connection", 10) || kyros_http_header_name_equals(name, name_length, "keep-alive", 10)
+        || kyros_http_header_name_equals(name, name_length, "transfer-encoding", 17) || kyros_http_header_name_equals(name, name_length, "upgrade", 7)
+        || kyros_http_header_name_equals(name, name_length, "proxy-connection", 16)) {
+        return;
+    }
+    if (kyros_http_header_name_equals(name, name_length, "content-length", 14)) {
+        stream->has_content_length = true;
+    }
+    uint32_t lengths[2] = { name_length, value_length };
+    auto needed = stream->fields_length + (uint32_t)sizeof(lengths) + name_length + value_length;
+    if (needed > stream->fields_capacity) {
+        auto capacity = stream->fields_capacity ? stream->fields_capacity * 2 : 256;
+        while (capacity < needed) {
+            capacity *= 2;
+        }
+        stream->fields = (char*)kyros_resize(stream->fields, capacity);
+        stream->fields_capacity = capacity;
+    }
+    auto out = stream->fields + stream->fields_length;
+    memcpy(out, lengths, sizeof(lengths));
+    out += sizeof(lengths);
+    // names are lowercase in HTTP/2
+    for (uint32_t i = 0; i < name_length; i++) {
+        auto c = name[i];
+        out[i] = c >= 'A' && c <= 'Z' ? (char)(c | 0x20) : c;
+    }
+    memcpy(out + name_length, value, value_length);
+    stream->fields_length = needed;
+}
+
+bool kyros_http2_write(kyros_http2_stream* stream, const char* data, uint64_t length)
+{
+    m_assert(stream->responding, "kyros_http_response_write after end");
+    auto connection = stream->connection;
+    if (stream->closed || connection->ending) {
+        return false;
+    }
+    if (!stream->headers_sent) {
+        kyros_http2_send_headers(stream, false, false, 0);
+    }
+    if (length && !stream->head_request && !stream->bodyless_status) {
+        kyros_http2_stream_send(stream, data, length, false);
+    }
+    // false while waiting for window too
+    return !stream->blocked && kyros_http2_connection_writable(connection);
+}
+
+bool kyros_http2_end(kyros_http2_stream* stream, const char* data, uint64_t length)
+{
+    m_assert(stream->responding, "kyros_http_response_end called twice");
+    auto connection = stream->connection;
+    if (stream->closed || connection->ending) {
+        // what closed it (or the dispatch) frees it
+        stream->responding = false;
+        return false;
+    }
+    stream->responding = false;
+    stream->onabort = NULL;
+    stream->onabort_ctx = NULL;
+    auto body = stream->head_request || stream->bodyless_status ? 0 : length;
+    if (!stream->headers_sent) {
+        kyros_http2_send_headers(stream, !body, true, length);
+        if (!body) {
+            kyros_http2_stream_sent_end(stream);
+            return kyros_http2_connection_writable(connection);
+        }
+    }
+    // the stream is freed once the END_STREAM is out
+    kyros_http2_stream_send(stream, data, body, true);
+    return kyros_http2_connection_writable(connection);
+}
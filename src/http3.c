@@ -0,0 +1,880 @@
+#include <kyros.h>
+#include <kyros_internal.h>
+
+#include <string.h>
+
+// RFC 9114 on the QUIC connections of a listener, the streams of the peer are read as they arrive: DATA is appended to the body
+// where it is received and only HEADERS and control frames are gathered, responses are written to their quic stream which sends
+// them with the datagrams of every connection once per loop iteration
+
+typedef enum {
+    KYROS_HTTP3_DATA = 0x0,
+    KYROS_HTTP3_HEADERS = 0x1,
+    KYROS_HTTP3_CANCEL_PUSH = 0x3,
+    KYROS_HTTP3_SETTINGS = 0x4,
+    KYROS_HTTP3_PUSH_PROMISE = 0x5,
+    KYROS_HTTP3_GOAWAY = 0x7,
+    KYROS_HTTP3_MAX_PUSH_ID = 0xd,
+} kyros_http3_frame_type;
+
+typedef enum {
+    KYROS_HTTP3_STREAM_TYPE_CONTROL = 0x0,
+    KYROS_HTTP3_STREAM_TYPE_PUSH = 0x1,
+    KYROS_HTTP3_STREAM_TYPE_ENCODER = 0x2,
+    KYROS_HTTP3_STREAM_TYPE_DECODER = 0x3,
+} kyros_http3_stream_type;
+
+typedef enum {
+    KYROS_HTTP3_NO_ERROR = 0x100,
+    KYROS_HTTP3_GENERAL_PROTOCOL_ERROR = 0x101,
+    KYROS_HTTP3_STREAM_CREATION_ERROR = 0x103,
+    KYROS_HTTP3_CLOSED_CRITICAL_STREAM = 0x104,
+    KYROS_HTTP3_FRAME_UNEXPECTED = 0x105,
+    KYROS_HTTP3_FRAME_ERROR = 0x106,
+    KYROS_HTTP3_EXCESSIVE_LOAD = 0x107,
+    KYROS_HTTP3_SETTINGS_ERROR = 0x109,
+    KYROS_HTTP3_MISSING_SETTINGS = 0x10a,
+    KYROS_HTTP3_REQUEST_CANCELLED = 0x10c,
+    KYROS_HTTP3_REQUEST_INCOMPLETE = 0x10d,
+    KYROS_HTTP3_MESSAGE_ERROR = 0x10e,
+    KYROS_HTTP3_QPACK_DECOMPRESSION_FAILED = 0x200,
+} kyros_http3_error;
+
+typedef enum {
+    KYROS_HTTP3_SETTINGS_QPACK_MAX_TABLE_CAPACITY = 0x1,
+    KYROS_HTTP3_SETTINGS_MAX_FIELD_SECTION_SIZE = 0x6,
+    KYROS_HTTP3_SETTINGS_QPACK_BLOCKED_STREAMS = 0x7,
+} kyros_http3_setting;
+
+/// @brief HTTP/2 frame types, a HTTP/3 peer must not send them
+static inline bool kyros_http3_is_http2_frame(uint64_t type)
+{
+    return type == 0x2 || type == 0x6 || type == 0x8 || type == 0x9;
+}
+
+///
+/// Streams
+///
+
+static kyros_http3_stream* kyros_http3_stream_create(kyros_http3_connection* connection, uint64_t id)
+{
+    auto stream = (kyros_http3_stream*)kyros_calloc(1, sizeof(kyros_http3_stream));
+    stream->response.version = 3;
+    stream->connection = connection;
+    stream->id = id;
+    stream->kind = id & 2 ? KYROS_HTTP3_STREAM_UNIDIRECTIONAL : KYROS_HTTP3_STREAM_REQUEST;
+    stream->content_length = -1;
+    stream->next = connection->streams;
+    if (connection->streams) {
+        connection->streams->prev = stream;
+    }
+    connection->streams = stream;
+    kyros_quic_stream_set_ctx(connection->quic, id, stream);
+    return stream;
+}
+
+static void kyros_http3_stream_free_request(kyros_http3_stream* stream)
+{
+    if (stream->head) {
+        kyros_free(stream->head);
+        stream->head = NULL;
+    }
+    if (stream->headers) {
+        kyros_free(stream->headers);
+        stream->headers = NULL;
+    }
+    if (stream->body) {
+        kyros_free(stream->body);
+        stream->body = NULL;
+    }
+}
+
+/// @brief freed once out of the connection list and the user is done with the response
+static void kyros_http3_stream_release(kyros_http3_stream* stream)
+{
+    if (!stream->closed || stream->responding || stream->in_receive) {
+        return;
+    }
+    kyros_http3_stream_free_request(stream);
+    if (stream->frame) {
+        kyros_free(stream->frame);
+    }
+    if (stream->fields) {
+        kyros_free(stream->fields);
+    }
+    kyros_free(stream);
+}
+
+/// @brief out of the connection list, what the quic stream still receives is not given to it
+static void kyros_http3_stream_remove(kyros_http3_stream* stream)
+{
+    if (stream->closed) {
+        return;
+    }
+    auto connection = stream->connection;
+    stream->closed = true;
+    if (stream->prev) {
+        stream->prev->next = stream->next;
+    } else {
+        connection->streams = stream->next;
+    }
+    if (stream->next) {
+        stream->next->prev = stream->prev;
+    }
+    kyros_quic_stream_set_ctx(connection->quic, stream->id, NULL);
+}
+
+static inline void kyros_http3_stream_close(kyros_http3_stream* stream)
+{
+    kyros_http3_stream_remove(stream);
+    kyros_http3_stream_release(stream);
+}
+
+/// @brief reset by the peer or the connection is gone, stream is invalid after it
+static void kyros_http3_stream_abort(kyros_http3_stream* stream)
+{
+    kyros_http3_stream_remove(stream);
+    if (stream->responding) {
+        if (stream->onabort) {
+            stream->onabort(&stream->response, stream->onabort_ctx);
+        }
+        stream->responding = false;
+    }
+    kyros_http3_stream_release(stream);
+}
+
+/// @brief stream error, both sides are reset and the connection goes on
+static void kyros_http3_stream_reset(kyros_http3_stream* stream, kyros_http3_error code)
+{
+    kyros_quic_stream_reset(stream->connection->quic, stream->id, code);
+    kyros_http3_stream_abort(stream);
+}
+
+/// @brief connection error, onclose is called before it returns (connection->closed is set)
+static void kyros_http3_connection_error(kyros_http3_connection* connection, kyros_http3_error code)
+{
+    kyros_quic_close(connection->quic, code, "", 0);
+}
+
+///
+/// Sending
+///
+
+/// @brief type and length of a frame, out needs 9 bytes, returns the bytes written
+static inline uint32_t kyros_http3_frame_header(uint8_t* out, kyros_http3_frame_type type, uint64_t length)
+{
+    out[0] = (uint8_t)type;
+    return (uint32_t)(kyros_quic_varint_write(out + 1, length) - out);
+}
+
+/// @brief the HEADERS frame of the response, content-length is added when ending without one
+static void kyros_http3_send_headers(kyros_http3_stream* stream, bool fin, bool ending, uint64_t length)
+{
+    auto connection = stream->connection;
+    auto server = connection->server;
+    kyros_http_server_refresh_date(server);
+    // each stored field has 8 bytes of lengths and a field line needs at most 16 more than its name and value
+    auto reserve = (uint64_t)stream->fields_length * 2 + 128;
+    if (reserve > connection->output_capacity) {
+        auto capacity = connection->output_capacity ? connection->output_capacity * 2 : 1024;
+        while (capacity < reserve) {
+            capacity *= 2;
+        }
+        connection->output = (char*)kyros_resize(connection->output, capacity);
+        connection->output_capacity = capacity;
+    }
+    // the section goes after the room of the largest frame header, which is written right before it once the length is known
+    auto start = (uint8_t*)connection->output + 9;
+    auto out = start;
+    // Required Insert Count and Base, there is no dynamic table
+    *out++ = 0;
+    *out++ = 0;
+    char value[24];
+    auto status = stream->status ? stream->status : 200;
+    value[0] = (char)('0' + status / 100);
+    value[1] = (char)('0' + status / 10 % 10);
+    value[2] = (char)('0' + status % 10);
+    out = kyros_qpack_encode_field(out, ":status", 7, value, 3);
+    // "Date: " and "\r\n" are not part of the value
+    out = kyros_qpack_encode_field(out, "date", 4, server->date + 6, KYROS_HTTP_DATE_LENGTH - 8);
+    for (uint32_t offset = 0; offset < stream->fields_length;) {
+        uint32_t lengths[2];
+        memcpy(lengths, stream->fields + offset, sizeof(lengths));
+        auto name = stream->fields + offset + sizeof(lengths);
+        out = kyros_qpack_encode_field(out, name, lengths[0], name + lengths[0], lengths[1]);
+        offset += (uint32_t)sizeof(lengths) + lengths[0] + lengths[1];
+    }
+    if (ending && !stream->has_content_length && !stream->bodyless_status) {
+        out = kyros_qpack_encode_field(out, "content-length", 14, value, kyros_http_format_decimal(value, length));
+    }
+    auto section = (uint64_t)(out - start);
+    uint8_t header[9];
+    auto header_length = kyros_http3_frame_header(header, KYROS_HTTP3_HEADERS, section);
+    memcpy(start - header_length, header, header_length);
+    kyros_quic_stream_write(connection->quic, stream->id, (const char*)start - header_length, header_length + section, fin);
+    stream->headers_sent = true;
+    if (stream->fields) {
+        kyros_free(stream->fields);
+        stream->fields = NULL;
+        stream->fields_length = 0;
+        stream->fields_capacity = 0;
+    }
+}
+
+/// @brief one DATA frame, the quic stream keeps what flow control does not let out yet, false above its high watermark
+static bool kyros_http3_send_data(kyros_http3_stream* stream, const char* data, uint64_t length, bool fin)
+{
+    auto quic = stream->connection->quic;
+    if (!length) {
+        return kyros_quic_stream_write(quic, stream->id, NULL, 0, fin);
+    }
+    uint8_t header[9];
+    auto header_length = kyros_http3_frame_header(header, KYROS_HTTP3_DATA, length);
+    kyros_quic_stream_write(quic, stream->id, (const char*)header, header_length, false);
+    return kyros_quic_stream_write(quic, stream->id, data, length, fin);
+}
+
+///
+/// Receiving
+///
+
+/// @brief count (1 or 2) varints at the start of the stream data, the bytes of an incomplete one wait in stream->header
+/// returns false until they are all received
+static bool kyros_http3_read_varints(kyros_http3_stream* stream, const uint8_t** data, uint64_t* length, uint32_t count, uint64_t* values)
+{
+    auto buffered = stream->header_length;
+    auto copy = (uint32_t)(*length < sizeof(stream->header) - buffered ? *length : sizeof(stream->header) - buffered);
+    memcpy(stream->header + buffered, *data, copy);
+    auto end = stream->header + buffered + copy;
+    auto p = stream->header;
+    for (uint32_t i = 0; i < count; i++) {
+        auto read = kyros_quic_varint_read(p, end, &values[i]);
+        if (!read) {
+            stream->header_length = (uint8_t)(buffered + copy);
+            *data += copy;
+            *length -= copy;
+            return false;
+        }
+        p += read;
+    }
+    auto used = (uint32_t)(p - stream->header) - buffered;
+    stream->header_length = 0;
+    *data += used;
+    *length -= used;
+    return true;
+}
+
+static void kyros_http3_stream_dispatch(kyros_http3_stream* stream, const kyros_http_header* headers, uint32_t header_count)
+{
+    auto server = stream->connection->server;
+    kyros_http_request request = {
+        .method = stream->method,
+        .target = stream->target,
+        .headers = headers,
+        .body = stream->body_length ? stream->body : NULL,
+        .body_length = stream->body_length,
+        .method_length = stream->method_length,
+        .target_length = stream->target_length,
+        .header_count = header_count,
+        .minor_version = 0,
+        .keep_alive = true,
+        .http2 = false,
+        .http3 = true,
+    };
+    stream->head_request = stream->method_length == 4 && !memcmp(stream->method, "HEAD", 4);
+    stream->responding = true;
+    server->options.onrequest(&request, &stream->response, server->options.ctx);
+    // the request is only valid during onrequest, the stream is released once the data it came with is handled
+    kyros_http3_stream_free_request(stream);
+    stream->method = NULL;
+    stream->target = NULL;
+}
+
+/// @brief answer with an error before the request is complete, the rest of it is refused with STOP_SENDING H3_NO_ERROR
+static void kyros_http3_stream_fail(kyros_http3_stream* stream, uint16_t status)
+{
+    auto connection = stream->connection;
+    auto id = stream->id;
+    bool request_ended = stream->request_ended;
+    stream->responding = true;
+    kyros_http3_write_status(stream, status);
+    // closes the stream if the request ended
+    kyros_http3_end(stream, NULL, 0);
+    if (!request_ended) {
+        kyros_quic_stream_stop(connection->quic, id, KYROS_HTTP3_NO_ERROR);
+        kyros_http3_stream_close(stream);
+    }
+}
+
+static void kyros_http3_stream_request_end(kyros_http3_stream* stream, const kyros_http_header* headers, uint32_t header_count)
+{
+    stream->request_ended = true;
+    if (!stream->headers_received) {
+        kyros_http3_stream_reset(stream, KYROS_HTTP3_REQUEST_INCOMPLETE);
+        return;
+    }
+    if (stream->content_length >= 0 && (uint64_t)stream->content_length != stream->body_length) {
+        kyros_http3_stream_reset(stream, KYROS_HTTP3_MESSAGE_ERROR);
+        return;
+    }
+    kyros_http3_stream_dispatch(stream, headers, header_count);
+}
+
+/// @brief the field section of the request, last if the stream ended right after it (dispatched from the decoded fields)
+static void kyros_http3_on_headers(kyros_http3_stream* stream, const char* section, uint64_t length, bool last)
+{
+    auto connection = stream->connection;
+    auto server = connection->server;
+    uint32_t size;
+    auto count = kyros_qpack_decode(server, (const uint8_t*)section, length, &size);
+    if (count < 0) {
+        kyros_http3_connection_error(connection, KYROS_HTTP3_QPACK_DECOMPRESSION_FAILED);
+        return;
+    }
+    if (stream->headers_received) {
+        // trailers, decoded to be validated and dropped
+        stream->trailers_received = true;
+        return;
+    }
+    stream->headers_received = true;
+    if (size > server->options.max_header_size || count > KYROS_HTTP2_MAX_FIELDS) {
+        kyros_http3_stream_fail(stream, 431);
+        return;
+    }
+    kyros_http_header headers[KYROS_HTTP2_MAX_FIELDS + 1];
+    uint32_t header_count;
+    kyros_http_fields fields = { .content_length = -1 };
+    if (!kyros_http_parse_fields(server->decoded, server->field_offsets, (uint32_t)count, &fields, headers, &header_count)) {
+        kyros_http3_stream_reset(stream, KYROS_HTTP3_MESSAGE_ERROR);
+        return;
+    }
+    stream->method = fields.method;
+    stream->target = fields.target;
+    stream->method_length = fields.method_length;
+    stream->target_length = fields.target_length;
+    stream->content_length = fields.content_length;
+    if (stream->content_length > 0 && (uint64_t)stream->content_length > server->options.max_body_size) {
+        kyros_http3_stream_fail(stream, 413);
+        return;
+    }
+    if (last) {
+        // most requests, straight from the decoded section
+        kyros_http3_stream_request_end(stream, headers, header_count);
+        return;
+    }
+    // the body comes in DATA frames, the head moves to the stream
+    auto decoded = server->decoded;
+    stream->head = (char*)kyros_alloc(size ? size : 1);
+    memcpy(stream->head, decoded, size);
+    stream->headers = (kyros_http_header*)kyros_alloc(sizeof(kyros_http_header) * (header_count ? header_count : 1));
+    stream->header_count = header_count;
+    for (uint32_t i = 0; i < header_count; i++) {
+        stream->headers[i] = (kyros_http_header) {
+            .name = kyros_http_rebase(headers[i].name, decoded, size, stream->head),
+            .value = kyros_http_rebase(headers[i].value, decoded, size, stream->head),
+            .name_length = headers[i].name_length,
+            .value_length = headers[i].value_length,
+        };
+    }
+    stream->method = kyros_http_rebase(stream->method, decoded, size, stream->head);
+    stream->target = kyros_http_rebase(stream->target, decoded, size, stream->head);
+    if (stream->content_length > 0) {
+        stream->body = (char*)kyros_alloc((uint64_t)stream->content_length);
+        stream->body_capacity = (uint64_t)stream->content_length;
+    }
+}
+
+static void kyros_http3_on_body(kyros_http3_stream* stream, const char* data, uint64_t length)
+{
+    auto needed = stream->body_length + length;
+    if (needed > stream->connection->server->options.max_body_size) {
+        kyros_http3_stream_fail(stream, 413);
+        return;
+    }
+    if (needed > stream->body_capacity) {
+        auto capacity = stream->body_capacity ? stream->body_capacity * 2 : 16384;
+        while (capacity < needed) {
+            capacity *= 2;
+        }
+        stream->body = (char*)kyros_resize(stream->body, capacity);
+        stream->body_capacity = capacity;
+    }
+    memcpy(stream->body + stream->body_length, data, length);
+    stream->body_length = needed;
+}
+
+static void kyros_http3_on_settings(kyros_http3_connection* connection, const uint8_t* data, uint64_t length)
+{
+    auto end = data + length;
+    uint32_t seen = 0;
+    while (data < end) {
+        uint64_t setting;
+        uint64_t value;
+        auto read = kyros_quic_varint_read(data, end, &setting);
+        if (!read) {
+            kyros_http3_connection_error(connection, KYROS_HTTP3_FRAME_ERROR);
+            return;
+        }
+        data += read;
+        read = kyros_quic_varint_read(data, end, &value);
+        if (!read) {
+            kyros_http3_connection_error(connection, KYROS_HTTP3_FRAME_ERROR);
+            return;
+        }
+        data += read;
+        // the HTTP/2 settings without a HTTP/3 meaning are errors, known ones can't repeat
+        if (setting >= 0x2 && setting <= 0x5) {
+            kyros_http3_connection_error(connection, KYROS_HTTP3_SETTINGS_ERROR);
+            return;
+        }
+        if (setting < 32) {
+            if (seen & (1u << setting)) {
+                kyros_http3_connection_error(connection, KYROS_HTTP3_SETTINGS_ERROR);
+                return;
+            }
+            seen |= 1u << setting;
+        }
+        // the dynamic table and field section size of the peer are not used, responses only have static references
+    }
+}
+
+static inline bool kyros_http3_frame_is_gathered(kyros_http3_stream* stream)
+{
+    auto type = stream->frame_type;
+    if (stream->kind == KYROS_HTTP3_STREAM_CONTROL) {
+        return type == KYROS_HTTP3_SETTINGS || type == KYROS_HTTP3_GOAWAY || type == KYROS_HTTP3_MAX_PUSH_ID || type == KYROS_HTTP3_CANCEL_PUSH;
+    }
+    return type == KYROS_HTTP3_HEADERS;
+}
+
+/// @brief a frame starts, false if the stream can't go on
+static bool kyros_http3_frame_begin(kyros_http3_stream* stream)
+{
+    auto connection = stream->connection;
+    auto type = stream->frame_type;
+    auto length = stream->frame_remaining;
+    if (kyros_http3_is_http2_frame(type)) {
+        kyros_http3_connection_error(connection, KYROS_HTTP3_FRAME_UNEXPECTED);
+        return false;
+    }
+    if (stream->kind == KYROS_HTTP3_STREAM_CONTROL) {
+        if (!connection->settings_received && type != KYROS_HTTP3_SETTINGS) {
+            kyros_http3_connection_error(connection, KYROS_HTTP3_MISSING_SETTINGS);
+            return false;
+        }
+        switch (type) {
+        case KYROS_HTTP3_DATA:
+        case KYROS_HTTP3_HEADERS:
+        case KYROS_HTTP3_PUSH_PROMISE:
+            kyros_http3_connection_error(connection, KYROS_HTTP3_FRAME_UNEXPECTED);
+            return false;
+        case KYROS_HTTP3_SETTINGS:
+            if (connection->settings_received) {
+                kyros_http3_connection_error(connection, KYROS_HTTP3_FRAME_UNEXPECTED);
+                return false;
+            }
+            connection->settings_received = true;
+            break;
+        }
+        if (kyros_http3_frame_is_gathered(stream) && length > KYROS_HTTP3_MAX_CONTROL_FRAME) {
+            kyros_http3_connection_error(connection, KYROS_HTTP3_EXCESSIVE_LOAD);
+            return false;
+        }
+        stream->frame_length = 0;
+        return true;
+    }
+    switch (type) {
+    case KYROS_HTTP3_HEADERS: {
+        if (stream->trailers_received) {
+            kyros_http3_connection_error(connection, KYROS_HTTP3_FRAME_UNEXPECTED);
+            return false;
+        }
+        // a section this much bigger than the limit can't decode below it, it is not gathered
+        auto max_header_size = (uint64_t)connection->server->options.max_header_size;
+        if (length > max_header_size * 2) {
+            if (stream->headers_received) {
+                kyros_http3_stream_reset(stream, KYROS_HTTP3_EXCESSIVE_LOAD);
+            } else {
+                stream->headers_received = true;
+                kyros_http3_stream_fail(stream, 431);
+            }
+            return false;
+        }
+        break;
+    }
+    case KYROS_HTTP3_DATA:
+        if (!stream->headers_received || stream->trailers_received) {
+            kyros_http3_connection_error(connection, KYROS_HTTP3_FRAME_UNEXPECTED);
+            return false;
+        }
+        break;
+    case KYROS_HTTP3_CANCEL_PUSH:
+    case KYROS_HTTP3_SETTINGS:
+    case KYROS_HTTP3_PUSH_PROMISE:
+    case KYROS_HTTP3_GOAWAY:
+    case KYROS_HTTP3_MAX_PUSH_ID:
+        kyros_http3_connection_error(connection, KYROS_HTTP3_FRAME_UNEXPECTED);
+        return false;
+    }
+    stream->frame_length = 0;
+    return true;
+}
+
+static void kyros_http3_frame_gather(kyros_http3_stream* stream, const char* data, uint64_t length)
+{
+    auto needed = stream->frame_length + length;
+    if (needed > stream->frame_capacity) {
+        // the whole frame, its length is known
+        auto capacity = stream->frame_length + stream->frame_remaining;
+        stream->frame = (char*)kyros_resize(stream->frame, capacity);
+        stream->frame_capacity = capacity;
+    }
+    memcpy(stream->frame + stream->frame_length, data, length);
+    stream->frame_length = needed;
+}
+
+/// @brief a gathered frame is complete, data is either the frame buffer or where it was received
+static void kyros_http3_frame_end(kyros_http3_stream* stream, const char* data, uint64_t length, bool last)
+{
+    if (stream->kind == KYROS_HTTP3_STREAM_CONTROL) {
+        // GOAWAY, MAX_PUSH_ID and CANCEL_PUSH mean nothing to a server that does not push and answers every stream it gets
+        if (stream->frame_type == KYROS_HTTP3_SETTINGS) {
+            kyros_http3_on_settings(stream->connection, (const uint8_t*)data, length);
+        }
+        return;
+    }
+    kyros_http3_on_headers(stream, data, length, last);
+}
+
+/// @brief frames of a request or control stream, returns false if the stream (or the connection) can't go on
+static bool kyros_http3_stream_frames(kyros_http3_stream* stream, const uint8_t* data, uint64_t length, bool fin)
+{
+    auto connection = stream->connection;
+    for (;;) {
+        if (!stream->in_frame) {
+            if (!length) {
+                return true;
+            }
+            uint64_t values[2];
+            if (!kyros_http3_read_varints(stream, &data, &length, 2, values)) {
+                return true;
+            }
+            stream->in_frame = true;
+            stream->frame_type = values[0];
+            stream->frame_remaining = values[1];
+            if (!kyros_http3_frame_begin(stream)) {
+                return false;
+            }
+        }
+        auto chunk = length < stream->frame_remaining ? length : stream->frame_remaining;
+        auto gathered = kyros_http3_frame_is_gathered(stream);
+        auto whole = gathered && !stream->frame_length && chunk == stream->frame_remaining;
+        if (gathered && !whole) {
+            kyros_http3_frame_gather(stream, (const char*)data, chunk);
+        } else if (stream->frame_type == KYROS_HTTP3_DATA && stream->kind == KYROS_HTTP3_STREAM_REQUEST && chunk) {
+            kyros_http3_on_body(stream, (const char*)data, chunk);
+            if (stream->closed) {
+                return false;
+            }
+        }
+        // unknown frame types are skipped
+        auto frame = data;
+        data += chunk;
+        length -= chunk;
+        stream->frame_remaining -= chunk;
+        if (stream->frame_remaining) {
+            return true;
+        }
+        stream->in_frame = false;
+        if (gathered) {
+            // a frame that came in one piece is used where it was received
+            auto last = !length && fin;
+            if (whole) {
+                kyros_http3_frame_end(stream, (const char*)frame, chunk, last);
+            } else {
+                kyros_http3_frame_end(stream, stream->frame, stream->frame_length, last);
+            }
+            if (connection->closed || stream->closed || stream->request_ended) {
+                return false;
+            }
+        }
+    }
+}
+
+/// @brief data of a stream opened by the peer, in order
+static void kyros_http3_stream_receive(kyros_http3_stream* stream, const uint8_t* data, uint64_t length, bool fin)
+{
+    auto connection = stream->connection;
+    if (stream->kind == KYROS_HTTP3_STREAM_UNIDIRECTIONAL) {
+        uint64_t type;
+        if (!kyros_http3_read_varints(stream, &data, &length, 1, &type)) {
+            if (fin) {
+                kyros_http3_stream_close(stream);
+            }
+            return;
+        }
+        switch (type) {
+        case KYROS_HTTP3_STREAM_TYPE_CONTROL:
+            if (connection->control_received) {
+                kyros_http3_connection_error(connection, KYROS_HTTP3_STREAM_CREATION_ERROR);
+                return;
+            }
+            connection->control_received = true;
+            stream->kind = KYROS_HTTP3_STREAM_CONTROL;
+            break;
+        case KYROS_HTTP3_STREAM_TYPE_ENCODER:
+        case KYROS_HTTP3_STREAM_TYPE_DECODER: {
+            auto received = type == KYROS_HTTP3_STREAM_TYPE_ENCODER ? connection->encoder_received : connection->decoder_received;
+            if (received) {
+                kyros_http3_connection_error(connection, KYROS_HTTP3_STREAM_CREATION_ERROR);
+                return;
+            }
+            if (type == KYROS_HTTP3_STREAM_TYPE_ENCODER) {
+                connection->encoder_received = true;
+            } else {
+                connection->decoder_received = true;
+            }
+            stream->kind = KYROS_HTTP3_STREAM_QPACK;
+            break;
+        }
+        case KYROS_HTTP3_STREAM_TYPE_PUSH:
+            // only servers push
+            kyros_http3_connection_error(connection, KYROS_HTTP3_STREAM_CREATION_ERROR);
+            return;
+        default:
+            // unknown stream types are refused without an error (grease among them)
+            kyros_quic_stream_stop(connection->quic, stream->id, KYROS_HTTP3_STREAM_CREATION_ERROR);
+            kyros_http3_stream_close(stream);
+            return;
+        }
+    }
+    switch (stream->kind) {
+    case KYROS_HTTP3_STREAM_REQUEST:
+        if (!kyros_http3_stream_frames(stream, data, length, fin) || !fin) {
+            return;
+        }
+        if (stream->in_frame || stream->header_length) {
+            // ended in the middle of a frame
+            kyros_http3_connection_error(connection, KYROS_HTTP3_FRAME_ERROR);
+            return;
+        }
+        kyros_http3_stream_request_end(stream, stream->headers, stream->header_count);
+        return;
+    case KYROS_HTTP3_STREAM_CONTROL:
+    case KYROS_HTTP3_STREAM_QPACK:
+        // encoder instructions could only set the capacity to 0 and decoder ones have nothing to refer to, they are dropped
+        if (stream->kind == KYROS_HTTP3_STREAM_CONTROL && !kyros_http3_stream_frames(stream, data, length, fin)) {
+            return;
+        }
+        if (fin) {
+            kyros_http3_connection_error(connection, KYROS_HTTP3_CLOSED_CRITICAL_STREAM);
+        }
+        return;
+    }
+}
+
+///
+/// Connection
+///
+
+static void kyros_http3_connection_free(kyros_http3_connection* connection)
+{
+    auto server = connection->server;
+    if (connection->output) {
+        kyros_free(connection->output);
+    }
+    kyros_free(connection);
+    server->handler.ref_count--;
+    kyros_http_server_release(server);
+}
+
+static void kyros_http3_onopen(kyros_quic_connection* quic, void* ctx)
+{
+    auto server = (kyros_http_server*)ctx;
+    auto connection = (kyros_http3_connection*)kyros_calloc(1, sizeof(kyros_http3_connection));
+    connection->server = server;
+    connection->quic = quic;
+    // the server is freed after its last connection
+    server->handler.ref_count++;
+    kyros_quic_set_ctx(quic, connection);
+    auto id = kyros_quic_open_stream(quic, false);
+    if (id == UINT64_MAX) {
+        // the peer must allow the control stream (and the QPACK ones we don't need)
+        connection->in_callback = true;
+        kyros_http3_connection_error(connection, KYROS_HTTP3_STREAM_CREATION_ERROR);
+        kyros_http3_connection_free(connection);
+        return;
+    }
+    // the control stream type and SETTINGS, a capacity of 0 for the dynamic table is the default
+    uint8_t control[16];
+    control[0] = KYROS_HTTP3_STREAM_TYPE_CONTROL;
+    uint8_t settings[16];
+    settings[0] = KYROS_HTTP3_SETTINGS_MAX_FIELD_SECTION_SIZE;
+    auto settings_length = (uint64_t)(kyros_quic_varint_write(settings + 1, server->options.max_header_size) - settings);
+    auto length = 1 + kyros_http3_frame_header(control + 1, KYROS_HTTP3_SETTINGS, settings_length);
+    memcpy(control + length, settings, settings_length);
+    kyros_quic_stream_write(quic, id, (const char*)control, length + settings_length, false);
+}
+
+static void kyros_http3_onstream(kyros_quic_connection* quic, uint64_t stream_id, const char* data, uint64_t length, bool fin, void* ctx)
+{
+    auto connection = (kyros_http3_connection*)ctx;
+    auto stream = (kyros_http3_stream*)kyros_quic_stream_get_ctx(quic, stream_id);
+    if (!stream) {
+        // the first data of a stream of the peer, ours only send
+        if (stream_id & 1) {
+            return;
+        }
+        stream = kyros_http3_stream_create(connection, stream_id);
+    }
+    connection->in_callback = true;
+    stream->in_receive = true;
+    kyros_http3_stream_receive(stream, (const uint8_t*)data, length, fin);
+    stream->in_receive = false;
+    kyros_http3_stream_release(stream);
+    connection->in_callback = false;
+    if (connection->closed) {
+        kyros_http3_connection_free(connection);
+    }
+}
+
+static void kyros_http3_onreset(kyros_quic_connection* quic, uint64_t stream_id, uint64_t error_code, void* ctx)
+{
+    auto connection = (kyros_http3_connection*)ctx;
+    auto stream = (kyros_http3_stream*)kyros_quic_stream_get_ctx(quic, stream_id);
+    if (!stream) {
+        return;
+    }
+    connection->in_callback = true;
+    switch (stream->kind) {
+    case KYROS_HTTP3_STREAM_REQUEST:
+        // the request was cancelled or the response is not wanted anymore, the rest of the stream goes too
+        kyros_http3_stream_reset(stream, KYROS_HTTP3_REQUEST_CANCELLED);
+        break;
+    case KYROS_HTTP3_STREAM_UNIDIRECTIONAL:
+        kyros_http3_stream_close(stream);
+        break;
+    default:
+        kyros_http3_connection_error(connection, KYROS_HTTP3_CLOSED_CRITICAL_STREAM);
+        break;
+    }
+    connection->in_callback = false;
+    if (connection->closed) {
+        kyros_http3_connection_free(connection);
+    }
+}
+
+static void kyros_http3_onclose(kyros_quic_connection* quic, uint64_t error_code, bool application, const char* reason, uint32_t reason_length, void* ctx)
+{
+    auto connection = (kyros_http3_connection*)ctx;
+    connection->closed = true;
+    while (connection->streams) {
+        kyros_http3_stream_abort(connection->streams);
+    }
+    // freed where the callback that closed it returns
+    if (!connection->in_callback) {
+        kyros_http3_connection_free(connection);
+    }
+}
+
+kyros_quic_handler kyros_http3_handler(kyros_http_server* server)
+{
+    return (kyros_quic_handler) {
+        .onopen = kyros_http3_onopen,
+        .onstream = kyros_http3_onstream,
+        .onreset = kyros_http3_onreset,
+        .onclose = kyros_http3_onclose,
+        .ctx = server,
+    };
+}
+
+///
+/// Response
+///
+
+void kyros_http3_write_status(kyros_http3_stream* stream, uint16_t status)
+{
+    m_assert(stream->responding && !stream->status && !stream->fields_length && !stream->headers_sent, "kyros_http_response_write_status must come first");
+    m_assert(status >= 100 && status <= 999, "kyros_http_response status must have 3 digits");
+    stream->status = status;
+    // no body at all, not even an empty one
+    stream->bodyless_status = status < 200 || status == 204 || status == 304;
+}
+
+void kyros_http3_write_header(kyros_http3_stream* stream, const char* name, uint32_t name_length, const char* value, uint32_t value_length)
+{
+    m_assert(stream->responding && !stream->headers_sent, "kyros_http_response_write_header after the body");
+    if (stream->closed) {
+        return;
+    }
+    // connection specific fields are HTTP/1 only
+    if (kyros_http_header_name_equals(name, name_length, "connection", 10) || kyros_http_header_name_equals(name, name_length, "keep-alive", 10)
+        || kyros_http_header_name_equals(name, name_length, "transfer-encoding", 17) || kyros_http_header_name_equals(name, name_length, "upgrade", 7)
+        || kyros_http_header_name_equals(name, name_length, "proxy-connection", 16)) {
+        return;
+    }
+    if (kyros_http_header_name_equals(name, name_length, "content-length", 14)) {
+        stream->has_content_length = true;
+    }
+    uint32_t lengths[2] = { name_length, value_length };
+    auto needed = stream->fields_length + (uint32_t)sizeof(lengths) + name_length + value_length;
+    if (needed > stream->fields_capacity) {
+        auto capacity = stream->fields_capacity ? stream->fields_capacity * 2 : 256;
+        while (capacity < needed) {
+            capacity *= 2;
+        }
+        stream->fields = (char*)kyros_resize(stream->fields, capacity);
+        stream->fields_capacity = capacity;
+    }
+    auto out = stream->fields + stream->fields_length;
+    memcpy(out, lengths, sizeof(lengths));
+    out += sizeof(lengths);
+    // names are lowercase in HTTP/3
+    for (uint32_t i = 0; i < name_length; i++) {
+        auto c = name[i];
+        out[i] = c >= 'A' && c <= 'Z' ? (char)(c | 0x20) : c;
+    }
+    memcpy(out + name_length, value, value_length);
+    stream->fields_length = needed;
+}
+
+bool kyros_http3_write(kyros_http3_stream* stream, const char* data, uint64_t length)
+{
+    m_assert(stream->responding, "kyros_http_response_write after end");
+    if (stream->closed || stream->connection->closed) {
+        return false;
+    }
+    if (!stream->headers_sent) {
+        kyros_http3_send_headers(stream, false, false, 0);
+    }
+    if (length && !stream->head_request && !stream->bodyless_status) {
+        return kyros_http3_send_data(stream, data, length, false);
+    }
+    return kyros_quic_stream_write(stream->connection->quic, stream->id, NULL, 0, false);
+}
+
+bool kyros_http3_end(kyros_http3_stream* stream, const char* data, uint64_t length)
+{
+    m_assert(stream->responding, "kyros_http_response_end called twice");
+    stream->responding = false;
+    stream->onabort = NULL;
+    stream->onabort_ctx = NULL;
+    if (stream->closed || stream->connection->closed) {
+        // what closed it (or the dispatch) frees it
+        kyros_http3_stream_release(stream);
+        return false;
+    }
+    auto body = stream->head_request || stream->bodyless_status ? 0 : length;
+    bool writable;
+    if (!stream->headers_sent) {
+        kyros_http3_send_headers(stream, !body, true, length);
+        writable = !body || kyros_http3_send_data(stream, data, body, true);
+    } else {
+        writable = kyros_http3_send_data(stream, data, body, true);
+    }
+    // the quic stream is freed once the FIN is acknowledged
+    if (stream->request_ended) {
+        kyros_http3_stream_close(stream);
+    }
+    return writable;
+}
@@ -0,0 +1,484 @@
+#include <kyros.h>
+#include <kyros_internal.h>
+
+#include <string.h>
+
+// RFC 9204 without a dynamic table, SETTINGS_QPACK_MAX_TABLE_CAPACITY is 0 so the peer only sends static references and literals
+// (no encoder or decoder stream is needed and nothing is ever blocked), responses are encoded the same way
+
+typedef struct {
+    const char* name;
+    const char* value;
+    uint8_t name_length;
+    uint8_t value_length;
+} kyros_qpack_entry;
+
+#define KYROS_QPACK_ENTRY(name, value) { name, value, sizeof(name) - 1, sizeof(value) - 1 }
+
+// RFC 9204 Appendix A
+static const kyros_qpack_entry kyros_qpack_static_table[KYROS_QPACK_STATIC_ENTRIES] = {
+    KYROS_QPACK_ENTRY(":authority", ""),
+    KYROS_QPACK_ENTRY(":path", "/"),
+    KYROS_QPACK_ENTRY("age", "0"),
+    KYROS_QPACK_ENTRY("content-disposition", ""),
+    KYROS_QPACK_ENTRY("content-length", "0"),
+    KYROS_QPACK_ENTRY("cookie", ""),
+    KYROS_QPACK_ENTRY("date", ""),
+    KYROS_QPACK_ENTRY("etag", ""),
+    KYROS_QPACK_ENTRY("if-modified-since", ""),
+    KYROS_QPACK_ENTRY("if-none-match", ""),
+    KYROS_QPACK_ENTRY("last-modified", ""),
+    KYROS_QPACK_ENTRY("link", ""),
+    KYROS_QPACK_ENTRY("location", ""),
+    KYROS_QPACK_ENTRY("referer", ""),
+    KYROS_QPACK_ENTRY("set-cookie", ""),
+    KYROS_QPACK_ENTRY(":method", "CONNECT"),
+    KYROS_QPACK_ENTRY(":method", "DELETE"),
+    KYROS_QPACK_ENTRY(":method", "GET"),
+    KYROS_QPACK_ENTRY(":method", "HEAD"),
+    KYROS_QPACK_ENTRY(":method", "OPTIONS"),
+    KYROS_QPACK_ENTRY(":method", "POST"),
+    KYROS_QPACK_ENTRY(":method", "PUT"),
+    KYROS_QPACK_ENTRY(":scheme", "http"),
+    KYROS_QPACK_ENTRY(":scheme", "https"),
+    KYROS_QPACK_ENTRY(":status", "103"),
+    KYROS_QPACK_ENTRY(":status", "200"),
+    KYROS_QPACK_ENTRY(":status", "304"),
+    KYROS_QPACK_ENTRY(":status", "404"),
+    KYROS_QPACK_ENTRY(":status", "503"),
+    KYROS_QPACK_ENTRY("accept", "*/*"),
+    KYROS_QPACK_ENTRY("accept", "application/dns-message"),
+    KYROS_QPACK_ENTRY("accept-encoding", "gzip, deflate, br"),
+    KYROS_QPACK_ENTRY("accept-ranges", "bytes"),
+    KYROS_QPACK_ENTRY("access-control-allow-headers", "cache-control"),
+    KYROS_QPACK_ENTRY("access-control-allow-headers", "content-type"),
+    KYROS_QPACK_ENTRY("access-control-allow-origin", "*"),
+    KYROS_QPACK_ENTRY("cache-control", "max-age=0"),
+    KYROS_QPACK_ENTRY("cache-control", "max-age=2592000"),
+    KYROS_QPACK_ENTRY("cache-control", "max-age=604800"),
+    KYROS_QPACK_ENTRY("cache-control", "no-cache"),
+    KYROS_QPACK_ENTRY("cache-control", "no-store"),
+    KYROS_QPACK_ENTRY("cache-control", "public, max-age=31536000"),
+    KYROS_QPACK_ENTRY("content-encoding", "br"),
+    KYROS_QPACK_ENTRY("content-encoding", "gzip"),
+    KYROS_QPACK_ENTRY("content-type", "application/dns-message"),
+    KYROS_QPACK_ENTRY("content-type", "application/javascript"),
+    KYROS_QPACK_ENTRY("content-type", "application/json"),
+    KYROS_QPACK_ENTRY("content-type", "application/x-www-form-urlencoded"),
+    KYROS_QPACK_ENTRY("content-type", "image/gif"),
+    KYROS_QPACK_ENTRY("content-type", "image/jpeg"),
+    KYROS_QPACK_ENTRY("content-type", "image/png"),
+    KYROS_QPACK_ENTRY("content-type", "text/css"),
+    KYROS_QPACK_ENTRY("content-type", "text/html; charset=utf-8"),
+    KYROS_QPACK_ENTRY("content-type", "text/plain"),
+    KYROS_QPACK_ENTRY("content-type", "text/plain;charset=utf-8"),
+    KYROS_QPACK_ENTRY("range", "bytes=0-"),
+    KYROS_QPACK_ENTRY("strict-transport-security", "max-age=31536000"),
+    KYROS_QPACK_ENTRY("strict-transport-security", "max-age=31536000; includesubdomains"),
+    KYROS_QPACK_ENTRY("strict-transport-security", "max-age=31536000; includesubdomains; preload"),
+    KYROS_QPACK_ENTRY("vary", "accept-encoding"),
+    KYROS_QPACK_ENTRY("vary", "origin"),
+    KYROS_QPACK_ENTRY("x-content-type-options", "nosniff"),
+    KYROS_QPACK_ENTRY("x-xss-protection", "1; mode=block"),
+    KYROS_QPACK_ENTRY(":status", "100"),
+    KYROS_QPACK_ENTRY(":status", "204"),
+    KYROS_QPACK_ENTRY(":status", "206"),
+    KYROS_QPACK_ENTRY(":status", "302"),
+    KYROS_QPACK_ENTRY(":status", "400"),
+    KYROS_QPACK_ENTRY(":status", "403"),
+    KYROS_QPACK_ENTRY(":status", "421"),
+    KYROS_QPACK_ENTRY(":status", "425"),
+    KYROS_QPACK_ENTRY(":status", "500"),
+    KYROS_QPACK_ENTRY("accept-language", ""),
+    KYROS_QPACK_ENTRY("access-control-allow-credentials", "FALSE"),
+    KYROS_QPACK_ENTRY("access-control-allow-credentials", "TRUE"),
+    KYROS_QPACK_ENTRY("access-control-allow-headers", "*"),
+    KYROS_QPACK_ENTRY("access-control-allow-methods", "get"),
+    KYROS_QPACK_ENTRY("access-control-allow-methods", "get, post, options"),
+    KYROS_QPACK_ENTRY("access-control-allow-methods", "options"),
+    KYROS_QPACK_ENTRY("access-control-expose-headers", "content-length"),
+    KYROS_QPACK_ENTRY("access-control-request-headers", "content-type"),
+    KYROS_QPACK_ENTRY("access-control-request-method", "get"),
+    KYROS_QPACK_ENTRY("access-control-request-method", "post"),
+    KYROS_QPACK_ENTRY("alt-svc", "clear"),
+    KYROS_QPACK_ENTRY("authorization", ""),
+    KYROS_QPACK_ENTRY("content-security-policy", "script-src 'none'; object-src 'none'; base-uri 'none'"),
+    KYROS_QPACK_ENTRY("early-data", "1"),
+    KYROS_QPACK_ENTRY("expect-ct", ""),
+    KYROS_QPACK_ENTRY("forwarded", ""),
+    KYROS_QPACK_ENTRY("if-range", ""),
+    KYROS_QPACK_ENTRY("origin", ""),
+    KYROS_QPACK_ENTRY("purpose", "prefetch"),
+    KYROS_QPACK_ENTRY("server", ""),
+    KYROS_QPACK_ENTRY("timing-allow-origin", "*"),
+    KYROS_QPACK_ENTRY("upgrade-insecure-requests", "1"),
+    KYROS_QPACK_ENTRY("user-agent", ""),
+    KYROS_QPACK_ENTRY("x-forwarded-for", ""),
+    KYROS_QPACK_ENTRY("x-frame-options", "deny"),
+    KYROS_QPACK_ENTRY("x-frame-options", "sameorigin"),
+};
+
+///
+/// Huffman
+///
+
+// RFC 7541 Appendix B, the code is canonical: codes of one length are consecutive and ordered by symbol
+static const uint32_t kyros_qpack_huffman_codes[256] = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+    0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+    0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+    0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+    0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+    0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+    0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+    0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+    0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+    0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+    0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+    0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+    0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+    0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+    0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+    0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+    0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+    0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+    0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+    0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+    0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+    0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+    0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+    0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+    0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+    0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+    0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+    0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+    0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+    0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+    0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+};
+
+static const uint8_t kyros_qpack_huffman_lengths[256] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+};
+
+static const uint8_t kyros_qpack_huffman_symbols[256] = {
+    48, 49, 50, 97, 99, 101, 105, 111, 115, 116, 32, 37, 45, 46, 47, 51,
+    52, 53, 54, 55, 56, 57, 61, 65, 95, 98, 100, 102, 103, 104, 108, 109,
+    110, 112, 114, 117, 58, 66, 67, 68, 69, 70, 71, 72, 73, 74, 75, 76,
+    77, 78, 79, 80, 81, 82, 83, 84, 85, 86, 87, 89, 106, 107, 113, 118,
+    119, 120, 121, 122, 38, 42, 44, 59, 88, 90, 33, 34, 40, 41, 63, 39,
+    43, 124, 35, 62, 0, 36, 64, 91, 93, 126, 94, 125, 60, 96, 123, 92,
+    195, 208, 128, 130, 131, 162, 184, 194, 224, 226, 153, 161, 167, 172, 176, 177,
+    179, 209, 216, 217, 227, 229, 230, 129, 132, 133, 134, 136, 146, 154, 156, 160,
+    163, 164, 169, 170, 173, 178, 181, 185, 186, 187, 189, 190, 196, 198, 228, 232,
+    233, 1, 135, 137, 138, 139, 140, 141, 143, 147, 149, 150, 151, 152, 155, 157,
+    158, 165, 166, 168, 174, 175, 180, 182, 183, 188, 191, 197, 231, 239, 9, 142,
+    144, 145, 148, 159, 171, 206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193,
+    200, 201, 202, 205, 210, 213, 218, 219, 238, 240, 242, 243, 255, 203, 204, 211,
+    212, 214, 221, 222, 223, 241, 244, 245, 246, 247, 248, 250, 251, 252, 253, 254,
+    2, 3, 4, 5, 6, 7, 8, 11, 12, 14, 15, 16, 17, 18, 19, 20,
+    21, 23, 24, 25, 26, 27, 28, 29, 30, 31, 127, 220, 249, 10, 13, 22,
+};
+
+static const uint64_t kyros_qpack_huffman_limits[31] = {
+    0x0, 0x0, 0x0, 0x0, 0x0, 0x50000000,
+    0xb8000000, 0xf8000000, 0xfe000000, 0xfe000000, 0xff400000, 0xffa00000,
+    0xffc00000, 0xfff00000, 0xfff80000, 0xfffe0000, 0xfffe0000, 0xfffe0000,
+    0xfffe0000, 0xfffe6000, 0xfffee000, 0xffff4800, 0xffffb000, 0xffffea00,
+    0xfffff600, 0xfffff800, 0xfffffbc0, 0xfffffe20, 0xfffffff0, 0xfffffff0,
+    0x100000000,
+};
+
+static const uint32_t kyros_qpack_huffman_first[31] = {
+    0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x14, 0x5c,
+    0xf8, 0x0, 0x3f8, 0x7fa, 0xffa, 0x1ff8, 0x3ffc, 0x7ffc,
+    0x0, 0x0, 0x0, 0x7fff0, 0xfffe6, 0x1fffdc, 0x3fffd2, 0x7fffd8,
+    0xffffea, 0x1ffffec, 0x3ffffe0, 0x7ffffde, 0xfffffe2, 0x0, 0x3ffffffc,
+};
+
+static const uint16_t kyros_qpack_huffman_offsets[31] = {
+    0, 0, 0, 0, 0, 0, 10, 36, 68, 0, 74, 79, 82, 84, 90, 92,
+    0, 0, 0, 95, 98, 106, 119, 145, 174, 186, 190, 205, 224, 0, 253,
+};
+
+static uint32_t kyros_qpack_huffman_length(const char* data, uint32_t length)
+{
+    uint64_t bits = 0;
+    for (uint32_t i = 0; i < length; i++) {
+        bits += kyros_qpack_huffman_lengths[(uint8_t)data[i]];
+    }
+    return (uint32_t)((bits + 7) / 8);
+}
+
+static uint8_t* kyros_qpack_huffman_encode(uint8_t* out, const char* data, uint32_t length)
+{
+    uint64_t bits = 0;
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < length; i++) {
+        auto symbol = (uint8_t)data[i];
+        bits = bits << kyros_qpack_huffman_lengths[symbol] | kyros_qpack_huffman_codes[symbol];
+        count += kyros_qpack_huffman_lengths[symbol];
+        while (count >= 8) {
+            count -= 8;
+            *out++ = (uint8_t)(bits >> count);
+        }
+    }
+    if (count) {
+        // padded with the most significant bits of EOS
+        *out++ = (uint8_t)(bits << (8 - count) | (0xff >> count));
+    }
+    return out;
+}
+
+/// @brief returns the decoded length or -1 if data is not valid (EOS, more than 7 bits of padding or padding that is not EOS)
+/// out needs room for length * 8 / 5 bytes
+static int64_t kyros_qpack_huffman_decode(const uint8_t* data, uint64_t length, char* out)
+{
+    auto start = out;
+    auto end = data + length;
+    uint64_t bits = 0;
+    uint32_t count = 0;
+    for (;;) {
+        while (count <= 56 && data < end) {
+            bits = bits << 8 | *data++;
+            count += 8;
+        }
+        if (!count) {
+            return out - start;
+        }
+        // the next 32 bits left aligned, zeros past the end
+        auto window = count >= 32 ? (bits >> (count - 32)) & 0xffffffff : (bits << (32 - count)) & 0xffffffff;
+        uint32_t code_length = 5;
+        while (window >= kyros_qpack_huffman_limits[code_length]) {
+            code_length++;
+        }
+        if (code_length > count) {
+            // the padding, at most 7 bits all set
+            auto mask = (1ull << count) - 1;
+            return count < 8 && (bits & mask) == mask ? out - start : -1;
+        }
+        auto index = kyros_qpack_huffman_offsets[code_length] + (uint32_t)(window >> (32 - code_length)) - kyros_qpack_huffman_first[code_length];
+        if (index >= 256) {
+            // EOS
+            return -1;
+        }
+        *out++ = (char)kyros_qpack_huffman_symbols[index];
+        count -= code_length;
+    }
+}
+
+///
+/// Integers and strings
+///
+
+/// @brief prefix integer (RFC 7541 5.1) of the low prefix bits of the first byte, false if data ends before it or it is too large
+static bool kyros_qpack_read_integer(const uint8_t** data, const uint8_t* end, uint32_t prefix, uint64_t* value)
+{
+    auto p = *data;
+    if (p >= end) {
+        return false;
+    }
+    uint64_t max = (1u << prefix) - 1;
+    uint64_t result = *p++ & max;
+    if (result == max) {
+        uint32_t shift = 0;
+        for (;;) {
+            if (p >= end || shift > 56) {
+                return false;
+            }
+            auto byte = *p++;
+            result += (uint64_t)(byte & 0x7f) << shift;
+            shift += 7;
+            if (!(byte & 0x80)) {
+                break;
+            }
+        }
+    }
+    *data = p;
+    *value = result;
+    return true;
+}
+
+static uint8_t* kyros_qpack_write_integer(uint8_t* out, uint8_t first, uint32_t prefix, uint64_t value)
+{
+    uint64_t max = (1u << prefix) - 1;
+    if (value < max) {
+        *out++ = (uint8_t)(first | value);
+        return out;
+    }
+    *out++ = (uint8_t)(first | max);
+    value -= max;
+    while (value >= 128) {
+        *out++ = (uint8_t)(0x80 | (value & 0x7f));
+        value >>= 7;
+    }
+    *out++ = (uint8_t)value;
+    return out;
+}
+
+/// @brief string with its length in a prefix integer, the bit above the prefix tells it is Huffman encoded (when it is shorter)
+static uint8_t* kyros_qpack_write_string(uint8_t* out, uint8_t first, uint32_t prefix, const char* data, uint32_t length)
+{
+    auto huffman_length = kyros_qpack_huffman_length(data, length);
+    if (huffman_length < length) {
+        out = kyros_qpack_write_integer(out, (uint8_t)(first | (1u << prefix)), prefix, huffman_length);
+        return kyros_qpack_huffman_encode(out, data, length);
+    }
+    out = kyros_qpack_write_integer(out, first, prefix, length);
+    memcpy(out, data, length);
+    return out + length;
+}
+
+///
+/// Decoding
+///
+
+/// @brief room for needed bytes at offset of server->decoded, with KYROS_RECV_BUFFER_PADDING after it for the validation
+static void kyros_qpack_reserve(kyros_http_server* server, uint64_t offset, uint64_t needed)
+{
+    if (offset + needed <= server->decoded_capacity) {
+        return;
+    }
+    auto capacity = server->decoded_capacity ? server->decoded_capacity * 2 : 4096;
+    while (capacity < offset + needed) {
+        capacity *= 2;
+    }
+    server->decoded = (char*)kyros_resize(server->decoded, capacity + KYROS_RECV_BUFFER_PADDING);
+    server->decoded_capacity = (uint32_t)capacity;
+}
+
+/// @brief string of a field line decoded at offset of server->decoded, returns its length or -1 if it is not valid
+static int64_t kyros_qpack_read_string(kyros_http_server* server, const uint8_t** data, const uint8_t* end, uint32_t prefix, uint64_t offset)
+{
+    auto huffman = **data & (1u << prefix);
+    uint64_t length;
+    if (!kyros_qpack_read_integer(data, end, prefix, &length) || length > (uint64_t)(end - *data)) {
+        return -1;
+    }
+    auto p = *data;
+    *data += length;
+    if (huffman) {
+        kyros_qpack_reserve(server, offset, length * 8 / 5 + 1);
+        return kyros_qpack_huffman_decode(p, length, server->decoded + offset);
+    }
+    kyros_qpack_reserve(server, offset, length);
+    memcpy(server->decoded + offset, p, length);
+    return (int64_t)length;
+}
+
+int32_t kyros_qpack_decode(kyros_http_server* server, const uint8_t* data, uint64_t length, uint32_t* size)
+{
+    auto end = data + length;
+    uint64_t required_insert_count;
+    uint64_t delta_base;
+    // without a dynamic table the Base is never used
+    if (!kyros_qpack_read_integer(&data, end, 8, &required_insert_count) || required_insert_count
+        || !kyros_qpack_read_integer(&data, end, 7, &delta_base)) {
+        return -1;
+    }
+    auto max_header_size = server->options.max_header_size;
+    uint32_t offset = 0;
+    uint32_t total = 0;
+    int32_t count = 0;
+    while (data < end) {
+        auto first = *data;
+        uint64_t index;
+        int64_t name_length;
+        int64_t value_length;
+        if (first & 0x80) {
+            // indexed field line, 1 T index
+            if (!(first & 0x40) || !kyros_qpack_read_integer(&data, end, 6, &index) || index >= KYROS_QPACK_STATIC_ENTRIES) {
+                return -1;
+            }
+            auto entry = &kyros_qpack_static_table[index];
+            name_length = entry->name_length;
+            value_length = entry->value_length;
+            kyros_qpack_reserve(server, offset, (uint64_t)name_length + value_length);
+            memcpy(server->decoded + offset, entry->name, entry->name_length);
+            memcpy(server->decoded + offset + name_length, entry->value, entry->value_length);
+        } else if (first & 0x40) {
+            // literal field line with name reference, 0 1 N T index
+            if (!(first & 0x10) || !kyros_qpack_read_integer(&data, end, 4, &index) || index >= KYROS_QPACK_STATIC_ENTRIES) {
+                return -1;
+            }
+            auto entry = &kyros_qpack_static_table[index];
+            name_length = entry->name_length;
+            kyros_qpack_reserve(server, offset, (uint64_t)name_length);
+            memcpy(server->decoded + offset, entry->name, entry->name_length);
+            value_length = kyros_qpack_read_string(server, &data, end, 7, offset + (uint64_t)name_length);
+        } else if (first & 0x20) {
+            // literal field line with literal name, 0 0 1 N H length
+            name_length = kyros_qpack_read_string(server, &data, end, 3, offset);
+            if (name_length < 0) {
+                return -1;
+            }
+            value_length = kyros_qpack_read_string(server, &data, end, 7, offset + (uint64_t)name_length);
+        } else {
+            // post-base references, only the dynamic table has them
+            return -1;
+        }
+        if (value_length < 0 || (uint64_t)name_length + (uint64_t)value_length > UINT32_MAX - total) {
+            return -1;
+        }
+        auto field_size = (uint32_t)(name_length + value_length);
+        total += field_size;
+        // past the limits the next field is decoded over this one
+        if (total <= max_header_size && count < KYROS_HTTP2_MAX_FIELDS) {
+            auto field = server->field_offsets[count];
+            field[0] = offset;
+            field[1] = (uint32_t)name_length;
+            field[2] = offset + (uint32_t)name_length;
+            field[3] = (uint32_t)value_length;
+            offset += field_size;
+        }
+        count++;
+    }
+    *size = total;
+    return count;
+}
+
+///
+/// Encoding
+///
+
+uint8_t* kyros_qpack_encode_field(uint8_t* out, const char* name, uint32_t name_length, const char* value, uint32_t value_length)
+{
+    uint32_t name_index = KYROS_QPACK_STATIC_ENTRIES;
+    for (uint32_t i = 0; i < KYROS_QPACK_STATIC_ENTRIES; i++) {
+        auto entry = &kyros_qpack_static_table[i];
+        if (entry->name_length != name_length || memcmp(entry->name, name, name_length)) {
+            continue;
+        }
+        if (entry->value_length == value_length && !memcmp(entry->value, value, value_length)) {
+            // indexed field line, 1 T=1 index
+            return kyros_qpack_write_integer(out, 0xc0, 6, i);
+        }
+        if (name_index == KYROS_QPACK_STATIC_ENTRIES) {
+            name_index = i;
+        }
+    }
+    if (name_index < KYROS_QPACK_STATIC_ENTRIES) {
+        // literal field line with name reference, 0 1 N=0 T=1 index
+        out = kyros_qpack_write_integer(out, 0x50, 4, name_index);
+    } else {
+        // literal field line with literal name, 0 0 1 N=0 H length
+        out = kyros_qpack_write_string(out, 0x20, 3, name, name_length);
+    }
+    return kyros_qpack_write_string(out, 0, 7, value, value_length);
+}
@@ -0,0 +1,560 @@
+#include <kyros.h>
+#include <kyros_internal.h>
+
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+// request heads are parsed in place, every input (loop recv buffer, io_uring buffers, decrypt buffer,
+// connection buffer) has KYROS_RECV_BUFFER_PADDING readable bytes after its end so the last vector
+// can be loaded whole, what is found past the end is ignored
+
+static_assert(KYROS_RECV_BUFFER_PADDING >= 32, "the scanner loads up to 32 bytes past the end");
+
+// tchar of RFC 9110, methods and header names
+static const bool kyros_http_token[256] = {
+    ['!'] = true, ['#'] = true, ['$'] = true, ['%'] = true, ['&'] = true, ['\''] = true, ['*'] = true,
+    ['+'] = true, ['-'] = true, ['.'] = true, ['^'] = true, ['_'] = true, ['`'] = true, ['|'] = true, ['~'] = true,
+    ['0'] = true, ['1'] = true, ['2'] = true, ['3'] = true, ['4'] = true, ['5'] = true, ['6'] = true, ['7'] = true, ['8'] = true, ['9'] = true,
+    ['A'] = true, ['B'] = true, ['C'] = true, ['D'] = true, ['E'] = true, ['F'] = true, ['G'] = true, ['H'] = true, ['I'] = true,
+    ['J'] = true, ['K'] = true, ['L'] = true, ['M'] = true, ['N'] = true, ['O'] = true, ['P'] = true, ['Q'] = true, ['R'] = true,
+    ['S'] = true, ['T'] = true, ['U'] = true, ['V'] = true, ['W'] = true, ['X'] = true, ['Y'] = true, ['Z'] = true,
+    ['a'] = true, ['b'] = true, ['c'] = true, ['d'] = true, ['e'] = true, ['f'] = true, ['g'] = true, ['h'] = true, ['i'] = true,
+    ['j'] = true, ['k'] = true, ['l'] = true, ['m'] = true, ['n'] = true, ['o'] = true, ['p'] = true, ['q'] = true, ['r'] = true,
+    ['s'] = true, ['t'] = true, ['u'] = true, ['v'] = true, ['w'] = true, ['x'] = true, ['y'] = true, ['z'] = true,
+};
+
+///
+/// Scanner
+///
+
+/// @brief first byte of [p, end) below `below` (unsigned) or DEL, end if there is none
+static inline const char* kyros_http_find_ctl(const char* p, const char* end, uint8_t below)
+{
+#if defined(__AVX2__)
+    // x <= below - 1 is min(x, below - 1) == x, there is no unsigned compare
+    auto limit = _mm256_set1_epi8((char)(below - 1));
+    auto del = _mm256_set1_epi8(0x7f);
+    for (; p < end; p += 32) {
+        auto bytes = _mm256_loadu_si256((const __m256i*)p);
+        auto found = _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(bytes, limit), bytes), _mm256_cmpeq_epi8(bytes, del));
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(found);
+        if (mask) {
+            p += __builtin_ctzg(mask);
+            return p < end ? p : end;
+        }
+    }
+    return end;
+#elif defined(__SSE2__) || defined(_M_X64)
+    auto limit = _mm_set1_epi8((char)(below - 1));
+    auto del = _mm_set1_epi8(0x7f);
+    for (; p < end; p += 16) {
+        auto bytes = _mm_loadu_si128((const __m128i*)p);
+        auto found = _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(bytes, limit), bytes), _mm_cmpeq_epi8(bytes, del));
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(found);
+        if (mask) {
+            p += __builtin_ctzg(mask);
+            return p < end ? p : end;
+        }
+    }
+    return end;
+#elif defined(__ARM_NEON)
+    auto limit = vdupq_n_u8(below);
+    auto del = vdupq_n_u8(0x7f);
+    for (; p < end; p += 16) {
+        auto bytes = vld1q_u8((const uint8_t*)p);
+        auto found = vorrq_u8(vcltq_u8(bytes, limit), vceqq_u8(bytes, del));
+        // no movemask on NEON, narrowing leaves 4 bits per byte
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(found), 4)), 0);
+        if (mask) {
+            p += __builtin_ctzg(mask) >> 2;
+            return p < end ? p : end;
+        }
+    }
+    return end;
+#else
+    for (; p < end; p++) {
+        if ((uint8_t)*p < below || *p == 0x7f) {
+            return p;
+        }
+    }
+    return end;
+#endif
+}
+
+/// @brief end of a field value (the CR), tabs are allowed, end if the line is not complete
+static inline const char* kyros_http_find_value_end(const char* p, const char* end)
+{
+    for (;;) {
+        p = kyros_http_find_ctl(p, end, 0x20);
+        if (p == end || *p != '\t') {
+            return p;
+        }
+        p++;
+    }
+}
+
+static inline bool kyros_http_equals_lowercase(const char* data, uint32_t length, const char* lowercase, uint32_t lowercase_length)
+{
+    if (length != lowercase_length) {
+        return false;
+    }
+    for (uint32_t i = 0; i < length; i++) {
+        // only compared against letters and '-', the bit 0x20 folds the case
+        if ((data[i] | 0x20) != lowercase[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool kyros_http_value_has_token(const char* value, uint32_t length, const char* token, uint32_t token_length)
+{
+    // comma separated list, like "keep-alive, Upgrade"
+    uint32_t i = 0;
+    while (i < length) {
+        while (i < length && (value[i] == ' ' || value[i] == '\t' || value[i] == ',')) {
+            i++;
+        }
+        uint32_t start = i;
+        while (i < length && value[i] != ',' && value[i] != ' ' && value[i] != '\t') {
+            i++;
+        }
+        if (kyros_http_equals_lowercase(value + start, i - start, token, token_length)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool kyros_http_header_name_equals(const char* name, uint32_t length, const char* other, uint32_t other_length)
+{
+    if (length != other_length) {
+        return false;
+    }
+    for (uint32_t i = 0; i < length; i++) {
+        char a = name[i];
+        char b = other[i];
+        if (a >= 'A' && a <= 'Z') {
+            a |= 0x20;
+        }
+        if (b >= 'A' && b <= 'Z') {
+            b |= 0x20;
+        }
+        if (a != b) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/// @brief HTTP/2 field names, lowercase tokens
+bool kyros_http_name_is_valid(const char* name, uint32_t length)
+{
+    if (!length) {
+        return false;
+    }
+    for (uint32_t i = 0; i < length; i++) {
+        auto c = (uint8_t)name[i];
+        if (!kyros_http_token[c] || (c >= 'A' && c <= 'Z')) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/// @brief no control character other than tab
+bool kyros_http_value_is_valid(const char* value, uint32_t length)
+{
+    return kyros_http_find_value_end(value, value + length) == value + length;
+}
+
+///
+/// Request head
+///
+
+bool kyros_http_parse_content_length(const char* value, uint32_t length, int64_t* content_length)
+{
+    if (!length || length > 18) {
+        return false;
+    }
+    int64_t result = 0;
+    for (uint32_t i = 0; i < length; i++) {
+        if (value[i] < '0' || value[i] > '9') {
+            return false;
+        }
+        result = result * 10 + (value[i] - '0');
+    }
+    // repeated headers must agree
+    if (*content_length >= 0 && *content_length != result) {
+        return false;
+    }
+    *content_length = result;
+    return true;
+}
+
+int64_t kyros_http_parse_request(const char* data, uint64_t length, kyros_http_request* request, kyros_http_header* headers, uint32_t max_headers, kyros_http_framing* framing)
+{
+    auto p = data;
+    auto end = data + length;
+
+    // method
+    auto method = p;
+    while (p < end && kyros_http_token[(uint8_t)*p]) {
+        p++;
+    }
+    if (p == end) {
+        return KYROS_HTTP_PARSE_INCOMPLETE;
+    }
+    if (p == method || *p != ' ') {
+        return KYROS_HTTP_PARSE_ERROR;
+    }
+    request->method = method;
+    request->method_length = (uint32_t)(p - method);
+    p++;
+
+    // target, anything visible up to the space
+    auto target = p;
+    p = kyros_http_find_ctl(p, end, 0x21);
+    if (p == end) {
+        return KYROS_HTTP_PARSE_INCOMPLETE;
+    }
+    if (p == target || *p != ' ') {
+        return KYROS_HTTP_PARSE_ERROR;
+    }
+    request->target = target;
+    request->target_length = (uint32_t)(p - target);
+    p++;
+
+    // HTTP/1.x\r\n
+    if (end - p < 10) {
+        // reject early what can't become a version
+        auto available = (uint64_t)(end - p);
+        return memcmp(p, "HTTP/1.", available < 7 ? available : 7) ? KYROS_HTTP_PARSE_ERROR : KYROS_HTTP_PARSE_INCOMPLETE;
+    }
+    if (memcmp(p, "HTTP/1.", 7) || (p[7] != '0' && p[7] != '1') || p[8] != '\r' || p[9] != '\n') {
+        return KYROS_HTTP_PARSE_ERROR;
+    }
+    request->minor_version = (uint8_t)(p[7] - '0');
+    p += 10;
+
+    *framing = (kyros_http_framing) { .content_length = -1 };
+    bool keep_alive = request->minor_version == 1;
+    uint32_t count = 0;
+    for (;;) {
+        if (end - p < 2) {
+            return p < end && *p != '\r' && !kyros_http_token[(uint8_t)*p] ? KYROS_HTTP_PARSE_ERROR : KYROS_HTTP_PARSE_INCOMPLETE;
+        }
+        if (p[0] == '\r') {
+            if (p[1] != '\n') {
+                return KYROS_HTTP_PARSE_ERROR;
+            }
+            p += 2;
+            break;
+        }
+        if (count == max_headers) {
+            return KYROS_HTTP_PARSE_TOO_LARGE;
+        }
+
+        // name, no space before the colon (and no obsolete line folding)
+        auto name = p;
+        while (p < end && kyros_http_token[(uint8_t)*p]) {
+            p++;
+        }
+        if (p == end) {
+            return KYROS_HTTP_PARSE_INCOMPLETE;
+        }
+        if (p == name || *p != ':') {
+            return KYROS_HTTP_PARSE_ERROR;
+        }
+        auto name_length = (uint32_t)(p - name);
+        p++;
+        while (p < end && (*p == ' ' || *p == '\t')) {
+            p++;
+        }
+
+        // value, the scanner does the long part
+        auto value = p;
+        p = kyros_http_find_value_end(p, end);
+        if (p == end || end - p < 2) {
+            return KYROS_HTTP_PARSE_INCOMPLETE;
+        }
+        if (p[0] != '\r' || p[1] != '\n') {
+            return KYROS_HTTP_PARSE_ERROR;
+        }
+        auto value_end = p;
+        while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t')) {
+            value_end--;
+        }
+        auto value_length = (uint32_t)(value_end - value);
+        p += 2;
+
+        headers[count++] = (kyros_http_header) { .name = name, .value = value, .name_length = name_length, .value_length = value_length };
+
+        // only the headers deciding the framing are looked at here
+        if (kyros_http_equals_lowercase(name, name_length, "content-length", 14)) {
+            if (!kyros_http_parse_content_length(value, value_length, &framing->content_length)) {
+                return KYROS_HTTP_PARSE_ERROR;
+            }
+        } else if (kyros_http_equals_lowercase(name, name_length, "transfer-encoding", 17)) {
+            // chunked must be the last coding, anything else can't be framed
+            if (!kyros_http_equals_lowercase(value, value_length, "chunked", 7)) {
+                return KYROS_HTTP_PARSE_ERROR;
+            }
+            framing->chunked = true;
+        } else if (kyros_http_equals_lowercase(name, name_length, "connection", 10)) {
+            if (kyros_http_value_has_token(value, value_length, "close", 5)) {
+                keep_alive = false;
+            } else if (kyros_http_value_has_token(value, value_length, "keep-alive", 10)) {
+                keep_alive = true;
+            }
+        }
+    }
+    // both is how requests are smuggled
+    if (framing->chunked && framing->content_length >= 0) {
+        return KYROS_HTTP_PARSE_ERROR;
+    }
+    request->headers = headers;
+    request->header_count = count;
+    request->keep_alive = keep_alive;
+    request->http2 = false;
+    request->http3 = false;
+    request->body = NULL;
+    request->body_length = 0;
+    return p - data;
+}
+
+///
+/// HTTP/2 and HTTP/3 fields
+///
+
+// RFC 9113 8.3 and RFC 9114 4.3, pseudo headers first and once each, no connection specific field
+bool kyros_http_parse_fields(const char* decoded, uint32_t (*field_offsets)[4], uint32_t count, kyros_http_fields* fields,
+    kyros_http_header* headers, uint32_t* header_count)
+{
+    const char* scheme = NULL;
+    const char* authority = NULL;
+    uint32_t authority_length = 0;
+    uint32_t regular = 0;
+    auto has_host = false;
+    for (uint32_t i = 0; i < count; i++) {
+        auto field = field_offsets[i];
+        auto name = decoded + field[0];
+        auto name_length = field[1];
+        auto value = decoded + field[2];
+        auto value_length = field[3];
+        if (name_length && name[0] == ':') {
+            // pseudo headers come first, once each
+            const char** target;
+            uint32_t* target_length = NULL;
+            if (regular) {
+                return false;
+            }
+            if (name_length == 7 && !memcmp(name, ":method", 7)) {
+                target = &fields->method;
+                target_length = &fields->method_length;
+            } else if (name_length == 5 && !memcmp(name, ":path", 5)) {
+                target = &fields->target;
+                target_length = &fields->target_length;
+            } else if (name_length == 7 && !memcmp(name, ":scheme", 7)) {
+                target = &scheme;
+            } else if (name_length == 10 && !memcmp(name, ":authority", 10)) {
+                target = &authority;
+                target_length = &authority_length;
+            } else {
+                return false;
+            }
+            if (*target || !kyros_http_value_is_valid(value, value_length)) {
+                return false;
+            }
+            *target = value;
+            if (target_length) {
+                *target_length = value_length;
+            }
+            continue;
+        }
+        if (!kyros_http_name_is_valid(name, name_length) || !kyros_http_value_is_valid(value, value_length)) {
+            return false;
+        }
+        switch (name_length) {
+        case 2:
+            if (!memcmp(name, "te", 2) && (value_length != 8 || memcmp(value, "trailers", 8))) {
+                return false;
+            }
+            break;
+        case 4:
+            has_host = has_host || !memcmp(name, "host", 4);
+            break;
+        case 7:
+            if (!memcmp(name, "upgrade", 7)) {
+                return false;
+            }
+            break;
+        case 10:
+            // connection specific fields have no meaning here
+            if (!memcmp(name, "connection", 10) || !memcmp(name, "keep-alive", 10)) {
+                return false;
+            }
+            break;
+        case 14:
+            if (!memcmp(name, "content-length", 14) && !kyros_http_parse_content_length(value, value_length, &fields->content_length)) {
+                return false;
+            }
+            break;
+        case 16:
+            if (!memcmp(name, "proxy-connection", 16)) {
+                return false;
+            }
+            break;
+        case 17:
+            if (!memcmp(name, "transfer-encoding", 17)) {
+                return false;
+            }
+            break;
+        }
+        headers[regular++] = (kyros_http_header) { .name = name, .value = value, .name_length = name_length, .value_length = value_length };
+    }
+    if (!fields->method) {
+        return false;
+    }
+    if (fields->method_length == 7 && !memcmp(fields->method, "CONNECT", 7)) {
+        // the target is the authority
+        if (!authority || scheme || fields->target) {
+            return false;
+        }
+        fields->target = authority;
+        fields->target_length = authority_length;
+    } else if (!scheme || !fields->target || !fields->target_length) {
+        return false;
+    }
+    if (authority && !has_host) {
+        headers[regular++] = (kyros_http_header) { .name = "host", .value = authority, .name_length = 4, .value_length = authority_length };
+    }
+    *header_count = regular;
+    return true;
+}
+
+///
+/// Chunked body
+///
+
+static inline int32_t kyros_http_hex(char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c |= 0x20;
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    return -1;
+}
+
+/// @brief chunk size line (size, extensions, CRLF), returns its length, 0 if incomplete, -1 if malformed
+static int64_t kyros_http_chunk_header(const char* data, const char* end, uint64_t* size)
+{
+    auto p = data;
+    uint64_t result = 0;
+    uint32_t digits = 0;
+    while (p < end && kyros_http_hex(*p) >= 0) {
+        if (++digits > 15) {
+            return KYROS_HTTP_PARSE_ERROR;
+        }
+        result = result * 16 + (uint64_t)kyros_http_hex(*p);
+        p++;
+    }
+    if (p == end) {
+        return KYROS_HTTP_PARSE_INCOMPLETE;
+    }
+    if (!digits) {
+        return KYROS_HTTP_PARSE_ERROR;
+    }
+    if (*p == ';') {
+        // extensions are ignored
+        p = kyros_http_find_value_end(p, end);
+    }
+    if (end - p < 2) {
+        return KYROS_HTTP_PARSE_INCOMPLETE;
+    }
+    if (p[0] != '\r' || p[1] != '\n') {
+        return KYROS_HTTP_PARSE_ERROR;
+    }
+    *size = result;
+    return p + 2 - data;
+}
+
+int64_t kyros_http_chunked_scan(const char* data, uint64_t length, uint64_t max_body, kyros_http_chunked_state* state)
+{
+    auto p = data + state->offset;
+    auto end = data + length;
+    while (!state->last_chunk) {
+        uint64_t size;
+        auto header = kyros_http_chunk_header(p, end, &size);
+        if (header <= 0) {
+            return header;
+        }
+        if (!size) {
+            p += header;
+            state->last_chunk = true;
+            state->offset = p - data;
+            break;
+        }
+        if (size > max_body - state->body_length) {
+            return KYROS_HTTP_PARSE_TOO_LARGE;
+        }
+        // a chunk is only taken whole, until then the next call looks at its header again
+        if ((uint64_t)(end - p - header) < size + 2) {
+            return KYROS_HTTP_PARSE_INCOMPLETE;
+        }
+        if (p[header + size] != '\r' || p[header + size + 1] != '\n') {
+            return KYROS_HTTP_PARSE_ERROR;
+        }
+        p += header + size + 2;
+        state->body_length += size;
+        state->offset = p - data;
+    }
+    // trailer fields are skipped, the body ends with an empty line
+    for (;;) {
+        if (end - p < 2) {
+            return KYROS_HTTP_PARSE_INCOMPLETE;
+        }
+        if (p[0] == '\r') {
+            if (p[1] != '\n') {
+                return KYROS_HTTP_PARSE_ERROR;
+            }
+            return p + 2 - data;
+        }
+        auto line_end = kyros_http_find_value_end(p, end);
+        if (end - line_end < 2) {
+            return KYROS_HTTP_PARSE_INCOMPLETE;
+        }
+        if (line_end[0] != '\r' || line_end[1] != '\n') {
+            return KYROS_HTTP_PARSE_ERROR;
+        }
+        p = line_end + 2;
+        state->offset = p - data;
+    }
+}
+
+void kyros_http_chunked_decode(const char* data, uint64_t length, char* out)
+{
+    auto p = data;
+    auto end = data + length;
+    for (;;) {
+        uint64_t size;
+        // already validated by kyros_http_chunked_scan
+        p += kyros_http_chunk_header(p, end, &size);
+        if (!size) {
+            return;
+        }
+        memcpy(out, p, size);
+        out += size;
+        p += size + 2;
+    }
+}
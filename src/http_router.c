@@ -0,0 +1,516 @@
+#include <kyros.h>
+#include <kyros_internal.h>
+
+#include <ada_c.h>
+#include <string.h>
+
+// routes are added to a pointer based radix tree, compile flattens it into arrays (nodes in breadth first order, the
+// first byte of every static prefix next to its siblings for memchr) and the lookup walks them without allocating,
+// the parameters are slices of the path. Targets are only given to ada when the path could change once normalized
+
+static const char* kyros_http_router_method_names[KYROS_HTTP_ROUTER_ANY] = {
+    "GET", "HEAD", "POST", "PUT", "DELETE", "PATCH", "OPTIONS", "CONNECT", "TRACE"
+};
+
+// what a lookup found, the values of the params of the route are at the index of their segment
+typedef struct {
+    const char* values[KYROS_HTTP_ROUTER_MAX_PARAMS];
+    uint32_t lengths[KYROS_HTTP_ROUTER_MAX_PARAMS];
+    // first node the path ended on without a route for the method, for 405
+    uint32_t not_allowed;
+} kyros_http_router_lookup;
+
+static kyros_http_router_method kyros_http_router_parse_method(const char* method, uint32_t length)
+{
+    // one candidate per length and first byte
+    kyros_http_router_method candidate;
+    switch (length) {
+    case 3: candidate = method[0] == 'G' ? KYROS_HTTP_ROUTER_GET : KYROS_HTTP_ROUTER_PUT; break;
+    case 4: candidate = method[0] == 'H' ? KYROS_HTTP_ROUTER_HEAD : KYROS_HTTP_ROUTER_POST; break;
+    case 5: candidate = method[0] == 'P' ? KYROS_HTTP_ROUTER_PATCH : KYROS_HTTP_ROUTER_TRACE; break;
+    case 6: candidate = KYROS_HTTP_ROUTER_DELETE; break;
+    case 7: candidate = method[0] == 'O' ? KYROS_HTTP_ROUTER_OPTIONS : KYROS_HTTP_ROUTER_CONNECT; break;
+    default: return KYROS_HTTP_ROUTER_ANY;
+    }
+    return !memcmp(kyros_http_router_method_names[candidate], method, length) ? candidate : KYROS_HTTP_ROUTER_ANY;
+}
+
+/// @brief static child of node starting with c, 0 if there is none
+static inline uint32_t kyros_http_router_child(kyros_http_router* router, kyros_http_router_node* node, char c)
+{
+    auto bytes = router->first_bytes + node->children;
+    // most nodes have a few children, memchr only pays off on wide ones like the root of many resources
+    if (node->child_count > 16) {
+        auto found = (const char*)memchr(bytes, c, node->child_count);
+        return found ? (uint32_t)(found - router->first_bytes) : 0;
+    }
+    for (uint32_t i = 0; i < node->child_count; i++) {
+        if (bytes[i] == c) {
+            return node->children + i;
+        }
+    }
+    return 0;
+}
+
+///
+/// Builder
+///
+
+static uint32_t kyros_http_router_add_string(kyros_http_router* router, const char* data, uint32_t length)
+{
+    if (router->strings_length + length > router->strings_capacity) {
+        router->strings_capacity = router->strings_capacity * 2 > router->strings_length + length ? router->strings_capacity * 2 : router->strings_length + length;
+        router->strings = (char*)kyros_resize(router->strings, router->strings_capacity);
+    }
+    auto offset = router->strings_length;
+    memcpy(router->strings + offset, data, length);
+    router->strings_length += length;
+    return offset;
+}
+
+static kyros_http_router_builder* kyros_http_router_builder_create(const char* prefix, uint32_t prefix_length)
+{
+    auto node = (kyros_http_router_builder*)kyros_calloc(1, sizeof(kyros_http_router_builder));
+    if (prefix_length) {
+        node->prefix = (char*)kyros_alloc(prefix_length);
+        memcpy(node->prefix, prefix, prefix_length);
+        node->prefix_length = prefix_length;
+    }
+    return node;
+}
+
+static void kyros_http_router_builder_free(kyros_http_router_builder* node)
+{
+    if (!node) {
+        return;
+    }
+    for (uint32_t i = 0; i < node->child_count; i++) {
+        kyros_http_router_builder_free(node->children[i]);
+    }
+    kyros_http_router_builder_free(node->param);
+    kyros_http_router_builder_free(node->wildcard);
+    kyros_free(node->children);
+    kyros_free(node->prefix);
+    kyros_free(node);
+}
+
+static void kyros_http_router_builder_append(kyros_http_router_builder* node, kyros_http_router_builder* child)
+{
+    if (node->child_count == node->child_capacity) {
+        node->child_capacity = node->child_capacity ? node->child_capacity * 2 : 4;
+        node->children = (kyros_http_router_builder**)kyros_resize(node->children, sizeof(kyros_http_router_builder*) * node->child_capacity);
+    }
+    node->children[node->child_count++] = child;
+}
+
+/// @brief node where literal ends below node, edges are split where they stop sharing a prefix
+static kyros_http_router_builder* kyros_http_router_builder_insert(kyros_http_router_builder* node, const char* literal, uint32_t length)
+{
+    while (length) {
+        kyros_http_router_builder* child = NULL;
+        uint32_t index = 0;
+        for (; index < node->child_count; index++) {
+            if (node->children[index]->prefix[0] == literal[0]) {
+                child = node->children[index];
+                break;
+            }
+        }
+        if (!child) {
+            child = kyros_http_router_builder_create(literal, length);
+            kyros_http_router_builder_append(node, child);
+            return child;
+        }
+        uint32_t common = 1;
+        while (common < length && common < child->prefix_length && child->prefix[common] == literal[common]) {
+            common++;
+        }
+        if (common < child->prefix_length) {
+            // the shared part becomes a node of its own with child below it
+            auto split = kyros_http_router_builder_create(child->prefix, common);
+            child->prefix_length -= common;
+            memmove(child->prefix, child->prefix + common, child->prefix_length);
+            kyros_http_router_builder_append(split, child);
+            node->children[index] = split;
+            child = split;
+        }
+        node = child;
+        literal += common;
+        length -= common;
+    }
+    return node;
+}
+
+///
+/// Compile
+///
+
+static uint32_t kyros_http_router_builder_count(kyros_http_router_builder* node)
+{
+    if (!node) {
+        return 0;
+    }
+    uint32_t count = 1;
+    for (uint32_t i = 0; i < node->child_count; i++) {
+        count += kyros_http_router_builder_count(node->children[i]);
+    }
+    return count + kyros_http_router_builder_count(node->param) + kyros_http_router_builder_count(node->wildcard);
+}
+
+static bool kyros_http_router_builder_has_route(kyros_http_router_builder* node)
+{
+    for (uint32_t i = 0; i < KYROS_HTTP_ROUTER_METHODS; i++) {
+        if (node->routes[i]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void kyros_http_router_compile(kyros_http_router* router)
+{
+    if (router->compiled) {
+        return;
+    }
+    auto count = kyros_http_router_builder_count(router->builder);
+    auto queue = (kyros_http_router_builder**)kyros_alloc(sizeof(kyros_http_router_builder*) * count);
+    router->nodes = (kyros_http_router_node*)kyros_calloc(count, sizeof(kyros_http_router_node));
+    router->first_bytes = (char*)kyros_calloc(count, 1);
+    // no more nodes end routes than there are routes
+    router->slots = (uint32_t*)kyros_alloc(sizeof(uint32_t) * KYROS_HTTP_ROUTER_METHODS * (router->route_count + 1));
+    uint32_t slot_count = 0;
+    // breadth first, a node gets the indices of its children when it is taken out of the queue
+    queue[0] = router->builder;
+    uint32_t queued = 1;
+    for (uint32_t index = 0; index < queued; index++) {
+        auto builder = queue[index];
+        auto node = &router->nodes[index];
+        node->prefix = builder->prefix_length ? kyros_http_router_add_string(router, builder->prefix, builder->prefix_length) : 0;
+        node->prefix_length = builder->prefix_length;
+        node->children = queued;
+        node->child_count = builder->child_count;
+        for (uint32_t i = 0; i < builder->child_count; i++) {
+            router->first_bytes[queued] = builder->children[i]->prefix[0];
+            queue[queued++] = builder->children[i];
+        }
+        if (builder->param) {
+            node->param = queued;
+            queue[queued++] = builder->param;
+        }
+        if (builder->wildcard) {
+            node->wildcard = queued;
+            queue[queued++] = builder->wildcard;
+        }
+        node->routes = UINT32_MAX;
+        if (kyros_http_router_builder_has_route(builder)) {
+            node->routes = slot_count;
+            memcpy(router->slots + slot_count, builder->routes, sizeof(builder->routes));
+            slot_count += KYROS_HTTP_ROUTER_METHODS;
+        }
+    }
+    router->node_count = count;
+    kyros_free(queue);
+    kyros_http_router_builder_free(router->builder);
+    router->builder = NULL;
+    router->compiled = true;
+}
+
+///
+/// Lookup
+///
+
+/// @brief route of method on the node a path ended on, index + 1 or 0
+static uint32_t kyros_http_router_route_of(kyros_http_router* router, uint32_t index, kyros_http_router_method method, kyros_http_router_lookup* lookup)
+{
+    auto node = &router->nodes[index];
+    if (node->routes == UINT32_MAX) {
+        return 0;
+    }
+    auto slots = router->slots + node->routes;
+    auto route = slots[method];
+    if (!route && method == KYROS_HTTP_ROUTER_HEAD) {
+        route = slots[KYROS_HTTP_ROUTER_GET];
+    }
+    if (!route) {
+        route = slots[KYROS_HTTP_ROUTER_ANY];
+    }
+    if (!route && lookup->not_allowed == UINT32_MAX) {
+        lookup->not_allowed = index;
+    }
+    return route;
+}
+
+/// @brief route for the rest of the path (from end of the prefix of node index), depth is the next param index
+/// recurses only where a static child, a param and a wildcard could all match
+static uint32_t kyros_http_router_find(kyros_http_router* router, uint32_t index, const char* path, const char* end,
+    kyros_http_router_method method, kyros_http_router_lookup* lookup, uint32_t depth)
+{
+    while (true) {
+        auto node = &router->nodes[index];
+        if (path == end) {
+            auto route = kyros_http_router_route_of(router, index, method, lookup);
+            if (route || !node->wildcard) {
+                return route;
+            }
+            lookup->values[depth] = path;
+            lookup->lengths[depth] = 0;
+            return kyros_http_router_route_of(router, node->wildcard, method, lookup);
+        }
+        auto child_index = kyros_http_router_child(router, node, *path);
+        auto child = &router->nodes[child_index];
+        if (child_index && (uint64_t)(end - path) >= child->prefix_length && !memcmp(router->strings + child->prefix, path, child->prefix_length)) {
+            if (!node->param && !node->wildcard) {
+                index = child_index;
+                path += child->prefix_length;
+                continue;
+            }
+            auto route = kyros_http_router_find(router, child_index, path + child->prefix_length, end, method, lookup, depth);
+            if (route) {
+                return route;
+            }
+        }
+        if (node->param) {
+            auto slash = (const char*)memchr(path, '/', end - path);
+            auto segment_end = slash ? slash : end;
+            if (segment_end > path) {
+                lookup->values[depth] = path;
+                lookup->lengths[depth] = (uint32_t)(segment_end - path);
+                auto route = kyros_http_router_find(router, node->param, segment_end, end, method, lookup, depth + 1);
+                if (route) {
+                    return route;
+                }
+            }
+        }
+        if (node->wildcard) {
+            lookup->values[depth] = path;
+            lookup->lengths[depth] = (uint32_t)(end - path);
+            return kyros_http_router_route_of(router, node->wildcard, method, lookup);
+        }
+        return 0;
+    }
+}
+
+static uint32_t kyros_http_router_lookup_path(kyros_http_router* router, kyros_http_router_method method, const char* path, uint32_t length,
+    kyros_http_router_lookup* lookup)
+{
+    m_assert(router->compiled, "kyros_http_router_compile must be called before matching");
+    lookup->not_allowed = UINT32_MAX;
+    // the root has no prefix, every pattern is below its "/" child
+    return kyros_http_router_find(router, 0, path, path + length, method, lookup, 0);
+}
+
+/// @brief params of the route that was found, named by its pattern
+static uint32_t kyros_http_router_params(kyros_http_router* router, kyros_http_route* route, kyros_http_router_lookup* lookup, kyros_http_header* params)
+{
+    for (uint32_t i = 0; i < route->name_count; i++) {
+        auto name = router->names[route->names + i];
+        params[i] = (kyros_http_header) { .name = router->strings + name[0], .value = lookup->values[i], .name_length = name[1], .value_length = lookup->lengths[i] };
+    }
+    return route->name_count;
+}
+
+///
+/// Dispatch
+///
+
+/// @brief the path of target can be matched as it is: origin form with no dot segment, escape after a slash or backslash
+/// (the ones ada could rewrite), path_length stops at the query
+static bool kyros_http_router_path_is_normal(const char* target, uint32_t length, uint32_t* path_length)
+{
+    if (!length || target[0] != '/') {
+        return false;
+    }
+    uint32_t i = 0;
+    for (; i < length && target[i] != '?'; i++) {
+        auto c = target[i];
+        if (c == '\\' || (c == '/' && i + 1 < length && (target[i + 1] == '.' || target[i + 1] == '%'))) {
+            return false;
+        }
+    }
+    *path_length = i;
+    return true;
+}
+
+static void kyros_http_router_reply(kyros_http_response* response, uint16_t status, const char* allow, uint32_t allow_length)
+{
+    kyros_http_response_write_status(response, status);
+    if (allow_length) {
+        kyros_http_response_write_header(response, "Allow", 5, allow, allow_length);
+    }
+    kyros_http_response_end(response, NULL, 0);
+}
+
+static void kyros_http_router_dispatch(kyros_http_router* router, kyros_http_request* request, kyros_http_response* response,
+    const char* path, uint32_t length)
+{
+    kyros_http_router_lookup lookup;
+    auto method = kyros_http_router_parse_method(request->method, request->method_length);
+    auto route = kyros_http_router_lookup_path(router, method, path, length, &lookup);
+    kyros_http_header params[KYROS_HTTP_ROUTER_MAX_PARAMS];
+    if (route) {
+        auto found = &router->routes[route - 1];
+        auto param_count = kyros_http_router_params(router, found, &lookup, params);
+        found->handler(request, response, params, param_count, found->ctx);
+        return;
+    }
+    if (router->fallback.handler) {
+        router->fallback.handler(request, response, params, 0, router->fallback.ctx);
+        return;
+    }
+    if (lookup.not_allowed == UINT32_MAX) {
+        kyros_http_router_reply(response, 404, NULL, 0);
+        return;
+    }
+    // "GET, HEAD, POST, PUT, DELETE, PATCH, OPTIONS, CONNECT, TRACE" fits
+    char allow[80];
+    uint32_t allow_length = 0;
+    auto slots = router->slots + router->nodes[lookup.not_allowed].routes;
+    for (uint32_t i = 0; i < KYROS_HTTP_ROUTER_ANY; i++) {
+        if (!slots[i] && !(i == KYROS_HTTP_ROUTER_HEAD && slots[KYROS_HTTP_ROUTER_GET])) {
+            continue;
+        }
+        if (allow_length) {
+            memcpy(allow + allow_length, ", ", 2);
+            allow_length += 2;
+        }
+        auto name_length = (uint32_t)strlen(kyros_http_router_method_names[i]);
+        memcpy(allow + allow_length, kyros_http_router_method_names[i], name_length);
+        allow_length += name_length;
+    }
+    kyros_http_router_reply(response, 405, allow, allow_length);
+}
+
+/// @brief matches the pathname of ada for target, resolved against a dummy origin when it is in origin form
+static void kyros_http_router_dispatch_normalized(kyros_http_router* router, kyros_http_request* request, kyros_http_response* response)
+{
+    static const char origin[] = "http://localhost";
+    auto relative = request->target_length && request->target[0] == '/';
+    uint64_t length = request->target_length + (relative ? sizeof(origin) - 1 : 0);
+    char stack[KYROS_HTTP_ROUTER_URL_BUFFER];
+    auto input = length <= sizeof(stack) ? stack : (char*)kyros_alloc(length);
+    auto offset = relative ? sizeof(origin) - 1 : 0;
+    memcpy(input, origin, offset);
+    memcpy(input + offset, request->target, request->target_length);
+    auto url = ada_parse(input, length);
+    if (ada_is_valid(url)) {
+        auto pathname = ada_get_pathname(url);
+        kyros_http_router_dispatch(router, request, response, pathname.data, (uint32_t)pathname.length);
+    } else {
+        kyros_http_router_reply(response, 400, NULL, 0);
+    }
+    ada_free(url);
+    if (input != stack) {
+        kyros_free(input);
+    }
+}
+
+///
+/// Public API
+///
+
+kyros_http_router* kyros_http_router_create()
+{
+    auto router = (kyros_http_router*)kyros_calloc(1, sizeof(kyros_http_router));
+    router->builder = kyros_http_router_builder_create(NULL, 0);
+    return router;
+}
+
+bool kyros_http_router_add(kyros_http_router* router, const char* method, const char* pattern, kyros_http_route_handler handler, void* ctx)
+{
+    m_assert(handler, "kyros_http_router_add needs a handler");
+    auto slot = method ? kyros_http_router_parse_method(method, (uint32_t)strlen(method)) : KYROS_HTTP_ROUTER_ANY;
+    if (router->compiled || (method && slot == KYROS_HTTP_ROUTER_ANY) || pattern[0] != '/') {
+        return false;
+    }
+    // names are only kept once the pattern is known to be new
+    const char* names[KYROS_HTTP_ROUTER_MAX_PARAMS];
+    uint32_t name_lengths[KYROS_HTTP_ROUTER_MAX_PARAMS];
+    uint32_t name_count = 0;
+    auto node = router->builder;
+    auto p = pattern;
+    auto end = pattern + strlen(pattern);
+    while (p < end) {
+        if ((*p == ':' || *p == '*') && p[-1] == '/') {
+            auto name = p + 1;
+            auto slash = (const char*)memchr(name, '/', end - name);
+            auto name_end = slash ? slash : end;
+            if ((*p == ':' && name_end == name) || (*p == '*' && slash) || name_count == KYROS_HTTP_ROUTER_MAX_PARAMS) {
+                return false;
+            }
+            auto child = *p == ':' ? &node->param : &node->wildcard;
+            if (!*child) {
+                *child = kyros_http_router_builder_create(NULL, 0);
+            }
+            node = *child;
+            names[name_count] = name;
+            name_lengths[name_count++] = (uint32_t)(name_end - name);
+            p = name_end;
+            continue;
+        }
+        auto literal = p;
+        while (p < end && !((*p == ':' || *p == '*') && p[-1] == '/')) {
+            p++;
+        }
+        node = kyros_http_router_builder_insert(node, literal, (uint32_t)(p - literal));
+    }
+    if (node->routes[slot]) {
+        return false;
+    }
+    if (router->route_count == router->route_capacity) {
+        router->route_capacity = router->route_capacity ? router->route_capacity * 2 : 16;
+        router->routes = (kyros_http_route*)kyros_resize(router->routes, sizeof(kyros_http_route) * router->route_capacity);
+    }
+    if (router->name_count + name_count > router->name_capacity) {
+        router->name_capacity = router->name_capacity * 2 > router->name_count + name_count ? router->name_capacity * 2 : router->name_count + name_count;
+        router->names = (uint32_t(*)[2])kyros_resize(router->names, sizeof(uint32_t[2]) * router->name_capacity);
+    }
+    router->routes[router->route_count] = (kyros_http_route) { .handler = handler, .ctx = ctx, .names = router->name_count, .name_count = name_count };
+    for (uint32_t i = 0; i < name_count; i++) {
+        router->names[router->name_count][0] = kyros_http_router_add_string(router, names[i], name_lengths[i]);
+        router->names[router->name_count++][1] = name_lengths[i];
+    }
+    node->routes[slot] = ++router->route_count;
+    return true;
+}
+
+void kyros_http_router_set_fallback(kyros_http_router* router, kyros_http_route_handler handler, void* ctx)
+{
+    router->fallback = (kyros_http_route) { .handler = handler, .ctx = ctx };
+}
+
+void kyros_http_router_onrequest(kyros_http_request* request, kyros_http_response* response, void* ctx)
+{
+    kyros_http_router* router = ctx;
+    uint32_t path_length;
+    if (kyros_http_router_path_is_normal(request->target, request->target_length, &path_length)) {
+        kyros_http_router_dispatch(router, request, response, request->target, path_length);
+        return;
+    }
+    kyros_http_router_dispatch_normalized(router, request, response);
+}
+
+kyros_http_route_handler kyros_http_router_match(kyros_http_router* router, const char* method, uint32_t method_length,
+    const char* path, uint32_t path_length, kyros_http_header* params, uint32_t* param_count, void** ctx)
+{
+    kyros_http_router_lookup lookup;
+    auto route = kyros_http_router_lookup_path(router, kyros_http_router_parse_method(method, method_length), path, path_length, &lookup);
+    if (!route) {
+        *param_count = 0;
+        return NULL;
+    }
+    auto found = &router->routes[route - 1];
+    *param_count = kyros_http_router_params(router, found, &lookup, params);
+    *ctx = found->ctx;
+    return found->handler;
+}
+
+void kyros_http_router_destroy(kyros_http_router* router)
+{
+    kyros_http_router_builder_free(router->builder);
+    kyros_free(router->routes);
+    kyros_free(router->strings);
+    kyros_free(router->names);
+    kyros_free(router->nodes);
+    kyros_free(router->first_bytes);
+    kyros_free(router->slots);
+    kyros_free(router);
+}
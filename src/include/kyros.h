@@ -20,7 +20,29 @@ typedef struct {
     uint64_t tagged_ptr;
 } kyros_socket;
 typedef struct kyros_timer kyros_timer;
+
+typedef enum {
+    /// @brief readiness from libuv (epoll, kqueue, IOCP), then one syscall per read and write
+    KYROS_LOOP_IO_POLL = 0,
+    /// @brief Linux io_uring, multishot accept/recv with kernel provided buffers and the sends of every socket
+    /// submitted together once per loop iteration (falls back to KYROS_LOOP_IO_POLL when the kernel can't do it)
+    KYROS_LOOP_IO_URING = 1,
+} kyros_loop_io_engine;
+
+typedef struct {
+    /// @brief timer resolution in ms, timers fire on multiples of it (0 = 1ms), use 4ms or more to trade precision for less wakeups
+    uint32_t timer_granularity;
+    /// @brief max normal priority deferred tasks executed per loop iteration, the rest waits for the next one (0 = unlimited)
+    uint32_t defer_budget;
+    /// @brief max time in microseconds spent on deferred tasks per loop iteration, checked every few tasks (0 = unlimited)
+    uint32_t defer_time_budget;
+    /// @brief how the loop sockets do their IO, timers and deferred tasks work the same with both
+    kyros_loop_io_engine io_engine;
+} kyros_loop_options;
+
 export kyros_loop* kyros_loop_create(void* loop);
+/// @brief same as kyros_loop_create but with custom options, passing a zeroed struct is the same as kyros_loop_create
+export kyros_loop* kyros_loop_create_with_options(void* loop, kyros_loop_options options);
 export kyros_loop* kyros_loop_default();
 export uint32_t kyros_loop_run_once(kyros_loop* loop);
 export uint32_t kyros_loop_run_forever(kyros_loop* loop);
@@ -29,10 +51,72 @@ export void kyros_loop_atomic_ref(kyros_loop* loop);
 export uint64_t kyros_loop_unref(kyros_loop* loop);
 export bool kyros_loop_atomic_unref(kyros_loop* loop);
 export void kyros_loop_stop(kyros_loop* loop);
+/// @brief the engine the loop ended up with, KYROS_LOOP_IO_POLL if KYROS_LOOP_IO_URING was asked but is not available
+export kyros_loop_io_engine kyros_loop_get_io_engine(kyros_loop* loop);
+
+typedef enum {
+    /// @brief runs before any normal task and after each one, until there is no microtask left (not affected by budgets)
+    KYROS_TASK_PRIORITY_MICROTASK = 0,
+    /// @brief runs in FIFO order on the next tick, following the loop defer budgets
+    KYROS_TASK_PRIORITY_NORMAL = 1,
+} kyros_task_priority;
+
+/// @brief same as kyros_loop_defer_with_priority using KYROS_TASK_PRIORITY_NORMAL
 export void kyros_loop_defer(kyros_loop* loop, void (*task)(void* ctx), void* ctx);
+export void kyros_loop_defer_with_priority(kyros_loop* loop, void (*task)(void* ctx),
+    void* ctx, kyros_task_priority priority);
 export void kyros_loop_atomic_defer(kyros_loop* loop, void (*task)(void* ctx),
     void* ctx);
 
+typedef struct {
+    void (*task)(void* ctx);
+    void* ctx;
+} kyros_task_entry;
+
+/// @brief enqueue count tasks from any thread with a single atomic splice and at most one wakeup
+export void kyros_loop_atomic_defer_many(kyros_loop* loop,
+    const kyros_task_entry* tasks, uint64_t count);
+/// @brief buffer a task in the calling thread submission buffer, tasks are sent with
+/// kyros_loop_atomic_defer_many when the buffer is full or on kyros_loop_atomic_flush
+/// (buffered tasks dont keep the loop running, they hold an atomic ref so it is not freed before they are sent;
+/// what a thread still buffers is sent when it exits, or added to the loop when its own thread destroys it)
+export void kyros_loop_atomic_submit(kyros_loop* loop, void (*task)(void* ctx),
+    void* ctx);
+/// @brief flush the calling thread submission buffer of loop, or of every loop if loop is NULL
+export void kyros_loop_atomic_flush(kyros_loop* loop);
+
+typedef struct {
+    /// @brief kyros_loop_defer tasks waiting to run (all priorities)
+    uint64_t tasks_pending;
+    /// @brief kyros_loop_defer tasks currently allocated from the loop slab
+    uint64_t task_slab_in_use;
+    /// @brief kyros_loop_defer tasks the loop slab can hold without growing
+    uint64_t task_slab_capacity;
+    /// @brief number of chunks in the loop slab
+    uint32_t task_slab_chunks;
+    /// @brief kyros_loop_atomic_defer tasks the loop pool can hold without growing
+    uint64_t async_task_capacity;
+    /// @brief kyros_loop_atomic_defer tasks allocated with the allocator because the pool was full
+    uint64_t async_task_heap_fallbacks;
+    /// @brief send syscalls avoided by KYROS_SOCKET_AUTO_CORK (writes coalesced minus flushes)
+    uint64_t cork_syscalls_saved;
+    /// @brief write queue chunks (16 KiB) holding data of slow sockets
+    uint32_t write_chunks_in_use;
+    /// @brief write queue chunks kept in the loop pool for reuse
+    uint32_t write_chunks_idle;
+    /// @brief io_uring_enter calls of the io_uring engine, each one submits every operation prepared until then
+    uint64_t uring_submits;
+    /// @brief completions handled by the io_uring engine
+    uint64_t uring_completions;
+    /// @brief loop iterations since the loop was created
+    uint64_t iterations;
+    /// @brief ns spent outside of the poll wait since the loop was created, busy_time / iterations is the average iteration latency
+    uint64_t busy_time;
+} kyros_loop_stats;
+
+/// @brief snapshot of the loop counters, must be called in the loop thread
+export kyros_loop_stats kyros_loop_get_stats(kyros_loop* loop);
+
 ///
 /// Timer
 ///
@@ -58,6 +142,7 @@ typedef enum {
     KYROS_SOCKET_ERROR_CONNECTING_ERROR = 1,
     KYROS_SOCKET_ERROR_TLS_ERROR = 2,
     KYROS_SOCKET_ERROR_EXIT_CODE = 3,
+    KYROS_SOCKET_ERROR_SYSTEM_ERROR = 4,
 } kyros_socket_error_type;
 
 typedef enum {
@@ -66,12 +151,22 @@ typedef enum {
   KYROS_SOCKET_AUTO_CORK = 2,
 } kyros_socket_cork_behavior;
 
+typedef enum {
+    KYROS_SOCKET_STATE_CONNECTING = 0,
+    KYROS_SOCKET_STATE_OPEN = 1,
+    /// @brief handshake ok (only available when over TLS)
+    KYROS_SOCKET_STATE_SECURE = 2,
+    KYROS_SOCKET_STATE_READABLE_ENDED = 3,
+    KYROS_SOCKET_STATE_WRITABLE_ENDED = 4,
+    KYROS_SOCKET_STATE_CLOSED = 5,
+} kyros_socket_state;
+
 typedef struct {
-    /// @brief error type 0 = no error, 1 = connecting error, 2 = tls error, 3 = exit code
+    /// @brief error type 0 = no error, 1 = connecting error, 2 = tls error, 3 = exit code, 4 = system error (read/write)
     kyros_socket_error_type type;
     /// @brief integer code that represents the connection error, tls error or exit code
     uint32_t code;
-    /// @brief null-terminated text code that represents the tls error, NULL if not available
+    /// @brief null-terminated text code that represents the error, NULL if not available
     const char* code_s;
     /// @brief null-terminated error message with extra information about the error, NULL if not available 
     const char* message;
@@ -123,7 +218,8 @@ typedef struct {
             bool reuse_port : 1;
             /// @brief if true connect using UDP instead of TCP
             bool use_udp: 1;
-            /// @brief uses Happy Eyeballs algorithm to connect
+            /// @brief race the addresses of host (RFC 8305 Happy Eyeballs v2): families interleaved, the next one is tried
+            /// 250 ms after the last one or as soon as it fails, the first connected wins and the others are closed
             bool use_happy_eyeballs: 1;
         } host_port;
         struct {
@@ -152,29 +248,608 @@ typedef struct {
   bool no_delay: 1;
   /// @brief enables keep-alive functionality on the socket
   bool keep_alive: 1;  
+  /// @brief stop reading while the write queue is above write_high_watermark, resume at write_low_watermark
+  bool pause_on_backpressure: 1;
+  /// @brief Linux only, hand the tls record keys to the kernel after the handshake (AES-GCM and ChaCha20-Poly1305)
+  /// so kyros_socket_write4 can use sendfile, falls back to userspace tls when the kernel or the cipher does not support it
+  /// (ignored on KYROS_LOOP_IO_URING loops)
+  bool kernel_tls: 1;
   /// @brief if set to a positive number, it sets the initial delay before the first keepalive probe is sent on an idle socket
   uint32_t keep_alive_initial_delay; 
   /// @brief sets the socket to timeout after timeout milliseconds of inactivity on the socket. 0 to disable it
   uint32_t timeout; 
+  /// @brief bytes queued after which kyros_socket_write returns false, 0 uses the default (64 KiB)
+  uint32_t write_high_watermark;
+  /// @brief ondrain is called when the queue falls to this size after crossing the high watermark, 0 uses the default (16 KiB)
+  uint32_t write_low_watermark;
   /// @brief enables TLS
   SSL_CTX* tls;
 } kryos_socket_options;
 
+struct sockaddr;
+
+/// @brief one datagram received by a UDP socket
+typedef struct {
+    /// @brief points to the loop shared receive buffer, only valid during the ondatagrams call
+    const char* data;
+    uint32_t length;
+    /// @brief sender address (struct sockaddr_in or struct sockaddr_in6), can be given back to kyros_socket_send_datagram
+    const struct sockaddr* peer;
+    uint32_t peer_length;
+} kyros_udp_datagram;
+
 typedef struct {
     /// @brief optional custom context that will be passed in the ondata, ontimeout, ondrain and onstatus callbacks
     void* ctx;
     /// @brief return true to keep reading, return false to close the socket (default is true if ondata is NULL and data will be discarted unless it is paused)
-    bool (*ondata)(kyros_socket socket, void* ctx);
+    /// data points to the loop shared receive buffer (a kernel provided buffer with KYROS_LOOP_IO_URING) and is only valid during the call
+    bool (*ondata)(kyros_socket socket, const char* data, uint64_t length, void* ctx);
     /// @brief return false to keep socket alive, return true to close after timeout (default is true if ontimeout is NULL)
     bool (*ontimeout)(kyros_socket socket, void* ctx);
-    /// @brief called when all the write data is flushed and the socket is writable again
+    /// @brief called when the write queue falls to the low watermark after crossing the high watermark
     void (*ondrain)(kyros_socket socket, void* ctx);
     /// @brief track status changes, open, half-closed, closed, error
     void (*onstatus)(kyros_socket socket, kyros_socket_error error, void* ctx);
+    /// @brief called in the thread of the new loop once kyros_socket_migrate moved the socket there
+    void (*onmigrate)(kyros_socket socket, kyros_loop* loop, void* ctx);
+    /// @brief UDP sockets, datagrams read with one recvmmsg (the ones coalesced by UDP GRO come split), ondata is not used
+    void (*ondatagrams)(kyros_socket socket, const kyros_udp_datagram* datagrams, uint32_t count, void* ctx);
     /// @brief ref_count this handler can be shared with multiple sockets, this is used manage memory
     uint64_t ref_count;
 } kyros_socket_handler;
 
 /// @brief connect socket to a source, following specified options
-kyros_socket kyros_socket_connect(kyros_socket_source source, kryos_socket_options options, kyros_socket_handler* handler);
+/// errors are reported asynchronously with onstatus, the returned socket is always valid until closed
+/// with host_port.use_udp it is a connected UDP socket, datagrams written before it is open wait for it
+/// host names are resolved through the process DNS cache (kyros_dns_configure)
+export kyros_socket kyros_socket_connect(kyros_loop* loop, kyros_socket_source source, kryos_socket_options options, kyros_socket_handler* handler);
+/// @brief listen on a source, accepted sockets use the same options and handler (onstatus is called with KYROS_SOCKET_STATE_OPEN)
+/// returns a socket with tagged_ptr 0 if the listener could not be created
+/// with host_port.use_udp it is a UDP socket bound to the address that receives from and sends to anyone
+export kyros_socket kyros_socket_listen(kyros_loop* loop, kyros_socket_source source, kryos_socket_options options, kyros_socket_handler* handler);
+export kyros_socket_state kyros_socket_get_state(kyros_socket socket);
+export kyros_loop* kyros_socket_get_loop(kyros_socket socket);
+/// @brief readable side is open
+export bool kyros_socket_is_readable(kyros_socket socket);
+/// @brief writable side is open
+export bool kyros_socket_is_writable(kyros_socket socket);
+export bool kyros_socket_is_closed(kyros_socket socket);
+/// @brief tls handshake ok
+export bool kyros_socket_is_secure(kyros_socket socket);
+/// @brief the kernel encrypts the tls records of this socket (kryos_socket_options.kernel_tls)
+export bool kyros_socket_is_kernel_tls(kyros_socket socket);
+/// @brief opened/connected
+export bool kyros_socket_is_open(kyros_socket socket);
+export bool kyros_socket_is_connecting(kyros_socket socket);
+export SSL* kyros_socket_get_ssl(kyros_socket socket);
+export SSL_CTX* kyros_socket_get_ctx(kyros_socket socket);
+export void kyros_socket_pause(kyros_socket socket);
+export void kyros_socket_resume(kyros_socket socket);
+export bool kyros_socket_is_paused(kyros_socket socket);
+export uint64_t kyros_socket_flush(kyros_socket socket);
+/// @brief writable buffer size waiting to be flushed on drain event
+export uint64_t kyros_socket_buffer_size(kyros_socket socket);
+export void kyros_socket_ref(kyros_socket socket);
+export void kyros_socket_unref(kyros_socket socket);
+/// @brief returns false when the write queue is above the high watermark, wait for ondrain before writing more
+export bool kyros_socket_write(kyros_socket socket, const char* buffer, uint64_t size, bool end);
+/// @brief queue a datagram to peer (NULL for the peer of a connected UDP socket), kyros_socket_write does the same for connected sockets
+/// the datagrams of a loop iteration go out with one sendmmsg per socket in the after IO hook, runs of datagrams of the same size
+/// to the same peer become one UDP GSO send; returns false if it was dropped because the kernel buffer and the batch are full
+/// (ondrain is called once the batch is sent) or the socket is closed, send errors of a datagram only drop that datagram
+export bool kyros_socket_send_datagram(kyros_socket socket, const char* data, uint32_t length, const struct sockaddr* peer);
+/// @brief send length bytes of the file fd (uv_file) from offset (length 0 = until the end of the file), fd can be closed after the call
+/// uses sendfile on tcp and kernel tls sockets, other tls sockets (and files sendfile refuses) are read in pieces on the uv threadpool
+/// and sent (encrypted) as the socket drains; returns false like kyros_socket_write once the socket is above write_high_watermark
+export bool kyros_socket_write4(kyros_socket socket, int fd, uint64_t offset, uint64_t length, bool end);
+/// @brief write everything read from socket to dst_socket until the source ends or is unpiped, end = true close the writable side of dst_socket after it
+/// plain tcp/unix sockets are spliced through a kernel pipe (the bytes never reach userspace), tls ends go through ondata and kyros_socket_write
+/// while piped, ondata of the source is not called, the other callbacks still are; returns false if the source ended or dst_socket already has a pipe
+export bool kyros_socket_pipe(kyros_socket socket, kyros_socket dst_socket, bool end);
+/// @brief same as kyros_socket_pipe to a file, pipe or socket fd (uv_file) that must stay open while piped, end = true closes it after the source ends
+export bool kyros_socket_pipe3(kyros_socket socket, int fd, bool end);
+/// @brief stop piping, what was already read is still written to the destination (without ending it)
+export void kyros_socket_unpipe(kyros_socket socket);
+export void kyros_socket_close(kyros_socket socket);
+export void kyros_socket_keepalive_loop(kyros_socket socket, bool keep_alive);
+export void kyros_socket_nodelay(kyros_socket socket, bool nodelay);
+export void kyros_socket_keepalive(kyros_socket socket, bool nodelay);
+/// @brief close (or call ontimeout) after timeout ms of inactivity, 0 to disable
+export void kyros_socket_timeout(kyros_socket socket, uint32_t timeout);
+/// @brief move an open tcp/tls socket (fd, write queue, tls state, timeout) to loop, handler replaces the current one (NULL keeps it)
+/// must be called in the thread of the current loop, both loops must use the same io engine, onmigrate is called in the thread of loop
+/// once the socket is there; until then the socket can't be used (io_uring sockets can still be closed by an error in the old loop)
+/// returns false for listeners, connecting, closed or piped sockets, and while a piece of a kyros_socket_write4 file is being read
+export bool kyros_socket_migrate(kyros_socket socket, kyros_loop* loop, kyros_socket_handler* handler);
+
+///
+/// TLS session resumption
+///
+
+typedef struct kyros_tls_session_cache kyros_tls_session_cache;
+
+typedef struct {
+    /// @brief max sessions kept (split in shards), 0 uses the default (20480)
+    uint32_t max_sessions;
+    /// @brief seconds a cached session can be resumed, 0 uses the default (300)
+    uint32_t session_timeout;
+    /// @brief ms between session ticket key rotations, 0 uses the default (1 hour), the previous key is still accepted for one period
+    uint32_t ticket_key_rotation;
+} kyros_tls_session_cache_options;
+
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t stored;
+    uint64_t evicted;
+    uint64_t ticket_key_rotations;
+} kyros_tls_session_cache_stats;
+
+/// @brief sharded session cache, can be attached to SSL_CTXs used by any number of loops/threads
+export kyros_tls_session_cache* kyros_tls_session_cache_create(kyros_tls_session_cache_options options);
+/// @brief server side resumption for ctx: session id cache + ticket keys rotated by a timer on loop (it does not keep the loop alive)
+export void kyros_tls_session_cache_attach_server(kyros_tls_session_cache* cache, SSL_CTX* ctx, kyros_loop* loop);
+/// @brief client side resumption for ctx: kyros_socket_connect reuses the last session of the same host:port
+export void kyros_tls_session_cache_attach_client(kyros_tls_session_cache* cache, SSL_CTX* ctx);
+/// @brief rotate now, thread safe
+export void kyros_tls_session_cache_rotate_ticket_keys(kyros_tls_session_cache* cache);
+export kyros_tls_session_cache_stats kyros_tls_session_cache_get_stats(kyros_tls_session_cache* cache);
+/// @brief must be called after every attached SSL_CTX is freed, in the thread of the rotation loop
+export void kyros_tls_session_cache_destroy(kyros_tls_session_cache* cache);
+
+///
+/// DNS
+///
+
+struct sockaddr_storage;
+
+typedef struct {
+    /// @brief optional, replaces getaddrinfo (a stub resolver, or one that knows the TTL of the records), runs in a resolver thread
+    /// fills up to capacity addresses (the port is ignored) and returns how many, or a negative libuv error (UV_EAI_NONAME when there is none)
+    /// *ttl starts at kyros_dns_options.ttl and can be set to the TTL of the records
+    int32_t (*resolver)(const char* host, struct sockaddr_storage* addresses, uint32_t capacity, uint32_t* ttl, void* ctx);
+    void* resolver_ctx;
+    /// @brief optional hosts file ("address name [aliases]" lines), its names never reach the resolver and never expire
+    const char* hosts_file;
+    /// @brief host names kept (split in shards), 0 uses the default (4096)
+    uint32_t max_entries;
+    /// @brief seconds an answer is used, 0 uses the default (60)
+    uint32_t ttl;
+    /// @brief seconds a failure is remembered, 0 uses the default (5)
+    uint32_t negative_ttl;
+    /// @brief seconds after its ttl an answer is still used while it is refreshed in the background, 0 uses the default (300)
+    uint32_t stale_ttl;
+} kyros_dns_options;
+
+typedef struct {
+    uint64_t hits;
+    /// @brief expired answers used while they were refreshed
+    uint64_t stale_hits;
+    /// @brief remembered failures
+    uint64_t negative_hits;
+    uint64_t misses;
+    /// @brief resolver calls (misses and refreshes, lookups of a name being resolved wait for the same call)
+    uint64_t resolutions;
+    uint64_t evicted;
+} kyros_dns_stats;
+
+/// @brief addresses have port 0 and are only valid during the call, error is 0 or a negative libuv error
+typedef void (*kyros_dns_callback)(const struct sockaddr_storage* addresses, uint32_t count, int32_t error, void* ctx);
+
+/// @brief kyros_socket_connect (and kyros_dns_lookup) resolve host names through one cache per process, resolved off the loops by
+/// resolver threads; call it before the first lookup to change the defaults, returns false if the hosts file can't be read
+/// (the cache is emptied, it must not run while lookups are in flight)
+export bool kyros_dns_configure(kyros_dns_options options);
+/// @brief resolve host through the cache, on a hit (expired answers being refreshed included) callback is called before it returns,
+/// otherwise in the thread of loop once resolved (the loop is kept alive until then)
+export void kyros_dns_lookup(kyros_loop* loop, const char* host, kyros_socket_ip_family family, kyros_dns_callback callback, void* ctx);
+export kyros_dns_stats kyros_dns_get_stats();
+/// @brief forget every answer, thread safe (resolutions in flight still complete their lookups)
+export void kyros_dns_clear();
+
+///
+/// Connection pool
+///
+
+typedef struct kyros_socket_pool kyros_socket_pool;
+typedef struct kyros_socket_pool_group kyros_socket_pool_group;
+
+typedef struct {
+    /// @brief connections per endpoint (connecting, checked out and idle), checkouts over it wait for a release or a close, 0 uses the default (64)
+    uint32_t max_per_host;
+    /// @brief ms an idle connection is kept before it is closed, 0 uses the default (30000)
+    uint32_t idle_timeout;
+    /// @brief optional, a pool without an idle connection for an endpoint asks the other pools of the group for one before connecting
+    kyros_socket_pool_group* group;
+    /// @brief ms a checkout waits for the answer of another pool of the group before it connects, 0 uses the default (100)
+    uint32_t steal_timeout;
+    /// @brief options of the new connections, tls is replaced by the one of each checkout
+    kryos_socket_options socket_options;
+} kyros_socket_pool_options;
+
+typedef struct {
+    /// @brief checkouts served by an idle connection
+    uint64_t reused;
+    /// @brief new connections
+    uint64_t connected;
+    /// @brief idle connections taken from other pools of the group
+    uint64_t stolen;
+    /// @brief idle connections given to other pools of the group
+    uint64_t given;
+    /// @brief checkouts that waited because their endpoint was at max_per_host
+    uint64_t waited;
+    /// @brief idle connections closed by idle_timeout
+    uint64_t evicted;
+    /// @brief idle connections closed because they were found closed by the peer (or it sent something nobody asked for)
+    uint64_t unhealthy;
+    /// @brief connecting, checked out and idle connections of the pool
+    uint64_t connections;
+    uint64_t idle;
+} kyros_socket_pool_stats;
+
+/// @brief socket is open (secure over tls) and uses the handler of the checkout, on error socket has tagged_ptr 0
+/// error is the one of the connect (or ECANCELED once the pool is destroyed)
+typedef void (*kyros_socket_pool_callback)(kyros_socket socket, kyros_socket_error error, void* ctx);
+
+/// @brief pools created with a group take idle connections from each other with kyros_socket_migrate (their loops must use the same
+/// io engine), the requests go through kyros_loop_atomic_defer; a checkout whose request is not answered within steal_timeout
+/// (the other loop is busy or stopped) connects instead, and a connection given after that is closed
+export kyros_socket_pool_group* kyros_socket_pool_group_create();
+/// @brief every pool of the group must be destroyed first
+export void kyros_socket_pool_group_destroy(kyros_socket_pool_group* group);
+/// @brief connections of loop to any endpoint, keyed by host, port, family and tls context; NULL if the group is full
+export kyros_socket_pool* kyros_socket_pool_create(kyros_loop* loop, kyros_socket_pool_options options);
+/// @brief closes the idle connections and fails the waiting checkouts (ECANCELED), the connecting ones are still handed out
+/// and the checked out ones are closed when released; the pool is freed after the last one, the checkouts still waiting for another
+/// pool of the group fail too (ECANCELED), their requests are freed by the asking loop once answered
+export void kyros_socket_pool_destroy(kyros_socket_pool* pool);
+/// @brief connection to source (host_port, not udp) over tls (NULL for plain tcp), the most recently released idle connection that
+/// passes a health check (still open, nothing to read) is given before checkout returns, otherwise callback is called once
+/// one is connected, or taken from another pool of the group, or released by someone else if the endpoint is at max_per_host
+/// the socket must be given back with kyros_socket_pool_release (or closed) and not migrated while checked out
+export void kyros_socket_pool_checkout(kyros_socket_pool* pool, kyros_socket_source source, SSL_CTX* tls, kyros_socket_handler* handler,
+    kyros_socket_pool_callback callback, void* ctx);
+/// @brief give back a checked out socket once its exchange is done, it is kept idle if reusable is true and it is still healthy
+/// (open, not piped, nothing queued or unread), otherwise it is closed; the handler of the checkout is not called anymore
+export void kyros_socket_pool_release(kyros_socket socket, bool reusable);
+export kyros_socket_pool_stats kyros_socket_pool_get_stats(kyros_socket_pool* pool);
+
+///
+/// Server group
+///
+
+typedef struct kyros_server_group kyros_server_group;
+
+typedef struct {
+    /// @brief loops of the group (one thread each), 0 = one per cpu the process can run on
+    uint32_t loop_count;
+    /// @brief pin loop i to the i-th usable cpu, the loop is created by its pinned thread so its memory is local to that NUMA node (Linux)
+    bool pin_threads : 1;
+    /// @brief attach a SO_ATTACH_REUSEPORT_CBPF program so each connection goes to the loop pinned to the cpu that received it,
+    /// instead of a hash of the 4-tuple (Linux, needs pin_threads, pair it with RSS/IRQ affinity of the NIC queues)
+    bool cpu_steering : 1;
+    /// @brief bitmask of the NUMA nodes whose cpus can be used, 0 = every node (Linux)
+    uint64_t numa_nodes;
+    /// @brief ms a graceful stop waits for the open sockets before stopping the loops anyway, 0 = wait for every socket
+    uint32_t stop_timeout;
+    /// @brief used to create every loop of the group
+    kyros_loop_options loop_options;
+    /// @brief optional, called in each loop thread before it listens (to attach per loop state like kyros_tls_session_cache_attach_server)
+    void (*onloop)(kyros_loop* loop, uint32_t index, void* ctx);
+    /// @brief passed to onloop
+    void* ctx;
+    /// @brief µs of average iteration latency (kyros_loop_stats busy_time / iterations) above which a loop moves some of its connections
+    /// to the least loaded loop of the group with kyros_socket_migrate, once it stays above it for 3 checks in a row (0 = no rebalancing)
+    /// only sockets accepted by the group are moved, the handler sees them again in onmigrate
+    uint32_t rebalance_threshold;
+    /// @brief ms between rebalance checks, 0 uses the default (100)
+    uint32_t rebalance_interval;
+    /// @brief max connections moved per check, 0 uses the default (16)
+    uint32_t rebalance_batch;
+} kyros_server_group_options;
+
+/// @brief one SO_REUSEPORT listener per loop on the same address, the kernel spreads the connections between them
+/// source must be KYROS_SOCKET_SOURCE_HOSTPORT (reuse_port is implied), handler is copied for every loop so its ctx is shared by all of them
+/// returns NULL if source can't be used
+export kyros_server_group* kyros_server_group_create(kyros_socket_source source, kryos_socket_options options,
+    kyros_socket_handler* handler, kyros_server_group_options group_options);
+/// @brief spawns the loop threads and returns once every loop listens (true), or once every loop exited because one of them could not listen (false)
+/// the loops start accepting together, after the last one listens
+export bool kyros_server_group_start(kyros_server_group* group);
+/// @brief graceful stop, thread safe: the listeners close and each loop runs until its sockets close (or stop_timeout)
+export void kyros_server_group_stop(kyros_server_group* group);
+/// @brief waits for every loop thread to exit and frees the loops, can't be called from one of them
+export void kyros_server_group_join(kyros_server_group* group);
+export uint32_t kyros_server_group_get_loop_count(kyros_server_group* group);
+/// @brief loop of index, valid from start to join, other threads can talk to it with kyros_loop_atomic_defer
+export kyros_loop* kyros_server_group_get_loop(kyros_server_group* group, uint32_t index);
+/// @brief cpu the loop of index is pinned to, -1 if it is not pinned
+export int32_t kyros_server_group_get_cpu(kyros_server_group* group, uint32_t index);
+/// @brief stops and joins the group if needed, then frees it
+export void kyros_server_group_destroy(kyros_server_group* group);
+
+///
+/// QUIC
+///
+
+// the UDP socket and connection id table of a QUIC server
+typedef struct kyros_quic_endpoint kyros_quic_listener;
+typedef struct kyros_quic_connection kyros_quic_connection;
+
+typedef enum {
+    /// @brief RFC 9438, after a loss the window grows back to where it was along a cubic curve that does not depend on the RTT
+    KYROS_QUIC_CONGESTION_CUBIC = 0,
+    /// @brief RFC 9002, the window is halved on loss and grows by one datagram per RTT
+    KYROS_QUIC_CONGESTION_NEW_RENO = 1,
+} kyros_quic_congestion_control;
+
+typedef struct {
+    /// @brief the handshake is done, streams can be opened and written
+    void (*onopen)(kyros_quic_connection* connection, void* ctx);
+    /// @brief data of a stream in order (only valid during the call), fin once the peer ended it
+    /// the first call for a stream opened by the peer is the one that creates it
+    void (*onstream)(kyros_quic_connection* connection, uint64_t stream_id, const char* data, uint64_t length, bool fin, void* ctx);
+    /// @brief the peer reset its side of the stream (RESET_STREAM) or asked for ours to stop (STOP_SENDING, it is reset)
+    void (*onreset)(kyros_quic_connection* connection, uint64_t stream_id, uint64_t error_code, void* ctx);
+    /// @brief the data buffered by the stream fell to the low watermark after kyros_quic_stream_write returned false
+    void (*ondrain)(kyros_quic_connection* connection, uint64_t stream_id, void* ctx);
+    /// @brief called once, with the CONNECTION_CLOSE received or sent (application tells which error space the code is from),
+    /// error_code is 0 with an empty reason after an idle timeout; connection is invalid after it
+    /// server connections that fail before onopen are dropped without it
+    void (*onclose)(kyros_quic_connection* connection, uint64_t error_code, bool application, const char* reason, uint32_t reason_length, void* ctx);
+    /// @brief passed to the callbacks until kyros_quic_set_ctx changes it for a connection
+    void* ctx;
+} kyros_quic_handler;
+
+typedef struct {
+    /// @brief ALPN protocol offered by clients and required by listeners (the SSL_CTX of a listener gets an ALPN callback), must be set
+    const char* alpn;
+    kyros_quic_congestion_control congestion_control;
+    /// @brief ms without receiving anything after which the connection is dropped without a CONNECTION_CLOSE, 0 uses the default (30 s)
+    uint32_t idle_timeout;
+    /// @brief bytes the peer can send on a stream before they are delivered, 0 uses the default (1 MiB)
+    uint64_t max_stream_data;
+    /// @brief bytes the peer can send on all streams before they are delivered, 0 uses the default (16 MiB)
+    uint64_t max_data;
+    /// @brief bidirectional streams the peer can have open at once, 0 uses the default (100)
+    uint32_t max_streams_bidi;
+    /// @brief unidirectional streams the peer can have open at once, 0 uses the default (100)
+    uint32_t max_streams_uni;
+    /// @brief send what the congestion window allows right away instead of spreading it over the RTT with timers
+    bool disable_pacing;
+} kyros_quic_options;
+
+typedef struct {
+    /// @brief smoothed RTT and the lowest one seen, in µs
+    uint64_t smoothed_rtt;
+    uint64_t min_rtt;
+    /// @brief bytes the congestion controller lets be in flight, and the ones that are
+    uint64_t congestion_window;
+    uint64_t bytes_in_flight;
+    uint64_t packets_sent;
+    uint64_t packets_received;
+    /// @brief packets declared lost by the ACKs (packet or time threshold), their frames were sent again
+    uint64_t packets_lost;
+} kyros_quic_stats;
+
+/// @brief QUIC v1 (RFC 9000) server on a UDP socket bound to source, tls is the SSL_CTX of the certificate (TLS 1.3 is used)
+/// packets are routed to their connection by the connection id, the datagrams of every connection go out with one sendmmsg
+/// per loop iteration (runs of full sized packets become UDP GSO sends); handler gets the connections once their handshake is done
+/// returns NULL if the socket could not be bound
+export kyros_quic_listener* kyros_quic_listen(kyros_loop* loop, kyros_socket_source source, SSL_CTX* tls, kyros_quic_options options, kyros_quic_handler handler);
+/// @brief stop accepting, the open connections are closed with NO_ERROR (their onclose is called), the socket closes after the last one
+export void kyros_quic_listener_close(kyros_quic_listener* listener);
+/// @brief QUIC v1 client on a connected UDP socket to source, server_name is sent as SNI (NULL to not send it), tls verifies the server
+/// failures are reported with onclose, the connection is valid until then
+export kyros_quic_connection* kyros_quic_connect(kyros_loop* loop, kyros_socket_source source, SSL_CTX* tls, const char* server_name,
+    kyros_quic_options options, kyros_quic_handler handler);
+/// @brief id of a new stream (UINT64_MAX if the peer does not allow one more yet or the connection is not open), nothing is sent until it is written
+export uint64_t kyros_quic_open_stream(kyros_quic_connection* connection, bool bidirectional);
+/// @brief data is copied and kept until the peer acknowledges it, fin ends our side of the stream
+/// returns false if the stream buffers more than 256 KiB (wait for ondrain) or can't be written (unknown, ended, reset or closed)
+export bool kyros_quic_stream_write(kyros_quic_connection* connection, uint64_t stream_id, const char* data, uint64_t length, bool fin);
+/// @brief abandon the stream, RESET_STREAM for our side and STOP_SENDING for the one of the peer
+export void kyros_quic_stream_reset(kyros_quic_connection* connection, uint64_t stream_id, uint64_t error_code);
+/// @brief STOP_SENDING only, what the peer sends on the stream is dropped and our side goes on (to answer before reading it all)
+export void kyros_quic_stream_stop(kyros_quic_connection* connection, uint64_t stream_id, uint64_t error_code);
+/// @brief ctx of one stream for the code on top of the connection, NULL until it is set and once the stream is freed
+/// (both sides ended, acknowledged or reset)
+export void kyros_quic_stream_set_ctx(kyros_quic_connection* connection, uint64_t stream_id, void* ctx);
+export void* kyros_quic_stream_get_ctx(kyros_quic_connection* connection, uint64_t stream_id);
+/// @brief CONNECTION_CLOSE with an application error (reason up to 256 bytes), onclose is called before it returns
+export void kyros_quic_close(kyros_quic_connection* connection, uint64_t error_code, const char* reason, uint32_t reason_length);
+export void kyros_quic_set_ctx(kyros_quic_connection* connection, void* ctx);
+/// @brief the UDP socket the connection sends from (the one of the listener for servers)
+export kyros_socket kyros_quic_get_socket(kyros_quic_connection* connection);
+export SSL* kyros_quic_get_ssl(kyros_quic_connection* connection);
+export kyros_quic_stats kyros_quic_get_stats(kyros_quic_connection* connection);
+
+///
+/// HTTP
+///
+
+typedef struct kyros_http_server kyros_http_server;
+// a request being answered, the connection for HTTP/1 (one at a time) or a stream of a HTTP/2 or HTTP/3 connection
+typedef struct kyros_http_response kyros_http_response;
+
+/// @brief slices of the received data, not null-terminated
+typedef struct {
+    const char* name;
+    const char* value;
+    uint32_t name_length;
+    uint32_t value_length;
+} kyros_http_header;
+
+/// @brief every pointer is a slice of the received data (no copies) only valid during onrequest
+typedef struct {
+    const char* method;
+    const char* target;
+    const kyros_http_header* headers;
+    /// @brief the whole body (Content-Length or decoded chunked), NULL if there is none
+    const char* body;
+    uint64_t body_length;
+    uint32_t method_length;
+    uint32_t target_length;
+    uint32_t header_count;
+    /// @brief 0 for HTTP/1.0, HTTP/2 and HTTP/3, 1 for HTTP/1.1
+    uint8_t minor_version;
+    /// @brief the connection stays open after the response (HTTP/1.1 default, Connection: close/keep-alive)
+    bool keep_alive;
+    /// @brief one stream of a HTTP/2 connection, :authority is given as a host header when there is none
+    bool http2;
+    /// @brief one stream of a HTTP/3 connection, the headers are the same as for HTTP/2
+    bool http3;
+} kyros_http_request;
+
+typedef struct {
+    /// @brief called once per request in the order they arrived, the response can be ended here or later (pipelined HTTP/1 requests wait for it)
+    void (*onrequest)(kyros_http_request* request, kyros_http_response* response, void* ctx);
+    /// @brief passed to onrequest
+    void* ctx;
+    /// @brief bytes of request line + headers, 0 uses the default (16 KiB), bigger requests get 431 and the connection is closed
+    uint32_t max_header_size;
+    /// @brief bytes of body, 0 uses the default (1 MiB), bigger requests get 413 and the connection is closed
+    uint64_t max_body_size;
+    /// @brief also speak HTTP/2, negotiated with ALPN h2 over tls (the SSL_CTX gets an ALPN callback) or h2c with prior knowledge
+    bool http2;
+} kyros_http_server_options;
+
+/// @brief HTTP/1.1 server on a kyros_socket_listen listener (options.tls for HTTPS), requests are parsed in place in the receive buffer
+/// pipelined requests are answered in order and the responses of one read are sent with a single write
+/// HTTP/2 streams of a connection are answered in any order, their frames are sent with one write per loop iteration
+/// returns NULL if the listener could not be created
+export kyros_http_server* kyros_http_server_listen(kyros_loop* loop, kyros_socket_source source, kryos_socket_options options, kyros_http_server_options http_options);
+/// @brief also answer HTTP/3 on a QUIC listener bound to source (UDP, usually the port of the TCP listener), quic_options.alpn
+/// defaults to "h3"; tls gets the ALPN callback of the listener so it must not be the SSL_CTX of the TCP one
+/// clients find it with an Alt-Svc header (h3=":port") written by onrequest, requests come with kyros_http_request.http3
+/// returns false if the listener could not be created (or QUIC is not available, it needs BoringSSL)
+export bool kyros_http_server_listen_http3(kyros_http_server* server, kyros_socket_source source, SSL_CTX* tls, kyros_quic_options quic_options);
+/// @brief stop listening, the open connections are not closed (HTTP/3 ones are, with the QUIC listener), the server is freed after the last one
+export void kyros_http_server_close(kyros_http_server* server);
+/// @brief first header named name (case insensitive), NULL if there is none, length is set to the value length
+export const char* kyros_http_request_get_header(kyros_http_request* request, const char* name, uint32_t name_length, uint32_t* length);
+/// @brief optional, 200 is used otherwise, must come before any header
+export void kyros_http_response_write_status(kyros_http_response* response, uint16_t status);
+/// @brief Date, Content-Length, Transfer-Encoding and Connection are added when needed, a Content-Length set here is trusted
+export void kyros_http_response_write_header(kyros_http_response* response, const char* name, uint32_t name_length, const char* value, uint32_t value_length);
+/// @brief send part of the body, chunked encoding unless a Content-Length header was written (HTTP/1.0 sends it raw and closes)
+/// returns false when the socket is above its high watermark (or the HTTP/2 stream waits for flow control window, the HTTP/3
+/// stream buffers more than 256 KiB)
+export bool kyros_http_response_write(kyros_http_response* response, const char* data, uint64_t length);
+/// @brief last part of the body (Content-Length is added if nothing was written yet), response is invalid after it
+export bool kyros_http_response_end(kyros_http_response* response, const char* data, uint64_t length);
+/// @brief called if the connection closes (or the HTTP/2 or HTTP/3 stream is reset) before the response ended, response is invalid after it
+export void kyros_http_response_onabort(kyros_http_response* response, void (*onabort)(kyros_http_response* response, void* ctx), void* ctx);
+export kyros_socket kyros_http_response_get_socket(kyros_http_response* response);
+
+///
+/// HTTP router
+///
+
+/// @brief routes registered at startup and compiled once into a radix tree, read only after kyros_http_router_compile so the
+/// loops of a kyros_server_group can share one
+/// a pattern is a path where a whole segment can be ":name" (any non-empty segment) or, as the last one, "*name" (the rest of
+/// the path, maybe empty, the name is optional); static segments win over parameters and parameters over wildcards
+typedef struct kyros_http_router kyros_http_router;
+
+/// @brief params are the ":name" and "*name" segments of the route in pattern order (the name without ':' or '*'), the values
+/// are slices of the request target (or of its normalized copy) only valid during the call
+typedef void (*kyros_http_route_handler)(kyros_http_request* request, kyros_http_response* response, const kyros_http_header* params,
+    uint32_t param_count, void* ctx);
+
+export kyros_http_router* kyros_http_router_create();
+/// @brief method is GET, HEAD, POST, PUT, DELETE, PATCH, OPTIONS, CONNECT or TRACE, NULL for any method (routes of the method win),
+/// HEAD requests use the GET route when there is no HEAD one
+/// returns false if pattern does not start with '/', a ':' or '*' segment is not valid, it has more than 16 of them, it is
+/// already registered for method, or the router is compiled
+export bool kyros_http_router_add(kyros_http_router* router, const char* method, const char* pattern, kyros_http_route_handler handler, void* ctx);
+/// @brief called when no route matches instead of answering 404 (or 405 with Allow when the path has routes of other methods)
+export void kyros_http_router_set_fallback(kyros_http_router* router, kyros_http_route_handler handler, void* ctx);
+/// @brief builds the tree, no route can be added after it
+export void kyros_http_router_compile(kyros_http_router* router);
+/// @brief onrequest of kyros_http_server_options with the router as ctx
+/// the path of the target is matched in place, targets that need normalization (absolute form, dot segments, escapes after a
+/// '/', backslashes) are parsed with ada first, an invalid one gets 400
+export void kyros_http_router_onrequest(kyros_http_request* request, kyros_http_response* response, void* ctx);
+/// @brief route of method for path (no query, already normalized), params needs room for 16, NULL if there is none
+export kyros_http_route_handler kyros_http_router_match(kyros_http_router* router, const char* method, uint32_t method_length,
+    const char* path, uint32_t path_length, kyros_http_header* params, uint32_t* param_count, void** ctx);
+export void kyros_http_router_destroy(kyros_http_router* router);
+
+///
+/// WebSocket
+///
+
+typedef struct kyros_websocket kyros_websocket;
+
+typedef enum {
+    KYROS_WEBSOCKET_TEXT = 1,
+    KYROS_WEBSOCKET_BINARY = 2,
+} kyros_websocket_opcode;
+
+typedef enum {
+    KYROS_WEBSOCKET_COMPRESSION_NONE = 0,
+    /// @brief permessage-deflate without context takeover, every message is (de)compressed with streams shared by the loop
+    /// so a connection costs no zlib memory, small repetitive messages compress worse than with a window
+    KYROS_WEBSOCKET_COMPRESSION_SHARED = 1,
+    /// @brief permessage-deflate with a sliding window per direction (about 300 KB per connection, taken from a pool of the loop
+    /// on the first compressed message), for hot connections with repetitive traffic
+    KYROS_WEBSOCKET_COMPRESSION_DEDICATED = 2,
+} kyros_websocket_compression;
+
+typedef struct {
+    /// @brief a whole message (fragments are joined), TEXT is valid UTF-8, data is only valid during the call
+    void (*onmessage)(kyros_websocket* websocket, const char* data, uint64_t length, kyros_websocket_opcode opcode, void* ctx);
+    /// @brief client only, the handshake is done
+    void (*onopen)(kyros_websocket* websocket, void* ctx);
+    /// @brief called once when the socket closes, code is the one of the close frame received (1005 if it had none),
+    /// the one the connection failed with, or 1006 if it closed without one; websocket is invalid after it
+    void (*onclose)(kyros_websocket* websocket, uint16_t code, const char* reason, uint32_t reason_length, void* ctx);
+    /// @brief called when the socket falls to its low watermark after kyros_websocket_send returned false
+    void (*ondrain)(kyros_websocket* websocket, void* ctx);
+    /// @brief passed to the callbacks
+    void* ctx;
+    /// @brief bytes of a message (all of its fragments), 0 uses the default (16 MiB), bigger messages close with 1009
+    uint64_t max_message_size;
+    /// @brief offered by clients and accepted by servers when the peer offers it, messages smaller than 64 bytes are sent uncompressed
+    kyros_websocket_compression compression;
+} kyros_websocket_options;
+
+/// @brief Sec-WebSocket-Key of a valid HTTP/1.1 upgrade request (24 bytes), NULL if request is not one
+/// the key (and Sec-WebSocket-Extensions) can be copied to call kyros_websocket_upgrade after onrequest returned
+export const char* kyros_websocket_get_key(kyros_http_request* request, uint32_t* length);
+/// @brief answer with 101 and take over the connection of response, nothing must have been written to it
+/// ping, pong and close frames are answered internally, with kryos_socket_options.timeout an idle websocket is pinged once before being closed
+/// extensions is the Sec-WebSocket-Extensions header of the request (NULL if it has none), used for options.compression
+/// returns NULL if the connection already closed, response is invalid after the call either way
+export kyros_websocket* kyros_websocket_upgrade(kyros_http_response* response, const char* key, uint32_t key_length,
+    const char* extensions, uint32_t extensions_length, kyros_websocket_options options);
+/// @brief client handshake for path (NULL = "/") on source (options.tls for wss), host is the Host header (NULL uses the source host)
+/// messages can be sent once onopen is called; failures are reported with onclose
+export kyros_websocket* kyros_websocket_connect(kyros_loop* loop, kyros_socket_source source, kryos_socket_options options, const char* host, const char* path, kyros_websocket_options websocket_options);
+/// @brief one frame, returns false when the socket is above its high watermark (wait for ondrain) or the close handshake started
+export bool kyros_websocket_send(kyros_websocket* websocket, const char* data, uint64_t length, kyros_websocket_opcode opcode);
+/// @brief start the close handshake (reason up to 123 bytes), the socket closes once the peer answers or after 10 s
+export void kyros_websocket_close(kyros_websocket* websocket, uint16_t code, const char* reason, uint32_t reason_length);
+export kyros_socket kyros_websocket_get_socket(kyros_websocket* websocket);
+
+/// @brief topics of server websockets shared by every loop (the loops of a kyros_server_group for example)
+/// topics are levels separated by '/', subscriptions can use "+" for exactly one level and "#" as the last one for any number of them
+/// ("a/#" matches "a" too), a websocket matching a message with several subscriptions gets it once
+typedef struct kyros_pubsub kyros_pubsub;
+
+export kyros_pubsub* kyros_pubsub_create();
+/// @brief once every loop with subscribed websockets stopped, the websockets still open lose their subscriptions
+export void kyros_pubsub_destroy(kyros_pubsub* pubsub);
+/// @brief from the thread of the websocket loop, subscriptions end with kyros_pubsub_unsubscribe or when the websocket closes
+/// returns false if topic is not valid, websocket is already subscribed to it, is a client or is closed
+export bool kyros_pubsub_subscribe(kyros_pubsub* pubsub, kyros_websocket* websocket, const char* topic, uint32_t topic_length);
+/// @brief topic is the one given to kyros_pubsub_subscribe, returns false if websocket is not subscribed to it
+export bool kyros_pubsub_unsubscribe(kyros_pubsub* pubsub, kyros_websocket* websocket, const char* topic, uint32_t topic_length);
+/// @brief send a message to the subscribers of topic (no '+' or '#') on every loop, from the thread of loop
+/// the frame is built once (and compressed once for the subscribers with permessage-deflate) and queued by reference, the other
+/// loops with subscriptions get it with one kyros_loop_atomic_defer each; returns the subscribers of loop it was written to
+/// subscribers above their high watermark still get it queued, kyros_websocket_options.ondrain tells when they caught up
+export uint32_t kyros_pubsub_publish(kyros_pubsub* pubsub, kyros_loop* loop, const char* topic, uint32_t topic_length,
+    const char* data, uint64_t length, kyros_websocket_opcode opcode);
 #endif
\ No newline at end of file
@@ -0,0 +1,301 @@
+#include <kyros.h>
+#include <kyros_bsd.h>
+#include <kyros_internal.h>
+
+#include <string.h>
+
+// kernel tls: once the handshake is done the record keys and sequence numbers go to the socket
+// (TLS_TX/TLS_RX), writes and reads are plaintext from then on and files can use sendfile
+// BoringSSL does not do it by itself, but it exposes everything needed: the TLS 1.2 key block,
+// the sequence numbers and (through the keylog callback) the TLS 1.3 traffic secrets
+
+#if defined(__linux__) && defined(OPENSSL_IS_BORINGSSL)
+#include <linux/tls.h>
+#include <openssl/hkdf.h>
+
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+
+typedef union {
+    struct tls_crypto_info info;
+    struct tls12_crypto_info_aes_gcm_128 aes_128_gcm;
+    struct tls12_crypto_info_aes_gcm_256 aes_256_gcm;
+#ifdef TLS_CIPHER_CHACHA20_POLY1305
+    struct tls12_crypto_info_chacha20_poly1305 chacha20_poly1305;
+#endif
+} kyros_ktls_crypto_info;
+
+// one direction, iv is the full 12 bytes nonce base (TLS 1.2 AES-GCM: 4 bytes salt + the explicit nonce)
+typedef struct {
+    uint8_t key[32];
+    uint8_t iv[12];
+    uint64_t sequence;
+} kyros_ktls_keys;
+
+static inline uint8_t kyros_ktls_hex_value(char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    return (c | 0x20) - 'a' + 10;
+}
+
+static void kyros_ktls_keylog(const SSL* ssl, const char* line)
+{
+    auto tls = kyros_tls_from_ssl(ssl);
+    if (!tls || !tls->tcp.socket.kernel_tls) {
+        return;
+    }
+    bool is_client;
+    if (!strncmp(line, "CLIENT_TRAFFIC_SECRET_0 ", 24)) {
+        is_client = true;
+    } else if (!strncmp(line, "SERVER_TRAFFIC_SECRET_0 ", 24)) {
+        is_client = false;
+    } else {
+        return;
+    }
+    // label client_random secret
+    auto hex = strrchr(line, ' ') + 1;
+    auto length = strlen(hex) / 2;
+    if (length > EVP_MAX_MD_SIZE) {
+        return;
+    }
+    if (!tls->traffic_secrets) {
+        tls->traffic_secrets = (kyros_tls_traffic_secrets*)kyros_alloc(sizeof(kyros_tls_traffic_secrets));
+        *tls->traffic_secrets = (kyros_tls_traffic_secrets) { 0 };
+    }
+    auto secret = is_client ? tls->traffic_secrets->client : tls->traffic_secrets->server;
+    for (size_t i = 0; i < length; i++) {
+        secret[i] = kyros_ktls_hex_value(hex[i * 2]) << 4 | kyros_ktls_hex_value(hex[i * 2 + 1]);
+    }
+    tls->traffic_secrets->length = (uint8_t)length;
+}
+
+void kyros_ktls_prepare_ctx(SSL_CTX* ctx)
+{
+    // an application keylog callback wins, TLS 1.3 sockets of that ctx then stay in userspace
+    if (!SSL_CTX_get_keylog_callback(ctx)) {
+        SSL_CTX_set_keylog_callback(ctx, kyros_ktls_keylog);
+    }
+}
+
+/// @brief HKDF-Expand-Label(secret, label, "", length) from RFC 8446
+static bool kyros_ktls_expand_label(const EVP_MD* digest, const uint8_t* secret, uint8_t secret_length, const char* label, uint8_t* out, uint8_t length)
+{
+    uint8_t info[32];
+    auto label_length = strlen(label);
+    info[0] = 0;
+    info[1] = length;
+    info[2] = (uint8_t)(6 + label_length);
+    memcpy(info + 3, "tls13 ", 6);
+    memcpy(info + 9, label, label_length);
+    // empty context
+    info[9 + label_length] = 0;
+    return HKDF_expand(out, length, digest, secret, secret_length, info, 10 + label_length);
+}
+
+static bool kyros_ktls_tls13_keys(kyros_socket_internal_tls* tls, int nid, uint8_t key_length, kyros_ktls_keys* client, kyros_ktls_keys* server)
+{
+    auto secrets = tls->traffic_secrets;
+    if (!secrets || !secrets->length) {
+        return false;
+    }
+    // the suites with a 256 bits AES key are the SHA-384 ones
+    auto digest = nid == NID_aes_256_gcm ? EVP_sha384() : EVP_sha256();
+    return kyros_ktls_expand_label(digest, secrets->client, secrets->length, "key", client->key, key_length)
+        && kyros_ktls_expand_label(digest, secrets->client, secrets->length, "iv", client->iv, 12)
+        && kyros_ktls_expand_label(digest, secrets->server, secrets->length, "key", server->key, key_length)
+        && kyros_ktls_expand_label(digest, secrets->server, secrets->length, "iv", server->iv, 12);
+}
+
+static bool kyros_ktls_tls12_keys(SSL* ssl, int nid, uint8_t key_length, kyros_ktls_keys* client, kyros_ktls_keys* server)
+{
+    uint8_t block[2 * (32 + 12)];
+    auto block_length = SSL_get_key_block_len(ssl);
+    // client mac, server mac, client key, server key, client iv, server iv (AEADs have no mac key)
+    size_t iv_length = nid == NID_chacha20_poly1305 ? 12 : 4;
+    if (block_length != 2 * ((size_t)key_length + iv_length) || !SSL_generate_key_block(ssl, block, block_length)) {
+        return false;
+    }
+    memcpy(client->key, block, key_length);
+    memcpy(server->key, block + key_length, key_length);
+    memcpy(client->iv, block + 2 * key_length, iv_length);
+    memcpy(server->iv, block + 2 * key_length + iv_length, iv_length);
+    if (iv_length == 4) {
+        // BoringSSL uses the sequence number as explicit nonce, the kernel keeps incrementing it
+        for (uint32_t i = 0; i < 8; i++) {
+            client->iv[4 + i] = (uint8_t)(client->sequence >> (56 - i * 8));
+            server->iv[4 + i] = (uint8_t)(server->sequence >> (56 - i * 8));
+        }
+    }
+    OPENSSL_cleanse(block, sizeof(block));
+    return true;
+}
+
+static socklen_t kyros_ktls_crypto_info_init(kyros_ktls_crypto_info* crypto_info, int nid, uint16_t version, kyros_ktls_keys* keys)
+{
+    uint8_t sequence[8];
+    for (uint32_t i = 0; i < 8; i++) {
+        sequence[i] = (uint8_t)(keys->sequence >> (56 - i * 8));
+    }
+    *crypto_info = (kyros_ktls_crypto_info) { 0 };
+    crypto_info->info.version = version == TLS1_3_VERSION ? TLS_1_3_VERSION : TLS_1_2_VERSION;
+    switch (nid) {
+    case NID_aes_128_gcm:
+        crypto_info->info.cipher_type = TLS_CIPHER_AES_GCM_128;
+        memcpy(crypto_info->aes_128_gcm.key, keys->key, 16);
+        memcpy(crypto_info->aes_128_gcm.salt, keys->iv, 4);
+        memcpy(crypto_info->aes_128_gcm.iv, keys->iv + 4, 8);
+        memcpy(crypto_info->aes_128_gcm.rec_seq, sequence, 8);
+        return sizeof(crypto_info->aes_128_gcm);
+    case NID_aes_256_gcm:
+        crypto_info->info.cipher_type = TLS_CIPHER_AES_GCM_256;
+        memcpy(crypto_info->aes_256_gcm.key, keys->key, 32);
+        memcpy(crypto_info->aes_256_gcm.salt, keys->iv, 4);
+        memcpy(crypto_info->aes_256_gcm.iv, keys->iv + 4, 8);
+        memcpy(crypto_info->aes_256_gcm.rec_seq, sequence, 8);
+        return sizeof(crypto_info->aes_256_gcm);
+#ifdef TLS_CIPHER_CHACHA20_POLY1305
+    case NID_chacha20_poly1305:
+        crypto_info->info.cipher_type = TLS_CIPHER_CHACHA20_POLY1305;
+        memcpy(crypto_info->chacha20_poly1305.key, keys->key, 32);
+        memcpy(crypto_info->chacha20_poly1305.iv, keys->iv, 12);
+        memcpy(crypto_info->chacha20_poly1305.rec_seq, sequence, 8);
+        return sizeof(crypto_info->chacha20_poly1305);
+#endif
+    default:
+        return 0;
+    }
+}
+
+static bool kyros_ktls_set_keys(uv_os_sock_t fd, int direction, int nid, uint16_t version, kyros_ktls_keys* keys)
+{
+    kyros_ktls_crypto_info crypto_info;
+    auto length = kyros_ktls_crypto_info_init(&crypto_info, nid, version, keys);
+    auto ok = length && setsockopt(fd, SOL_TLS, direction, &crypto_info, length) == 0;
+    OPENSSL_cleanse(&crypto_info, sizeof(crypto_info));
+    return ok;
+}
+
+bool kyros_ktls_enable(kyros_socket_internal_tls* tls)
+{
+    auto tcp = &tls->tcp;
+    auto ssl = tls->ssl;
+    auto version = SSL_version(ssl);
+    auto nid = SSL_CIPHER_get_cipher_nid(SSL_get_current_cipher(ssl));
+    uint8_t key_length = nid == NID_aes_128_gcm ? 16 : (nid == NID_aes_256_gcm || nid == NID_chacha20_poly1305) ? 32 : 0;
+    kyros_ktls_keys client = { 0 };
+    kyros_ktls_keys server = { 0 };
+    auto tx = tcp->socket.is_client ? &client : &server;
+    auto rx = tcp->socket.is_client ? &server : &client;
+    uv_os_fd_t fd;
+    if (!key_length || (version != TLS1_2_VERSION && version != TLS1_3_VERSION)) {
+        goto done;
+    }
+    // the end of the handshake must be on the wire before the kernel encrypts what comes next
+    kyros_socket_flush(kyros_socket_from_internal(&tcp->socket));
+    if (tcp->socket.status == KYROS_SOCKET_STATE_CLOSED || kyros_socket_queued(tcp) || tcp->cork) {
+        goto done;
+    }
+    tx->sequence = SSL_get_write_sequence(ssl);
+    rx->sequence = SSL_get_read_sequence(ssl);
+    if (version == TLS1_3_VERSION ? !kyros_ktls_tls13_keys(tls, nid, key_length, &client, &server) : !kyros_ktls_tls12_keys(ssl, nid, key_length, &client, &server)) {
+        goto done;
+    }
+    uv_fileno((uv_handle_t*)&tcp->poll.poll, &fd);
+    // fails without the tls module or on unix sockets
+    if (setsockopt(fd, IPPROTO_TCP, TCP_ULP, "tls", sizeof("tls")) != 0 || !kyros_ktls_set_keys(fd, TLS_TX, nid, version, tx)) {
+        goto done;
+    }
+    tcp->socket.ktls_tx = true;
+    // records the kernel can't decrypt (post handshake messages) would be lost for BoringSSL, a TLS 1.3 client
+    // receives session tickets so it keeps reading in userspace, and so does anyone who already has the next records
+    auto internal = kyros_get_internal_loop(kyros_socket_internal_get_loop(tcp));
+    if ((version == TLS1_2_VERSION || !tcp->socket.is_client) && !internal->ssl_input_length && !SSL_has_pending(ssl)) {
+        tcp->socket.ktls_rx = kyros_ktls_set_keys(fd, TLS_RX, nid, version, rx);
+    }
+
+done:
+    OPENSSL_cleanse(&client, sizeof(client));
+    OPENSSL_cleanse(&server, sizeof(server));
+    if (tls->traffic_secrets) {
+        OPENSSL_cleanse(tls->traffic_secrets, sizeof(kyros_tls_traffic_secrets));
+        kyros_free(tls->traffic_secrets);
+        tls->traffic_secrets = NULL;
+    }
+    return tcp->socket.ktls_tx;
+}
+
+int64_t kyros_ktls_recv(uv_os_sock_t fd, char* buffer, uint64_t length, uint8_t* record_type)
+{
+    char control[CMSG_SPACE(sizeof(uint8_t))];
+    struct iovec iov = { .iov_base = buffer, .iov_len = length };
+    struct msghdr message = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    ssize_t received;
+    do {
+        received = recvmsg(fd, &message, 0);
+    } while (kyros_bsd_interrupted(received));
+    // one record type per call, the type only comes as a control message when it is not application data
+    *record_type = SSL3_RT_APPLICATION_DATA;
+    if (received > 0) {
+        auto header = CMSG_FIRSTHDR(&message);
+        if (header && header->cmsg_level == SOL_TLS && header->cmsg_type == TLS_GET_RECORD_TYPE) {
+            *record_type = *(uint8_t*)CMSG_DATA(header);
+        }
+    }
+    return received;
+}
+
+void kyros_ktls_send_close_notify(uv_os_sock_t fd)
+{
+    char control[CMSG_SPACE(sizeof(uint8_t))] = { 0 };
+    uint8_t alert[2] = { SSL3_AL_WARNING, SSL3_AD_CLOSE_NOTIFY };
+    struct iovec iov = { .iov_base = alert, .iov_len = sizeof(alert) };
+    struct msghdr message = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    auto header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_TLS;
+    header->cmsg_type = TLS_SET_RECORD_TYPE;
+    header->cmsg_len = CMSG_LEN(sizeof(uint8_t));
+    *CMSG_DATA(header) = SSL3_RT_ALERT;
+    // best effort like SSL_shutdown, the writable side is shutdown right after
+    sendmsg(fd, &message, MSG_NOSIGNAL);
+}
+
+#else
+
+// no kernel tls, everything stays in userspace
+
+void kyros_ktls_prepare_ctx(SSL_CTX* ctx)
+{
+}
+
+bool kyros_ktls_enable(kyros_socket_internal_tls* tls)
+{
+    return false;
+}
+
+int64_t kyros_ktls_recv(uv_os_sock_t fd, char* buffer, uint64_t length, uint8_t* record_type)
+{
+    *record_type = SSL3_RT_APPLICATION_DATA;
+    return kyros_bsd_recv(fd, buffer, length);
+}
+
+void kyros_ktls_send_close_notify(uv_os_sock_t fd)
+{
+}
+
+#endif
@@ -39,7 +39,7 @@ static void kyros_do_not_optimize_away(void* p) {
 void kyros_init() {
     uv_init();
     CRYPTO_library_init();
-    assert(boring.SSL_library_init() > 0);
+    assert(SSL_library_init() > 0);
     SSL_load_error_strings();
     ERR_load_BIO_strings();
     OpenSSL_add_all_algorithms();
@@ -71,7 +71,7 @@ static inline void kyros_bitset_set(kyros_bitset* self, uint32_t index)
 static inline void kyros_bitset_unset(kyros_bitset* self, uint32_t index)
 {
     assert(index < 64);
-    self->mask &= (1ULL << index);
+    self->mask &= ~(1ULL << index);
 }
 
 static inline int32_t kyros_bitset_first_set(kyros_bitset* self)
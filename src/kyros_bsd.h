@@ -0,0 +1,246 @@
+#ifndef KYROS_BSD_H
+#define KYROS_BSD_H
+// thin portable layer over BSD sockets, everything is non-blocking and close-on-exec
+#include <stdbool.h>
+#include <stdint.h>
+#include <uv.h>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#define KYROS_SOCKET_ERROR_WOULD_BLOCK WSAEWOULDBLOCK
+#define KYROS_SOCKET_ERROR_IN_PROGRESS WSAEWOULDBLOCK
+#define KYROS_SOCKET_ERROR_INTERRUPTED WSAEINTR
+#define KYROS_INVALID_SOCKET INVALID_SOCKET
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#define KYROS_HAS_SENDFILE 1
+#endif
+#define KYROS_SOCKET_ERROR_WOULD_BLOCK EWOULDBLOCK
+#define KYROS_SOCKET_ERROR_IN_PROGRESS EINPROGRESS
+#define KYROS_SOCKET_ERROR_INTERRUPTED EINTR
+#define KYROS_INVALID_SOCKET -1
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+static inline int kyros_bsd_errno()
+{
+#ifdef _WIN32
+    return WSAGetLastError();
+#else
+    return errno;
+#endif
+}
+
+static inline bool kyros_bsd_would_block(int error)
+{
+#ifdef _WIN32
+    return error == WSAEWOULDBLOCK;
+#else
+    return error == EWOULDBLOCK || error == EAGAIN;
+#endif
+}
+
+/// @brief a call that failed because a signal came first, it is made again right away
+static inline bool kyros_bsd_interrupted(int64_t result)
+{
+    return result < 0 && kyros_bsd_errno() == KYROS_SOCKET_ERROR_INTERRUPTED;
+}
+
+static inline uv_os_sock_t kyros_bsd_set_nonblocking(uv_os_sock_t fd)
+{
+#ifdef _WIN32
+    u_long enabled = 1;
+    ioctlsocket(fd, FIONBIO, &enabled);
+#else
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+#endif
+    return fd;
+}
+
+static inline void kyros_bsd_set_nosigpipe(uv_os_sock_t fd)
+{
+#ifdef SO_NOSIGPIPE
+    int enabled = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &enabled, sizeof(int));
+#endif
+}
+
+static inline uv_os_sock_t kyros_bsd_create_socket(int domain, int type)
+{
+#if defined(SOCK_NONBLOCK) && defined(SOCK_CLOEXEC)
+    uv_os_sock_t fd = socket(domain, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+#else
+    uv_os_sock_t fd = socket(domain, type, 0);
+    if (fd != KYROS_INVALID_SOCKET) {
+        kyros_bsd_set_nonblocking(fd);
+    }
+#endif
+    if (fd != KYROS_INVALID_SOCKET) {
+        kyros_bsd_set_nosigpipe(fd);
+    }
+    return fd;
+}
+
+static inline void kyros_bsd_close(uv_os_sock_t fd)
+{
+#ifdef _WIN32
+    closesocket(fd);
+#else
+    close(fd);
+#endif
+}
+
+static inline uv_os_sock_t kyros_bsd_accept(uv_os_sock_t fd)
+{
+#if defined(SOCK_NONBLOCK) && defined(SOCK_CLOEXEC) && defined(__linux__)
+    uv_os_sock_t accepted;
+    do {
+        accepted = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    } while (kyros_bsd_interrupted(accepted));
+#else
+    uv_os_sock_t accepted;
+    do {
+        accepted = accept(fd, NULL, NULL);
+    } while (accepted == KYROS_INVALID_SOCKET && kyros_bsd_errno() == KYROS_SOCKET_ERROR_INTERRUPTED);
+    if (accepted != KYROS_INVALID_SOCKET) {
+        kyros_bsd_set_nonblocking(accepted);
+    }
+#endif
+    if (accepted != KYROS_INVALID_SOCKET) {
+        kyros_bsd_set_nosigpipe(accepted);
+    }
+    return accepted;
+}
+
+static inline int64_t kyros_bsd_recv(uv_os_sock_t fd, void* buffer, uint64_t length)
+{
+    int64_t received;
+    do {
+        received = recv(fd, buffer, length, 0);
+    } while (kyros_bsd_interrupted(received));
+    return received;
+}
+
+/// @brief read without taking the bytes out of the socket
+static inline int64_t kyros_bsd_peek(uv_os_sock_t fd, void* buffer, uint64_t length)
+{
+    int64_t received;
+    do {
+        received = recv(fd, buffer, length, MSG_PEEK);
+    } while (kyros_bsd_interrupted(received));
+    return received;
+}
+
+static inline int64_t kyros_bsd_send(uv_os_sock_t fd, const void* buffer, uint64_t length)
+{
+    int64_t sent;
+    do {
+        sent = send(fd, buffer, length, MSG_NOSIGNAL);
+    } while (kyros_bsd_interrupted(sent));
+    return sent;
+}
+
+/// @brief gather write, uv_buf_t matches struct iovec on unix and WSABUF on windows
+static inline int64_t kyros_bsd_sendv(uv_os_sock_t fd, uv_buf_t* buffers, uint32_t count)
+{
+#ifdef _WIN32
+    DWORD sent = 0;
+    if (WSASend(fd, (WSABUF*)buffers, count, &sent, 0, NULL, NULL) != 0) {
+        return -1;
+    }
+    return sent;
+#else
+    struct msghdr message = {
+        .msg_iov = (struct iovec*)buffers,
+        .msg_iovlen = count,
+    };
+    int64_t sent;
+    do {
+        sent = sendmsg(fd, &message, MSG_NOSIGNAL);
+    } while (kyros_bsd_interrupted(sent));
+    return sent;
+#endif
+}
+
+#ifdef KYROS_HAS_SENDFILE
+/// @brief file to socket without going through userspace, returns the bytes sent or -1 (errno)
+static inline int64_t kyros_bsd_sendfile(uv_os_sock_t fd, uv_file file, uint64_t offset, uint64_t length)
+{
+    off_t position = (off_t)offset;
+    int64_t sent;
+    do {
+        sent = sendfile(fd, file, &position, length);
+    } while (kyros_bsd_interrupted(sent));
+    return sent;
+}
+#endif
+
+static inline void kyros_bsd_set_nodelay(uv_os_sock_t fd, bool enabled)
+{
+    int value = enabled;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (const char*)&value, sizeof(int));
+}
+
+static inline void kyros_bsd_set_keepalive(uv_os_sock_t fd, bool enabled, uint32_t initial_delay)
+{
+    int value = enabled;
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, (const char*)&value, sizeof(int));
+    if (enabled && initial_delay) {
+        // initial_delay is in ms like node, the kernel wants seconds
+        int seconds = initial_delay < 1000 ? 1 : (int)(initial_delay / 1000);
+#if defined(TCP_KEEPIDLE)
+        setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, (const char*)&seconds, sizeof(int));
+#elif defined(TCP_KEEPALIVE)
+        setsockopt(fd, IPPROTO_TCP, TCP_KEEPALIVE, (const char*)&seconds, sizeof(int));
+#endif
+    }
+}
+
+static inline void kyros_bsd_set_reuse(uv_os_sock_t fd, bool reuse_port)
+{
+    int enabled = 1;
+#ifndef _WIN32
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enabled, sizeof(int));
+#endif
+#ifdef SO_REUSEPORT
+    if (reuse_port) {
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &enabled, sizeof(int));
+    }
+#endif
+}
+
+/// @brief pending error of a non-blocking connect, 0 when connected
+static inline int kyros_bsd_socket_error(uv_os_sock_t fd)
+{
+    int error = 0;
+    socklen_t length = sizeof(int);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, (char*)&error, &length) != 0) {
+        return kyros_bsd_errno();
+    }
+    return error;
+}
+
+static inline void kyros_bsd_shutdown_write(uv_os_sock_t fd)
+{
+#ifdef _WIN32
+    shutdown(fd, SD_SEND);
+#else
+    shutdown(fd, SHUT_WR);
+#endif
+}
+
+#endif
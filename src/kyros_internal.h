@@ -3,8 +3,10 @@
 #include <assert.h>
 #include <kyros.h>
 #include <kyros_bitset.h>
+#include <lshpack.h>
 #include <openssl/ssl.h>
 #include <stdatomic.h>
+#include <stddef.h>
 #include <uv.h>
 
 
@@ -26,6 +28,12 @@
 #ifndef kyros_calloc
 #define kyros_calloc mi_calloc
 #endif
+#ifndef kyros_alloc_aligned
+#define kyros_alloc_aligned(size, alignment) mi_malloc_aligned(size, alignment)
+#endif
+#ifndef kyros_free_aligned
+#define kyros_free_aligned mi_free
+#endif
 #else 
 #ifdef _WIN32
 #include <malloc.h>
@@ -56,14 +64,137 @@
 #ifndef kyros_usable_size
 #define kyros_usable_size malloc_usable_size
 #endif
+#ifndef kyros_alloc_aligned
+#ifdef _WIN32
+#define kyros_alloc_aligned(size, alignment) _aligned_malloc(size, alignment)
+#define kyros_free_aligned _aligned_free
+#else
+// aligned_alloc wants a size multiple of the alignment
+#define kyros_alloc_aligned(size, alignment) aligned_alloc(alignment, ((size) + (alignment) - 1) & ~((size_t)(alignment) - 1))
+#define kyros_free_aligned free
+#endif
+#endif
 #endif
 
-#define TASK_HIVE_SIZE 64 // used on main thread only to defer tasks (global)
-#define ASYNC_TASK_HIVE_SIZE 64 // used to signal tasks from another thread to main thread (per loop)
+#define TASK_SLAB_CHUNK_SIZE 64 // tasks per slab chunk, one kyros_bitset tracks the free slots
+#define TASK_SLAB_CHUNK_ALIGNMENT 2048 // chunks are aligned so a task can find its chunk by masking the address
+#define ASYNC_TASK_CHUNK_SIZE 1024 // async tasks are allocated in chunks of this size (per loop)
+#define ASYNC_TASK_MAX_CHUNKS 1024 // up to 1M in flight async tasks per loop before falling back to kyros_alloc
+#define KYROS_CACHE_LINE 64
+#define SUBMISSION_BUFFER_SIZE 128 // tasks buffered per loop by kyros_loop_atomic_submit (thread local)
+#define SUBMISSION_BUFFER_LOOPS 8 // distinct loops a thread can buffer tasks for before flushing all
+
+#define TIMER_WHEEL_LEVELS 4 // 64^4 ticks of range, longer timers are cascaded again at the last level
+#define TIMER_WHEEL_SLOT_BITS 6 // 64 slots per level so each level occupancy fits a kyros_bitset
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_SLOT_BITS)
+#define TIMER_WHEEL_DEFAULT_GRANULARITY 1 // in ms
+
+#define KYROS_RECV_BUFFER_SIZE 524288 // shared by every socket of the loop, like uSockets
+#define KYROS_RECV_BUFFER_PADDING 32 // extra room so parsers can overread safely
+#define KYROS_SSL_READ_BUFFER_SIZE 65536 // decrypted data of the current tls socket, shared by every socket of the loop
+#define KYROS_TLS_CACHE_SHARDS 64 // session cache shards, each one has its own lock
+#define KYROS_TLS_CACHE_PROBES 8 // slots probed per lookup/insert before evicting the oldest one
+#define KYROS_TLS_CACHE_DEFAULT_SESSIONS 20480
+#define KYROS_TLS_CACHE_DEFAULT_TIMEOUT 300 // in seconds
+#define KYROS_TLS_TICKET_KEY_ROTATION 3600000 // in ms
+#define KYROS_DNS_CACHE_SHARDS 16 // host name cache shards, each one has its own lock
+#define KYROS_DNS_CACHE_PROBES 8 // slots probed per lookup/insert before evicting the entry closest to expire
+#define KYROS_DNS_DEFAULT_ENTRIES 4096
+#define KYROS_DNS_DEFAULT_TTL 60 // in seconds, getaddrinfo does not tell the TTL of the records
+#define KYROS_DNS_DEFAULT_NEGATIVE_TTL 5 // in seconds
+#define KYROS_DNS_DEFAULT_STALE_TTL 300 // in seconds an expired answer is still used while it is refreshed
+#define KYROS_DNS_MAX_ADDRESSES 16 // addresses kept per host name
+#define KYROS_DNS_MAX_HOST 255
+#define KYROS_DNS_THREADS 4 // resolver threads (getaddrinfo blocks), started on demand
+#define KYROS_HAPPY_EYEBALLS_ATTEMPT_DELAY 250 // ms before the next address joins the race (RFC 8305 Connection Attempt Delay)
+#define KYROS_HAPPY_EYEBALLS_MAX_ATTEMPTS 8 // addresses raced per connect, the rest are not tried
+#define KYROS_SOCKET_POOL_MAX_PER_HOST 64 // default when kyros_socket_pool_options.max_per_host is 0
+#define KYROS_SOCKET_POOL_IDLE_TIMEOUT 30000 // default when kyros_socket_pool_options.idle_timeout is 0
+#define KYROS_SOCKET_POOL_STEAL_TIMEOUT 100 // default when kyros_socket_pool_options.steal_timeout is 0
+#define KYROS_SOCKET_POOL_ENDPOINTS 16 // initial endpoint buckets of a pool, doubled when there are more endpoints
+#define KYROS_SOCKET_POOL_GROUP_SIZE 64 // pools per kyros_socket_pool_group
+#define KYROS_SOCKET_POOL_STEAL_BUCKETS 64 // idle counters each pool publishes to its group, by endpoint hash
+#define KYROS_ACCEPT_BATCH 64 // max accepts per listener readiness so one listener cant starve the loop
+#define KYROS_UDP_RECV_BATCH 64 // datagrams per recvmmsg, each one gets KYROS_RECV_BUFFER_SIZE / 64 bytes of the loop recv buffer
+#define KYROS_UDP_GRO_BATCH 8 // coalesced messages per recvmmsg with UDP GRO, 64 KiB each
+#define KYROS_UDP_RECV_ROUNDS 4 // recvmmsg calls per readiness so one socket cant starve the loop
+#define KYROS_UDP_DELIVER_MAX 256 // datagrams per ondatagrams call, GRO messages can split into more than a batch
+#define KYROS_UDP_SEND_BATCH 64 // messages per sendmmsg, a socket with more flushes early
+#define KYROS_UDP_SEND_BUFFER 262144 // datagram bytes a socket gathers per iteration (from the loop buffer pool)
+#define KYROS_UDP_GSO_SEGMENTS 64 // datagrams coalesced in one UDP_SEGMENT send (the kernel limit)
+#define KYROS_UDP_GSO_MAX_BYTES 65000 // payload of one UDP_SEGMENT send, the headers must still fit in 64 KiB
+#define KYROS_UDP_MAX_DATAGRAM 65507 // largest UDP payload over IPv4
+#define KYROS_CORK_IOV_MAX 16 // iovecs gathered per corked socket before it is flushed early
+#define KYROS_CORK_CHUNK_SIZE 65536 // bytes per cork arena chunk, arena is reset after every flush
+#define KYROS_CORK_COPY_LIMIT 16384 // bigger writes are sent right away together with the corked data
+#define KYROS_WRITE_CHUNK_SIZE 16384 // write queue chunk including its header, chunks are pooled per loop
+#define KYROS_WRITE_POOL_MAX 4096 // idle chunks kept by a loop (64 MiB), the extra ones go back to the allocator
+#define KYROS_WRITE_QUEUE_IOV 16 // chunks sent per sendmsg when flushing a write queue
+#define KYROS_WRITE_HIGH_WATERMARK 65536 // default when kryos_socket_options.write_high_watermark is 0
+#define KYROS_WRITE_LOW_WATERMARK 16384 // default when kryos_socket_options.write_low_watermark is 0
+#define KYROS_WRITE_FILE_READ_SIZE 65536 // file bytes read per step when sendfile can't be used
+#define KYROS_BUFFER_POOL_MIN_SHIFT 12 // smallest pooled buffer is 4 KiB, each class doubles it
+#define KYROS_BUFFER_POOL_CLASSES 9 // up to 1 MiB, bigger buffers come from the allocator
+#define KYROS_BUFFER_POOL_IDLE_BYTES 8388608 // idle bytes a loop keeps per class, the extra buffers go back to the allocator
+#define KYROS_PIPE_KERNEL_SIZE 1048576 // kernel pipe asked for each spliced kyros_socket_pipe (the default 64 KiB is kept if refused)
+#define KYROS_URING_ENTRIES 1024 // submission queue of the io_uring engine, the completion queue is 4 times bigger (multishot)
+#define KYROS_URING_BUFFER_COUNT 256 // recv buffers provided to the kernel per loop, must be a power of 2
+#define KYROS_URING_BUFFER_SIZE 16384 // data per recv completion, each buffer also has KYROS_RECV_BUFFER_PADDING
+#define KYROS_SERVER_GROUP_STEERING_MAX 2046 // loops the steering program can map, 2 instructions each within BPF_MAXINSNS
+#define KYROS_SERVER_GROUP_REBALANCE_INTERVAL 100 // ms between rebalance checks by default
+#define KYROS_SERVER_GROUP_REBALANCE_BATCH 16 // sockets moved per check by default
+#define KYROS_SERVER_GROUP_REBALANCE_PERIODS 3 // checks in a row above the threshold before moving anything
+#define KYROS_HTTP_MAX_HEADERS 64 // headers per request, more is answered with 431
+#define KYROS_HTTP_MAX_HEADER_SIZE 16384 // default when kyros_http_server_options.max_header_size is 0
+#define KYROS_HTTP_MAX_BODY_SIZE 1048576 // default when kyros_http_server_options.max_body_size is 0
+#define KYROS_HTTP_DIRECT_WRITE 16384 // response bodies this big are written as they are instead of copied into the batch
+#define KYROS_HTTP_DATE_LENGTH 37 // "Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+#define KYROS_HTTP_ROUTER_MAX_PARAMS 16 // ":name" and "*name" segments per route
+#define KYROS_HTTP_ROUTER_URL_BUFFER 2048 // targets normalized with ada are built on the stack up to this size
+#define KYROS_HTTP2_PREFACE_LENGTH 24 // "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define KYROS_HTTP2_MAX_STREAMS 128 // SETTINGS_MAX_CONCURRENT_STREAMS we advertise
+#define KYROS_HTTP2_STREAM_TABLE 256 // open addressing slots per connection, twice the max streams
+#define KYROS_HTTP2_MAX_FRAME_SIZE 16384 // largest frame we accept (the protocol default)
+#define KYROS_HTTP2_STREAM_WINDOW 1048576 // SETTINGS_INITIAL_WINDOW_SIZE we advertise
+#define KYROS_HTTP2_CONNECTION_WINDOW 16777216 // connection receive window, raised with a WINDOW_UPDATE in the preface
+#define KYROS_HTTP2_MAX_FIELDS 80 // fields per header block (KYROS_HTTP_MAX_HEADERS plus pseudo headers and some slack)
+#define KYROS_HTTP3_MAX_CONTROL_FRAME 4096 // SETTINGS, GOAWAY and the like are gathered whole, bigger ones close with H3_EXCESSIVE_LOAD
+#define KYROS_QUIC_MAX_DATAGRAM 1200 // every datagram fits the smallest one QUIC allows, there is no path MTU discovery
+#define KYROS_QUIC_CID_LENGTH 8 // connection ids we issue, short headers are routed with them
+#define KYROS_QUIC_ACTIVE_CIDS 4 // connection ids issued per connection (if the active_connection_id_limit of the peer allows)
+#define KYROS_QUIC_PEER_CIDS 8 // active_connection_id_limit we advertise
+#define KYROS_QUIC_ACK_RANGES 32 // received packet number ranges kept per space, the oldest ones are forgotten
+#define KYROS_QUIC_PACKET_FRAMES 8 // frames tracked per sent packet for retransmission, a packet is ended when it has this many
+#define KYROS_QUIC_IDLE_TIMEOUT 30000 // default when kyros_quic_options.idle_timeout is 0
+#define KYROS_QUIC_MAX_STREAM_DATA 1048576 // default when kyros_quic_options.max_stream_data is 0
+#define KYROS_QUIC_MAX_DATA 16777216 // default when kyros_quic_options.max_data is 0
+#define KYROS_QUIC_MAX_STREAMS 100 // default when kyros_quic_options.max_streams_bidi/max_streams_uni is 0
+#define KYROS_QUIC_MAX_ACK_DELAY 25 // ms we wait before acknowledging a single packet (max_ack_delay)
+#define KYROS_QUIC_ACK_ELICITING_THRESHOLD 2 // ack-eliciting packets received before a 1-RTT ACK is sent right away
+#define KYROS_QUIC_INITIAL_RTT 333 // ms, until the first sample
+#define KYROS_QUIC_INITIAL_WINDOW 10 // congestion window in datagrams before any loss
+#define KYROS_QUIC_MINIMUM_WINDOW 2 // datagrams, the window never goes below it
+#define KYROS_QUIC_PACING_BURST 10 // datagrams the pacer lets out at once (or 1 ms of its rate if that is more)
+#define KYROS_QUIC_SEND_BURST 64 // datagrams a connection builds per flush, it is flushed again on the next iteration
+#define KYROS_QUIC_STREAM_HIGH_WATERMARK 262144 // bytes a stream buffers before kyros_quic_stream_write returns false
+#define KYROS_QUIC_STREAM_LOW_WATERMARK 65536 // ondrain once the acknowledged data brings it back here
+#define KYROS_QUIC_MAX_CRYPTO_BUFFER 65536 // out of order handshake bytes buffered per packet number space
+#define KYROS_WEBSOCKET_MAX_MESSAGE_SIZE 16777216 // default when kyros_websocket_options.max_message_size is 0
+#define KYROS_WEBSOCKET_COPY_LIMIT 4096 // payloads this small are sent in one write with their header, bigger ones are written as they are
+#define KYROS_WEBSOCKET_CLOSE_TIMEOUT 10000 // ms the peer has to answer a close frame before the socket is closed
+#define KYROS_WEBSOCKET_MAX_HANDSHAKE 16384 // bytes of 101 response a client waits for
+#define KYROS_WEBSOCKET_DEFLATE_MIN_SIZE 64 // messages this small are sent uncompressed even when permessage-deflate was negotiated
+#define KYROS_WEBSOCKET_DEFLATE_LEVEL 6
+#define KYROS_WEBSOCKET_DEFLATE_MEM_LEVEL 8 // zlib memLevel of the deflate streams, 2^(memLevel + 9) bytes of hash chains
+#define KYROS_WEBSOCKET_DEFLATE_IDLE 16 // reset streams of each kind a loop keeps for the next dedicated connections
+#define KYROS_PUBSUB_STACK_SUBSCRIBERS 256 // subscribers a publish collects on the stack, more go to the allocator
 
 #define KYROS_SOCKET_READABLE UV_READABLE
 #define KYROS_SOCKET_WRITABLE UV_WRITABLE
 
+/// @brief get the struct that contains member from a pointer to the member
+#define kyros_container_of(ptr, type, member) ((type*)((char*)(ptr) - offsetof(type, member)))
+
 #define CONCAT_INNER(a, b) a##b
 #define CONCAT(a, b) CONCAT_INNER(a, b)
 
@@ -138,20 +269,256 @@ typedef struct kyros_task {
     struct kyros_task* next;
 } kyros_task;
 
-declare_kyros_bitset_n(TASK_HIVE_SIZE);
+// FIFO of tasks, tail points to the last next field (or to head when empty)
+typedef struct {
+    kyros_task* head;
+    kyros_task** tail;
+} kyros_task_queue;
+
+#define KYROS_TASK_PRIORITY_COUNT 2
+
+// used by kyros_loop_defer, only touched by the loop thread
+typedef struct kyros_task_chunk {
+    // set bit = free slot
+    kyros_bitset free;
+    // next chunk with at least one free slot
+    struct kyros_task_chunk* next_partial;
+    // all chunks of the slab
+    struct kyros_task_chunk* next;
+    kyros_task tasks[TASK_SLAB_CHUNK_SIZE];
+} kyros_task_chunk;
+
+static_assert(sizeof(kyros_task_chunk) <= TASK_SLAB_CHUNK_ALIGNMENT, "kyros_task_chunk must fit in its alignment");
+
+// growable slab, chunks are kept after growing so steady state defer never reaches the allocator
+typedef struct {
+    kyros_task_chunk* partial;
+    kyros_task_chunk* chunks;
+    uint32_t chunk_count;
+    uint64_t in_use;
+} kyros_task_slab;
+
+// 32 bytes struct, node of the intrusive MPSC queue used by kyros_loop_atomic_defer
+typedef struct kyros_async_task {
+    void (*task)(void* ctx);
+    void* ctx;
+    // queue link, written by producers
+    _Atomic(struct kyros_async_task*) next;
+    // free list link (index + 1, 0 means end of the list)
+    _Atomic(uint32_t) next_free;
+    // stable slot index inside the pool, UINT32_MAX when allocated with kyros_alloc
+    uint32_t index;
+} kyros_async_task;
+
+#define KYROS_ASYNC_TASK_HEAP_INDEX UINT32_MAX
+
+// lock-free pool of async tasks, chunks are never released until the loop is freed
+// so a node can always be read even if it was popped by another producer
+typedef struct {
+    // (generation << 32) | (index + 1), the generation makes the pop ABA safe
+    _Atomic(uint64_t) free_head;
+    _Atomic(uint32_t) chunk_count;
+    // tasks allocated with kyros_alloc because the pool was at ASYNC_TASK_MAX_CHUNKS
+    _Atomic(uint64_t) heap_fallbacks;
+    char _padding[KYROS_CACHE_LINE];
+    _Atomic(kyros_async_task*) chunks[ASYNC_TASK_MAX_CHUNKS];
+} kyros_async_task_pool;
+
+// per thread buffer of tasks waiting to be spliced into a loop async queue
+typedef struct {
+    kyros_loop* loop;
+    uint32_t len;
+    kyros_task_entry tasks[SUBMISSION_BUFFER_SIZE];
+} kyros_submission_buffer;
+
+// 32 bytes intrusive timer wheel node, can be embedded in any struct (timers, sockets)
+typedef struct kyros_timer_entry {
+    struct kyros_timer_entry* next;
+    // NULL when the entry is not armed
+    struct kyros_timer_entry** pprev;
+    // absolute expiration in wheel ticks
+    uint64_t expires;
+    void (*callback)(struct kyros_timer_entry* entry);
+} kyros_timer_entry;
+
+// hierarchical timing wheel, O(1) insert, remove and re-arm driven by a single uv_timer_t
+typedef struct {
+    uv_timer_t driver;
+    // last processed tick
+    uint64_t now;
+    // tick the driver is armed for, UINT64_MAX when stopped
+    uint64_t armed;
+    // ms per tick
+    uint32_t granularity;
+    // armed entries
+    uint32_t count;
+    // armed entries that keep the loop alive
+    uint32_t keep_alive_count;
+    kyros_bitset occupied[TIMER_WHEEL_LEVELS];
+    kyros_timer_entry* slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+} kyros_timer_wheel;
+
+// bytes written to many sockets without a copy per socket (pre-framed pub/sub messages), write queues and
+// corks hold a reference, the last kyros_shared_buffer_unref frees it from whatever thread it runs on
 typedef struct {
-    kyros_bitset_n(TASK_HIVE_SIZE) set;
-    kyros_task tasks[TASK_HIVE_SIZE];
-} kyros_tasks_hive;
-// hives can have diferent sizes but for now both are only 64 in size until
-// further analysis
+    _Atomic(uint32_t) ref_count;
+    uint64_t length;
+    char data[];
+} kyros_shared_buffer;
+
+// writes of a corked socket gathered during one loop iteration, flushed with a single sendmsg/WSASend
+typedef struct kyros_cork {
+    struct kyros_cork* next;
+    // NULL if the socket was closed before the flush
+    void* socket;
+    uint32_t iov_count;
+    // writes absorbed, each one would have been a syscall without corking
+    uint32_t writes;
+    uint64_t length;
+    uv_buf_t iov[KYROS_CORK_IOV_MAX];
+} kyros_cork;
+
+// bump allocator for corked bytes, chunks are kept and reused across iterations
 typedef struct {
-    kyros_bitset_n(ASYNC_TASK_HIVE_SIZE) set;
-    kyros_task tasks[ASYNC_TASK_HIVE_SIZE];
-} kyros_tasks_async_hive;
+    char** chunks;
+    uint32_t chunk_count;
+    uint32_t current;
+    uint32_t used;
+    // corked sockets waiting for the after IO flush
+    kyros_cork* pending;
+    kyros_cork* free_list;
+    // shared buffers the corked iovs point into, released by the reset
+    kyros_shared_buffer** shared;
+    uint32_t shared_count;
+    uint32_t shared_capacity;
+    uint64_t syscalls_saved;
+} kyros_cork_arena;
+
+// fixed size piece of a socket write queue, always KYROS_WRITE_CHUNK_SIZE bytes with the header
+typedef struct kyros_write_chunk {
+    struct kyros_write_chunk* next;
+    // first byte not sent yet
+    uint32_t start;
+    // first free byte
+    uint32_t end;
+    char data[];
+} kyros_write_chunk;
 
-#define kyros_tasks_hive_empty \
-    (kyros_tasks_hive) { .set = kyros_bitset_full_n(TASK_HIVE_SIZE) }
+#define KYROS_WRITE_CHUNK_CAPACITY (KYROS_WRITE_CHUNK_SIZE - sizeof(kyros_write_chunk))
+// start of a chunk holding a kyros_write_file instead of bytes (its end is the capacity so nothing is appended to it)
+#define KYROS_WRITE_CHUNK_FILE UINT32_MAX
+
+// file region queued by kyros_socket_write4, sent with sendfile (or read in pieces) once it reaches the head
+typedef struct {
+    // duplicated, closed once everything is sent
+    uv_file fd;
+    uint64_t offset;
+    // bytes left
+    uint64_t length;
+} kyros_write_file;
+
+static inline kyros_write_file* kyros_write_chunk_get_file(kyros_write_chunk* chunk)
+{
+    return chunk->start == KYROS_WRITE_CHUNK_FILE ? (kyros_write_file*)chunk->data : NULL;
+}
+
+// start of a chunk referencing bytes of a kyros_shared_buffer, allocated on its own instead of from the pool (it is only a header)
+#define KYROS_WRITE_CHUNK_SHARED (UINT32_MAX - 1)
+
+typedef struct {
+    kyros_shared_buffer* buffer;
+    // bytes left, inside buffer
+    const char* data;
+    uint64_t length;
+} kyros_write_shared;
+
+static inline kyros_write_shared* kyros_write_chunk_get_shared(kyros_write_chunk* chunk)
+{
+    return chunk->start == KYROS_WRITE_CHUNK_SHARED ? (kyros_write_shared*)chunk->data : NULL;
+}
+
+/// @brief bytes of a chunk that is not a file, in place or in its shared buffer
+static inline uv_buf_t kyros_write_chunk_bytes(kyros_write_chunk* chunk)
+{
+    auto shared = kyros_write_chunk_get_shared(chunk);
+    if (shared) {
+        return uv_buf_init((char*)shared->data, shared->length);
+    }
+    return uv_buf_init(chunk->data + chunk->start, chunk->end - chunk->start);
+}
+
+// free chunks shared by every socket of the loop, so slow clients dont fragment the heap
+typedef struct {
+    kyros_write_chunk* free_list;
+    uint32_t idle;
+    uint32_t in_use;
+} kyros_write_chunk_pool;
+
+// free buffer of a kyros_buffer_pool class, the link lives in the buffer itself
+typedef struct kyros_pooled_buffer {
+    struct kyros_pooled_buffer* next;
+} kyros_pooled_buffer;
+
+// power of two buffers for messages being assembled (websocket fragments and partial frames), shared by every socket of the loop
+typedef struct {
+    kyros_pooled_buffer* free_lists[KYROS_BUFFER_POOL_CLASSES];
+    uint32_t idle[KYROS_BUFFER_POOL_CLASSES];
+    uint32_t in_use;
+} kyros_buffer_pool;
+
+// kind of operation a io_uring completion is for, kept in the low bits of its user_data next to the socket pointer
+typedef enum {
+    KYROS_URING_RECV = 0, // multishot recv with provided buffers
+    KYROS_URING_SEND = 1,
+    KYROS_URING_CONNECT = 2, // poll for writable while connecting
+    KYROS_URING_ACCEPT = 3, // multishot accept
+    KYROS_URING_STASH = 4, // nop, delivers what was received while paused
+    KYROS_URING_CANCEL = 5, // completions of cancels are not dispatched
+} kyros_uring_op;
+
+#define KYROS_URING_OP_MASK 7
+
+// owned by uring.c
+typedef struct kyros_uring kyros_uring;
+// owned by http2.c
+typedef struct kyros_http2_connection kyros_http2_connection;
+// udp.c
+typedef struct kyros_socket_internal_udp kyros_socket_internal_udp;
+// owned by websocket_deflate.c
+typedef struct kyros_websocket_deflate_pool kyros_websocket_deflate_pool;
+typedef struct kyros_websocket_zstream kyros_websocket_zstream;
+
+// data that could not be sent yet, a list of pooled chunks (and files, counted in length)
+typedef struct {
+    kyros_write_chunk* head;
+    kyros_write_chunk* tail;
+    uint64_t length;
+} kyros_write_queue;
+
+// sockets of a io_uring loop have no uv_poll_t, this takes its place (kyros_socket_internal.uring)
+typedef struct kyros_uring_io {
+    void* data;
+    // same offset as uv_poll_t.loop so kyros_socket_internal_get_loop works for both
+    uv_loop_t* loop;
+    // next socket of the loop uring_sends list
+    struct kyros_uring_io* next_send;
+    // received while paused, delivered before anything else on resume
+    kyros_write_queue stash;
+    int fd;
+    // operations the kernel still owns, each one holds a socket ref
+    uint16_t inflight;
+    bool recv_armed : 1; // multishot recv (accept for listeners) not finished yet
+    bool recv_canceling : 1;
+    bool send_armed : 1; // the kernel reads the head of the write queue
+    bool send_queued : 1; // in the uring_sends list
+    bool connect_armed : 1;
+    bool stash_scheduled : 1;
+    bool stash_end : 1; // FIN received while paused, handled after the stash
+    bool loop_unref : 1; // kyros_socket_keepalive_loop(false), the operations dont keep the loop alive
+} kyros_uring_io;
+
+static_assert(offsetof(kyros_uring_io, loop) == offsetof(uv_poll_t, loop), "kyros_uring_io must keep the loop where uv_poll_t has it");
+static_assert(sizeof(kyros_uring_io) <= sizeof(uv_poll_t), "kyros_uring_io must fit in the room of a uv_poll_t");
 
 // the loop is not small in size but normally we have 1 loop per thread so its fine
 typedef struct {
@@ -163,23 +530,76 @@ typedef struct {
     uv_check_t uv_check;
     uv_prepare_t uv_prepare;
 
-    // used to defer tasks/callbacks to next tick
-    kyros_task* task_queue;
+    // used to defer tasks/callbacks to next tick, one FIFO per kyros_task_priority
+    kyros_task_queue task_lanes[KYROS_TASK_PRIORITY_COUNT];
+    // tasks waiting in all lanes
+    uint64_t task_count;
+    // max normal tasks / time (in ns) per drain, 0 = unlimited
+    uint32_t task_budget;
+    uint64_t task_time_budget;
+    kyros_task_slab task_slab;
     uv_async_t task_queue_signal;
 
     // used to wakeup and thread comunication
-    atomic_flag lock;
     uv_async_t async_signal;
-    kyros_task* async_task_queue;
-    kyros_tasks_async_hive async_task_hive;
+    // true while a wakeup is in flight, only the producer that flips it sends the signal
+    atomic_bool async_pending;
+    // consumer side of the async task queue (loop thread only)
+    kyros_async_task* async_task_head;
+    kyros_async_task async_task_stub;
+    // producer side of the async task queue, padded so producers dont share a cache line with the consumer
+    char _padding[KYROS_CACHE_LINE];
+    _Atomic(kyros_async_task*) async_task_tail;
+    kyros_async_task_pool async_task_pool;
+
+    // timers and socket timeouts
+    kyros_timer_wheel timer_wheel;
+    // never sent, only referenced while keep_alive_count > 0 so uv_run waits for work done outside libuv (dns lookups)
+    uv_async_t keep_alive_handle;
+    uint32_t keep_alive_count;
+
+    // every socket of this loop reads here, allocated on the first read
+    char* recv_buffer;
+    // tls sockets decrypt here, allocated on the first tls read
+    char* ssl_read_buffer;
+    // ciphertext not consumed yet by the tls socket being read, the BIO reads from it
+    const char* ssl_input;
+    uint64_t ssl_input_length;
+    // auto corked writes, flushed in the uv_check (after IO) hook
+    kyros_cork_arena cork_arena;
+    // chunks for the socket write queues
+    kyros_write_chunk_pool write_pool;
+    // buffers for messages of any size
+    kyros_buffer_pool buffer_pool;
+    // permessage-deflate streams, NULL until a websocket of the loop compresses something (websocket_deflate.c)
+    kyros_websocket_deflate_pool* deflate_pool;
+    // NULL with the poll engine (kyros_loop_options.io_engine)
+    kyros_uring* uring;
+    // io_uring sockets with something to send, one send per socket is submitted in the before/after IO hooks
+    kyros_uring_io* uring_sends;
+    // http2 connections with frames to write, one write per connection in the before/after IO hooks
+    kyros_http2_connection* http2_sends;
+    // quic connections with packets to build, they become datagrams of the udp_sends flush right after
+    kyros_quic_connection* quic_sends;
+    // udp sockets with datagrams to send, one sendmmsg per socket in the before/after IO hooks
+    kyros_socket_internal_udp* udp_sends;
+    uint64_t uring_submits;
+    uint64_t uring_completions;
+    // kyros_loop_stats iterations and busy_time
+    uint64_t iterations;
+    uint64_t start_time;
+    uint64_t start_idle_time;
 } kyros_loop_internal;
 
-// we have exacly 4 ptr wide here to be used inside uv_handler_t reserved size
+// 72 bytes instead of a full uv_timer_t, the wheel entry must be the first member
 typedef struct {
-    uint64_t ref_count;
+    kyros_timer_entry entry;
+    kyros_loop* loop;
     void (*task)(void* ctx);
     void* ctx;
-    void* _reserved;
+    uint64_t repeat;
+    uint32_t ref_count;
+    bool keep_alive;
 } kyros_timer_internal;
 
 static inline kyros_loop_internal* kyros_get_internal_loop(kyros_loop* loop)
@@ -188,17 +608,64 @@ static inline kyros_loop_internal* kyros_get_internal_loop(kyros_loop* loop)
 }
 static inline kyros_timer_internal* kyros_get_internal_timer(kyros_timer* timer)
 {
-    return (kyros_timer_internal*)(&((uv_timer_t*)timer)->u.reserved[0]);
+    return (kyros_timer_internal*)timer;
 }
 
-typedef enum {
-    KYROS_SOCKET_STATE_CONNECTING = 0,
-    KYROS_SOCKET_STATE_OPEN = 1,
-    KYROS_SOCKET_STATE_SECURE = 2, // handshake ok (only available when over TLS)
-    KYROS_SOCKET_STATE_READABLE_ENDED = 3,
-    KYROS_SOCKET_STATE_WRITABLE_ENDED = 4,
-    KYROS_SOCKET_STATE_CLOSED = 5,
-} KYROS_SOCKET_STATUS;
+static inline bool kyros_timer_entry_is_armed(kyros_timer_entry* entry)
+{
+    return entry->pprev != NULL;
+}
+
+void kyros_timer_wheel_init(kyros_timer_wheel* wheel, uv_loop_t* loop, uint32_t granularity);
+void kyros_timer_wheel_deinit(kyros_timer_wheel* wheel);
+/// @brief arm (or re-arm) entry to fire after timeout ms
+void kyros_timer_wheel_insert(kyros_timer_wheel* wheel, kyros_timer_entry* entry, uint64_t timeout);
+/// @brief disarm entry, no-op if not armed
+void kyros_timer_wheel_remove(kyros_timer_wheel* wheel, kyros_timer_entry* entry);
+/// @brief add or remove entries that keep the loop alive
+void kyros_timer_wheel_keep_alive(kyros_timer_wheel* wheel, int32_t delta);
+// keep the loop running while delta > 0 pending operations that libuv does not know about, loop thread only
+void kyros_loop_keep_alive(kyros_loop* loop, int32_t delta);
+// shared read buffer of the loop (KYROS_RECV_BUFFER_SIZE + KYROS_RECV_BUFFER_PADDING bytes), allocated on first use
+char* kyros_loop_get_recv_buffer(kyros_loop* loop);
+// shared decrypt buffer of the loop (KYROS_SSL_READ_BUFFER_SIZE bytes), allocated on first use
+char* kyros_loop_get_ssl_read_buffer(kyros_loop* loop);
+// copy data in the cork arena, returns NULL if it does not fit in a chunk
+char* kyros_cork_arena_copy(kyros_cork_arena* arena, const char* data, uint64_t length);
+kyros_cork* kyros_cork_arena_new_cork(kyros_cork_arena* arena, void* socket);
+// keep buffer alive until the reset, corked iovs point into it
+void kyros_cork_arena_hold(kyros_cork_arena* arena, kyros_shared_buffer* buffer);
+void kyros_cork_arena_reset(kyros_cork_arena* arena);
+kyros_write_chunk* kyros_write_chunk_pool_get(kyros_write_chunk_pool* pool);
+void kyros_write_chunk_pool_release(kyros_write_chunk_pool* pool, kyros_write_chunk* chunk);
+// at least *capacity bytes, *capacity is set to the size of the buffer given
+char* kyros_buffer_pool_get(kyros_buffer_pool* pool, uint64_t* capacity);
+// capacity must be the one kyros_buffer_pool_get gave
+void kyros_buffer_pool_release(kyros_buffer_pool* pool, char* buffer, uint64_t capacity);
+// flush every corked socket of the loop (socket.c)
+void kyros_socket_flush_corked(kyros_loop_internal* internal);
+
+// uring.c, Linux io_uring engine driven by a uv_poll_t on the ring fd, NULL if the kernel can't do it
+kyros_uring* kyros_uring_create(kyros_loop* loop);
+void kyros_uring_destroy(kyros_uring* uring);
+// enter the kernel once with every operation prepared since the last submit
+void kyros_uring_submit(kyros_uring* uring);
+// target is the socket the completion is for, the buffer given to its recv completions is recycled after the dispatch
+void kyros_uring_recv(kyros_uring* uring, int fd, void* target);
+void kyros_uring_send(kyros_uring* uring, int fd, const uv_buf_t* iov, uint32_t count, void* target);
+void kyros_uring_poll_writable(kyros_uring* uring, int fd, void* target);
+void kyros_uring_accept(kyros_uring* uring, int fd, void* target);
+void kyros_uring_nop(kyros_uring* uring, void* target, kyros_uring_op op);
+void kyros_uring_cancel(kyros_uring* uring, void* target, kyros_uring_op op);
+/// @brief add or remove operations that keep the loop alive
+void kyros_uring_keep_alive(kyros_uring* uring, int32_t delta);
+// socket.c, result is the cqe res (negative errno), buffer is set for recv completions with data
+void kyros_socket_uring_complete(void* target, kyros_uring_op op, int32_t result, const char* buffer, bool more);
+// prepare one send per socket in uring_sends, called before each submit
+void kyros_socket_uring_prepare_sends(kyros_loop_internal* internal);
+
+// public as kyros_socket_state
+typedef kyros_socket_state KYROS_SOCKET_STATUS;
 
 // we will not have a single socket type but one for each tag this is only the common part
 typedef struct {
@@ -207,6 +674,26 @@ typedef struct {
     bool allow_half_open : 1; // really needed and useful, if false it will close the socket if the readable side closes
     bool is_paused : 1;
     bool is_client : 1;
+    uint8_t tag : 5; // kyros_socket_internal_tag, used to rebuild the tagged kyros_socket from internal callbacks
+    uint8_t poll_events : 2; // KYROS_SOCKET_READABLE | KYROS_SOCKET_WRITABLE currently requested
+    bool has_poll : 1; // false while resolving the address (no fd yet)
+    bool end_pending : 1; // shutdown the writable side once the write buffer is flushed
+    bool over_high_watermark : 1; // write queue crossed the high watermark, ondrain is due at the low watermark
+    bool pause_on_backpressure : 1; // stop reading while over the high watermark
+    bool backpressure_paused : 1; // reading stopped by backpressure, independent of is_paused
+    bool tls_end_pending : 1; // end was requested before the tls plaintext queue was flushed
+    bool kernel_tls : 1; // kryos_socket_options.kernel_tls, try to move the tls records to the kernel after the handshake
+    bool ktls_tx : 1; // the kernel encrypts, writes are plaintext
+    bool ktls_rx : 1; // the kernel decrypts, reads are plaintext (records come with their type)
+    bool has_pipe_link : 1; // handlers is a kyros_socket_pipe_link wrapping the user handler
+    bool pipe_splice : 1; // source of a spliced pipe, reads never reach userspace
+    bool pipe_paused : 1; // source not read until the pipe destination takes what it has
+    bool pipe_waiting : 1; // destination polled for writable on behalf of a spliced pipe
+    bool uring : 1; // driven by the loop io_uring, the poll room holds a kyros_uring_io
+    bool migrating : 1; // kyros_socket_migrate, the old loop lets go of it and the poll/uring data holds the migration
+    bool racing : 1; // happy eyeballs attempts in flight (no fd yet), the poll data holds the race
+    bool pooled : 1; // handlers is a kyros_socket_pool_connection (under the pipe link while piped)
+    bool file_reading : 1; // a piece of the file at the head of the write (or tls plaintext) queue is read on the uv threadpool
     // usockets uses the uv_poll_t ptr + fd + poll_type
     // our solution tags the ptr instead of poll_type
     // and uses ref_count + flags with should be basically fd + poll_type in size
@@ -214,7 +701,10 @@ typedef struct {
 } kyros_socket_internal;
 
 typedef struct {
-    uv_poll_t poll; // only pollable sockets have this because is 160 bytes
+    union {
+        uv_poll_t poll; // only pollable sockets have this because is 160 bytes
+        kyros_uring_io uring; // io_uring loops dont poll, same room
+    };
 } kyros_socket_internal_poll;
 
 typedef struct {
@@ -227,20 +717,97 @@ typedef struct {
   unsigned char* buffer;
 } kyros_buffer;
 
+// 240 bytes per idle connection (uv_poll_t is 160 of it), reads go to the loop recv_buffer
+// so nothing else is allocated until a write can't be flushed right away
 typedef struct {
     kyros_socket_internal socket;
     kyros_socket_internal_poll poll;
     kyros_socket_handler* handlers;
+    kyros_timer_entry timeout_entry; // armed only when timeout > 0
+    // allocated by the first write that can't be flushed right away and freed once it is flushed,
+    // chunks are taken from the loop pool on demand and given back once sent
+    kyros_write_queue* write_queue;
+    // writes gathered in this loop iteration when auto corking, NULL otherwise
+    kyros_cork* cork;
     uint32_t timeout; // in ms default 0 (no timeout)
+    uint32_t write_high_watermark;
+    uint32_t write_low_watermark;
     kyros_socket_cork_behavior cork_behavior : 2; // 0 = disabled, 1 = manual, 2 = auto
      // if true increase sizeof(kyros_buffer) at the end of the full size struct
     bool enable_write_buffer: 1;
 } kyros_socket_internal_tcp;
 
+static_assert(sizeof(kyros_socket_internal_tcp) < 256, "idle tcp sockets must stay below 256 bytes");
+
+/// @brief bytes waiting in the write queue of the socket
+static inline uint64_t kyros_socket_queued(kyros_socket_internal_tcp* tcp)
+{
+    return tcp->write_queue ? tcp->write_queue->length : 0;
+}
+
+typedef struct {
+    kyros_socket_internal socket;
+    kyros_socket_internal_poll poll;
+    kyros_socket_handler* handlers;
+    // applied to every accepted socket
+    kryos_socket_options options;
+} kyros_socket_internal_listener;
+
+// one sendmmsg entry, a single datagram or a run of segments sent with UDP GSO
+typedef struct {
+    uint32_t offset; // in the batch data
+    uint32_t length;
+    uint16_t segment_size; // every segment but the last one has this size, 0 for a single datagram
+    uint16_t segments;
+    socklen_t peer_length; // 0 for the peer of a connected socket
+    struct sockaddr_storage peer;
+} kyros_udp_message;
+
+// datagrams written during an iteration, sent by kyros_udp_flush_sends (or early when full)
+typedef struct {
+    // from the loop buffer pool while there is something to send, NULL otherwise
+    char* data;
+    uint64_t capacity;
+    uint32_t length;
+    uint32_t count;
+    // messages at the front the kernel already took, the rest waits for writable
+    uint32_t sent;
+    kyros_udp_message messages[KYROS_UDP_SEND_BATCH];
+} kyros_udp_batch;
+
+// poll at the same offset as in the tcp socket (kyros_socket_get_loop), always driven by uv_poll (also on io_uring loops)
+struct kyros_socket_internal_udp {
+    kyros_socket_internal socket;
+    kyros_socket_internal_poll poll;
+    kyros_socket_handler* handlers;
+    // allocated on the first send, kept until the socket is closed
+    kyros_udp_batch* batch;
+    kyros_socket_internal_udp* send_next;
+    // segment sizes from this one up are not coalesced, the path refused them (EINVAL)
+    uint16_t gso_limit;
+    int family;
+    bool send_queued : 1; // in the loop udp_sends list
+    bool blocked : 1; // the kernel buffer is full, waiting for writable
+    bool connected : 1;
+    bool gso : 1; // UDP_SEGMENT works, cleared the first time the kernel refuses it (EIO)
+    bool gro : 1; // UDP_GRO enabled, reads are 64 KiB messages of coalesced datagrams
+};
+
+// TLS 1.3 traffic secrets caught by the keylog callback, only alive during a kernel tls handshake
+typedef struct {
+    uint8_t client[EVP_MAX_MD_SIZE];
+    uint8_t server[EVP_MAX_MD_SIZE];
+    uint8_t length;
+} kyros_tls_traffic_secrets;
+
+// only the SSL is added, BoringSSL drops its record buffers while idle and the
+// handshake config once the handshake is done (SSL_CTX comes from SSL_get_SSL_CTX)
 typedef struct {
     kyros_socket_internal_tcp tcp;
     SSL* ssl;
-    SSL_CTX* ssl_ctx;
+    // plaintext written before the handshake finished or behind a file being encrypted, allocated on demand
+    kyros_write_queue* plaintext_queue;
+    kyros_tls_traffic_secrets* traffic_secrets;
 } kyros_socket_internal_tls;
 
 typedef union {
@@ -282,4 +849,1381 @@ static inline kyros_socket_internal* kyros_get_socket_internal(kyros_socket sock
     return (kyros_socket_internal*)((kyros_tagged_socket) { .ptr = socket }).v.value;
 }
 
+static inline kyros_socket kyros_socket_from_internal(kyros_socket_internal* internal)
+{
+    return ((kyros_tagged_socket) { .v = { .tag = internal->tag, .value = (uint64_t)internal } }).ptr;
+}
+
+static inline kyros_loop* kyros_socket_internal_get_loop(kyros_socket_internal_tcp* tcp)
+{
+    // set by uv_poll_init (or with the kyros_uring_io), or by hand while the socket is still resolving (see kyros_socket_create_tcp)
+    return (kyros_loop*)tcp->poll.poll.loop;
+}
+
+/// @brief uv_error is a negative libuv error code
+static inline kyros_socket_error kyros_socket_uv_error(kyros_socket_error_type type, int uv_error)
+{
+    return (kyros_socket_error) {
+        .type = type,
+        .code = (uint32_t)-uv_error,
+        .code_s = uv_err_name(uv_error),
+        .message = uv_strerror(uv_error),
+    };
+}
+
+static inline kyros_socket_error kyros_socket_system_error(kyros_socket_error_type type, int error)
+{
+    return kyros_socket_uv_error(type, uv_translate_sys_error(error));
+}
+
+// socket.c, shared with the layers on top of tcp (tls)
+void kyros_write_queue_append(kyros_write_chunk_pool* pool, kyros_write_queue* queue, const char* data, uint64_t length);
+void kyros_write_queue_clear(kyros_write_chunk_pool* pool, kyros_write_queue* queue);
+// queue a file region, fd is duplicated, returns false if it could not be
+bool kyros_write_queue_append_file(kyros_write_chunk_pool* pool, kyros_write_queue* queue, uv_file fd, uint64_t offset, uint64_t length);
+// queue length bytes of buffer starting at data by reference
+void kyros_write_queue_append_shared(kyros_write_queue* queue, kyros_shared_buffer* buffer, const char* data, uint64_t length);
+// drop sent bytes from the front, fully sent chunks go back to the pool (files are closed, shared buffers unreferenced)
+void kyros_write_queue_consume(kyros_write_chunk_pool* pool, kyros_write_queue* queue, uint64_t sent);
+// ref_count starts at 1
+kyros_shared_buffer* kyros_shared_buffer_create(uint64_t length);
+void kyros_shared_buffer_ref(kyros_shared_buffer* buffer);
+void kyros_shared_buffer_unref(kyros_shared_buffer* buffer);
+// raw write to the tcp socket (direct, corked or queued), returns false when over the high watermark or closed
+bool kyros_socket_internal_write(kyros_socket_internal_tcp* tcp, const char* data, uint64_t length, bool end);
+// raw write of bytes inside buffer, queued (or corked) by reference instead of copied, same return as kyros_socket_internal_write
+bool kyros_socket_internal_write_shared(kyros_socket_internal_tcp* tcp, kyros_shared_buffer* buffer, const char* data, uint64_t length);
+// kyros_socket_internal_write_shared on top of tls, the bytes are only shared when the kernel encrypts them
+bool kyros_socket_write_shared(kyros_socket socket, kyros_shared_buffer* buffer, const char* data, uint64_t length);
+// raw file write to the tcp socket (sendfile when possible), same return as kyros_socket_internal_write
+bool kyros_socket_internal_write_file(kyros_socket_internal_tcp* tcp, uv_file fd, uint64_t offset, uint64_t length, bool end);
+// takes the chunks of piece, the bytes read in order
+typedef void (*kyros_socket_file_piece_callback)(kyros_socket_internal_tcp* tcp, kyros_write_queue* piece);
+// read up to KYROS_WRITE_FILE_READ_SIZE bytes of file on the uv threadpool, file_reading is set until callback runs on the loop thread
+// (it does not run if the socket was closed meanwhile, a failed read closes it)
+void kyros_socket_read_file_piece(kyros_socket_internal_tcp* tcp, kyros_write_file* file, kyros_socket_file_piece_callback callback);
+void kyros_socket_close_with_error(kyros_socket_internal_tcp* tcp, kyros_socket_error error);
+// parse a literal ip, returns false if host is a name
+bool kyros_socket_parse_ip(const char* host, uint16_t port, kyros_socket_ip_family family, struct sockaddr_storage* address, socklen_t* length);
+// AF_INET, AF_INET6 or AF_UNSPEC for getaddrinfo hints
+int kyros_socket_family_hint(kyros_socket_ip_family family);
+void kyros_socket_notify_status(kyros_socket_internal_tcp* tcp, kyros_socket_error error);
+void kyros_socket_update_poll(kyros_socket_internal_tcp* tcp);
+// over_high_watermark (and backpressure_paused) once the buffered bytes cross the high watermark, the caller updates the poll
+void kyros_socket_check_high_watermark(kyros_socket_internal_tcp* tcp);
+// resume reading and call ondrain once the buffered bytes are back to the low watermark
+void kyros_socket_check_low_watermark(kyros_socket_internal_tcp* tcp);
+// calls ondata, returns false if the socket was closed
+bool kyros_socket_emit_data(kyros_socket_internal_tcp* tcp, const char* data, uint64_t length);
+// readable side ended (FIN or close_notify)
+void kyros_socket_on_end(kyros_socket_internal_tcp* tcp);
+
+// bytes from a source socket to a destination socket or fd, spliced through a kernel pipe when
+// both ends are plain tcp/unix (or kernel tls), otherwise through ondata and kyros_socket_write
+typedef struct {
+    // NULL once the source ended or was unpiped, what is left is still written
+    kyros_socket_internal_tcp* source;
+    // NULL for kyros_socket_pipe3
+    kyros_socket_internal_tcp* destination;
+    kyros_loop* loop;
+    uv_file fd;
+    // -1 on the userspace path
+    int kernel_pipe[2];
+    // bytes in the kernel pipe
+    uint64_t pending;
+    // userspace path to a fd, what the fd did not take yet
+    kyros_write_queue backlog;
+    // fd destinations that can be polled (not regular files)
+    uv_poll_t fd_poll;
+    bool has_fd_poll;
+    bool end;
+    bool source_ended;
+} kyros_socket_pipe_internal;
+
+// installed as the handler of every socket in a pipe, forwards to the user handler what the pipes don't take
+typedef struct {
+    kyros_socket_handler handler;
+    kyros_socket_handler* original;
+    // pipe this socket feeds
+    kyros_socket_pipe_internal* outgoing;
+    // pipe writing to this socket
+    kyros_socket_pipe_internal* incoming;
+} kyros_socket_pipe_link;
+
+// pipe.c, called by the poll callback of sockets with pipe_splice / pipe_waiting
+void kyros_socket_pipe_on_readable(kyros_socket_internal_tcp* source);
+void kyros_socket_pipe_on_writable(kyros_socket_internal_tcp* destination);
+
+// udp.c, kyros_socket_connect / kyros_socket_listen with host_port.use_udp (or a KYROS_SOCKET_FD_TYPE_UDP fd)
+kyros_socket kyros_udp_connect(kyros_loop* loop, kyros_socket_source source, kyros_socket_handler* handler);
+// returns a socket with tagged_ptr 0 if it could not be bound
+kyros_socket kyros_udp_bind(kyros_loop* loop, kyros_socket_source source, kyros_socket_handler* handler);
+bool kyros_udp_send(kyros_socket_internal_udp* udp, const char* data, uint32_t length, const struct sockaddr* peer);
+// sends what is batched, returns false if the kernel did not take all of it
+bool kyros_udp_flush(kyros_socket_internal_udp* udp);
+// one sendmmsg per socket in udp_sends
+void kyros_udp_flush_sends(kyros_loop_internal* internal);
+void kyros_udp_update_poll(kyros_socket_internal_udp* udp);
+void kyros_udp_close(kyros_socket_internal_udp* udp);
+uint64_t kyros_udp_buffer_size(kyros_socket_internal_udp* udp);
+
+// tls.c
+void kyros_tls_init(kyros_socket_internal_tls* tls, SSL_CTX* ctx, bool is_client);
+// sets SNI (only for names) and resumes the last session of host:port if the ctx has a client cache
+void kyros_tls_set_peer(kyros_socket_internal_tls* tls, const char* host, uint16_t port, bool is_name);
+// start the handshake once the tcp connection is open
+void kyros_tls_start(kyros_socket_internal_tls* tls);
+void kyros_tls_on_data(kyros_socket_internal_tls* tls, const char* data, uint64_t length);
+// kernel tls records (application data, alerts, handshake messages)
+void kyros_tls_on_record(kyros_socket_internal_tls* tls, uint8_t type, const char* data, uint64_t length);
+bool kyros_tls_write(kyros_socket_internal_tls* tls, const char* data, uint64_t length, bool end);
+bool kyros_tls_write_file(kyros_socket_internal_tls* tls, uv_file fd, uint64_t offset, uint64_t length, bool end);
+bool kyros_tls_write_shared(kyros_socket_internal_tls* tls, kyros_shared_buffer* buffer, const char* data, uint64_t length);
+// encrypt more of the plaintext queue, called when the tcp socket is writable
+void kyros_tls_on_writable(kyros_socket_internal_tls* tls);
+// true if the plaintext queue is waiting for the socket to be writable (not for the handshake)
+bool kyros_tls_has_pending_writes(kyros_socket_internal_tls* tls);
+uint64_t kyros_tls_buffer_size(kyros_socket_internal_tls* tls);
+void kyros_tls_free(kyros_socket_internal_tls* tls);
+// NULL if the SSL is not driven by a kyros socket
+kyros_socket_internal_tls* kyros_tls_from_ssl(const SSL* ssl);
+
+// ktls.c, Linux kernel tls (only with BoringSSL, it is the one exposing the record keys and sequences)
+// installs the keylog callback on ctx if it has none, TLS 1.3 keys are derived from the traffic secrets
+void kyros_ktls_prepare_ctx(SSL_CTX* ctx);
+// after the handshake, sets ktls_tx/ktls_rx if the kernel took the keys, false if nothing was offloaded
+bool kyros_ktls_enable(kyros_socket_internal_tls* tls);
+// recvmsg on a ktls_rx socket, record_type is the TLS content type of the record read
+int64_t kyros_ktls_recv(uv_os_sock_t fd, char* buffer, uint64_t length, uint8_t* record_type);
+// close_notify as a kernel tls alert record, before the write shutdown
+void kyros_ktls_send_close_notify(uv_os_sock_t fd);
+
+// 64 bytes, key is the session id (server) or a hash of host:port (client)
+typedef struct {
+    uint64_t hash;
+    // absolute, in seconds
+    uint64_t expires;
+    SSL_SESSION* session;
+    uint8_t key_length;
+    uint8_t key[SSL_MAX_SSL_SESSION_ID_LENGTH];
+} kyros_tls_cache_entry;
+
+// open addressing table, readers of different shards never touch the same lock
+typedef struct {
+    uv_rwlock_t lock;
+    kyros_tls_cache_entry* entries;
+    uint32_t mask;
+    _Atomic(uint64_t) hits;
+    _Atomic(uint64_t) misses;
+    _Atomic(uint64_t) stored;
+    _Atomic(uint64_t) evicted;
+    char _padding[KYROS_CACHE_LINE];
+} kyros_tls_cache_shard;
+
+typedef struct {
+    uint8_t name[16];
+    uint8_t aes_key[32];
+    uint8_t hmac_key[32];
+} kyros_tls_ticket_key;
+
+// immutable once published, replaced as a whole on rotation
+typedef struct {
+    kyros_tls_ticket_key current;
+    kyros_tls_ticket_key previous;
+} kyros_tls_ticket_keys;
+
+struct kyros_tls_session_cache {
+    kyros_tls_cache_shard shards[KYROS_TLS_CACHE_SHARDS];
+    uint32_t session_timeout;
+    uint32_t ticket_key_rotation;
+    // readers load it without locking, the replaced keys are freed one rotation later
+    _Atomic(kyros_tls_ticket_keys*) ticket_keys;
+    kyros_tls_ticket_keys* retired_ticket_keys;
+    uv_mutex_t rotation_lock;
+    _Atomic(uint64_t) rotations;
+    kyros_timer* rotation_timer;
+};
+
+// tls_cache.c
+void kyros_tls_session_cache_prepare_client(SSL* ssl, const char* host, uint16_t port);
+
+// immutable answer shared by the cache and the lookups using it, the addresses have port 0
+typedef struct {
+    _Atomic(uint32_t) ref_count;
+    uint32_t count;
+    struct sockaddr_storage addresses[];
+} kyros_dns_record;
+
+// a lookup waiting for a resolver thread, completed in the thread of its loop with kyros_loop_atomic_defer
+typedef struct kyros_dns_waiter {
+    struct kyros_dns_waiter* next;
+    kyros_loop* loop;
+    // record is a new reference owned by the callback, NULL when error (a negative libuv error) is set
+    void (*callback)(struct kyros_dns_waiter* waiter, kyros_dns_record* record, int32_t error);
+    kyros_dns_record* record;
+    int32_t error;
+} kyros_dns_waiter;
+
+// one host name, the table holds a reference and so does a resolution in flight (ref_count is under the shard lock)
+typedef struct kyros_dns_entry {
+    // resolver queue
+    struct kyros_dns_entry* next_job;
+    uint64_t hash;
+    // NULL before the first answer and after a failure
+    kyros_dns_record* record;
+    int32_t error;
+    uint32_t ref_count;
+    // in ms (uv_hrtime), the answer (or the failure) is used until then
+    uint64_t expires;
+    // in ms, the answer is still used after expires while a refresh runs
+    uint64_t stale_until;
+    kyros_dns_waiter* waiters;
+    bool resolving : 1;
+    bool pinned : 1; // from the hosts file, never expires nor is evicted
+    uint8_t host_length;
+    // lowercase
+    char host[];
+} kyros_dns_entry;
+
+// open addressing table of entry pointers
+typedef struct {
+    uv_mutex_t lock;
+    kyros_dns_entry** entries;
+    uint32_t mask;
+    char _padding[KYROS_CACHE_LINE];
+} kyros_dns_shard;
+
+// the process cache, every field after the shards is set once by kyros_dns_configure
+typedef struct {
+    kyros_dns_shard shards[KYROS_DNS_CACHE_SHARDS];
+    // entries waiting for a resolver thread
+    uv_mutex_t queue_lock;
+    uv_cond_t queue_ready;
+    kyros_dns_entry* queue_head;
+    kyros_dns_entry* queue_tail;
+    uint32_t thread_count;
+    uint32_t idle_threads;
+    int32_t (*resolver)(const char* host, struct sockaddr_storage* addresses, uint32_t capacity, uint32_t* ttl, void* ctx);
+    void* resolver_ctx;
+    uint32_t ttl;
+    uint32_t negative_ttl;
+    uint32_t stale_ttl;
+    _Atomic(uint64_t) hits;
+    _Atomic(uint64_t) stale_hits;
+    _Atomic(uint64_t) negative_hits;
+    _Atomic(uint64_t) misses;
+    _Atomic(uint64_t) resolutions;
+    _Atomic(uint64_t) evicted;
+} kyros_dns_cache;
+
+// dns.c, true on a hit with *record (a new reference) or *error set (a remembered failure or a bad host name),
+// false once waiter is queued (waiter->loop is kept alive until its callback)
+bool kyros_dns_resolve(const char* host, kyros_dns_waiter* waiter, kyros_dns_record** record, int32_t* error);
+void kyros_dns_record_unref(kyros_dns_record* record);
+// copy the addresses of family with port set, returns how many
+uint32_t kyros_dns_record_addresses(kyros_dns_record* record, kyros_socket_ip_family family, uint16_t port, struct sockaddr_storage* addresses, uint32_t capacity);
+
+// socket.c, fd of a listener (server_group.c attaches the steering program to it)
+uv_os_sock_t kyros_socket_listener_fd(kyros_socket socket);
+// socket.c, an open tcp/tls socket with nothing queued and nothing (not even a FIN) waiting to be read
+bool kyros_socket_internal_is_reusable(kyros_socket_internal_tcp* tcp);
+
+typedef enum {
+    KYROS_SERVER_GROUP_CREATED = 0,
+    KYROS_SERVER_GROUP_STARTING = 1,
+    KYROS_SERVER_GROUP_RUNNING = 2,
+    // a loop could not listen, the others close their listener without running
+    KYROS_SERVER_GROUP_ABORTED = 3,
+    KYROS_SERVER_GROUP_JOINED = 4,
+} kyros_server_group_state;
+
+// one loop thread, only its own thread touches listener and stop_timer
+typedef struct {
+    kyros_server_group* group;
+    kyros_loop* loop;
+    kyros_socket listener;
+    // handlers are not shared between threads, their ref_count is not atomic
+    kyros_socket_handler handler;
+    kyros_timer* stop_timer;
+    uv_thread_t thread;
+    uint32_t index;
+    int32_t cpu;
+    // rebalancing, the open sockets of this loop (each one ref'd) and the counters of the last check
+    kyros_socket* sockets;
+    uint32_t socket_count;
+    uint32_t socket_capacity;
+    kyros_timer* rebalance_timer;
+    uint64_t last_iterations;
+    uint64_t last_busy_time;
+    uint32_t periods_over;
+    // average iteration latency in ns of the last check, read by the other loops to pick a target
+    _Atomic(uint64_t) latency;
+} kyros_server_group_worker;
+
+struct kyros_server_group {
+    kyros_socket_source source;
+    kryos_socket_options options;
+    kyros_server_group_options group_options;
+    // the user handler, the worker copies wrap onstatus and onmigrate when rebalancing
+    kyros_socket_handler handler;
+    // workers listen one at a time in index order, so reuseport socket i is the listener of loop i (steering)
+    uv_mutex_t lock;
+    uv_cond_t cond;
+    uint32_t listened;
+    bool failed;
+    kyros_server_group_state state;
+    bool stopping;
+    uint32_t loop_count;
+    kyros_server_group_worker workers[];
+};
+
+// a checkout of a pool, queued while its endpoint is at max_per_host
+typedef struct kyros_socket_pool_request {
+    struct kyros_socket_pool_request* next;
+    kyros_socket_handler* handler;
+    kyros_socket_pool_callback callback;
+    void* ctx;
+    bool use_happy_eyeballs;
+} kyros_socket_pool_request;
+
+typedef struct kyros_socket_pool_connection kyros_socket_pool_connection;
+
+// host, port, family and tls context of the connections of a pool
+typedef struct kyros_socket_pool_endpoint {
+    // hash chain
+    struct kyros_socket_pool_endpoint* next;
+    uint64_t hash;
+    SSL_CTX* tls;
+    uint16_t port;
+    kyros_socket_ip_family family;
+    // connecting, checked out and idle connections, plus checkouts asking another pool for one
+    uint32_t total;
+    uint32_t idle_count;
+    // most recently released first
+    kyros_socket_pool_connection* idle;
+    kyros_socket_pool_request* waiters_head;
+    kyros_socket_pool_request* waiters_tail;
+    uint32_t host_length;
+    char host[];
+} kyros_socket_pool_endpoint;
+
+typedef enum {
+    KYROS_SOCKET_POOL_CONNECTING = 0,
+    KYROS_SOCKET_POOL_IN_USE = 1,
+    KYROS_SOCKET_POOL_IDLE = 2,
+    // given to the pool of another loop, on its way there with kyros_socket_migrate
+    KYROS_SOCKET_POOL_STOLEN = 3,
+} kyros_socket_pool_connection_state;
+
+// a checkout asking the pool of another loop for an idle connection, the endpoint of the asking pool counts it
+// the answer (a migrated connection or a miss) always comes back to the asking loop, which frees it
+typedef struct kyros_socket_pool_steal {
+    // only touched in the asking loop, pool is NULL once the checkout stopped waiting (timed out or destroyed)
+    kyros_socket_pool* pool;
+    kyros_socket_pool_endpoint* endpoint;
+    kyros_socket_pool_request checkout;
+    kyros_timer* timer;
+    struct kyros_socket_pool_steal* prev;
+    struct kyros_socket_pool_steal* next;
+    // read by the asked loop
+    kyros_loop* loop;
+    struct kyros_socket_pool_slot* slot;
+    // of the slot when it was picked, the owner only answers if its pool still has the slot
+    uint64_t generation;
+    // key of the endpoint, a copy since the asking one can be released while the request is on its way
+    uint64_t hash;
+    SSL_CTX* tls;
+    uint16_t port;
+    kyros_socket_ip_family family;
+    uint32_t host_length;
+    char host[];
+} kyros_socket_pool_steal;
+
+// installed as the handler of every pooled socket, forwards to the checkout handler while it is checked out
+struct kyros_socket_pool_connection {
+    kyros_socket_handler handler;
+    kyros_socket_pool* pool;
+    kyros_socket_pool_endpoint* endpoint;
+    kyros_socket socket;
+    // idle list of the endpoint
+    kyros_socket_pool_connection* prev;
+    kyros_socket_pool_connection* next;
+    // who gets it once open and who has it while checked out (the handler is ref'd then)
+    kyros_socket_pool_request checkout;
+    // while stolen
+    kyros_socket_pool_steal* steal;
+    kyros_socket_pool_connection_state state;
+    // idle connection closed by the pool itself (evicted or destroyed), any other close of an idle one counts as unhealthy
+    bool closing;
+};
+
+// one pool of a group, written by the thread of its loop and read by the other pools without locks
+typedef struct kyros_socket_pool_slot {
+    // odd while a pool has the slot
+    _Atomic(uint64_t) generation;
+    // set last (release), the loop and io engine are valid once it is
+    _Atomic(kyros_socket_pool*) pool;
+    _Atomic(kyros_loop*) loop;
+    _Atomic(uint32_t) io_engine;
+    // idle connections by endpoint hash, only a hint, a steal can still miss
+    _Atomic(uint32_t) idle[KYROS_SOCKET_POOL_STEAL_BUCKETS];
+    char _padding[KYROS_CACHE_LINE];
+} kyros_socket_pool_slot;
+
+struct kyros_socket_pool_group {
+    kyros_socket_pool_slot slots[KYROS_SOCKET_POOL_GROUP_SIZE];
+};
+
+// per loop, only its thread touches it
+struct kyros_socket_pool {
+    kyros_loop* loop;
+    kyros_socket_pool_options options;
+    // NULL without a group
+    kyros_socket_pool_slot* slot;
+    kyros_socket_pool_endpoint** endpoints;
+    uint32_t endpoint_mask;
+    uint32_t endpoint_count;
+    // a destroyed pool is freed once it has no connection, steals are given up by kyros_socket_pool_destroy
+    uint32_t connections;
+    // checkouts waiting for the answer of another loop
+    kyros_socket_pool_steal* steals;
+    uint32_t idle_count;
+    bool destroyed;
+    kyros_socket_pool_stats stats;
+};
+
+// QUIC variable length integers (RFC 9000 16), 1, 2, 4 or 8 bytes with the length in the 2 high bits
+#define KYROS_QUIC_VARINT_MAX 4611686018427387903ULL
+
+static inline uint32_t kyros_quic_varint_length(uint64_t value)
+{
+    return value < 64 ? 1 : value < 16384 ? 2 : value < 1073741824 ? 4 : 8;
+}
+
+static inline uint8_t* kyros_quic_varint_write(uint8_t* out, uint64_t value)
+{
+    auto length = kyros_quic_varint_length(value);
+    for (uint32_t i = 0; i < length; i++) {
+        out[i] = (uint8_t)(value >> ((length - 1 - i) * 8));
+    }
+    // 0, 1, 2 or 3 for 1, 2, 4 and 8 bytes
+    out[0] |= (uint8_t)((length == 8 ? 3 : length >> 1) << 6);
+    return out + length;
+}
+
+/// @brief bytes read, 0 if data ends before the integer
+static inline uint32_t kyros_quic_varint_read(const uint8_t* data, const uint8_t* end, uint64_t* value)
+{
+    if (data >= end) {
+        return 0;
+    }
+    uint32_t length = 1u << (data[0] >> 6);
+    if ((uint64_t)(end - data) < length) {
+        return 0;
+    }
+    uint64_t result = data[0] & 0x3f;
+    for (uint32_t i = 1; i < length; i++) {
+        result = (result << 8) | data[i];
+    }
+    *value = result;
+    return length;
+}
+
+// quic_packet.c, packet protection (RFC 9001 5), the AEAD and header protection keys of one direction
+typedef struct kyros_quic_keys kyros_quic_keys;
+
+#define KYROS_QUIC_TAG_LENGTH 16
+#define KYROS_QUIC_MAX_CID_LENGTH 20
+
+// transport parameters (RFC 9000 18.2), the lengths are 0 when the parameter is absent
+typedef struct {
+    uint64_t max_idle_timeout; // ms
+    uint64_t max_udp_payload_size;
+    uint64_t initial_max_data;
+    uint64_t initial_max_stream_data_bidi_local;
+    uint64_t initial_max_stream_data_bidi_remote;
+    uint64_t initial_max_stream_data_uni;
+    uint64_t initial_max_streams_bidi;
+    uint64_t initial_max_streams_uni;
+    uint64_t ack_delay_exponent;
+    uint64_t max_ack_delay; // ms
+    uint64_t active_connection_id_limit;
+    uint8_t original_dcid[KYROS_QUIC_MAX_CID_LENGTH];
+    uint8_t initial_scid[KYROS_QUIC_MAX_CID_LENGTH];
+    uint8_t stateless_reset_token[16];
+    uint8_t original_dcid_length;
+    uint8_t initial_scid_length;
+    bool has_original_dcid : 1;
+    bool has_initial_scid : 1;
+    bool has_retry_scid : 1;
+    bool has_stateless_reset_token : 1;
+    bool has_preferred_address : 1;
+    bool disable_active_migration : 1;
+} kyros_quic_transport_params;
+
+// keys of a TLS 1.3 traffic secret given by BoringSSL, NULL if the cipher is not one QUIC uses
+kyros_quic_keys* kyros_quic_keys_create(const SSL_CIPHER* cipher, const uint8_t* secret, uint64_t secret_length);
+// Initial keys of one side, derived from the Destination Connection ID of the first Initial packet of the client
+kyros_quic_keys* kyros_quic_keys_initial(const uint8_t* cid, uint8_t cid_length, bool server);
+// keys of the next key phase ("quic ku"), the header protection key stays the same
+kyros_quic_keys* kyros_quic_keys_update(const kyros_quic_keys* keys);
+void kyros_quic_keys_free(kyros_quic_keys* keys);
+// encrypt in place the payload_length bytes after header_length (KYROS_QUIC_TAG_LENGTH more are written) and protect the header
+void kyros_quic_seal(kyros_quic_keys* keys, uint8_t* packet, uint32_t pn_offset, uint32_t header_length, uint32_t payload_length, uint64_t packet_number);
+// remove the header protection in place, returns the packet number length (0 if the packet is too short to be sampled)
+uint32_t kyros_quic_unprotect_header(kyros_quic_keys* keys, uint8_t* packet, uint32_t pn_offset, uint32_t packet_length);
+// decrypt in place the bytes after header_length, false if they are not authentic
+bool kyros_quic_open(kyros_quic_keys* keys, uint8_t* packet, uint32_t header_length, uint32_t packet_length, uint64_t packet_number);
+// full packet number from the truncated one (RFC 9000 A.3)
+uint64_t kyros_quic_decode_packet_number(uint64_t largest, uint64_t truncated, uint32_t length);
+// first 16 bytes of HMAC-SHA256(secret, cid), the stateless reset token of an id we issued
+void kyros_quic_reset_token(const uint8_t* secret, const uint8_t* cid, uint8_t cid_length, uint8_t* token);
+// returns the length written (out needs 256 bytes)
+uint32_t kyros_quic_transport_params_encode(const kyros_quic_transport_params* params, bool server, uint8_t* out);
+// defaults for what is absent, false on a malformed or forbidden parameter (TRANSPORT_PARAMETER_ERROR)
+bool kyros_quic_transport_params_decode(const uint8_t* data, uint64_t length, bool from_server, kyros_quic_transport_params* params);
+
+// sorted and disjoint [start, end) ranges of packet numbers or stream offsets
+typedef struct {
+    uint64_t (*items)[2];
+    uint32_t count;
+    uint32_t capacity;
+} kyros_quic_ranges;
+
+// quic_recovery.c
+void kyros_quic_ranges_add(kyros_quic_ranges* ranges, uint64_t start, uint64_t end);
+void kyros_quic_ranges_remove(kyros_quic_ranges* ranges, uint64_t start, uint64_t end);
+bool kyros_quic_ranges_contains(const kyros_quic_ranges* ranges, uint64_t value);
+void kyros_quic_ranges_free(kyros_quic_ranges* ranges);
+
+typedef enum {
+    KYROS_QUIC_SPACE_INITIAL = 0,
+    KYROS_QUIC_SPACE_HANDSHAKE = 1,
+    KYROS_QUIC_SPACE_APPLICATION = 2,
+    KYROS_QUIC_SPACES = 3,
+} kyros_quic_space_id;
+
+// what a sent packet carried that is sent again if the packet is lost
+typedef enum {
+    KYROS_QUIC_SENT_CRYPTO = 0,
+    KYROS_QUIC_SENT_STREAM = 1,
+    KYROS_QUIC_SENT_RESET_STREAM = 2,
+    KYROS_QUIC_SENT_STOP_SENDING = 3,
+    KYROS_QUIC_SENT_MAX_DATA = 4,
+    KYROS_QUIC_SENT_MAX_STREAM_DATA = 5,
+    KYROS_QUIC_SENT_MAX_STREAMS_BIDI = 6,
+    KYROS_QUIC_SENT_MAX_STREAMS_UNI = 7,
+    KYROS_QUIC_SENT_NEW_CONNECTION_ID = 8,
+    KYROS_QUIC_SENT_RETIRE_CONNECTION_ID = 9,
+    KYROS_QUIC_SENT_HANDSHAKE_DONE = 10,
+} kyros_quic_sent_kind;
+
+// 24 bytes
+typedef struct {
+    uint64_t id; // stream id or connection id sequence
+    uint64_t offset;
+    uint32_t length;
+    uint8_t kind;
+    bool fin;
+} kyros_quic_sent_frame;
+
+typedef struct {
+    uint64_t time_sent; // µs
+    uint16_t size;
+    uint8_t frame_count;
+    bool ack_eliciting : 1;
+    bool in_flight : 1;
+    bool settled : 1; // acknowledged or declared lost
+    kyros_quic_sent_frame frames[KYROS_QUIC_PACKET_FRAMES];
+} kyros_quic_sent_packet;
+
+// bytes kept until the peer acknowledges them, the ones declared lost are sent again before new ones
+typedef struct {
+    char* data;
+    uint64_t capacity;
+    uint64_t origin; // offset of data[0]
+    uint64_t base; // everything before it is acknowledged
+    uint64_t end; // offset after the last byte buffered
+    uint64_t next; // first offset never sent
+    kyros_quic_ranges acked; // above base
+    kyros_quic_ranges lost; // below next
+} kyros_quic_send_buffer;
+
+// received bytes put back in order, data[0] is the first offset not delivered yet
+typedef struct {
+    char* data;
+    uint64_t capacity;
+    uint64_t base;
+    kyros_quic_ranges ranges; // received at or above base
+} kyros_quic_recv_buffer;
+
+typedef struct {
+    kyros_quic_keys* read_keys;
+    kyros_quic_keys* write_keys;
+    kyros_quic_send_buffer crypto_send;
+    kyros_quic_recv_buffer crypto_recv;
+    // packet numbers received, acknowledged with the next ACK
+    kyros_quic_ranges received;
+    uint64_t largest_received_time; // µs
+    uint64_t next_packet_number;
+    uint64_t largest_acked; // UINT64_MAX until an ACK is received
+    // packets not settled from sent_first on, a ring of sent_capacity (a power of 2)
+    kyros_quic_sent_packet* sent;
+    uint64_t sent_first;
+    uint32_t sent_head;
+    uint32_t sent_count;
+    uint32_t sent_capacity;
+    uint32_t ack_eliciting_received; // since the last ACK we sent
+    uint64_t loss_time; // µs, 0 if no packet waits for the time threshold
+    uint64_t last_ack_eliciting_time;
+    uint32_t ack_eliciting_in_flight;
+    bool ack_pending : 1;
+    bool probe : 1; // the PTO fired, the next packet of the space is ack-eliciting (a PING if there is nothing else)
+    bool discarded : 1; // keys dropped, nothing is sent or received in it anymore
+} kyros_quic_space;
+
+typedef struct kyros_quic_stream kyros_quic_stream;
+
+// quic.c, a stream is freed once both of its sides are done (or the connection is)
+struct kyros_quic_stream {
+    uint64_t id;
+    kyros_quic_send_buffer send;
+    kyros_quic_recv_buffer recv;
+    uint64_t send_max; // MAX_STREAM_DATA of the peer
+    uint64_t recv_max; // what we advertised
+    uint64_t recv_highest; // counted by the connection flow control
+    uint64_t final_size; // of the peer, UINT64_MAX until known
+    uint64_t reset_code;
+    uint64_t stop_code;
+    void* ctx; // kyros_quic_stream_set_ctx
+    // connection send list
+    kyros_quic_stream* send_prev;
+    kyros_quic_stream* send_next;
+    bool has_send : 1; // bidirectional or opened by us
+    bool has_recv : 1; // bidirectional or opened by the peer
+    bool fin : 1; // our side ends after what is buffered
+    bool fin_sent : 1;
+    bool fin_acked : 1;
+    bool reset : 1; // our side was reset, nothing else is sent
+    bool reset_pending : 1; // RESET_STREAM to send
+    bool reset_acked : 1;
+    bool stop_pending : 1; // STOP_SENDING to send
+    bool stopped : 1; // we asked the peer to stop, what it sends is dropped
+    bool max_data_pending : 1; // MAX_STREAM_DATA to send
+    bool recv_done : 1; // fin delivered or reset received
+    bool queued : 1; // in the send list
+    bool drain_due : 1; // kyros_quic_stream_write returned false
+};
+
+// connection id issued by the peer
+typedef struct {
+    uint64_t sequence;
+    uint8_t id[KYROS_QUIC_MAX_CID_LENGTH];
+    uint8_t reset_token[16];
+    uint8_t length;
+    bool has_reset_token : 1;
+    bool retired : 1; // kept until the RETIRE_CONNECTION_ID is acknowledged
+    bool retire_pending : 1; // RETIRE_CONNECTION_ID to send
+} kyros_quic_peer_cid;
+
+// connection id we issued, routed to the connection by the endpoint
+typedef struct {
+    uint64_t sequence;
+    uint8_t id[KYROS_QUIC_CID_LENGTH];
+    bool active : 1;
+    bool pending : 1; // NEW_CONNECTION_ID to send
+} kyros_quic_local_cid;
+
+typedef enum {
+    KYROS_QUIC_STATE_HANDSHAKE = 0,
+    KYROS_QUIC_STATE_OPEN = 1,
+    KYROS_QUIC_STATE_CLOSING = 2, // CONNECTION_CLOSE sent, sent again for what is received
+    KYROS_QUIC_STATE_DRAINING = 3, // nothing is sent, freed by the timer
+} kyros_quic_state;
+
+typedef struct kyros_quic_endpoint kyros_quic_endpoint;
+
+struct kyros_quic_connection {
+    kyros_quic_endpoint* endpoint;
+    SSL* ssl;
+    kyros_quic_handler handler;
+    kyros_quic_options options;
+    kyros_quic_space spaces[KYROS_QUIC_SPACES];
+    // 1-RTT read keys of the previous phase (reordered packets) and of the next one (tried when the key phase bit flips)
+    kyros_quic_keys* read_keys_previous;
+    kyros_quic_keys* read_keys_next;
+    uint64_t key_phase_start; // first packet number of the current read phase
+    kyros_quic_local_cid cids[KYROS_QUIC_ACTIVE_CIDS];
+    uint64_t next_cid_sequence;
+    kyros_quic_peer_cid peer_cids[KYROS_QUIC_PEER_CIDS];
+    uint32_t peer_cid_count;
+    uint32_t peer_cid_current; // index in peer_cids
+    uint64_t peer_retire_prior_to;
+    // Destination Connection ID of the first Initial of the client
+    uint8_t original_dcid[KYROS_QUIC_MAX_CID_LENGTH];
+    uint8_t original_dcid_length;
+    struct sockaddr_storage peer;
+    socklen_t peer_length;
+    // anti-amplification, a server sends at most 3 times what it received from an address it did not validate yet
+    uint64_t bytes_received;
+    uint64_t bytes_sent;
+    uint8_t path_challenge[8];
+    uint8_t path_response[8];
+    // streams by id, open addressing with backward shift deletion
+    kyros_quic_stream** streams;
+    uint32_t stream_count;
+    uint32_t stream_mask;
+    kyros_quic_stream* send_head;
+    kyros_quic_stream* send_tail;
+    // bidirectional [0] and unidirectional [1] streams opened by us and by the peer, and the limits of each other
+    uint64_t local_streams[2];
+    uint64_t local_max_streams[2];
+    uint64_t peer_streams[2];
+    uint64_t peer_max_streams[2]; // advertised, raised as the peer streams close
+    uint64_t peer_streams_closed[2];
+    // flow control of the whole connection
+    uint64_t send_max_data;
+    uint64_t send_data; // new stream bytes sent
+    uint64_t recv_max_data;
+    uint64_t recv_data; // highest offsets received, summed
+    uint64_t recv_consumed;
+    kyros_quic_transport_params peer_params;
+    // recovery (RFC 9002), in µs
+    uint64_t latest_rtt;
+    uint64_t smoothed_rtt;
+    uint64_t rtt_variance;
+    uint64_t min_rtt;
+    uint32_t pto_count;
+    uint32_t probes; // ack-eliciting packets the PTO lets out regardless of the congestion window
+    uint64_t bytes_in_flight;
+    uint64_t congestion_window;
+    uint64_t ssthresh;
+    uint64_t recovery_start; // µs, packets sent before it dont reduce the window again
+    // CUBIC (RFC 9438), windows in bytes
+    uint64_t cubic_epoch; // µs, start of the current congestion avoidance epoch, 0 until the first one
+    uint64_t cubic_w_max;
+    uint64_t cubic_w_last_max;
+    uint64_t cubic_w_est;
+    uint64_t cubic_k; // µs
+    // token bucket of the pacer
+    uint64_t pacing_tokens;
+    uint64_t pacing_time; // µs of the last refill
+    uint64_t packets_sent;
+    uint64_t packets_received;
+    uint64_t packets_lost;
+    // a single wheel entry for every deadline (µs, 0 when unset)
+    kyros_timer_entry timer;
+    uint64_t loss_deadline;
+    uint64_t ack_deadline;
+    uint64_t idle_deadline;
+    uint64_t pacing_deadline;
+    uint64_t close_deadline;
+    uint64_t idle_timeout; // µs, the lowest of both sides
+    // CONNECTION_CLOSE we send (again for every packet received while closing)
+    uint64_t close_code;
+    uint32_t close_reason_length;
+    char close_reason[256];
+    uint8_t alert; // TLS alert given by send_alert
+    kyros_quic_connection* send_next; // loop quic_sends list
+    kyros_quic_connection* prev; // connections of the endpoint
+    kyros_quic_connection* next;
+    kyros_quic_state state;
+    bool is_client : 1;
+    bool opened : 1; // onopen was called
+    bool handshake_complete : 1;
+    bool handshake_confirmed : 1;
+    bool handshake_done_pending : 1; // HANDSHAKE_DONE to send (server)
+    bool address_validated : 1;
+    bool close_application : 1;
+    bool close_pending : 1; // a packet with CONNECTION_CLOSE to send
+    bool onclose_called : 1;
+    bool send_queued : 1; // in the loop quic_sends list
+    bool key_phase : 1;
+    bool max_data_pending : 1;
+    bool max_streams_pending_bidi : 1;
+    bool max_streams_pending_uni : 1;
+    bool challenge_pending : 1; // PATH_CHALLENGE to send to a new peer address
+    bool response_pending : 1; // PATH_RESPONSE to send
+    bool peer_cid_set : 1; // client, the Source Connection ID of the server replaced the random one
+    bool eliciting_since_receive : 1; // an ack-eliciting packet was sent since the last one received (idle timer)
+};
+
+// connection id -> connection, ids are KYROS_QUIC_CID_LENGTH long except the original ones of clients
+typedef struct {
+    kyros_quic_connection* connection;
+    uint8_t length;
+    uint8_t id[KYROS_QUIC_MAX_CID_LENGTH];
+} kyros_quic_cid_entry;
+
+// the udp socket of a listener (or of a single client connection) and the ids of its connections
+struct kyros_quic_endpoint {
+    kyros_socket_handler socket_handler;
+    kyros_loop* loop;
+    kyros_socket socket;
+    SSL_CTX* tls;
+    kyros_quic_options options;
+    kyros_quic_handler handler;
+    kyros_quic_cid_entry* cids;
+    uint32_t cid_count;
+    uint32_t cid_mask;
+    kyros_quic_connection* connections;
+    // the listener (until it is closed) and every connection
+    uint32_t ref_count;
+    // stateless reset tokens are derived from it
+    uint8_t secret[32];
+    bool is_client : 1;
+    bool closed : 1;
+    bool blocked : 1; // the udp socket refused a datagram, its ondrain sends again
+};
+
+// quic_recovery.c, congestion control and loss detection
+void kyros_quic_recovery_init(kyros_quic_connection* connection);
+void kyros_quic_on_rtt_sample(kyros_quic_connection* connection, uint64_t latest_rtt, uint64_t ack_delay);
+// probe timeout without backoff, with max_ack_delay for the application space
+uint64_t kyros_quic_pto_duration(kyros_quic_connection* connection, kyros_quic_space_id space);
+void kyros_quic_on_packet_acked(kyros_quic_connection* connection, kyros_quic_sent_packet* packet, uint64_t now);
+// a congestion event for lost packets sent at or before largest_time_sent
+void kyros_quic_on_congestion(kyros_quic_connection* connection, uint64_t largest_time_sent, uint64_t now, bool persistent);
+// true if a full datagram can go now, otherwise *next_send is when it can
+bool kyros_quic_pacer_allows(kyros_quic_connection* connection, uint64_t now, uint64_t* next_send);
+void kyros_quic_pacer_on_sent(kyros_quic_connection* connection, uint64_t bytes);
+
+// quic.c
+void kyros_quic_flush_sends(kyros_loop_internal* internal);
+
+// http_parser.c, heads are parsed in place, data must have KYROS_RECV_BUFFER_PADDING readable bytes after length
+#define KYROS_HTTP_PARSE_INCOMPLETE 0
+#define KYROS_HTTP_PARSE_ERROR -1 // 400
+#define KYROS_HTTP_PARSE_TOO_LARGE -2 // 431 for heads, 413 for chunked bodies
+
+// how the body of a request is delimited
+typedef struct {
+    int64_t content_length; // -1 if there is no Content-Length
+    bool chunked;
+} kyros_http_framing;
+
+// returns the head length (request line + headers + empty line) or one of KYROS_HTTP_PARSE_*
+int64_t kyros_http_parse_request(const char* data, uint64_t length, kyros_http_request* request, kyros_http_header* headers, uint32_t max_headers, kyros_http_framing* framing);
+// how far kyros_http_chunked_scan got in a body that is not all there, zeroed for a new body
+typedef struct {
+    uint64_t offset; // whole chunks (and trailer lines) before it were checked
+    uint64_t body_length; // decoded size of those chunks
+    bool last_chunk; // only the trailers are left
+} kyros_http_chunked_state;
+
+// length of a whole chunked body including the trailers, state->body_length is then the decoded size
+// an incomplete body can be scanned again with more data and the same state, it goes on from where it stopped
+int64_t kyros_http_chunked_scan(const char* data, uint64_t length, uint64_t max_body, kyros_http_chunked_state* state);
+// out must have room for the body_length of kyros_http_chunked_scan
+void kyros_http_chunked_decode(const char* data, uint64_t length, char* out);
+bool kyros_http_header_name_equals(const char* name, uint32_t length, const char* other, uint32_t other_length);
+// comma separated list containing token (lowercase, compared case insensitive)
+bool kyros_http_value_has_token(const char* value, uint32_t length, const char* token, uint32_t token_length);
+// digits only, repeated values must agree with content_length unless it is -1
+bool kyros_http_parse_content_length(const char* value, uint32_t length, int64_t* content_length);
+bool kyros_http_name_is_valid(const char* name, uint32_t length);
+// value needs KYROS_RECV_BUFFER_PADDING readable bytes after length
+bool kyros_http_value_is_valid(const char* value, uint32_t length);
+
+// pseudo headers of a HTTP/2 or HTTP/3 request and its content-length
+typedef struct {
+    const char* method;
+    const char* target;
+    uint32_t method_length;
+    uint32_t target_length;
+    int64_t content_length; // -1 if there is no content-length
+} kyros_http_fields;
+
+// decoded fields (name offset, name length, value offset, value length) into fields and the regular headers, :authority becomes
+// a host header if there is none so headers needs room for count + 1; false if the request is malformed
+bool kyros_http_parse_fields(const char* decoded, uint32_t (*field_offsets)[4], uint32_t count, kyros_http_fields* fields,
+    kyros_http_header* headers, uint32_t* header_count);
+
+// p moved from a copy of length bytes at from to to, pointers outside of it are kept (the "host" name added for :authority)
+static inline const char* kyros_http_rebase(const char* p, const char* from, uint64_t length, const char* to)
+{
+    return p >= from && p < from + length ? to + (p - from) : p;
+}
+
+typedef struct kyros_http_connection kyros_http_connection;
+
+// what a kyros_http_response points to, the first member of kyros_http_connection, kyros_http2_stream and kyros_http3_stream
+struct kyros_http_response {
+    uint8_t version; // 1, 2 or 3
+};
+
+// http.c, one per connection, installed as the socket handler once it is open (or secure)
+struct kyros_http_connection {
+    kyros_http_response response;
+    kyros_socket_handler handler;
+    kyros_http_server* server;
+    kyros_socket socket;
+    // partial request or pipelined requests waiting for the current response, with KYROS_RECV_BUFFER_PADDING
+    char* input;
+    uint64_t input_length;
+    uint64_t input_capacity;
+    // the request at the start of input is waiting for the rest of its body, a read does not parse it again from the start
+    uint64_t body_wait; // head + Content-Length, nothing is parsed until input has that much
+    uint64_t body_head; // head length of a chunked body, 0 if there is none
+    kyros_http_chunked_state body_chunked; // where the scan of that body stopped
+    void (*onabort)(kyros_http_response* response, void* ctx);
+    void* onabort_ctx;
+    bool responding : 1; // onrequest was called, end was not
+    bool status_written : 1;
+    bool headers_ended : 1;
+    bool chunked : 1; // the body is sent with chunked encoding
+    bool has_content_length : 1; // written by the user, the body is sent as it is
+    bool has_connection : 1; // Connection written by the user
+    bool head_request : 1; // Content-Length is sent, the body is not
+    bool bodyless_status : 1; // 1xx, 204 and 304 have neither
+    bool keep_alive : 1;
+    bool http10 : 1;
+    bool in_batch : 1; // requests of one read are being answered, the output is flushed after the last one
+    bool closing : 1; // the last response was sent with end, anything else received is dropped
+    bool closed : 1; // freed once nothing in this file is using it
+    bool resume_scheduled : 1;
+    bool started : 1; // something other than the h2c preface was received
+    bool upgraded : 1; // the socket has another handler, what was read after the request is handed to it
+};
+
+struct kyros_http_server {
+    // handler of the listener and of accepted sockets until they are open, its ref_count also counts the connections
+    kyros_socket_handler handler;
+    kyros_http_server_options options;
+    kyros_loop* loop;
+    kyros_socket listener;
+    // responses of the current batch, sent with one write per connection
+    char* output;
+    uint64_t output_length;
+    uint64_t output_capacity;
+    kyros_http_connection* output_owner;
+    // decoded chunked bodies
+    char* scratch;
+    uint64_t scratch_capacity;
+    // "Date: ...\r\n" refreshed once per second
+    char date[40];
+    uint64_t date_second;
+    // http2 header blocks (and http3 field sections) are decoded here before being copied to their stream
+    char* decoded;
+    uint32_t decoded_capacity;
+    uint32_t field_offsets[KYROS_HTTP2_MAX_FIELDS][4]; // name offset, name length, value offset, value length
+    // kyros_http_server_listen_http3
+    kyros_quic_listener* quic_listener;
+    bool closed;
+};
+
+// http.c
+void kyros_http_server_refresh_date(kyros_http_server* server);
+void kyros_http_server_release(kyros_http_server* server);
+uint32_t kyros_http_format_decimal(char* out, uint64_t value);
+// sends head as it is and gives the socket of a HTTP/1 response to handler (the rest of the input goes to its ondata on the
+// next tick), the connection is released, returns false if the socket closed (handler is not installed)
+bool kyros_http_connection_upgrade(kyros_http_response* response, const char* head, uint64_t length, kyros_socket_handler* handler);
+
+// http_router.c, index of the route slot of a method, unknown methods only match KYROS_HTTP_ROUTER_ANY
+typedef enum {
+    KYROS_HTTP_ROUTER_GET = 0,
+    KYROS_HTTP_ROUTER_HEAD,
+    KYROS_HTTP_ROUTER_POST,
+    KYROS_HTTP_ROUTER_PUT,
+    KYROS_HTTP_ROUTER_DELETE,
+    KYROS_HTTP_ROUTER_PATCH,
+    KYROS_HTTP_ROUTER_OPTIONS,
+    KYROS_HTTP_ROUTER_CONNECT,
+    KYROS_HTTP_ROUTER_TRACE,
+    KYROS_HTTP_ROUTER_ANY,
+    KYROS_HTTP_ROUTER_METHODS,
+} kyros_http_router_method;
+
+typedef struct {
+    kyros_http_route_handler handler;
+    void* ctx;
+    uint32_t names; // first param name in kyros_http_router.names
+    uint32_t name_count;
+} kyros_http_route;
+
+// tree of kyros_http_router_add, compile flattens it and frees it
+typedef struct kyros_http_router_builder kyros_http_router_builder;
+struct kyros_http_router_builder {
+    char* prefix;
+    uint32_t prefix_length;
+    uint32_t child_count;
+    uint32_t child_capacity;
+    kyros_http_router_builder** children; // static, no two start with the same byte
+    kyros_http_router_builder* param;
+    kyros_http_router_builder* wildcard;
+    uint32_t routes[KYROS_HTTP_ROUTER_METHODS]; // route index + 1, 0 if none
+};
+
+// compiled node, the static children of a node are contiguous and first_bytes has the first byte of their prefix at the same index
+typedef struct {
+    uint32_t prefix; // offset in kyros_http_router.strings
+    uint32_t prefix_length;
+    uint32_t children;
+    uint32_t child_count;
+    uint32_t param; // node index, 0 if none (the root is nobody's child)
+    uint32_t wildcard;
+    uint32_t routes; // first of KYROS_HTTP_ROUTER_METHODS slots in kyros_http_router.slots, UINT32_MAX if no route ends here
+} kyros_http_router_node;
+
+struct kyros_http_router {
+    kyros_http_router_builder* builder;
+    kyros_http_route* routes;
+    uint32_t route_count;
+    uint32_t route_capacity;
+    // param names and node prefixes
+    char* strings;
+    uint32_t strings_length;
+    uint32_t strings_capacity;
+    uint32_t (*names)[2]; // offset in strings, length
+    uint32_t name_count;
+    uint32_t name_capacity;
+    kyros_http_route fallback;
+    kyros_http_router_node* nodes;
+    char* first_bytes;
+    uint32_t node_count;
+    uint32_t* slots;
+    bool compiled;
+};
+
+typedef struct kyros_http2_stream kyros_http2_stream;
+
+// http2.c, lives until both sides ended (or a reset) and the user is done with the response
+struct kyros_http2_stream {
+    kyros_http_response response;
+    kyros_http2_connection* connection;
+    uint32_t id;
+    // DATA the peer lets us send, can go negative when SETTINGS_INITIAL_WINDOW_SIZE shrinks
+    int64_t send_window;
+    int64_t recv_window;
+    // request, the decoded header block and the body until dispatch
+    char* head;
+    kyros_http_header* headers;
+    uint32_t header_count;
+    const char* method;
+    const char* target;
+    uint32_t method_length;
+    uint32_t target_length;
+    int64_t content_length; // -1 if there is no content-length
+    char* body;
+    uint64_t body_length;
+    uint64_t body_capacity;
+    // response headers written before the HEADERS frame, name length, value length, lowercase name, value
+    char* fields;
+    uint32_t fields_length;
+    uint32_t fields_capacity;
+    uint16_t status;
+    // DATA waiting for flow control window
+    char* pending;
+    uint64_t pending_offset;
+    uint64_t pending_length;
+    uint64_t pending_capacity;
+    kyros_http2_stream* blocked_next;
+    void (*onabort)(kyros_http_response* response, void* ctx);
+    void* onabort_ctx;
+    bool request_ended : 1; // END_STREAM received
+    bool headers_sent : 1;
+    bool end_sent : 1; // END_STREAM is in the output
+    bool end_pending : 1; // END_STREAM goes with the last pending DATA
+    bool responding : 1; // onrequest was called, end was not
+    bool in_dispatch : 1;
+    bool closed : 1; // out of the stream table
+    bool blocked : 1; // in the blocked list
+    bool head_request : 1;
+    bool has_content_length : 1; // written by the user
+    bool bodyless_status : 1;
+};
+
+struct kyros_http2_connection {
+    kyros_socket_handler handler;
+    kyros_http_server* server;
+    kyros_socket socket;
+    struct lshpack_enc encoder;
+    struct lshpack_dec decoder;
+    // partial frame
+    char* input;
+    uint64_t input_length;
+    uint64_t input_capacity;
+    // frames of every stream, written once per loop iteration
+    char* output;
+    uint64_t output_length;
+    uint64_t output_capacity;
+    kyros_http2_connection* send_next;
+    // header block split in CONTINUATION frames, block_stream is 0 when there is none
+    char* block;
+    uint32_t block_length;
+    uint32_t block_capacity;
+    uint32_t block_stream;
+    bool block_end_stream;
+    kyros_http2_stream* streams[KYROS_HTTP2_STREAM_TABLE];
+    uint32_t stream_count;
+    uint32_t last_stream_id;
+    // streams with DATA waiting for window, in the order they got blocked
+    kyros_http2_stream* blocked_head;
+    kyros_http2_stream* blocked_tail;
+    int64_t send_window;
+    int64_t recv_window;
+    uint32_t peer_initial_window;
+    uint32_t peer_max_frame_size;
+    uint32_t encoder_capacity; // SETTINGS_HEADER_TABLE_SIZE of the peer, at most 4096
+    bool preface_received : 1;
+    bool settings_received : 1;
+    bool send_queued : 1; // in the loop http2_sends list
+    bool ending : 1; // GOAWAY sent, the next write ends the socket
+    bool ended : 1;
+    bool goaway_received : 1; // ended once the last stream closes
+    bool table_size_update : 1; // encoder_capacity shrank, the next header block starts with a size update
+    bool in_batch : 1;
+    bool closed : 1;
+};
+
+// the socket handler becomes the connection, data is what was already received after the handshake (or the h2c preface)
+void kyros_http2_connection_create(kyros_http_server* server, kyros_socket socket, const char* data, uint64_t length);
+// true if data (length < 24 is a prefix) is the client connection preface
+bool kyros_http2_is_preface(const char* data, uint64_t length);
+void kyros_http2_flush_sends(kyros_loop_internal* internal);
+void kyros_http2_write_status(kyros_http2_stream* stream, uint16_t status);
+void kyros_http2_write_header(kyros_http2_stream* stream, const char* name, uint32_t name_length, const char* value, uint32_t value_length);
+bool kyros_http2_write(kyros_http2_stream* stream, const char* data, uint64_t length);
+bool kyros_http2_end(kyros_http2_stream* stream, const char* data, uint64_t length);
+
+// http3_qpack.c, RFC 9204 without a dynamic table
+#define KYROS_QPACK_STATIC_ENTRIES 99
+
+// fields of a field section into server->decoded and server->field_offsets like kyros_http2_decode, returns the count or -1 if
+// it is not valid (references to the dynamic table are not)
+int32_t kyros_qpack_decode(kyros_http_server* server, const uint8_t* data, uint64_t length, uint32_t* size);
+// one field line, static table references where they match, out needs name_length + value_length + 16 bytes
+uint8_t* kyros_qpack_encode_field(uint8_t* out, const char* name, uint32_t name_length, const char* value, uint32_t value_length);
+
+typedef struct kyros_http3_connection kyros_http3_connection;
+typedef struct kyros_http3_stream kyros_http3_stream;
+
+typedef enum {
+    KYROS_HTTP3_STREAM_REQUEST = 0,
+    KYROS_HTTP3_STREAM_UNIDIRECTIONAL = 1, // its type is not received yet
+    KYROS_HTTP3_STREAM_CONTROL = 2,
+    KYROS_HTTP3_STREAM_QPACK = 3, // encoder or decoder stream, nothing is on them without a dynamic table, what comes is dropped
+} kyros_http3_stream_kind;
+
+// http3.c, a stream opened by the peer (the ctx of its quic stream), request ones live until both the request and the response
+// ended (or a reset) and the user is done with the response
+struct kyros_http3_stream {
+    kyros_http_response response;
+    kyros_http3_connection* connection;
+    kyros_http3_stream* prev;
+    kyros_http3_stream* next;
+    uint64_t id;
+    // frame being received, its type and length can be split between packets and wait in header
+    uint64_t frame_type;
+    uint64_t frame_remaining;
+    uint8_t header[16];
+    uint8_t header_length;
+    uint8_t kind;
+    // HEADERS and control frames are gathered whole
+    char* frame;
+    uint64_t frame_length;
+    uint64_t frame_capacity;
+    // request, the decoded field section and the body until dispatch
+    char* head;
+    kyros_http_header* headers;
+    uint32_t header_count;
+    const char* method;
+    const char* target;
+    uint32_t method_length;
+    uint32_t target_length;
+    int64_t content_length; // -1 if there is no content-length
+    char* body;
+    uint64_t body_length;
+    uint64_t body_capacity;
+    // response headers written before the HEADERS frame, name length, value length, lowercase name, value
+    char* fields;
+    uint32_t fields_length;
+    uint32_t fields_capacity;
+    uint16_t status;
+    void (*onabort)(kyros_http_response* response, void* ctx);
+    void* onabort_ctx;
+    bool in_frame : 1; // frame_type and frame_remaining are set
+    bool headers_received : 1;
+    bool trailers_received : 1;
+    bool request_ended : 1; // FIN received
+    bool headers_sent : 1;
+    bool responding : 1; // onrequest was called, end was not
+    bool in_receive : 1; // released after the data being handled
+    bool closed : 1; // out of the connection list, nothing is received for it anymore
+    bool head_request : 1;
+    bool has_content_length : 1; // written by the user
+    bool bodyless_status : 1;
+};
+
+// the ctx of a kyros_quic_connection of the listener once it is open
+struct kyros_http3_connection {
+    kyros_http_server* server;
+    kyros_quic_connection* quic;
+    kyros_http3_stream* streams; // aborted when the connection closes
+    // HEADERS frames are built here before being written to their stream
+    char* output;
+    uint64_t output_capacity;
+    bool control_received : 1;
+    bool encoder_received : 1;
+    bool decoder_received : 1;
+    bool settings_received : 1;
+    bool in_callback : 1;
+    bool closed : 1; // onclose was called, freed once the callback it happened in returns
+};
+
+void kyros_http3_write_status(kyros_http3_stream* stream, uint16_t status);
+void kyros_http3_write_header(kyros_http3_stream* stream, const char* name, uint32_t name_length, const char* value, uint32_t value_length);
+bool kyros_http3_write(kyros_http3_stream* stream, const char* data, uint64_t length);
+bool kyros_http3_end(kyros_http3_stream* stream, const char* data, uint64_t length);
+// quic handler of kyros_http_server_listen_http3, its ctx is the server
+kyros_quic_handler kyros_http3_handler(kyros_http_server* server);
+
+// websocket_parser.c
+#define KYROS_WEBSOCKET_PARSE_INCOMPLETE 0
+#define KYROS_WEBSOCKET_PARSE_ERROR -1
+
+typedef struct {
+    uint64_t payload_length;
+    uint32_t mask; // the 4 key bytes in memory order
+    uint8_t header_length;
+    uint8_t opcode;
+    uint8_t rsv;
+    bool fin;
+    bool masked;
+} kyros_websocket_frame;
+
+// returns the header length or one of KYROS_WEBSOCKET_PARSE_*, the payload is not looked at
+int32_t kyros_websocket_parse_frame(const char* data, uint64_t length, kyros_websocket_frame* frame);
+// out needs 14 bytes, returns the header length
+uint32_t kyros_websocket_format_frame(char* out, uint8_t first_byte, uint64_t length, bool masked, uint32_t mask);
+// xor with the key, out can be in (unmasking in place)
+void kyros_websocket_mask(char* out, const char* in, uint64_t length, uint32_t mask);
+bool kyros_websocket_utf8_is_valid(const char* data, uint64_t length);
+
+// websocket_deflate.c, permessage-deflate (RFC 7692)
+// Sec-WebSocket-Extensions value a client offers for mode, returns its length (out needs 128 bytes)
+uint32_t kyros_websocket_deflate_offer(kyros_websocket_compression mode, char* out);
+// server side, picks the first acceptable offer and writes the response value (out needs 128 bytes), false if there is none
+bool kyros_websocket_deflate_negotiate(kyros_websocket* websocket, const char* offers, uint32_t length, char* out, uint32_t* out_length);
+// client side, false if the response of the server can not be used
+bool kyros_websocket_deflate_accept(kyros_websocket* websocket, const char* response, uint32_t length);
+// whole message into a pooled buffer, header_room bytes are left in front of it for the frame header
+char* kyros_websocket_deflate(kyros_websocket* websocket, const char* data, uint64_t length, uint32_t header_room, uint64_t* out_length, uint64_t* capacity);
+// kyros_websocket_deflate with the shared stream of loop, for messages sent as they are to many websockets
+char* kyros_websocket_deflate_shared(kyros_loop* loop, const char* data, uint64_t length, uint32_t header_room, uint64_t* out_length, uint64_t* capacity);
+// whole message into a pooled buffer, NULL if it is not valid deflate data or it inflates to more than max_message_size (too_big is set)
+char* kyros_websocket_inflate(kyros_websocket* websocket, const char* data, uint64_t length, uint64_t* out_length, uint64_t* capacity, bool* too_big);
+// gives the dedicated streams of websocket back to the pool of its loop
+void kyros_websocket_deflate_release(kyros_websocket* websocket);
+// the peer got a message that was not compressed with the dedicated deflater, its window is given back
+void kyros_websocket_deflate_restart(kyros_websocket* websocket);
+void kyros_websocket_deflate_pool_destroy(kyros_websocket_deflate_pool* pool);
+
+// pubsub.c, every loop has its own trie of topic levels, only touched by its thread
+typedef struct kyros_pubsub_subscription kyros_pubsub_subscription;
+typedef struct kyros_pubsub_loop kyros_pubsub_loop;
+
+typedef struct kyros_pubsub_node {
+    struct kyros_pubsub_node* parent;
+    // named levels sorted by name
+    struct kyros_pubsub_node** children;
+    uint32_t child_count;
+    uint32_t child_capacity;
+    // "+" and "#" levels
+    struct kyros_pubsub_node* any;
+    struct kyros_pubsub_node* rest;
+    kyros_pubsub_subscription* subscriptions;
+    uint32_t name_length;
+    char name[];
+} kyros_pubsub_node;
+
+struct kyros_pubsub_subscription {
+    kyros_pubsub_loop* owner;
+    kyros_pubsub_node* node;
+    kyros_websocket* websocket;
+    // subscriptions of the node
+    kyros_pubsub_subscription* prev;
+    kyros_pubsub_subscription* next;
+    // subscriptions of the websocket (to any pubsub)
+    kyros_pubsub_subscription* next_of_websocket;
+};
+
+struct kyros_pubsub_loop {
+    kyros_pubsub* pubsub;
+    kyros_loop* loop;
+    kyros_pubsub_node* root;
+    // read by publishers on other loops, a loop without subscriptions gets no hop
+    _Atomic(uint32_t) subscriptions;
+};
+
+struct kyros_pubsub {
+    // loops are added by their first subscription and kept until kyros_pubsub_destroy
+    uv_mutex_t lock;
+    kyros_pubsub_loop** loops;
+    uint32_t loop_count;
+    uint32_t loop_capacity;
+    // subscriptions of websockets that take compressed messages, nothing is compressed while there is none
+    _Atomic(uint32_t) compressed_subscriptions;
+};
+
+// what a publish sends, built once and shared by the loops it goes to
+typedef struct {
+    _Atomic(uint32_t) ref_count;
+    kyros_shared_buffer* frame;
+    // NULL if no subscriber takes permessage-deflate or the message is too small for it
+    kyros_shared_buffer* compressed;
+    uint32_t topic_length;
+    char topic[];
+} kyros_pubsub_message;
+
+// websocket closed, its subscriptions go away before onclose
+void kyros_pubsub_remove_websocket(kyros_websocket* websocket);
+// websocket.c, server frame of a whole message (compressed with the shared stream of loop)
+kyros_shared_buffer* kyros_websocket_frame_shared(kyros_loop* loop, const char* data, uint64_t length, kyros_websocket_opcode opcode, bool compress);
+// write a pre-framed message to websockets of the same loop, compressed goes to the ones that negotiated permessage-deflate
+void kyros_websocket_broadcast(kyros_websocket** websockets, uint32_t count, kyros_shared_buffer* frame, kyros_shared_buffer* compressed);
+
+// websocket.c, the socket handler from the upgrade (or the connect) until the socket closes
+struct kyros_websocket {
+    kyros_socket_handler handler;
+    kyros_websocket_options options;
+    kyros_socket socket;
+    kyros_loop* loop;
+    // partial frame (or 101 response of a client), from the loop buffer pool
+    char* input;
+    uint64_t input_length;
+    uint64_t input_capacity;
+    // fragments of the message being received, from the loop buffer pool
+    char* message;
+    uint64_t message_length;
+    uint64_t message_capacity;
+    uint8_t message_opcode; // 0 when no fragmented message is in progress
+    // given to onclose, what the peer sent (or what the connection failed with)
+    uint16_t close_code;
+    uint8_t close_reason_length;
+    char close_reason[123];
+    // Sec-WebSocket-Accept a client expects
+    char accept[28];
+    // streams with a sliding window kept across messages, NULL until the first message that needs them
+    kyros_websocket_zstream* deflater;
+    kyros_websocket_zstream* inflater;
+    // topics of kyros_pubsub_subscribe
+    kyros_pubsub_subscription* subscriptions;
+    bool is_client : 1;
+    bool handshaking : 1; // client waiting for the 101 response
+    bool close_sent : 1;
+    bool close_received : 1;
+    bool ping_sent : 1; // pinged by the socket timeout, nothing was received since
+    bool ended : 1; // nothing else is read, the close handshake is over or failed
+    bool in_use : 1; // a call is running, the websocket is freed when it returns
+    bool closed : 1;
+    bool compression : 1; // permessage-deflate was negotiated
+    bool send_uncompressed : 1; // the peer limited our window below what the deflate streams use
+    bool deflate_takeover : 1; // what we send keeps the context (dedicated deflater)
+    bool inflate_takeover : 1; // what the peer sends keeps the context (dedicated inflater)
+    bool message_compressed : 1; // RSV1 of the first frame of the fragmented message being received
+    bool collected : 1; // already matched by the publish being collected (several of its subscriptions can match)
+};
+
 #endif
\ No newline at end of file
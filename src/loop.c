@@ -7,120 +7,514 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+#include <threads.h>
 #include <time.h>
 
-static kyros_tasks_hive tasks_hive = kyros_tasks_hive_empty;
+static void kyros_submission_buffers_release(kyros_loop* loop);
 
-static inline kyros_task* kyros_new_task()
+static kyros_task_chunk* kyros_task_slab_grow(kyros_task_slab* slab)
 {
-    auto index = kyros_bitset_first_set_n(TASK_HIVE_SIZE, &tasks_hive.set);
-    if (index == -1) {
-        return (kyros_task*)kyros_alloc(sizeof(kyros_task));
+    auto chunk = (kyros_task_chunk*)kyros_alloc_aligned(TASK_SLAB_CHUNK_ALIGNMENT, TASK_SLAB_CHUNK_ALIGNMENT);
+    chunk->free = kyros_bitset_full;
+    chunk->next = slab->chunks;
+    chunk->next_partial = slab->partial;
+    slab->chunks = chunk;
+    slab->partial = chunk;
+    slab->chunk_count++;
+    return chunk;
+}
+
+static inline kyros_task* kyros_new_task(kyros_task_slab* slab)
+{
+    auto chunk = slab->partial;
+    if (!chunk) {
+        chunk = kyros_task_slab_grow(slab);
     }
-    auto new_task = &tasks_hive.tasks[index];
-    kyros_bitset_unset_n(TASK_HIVE_SIZE, &tasks_hive.set, index);
-    return new_task;
+    auto index = kyros_bitset_first_set(&chunk->free);
+    kyros_bitset_unset(&chunk->free, index);
+    if (!chunk->free.mask) {
+        // full, only comes back to the partial list when a task is freed
+        slab->partial = chunk->next_partial;
+        chunk->next_partial = NULL;
+    }
+    slab->in_use++;
+    return &chunk->tasks[index];
 }
 
-static inline int32_t kyros_task_index_of(kyros_task* task)
+static inline kyros_task_chunk* kyros_task_chunk_of(kyros_task* task)
 {
-    const auto start = (uintptr_t)&tasks_hive.tasks[0];
-    const auto end = (uintptr_t)&tasks_hive.tasks[TASK_HIVE_SIZE - 1];
-    const auto value = (uintptr_t)task;
+    return (kyros_task_chunk*)((uintptr_t)task & ~((uintptr_t)TASK_SLAB_CHUNK_ALIGNMENT - 1));
+}
 
-    if ((value >= start) && (value < end)) {
-        return (value - start) / sizeof(uint64_t);
+static inline void kyros_free_task(kyros_task_slab* slab, kyros_task* task)
+{
+    auto chunk = kyros_task_chunk_of(task);
+    if (!chunk->free.mask) {
+        chunk->next_partial = slab->partial;
+        slab->partial = chunk;
     }
-    return -1;
+    kyros_bitset_set(&chunk->free, (uint32_t)(task - chunk->tasks));
+    slab->in_use--;
 }
 
-static inline void kyros_free_task(kyros_task* task)
+static void kyros_task_slab_deinit(kyros_task_slab* slab)
 {
-    auto index = kyros_task_index_of(task);
-    if (index == -1) {
-        kyros_free(task);
-    } else {
-        kyros_bitset_set_n(TASK_HIVE_SIZE, &tasks_hive.set, index);
+    auto chunk = slab->chunks;
+    while (chunk) {
+        auto next = chunk->next;
+        kyros_free_aligned(chunk);
+        chunk = next;
     }
+    *slab = (kyros_task_slab) { 0 };
 }
 
-static inline kyros_task* kyros_loop_new_task(kyros_loop* loop)
+static inline kyros_async_task* kyros_async_task_at(kyros_async_task_pool* pool, uint32_t index)
 {
-    auto internal = kyros_get_internal_loop(loop);
-    auto* async_task_set = &internal->async_task_hive.set;
-    auto index = kyros_bitset_first_set_n(ASYNC_TASK_HIVE_SIZE, async_task_set);
-    if (index == -1) {
-        return (kyros_task*)kyros_alloc(sizeof(kyros_task));
+    auto chunk = atomic_load_explicit(&pool->chunks[index / ASYNC_TASK_CHUNK_SIZE], memory_order_acquire);
+    return &chunk[index % ASYNC_TASK_CHUNK_SIZE];
+}
+
+// push a chain of tasks linked by next_free, safe to call from any thread
+static inline void kyros_async_task_pool_push(kyros_async_task_pool* pool, kyros_async_task* first, kyros_async_task* last)
+{
+    auto head = atomic_load_explicit(&pool->free_head, memory_order_relaxed);
+    uint64_t new_head;
+    do {
+        atomic_store_explicit(&last->next_free, (uint32_t)head, memory_order_relaxed);
+        new_head = (((head >> 32) + 1) << 32) | (first->index + 1);
+    } while (!atomic_compare_exchange_weak_explicit(&pool->free_head, &head, new_head, memory_order_release, memory_order_relaxed));
+}
+
+static inline kyros_async_task* kyros_async_task_pool_pop(kyros_async_task_pool* pool)
+{
+    auto head = atomic_load_explicit(&pool->free_head, memory_order_acquire);
+    while ((uint32_t)head) {
+        auto task = kyros_async_task_at(pool, (uint32_t)head - 1);
+        // next_free can be stale if another thread popped it first, the generation will make the CAS fail
+        uint64_t new_head = (((head >> 32) + 1) << 32) | atomic_load_explicit(&task->next_free, memory_order_relaxed);
+        if (atomic_compare_exchange_weak_explicit(&pool->free_head, &head, new_head, memory_order_acquire, memory_order_acquire)) {
+            return task;
+        }
     }
-    auto new_task = &internal->async_task_hive.tasks[index];
-    kyros_bitset_unset_n(ASYNC_TASK_HIVE_SIZE, async_task_set, index);
-    return new_task;
+    return NULL;
 }
-static inline int32_t kyros_loop_task_index_of(kyros_loop_internal* internal, kyros_task* task)
+
+// allocate a new chunk, keep the first task and publish the rest in the free list
+static kyros_async_task* kyros_async_task_pool_grow(kyros_async_task_pool* pool)
 {
-    const auto start = (uintptr_t)&internal->async_task_hive.tasks[0];
-    const auto end = (uintptr_t)&internal->async_task_hive.tasks[ASYNC_TASK_HIVE_SIZE - 1];
-    const auto value = (uintptr_t)task;
+    auto chunk_index = atomic_fetch_add_explicit(&pool->chunk_count, 1, memory_order_relaxed);
+    if (chunk_index >= ASYNC_TASK_MAX_CHUNKS) {
+        atomic_store_explicit(&pool->chunk_count, ASYNC_TASK_MAX_CHUNKS, memory_order_relaxed);
+        return NULL;
+    }
+    auto chunk = (kyros_async_task*)kyros_alloc(sizeof(kyros_async_task) * ASYNC_TASK_CHUNK_SIZE);
+    const uint32_t base = chunk_index * ASYNC_TASK_CHUNK_SIZE;
+    for (uint32_t i = 0; i < ASYNC_TASK_CHUNK_SIZE; i++) {
+        chunk[i].index = base + i;
+        atomic_init(&chunk[i].next, NULL);
+        atomic_init(&chunk[i].next_free, base + i + 2);
+    }
+    atomic_store_explicit(&pool->chunks[chunk_index], chunk, memory_order_release);
+    kyros_async_task_pool_push(pool, &chunk[1], &chunk[ASYNC_TASK_CHUNK_SIZE - 1]);
+    return &chunk[0];
+}
 
-    if ((value >= start) && (value < end)) {
-        return (value - start) / sizeof(uint64_t);
+static inline kyros_async_task* kyros_loop_new_async_task(kyros_loop_internal* internal)
+{
+    auto pool = &internal->async_task_pool;
+    auto task = kyros_async_task_pool_pop(pool);
+    if (!task) {
+        task = kyros_async_task_pool_grow(pool);
+    }
+    if (!task) {
+        task = (kyros_async_task*)kyros_alloc(sizeof(kyros_async_task));
+        task->index = KYROS_ASYNC_TASK_HEAP_INDEX;
+        atomic_fetch_add_explicit(&pool->heap_fallbacks, 1, memory_order_relaxed);
     }
-    return -1;
+    return task;
 }
 
-static inline void kyros_loop_free_task(kyros_loop* loop, kyros_task* task)
+static void kyros_async_task_pool_deinit(kyros_async_task_pool* pool)
 {
-    auto internal = kyros_get_internal_loop(loop);
-    auto index = kyros_loop_task_index_of(internal, task);
-    if (index == -1) {
-        kyros_free(task);
-    } else {
-        kyros_bitset_set_n(TASK_HIVE_SIZE, &internal->async_task_hive.set, index);
+    auto count = atomic_load_explicit(&pool->chunk_count, memory_order_acquire);
+    for (uint32_t i = 0; i < count; i++) {
+        kyros_free(atomic_load_explicit(&pool->chunks[i], memory_order_relaxed));
     }
 }
+
+// wait-free multi-producer enqueue of an already linked chain (Vyukov intrusive MPSC queue)
+static inline void kyros_async_queue_splice(kyros_loop_internal* internal, kyros_async_task* first, kyros_async_task* last)
+{
+    atomic_store_explicit(&last->next, NULL, memory_order_relaxed);
+    auto prev = atomic_exchange_explicit(&internal->async_task_tail, last, memory_order_acq_rel);
+    atomic_store_explicit(&prev->next, first, memory_order_release);
+}
+
+static inline void kyros_async_queue_push(kyros_loop_internal* internal, kyros_async_task* task)
+{
+    kyros_async_queue_splice(internal, task, task);
+}
+
+// single consumer dequeue, returns NULL if empty or if a producer is in the middle of a push
+// (in that case the producer will signal the loop again after linking its task)
+static kyros_async_task* kyros_async_queue_pop(kyros_loop_internal* internal)
+{
+    auto stub = &internal->async_task_stub;
+    auto head = internal->async_task_head;
+    auto next = atomic_load_explicit(&head->next, memory_order_acquire);
+    if (head == stub) {
+        if (!next) {
+            return NULL;
+        }
+        internal->async_task_head = next;
+        head = next;
+        next = atomic_load_explicit(&next->next, memory_order_acquire);
+    }
+    if (next) {
+        internal->async_task_head = next;
+        return head;
+    }
+    if (head != atomic_load_explicit(&internal->async_task_tail, memory_order_acquire)) {
+        return NULL;
+    }
+    // head is the last task, push the stub back so we can detach it
+    kyros_async_queue_push(internal, stub);
+    next = atomic_load_explicit(&head->next, memory_order_acquire);
+    if (next) {
+        internal->async_task_head = next;
+        return head;
+    }
+    return NULL;
+}
+
 // uv loop default is just static not thread_local
 // when not in main thread dont use the default loop unless you wanna call kyros_loop_async_defer
 static kyros_loop* default_loop = NULL;
+char* kyros_cork_arena_copy(kyros_cork_arena* arena, const char* data, uint64_t length)
+{
+    if (length > KYROS_CORK_CHUNK_SIZE) {
+        return NULL;
+    }
+    if (!arena->chunk_count || arena->used + length > KYROS_CORK_CHUNK_SIZE) {
+        // chunks are never moved, iovecs keep pointing at them until the flush
+        if (arena->chunk_count && arena->current + 1 < arena->chunk_count) {
+            arena->current++;
+        } else {
+            arena->chunks = (char**)kyros_resize(arena->chunks, sizeof(char*) * (arena->chunk_count + 1));
+            arena->chunks[arena->chunk_count] = (char*)kyros_alloc(KYROS_CORK_CHUNK_SIZE);
+            arena->current = arena->chunk_count++;
+        }
+        arena->used = 0;
+    }
+    auto destination = arena->chunks[arena->current] + arena->used;
+    memcpy(destination, data, length);
+    arena->used += length;
+    return destination;
+}
+
+kyros_cork* kyros_cork_arena_new_cork(kyros_cork_arena* arena, void* socket)
+{
+    auto cork = arena->free_list;
+    if (cork) {
+        arena->free_list = cork->next;
+    } else {
+        cork = (kyros_cork*)kyros_alloc(sizeof(kyros_cork));
+    }
+    cork->socket = socket;
+    cork->iov_count = 0;
+    cork->writes = 0;
+    cork->length = 0;
+    cork->next = arena->pending;
+    arena->pending = cork;
+    return cork;
+}
+
+void kyros_cork_arena_hold(kyros_cork_arena* arena, kyros_shared_buffer* buffer)
+{
+    // a broadcast corks the same buffer on every socket, one reference is enough
+    if (arena->shared_count && arena->shared[arena->shared_count - 1] == buffer) {
+        return;
+    }
+    if (arena->shared_count == arena->shared_capacity) {
+        arena->shared_capacity = arena->shared_capacity ? arena->shared_capacity * 2 : 16;
+        arena->shared = (kyros_shared_buffer**)kyros_resize(arena->shared, sizeof(kyros_shared_buffer*) * arena->shared_capacity);
+    }
+    kyros_shared_buffer_ref(buffer);
+    arena->shared[arena->shared_count++] = buffer;
+}
+
+void kyros_cork_arena_reset(kyros_cork_arena* arena)
+{
+    // recycle the flushed corks
+    while (arena->pending) {
+        auto cork = arena->pending;
+        arena->pending = cork->next;
+        cork->next = arena->free_list;
+        arena->free_list = cork;
+    }
+    for (uint32_t i = 0; i < arena->shared_count; i++) {
+        kyros_shared_buffer_unref(arena->shared[i]);
+    }
+    arena->shared_count = 0;
+    arena->current = 0;
+    arena->used = 0;
+}
+
+static void kyros_cork_arena_deinit(kyros_cork_arena* arena)
+{
+    kyros_cork_arena_reset(arena);
+    while (arena->free_list) {
+        auto cork = arena->free_list;
+        arena->free_list = cork->next;
+        kyros_free(cork);
+    }
+    for (uint32_t i = 0; i < arena->chunk_count; i++) {
+        kyros_free(arena->chunks[i]);
+    }
+    if (arena->chunks) {
+        kyros_free(arena->chunks);
+    }
+    if (arena->shared) {
+        kyros_free(arena->shared);
+    }
+    *arena = (kyros_cork_arena) { 0 };
+}
+
+kyros_write_chunk* kyros_write_chunk_pool_get(kyros_write_chunk_pool* pool)
+{
+    auto chunk = pool->free_list;
+    if (chunk) {
+        pool->free_list = chunk->next;
+        pool->idle--;
+    } else {
+        chunk = (kyros_write_chunk*)kyros_alloc(KYROS_WRITE_CHUNK_SIZE);
+    }
+    chunk->next = NULL;
+    chunk->start = 0;
+    chunk->end = 0;
+    pool->in_use++;
+    return chunk;
+}
+
+void kyros_write_chunk_pool_release(kyros_write_chunk_pool* pool, kyros_write_chunk* chunk)
+{
+    pool->in_use--;
+    if (pool->idle >= KYROS_WRITE_POOL_MAX) {
+        kyros_free(chunk);
+        return;
+    }
+    chunk->next = pool->free_list;
+    pool->free_list = chunk;
+    pool->idle++;
+}
+
+static void kyros_write_chunk_pool_deinit(kyros_write_chunk_pool* pool)
+{
+    while (pool->free_list) {
+        auto chunk = pool->free_list;
+        pool->free_list = chunk->next;
+        kyros_free(chunk);
+    }
+    pool->idle = 0;
+}
+
+/// @brief class of the smallest pooled buffer with room for size, KYROS_BUFFER_POOL_CLASSES if it is too big
+static inline uint32_t kyros_buffer_pool_class(uint64_t size)
+{
+    if (size <= (1ull << KYROS_BUFFER_POOL_MIN_SHIFT)) {
+        return 0;
+    }
+    auto shift = 64 - (uint32_t)__builtin_clzg(size - 1);
+    auto index = shift - KYROS_BUFFER_POOL_MIN_SHIFT;
+    return index < KYROS_BUFFER_POOL_CLASSES ? index : KYROS_BUFFER_POOL_CLASSES;
+}
+
+char* kyros_buffer_pool_get(kyros_buffer_pool* pool, uint64_t* capacity)
+{
+    auto index = kyros_buffer_pool_class(*capacity);
+    if (index == KYROS_BUFFER_POOL_CLASSES) {
+        return (char*)kyros_alloc(*capacity);
+    }
+    *capacity = 1ull << (index + KYROS_BUFFER_POOL_MIN_SHIFT);
+    pool->in_use++;
+    auto buffer = pool->free_lists[index];
+    if (buffer) {
+        pool->free_lists[index] = buffer->next;
+        pool->idle[index]--;
+        return (char*)buffer;
+    }
+    return (char*)kyros_alloc(*capacity);
+}
+
+void kyros_buffer_pool_release(kyros_buffer_pool* pool, char* buffer, uint64_t capacity)
+{
+    uint32_t index = kyros_buffer_pool_class(capacity);
+    if (index == KYROS_BUFFER_POOL_CLASSES) {
+        kyros_free(buffer);
+        return;
+    }
+    m_assert(capacity == 1ull << (index + KYROS_BUFFER_POOL_MIN_SHIFT), "kyros_buffer_pool_release with a capacity it did not give");
+    pool->in_use--;
+    if (pool->idle[index] >= (uint32_t)KYROS_BUFFER_POOL_IDLE_BYTES >> (index + KYROS_BUFFER_POOL_MIN_SHIFT)) {
+        kyros_free(buffer);
+        return;
+    }
+    auto pooled = (kyros_pooled_buffer*)buffer;
+    pooled->next = pool->free_lists[index];
+    pool->free_lists[index] = pooled;
+    pool->idle[index]++;
+}
+
+static void kyros_buffer_pool_deinit(kyros_buffer_pool* pool)
+{
+    for (uint32_t i = 0; i < KYROS_BUFFER_POOL_CLASSES; i++) {
+        while (pool->free_lists[i]) {
+            auto buffer = pool->free_lists[i];
+            pool->free_lists[i] = buffer->next;
+            kyros_free(buffer);
+        }
+        pool->idle[i] = 0;
+    }
+}
+
 static void kyros_loop_deinit(kyros_loop* loop);
 
+static inline void kyros_task_queue_init(kyros_task_queue* queue)
+{
+    queue->head = NULL;
+    queue->tail = &queue->head;
+}
+
+static inline void kyros_task_queue_push(kyros_task_queue* queue, kyros_task* task)
+{
+    task->next = NULL;
+    *queue->tail = task;
+    queue->tail = &task->next;
+}
+
+static inline kyros_task* kyros_task_queue_pop(kyros_task_queue* queue)
+{
+    auto task = queue->head;
+    if (task) {
+        queue->head = task->next;
+        if (!queue->head) {
+            queue->tail = &queue->head;
+        }
+    }
+    return task;
+}
+
+static inline kyros_task* kyros_task_queue_last(kyros_task_queue* queue)
+{
+    return queue->head ? kyros_container_of(queue->tail, kyros_task, next) : NULL;
+}
+
+static inline void kyros_loop_run_task(kyros_loop_internal* internal, kyros_task* task)
+{
+    internal->task_count--;
+    task->task(task->ctx);
+    kyros_free_task(&internal->task_slab, task);
+}
+
+static inline void kyros_loop_run_microtasks(kyros_loop_internal* internal)
+{
+    auto lane = &internal->task_lanes[KYROS_TASK_PRIORITY_MICROTASK];
+    kyros_task* task;
+    while ((task = kyros_task_queue_pop(lane))) {
+        kyros_loop_run_task(internal, task);
+    }
+}
+
+// how many tasks we run between uv_hrtime calls when there is a time budget
+#define TASK_TIME_BUDGET_CHECK_INTERVAL 16
+
+// run the normal tasks enqueued until now (tasks deferred while running wait for the next tick)
+// stops early when the budget is over, returns true if there are tasks left
+static bool kyros_loop_run_tasks(kyros_loop_internal* internal, bool use_budget)
+{
+    auto lane = &internal->task_lanes[KYROS_TASK_PRIORITY_NORMAL];
+    auto last = kyros_task_queue_last(lane);
+    const uint32_t budget = use_budget ? internal->task_budget : 0;
+    const uint64_t deadline = use_budget && internal->task_time_budget ? uv_hrtime() + internal->task_time_budget : 0;
+    uint32_t executed = 0;
+
+    kyros_loop_run_microtasks(internal);
+    kyros_task* task;
+    while (last && (task = kyros_task_queue_pop(lane))) {
+        const bool is_last = task == last;
+        kyros_loop_run_task(internal, task);
+        kyros_loop_run_microtasks(internal);
+        if (is_last) {
+            break;
+        }
+        executed++;
+        if (budget && executed >= budget) {
+            break;
+        }
+        if (deadline && executed % TASK_TIME_BUDGET_CHECK_INTERVAL == 0 && uv_hrtime() >= deadline) {
+            break;
+        }
+    }
+    return internal->task_count != 0;
+}
+
 static void kyros_loop_drain_tasks(kyros_loop* loop)
 {
     auto internal = kyros_get_internal_loop(loop);
-    if (!internal)
+    if (!internal || !internal->task_count)
         return;
-    kyros_task* task = internal->task_queue;
-    if (task) {
-        internal->task_queue = NULL;
-        while (task) {
-            auto next_task = task->next;
-            task->task(task->ctx);
-            kyros_free_task(task);
-            task = next_task;
+    if (kyros_loop_run_tasks(internal, true)) {
+        // budget is over or new tasks arrived, let IO run and continue on the next iteration
+        uv_ref((uv_handle_t*)&internal->task_queue_signal);
+        uv_async_send(&internal->task_queue_signal);
+        return;
+    }
+    kyros_loop_unref(loop);
+}
+// run the async tasks enqueued until now, tasks enqueued while running will wait for the next wakeup
+static void kyros_loop_run_async_tasks(kyros_loop_internal* internal)
+{
+    auto last = atomic_load_explicit(&internal->async_task_tail, memory_order_acquire);
+    if (last == &internal->async_task_stub) {
+        return;
+    }
+    auto pool = &internal->async_task_pool;
+    kyros_async_task* recycled_first = NULL;
+    kyros_async_task* recycled_last = NULL;
+    kyros_async_task* task;
+    while ((task = kyros_async_queue_pop(internal))) {
+        task->task(task->ctx);
+        if (task->index == KYROS_ASYNC_TASK_HEAP_INDEX) {
+            kyros_free(task);
+        } else {
+            // give back to producers in a single CAS at the end
+            atomic_store_explicit(&task->next_free, recycled_first ? recycled_first->index + 1 : 0, memory_order_relaxed);
+            if (!recycled_last) {
+                recycled_last = task;
+            }
+            recycled_first = task;
         }
-        kyros_loop_unref(loop);
+        if (task == last) {
+            break;
+        }
+    }
+    if (recycled_first) {
+        kyros_async_task_pool_push(pool, recycled_first, recycled_last);
     }
 }
+
 static void kyros_loop_drain_async_tasks(kyros_loop* loop)
 {
     auto internal = kyros_get_internal_loop(loop);
     if (!internal)
         return;
 
-    kyros_task* task;
-    kyros_lock(&internal->lock, {
-        task = internal->async_task_queue;
-        internal->async_task_queue = NULL;
-    });
-    if (task) {
-        while (task) {
-            auto next_task = task->next;
-            task->task(task->ctx);
-            // we dont wanna to cause dead locks so we need to lock/unlock to free
-            kyros_lock(&internal->lock, {
-                kyros_loop_free_task(loop, task);
-            });
-            task = next_task;
-        }
+    // clear the flag before draining so any push after this point wakes us up again
+    auto was_pending = atomic_exchange_explicit(&internal->async_pending, false, memory_order_acq_rel);
+    kyros_loop_run_async_tasks(internal);
+    if (!was_pending) {
+        return;
     }
     auto ref_count = atomic_fetch_sub(&internal->aref_count, 1);
     m_assert(ref_count, "kyros_loop atomic double free detected");
@@ -132,6 +526,16 @@ static void kyros_loop_drain_async_tasks(kyros_loop* loop)
     }
 }
 
+// signal the loop thread if no wakeup is in flight yet, can be called from any thread
+static inline void kyros_loop_async_wakeup(kyros_loop* loop, kyros_loop_internal* internal)
+{
+    if (!atomic_exchange_explicit(&internal->async_pending, true, memory_order_acq_rel)) {
+        kyros_loop_atomic_ref(loop);
+        uv_ref((uv_handle_t*)&internal->async_signal);
+        uv_async_send(&internal->async_signal);
+    }
+}
+
 static void kyros_async_wakeup_callback(uv_async_t* p)
 {
     uv_unref((uv_handle_t*)p);
@@ -148,11 +552,38 @@ static void kyros_async_callback(uv_async_t* p)
         kyros_loop_drain_tasks(loop);
     }
 }
+// io_uring engine: one send per queued socket, submitted in the same io_uring_enter as the recvs and cancels of this iteration
+static inline void kyros_loop_submit_uring(kyros_loop_internal* internal)
+{
+    if (internal->uring_sends) {
+        kyros_socket_uring_prepare_sends(internal);
+    }
+    kyros_uring_submit(internal->uring);
+}
+
 static void kyros_before_callback(uv_prepare_t* p)
 {
     // before IO
     kyros_loop* loop = p->data;
     if (loop) {
+        auto internal = kyros_get_internal_loop(loop);
+        internal->iterations++;
+        // writes from timers and close callbacks, dont keep them corked while blocking in poll
+        if (internal->http2_sends) {
+            kyros_http2_flush_sends(internal);
+        }
+        if (internal->cork_arena.pending) {
+            kyros_socket_flush_corked(internal);
+        }
+        if (internal->quic_sends) {
+            kyros_quic_flush_sends(internal);
+        }
+        if (internal->udp_sends) {
+            kyros_udp_flush_sends(internal);
+        }
+        if (internal->uring) {
+            kyros_loop_submit_uring(internal);
+        }
     }
 }
 
@@ -161,6 +592,25 @@ static void kyros_after_callback(uv_check_t* p)
     // after IO
     kyros_loop* loop = p->data;
     if (loop) {
+        auto internal = kyros_get_internal_loop(loop);
+        // one send per socket for everything written while handling this iteration events
+        if (internal->http2_sends) {
+            // the frames of every stream of a connection become one socket write
+            kyros_http2_flush_sends(internal);
+        }
+        if (internal->cork_arena.pending) {
+            kyros_socket_flush_corked(internal);
+        }
+        if (internal->quic_sends) {
+            // packets of every connection, written into the udp batches flushed right below
+            kyros_quic_flush_sends(internal);
+        }
+        if (internal->udp_sends) {
+            kyros_udp_flush_sends(internal);
+        }
+        if (internal->uring) {
+            kyros_loop_submit_uring(internal);
+        }
     }
 }
 
@@ -173,6 +623,11 @@ kyros_loop* kyros_loop_default()
 }
 
 kyros_loop* kyros_loop_create(void* existing_loop)
+{
+    return kyros_loop_create_with_options(existing_loop, (kyros_loop_options) { 0 });
+}
+
+kyros_loop* kyros_loop_create_with_options(void* existing_loop, kyros_loop_options options)
 {
     uv_loop_t* loop = existing_loop;
     if (!loop) {
@@ -183,9 +638,21 @@ kyros_loop* kyros_loop_create(void* existing_loop)
     auto internal = (kyros_loop_internal*)loop->data;
     internal->ref_count = 1;
     atomic_init(&internal->aref_count, 1);
-    internal->lock = (atomic_flag)ATOMIC_FLAG_INIT;
-    internal->async_task_queue = NULL;
-    internal->task_queue = NULL;
+    atomic_init(&internal->async_pending, false);
+    atomic_init(&internal->async_task_stub.next, NULL);
+    internal->async_task_stub.index = KYROS_ASYNC_TASK_HEAP_INDEX;
+    internal->async_task_head = &internal->async_task_stub;
+    atomic_init(&internal->async_task_tail, &internal->async_task_stub);
+    atomic_init(&internal->async_task_pool.free_head, 0);
+    atomic_init(&internal->async_task_pool.chunk_count, 0);
+    atomic_init(&internal->async_task_pool.heap_fallbacks, 0);
+    for (uint32_t i = 0; i < KYROS_TASK_PRIORITY_COUNT; i++) {
+        kyros_task_queue_init(&internal->task_lanes[i]);
+    }
+    internal->task_count = 0;
+    internal->task_budget = options.defer_budget;
+    internal->task_time_budget = (uint64_t)options.defer_time_budget * 1000;
+    internal->task_slab = (kyros_task_slab) { 0 };
     uv_async_init(loop, &internal->task_queue_signal, kyros_async_callback);
     uv_async_init(loop, &internal->async_signal, kyros_async_wakeup_callback);
     uv_unref((uv_handle_t*)&internal->async_signal);
@@ -193,7 +660,6 @@ kyros_loop* kyros_loop_create(void* existing_loop)
 
     internal->task_queue_signal.data = loop;
     internal->async_signal.data = loop;
-    internal->async_task_hive = (kyros_tasks_async_hive) { .set = kyros_bitset_full_n(ASYNC_TASK_HIVE_SIZE) };
 
     uv_prepare_init(loop, &internal->uv_prepare);
     uv_prepare_start(&internal->uv_prepare, kyros_before_callback);
@@ -205,6 +671,35 @@ kyros_loop* kyros_loop_create(void* existing_loop)
     uv_check_start(&internal->uv_check, kyros_after_callback);
     internal->uv_check.data = loop;
 
+    kyros_timer_wheel_init(&internal->timer_wheel, loop, options.timer_granularity);
+    uv_async_init(loop, &internal->keep_alive_handle, NULL);
+    uv_unref((uv_handle_t*)&internal->keep_alive_handle);
+    internal->keep_alive_count = 0;
+    internal->recv_buffer = NULL;
+    internal->ssl_read_buffer = NULL;
+    internal->ssl_input = NULL;
+    internal->ssl_input_length = 0;
+    internal->cork_arena = (kyros_cork_arena) { 0 };
+    internal->write_pool = (kyros_write_chunk_pool) { 0 };
+    internal->buffer_pool = (kyros_buffer_pool) { 0 };
+    internal->deflate_pool = NULL;
+    internal->uring = NULL;
+    internal->uring_sends = NULL;
+    internal->http2_sends = NULL;
+    internal->quic_sends = NULL;
+    internal->udp_sends = NULL;
+    internal->uring_submits = 0;
+    internal->uring_completions = 0;
+    internal->iterations = 0;
+    // busy_time is the wall time minus what libuv measured blocked in the poll wait
+    uv_loop_configure(loop, UV_METRICS_IDLE_TIME);
+    internal->start_time = uv_hrtime();
+    internal->start_idle_time = uv_metrics_idle_time(loop);
+    if (options.io_engine == KYROS_LOOP_IO_URING) {
+        // NULL if the kernel can't do it, the sockets poll like with KYROS_LOOP_IO_POLL
+        internal->uring = kyros_uring_create((kyros_loop*)loop);
+    }
+
     return (kyros_loop*)loop;
 }
 
@@ -235,20 +730,38 @@ static void kyros_loop_deinit(kyros_loop* loop)
 {
     auto internal = kyros_get_internal_loop(loop);
     // drain all tasks
-    kyros_loop_drain_tasks(loop);
+    if (internal->task_count) {
+        kyros_loop_run_tasks(internal, false);
+    }
     // drain all async tasks
-    kyros_loop_drain_tasks(loop);
+    kyros_loop_run_async_tasks(internal);
 
-    // cancel all new pending tasks
-    kyros_task* task;
-    while ((task = internal->task_queue)) {
-        kyros_free_task(task);
+    // cancel all new pending tasks, the slab owns their memory
+    kyros_task_slab_deinit(&internal->task_slab);
+    kyros_async_task* async_task;
+    while ((async_task = kyros_async_queue_pop(internal))) {
+        if (async_task->index == KYROS_ASYNC_TASK_HEAP_INDEX) {
+            kyros_free(async_task);
+        }
+    }
+    kyros_async_task_pool_deinit(&internal->async_task_pool);
+
+    kyros_timer_wheel_deinit(&internal->timer_wheel);
+    if (internal->recv_buffer) {
+        kyros_free(internal->recv_buffer);
+    }
+    if (internal->ssl_read_buffer) {
+        kyros_free(internal->ssl_read_buffer);
+    }
+    kyros_cork_arena_deinit(&internal->cork_arena);
+    kyros_write_chunk_pool_deinit(&internal->write_pool);
+    kyros_buffer_pool_deinit(&internal->buffer_pool);
+    if (internal->deflate_pool) {
+        kyros_websocket_deflate_pool_destroy(internal->deflate_pool);
     }
-    internal->task_queue = NULL;
-    while ((task = internal->async_task_queue)) {
-        kyros_loop_free_task(loop, task);
+    if (internal->uring) {
+        kyros_uring_destroy(internal->uring);
     }
-    internal->async_task_queue = NULL;
 
     // stop check and prepare
     uv_check_stop(&internal->uv_check);
@@ -261,6 +774,7 @@ static void kyros_loop_deinit(kyros_loop* loop)
     uv_close((uv_handle_t*)&internal->uv_prepare, NULL);
     uv_close((uv_handle_t*)&internal->task_queue_signal, NULL);
     uv_close((uv_handle_t*)&internal->async_signal, NULL);
+    uv_close((uv_handle_t*)&internal->keep_alive_handle, NULL);
     // free loop
     kyros_free(internal);
     // invalidate loop data
@@ -283,14 +797,8 @@ bool kyros_loop_atomic_unref(kyros_loop* loop)
     if (ref_count == 1) {
         // we need to check in the main thread the normal ref_count
         // yeah is a little expensive unref outside the main thread avoid this
-        kyros_lock(&internal->lock, {
-            if (!internal->async_task_queue) {
-                // need to ref again just to wakeup but only necessary if we dont have an async task already in place
-                kyros_loop_atomic_ref(loop);
-                uv_ref((uv_handle_t*)&internal->async_signal);
-                uv_async_send(&internal->async_signal);
-            }
-        });
+        // need to ref again just to wakeup but only necessary if we dont have a wakeup already in place
+        kyros_loop_async_wakeup(loop, internal);
         return true;
     }
     return false;
@@ -301,6 +809,7 @@ uint64_t kyros_loop_unref(kyros_loop* loop)
     auto internal = kyros_get_internal_loop(loop);
     m_assert(internal->ref_count, "kyros_loop double free detected");
     if (--internal->ref_count == 0) {
+        kyros_submission_buffers_release(loop);
         if (atomic_load(&internal->aref_count) == 0) {
             kyros_loop_deinit(loop);
         }
@@ -309,114 +818,226 @@ uint64_t kyros_loop_unref(kyros_loop* loop)
     return internal->ref_count;
 }
 
-void kyros_loop_stop(kyros_loop* loop)
+void kyros_loop_keep_alive(kyros_loop* loop, int32_t delta)
 {
-    uv_stop((uv_loop_t*)loop);
+    auto internal = kyros_get_internal_loop(loop);
+    auto before = internal->keep_alive_count;
+    internal->keep_alive_count += delta;
+    if (!before && internal->keep_alive_count) {
+        uv_ref((uv_handle_t*)&internal->keep_alive_handle);
+    } else if (before && !internal->keep_alive_count) {
+        uv_unref((uv_handle_t*)&internal->keep_alive_handle);
+    }
 }
 
-void kyros_loop_atomic_defer(kyros_loop* loop, void (*task)(void* ctx), void* ctx)
+kyros_loop_stats kyros_loop_get_stats(kyros_loop* loop)
 {
     auto internal = kyros_get_internal_loop(loop);
+    auto async_chunks = atomic_load_explicit(&internal->async_task_pool.chunk_count, memory_order_relaxed);
+    return (kyros_loop_stats) {
+        .tasks_pending = internal->task_count,
+        .task_slab_in_use = internal->task_slab.in_use,
+        .task_slab_capacity = (uint64_t)internal->task_slab.chunk_count * TASK_SLAB_CHUNK_SIZE,
+        .task_slab_chunks = internal->task_slab.chunk_count,
+        .async_task_capacity = (uint64_t)(async_chunks < ASYNC_TASK_MAX_CHUNKS ? async_chunks : ASYNC_TASK_MAX_CHUNKS) * ASYNC_TASK_CHUNK_SIZE,
+        .async_task_heap_fallbacks = atomic_load_explicit(&internal->async_task_pool.heap_fallbacks, memory_order_relaxed),
+        .cork_syscalls_saved = internal->cork_arena.syscalls_saved,
+        .write_chunks_in_use = internal->write_pool.in_use,
+        .write_chunks_idle = internal->write_pool.idle,
+        .uring_submits = internal->uring_submits,
+        .uring_completions = internal->uring_completions,
+        .iterations = internal->iterations,
+        .busy_time = (uv_hrtime() - internal->start_time) - (uv_metrics_idle_time((uv_loop_t*)loop) - internal->start_idle_time),
+    };
+}
 
-    kyros_lock(&internal->lock, {
-        auto new_task = kyros_loop_new_task(loop);
-        new_task->ctx = ctx;
-        new_task->task = task;
-        auto current_queue = internal->async_task_queue;
-        new_task->next = current_queue;
-        // ref the loop if we dont have any task enqueued yet
-        internal->async_task_queue = new_task;
-        if (!current_queue) {
-            kyros_loop_atomic_ref(loop);
-            uv_ref((uv_handle_t*)&internal->async_signal);
-            uv_async_send(&internal->async_signal);
-        }
-    });
+kyros_loop_io_engine kyros_loop_get_io_engine(kyros_loop* loop)
+{
+    return kyros_get_internal_loop(loop)->uring ? KYROS_LOOP_IO_URING : KYROS_LOOP_IO_POLL;
 }
 
-void kyros_loop_defer(kyros_loop* loop, void (*task)(void* ctx), void* ctx)
+char* kyros_loop_get_recv_buffer(kyros_loop* loop)
+{
+    auto internal = kyros_get_internal_loop(loop);
+    if (!internal->recv_buffer) {
+        internal->recv_buffer = (char*)kyros_alloc(KYROS_RECV_BUFFER_SIZE + KYROS_RECV_BUFFER_PADDING);
+    }
+    return internal->recv_buffer;
+}
+
+char* kyros_loop_get_ssl_read_buffer(kyros_loop* loop)
+{
+    auto internal = kyros_get_internal_loop(loop);
+    if (!internal->ssl_read_buffer) {
+        internal->ssl_read_buffer = (char*)kyros_alloc(KYROS_SSL_READ_BUFFER_SIZE + KYROS_RECV_BUFFER_PADDING);
+    }
+    return internal->ssl_read_buffer;
+}
+
+void kyros_loop_stop(kyros_loop* loop)
+{
+    uv_stop((uv_loop_t*)loop);
+}
+
+void kyros_loop_atomic_defer(kyros_loop* loop, void (*task)(void* ctx), void* ctx)
 {
     auto internal = kyros_get_internal_loop(loop);
-    auto new_task = kyros_new_task();
+    auto new_task = kyros_loop_new_async_task(internal);
     new_task->ctx = ctx;
     new_task->task = task;
-    auto current_queue = internal->task_queue;
-    new_task->next = current_queue;
-    // ref the loop if we dont have any task enqueued yet
-    internal->task_queue = new_task;
-    if (!current_queue) {
-        // keep loop alive until we drain tasks
-        kyros_loop_ref(loop);
-        uv_ref((uv_handle_t*)&internal->task_queue_signal);
-        uv_async_send(&internal->task_queue_signal);
-    }
+    kyros_async_queue_push(internal, new_task);
+    // ref the loop if we dont have any wakeup in flight yet
+    kyros_loop_async_wakeup(loop, internal);
 }
 
-void kyros_internal_timer_callback(uv_timer_t* timer)
+/// @brief link the tasks privately and splice them into the async queue, the caller wakes the loop
+static void kyros_loop_async_splice_many(kyros_loop_internal* internal, const kyros_task_entry* tasks, uint64_t count)
 {
-    auto internal = kyros_get_internal_timer((kyros_timer*)timer);
-    internal->task(internal->ctx);
+    // link the chain privately, nobody can see it until the splice
+    auto first = kyros_loop_new_async_task(internal);
+    auto last = first;
+    first->task = tasks[0].task;
+    first->ctx = tasks[0].ctx;
+    for (uint64_t i = 1; i < count; i++) {
+        auto new_task = kyros_loop_new_async_task(internal);
+        new_task->task = tasks[i].task;
+        new_task->ctx = tasks[i].ctx;
+        atomic_store_explicit(&last->next, new_task, memory_order_relaxed);
+        last = new_task;
+    }
+    kyros_async_queue_splice(internal, first, last);
 }
 
-kyros_timer* kyros_loop_timer(kyros_loop* loop, void (*task)(void* ctx), void* ctx, uint64_t timeout, uint64_t repeat, bool keep_alive)
+void kyros_loop_atomic_defer_many(kyros_loop* loop, const kyros_task_entry* tasks, uint64_t count)
 {
+    if (!count) {
+        return;
+    }
     auto internal = kyros_get_internal_loop(loop);
-    auto timer = (uv_timer_t*)kyros_alloc(sizeof(uv_timer_t));
-    timer->data = loop;
-    auto ktimer = (kyros_timer*)timer;
-    auto itimer = kyros_get_internal_timer(ktimer);
-    itimer->ref_count = 1;
-    itimer->task = task;
-    itimer->ctx = ctx;
-    uv_timer_init((uv_loop_t*)loop, timer);
-    uv_timer_start(timer, kyros_internal_timer_callback, timeout, repeat);
-    if (!keep_alive) {
-        uv_unref((uv_handle_t*)timer);
+    kyros_loop_async_splice_many(internal, tasks, count);
+    kyros_loop_async_wakeup(loop, internal);
+}
+
+static thread_local kyros_submission_buffer* submission_buffers[SUBMISSION_BUFFER_LOOPS];
+static tss_t submission_buffers_key;
+static uv_once_t submission_buffers_once = UV_ONCE_INIT;
+
+/// @brief send the tasks and drop the atomic ref, a buffer only points to a loop while it holds tasks
+static inline void kyros_submission_buffer_flush(kyros_submission_buffer* buffer)
+{
+    auto loop = buffer->loop;
+    kyros_loop_atomic_defer_many(loop, buffer->tasks, buffer->len);
+    buffer->len = 0;
+    buffer->loop = NULL;
+    kyros_loop_atomic_unref(loop);
+}
+
+// tss destructor, sends what the exiting thread still buffers and frees its buffers
+static void kyros_submission_buffers_free(void* buffers)
+{
+    auto list = (kyros_submission_buffer**)buffers;
+    for (uint32_t i = 0; i < SUBMISSION_BUFFER_LOOPS; i++) {
+        if (list[i]) {
+            if (list[i]->loop) {
+                kyros_submission_buffer_flush(list[i]);
+            }
+            kyros_free(list[i]);
+            list[i] = NULL;
+        }
     }
-    return ktimer;
 }
 
-void kyros_timer_set_callback(kyros_timer* timer, void (*task)(void* ctx), void* ctx)
+static void kyros_submission_buffers_init()
 {
-    auto internal = kyros_get_internal_timer((kyros_timer*)timer);
-    internal->task = task;
-    internal->ctx = ctx;
+    tss_create(&submission_buffers_key, kyros_submission_buffers_free);
 }
 
-void kyros_timer_set_times(kyros_timer* timer, uint64_t timeout, uint64_t repeat)
+/// @brief called by the loop thread when the loop is destroyed, the tasks it buffered for the loop
+/// go to the async queue without a wakeup and run with the drain of kyros_loop_deinit
+static void kyros_submission_buffers_release(kyros_loop* loop)
 {
-    uv_timer_stop((uv_timer_t*)timer);
-    uv_timer_start((uv_timer_t*)timer, kyros_internal_timer_callback, timeout, repeat);
+    for (uint32_t i = 0; i < SUBMISSION_BUFFER_LOOPS; i++) {
+        auto buffer = submission_buffers[i];
+        if (buffer && buffer->loop == loop) {
+            auto internal = kyros_get_internal_loop(loop);
+            kyros_loop_async_splice_many(internal, buffer->tasks, buffer->len);
+            buffer->len = 0;
+            buffer->loop = NULL;
+            atomic_fetch_sub(&internal->aref_count, 1);
+        }
+    }
 }
 
-void kyros_timer_stop(kyros_timer* timer)
+static kyros_submission_buffer* kyros_get_submission_buffer(kyros_loop* loop)
 {
-    uv_timer_stop((uv_timer_t*)timer);
+    kyros_submission_buffer* unused = NULL;
+    for (uint32_t i = 0; i < SUBMISSION_BUFFER_LOOPS; i++) {
+        auto buffer = submission_buffers[i];
+        if (!buffer) {
+            if (i == 0) {
+                // first buffer of this thread, freed by the tss destructor when the thread exits
+                uv_once(&submission_buffers_once, kyros_submission_buffers_init);
+                tss_set(submission_buffers_key, submission_buffers);
+            }
+            buffer = (kyros_submission_buffer*)kyros_alloc(sizeof(kyros_submission_buffer));
+            buffer->loop = NULL;
+            buffer->len = 0;
+            submission_buffers[i] = buffer;
+        }
+        if (buffer->loop == loop) {
+            return buffer;
+        }
+        if (!unused && !buffer->loop) {
+            unused = buffer;
+        }
+    }
+    if (!unused) {
+        // too many loops at once, flush everything and reuse the first one
+        kyros_loop_atomic_flush(NULL);
+        unused = submission_buffers[0];
+    }
+    // the loop is not freed while this thread holds tasks for it
+    kyros_loop_atomic_ref(loop);
+    unused->loop = loop;
+    return unused;
 }
 
-uint64_t kyros_timer_ref(kyros_timer* timer)
+void kyros_loop_atomic_submit(kyros_loop* loop, void (*task)(void* ctx), void* ctx)
 {
-    auto internal = kyros_get_internal_timer((kyros_timer*)timer);
-    internal->ref_count++;
-    return internal->ref_count;
+    auto buffer = kyros_get_submission_buffer(loop);
+    buffer->tasks[buffer->len++] = (kyros_task_entry) { .task = task, .ctx = ctx };
+    if (buffer->len == SUBMISSION_BUFFER_SIZE) {
+        kyros_submission_buffer_flush(buffer);
+    }
 }
 
-uint64_t kyros_timer_unref(kyros_timer* timer)
+void kyros_loop_atomic_flush(kyros_loop* loop)
 {
-    auto internal = kyros_get_internal_timer((kyros_timer*)timer);
-    m_assert(internal->ref_count, "kyros_timer double free detected");
-    if (--internal->ref_count == 0) {
-        kyros_free(timer);
-        return 0;
+    for (uint32_t i = 0; i < SUBMISSION_BUFFER_LOOPS; i++) {
+        auto buffer = submission_buffers[i];
+        if (buffer && buffer->loop && (!loop || buffer->loop == loop)) {
+            kyros_submission_buffer_flush(buffer);
+        }
     }
-    return internal->ref_count;
 }
 
-void kyros_timer_keepalive_loop(kyros_timer* timer, bool keep_alive)
+void kyros_loop_defer_with_priority(kyros_loop* loop, void (*task)(void* ctx), void* ctx, kyros_task_priority priority)
 {
-    if (keep_alive) {
-        uv_ref((uv_handle_t*)timer);
-    } else {
-        uv_unref((uv_handle_t*)timer);
+    auto internal = kyros_get_internal_loop(loop);
+    auto new_task = kyros_new_task(&internal->task_slab);
+    new_task->ctx = ctx;
+    new_task->task = task;
+    kyros_task_queue_push(&internal->task_lanes[priority], new_task);
+    // ref the loop if we dont have any task enqueued yet
+    if (internal->task_count++ == 0) {
+        // keep loop alive until we drain tasks
+        kyros_loop_ref(loop);
+        uv_ref((uv_handle_t*)&internal->task_queue_signal);
+        uv_async_send(&internal->task_queue_signal);
     }
 }
+
+void kyros_loop_defer(kyros_loop* loop, void (*task)(void* ctx), void* ctx)
+{
+    kyros_loop_defer_with_priority(loop, task, ctx, KYROS_TASK_PRIORITY_NORMAL);
+}
@@ -0,0 +1,526 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+// splice, pipe2 and F_SETPIPE_SZ
+#define _GNU_SOURCE
+#endif
+#include <kyros.h>
+#include <kyros_bsd.h>
+#include <kyros_internal.h>
+
+#ifdef __linux__
+#define KYROS_HAS_SPLICE 1
+#endif
+
+static void kyros_socket_pipe_fd_poll_callback(uv_poll_t* poll, int status, int events);
+
+static inline kyros_socket_internal_tcp* kyros_socket_pipe_get_tcp(kyros_socket socket)
+{
+    return (kyros_socket_internal_tcp*)kyros_get_socket_internal(socket);
+}
+
+static inline uv_os_sock_t kyros_socket_pipe_tcp_fd(kyros_socket_internal_tcp* tcp)
+{
+    uv_os_fd_t fd;
+    uv_fileno((uv_handle_t*)&tcp->poll.poll, &fd);
+    return (uv_os_sock_t)fd;
+}
+
+static inline kyros_write_chunk_pool* kyros_socket_pipe_get_write_pool(kyros_socket_pipe_internal* pipe)
+{
+    return &kyros_get_internal_loop(pipe->loop)->write_pool;
+}
+
+static inline bool kyros_socket_pipe_is_spliced(kyros_socket_pipe_internal* pipe)
+{
+    return pipe->kernel_pipe[0] != -1;
+}
+
+static inline bool kyros_socket_pipe_has_source_ended(KYROS_SOCKET_STATUS status)
+{
+    return status == KYROS_SOCKET_STATE_CLOSED || status == KYROS_SOCKET_STATE_READABLE_ENDED;
+}
+
+static inline bool kyros_socket_pipe_has_destination_ended(KYROS_SOCKET_STATUS status)
+{
+    return status == KYROS_SOCKET_STATE_CLOSED || status == KYROS_SOCKET_STATE_WRITABLE_ENDED;
+}
+
+///
+/// Link
+///
+
+static inline kyros_socket_pipe_link* kyros_socket_pipe_get_link(kyros_socket_internal_tcp* tcp)
+{
+    return tcp->socket.has_pipe_link ? kyros_container_of(tcp->handlers, kyros_socket_pipe_link, handler) : NULL;
+}
+
+static void kyros_socket_pipe_source_ended(kyros_socket_pipe_internal* pipe);
+static void kyros_socket_pipe_destroy(kyros_socket_pipe_internal* pipe);
+static bool kyros_socket_pipe_write(kyros_socket_pipe_internal* pipe, const char* data, uint64_t length);
+static void kyros_socket_pipe_wait(kyros_socket_pipe_internal* pipe, bool waiting);
+
+static bool kyros_socket_pipe_link_ondata(kyros_socket socket, const char* data, uint64_t length, void* ctx)
+{
+    kyros_socket_pipe_link* link = ctx;
+    if (link->outgoing) {
+        return kyros_socket_pipe_write(link->outgoing, data, length);
+    }
+    auto original = link->original;
+    if (original && original->ondata) {
+        return original->ondata(socket, data, length, original->ctx);
+    }
+    return true;
+}
+
+static bool kyros_socket_pipe_link_ontimeout(kyros_socket socket, void* ctx)
+{
+    kyros_socket_pipe_link* link = ctx;
+    auto original = link->original;
+    if (original && original->ontimeout) {
+        return original->ontimeout(socket, original->ctx);
+    }
+    return true;
+}
+
+static void kyros_socket_pipe_link_ondrain(kyros_socket socket, void* ctx)
+{
+    kyros_socket_pipe_link* link = ctx;
+    auto original = link->original;
+    auto incoming = link->incoming;
+    if (incoming && !kyros_socket_pipe_is_spliced(incoming)) {
+        // userspace path, the destination took what the source gave it
+        kyros_socket_pipe_wait(incoming, false);
+    }
+    if (original && original->ondrain) {
+        original->ondrain(socket, original->ctx);
+    }
+}
+
+static void kyros_socket_pipe_link_onstatus(kyros_socket socket, kyros_socket_error error, void* ctx)
+{
+    kyros_socket_pipe_link* link = ctx;
+    auto tcp = kyros_socket_pipe_get_tcp(socket);
+    // the pipes can release the link
+    auto original = link->original;
+    KYROS_SOCKET_STATUS status = tcp->socket.status;
+    if (link->outgoing && kyros_socket_pipe_has_source_ended(status)) {
+        // ending the destination can close the pipe coming back to this socket, look the link up again
+        kyros_socket_pipe_source_ended(link->outgoing);
+        link = kyros_socket_pipe_get_link(tcp);
+    }
+    if (link && link->incoming && kyros_socket_pipe_has_destination_ended(status)) {
+        kyros_socket_pipe_destroy(link->incoming);
+    }
+    if (original && original->onstatus) {
+        original->onstatus(socket, error, original->ctx);
+    }
+}
+
+static kyros_socket_pipe_link* kyros_socket_pipe_link_install(kyros_socket_internal_tcp* tcp)
+{
+    auto link = kyros_socket_pipe_get_link(tcp);
+    if (link) {
+        return link;
+    }
+    link = (kyros_socket_pipe_link*)kyros_alloc(sizeof(kyros_socket_pipe_link));
+    *link = (kyros_socket_pipe_link) {
+        .handler = {
+            .ctx = link,
+            .ondata = kyros_socket_pipe_link_ondata,
+            .ontimeout = kyros_socket_pipe_link_ontimeout,
+            .ondrain = kyros_socket_pipe_link_ondrain,
+            .onstatus = kyros_socket_pipe_link_onstatus,
+            .ref_count = 1,
+        },
+        .original = tcp->handlers,
+    };
+    tcp->handlers = &link->handler;
+    tcp->socket.has_pipe_link = true;
+    return link;
+}
+
+/// @brief give the socket its handler back once no pipe uses it, close_with_error releases the original one
+static void kyros_socket_pipe_link_release(kyros_socket_internal_tcp* tcp)
+{
+    auto link = kyros_socket_pipe_get_link(tcp);
+    if (!link || link->outgoing || link->incoming) {
+        return;
+    }
+    tcp->handlers = link->original;
+    tcp->socket.has_pipe_link = false;
+    kyros_free(link);
+}
+
+///
+/// Pipe
+///
+
+static void kyros_socket_pipe_fd_poll_close_callback(uv_handle_t* handle)
+{
+    kyros_free(kyros_container_of((uv_poll_t*)handle, kyros_socket_pipe_internal, fd_poll));
+}
+
+/// @brief stop the source side, the socket reads for its own handler again
+static void kyros_socket_pipe_detach_source(kyros_socket_pipe_internal* pipe)
+{
+    auto source = pipe->source;
+    if (!source) {
+        return;
+    }
+    pipe->source = NULL;
+    source->socket.pipe_splice = false;
+    source->socket.pipe_paused = false;
+    kyros_socket_pipe_get_link(source)->outgoing = NULL;
+    kyros_socket_pipe_link_release(source);
+    if (source->socket.status != KYROS_SOCKET_STATE_CLOSED) {
+        kyros_socket_update_poll(source);
+    }
+}
+
+static void kyros_socket_pipe_destroy(kyros_socket_pipe_internal* pipe)
+{
+    kyros_socket_pipe_detach_source(pipe);
+    auto destination = pipe->destination;
+    if (destination) {
+        pipe->destination = NULL;
+        destination->socket.pipe_waiting = false;
+        kyros_socket_pipe_get_link(destination)->incoming = NULL;
+        kyros_socket_pipe_link_release(destination);
+        if (destination->socket.status != KYROS_SOCKET_STATE_CLOSED) {
+            kyros_socket_update_poll(destination);
+        }
+    }
+    if (kyros_socket_pipe_is_spliced(pipe)) {
+        close(pipe->kernel_pipe[0]);
+        close(pipe->kernel_pipe[1]);
+    }
+    kyros_write_queue_clear(kyros_socket_pipe_get_write_pool(pipe), &pipe->backlog);
+    if (pipe->has_fd_poll) {
+        uv_poll_stop(&pipe->fd_poll);
+        // memory is released in the close callback
+        uv_close((uv_handle_t*)&pipe->fd_poll, kyros_socket_pipe_fd_poll_close_callback);
+        return;
+    }
+    kyros_free(pipe);
+}
+
+/// @brief free the pipe once the source is gone and everything it gave was written
+static void kyros_socket_pipe_check_done(kyros_socket_pipe_internal* pipe)
+{
+    if (pipe->source || pipe->pending || pipe->backlog.length) {
+        return;
+    }
+    auto destination = pipe->destination;
+    auto end = pipe->end && pipe->source_ended;
+    auto fd = pipe->fd;
+    kyros_socket_pipe_destroy(pipe);
+    if (!end) {
+        return;
+    }
+    if (destination) {
+        kyros_socket_write(kyros_socket_from_internal(&destination->socket), NULL, 0, true);
+    } else {
+        uv_fs_t request;
+        uv_fs_close(NULL, &request, fd, NULL);
+        uv_fs_req_cleanup(&request);
+    }
+}
+
+static void kyros_socket_pipe_source_ended(kyros_socket_pipe_internal* pipe)
+{
+    pipe->source_ended = true;
+    kyros_socket_pipe_detach_source(pipe);
+    kyros_socket_pipe_check_done(pipe);
+}
+
+/// @brief the destination could not take everything, stop reading the source until it can
+static void kyros_socket_pipe_wait(kyros_socket_pipe_internal* pipe, bool waiting)
+{
+    auto source = pipe->source;
+    if (source && source->socket.pipe_paused != waiting) {
+        source->socket.pipe_paused = waiting;
+        kyros_socket_update_poll(source);
+    }
+    auto destination = pipe->destination;
+    // the userspace path to a socket waits for its ondrain instead
+    if (destination && kyros_socket_pipe_is_spliced(pipe) && destination->socket.pipe_waiting != waiting) {
+        destination->socket.pipe_waiting = waiting;
+        kyros_socket_update_poll(destination);
+    }
+    if (pipe->has_fd_poll) {
+        if (waiting) {
+            uv_poll_start(&pipe->fd_poll, KYROS_SOCKET_WRITABLE, kyros_socket_pipe_fd_poll_callback);
+        } else {
+            uv_poll_stop(&pipe->fd_poll);
+        }
+    }
+    if (!waiting) {
+        kyros_socket_pipe_check_done(pipe);
+    }
+}
+
+/// @brief the destination failed, a fd has no onstatus so its source gets the error
+static void kyros_socket_pipe_fail(kyros_socket_pipe_internal* pipe, kyros_socket_error error)
+{
+    auto destination = pipe->destination;
+    if (destination) {
+        // onstatus destroys the pipe
+        kyros_socket_close_with_error(destination, error);
+        return;
+    }
+    auto source = pipe->source;
+    kyros_socket_pipe_destroy(pipe);
+    if (source) {
+        kyros_socket_close_with_error(source, error);
+    }
+}
+
+///
+/// Splice
+///
+
+#ifdef KYROS_HAS_SPLICE
+static bool kyros_socket_pipe_open_kernel_pipe(kyros_socket_pipe_internal* pipe)
+{
+    if (pipe2(pipe->kernel_pipe, O_NONBLOCK | O_CLOEXEC) != 0) {
+        pipe->kernel_pipe[0] = pipe->kernel_pipe[1] = -1;
+        return false;
+    }
+    // bigger pipe, less splice calls, the default size is kept if the limit is lower
+    fcntl(pipe->kernel_pipe[1], F_SETPIPE_SZ, KYROS_PIPE_KERNEL_SIZE);
+    return true;
+}
+
+/// @brief move the kernel pipe into the destination, returns false if it has to wait (or the pipe is gone)
+static bool kyros_socket_pipe_drain(kyros_socket_pipe_internal* pipe)
+{
+    auto destination = pipe->destination;
+    if (destination) {
+        auto socket = kyros_socket_from_internal(&destination->socket);
+        // keep ordering with what was written to the destination directly
+        if ((destination->cork || kyros_socket_queued(destination)) && kyros_socket_flush(socket)) {
+            kyros_socket_pipe_wait(pipe, true);
+            return false;
+        }
+        if (destination->socket.status == KYROS_SOCKET_STATE_CLOSED) {
+            return false;
+        }
+    }
+    auto fd = destination ? (int)kyros_socket_pipe_tcp_fd(destination) : pipe->fd;
+    while (pipe->pending) {
+        auto written = splice(pipe->kernel_pipe[0], NULL, fd, NULL, pipe->pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (written < 0) {
+            auto error = errno;
+            if (error == EINTR) {
+                continue;
+            }
+            if (kyros_bsd_would_block(error)) {
+                kyros_socket_pipe_wait(pipe, true);
+            } else {
+                kyros_socket_pipe_fail(pipe, kyros_socket_system_error(KYROS_SOCKET_ERROR_SYSTEM_ERROR, error));
+            }
+            return false;
+        }
+        pipe->pending -= written;
+    }
+    return true;
+}
+
+void kyros_socket_pipe_on_readable(kyros_socket_internal_tcp* source)
+{
+    auto pipe = kyros_socket_pipe_get_link(source)->outgoing;
+    m_assert(pipe && pipe->source == source, "spliced socket without pipe");
+    ssize_t received;
+    do {
+        received = splice(kyros_socket_pipe_tcp_fd(source), NULL, pipe->kernel_pipe[1], NULL, KYROS_PIPE_KERNEL_SIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    } while (kyros_bsd_interrupted(received));
+    if (received > 0) {
+        pipe->pending += received;
+        kyros_socket_pipe_drain(pipe);
+        return;
+    }
+    if (received == 0) {
+        // FIN received, onstatus ends the source side of the pipe
+        kyros_socket_on_end(source);
+        return;
+    }
+    auto error = errno;
+    if (!kyros_bsd_would_block(error)) {
+        kyros_socket_close_with_error(source, kyros_socket_system_error(KYROS_SOCKET_ERROR_SYSTEM_ERROR, error));
+    }
+}
+
+void kyros_socket_pipe_on_writable(kyros_socket_internal_tcp* destination)
+{
+    auto pipe = kyros_socket_pipe_get_link(destination)->incoming;
+    m_assert(pipe && pipe->destination == destination, "pipe destination without pipe");
+    if (kyros_socket_pipe_drain(pipe)) {
+        kyros_socket_pipe_wait(pipe, false);
+    }
+}
+#else
+static bool kyros_socket_pipe_open_kernel_pipe(kyros_socket_pipe_internal* pipe)
+{
+    return false;
+}
+
+static bool kyros_socket_pipe_drain(kyros_socket_pipe_internal* pipe)
+{
+    return true;
+}
+
+void kyros_socket_pipe_on_readable(kyros_socket_internal_tcp* source)
+{
+    panic("kyros_socket_pipe_on_readable without splice");
+}
+
+void kyros_socket_pipe_on_writable(kyros_socket_internal_tcp* destination)
+{
+    destination->socket.pipe_waiting = false;
+    kyros_socket_update_poll(destination);
+}
+#endif
+
+///
+/// Userspace
+///
+
+/// @brief write as much of the backlog as the fd takes, returns false if it has to wait (or the pipe is gone)
+static bool kyros_socket_pipe_flush_backlog(kyros_socket_pipe_internal* pipe)
+{
+    auto pool = kyros_socket_pipe_get_write_pool(pipe);
+    while (pipe->backlog.length) {
+        uv_buf_t buffers[KYROS_WRITE_QUEUE_IOV];
+        uint32_t count = 0;
+        for (auto chunk = pipe->backlog.head; chunk && count < KYROS_WRITE_QUEUE_IOV; chunk = chunk->next) {
+            buffers[count++] = uv_buf_init(chunk->data + chunk->start, chunk->end - chunk->start);
+        }
+        uv_fs_t request;
+        auto written = uv_fs_write(NULL, &request, pipe->fd, buffers, count, -1, NULL);
+        uv_fs_req_cleanup(&request);
+        if (written < 0) {
+            if (written == UV_EAGAIN && pipe->has_fd_poll) {
+                kyros_socket_pipe_wait(pipe, true);
+            } else {
+                kyros_socket_pipe_fail(pipe, kyros_socket_uv_error(KYROS_SOCKET_ERROR_SYSTEM_ERROR, written));
+            }
+            return false;
+        }
+        kyros_write_queue_consume(pool, &pipe->backlog, written);
+    }
+    return true;
+}
+
+/// @brief ondata of the source on the userspace path, data is the loop recv buffer (or the ssl read buffer)
+static bool kyros_socket_pipe_write(kyros_socket_pipe_internal* pipe, const char* data, uint64_t length)
+{
+    auto destination = pipe->destination;
+    if (destination) {
+        // the pipe is gone if the write ended the destination
+        auto accepted = kyros_socket_write(kyros_socket_from_internal(&destination->socket), data, length, false);
+        if (!accepted && !kyros_socket_pipe_has_destination_ended(destination->socket.status) && destination->socket.over_high_watermark) {
+            // ondrain resumes the source
+            kyros_socket_pipe_wait(pipe, true);
+        }
+        return true;
+    }
+    // queued chunks are reused from the loop pool, the fd gets them when it is writable
+    kyros_write_queue_append(kyros_socket_pipe_get_write_pool(pipe), &pipe->backlog, data, length);
+    kyros_socket_pipe_flush_backlog(pipe);
+    return true;
+}
+
+static void kyros_socket_pipe_fd_poll_callback(uv_poll_t* poll, int status, int events)
+{
+    auto pipe = kyros_container_of(poll, kyros_socket_pipe_internal, fd_poll);
+    if (status < 0) {
+        kyros_socket_pipe_fail(pipe, kyros_socket_uv_error(KYROS_SOCKET_ERROR_SYSTEM_ERROR, status));
+        return;
+    }
+    auto ready = kyros_socket_pipe_is_spliced(pipe) ? kyros_socket_pipe_drain(pipe) : kyros_socket_pipe_flush_backlog(pipe);
+    if (ready) {
+        kyros_socket_pipe_wait(pipe, false);
+    }
+}
+
+///
+/// Public API
+///
+
+static kyros_socket_pipe_internal* kyros_socket_pipe_create(kyros_socket_internal_tcp* source, bool end)
+{
+    // datagrams have no byte stream to forward
+    if (source->socket.tag == KYROS_SOCKET_UDP || kyros_socket_pipe_has_source_ended(source->socket.status)) {
+        return NULL;
+    }
+    kyros_socket_unpipe(kyros_socket_from_internal(&source->socket));
+    auto pipe = (kyros_socket_pipe_internal*)kyros_alloc(sizeof(kyros_socket_pipe_internal));
+    *pipe = (kyros_socket_pipe_internal) {
+        .source = source,
+        .loop = kyros_socket_internal_get_loop(source),
+        .fd = -1,
+        .kernel_pipe = { -1, -1 },
+        .end = end,
+    };
+    kyros_socket_pipe_link_install(source)->outgoing = pipe;
+    return pipe;
+}
+
+/// @brief splice only between plain sockets, the kernel can still encrypt what goes out (kernel tls)
+/// io_uring sockets have no readiness to splice on, they always take the userspace path
+static void kyros_socket_pipe_start(kyros_socket_pipe_internal* pipe, bool can_splice)
+{
+    auto source = pipe->source;
+    if (can_splice && source->socket.tag == KYROS_SOCKET_TCP && source->socket.has_poll && !source->socket.uring && kyros_socket_pipe_open_kernel_pipe(pipe)) {
+        source->socket.pipe_splice = true;
+    }
+    kyros_socket_update_poll(source);
+}
+
+bool kyros_socket_pipe(kyros_socket socket, kyros_socket dst_socket, bool end)
+{
+    auto source = kyros_socket_pipe_get_tcp(socket);
+    auto destination = kyros_socket_pipe_get_tcp(dst_socket);
+    KYROS_SOCKET_STATUS status = destination->socket.status;
+    if (source == destination || destination->socket.tag == KYROS_SOCKET_UDP || kyros_socket_pipe_has_destination_ended(status)) {
+        return false;
+    }
+    auto incoming = kyros_socket_pipe_get_link(destination) ? kyros_socket_pipe_get_link(destination)->incoming : NULL;
+    if (incoming) {
+        // one writer per destination
+        return false;
+    }
+    auto pipe = kyros_socket_pipe_create(source, end);
+    if (!pipe) {
+        return false;
+    }
+    pipe->destination = destination;
+    kyros_socket_pipe_link_install(destination)->incoming = pipe;
+    auto plain = destination->socket.tag == KYROS_SOCKET_TCP || destination->socket.ktls_tx;
+    kyros_socket_pipe_start(pipe, plain && destination->socket.has_poll && !destination->socket.uring);
+    return true;
+}
+
+bool kyros_socket_pipe3(kyros_socket socket, int fd, bool end)
+{
+    auto pipe = kyros_socket_pipe_create(kyros_socket_pipe_get_tcp(socket), end);
+    if (!pipe) {
+        return false;
+    }
+    pipe->fd = fd;
+    // regular files can't be polled, they are always writable
+    pipe->has_fd_poll = uv_poll_init((uv_loop_t*)pipe->loop, &pipe->fd_poll, fd) == 0;
+    kyros_socket_pipe_start(pipe, true);
+    return true;
+}
+
+void kyros_socket_unpipe(kyros_socket socket)
+{
+    auto link = kyros_socket_pipe_get_link(kyros_socket_pipe_get_tcp(socket));
+    if (!link || !link->outgoing) {
+        return;
+    }
+    // what the source already gave is still written, without ending the destination
+    auto pipe = link->outgoing;
+    kyros_socket_pipe_detach_source(pipe);
+    kyros_socket_pipe_check_done(pipe);
+}
@@ -0,0 +1,477 @@
+#include <kyros.h>
+#include <kyros_internal.h>
+
+#include <string.h>
+
+// a publish frames (and compresses) the message once into shared buffers, the write queues of the subscribers
+// hold references to them instead of copies. Every loop matches the topic against its own trie, the other loops
+// are reached with one kyros_loop_atomic_defer each carrying the message, never one per subscriber
+
+// runs in the loop of target
+typedef struct {
+    kyros_pubsub_loop* target;
+    kyros_pubsub_message* message;
+} kyros_pubsub_hop;
+
+// websockets matched by one publish, on the stack unless there are many
+typedef struct {
+    kyros_websocket** websockets;
+    uint32_t count;
+    uint32_t capacity;
+} kyros_pubsub_collector;
+
+///
+/// Topics
+///
+
+/// @brief levels are split by '/', wildcards are whole levels ("#" only the last one) and only allowed in subscriptions
+static bool kyros_pubsub_topic_is_valid(const char* topic, uint32_t length, bool wildcards)
+{
+    auto end = topic + length;
+    auto level = topic;
+    while (true) {
+        auto slash = (const char*)memchr(level, '/', end - level);
+        auto level_end = slash ? slash : end;
+        for (auto c = level; c < level_end; c++) {
+            if (*c != '+' && *c != '#') {
+                continue;
+            }
+            if (!wildcards || level_end - level != 1 || (*c == '#' && slash)) {
+                return false;
+            }
+        }
+        if (!slash) {
+            return true;
+        }
+        level = slash + 1;
+    }
+}
+
+/// @brief length of the level starting at level, next is the level after it (NULL if it was the last one)
+static inline uint32_t kyros_pubsub_next_level(const char* level, const char* end, const char** next)
+{
+    auto slash = (const char*)memchr(level, '/', end - level);
+    *next = slash ? slash + 1 : NULL;
+    return (uint32_t)((slash ? slash : end) - level);
+}
+
+///
+/// Trie
+///
+
+static kyros_pubsub_node* kyros_pubsub_node_create(kyros_pubsub_node* parent, const char* name, uint32_t name_length)
+{
+    auto node = (kyros_pubsub_node*)kyros_calloc(1, sizeof(kyros_pubsub_node) + name_length);
+    node->parent = parent;
+    node->name_length = name_length;
+    if (name_length) {
+        memcpy(node->name, name, name_length);
+    }
+    return node;
+}
+
+static inline int32_t kyros_pubsub_node_compare(kyros_pubsub_node* node, const char* name, uint32_t name_length)
+{
+    auto length = node->name_length < name_length ? node->name_length : name_length;
+    auto result = length ? memcmp(node->name, name, length) : 0;
+    if (result) {
+        return result;
+    }
+    return node->name_length < name_length ? -1 : node->name_length > name_length;
+}
+
+/// @brief binary search of a named child, index is where it is (or where it would be inserted)
+static kyros_pubsub_node* kyros_pubsub_node_find(kyros_pubsub_node* node, const char* name, uint32_t name_length, uint32_t* index)
+{
+    uint32_t low = 0;
+    uint32_t high = node->child_count;
+    while (low < high) {
+        auto middle = low + (high - low) / 2;
+        auto result = kyros_pubsub_node_compare(node->children[middle], name, name_length);
+        if (!result) {
+            *index = middle;
+            return node->children[middle];
+        }
+        if (result < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    *index = low;
+    return NULL;
+}
+
+/// @brief node of a subscription level ("+" and "#" are the wildcard children), created if create is set
+static kyros_pubsub_node* kyros_pubsub_node_child(kyros_pubsub_node* node, const char* name, uint32_t name_length, bool create)
+{
+    if (name_length == 1 && (*name == '+' || *name == '#')) {
+        auto wildcard = *name == '+' ? &node->any : &node->rest;
+        if (!*wildcard && create) {
+            *wildcard = kyros_pubsub_node_create(node, name, 1);
+        }
+        return *wildcard;
+    }
+    uint32_t index;
+    auto child = kyros_pubsub_node_find(node, name, name_length, &index);
+    if (child || !create) {
+        return child;
+    }
+    if (node->child_count == node->child_capacity) {
+        node->child_capacity = node->child_capacity ? node->child_capacity * 2 : 4;
+        node->children = (kyros_pubsub_node**)kyros_resize(node->children, sizeof(kyros_pubsub_node*) * node->child_capacity);
+    }
+    memmove(node->children + index + 1, node->children + index, sizeof(kyros_pubsub_node*) * (node->child_count - index));
+    child = kyros_pubsub_node_create(node, name, name_length);
+    node->children[index] = child;
+    node->child_count++;
+    return child;
+}
+
+/// @brief node of a whole subscription topic
+static kyros_pubsub_node* kyros_pubsub_node_lookup(kyros_pubsub_node* root, const char* topic, uint32_t topic_length, bool create)
+{
+    auto end = topic + topic_length;
+    auto node = root;
+    const char* level = topic;
+    while (level && node) {
+        const char* next;
+        auto length = kyros_pubsub_next_level(level, end, &next);
+        node = kyros_pubsub_node_child(node, level, length, create);
+        level = next;
+    }
+    return node;
+}
+
+/// @brief free node and the levels above it that have nothing left (the root stays)
+static void kyros_pubsub_node_prune(kyros_pubsub_node* node)
+{
+    while (node->parent && !node->subscriptions && !node->child_count && !node->any && !node->rest) {
+        auto parent = node->parent;
+        if (parent->any == node) {
+            parent->any = NULL;
+        } else if (parent->rest == node) {
+            parent->rest = NULL;
+        } else {
+            uint32_t index;
+            kyros_pubsub_node_find(parent, node->name, node->name_length, &index);
+            memmove(parent->children + index, parent->children + index + 1, sizeof(kyros_pubsub_node*) * (parent->child_count - index - 1));
+            parent->child_count--;
+        }
+        if (node->children) {
+            kyros_free(node->children);
+        }
+        kyros_free(node);
+        node = parent;
+    }
+}
+
+///
+/// Subscriptions
+///
+
+static inline bool kyros_pubsub_takes_compressed(kyros_websocket* websocket)
+{
+    return websocket->compression && !websocket->send_uncompressed;
+}
+
+/// @brief entry of loop, created by its first subscription
+static kyros_pubsub_loop* kyros_pubsub_get_loop(kyros_pubsub* pubsub, kyros_loop* loop)
+{
+    uv_mutex_lock(&pubsub->lock);
+    for (uint32_t i = 0; i < pubsub->loop_count; i++) {
+        if (pubsub->loops[i]->loop == loop) {
+            auto entry = pubsub->loops[i];
+            uv_mutex_unlock(&pubsub->lock);
+            return entry;
+        }
+    }
+    if (pubsub->loop_count == pubsub->loop_capacity) {
+        pubsub->loop_capacity = pubsub->loop_capacity ? pubsub->loop_capacity * 2 : 4;
+        pubsub->loops = (kyros_pubsub_loop**)kyros_resize(pubsub->loops, sizeof(kyros_pubsub_loop*) * pubsub->loop_capacity);
+    }
+    auto entry = (kyros_pubsub_loop*)kyros_alloc(sizeof(kyros_pubsub_loop));
+    entry->pubsub = pubsub;
+    entry->loop = loop;
+    entry->root = kyros_pubsub_node_create(NULL, NULL, 0);
+    atomic_init(&entry->subscriptions, 0);
+    pubsub->loops[pubsub->loop_count++] = entry;
+    uv_mutex_unlock(&pubsub->lock);
+    return entry;
+}
+
+/// @brief unlink subscription from its node (pruning it) and update the counters, the websocket list is up to the caller
+static void kyros_pubsub_subscription_remove(kyros_pubsub_subscription* subscription)
+{
+    auto node = subscription->node;
+    if (subscription->prev) {
+        subscription->prev->next = subscription->next;
+    } else {
+        node->subscriptions = subscription->next;
+    }
+    if (subscription->next) {
+        subscription->next->prev = subscription->prev;
+    }
+    auto owner = subscription->owner;
+    atomic_fetch_sub_explicit(&owner->subscriptions, 1, memory_order_relaxed);
+    if (kyros_pubsub_takes_compressed(subscription->websocket)) {
+        atomic_fetch_sub_explicit(&owner->pubsub->compressed_subscriptions, 1, memory_order_relaxed);
+    }
+    kyros_pubsub_node_prune(node);
+    kyros_free(subscription);
+}
+
+void kyros_pubsub_remove_websocket(kyros_websocket* websocket)
+{
+    auto subscription = websocket->subscriptions;
+    websocket->subscriptions = NULL;
+    while (subscription) {
+        auto next = subscription->next_of_websocket;
+        kyros_pubsub_subscription_remove(subscription);
+        subscription = next;
+    }
+}
+
+///
+/// Publish
+///
+
+static void kyros_pubsub_collect(kyros_pubsub_collector* collector, kyros_pubsub_node* node)
+{
+    for (auto subscription = node->subscriptions; subscription; subscription = subscription->next) {
+        auto websocket = subscription->websocket;
+        if (websocket->collected) {
+            continue;
+        }
+        websocket->collected = true;
+        if (collector->count == collector->capacity) {
+            auto capacity = collector->capacity * 2;
+            auto grown = (kyros_websocket**)kyros_alloc(sizeof(kyros_websocket*) * capacity);
+            memcpy(grown, collector->websockets, sizeof(kyros_websocket*) * collector->count);
+            if (collector->capacity != KYROS_PUBSUB_STACK_SUBSCRIBERS) {
+                kyros_free(collector->websockets);
+            }
+            collector->websockets = grown;
+            collector->capacity = capacity;
+        }
+        collector->websockets[collector->count++] = websocket;
+    }
+}
+
+/// @brief subscribers of node matching the levels from level on (NULL when there are no more)
+static void kyros_pubsub_match(kyros_pubsub_collector* collector, kyros_pubsub_node* node, const char* level, const char* end)
+{
+    if (node->rest) {
+        // "#" takes whatever is left, nothing included
+        kyros_pubsub_collect(collector, node->rest);
+    }
+    if (!level) {
+        kyros_pubsub_collect(collector, node);
+        return;
+    }
+    const char* next;
+    auto length = kyros_pubsub_next_level(level, end, &next);
+    uint32_t index;
+    auto child = kyros_pubsub_node_find(node, level, length, &index);
+    if (child) {
+        kyros_pubsub_match(collector, child, next, end);
+    }
+    if (node->any) {
+        kyros_pubsub_match(collector, node->any, next, end);
+    }
+}
+
+/// @brief write message to the subscribers of its topic on the loop of target (its thread), returns how many
+static uint32_t kyros_pubsub_deliver(kyros_pubsub_loop* target, kyros_pubsub_message* message)
+{
+    kyros_websocket* stack[KYROS_PUBSUB_STACK_SUBSCRIBERS];
+    kyros_pubsub_collector collector = { .websockets = stack, .capacity = KYROS_PUBSUB_STACK_SUBSCRIBERS };
+    kyros_pubsub_match(&collector, target->root, message->topic, message->topic + message->topic_length);
+    // cleared before writing, a publish from a callback of the writes collects on its own
+    for (uint32_t i = 0; i < collector.count; i++) {
+        collector.websockets[i]->collected = false;
+    }
+    if (collector.count) {
+        kyros_websocket_broadcast(collector.websockets, collector.count, message->frame, message->compressed);
+    }
+    if (collector.websockets != stack) {
+        kyros_free(collector.websockets);
+    }
+    return collector.count;
+}
+
+static void kyros_pubsub_message_unref(kyros_pubsub_message* message)
+{
+    if (atomic_fetch_sub_explicit(&message->ref_count, 1, memory_order_acq_rel) != 1) {
+        return;
+    }
+    kyros_shared_buffer_unref(message->frame);
+    if (message->compressed) {
+        kyros_shared_buffer_unref(message->compressed);
+    }
+    kyros_free(message);
+}
+
+static void kyros_pubsub_hop_run(void* ctx)
+{
+    kyros_pubsub_hop* hop = ctx;
+    kyros_pubsub_deliver(hop->target, hop->message);
+    kyros_pubsub_message_unref(hop->message);
+    kyros_free(hop);
+}
+
+///
+/// Public API
+///
+
+kyros_pubsub* kyros_pubsub_create()
+{
+    auto pubsub = (kyros_pubsub*)kyros_calloc(1, sizeof(kyros_pubsub));
+    uv_mutex_init(&pubsub->lock);
+    atomic_init(&pubsub->compressed_subscriptions, 0);
+    return pubsub;
+}
+
+static void kyros_pubsub_node_destroy(kyros_pubsub_node* node)
+{
+    while (node->subscriptions) {
+        auto subscription = node->subscriptions;
+        node->subscriptions = subscription->next;
+        // the websocket keeps its subscriptions to other pubsubs
+        auto link = &subscription->websocket->subscriptions;
+        while (*link != subscription) {
+            link = &(*link)->next_of_websocket;
+        }
+        *link = subscription->next_of_websocket;
+        kyros_free(subscription);
+    }
+    for (uint32_t i = 0; i < node->child_count; i++) {
+        kyros_pubsub_node_destroy(node->children[i]);
+    }
+    if (node->any) {
+        kyros_pubsub_node_destroy(node->any);
+    }
+    if (node->rest) {
+        kyros_pubsub_node_destroy(node->rest);
+    }
+    if (node->children) {
+        kyros_free(node->children);
+    }
+    kyros_free(node);
+}
+
+void kyros_pubsub_destroy(kyros_pubsub* pubsub)
+{
+    for (uint32_t i = 0; i < pubsub->loop_count; i++) {
+        kyros_pubsub_node_destroy(pubsub->loops[i]->root);
+        kyros_free(pubsub->loops[i]);
+    }
+    if (pubsub->loops) {
+        kyros_free(pubsub->loops);
+    }
+    uv_mutex_destroy(&pubsub->lock);
+    kyros_free(pubsub);
+}
+
+bool kyros_pubsub_subscribe(kyros_pubsub* pubsub, kyros_websocket* websocket, const char* topic, uint32_t topic_length)
+{
+    // clients mask every frame with its own key, nothing they send can be shared
+    if (websocket->is_client || websocket->closed || !kyros_pubsub_topic_is_valid(topic, topic_length, true)) {
+        return false;
+    }
+    auto owner = kyros_pubsub_get_loop(pubsub, websocket->loop);
+    auto node = kyros_pubsub_node_lookup(owner->root, topic, topic_length, true);
+    for (auto subscription = websocket->subscriptions; subscription; subscription = subscription->next_of_websocket) {
+        if (subscription->node == node) {
+            return false;
+        }
+    }
+    auto subscription = (kyros_pubsub_subscription*)kyros_alloc(sizeof(kyros_pubsub_subscription));
+    *subscription = (kyros_pubsub_subscription) {
+        .owner = owner,
+        .node = node,
+        .websocket = websocket,
+        .next = node->subscriptions,
+        .next_of_websocket = websocket->subscriptions,
+    };
+    if (node->subscriptions) {
+        node->subscriptions->prev = subscription;
+    }
+    node->subscriptions = subscription;
+    websocket->subscriptions = subscription;
+    atomic_fetch_add_explicit(&owner->subscriptions, 1, memory_order_relaxed);
+    if (kyros_pubsub_takes_compressed(websocket)) {
+        atomic_fetch_add_explicit(&pubsub->compressed_subscriptions, 1, memory_order_relaxed);
+    }
+    return true;
+}
+
+bool kyros_pubsub_unsubscribe(kyros_pubsub* pubsub, kyros_websocket* websocket, const char* topic, uint32_t topic_length)
+{
+    if (!kyros_pubsub_topic_is_valid(topic, topic_length, true)) {
+        return false;
+    }
+    // the trie is the one of the loop entry of any subscription the websocket has to pubsub
+    auto subscription = websocket->subscriptions;
+    while (subscription && subscription->owner->pubsub != pubsub) {
+        subscription = subscription->next_of_websocket;
+    }
+    if (!subscription) {
+        return false;
+    }
+    auto node = kyros_pubsub_node_lookup(subscription->owner->root, topic, topic_length, false);
+    if (!node) {
+        return false;
+    }
+    for (auto link = &websocket->subscriptions; *link; link = &(*link)->next_of_websocket) {
+        auto subscription = *link;
+        if (subscription->node == node) {
+            *link = subscription->next_of_websocket;
+            kyros_pubsub_subscription_remove(subscription);
+            return true;
+        }
+    }
+    return false;
+}
+
+uint32_t kyros_pubsub_publish(kyros_pubsub* pubsub, kyros_loop* loop, const char* topic, uint32_t topic_length,
+    const char* data, uint64_t length, kyros_websocket_opcode opcode)
+{
+    if (!kyros_pubsub_topic_is_valid(topic, topic_length, false)) {
+        return 0;
+    }
+    auto message = (kyros_pubsub_message*)kyros_alloc(sizeof(kyros_pubsub_message) + topic_length);
+    atomic_init(&message->ref_count, 1);
+    message->frame = kyros_websocket_frame_shared(loop, data, length, opcode, false);
+    // the compressed frame is the same for every subscriber since the shared stream has no context
+    bool compress = atomic_load_explicit(&pubsub->compressed_subscriptions, memory_order_relaxed)
+        && length >= KYROS_WEBSOCKET_DEFLATE_MIN_SIZE && length <= UINT32_MAX;
+    message->compressed = compress ? kyros_websocket_frame_shared(loop, data, length, opcode, true) : NULL;
+    message->topic_length = topic_length;
+    if (topic_length) {
+        memcpy(message->topic, topic, topic_length);
+    }
+
+    kyros_pubsub_loop* local = NULL;
+    uv_mutex_lock(&pubsub->lock);
+    for (uint32_t i = 0; i < pubsub->loop_count; i++) {
+        auto entry = pubsub->loops[i];
+        if (entry->loop == loop) {
+            local = entry;
+            continue;
+        }
+        if (!atomic_load_explicit(&entry->subscriptions, memory_order_relaxed)) {
+            continue;
+        }
+        atomic_fetch_add_explicit(&message->ref_count, 1, memory_order_relaxed);
+        auto hop = (kyros_pubsub_hop*)kyros_alloc(sizeof(kyros_pubsub_hop));
+        hop->target = entry;
+        hop->message = message;
+        kyros_loop_atomic_defer(entry->loop, kyros_pubsub_hop_run, hop);
+    }
+    uv_mutex_unlock(&pubsub->lock);
+
+    uint32_t count = local ? kyros_pubsub_deliver(local, message) : 0;
+    kyros_pubsub_message_unref(message);
+    return count;
+}
@@ -0,0 +1,3354 @@
+#include <kyros.h>
+#include <kyros_internal.h>
+
+#include <string.h>
+
+// QUIC v1 (RFC 9000) on kyros udp sockets, the TLS handshake is driven through the QUIC API of BoringSSL
+// (SSL_QUIC_METHOD): it gives the traffic secrets and the handshake bytes, the packets are built here
+// connections build their datagrams in the loop hooks (quic_sends) right before the udp batches are flushed,
+// every deadline of a connection (loss, ack delay, idle, pacing, close) shares one timer wheel entry
+
+#ifdef OPENSSL_IS_BORINGSSL
+#include <openssl/rand.h>
+
+#define KYROS_QUIC_VERSION 0x00000001
+#define KYROS_QUIC_MAX_UDP_PAYLOAD 1472 // max_udp_payload_size we advertise, an ethernet MTU
+#define KYROS_QUIC_MIN_PACKET 64 // room a packet needs to be worth building (header, tag and a few frames)
+#define KYROS_QUIC_ACK_DELAY_EXPONENT 3 // the default, not sent
+
+typedef enum {
+    KYROS_QUIC_PACKET_INITIAL = 0,
+    KYROS_QUIC_PACKET_0RTT = 1,
+    KYROS_QUIC_PACKET_HANDSHAKE = 2,
+    KYROS_QUIC_PACKET_RETRY = 3,
+} kyros_quic_packet_type;
+
+typedef enum {
+    KYROS_QUIC_FRAME_PADDING = 0x00,
+    KYROS_QUIC_FRAME_PING = 0x01,
+    KYROS_QUIC_FRAME_ACK = 0x02,
+    KYROS_QUIC_FRAME_ACK_ECN = 0x03,
+    KYROS_QUIC_FRAME_RESET_STREAM = 0x04,
+    KYROS_QUIC_FRAME_STOP_SENDING = 0x05,
+    KYROS_QUIC_FRAME_CRYPTO = 0x06,
+    KYROS_QUIC_FRAME_NEW_TOKEN = 0x07,
+    KYROS_QUIC_FRAME_STREAM = 0x08, // to 0x0f, OFF (0x04), LEN (0x02) and FIN (0x01) bits
+    KYROS_QUIC_FRAME_MAX_DATA = 0x10,
+    KYROS_QUIC_FRAME_MAX_STREAM_DATA = 0x11,
+    KYROS_QUIC_FRAME_MAX_STREAMS_BIDI = 0x12,
+    KYROS_QUIC_FRAME_MAX_STREAMS_UNI = 0x13,
+    KYROS_QUIC_FRAME_DATA_BLOCKED = 0x14,
+    KYROS_QUIC_FRAME_STREAM_DATA_BLOCKED = 0x15,
+    KYROS_QUIC_FRAME_STREAMS_BLOCKED_BIDI = 0x16,
+    KYROS_QUIC_FRAME_STREAMS_BLOCKED_UNI = 0x17,
+    KYROS_QUIC_FRAME_NEW_CONNECTION_ID = 0x18,
+    KYROS_QUIC_FRAME_RETIRE_CONNECTION_ID = 0x19,
+    KYROS_QUIC_FRAME_PATH_CHALLENGE = 0x1a,
+    KYROS_QUIC_FRAME_PATH_RESPONSE = 0x1b,
+    KYROS_QUIC_FRAME_CONNECTION_CLOSE = 0x1c,
+    KYROS_QUIC_FRAME_CONNECTION_CLOSE_APPLICATION = 0x1d,
+    KYROS_QUIC_FRAME_HANDSHAKE_DONE = 0x1e,
+} kyros_quic_frame_type;
+
+// transport error codes (RFC 9000 20.1), 0 is also the success of the frame handlers
+typedef enum {
+    KYROS_QUIC_NO_ERROR = 0x0,
+    KYROS_QUIC_INTERNAL_ERROR = 0x1,
+    KYROS_QUIC_CONNECTION_REFUSED = 0x2,
+    KYROS_QUIC_FLOW_CONTROL_ERROR = 0x3,
+    KYROS_QUIC_STREAM_LIMIT_ERROR = 0x4,
+    KYROS_QUIC_STREAM_STATE_ERROR = 0x5,
+    KYROS_QUIC_FINAL_SIZE_ERROR = 0x6,
+    KYROS_QUIC_FRAME_ENCODING_ERROR = 0x7,
+    KYROS_QUIC_TRANSPORT_PARAMETER_ERROR = 0x8,
+    KYROS_QUIC_CONNECTION_ID_LIMIT_ERROR = 0x9,
+    KYROS_QUIC_PROTOCOL_VIOLATION = 0xa,
+    KYROS_QUIC_APPLICATION_ERROR = 0xc,
+    KYROS_QUIC_CRYPTO_BUFFER_EXCEEDED = 0xd,
+    KYROS_QUIC_CRYPTO_ERROR = 0x100, // plus the TLS alert
+} kyros_quic_error;
+
+static void kyros_quic_queue_send(kyros_quic_connection* connection);
+static void kyros_quic_set_timer(kyros_quic_connection* connection);
+static void kyros_quic_fail(kyros_quic_connection* connection, uint64_t error_code, const char* reason);
+
+static inline uint64_t kyros_quic_now()
+{
+    return uv_hrtime() / 1000;
+}
+
+static inline uint64_t kyros_quic_min(uint64_t a, uint64_t b)
+{
+    return a < b ? a : b;
+}
+
+static inline uint32_t kyros_quic_read_u32(const uint8_t* data)
+{
+    return ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) | ((uint32_t)data[2] << 8) | data[3];
+}
+
+static inline uint8_t* kyros_quic_write_u32(uint8_t* out, uint32_t value)
+{
+    out[0] = (uint8_t)(value >> 24);
+    out[1] = (uint8_t)(value >> 16);
+    out[2] = (uint8_t)(value >> 8);
+    out[3] = (uint8_t)value;
+    return out + 4;
+}
+
+static bool kyros_quic_same_address(const struct sockaddr* a, const struct sockaddr* b)
+{
+    if (a->sa_family != b->sa_family) {
+        return false;
+    }
+    if (a->sa_family == AF_INET) {
+        auto a4 = (const struct sockaddr_in*)a;
+        auto b4 = (const struct sockaddr_in*)b;
+        return a4->sin_port == b4->sin_port && a4->sin_addr.s_addr == b4->sin_addr.s_addr;
+    }
+    auto a6 = (const struct sockaddr_in6*)a;
+    auto b6 = (const struct sockaddr_in6*)b;
+    return a6->sin6_port == b6->sin6_port && memcmp(&a6->sin6_addr, &b6->sin6_addr, sizeof(struct in6_addr)) == 0;
+}
+
+static inline kyros_socket_internal_udp* kyros_quic_endpoint_udp(kyros_quic_endpoint* endpoint)
+{
+    return (kyros_socket_internal_udp*)kyros_get_socket_internal(endpoint->socket);
+}
+
+///
+/// Connection ids
+///
+
+// keyed by the endpoint secret, clients pick the original ids
+static uint32_t kyros_quic_cid_hash(kyros_quic_endpoint* endpoint, const uint8_t* id, uint8_t length)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (uint32_t i = 0; i < 8; i++) {
+        hash = (hash ^ endpoint->secret[i]) * 1099511628211ULL;
+    }
+    for (uint32_t i = 0; i < length; i++) {
+        hash = (hash ^ id[i]) * 1099511628211ULL;
+    }
+    return (uint32_t)(hash ^ (hash >> 32));
+}
+
+static kyros_quic_connection* kyros_quic_cid_find(kyros_quic_endpoint* endpoint, const uint8_t* id, uint8_t length)
+{
+    if (!endpoint->cids) {
+        return NULL;
+    }
+    for (auto slot = kyros_quic_cid_hash(endpoint, id, length) & endpoint->cid_mask;; slot = (slot + 1) & endpoint->cid_mask) {
+        auto entry = &endpoint->cids[slot];
+        if (!entry->connection) {
+            return NULL;
+        }
+        if (entry->length == length && memcmp(entry->id, id, length) == 0) {
+            return entry->connection;
+        }
+    }
+}
+
+static void kyros_quic_cid_place(kyros_quic_endpoint* endpoint, kyros_quic_cid_entry entry)
+{
+    auto slot = kyros_quic_cid_hash(endpoint, entry.id, entry.length) & endpoint->cid_mask;
+    while (endpoint->cids[slot].connection) {
+        slot = (slot + 1) & endpoint->cid_mask;
+    }
+    endpoint->cids[slot] = entry;
+}
+
+static void kyros_quic_cid_insert(kyros_quic_endpoint* endpoint, const uint8_t* id, uint8_t length, kyros_quic_connection* connection)
+{
+    // at most half full
+    if ((endpoint->cid_count + 1) * 2 > endpoint->cid_mask + 1 || !endpoint->cids) {
+        auto old = endpoint->cids;
+        uint32_t old_capacity = old ? endpoint->cid_mask + 1 : 0;
+        uint32_t capacity = old ? old_capacity * 2 : 64;
+        endpoint->cids = kyros_calloc(capacity, sizeof(kyros_quic_cid_entry));
+        endpoint->cid_mask = capacity - 1;
+        for (uint32_t i = 0; i < old_capacity; i++) {
+            if (old[i].connection) {
+                kyros_quic_cid_place(endpoint, old[i]);
+            }
+        }
+        kyros_free(old);
+    }
+    kyros_quic_cid_entry entry = { .connection = connection, .length = length };
+    memcpy(entry.id, id, length);
+    kyros_quic_cid_place(endpoint, entry);
+    endpoint->cid_count++;
+}
+
+/// @brief only if the id routes to connection
+static void kyros_quic_cid_remove(kyros_quic_endpoint* endpoint, const uint8_t* id, uint8_t length, kyros_quic_connection* connection)
+{
+    if (!endpoint->cids) {
+        return;
+    }
+    auto mask = endpoint->cid_mask;
+    auto slot = kyros_quic_cid_hash(endpoint, id, length) & mask;
+    while (true) {
+        auto entry = &endpoint->cids[slot];
+        if (!entry->connection) {
+            return;
+        }
+        if (entry->length == length && memcmp(entry->id, id, length) == 0) {
+            if (entry->connection != connection) {
+                return;
+            }
+            break;
+        }
+        slot = (slot + 1) & mask;
+    }
+    // backward shift, the entries after it that would not be found anymore move into the hole
+    auto hole = slot;
+    for (auto next = (hole + 1) & mask; endpoint->cids[next].connection; next = (next + 1) & mask) {
+        auto home = kyros_quic_cid_hash(endpoint, endpoint->cids[next].id, endpoint->cids[next].length) & mask;
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            endpoint->cids[hole] = endpoint->cids[next];
+            hole = next;
+        }
+    }
+    endpoint->cids[hole] = (kyros_quic_cid_entry) { 0 };
+    endpoint->cid_count--;
+}
+
+static void kyros_quic_issue_cid(kyros_quic_connection* connection, kyros_quic_local_cid* cid)
+{
+    RAND_bytes(cid->id, KYROS_QUIC_CID_LENGTH);
+    cid->sequence = connection->next_cid_sequence++;
+    cid->active = true;
+    cid->pending = cid->sequence > 0;
+    kyros_quic_cid_insert(connection->endpoint, cid->id, KYROS_QUIC_CID_LENGTH, connection);
+}
+
+/// @brief NEW_CONNECTION_ID up to the limit of the peer, so it has spare ids to migrate with
+static void kyros_quic_issue_cids(kyros_quic_connection* connection)
+{
+    auto limit = kyros_quic_min(connection->peer_params.active_connection_id_limit, KYROS_QUIC_ACTIVE_CIDS);
+    uint32_t active = 0;
+    for (uint32_t i = 0; i < KYROS_QUIC_ACTIVE_CIDS; i++) {
+        active += connection->cids[i].active;
+    }
+    for (uint32_t i = 0; i < KYROS_QUIC_ACTIVE_CIDS && active < limit; i++) {
+        if (!connection->cids[i].active) {
+            kyros_quic_issue_cid(connection, &connection->cids[i]);
+            active++;
+        }
+    }
+}
+
+/// @brief the peer id packets are sent to, the first one not retired
+static kyros_quic_peer_cid* kyros_quic_current_peer_cid(kyros_quic_connection* connection)
+{
+    return &connection->peer_cids[connection->peer_cid_current];
+}
+
+static void kyros_quic_peer_cid_switch(kyros_quic_connection* connection)
+{
+    for (uint32_t i = 0; i < connection->peer_cid_count; i++) {
+        if (!connection->peer_cids[i].retired) {
+            connection->peer_cid_current = i;
+            return;
+        }
+    }
+}
+
+///
+/// Buffers
+///
+
+static void kyros_quic_send_buffer_append(kyros_quic_send_buffer* buffer, const char* data, uint64_t length)
+{
+    if (!length) {
+        return;
+    }
+    if (buffer->end - buffer->origin + length > buffer->capacity) {
+        // drop what was acknowledged before growing
+        uint64_t live = buffer->end - buffer->base;
+        if (buffer->base > buffer->origin) {
+            memmove(buffer->data, buffer->data + (buffer->base - buffer->origin), live);
+            buffer->origin = buffer->base;
+        }
+        if (live + length > buffer->capacity) {
+            uint64_t capacity = buffer->capacity ? buffer->capacity * 2 : 4096;
+            while (capacity < live + length) {
+                capacity *= 2;
+            }
+            buffer->data = kyros_resize(buffer->data, capacity);
+            buffer->capacity = capacity;
+        }
+    }
+    memcpy(buffer->data + (buffer->end - buffer->origin), data, length);
+    buffer->end += length;
+}
+
+static inline const char* kyros_quic_send_buffer_at(kyros_quic_send_buffer* buffer, uint64_t offset)
+{
+    return buffer->data + (offset - buffer->origin);
+}
+
+static void kyros_quic_send_buffer_on_acked(kyros_quic_send_buffer* buffer, uint64_t offset, uint64_t length)
+{
+    kyros_quic_ranges_remove(&buffer->lost, offset, offset + length);
+    if (offset + length <= buffer->base) {
+        return;
+    }
+    kyros_quic_ranges_add(&buffer->acked, offset, offset + length);
+    auto acked = &buffer->acked;
+    if (acked->count && acked->items[0][0] <= buffer->base) {
+        buffer->base = acked->items[0][1];
+        kyros_quic_ranges_remove(acked, 0, buffer->base);
+    }
+}
+
+static void kyros_quic_send_buffer_on_lost(kyros_quic_send_buffer* buffer, uint64_t offset, uint64_t length)
+{
+    uint64_t start = offset > buffer->base ? offset : buffer->base;
+    if (start >= offset + length) {
+        return;
+    }
+    kyros_quic_ranges_add(&buffer->lost, start, offset + length);
+    // parts acknowledged by another packet are not sent again
+    for (uint32_t i = 0; i < buffer->acked.count; i++) {
+        kyros_quic_ranges_remove(&buffer->lost, buffer->acked.items[i][0], buffer->acked.items[i][1]);
+    }
+}
+
+static inline bool kyros_quic_send_buffer_pending(kyros_quic_send_buffer* buffer)
+{
+    return buffer->lost.count || buffer->next < buffer->end;
+}
+
+static void kyros_quic_send_buffer_free(kyros_quic_send_buffer* buffer)
+{
+    kyros_free(buffer->data);
+    kyros_quic_ranges_free(&buffer->acked);
+    kyros_quic_ranges_free(&buffer->lost);
+}
+
+static void kyros_quic_recv_buffer_insert(kyros_quic_recv_buffer* buffer, uint64_t offset, const uint8_t* data, uint64_t length)
+{
+    uint64_t end = offset + length;
+    if (end <= buffer->base) {
+        return;
+    }
+    if (offset < buffer->base) {
+        data += buffer->base - offset;
+        offset = buffer->base;
+    }
+    if (end - buffer->base > buffer->capacity) {
+        uint64_t capacity = buffer->capacity ? buffer->capacity * 2 : 4096;
+        while (capacity < end - buffer->base) {
+            capacity *= 2;
+        }
+        buffer->data = kyros_resize(buffer->data, capacity);
+        buffer->capacity = capacity;
+    }
+    memcpy(buffer->data + (offset - buffer->base), data, end - offset);
+    kyros_quic_ranges_add(&buffer->ranges, offset, end);
+}
+
+/// @brief contiguous bytes at data[0]
+static inline uint64_t kyros_quic_recv_buffer_readable(kyros_quic_recv_buffer* buffer)
+{
+    auto ranges = &buffer->ranges;
+    return ranges->count && ranges->items[0][0] == buffer->base ? ranges->items[0][1] - buffer->base : 0;
+}
+
+static void kyros_quic_recv_buffer_consume(kyros_quic_recv_buffer* buffer, uint64_t length)
+{
+    auto ranges = &buffer->ranges;
+    uint64_t highest = ranges->count ? ranges->items[ranges->count - 1][1] : buffer->base;
+    if (highest > buffer->base + length) {
+        memmove(buffer->data, buffer->data + length, highest - buffer->base - length);
+    }
+    buffer->base += length;
+    kyros_quic_ranges_remove(ranges, 0, buffer->base);
+}
+
+static void kyros_quic_recv_buffer_free(kyros_quic_recv_buffer* buffer)
+{
+    kyros_free(buffer->data);
+    kyros_quic_ranges_free(&buffer->ranges);
+}
+
+///
+/// Streams
+///
+
+static inline bool kyros_quic_stream_is_local(kyros_quic_connection* connection, uint64_t id)
+{
+    return (id & 1) == (connection->is_client ? 0 : 1);
+}
+
+static inline uint32_t kyros_quic_stream_slot(uint64_t id, uint32_t mask)
+{
+    return (uint32_t)(((id >> 2) * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+}
+
+static kyros_quic_stream* kyros_quic_stream_find(kyros_quic_connection* connection, uint64_t id)
+{
+    if (!connection->streams) {
+        return NULL;
+    }
+    auto mask = connection->stream_mask;
+    for (auto slot = kyros_quic_stream_slot(id, mask);; slot = (slot + 1) & mask) {
+        auto stream = connection->streams[slot];
+        if (!stream || stream->id == id) {
+            return stream;
+        }
+    }
+}
+
+static void kyros_quic_stream_place(kyros_quic_connection* connection, kyros_quic_stream* stream)
+{
+    auto slot = kyros_quic_stream_slot(stream->id, connection->stream_mask);
+    while (connection->streams[slot]) {
+        slot = (slot + 1) & connection->stream_mask;
+    }
+    connection->streams[slot] = stream;
+}
+
+static kyros_quic_stream* kyros_quic_stream_create(kyros_quic_connection* connection, uint64_t id)
+{
+    if (!connection->streams || (connection->stream_count + 1) * 2 > connection->stream_mask + 1) {
+        auto old = connection->streams;
+        uint32_t old_capacity = old ? connection->stream_mask + 1 : 0;
+        uint32_t capacity = old ? old_capacity * 2 : 16;
+        connection->streams = kyros_calloc(capacity, sizeof(kyros_quic_stream*));
+        connection->stream_mask = capacity - 1;
+        for (uint32_t i = 0; i < old_capacity; i++) {
+            if (old[i]) {
+                kyros_quic_stream_place(connection, old[i]);
+            }
+        }
+        kyros_free(old);
+    }
+    kyros_quic_stream* stream = kyros_calloc(1, sizeof(kyros_quic_stream));
+    stream->id = id;
+    bool local = kyros_quic_stream_is_local(connection, id);
+    bool uni = id & 2;
+    stream->has_send = !uni || local;
+    stream->has_recv = !uni || !local;
+    stream->final_size = UINT64_MAX;
+    // the limits of the peer are named from its side, bidi_remote is for the streams we open
+    auto params = &connection->peer_params;
+    if (stream->has_send) {
+        stream->send_max = uni ? params->initial_max_stream_data_uni
+            : local            ? params->initial_max_stream_data_bidi_remote
+                               : params->initial_max_stream_data_bidi_local;
+    }
+    stream->recv_max = connection->options.max_stream_data;
+    kyros_quic_stream_place(connection, stream);
+    connection->stream_count++;
+    return stream;
+}
+
+static void kyros_quic_stream_unlink(kyros_quic_connection* connection, kyros_quic_stream* stream)
+{
+    if (!stream->queued) {
+        return;
+    }
+    if (stream->send_prev) {
+        stream->send_prev->send_next = stream->send_next;
+    } else {
+        connection->send_head = stream->send_next;
+    }
+    if (stream->send_next) {
+        stream->send_next->send_prev = stream->send_prev;
+    } else {
+        connection->send_tail = stream->send_prev;
+    }
+    stream->send_prev = NULL;
+    stream->send_next = NULL;
+    stream->queued = false;
+}
+
+/// @brief in the send list (at its tail) for its data and control frames
+static void kyros_quic_stream_queue(kyros_quic_connection* connection, kyros_quic_stream* stream)
+{
+    if (stream->queued) {
+        return;
+    }
+    stream->queued = true;
+    stream->send_prev = connection->send_tail;
+    if (connection->send_tail) {
+        connection->send_tail->send_next = stream;
+    } else {
+        connection->send_head = stream;
+    }
+    connection->send_tail = stream;
+    kyros_quic_queue_send(connection);
+}
+
+static void kyros_quic_stream_free(kyros_quic_stream* stream)
+{
+    kyros_quic_send_buffer_free(&stream->send);
+    kyros_quic_recv_buffer_free(&stream->recv);
+    kyros_free(stream);
+}
+
+static void kyros_quic_stream_remove(kyros_quic_connection* connection, kyros_quic_stream* stream)
+{
+    kyros_quic_stream_unlink(connection, stream);
+    auto mask = connection->stream_mask;
+    auto slot = kyros_quic_stream_slot(stream->id, mask);
+    while (connection->streams[slot] != stream) {
+        slot = (slot + 1) & mask;
+    }
+    auto hole = slot;
+    for (auto next = (hole + 1) & mask; connection->streams[next]; next = (next + 1) & mask) {
+        auto home = kyros_quic_stream_slot(connection->streams[next]->id, mask);
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            connection->streams[hole] = connection->streams[next];
+            hole = next;
+        }
+    }
+    connection->streams[hole] = NULL;
+    connection->stream_count--;
+}
+
+/// @brief frees the stream once both of its sides are done, a closed peer stream lets the peer open one more
+static void kyros_quic_stream_check_done(kyros_quic_connection* connection, kyros_quic_stream* stream)
+{
+    bool send_done = !stream->has_send || stream->fin_acked || stream->reset_acked;
+    bool recv_done = !stream->has_recv || stream->recv_done;
+    if (!send_done || !recv_done) {
+        return;
+    }
+    kyros_quic_stream_remove(connection, stream);
+    if (!kyros_quic_stream_is_local(connection, stream->id)) {
+        uint32_t uni = (stream->id >> 1) & 1;
+        uint64_t limit = uni ? connection->options.max_streams_uni : connection->options.max_streams_bidi;
+        uint64_t max = ++connection->peer_streams_closed[uni] + limit;
+        // MAX_STREAMS once half of the limit was used
+        if (max - connection->peer_max_streams[uni] >= (limit + 1) / 2) {
+            connection->peer_max_streams[uni] = max;
+            if (uni) {
+                connection->max_streams_pending_uni = true;
+            } else {
+                connection->max_streams_pending_bidi = true;
+            }
+            kyros_quic_queue_send(connection);
+        }
+    }
+    kyros_quic_stream_free(stream);
+}
+
+/// @brief stream a frame of the peer refers to, peer streams below it are opened too (RFC 9000 3.2)
+/// NULL with *error 0 if the stream is already closed
+static kyros_quic_stream* kyros_quic_stream_get(kyros_quic_connection* connection, uint64_t id, uint64_t* error)
+{
+    *error = KYROS_QUIC_NO_ERROR;
+    auto stream = kyros_quic_stream_find(connection, id);
+    if (stream) {
+        return stream;
+    }
+    uint32_t uni = (id >> 1) & 1;
+    uint64_t count = (id >> 2) + 1;
+    if (kyros_quic_stream_is_local(connection, id)) {
+        if (count > connection->local_streams[uni]) {
+            *error = KYROS_QUIC_STREAM_STATE_ERROR;
+        }
+        return NULL;
+    }
+    if (count <= connection->peer_streams[uni]) {
+        return NULL;
+    }
+    if (count > connection->peer_max_streams[uni]) {
+        *error = KYROS_QUIC_STREAM_LIMIT_ERROR;
+        return NULL;
+    }
+    for (uint64_t i = connection->peer_streams[uni]; i < count; i++) {
+        stream = kyros_quic_stream_create(connection, (i << 2) | (id & 3));
+    }
+    connection->peer_streams[uni] = count;
+    return stream;
+}
+
+/// @brief n bytes of stream were delivered (or dropped), MAX_DATA and MAX_STREAM_DATA move the windows once half is used
+static void kyros_quic_credit(kyros_quic_connection* connection, kyros_quic_stream* stream, uint64_t n)
+{
+    connection->recv_consumed += n;
+    auto window = connection->options.max_data;
+    if (connection->recv_max_data - connection->recv_consumed < window / 2) {
+        connection->recv_max_data = connection->recv_consumed + window;
+        connection->max_data_pending = true;
+        kyros_quic_queue_send(connection);
+    }
+    if (stream && stream->final_size == UINT64_MAX && !stream->recv_done) {
+        auto stream_window = connection->options.max_stream_data;
+        if (stream->recv_max - stream->recv.base < stream_window / 2) {
+            stream->recv_max = stream->recv.base + stream_window;
+            stream->max_data_pending = true;
+            kyros_quic_stream_queue(connection, stream);
+        }
+    }
+}
+
+///
+/// Spaces
+///
+
+static inline kyros_quic_sent_packet* kyros_quic_sent_get(kyros_quic_space* space, uint64_t packet_number)
+{
+    if (packet_number < space->sent_first || packet_number - space->sent_first >= space->sent_count) {
+        return NULL;
+    }
+    return &space->sent[(space->sent_head + (packet_number - space->sent_first)) & (space->sent_capacity - 1)];
+}
+
+/// @brief packet numbers are consecutive, so they index the ring from sent_first
+static kyros_quic_sent_packet* kyros_quic_sent_push(kyros_quic_space* space, uint64_t packet_number)
+{
+    if (!space->sent_count) {
+        space->sent_first = packet_number;
+    }
+    if (space->sent_count == space->sent_capacity) {
+        uint32_t capacity = space->sent_capacity ? space->sent_capacity * 2 : 64;
+        kyros_quic_sent_packet* sent = kyros_alloc(sizeof(kyros_quic_sent_packet) * capacity);
+        for (uint32_t i = 0; i < space->sent_count; i++) {
+            sent[i] = space->sent[(space->sent_head + i) & (space->sent_capacity - 1)];
+        }
+        kyros_free(space->sent);
+        space->sent = sent;
+        space->sent_head = 0;
+        space->sent_capacity = capacity;
+    }
+    auto packet = &space->sent[(space->sent_head + space->sent_count) & (space->sent_capacity - 1)];
+    space->sent_count++;
+    memset(packet, 0, offsetof(kyros_quic_sent_packet, frames));
+    return packet;
+}
+
+static void kyros_quic_sent_trim(kyros_quic_space* space)
+{
+    while (space->sent_count && space->sent[space->sent_head].settled) {
+        space->sent_head = (space->sent_head + 1) & (space->sent_capacity - 1);
+        space->sent_first++;
+        space->sent_count--;
+    }
+}
+
+/// @brief the keys of the space are dropped (RFC 9001 4.9), so are its packets in flight
+static void kyros_quic_discard_space(kyros_quic_connection* connection, kyros_quic_space_id id)
+{
+    auto space = &connection->spaces[id];
+    if (space->discarded) {
+        return;
+    }
+    space->discarded = true;
+    for (uint32_t i = 0; i < space->sent_count; i++) {
+        auto packet = &space->sent[(space->sent_head + i) & (space->sent_capacity - 1)];
+        if (!packet->settled && packet->in_flight) {
+            connection->bytes_in_flight -= kyros_quic_min(packet->size, connection->bytes_in_flight);
+        }
+    }
+    kyros_free(space->sent);
+    space->sent = NULL;
+    space->sent_count = 0;
+    space->sent_capacity = 0;
+    kyros_quic_keys_free(space->read_keys);
+    kyros_quic_keys_free(space->write_keys);
+    space->read_keys = NULL;
+    space->write_keys = NULL;
+    kyros_quic_send_buffer_free(&space->crypto_send);
+    kyros_quic_recv_buffer_free(&space->crypto_recv);
+    kyros_quic_ranges_free(&space->received);
+    space->crypto_send = (kyros_quic_send_buffer) { 0 };
+    space->crypto_recv = (kyros_quic_recv_buffer) { 0 };
+    space->loss_time = 0;
+    space->ack_eliciting_in_flight = 0;
+    space->ack_pending = false;
+    space->probe = false;
+    connection->pto_count = 0;
+}
+
+///
+/// Closing
+///
+
+static void kyros_quic_notify_close(kyros_quic_connection* connection, uint64_t code, bool application, const char* reason, uint32_t reason_length)
+{
+    if (connection->onclose_called) {
+        return;
+    }
+    connection->onclose_called = true;
+    // servers only hear about the connections they got an onopen for
+    if ((connection->is_client || connection->opened) && connection->handler.onclose) {
+        connection->handler.onclose(connection, code, application, reason, reason_length, connection->handler.ctx);
+    }
+}
+
+static uint64_t kyros_quic_closing_period(kyros_quic_connection* connection)
+{
+    return 3 * kyros_quic_pto_duration(connection, KYROS_QUIC_SPACE_APPLICATION);
+}
+
+/// @brief CONNECTION_CLOSE is sent, and again for what is received during 3 PTO
+static void kyros_quic_close_with(kyros_quic_connection* connection, uint64_t code, bool application, const char* reason, uint32_t reason_length)
+{
+    if (connection->state >= KYROS_QUIC_STATE_CLOSING) {
+        return;
+    }
+    connection->state = KYROS_QUIC_STATE_CLOSING;
+    connection->close_code = code;
+    connection->close_application = application;
+    connection->close_reason_length = reason_length < sizeof(connection->close_reason) ? reason_length : sizeof(connection->close_reason);
+    if (reason_length) {
+        memcpy(connection->close_reason, reason, connection->close_reason_length);
+    }
+    connection->close_pending = true;
+    connection->loss_deadline = 0;
+    connection->ack_deadline = 0;
+    connection->idle_deadline = 0;
+    connection->pacing_deadline = 0;
+    connection->close_deadline = kyros_quic_now() + kyros_quic_closing_period(connection);
+    kyros_quic_queue_send(connection);
+    kyros_quic_set_timer(connection);
+    kyros_quic_notify_close(connection, code, application, reason, reason_length);
+}
+
+static void kyros_quic_fail(kyros_quic_connection* connection, uint64_t error_code, const char* reason)
+{
+    kyros_quic_close_with(connection, error_code, false, reason, (uint32_t)strlen(reason));
+}
+
+/// @brief nothing is sent anymore, the connection is freed by its timer (right away if immediately)
+static void kyros_quic_drain(kyros_quic_connection* connection, uint64_t code, bool application, const char* reason, uint32_t reason_length, bool immediately)
+{
+    if (connection->state == KYROS_QUIC_STATE_DRAINING) {
+        return;
+    }
+    auto now = kyros_quic_now();
+    connection->state = KYROS_QUIC_STATE_DRAINING;
+    connection->close_pending = false;
+    connection->loss_deadline = 0;
+    connection->ack_deadline = 0;
+    connection->idle_deadline = 0;
+    connection->pacing_deadline = 0;
+    auto deadline = immediately ? now : now + kyros_quic_closing_period(connection);
+    if (!connection->close_deadline || deadline < connection->close_deadline) {
+        connection->close_deadline = deadline;
+    }
+    kyros_quic_set_timer(connection);
+    kyros_quic_notify_close(connection, code, application, reason, reason_length);
+}
+
+static void kyros_quic_endpoint_release(kyros_quic_endpoint* endpoint)
+{
+    if (--endpoint->ref_count) {
+        return;
+    }
+    // the socket could have closed itself on an error, our reference keeps it valid until here
+    kyros_socket_close(endpoint->socket);
+    kyros_socket_unref(endpoint->socket);
+    kyros_free(endpoint->cids);
+    kyros_free(endpoint);
+}
+
+static void kyros_quic_connection_free(kyros_quic_connection* connection)
+{
+    auto endpoint = connection->endpoint;
+    auto internal = kyros_get_internal_loop(endpoint->loop);
+    kyros_timer_wheel_remove(&internal->timer_wheel, &connection->timer);
+    if (connection->send_queued) {
+        for (auto link = &internal->quic_sends; *link; link = &(*link)->send_next) {
+            if (*link == connection) {
+                *link = connection->send_next;
+                break;
+            }
+        }
+    }
+    for (uint32_t i = 0; i < KYROS_QUIC_ACTIVE_CIDS; i++) {
+        if (connection->cids[i].active) {
+            kyros_quic_cid_remove(endpoint, connection->cids[i].id, KYROS_QUIC_CID_LENGTH, connection);
+        }
+    }
+    if (!connection->is_client) {
+        kyros_quic_cid_remove(endpoint, connection->original_dcid, connection->original_dcid_length, connection);
+    }
+    if (connection->prev) {
+        connection->prev->next = connection->next;
+    } else {
+        endpoint->connections = connection->next;
+    }
+    if (connection->next) {
+        connection->next->prev = connection->prev;
+    }
+    for (uint32_t i = 0; connection->streams && i <= connection->stream_mask; i++) {
+        if (connection->streams[i]) {
+            kyros_quic_stream_free(connection->streams[i]);
+        }
+    }
+    kyros_free(connection->streams);
+    for (uint32_t i = 0; i < KYROS_QUIC_SPACES; i++) {
+        kyros_quic_discard_space(connection, i);
+    }
+    kyros_quic_keys_free(connection->read_keys_previous);
+    kyros_quic_keys_free(connection->read_keys_next);
+    SSL_free(connection->ssl);
+    kyros_free(connection);
+    kyros_quic_endpoint_release(endpoint);
+}
+
+///
+/// Timer
+///
+
+static void kyros_quic_set_timer(kyros_quic_connection* connection)
+{
+    uint64_t deadline = 0;
+    uint64_t deadlines[] = { connection->loss_deadline, connection->ack_deadline, connection->idle_deadline, connection->pacing_deadline,
+        connection->close_deadline };
+    for (uint32_t i = 0; i < sizeof(deadlines) / sizeof(deadlines[0]); i++) {
+        if (deadlines[i] && (!deadline || deadlines[i] < deadline)) {
+            deadline = deadlines[i];
+        }
+    }
+    auto wheel = &kyros_get_internal_loop(connection->endpoint->loop)->timer_wheel;
+    if (!deadline) {
+        kyros_timer_wheel_remove(wheel, &connection->timer);
+        return;
+    }
+    auto now = kyros_quic_now();
+    kyros_timer_wheel_insert(wheel, &connection->timer, deadline > now ? (deadline - now + 999) / 1000 : 0);
+}
+
+/// @brief a packet was received or an ack-eliciting one sent since, the idle timeout starts again (RFC 9000 10.1)
+static void kyros_quic_restart_idle(kyros_quic_connection* connection, uint64_t now)
+{
+    // at least 3 PTO so probes can be answered
+    auto timeout = connection->idle_timeout;
+    auto pto = 3 * kyros_quic_pto_duration(connection, KYROS_QUIC_SPACE_APPLICATION);
+    connection->idle_deadline = now + (timeout > pto ? timeout : pto);
+}
+
+///
+/// Loss detection
+///
+
+static void kyros_quic_on_frame_lost(kyros_quic_connection* connection, kyros_quic_space* space, kyros_quic_sent_frame* frame)
+{
+    switch ((kyros_quic_sent_kind)frame->kind) {
+    case KYROS_QUIC_SENT_CRYPTO:
+        kyros_quic_send_buffer_on_lost(&space->crypto_send, frame->offset, frame->length);
+        kyros_quic_queue_send(connection);
+        break;
+    case KYROS_QUIC_SENT_STREAM: {
+        auto stream = kyros_quic_stream_find(connection, frame->id);
+        if (!stream || stream->reset) {
+            break;
+        }
+        kyros_quic_send_buffer_on_lost(&stream->send, frame->offset, frame->length);
+        if (frame->fin && !stream->fin_acked) {
+            stream->fin_sent = false;
+        }
+        kyros_quic_stream_queue(connection, stream);
+        break;
+    }
+    case KYROS_QUIC_SENT_RESET_STREAM: {
+        auto stream = kyros_quic_stream_find(connection, frame->id);
+        if (stream && !stream->reset_acked) {
+            stream->reset_pending = true;
+            kyros_quic_stream_queue(connection, stream);
+        }
+        break;
+    }
+    case KYROS_QUIC_SENT_STOP_SENDING: {
+        auto stream = kyros_quic_stream_find(connection, frame->id);
+        if (stream && !stream->recv_done) {
+            stream->stop_pending = true;
+            kyros_quic_stream_queue(connection, stream);
+        }
+        break;
+    }
+    case KYROS_QUIC_SENT_MAX_DATA:
+        // the current value is sent, not the lost one
+        connection->max_data_pending = true;
+        kyros_quic_queue_send(connection);
+        break;
+    case KYROS_QUIC_SENT_MAX_STREAM_DATA: {
+        auto stream = kyros_quic_stream_find(connection, frame->id);
+        if (stream && !stream->recv_done && stream->final_size == UINT64_MAX) {
+            stream->max_data_pending = true;
+            kyros_quic_stream_queue(connection, stream);
+        }
+        break;
+    }
+    case KYROS_QUIC_SENT_MAX_STREAMS_BIDI:
+        connection->max_streams_pending_bidi = true;
+        kyros_quic_queue_send(connection);
+        break;
+    case KYROS_QUIC_SENT_MAX_STREAMS_UNI:
+        connection->max_streams_pending_uni = true;
+        kyros_quic_queue_send(connection);
+        break;
+    case KYROS_QUIC_SENT_NEW_CONNECTION_ID:
+        for (uint32_t i = 0; i < KYROS_QUIC_ACTIVE_CIDS; i++) {
+            if (connection->cids[i].active && connection->cids[i].sequence == frame->id) {
+                connection->cids[i].pending = true;
+                kyros_quic_queue_send(connection);
+            }
+        }
+        break;
+    case KYROS_QUIC_SENT_RETIRE_CONNECTION_ID:
+        for (uint32_t i = 0; i < connection->peer_cid_count; i++) {
+            if (connection->peer_cids[i].retired && connection->peer_cids[i].sequence == frame->id) {
+                connection->peer_cids[i].retire_pending = true;
+                kyros_quic_queue_send(connection);
+            }
+        }
+        break;
+    case KYROS_QUIC_SENT_HANDSHAKE_DONE:
+        connection->handshake_done_pending = true;
+        kyros_quic_queue_send(connection);
+        break;
+    }
+}
+
+static void kyros_quic_on_frame_acked(kyros_quic_connection* connection, kyros_quic_space* space, kyros_quic_sent_frame* frame)
+{
+    switch ((kyros_quic_sent_kind)frame->kind) {
+    case KYROS_QUIC_SENT_CRYPTO:
+        kyros_quic_send_buffer_on_acked(&space->crypto_send, frame->offset, frame->length);
+        break;
+    case KYROS_QUIC_SENT_STREAM: {
+        auto stream = kyros_quic_stream_find(connection, frame->id);
+        if (!stream) {
+            break;
+        }
+        kyros_quic_send_buffer_on_acked(&stream->send, frame->offset, frame->length);
+        if (frame->fin) {
+            stream->fin_acked = true;
+        }
+        auto buffered = stream->send.end - stream->send.base;
+        if (stream->drain_due && buffered <= KYROS_QUIC_STREAM_LOW_WATERMARK && !stream->reset) {
+            stream->drain_due = false;
+            if (connection->handler.ondrain) {
+                connection->handler.ondrain(connection, stream->id, connection->handler.ctx);
+            }
+            if (connection->state >= KYROS_QUIC_STATE_CLOSING) {
+                break;
+            }
+        }
+        if (stream->fin_acked && stream->send.base == stream->send.end) {
+            kyros_quic_stream_check_done(connection, stream);
+        }
+        break;
+    }
+    case KYROS_QUIC_SENT_RESET_STREAM: {
+        auto stream = kyros_quic_stream_find(connection, frame->id);
+        if (stream) {
+            stream->reset_acked = true;
+            kyros_quic_stream_check_done(connection, stream);
+        }
+        break;
+    }
+    case KYROS_QUIC_SENT_RETIRE_CONNECTION_ID:
+        for (uint32_t i = 0; i < connection->peer_cid_count; i++) {
+            auto cid = &connection->peer_cids[i];
+            if (cid->retired && cid->sequence == frame->id) {
+                // the current one is never retired, so it can only move down
+                memmove(cid, cid + 1, sizeof(kyros_quic_peer_cid) * (connection->peer_cid_count - i - 1));
+                connection->peer_cid_count--;
+                if (connection->peer_cid_current > i) {
+                    connection->peer_cid_current--;
+                }
+                break;
+            }
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+/// @brief settles a packet that is acknowledged or lost, its window share is given back
+static void kyros_quic_settle(kyros_quic_connection* connection, kyros_quic_space* space, kyros_quic_sent_packet* packet)
+{
+    packet->settled = true;
+    if (packet->ack_eliciting && space->ack_eliciting_in_flight) {
+        space->ack_eliciting_in_flight--;
+    }
+}
+
+/// @brief packet and time thresholds (RFC 9002 6.1), the window is reduced once for what is declared lost
+static void kyros_quic_detect_lost(kyros_quic_connection* connection, kyros_quic_space_id id, uint64_t now)
+{
+    auto space = &connection->spaces[id];
+    space->loss_time = 0;
+    if (space->largest_acked == UINT64_MAX) {
+        return;
+    }
+    auto rtt = connection->latest_rtt > connection->smoothed_rtt ? connection->latest_rtt : connection->smoothed_rtt;
+    uint64_t loss_delay = rtt * 9 / 8;
+    loss_delay = loss_delay > 1000 ? loss_delay : 1000;
+    uint64_t lost_send_time = now > loss_delay ? now - loss_delay : 0;
+    uint64_t first_lost = UINT64_MAX;
+    uint64_t last_lost = 0;
+    for (auto pn = space->sent_first; pn < space->sent_first + space->sent_count && pn < space->largest_acked; pn++) {
+        auto packet = kyros_quic_sent_get(space, pn);
+        if (packet->settled) {
+            continue;
+        }
+        if (packet->time_sent <= lost_send_time || space->largest_acked >= pn + 3) {
+            kyros_quic_settle(connection, space, packet);
+            connection->packets_lost++;
+            if (packet->in_flight) {
+                connection->bytes_in_flight -= kyros_quic_min(packet->size, connection->bytes_in_flight);
+                first_lost = packet->time_sent < first_lost ? packet->time_sent : first_lost;
+                last_lost = packet->time_sent > last_lost ? packet->time_sent : last_lost;
+            }
+            for (uint32_t i = 0; i < packet->frame_count; i++) {
+                kyros_quic_on_frame_lost(connection, space, &packet->frames[i]);
+            }
+        } else {
+            auto loss_time = packet->time_sent + loss_delay;
+            if (!space->loss_time || loss_time < space->loss_time) {
+                space->loss_time = loss_time;
+            }
+        }
+    }
+    if (last_lost) {
+        // persistent congestion, everything sent over 3 PTO was lost (RFC 9002 7.6)
+        uint64_t period = 3 * kyros_quic_pto_duration(connection, KYROS_QUIC_SPACE_APPLICATION);
+        bool persistent = connection->min_rtt != UINT64_MAX && last_lost - first_lost > period;
+        kyros_quic_on_congestion(connection, last_lost, now, persistent);
+    }
+    kyros_quic_sent_trim(space);
+}
+
+static bool kyros_quic_peer_validated_address(kyros_quic_connection* connection)
+{
+    return !connection->is_client || connection->handshake_confirmed
+        || connection->spaces[KYROS_QUIC_SPACE_HANDSHAKE].largest_acked != UINT64_MAX;
+}
+
+/// @brief loss_deadline for the earliest loss time, otherwise for the probe timeout (RFC 9002 6.2)
+static void kyros_quic_set_loss_timer(kyros_quic_connection* connection, uint64_t now)
+{
+    connection->loss_deadline = 0;
+    if (connection->state >= KYROS_QUIC_STATE_CLOSING) {
+        return;
+    }
+    for (uint32_t i = 0; i < KYROS_QUIC_SPACES; i++) {
+        auto loss_time = connection->spaces[i].loss_time;
+        if (loss_time && (!connection->loss_deadline || loss_time < connection->loss_deadline)) {
+            connection->loss_deadline = loss_time;
+        }
+    }
+    if (connection->loss_deadline) {
+        return;
+    }
+    // a server blocked by the anti-amplification limit waits for the client
+    if (!connection->is_client && !connection->address_validated && connection->bytes_sent >= 3 * connection->bytes_received) {
+        return;
+    }
+    uint32_t shift = connection->pto_count < 16 ? connection->pto_count : 16;
+    uint32_t in_flight = 0;
+    for (uint32_t i = 0; i < KYROS_QUIC_SPACES; i++) {
+        in_flight += connection->spaces[i].ack_eliciting_in_flight;
+    }
+    if (!in_flight) {
+        if (kyros_quic_peer_validated_address(connection)) {
+            return;
+        }
+        // a client keeps probing so the server is not stuck at its amplification limit
+        auto space = connection->spaces[KYROS_QUIC_SPACE_HANDSHAKE].write_keys ? KYROS_QUIC_SPACE_HANDSHAKE : KYROS_QUIC_SPACE_INITIAL;
+        connection->loss_deadline = now + (kyros_quic_pto_duration(connection, space) << shift);
+        return;
+    }
+    for (uint32_t i = 0; i < KYROS_QUIC_SPACES; i++) {
+        auto space = &connection->spaces[i];
+        if (!space->ack_eliciting_in_flight || (i == KYROS_QUIC_SPACE_APPLICATION && !connection->handshake_confirmed)) {
+            continue;
+        }
+        auto deadline = space->last_ack_eliciting_time + (kyros_quic_pto_duration(connection, i) << shift);
+        if (!connection->loss_deadline || deadline < connection->loss_deadline) {
+            connection->loss_deadline = deadline;
+        }
+    }
+}
+
+/// @brief the frames of the packets still in flight are sent again, without declaring them lost
+static void kyros_quic_probe_space(kyros_quic_connection* connection, kyros_quic_space_id id)
+{
+    auto space = &connection->spaces[id];
+    space->probe = true;
+    for (uint32_t i = 0; i < space->sent_count; i++) {
+        auto packet = &space->sent[(space->sent_head + i) & (space->sent_capacity - 1)];
+        if (packet->settled) {
+            continue;
+        }
+        for (uint32_t j = 0; j < packet->frame_count; j++) {
+            kyros_quic_on_frame_lost(connection, space, &packet->frames[j]);
+        }
+    }
+}
+
+static void kyros_quic_on_loss_timeout(kyros_quic_connection* connection, uint64_t now)
+{
+    for (uint32_t i = 0; i < KYROS_QUIC_SPACES; i++) {
+        if (connection->spaces[i].loss_time && connection->spaces[i].loss_time <= now) {
+            kyros_quic_detect_lost(connection, i, now);
+            kyros_quic_set_loss_timer(connection, now);
+            return;
+        }
+    }
+    connection->pto_count++;
+    connection->probes = 2;
+    uint32_t in_flight = 0;
+    for (uint32_t i = 0; i < KYROS_QUIC_SPACES; i++) {
+        in_flight += connection->spaces[i].ack_eliciting_in_flight;
+    }
+    if (!in_flight) {
+        auto space = connection->spaces[KYROS_QUIC_SPACE_HANDSHAKE].write_keys ? KYROS_QUIC_SPACE_HANDSHAKE : KYROS_QUIC_SPACE_INITIAL;
+        connection->spaces[space].probe = true;
+    } else {
+        // the earliest timer among the spaces with packets in flight
+        kyros_quic_space_id earliest = KYROS_QUIC_SPACE_INITIAL;
+        uint64_t earliest_time = UINT64_MAX;
+        for (uint32_t i = 0; i < KYROS_QUIC_SPACES; i++) {
+            auto space = &connection->spaces[i];
+            if (!space->ack_eliciting_in_flight || (i == KYROS_QUIC_SPACE_APPLICATION && !connection->handshake_confirmed)) {
+                continue;
+            }
+            auto time = space->last_ack_eliciting_time + kyros_quic_pto_duration(connection, i);
+            if (time < earliest_time) {
+                earliest_time = time;
+                earliest = i;
+            }
+        }
+        kyros_quic_probe_space(connection, earliest);
+        // the Handshake of a client without 1-RTT keys yet goes with its Initial
+        if (earliest == KYROS_QUIC_SPACE_INITIAL && connection->spaces[KYROS_QUIC_SPACE_HANDSHAKE].ack_eliciting_in_flight) {
+            kyros_quic_probe_space(connection, KYROS_QUIC_SPACE_HANDSHAKE);
+        }
+    }
+    if (!connection->address_validated && connection->state == KYROS_QUIC_STATE_OPEN && !connection->is_client) {
+        // the PATH_CHALLENGE may have been lost
+        connection->challenge_pending = true;
+    }
+    kyros_quic_queue_send(connection);
+    kyros_quic_set_loss_timer(connection, now);
+}
+
+static void kyros_quic_ack_range(kyros_quic_connection* connection, kyros_quic_space* space, uint64_t low, uint64_t high, uint64_t now,
+    kyros_quic_sent_packet** largest, bool* newly_acked)
+{
+    uint64_t first = space->sent_first;
+    uint64_t last = space->sent_first + space->sent_count;
+    low = low > first ? low : first;
+    for (auto pn = low; pn <= high && pn < last; pn++) {
+        auto packet = kyros_quic_sent_get(space, pn);
+        if (packet->settled) {
+            continue;
+        }
+        *newly_acked = true;
+        if (pn == high && !*largest) {
+            *largest = packet;
+        }
+        kyros_quic_settle(connection, space, packet);
+        kyros_quic_on_packet_acked(connection, packet, now);
+        for (uint32_t i = 0; i < packet->frame_count && connection->state < KYROS_QUIC_STATE_CLOSING; i++) {
+            kyros_quic_on_frame_acked(connection, space, &packet->frames[i]);
+        }
+    }
+}
+
+#define KYROS_QUIC_READ_VARINT(p, end, value)               \
+    do {                                                    \
+        auto read = kyros_quic_varint_read(p, end, &value); \
+        if (!read) {                                        \
+            return KYROS_QUIC_FRAME_ENCODING_ERROR;         \
+        }                                                   \
+        p += read;                                          \
+    } while (0)
+
+static uint64_t kyros_quic_on_ack_frame(kyros_quic_connection* connection, kyros_quic_space_id id, const uint8_t** data, const uint8_t* end,
+    bool ecn, uint64_t now)
+{
+    auto space = &connection->spaces[id];
+    auto p = *data;
+    uint64_t largest, delay, range_count, first_range;
+    KYROS_QUIC_READ_VARINT(p, end, largest);
+    KYROS_QUIC_READ_VARINT(p, end, delay);
+    KYROS_QUIC_READ_VARINT(p, end, range_count);
+    KYROS_QUIC_READ_VARINT(p, end, first_range);
+    if (first_range > largest) {
+        return KYROS_QUIC_FRAME_ENCODING_ERROR;
+    }
+    if (largest >= space->next_packet_number) {
+        return KYROS_QUIC_PROTOCOL_VIOLATION;
+    }
+    kyros_quic_sent_packet* largest_packet = NULL;
+    bool newly_acked = false;
+    uint64_t smallest = largest - first_range;
+    kyros_quic_ack_range(connection, space, smallest, largest, now, &largest_packet, &newly_acked);
+    for (uint64_t i = 0; i < range_count; i++) {
+        uint64_t gap, length;
+        KYROS_QUIC_READ_VARINT(p, end, gap);
+        KYROS_QUIC_READ_VARINT(p, end, length);
+        if (gap + 2 > smallest || length > smallest - gap - 2) {
+            return KYROS_QUIC_FRAME_ENCODING_ERROR;
+        }
+        uint64_t high = smallest - gap - 2;
+        smallest = high - length;
+        kyros_quic_ack_range(connection, space, smallest, high, now, &largest_packet, &newly_acked);
+    }
+    if (ecn) {
+        uint64_t count;
+        for (uint32_t i = 0; i < 3; i++) {
+            KYROS_QUIC_READ_VARINT(p, end, count);
+        }
+    }
+    *data = p;
+    if (!newly_acked || connection->state >= KYROS_QUIC_STATE_CLOSING || space->discarded) {
+        return KYROS_QUIC_NO_ERROR;
+    }
+    if (space->largest_acked == UINT64_MAX || largest > space->largest_acked) {
+        space->largest_acked = largest;
+    }
+    if (largest_packet && largest_packet->ack_eliciting) {
+        uint64_t ack_delay = 0;
+        if (id == KYROS_QUIC_SPACE_APPLICATION) {
+            auto exponent = connection->peer_params.ack_delay_exponent;
+            ack_delay = delay < (UINT64_MAX >> exponent) ? delay << exponent : UINT64_MAX;
+        }
+        kyros_quic_on_rtt_sample(connection, now - largest_packet->time_sent, ack_delay);
+    }
+    kyros_quic_detect_lost(connection, id, now);
+    // a client that has not confirmed the handshake keeps its backoff for the Initial acks (RFC 9002 6.2.1)
+    if (!connection->is_client || kyros_quic_peer_validated_address(connection)) {
+        connection->pto_count = 0;
+    }
+    kyros_quic_set_loss_timer(connection, now);
+    kyros_quic_queue_send(connection);
+    return KYROS_QUIC_NO_ERROR;
+}
+
+///
+/// TLS
+///
+
+static uv_once_t kyros_quic_index_once = UV_ONCE_INIT;
+static int kyros_quic_ssl_index = -1;
+
+static void kyros_quic_create_index()
+{
+    kyros_quic_ssl_index = SSL_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+}
+
+static inline kyros_quic_connection* kyros_quic_from_ssl(const SSL* ssl)
+{
+    return SSL_get_ex_data(ssl, kyros_quic_ssl_index);
+}
+
+static inline kyros_quic_space_id kyros_quic_level_space(enum ssl_encryption_level_t level)
+{
+    switch (level) {
+    case ssl_encryption_initial:
+        return KYROS_QUIC_SPACE_INITIAL;
+    case ssl_encryption_handshake:
+        return KYROS_QUIC_SPACE_HANDSHAKE;
+    default:
+        return KYROS_QUIC_SPACE_APPLICATION;
+    }
+}
+
+static inline enum ssl_encryption_level_t kyros_quic_space_level(kyros_quic_space_id id)
+{
+    return id == KYROS_QUIC_SPACE_INITIAL ? ssl_encryption_initial
+        : id == KYROS_QUIC_SPACE_HANDSHAKE ? ssl_encryption_handshake
+                                           : ssl_encryption_application;
+}
+
+static int kyros_quic_set_read_secret(SSL* ssl, enum ssl_encryption_level_t level, const SSL_CIPHER* cipher, const uint8_t* secret, size_t secret_length)
+{
+    if (level == ssl_encryption_early_data) {
+        // no 0-RTT
+        return 1;
+    }
+    auto space = &kyros_quic_from_ssl(ssl)->spaces[kyros_quic_level_space(level)];
+    auto keys = kyros_quic_keys_create(cipher, secret, secret_length);
+    if (!keys) {
+        return 0;
+    }
+    kyros_quic_keys_free(space->read_keys);
+    space->read_keys = keys;
+    return 1;
+}
+
+static int kyros_quic_set_write_secret(SSL* ssl, enum ssl_encryption_level_t level, const SSL_CIPHER* cipher, const uint8_t* secret, size_t secret_length)
+{
+    if (level == ssl_encryption_early_data) {
+        return 1;
+    }
+    auto space = &kyros_quic_from_ssl(ssl)->spaces[kyros_quic_level_space(level)];
+    auto keys = kyros_quic_keys_create(cipher, secret, secret_length);
+    if (!keys) {
+        return 0;
+    }
+    kyros_quic_keys_free(space->write_keys);
+    space->write_keys = keys;
+    return 1;
+}
+
+static int kyros_quic_add_handshake_data(SSL* ssl, enum ssl_encryption_level_t level, const uint8_t* data, size_t length)
+{
+    auto connection = kyros_quic_from_ssl(ssl);
+    auto space = &connection->spaces[kyros_quic_level_space(level)];
+    if (space->discarded) {
+        return 0;
+    }
+    kyros_quic_send_buffer_append(&space->crypto_send, (const char*)data, length);
+    kyros_quic_queue_send(connection);
+    return 1;
+}
+
+static int kyros_quic_flush_flight(SSL* ssl)
+{
+    // packets are built in the loop hooks
+    return 1;
+}
+
+static int kyros_quic_send_alert(SSL* ssl, enum ssl_encryption_level_t level, uint8_t alert)
+{
+    kyros_quic_from_ssl(ssl)->alert = alert;
+    return 1;
+}
+
+static const SSL_QUIC_METHOD kyros_quic_method = {
+    kyros_quic_set_read_secret,
+    kyros_quic_set_write_secret,
+    kyros_quic_add_handshake_data,
+    kyros_quic_flush_flight,
+    kyros_quic_send_alert,
+};
+
+/// @brief protocol of the listener options from the list of the client, no_application_protocol otherwise (RFC 9001 8.1)
+static int kyros_quic_alpn_select(SSL* ssl, const uint8_t** out, uint8_t* out_length, const uint8_t* in, unsigned int in_length, void* arg)
+{
+    auto connection = kyros_quic_from_ssl(ssl);
+    if (!connection) {
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    auto alpn = connection->options.alpn;
+    auto alpn_length = strlen(alpn);
+    for (unsigned int i = 0; i < in_length; i += 1 + in[i]) {
+        uint8_t length = in[i];
+        if (i + 1 + length > in_length) {
+            break;
+        }
+        if (length == alpn_length && memcmp(in + i + 1, alpn, length) == 0) {
+            *out = in + i + 1;
+            *out_length = length;
+            return SSL_TLSEXT_ERR_OK;
+        }
+    }
+    return SSL_TLSEXT_ERR_ALERT_FATAL;
+}
+
+/// @brief the connection ids of the handshake are authenticated by the transport parameters (RFC 9000 7.3)
+static uint64_t kyros_quic_apply_peer_params(kyros_quic_connection* connection)
+{
+    const uint8_t* data;
+    size_t length;
+    SSL_get_peer_quic_transport_params(connection->ssl, &data, &length);
+    kyros_quic_transport_params params;
+    if (!length || !kyros_quic_transport_params_decode(data, length, connection->is_client, &params)) {
+        return KYROS_QUIC_TRANSPORT_PARAMETER_ERROR;
+    }
+    auto peer_cid = &connection->peer_cids[0];
+    if (!params.has_initial_scid || params.initial_scid_length != peer_cid->length
+        || memcmp(params.initial_scid, peer_cid->id, peer_cid->length) != 0) {
+        return KYROS_QUIC_TRANSPORT_PARAMETER_ERROR;
+    }
+    if (connection->is_client) {
+        if (!params.has_original_dcid || params.original_dcid_length != connection->original_dcid_length
+            || memcmp(params.original_dcid, connection->original_dcid, connection->original_dcid_length) != 0 || params.has_retry_scid) {
+            return KYROS_QUIC_TRANSPORT_PARAMETER_ERROR;
+        }
+        if (params.has_stateless_reset_token) {
+            memcpy(peer_cid->reset_token, params.stateless_reset_token, 16);
+            peer_cid->has_reset_token = true;
+        }
+    }
+    connection->peer_params = params;
+    connection->send_max_data = params.initial_max_data;
+    connection->local_max_streams[0] = params.initial_max_streams_bidi;
+    connection->local_max_streams[1] = params.initial_max_streams_uni;
+    if (params.max_idle_timeout && params.max_idle_timeout * 1000 < connection->idle_timeout) {
+        connection->idle_timeout = params.max_idle_timeout * 1000;
+    }
+    return KYROS_QUIC_NO_ERROR;
+}
+
+static void kyros_quic_do_handshake(kyros_quic_connection* connection)
+{
+    if (connection->handshake_complete) {
+        // NewSessionTicket and the like
+        if (SSL_process_quic_post_handshake(connection->ssl) != 1) {
+            kyros_quic_fail(connection, KYROS_QUIC_CRYPTO_ERROR + connection->alert, "TLS post handshake message");
+        }
+        return;
+    }
+    auto result = SSL_do_handshake(connection->ssl);
+    if (result != 1) {
+        auto error = SSL_get_error(connection->ssl, result);
+        if (error != SSL_ERROR_WANT_READ && error != SSL_ERROR_WANT_WRITE) {
+            kyros_quic_fail(connection, connection->alert ? KYROS_QUIC_CRYPTO_ERROR + connection->alert : KYROS_QUIC_INTERNAL_ERROR,
+                "TLS handshake failed");
+        }
+        return;
+    }
+    connection->handshake_complete = true;
+    auto error = kyros_quic_apply_peer_params(connection);
+    if (error) {
+        kyros_quic_fail(connection, error, "invalid transport parameters");
+        return;
+    }
+    if (!connection->is_client) {
+        // a server confirms the handshake as it completes (RFC 9001 4.1.2)
+        connection->handshake_confirmed = true;
+        connection->handshake_done_pending = true;
+        kyros_quic_discard_space(connection, KYROS_QUIC_SPACE_HANDSHAKE);
+        kyros_quic_cid_remove(connection->endpoint, connection->original_dcid, connection->original_dcid_length, connection);
+    }
+    kyros_quic_issue_cids(connection);
+    connection->state = KYROS_QUIC_STATE_OPEN;
+    connection->opened = true;
+    kyros_quic_queue_send(connection);
+    if (connection->handler.onopen) {
+        connection->handler.onopen(connection, connection->handler.ctx);
+    }
+}
+
+///
+/// Frames
+///
+
+static uint64_t kyros_quic_deliver(kyros_quic_connection* connection, kyros_quic_stream* stream, const uint8_t* data, uint64_t length, bool fin)
+{
+    if (fin) {
+        stream->recv_done = true;
+    }
+    if (connection->handler.onstream) {
+        connection->handler.onstream(connection, stream->id, (const char*)data, length, fin, connection->handler.ctx);
+    }
+    if (connection->state >= KYROS_QUIC_STATE_CLOSING) {
+        return KYROS_QUIC_NO_ERROR;
+    }
+    kyros_quic_credit(connection, stream, length);
+    if (fin) {
+        kyros_quic_stream_check_done(connection, stream);
+    }
+    return KYROS_QUIC_NO_ERROR;
+}
+
+static uint64_t kyros_quic_on_stream_frame(kyros_quic_connection* connection, uint64_t id, uint64_t offset, const uint8_t* data, uint64_t length, bool fin)
+{
+    if (kyros_quic_stream_is_local(connection, id) && (id & 2)) {
+        return KYROS_QUIC_STREAM_STATE_ERROR;
+    }
+    uint64_t error;
+    auto stream = kyros_quic_stream_get(connection, id, &error);
+    if (!stream) {
+        return error;
+    }
+    uint64_t end = offset + length;
+    if (end > KYROS_QUIC_VARINT_MAX) {
+        return KYROS_QUIC_FRAME_ENCODING_ERROR;
+    }
+    if (stream->final_size != UINT64_MAX && (end > stream->final_size || (fin && end != stream->final_size))) {
+        return KYROS_QUIC_FINAL_SIZE_ERROR;
+    }
+    if (fin) {
+        if (end < stream->recv_highest) {
+            return KYROS_QUIC_FINAL_SIZE_ERROR;
+        }
+        stream->final_size = end;
+    }
+    if (end > stream->recv_max) {
+        return KYROS_QUIC_FLOW_CONTROL_ERROR;
+    }
+    if (end > stream->recv_highest) {
+        connection->recv_data += end - stream->recv_highest;
+        stream->recv_highest = end;
+        if (connection->recv_data > connection->recv_max_data) {
+            return KYROS_QUIC_FLOW_CONTROL_ERROR;
+        }
+    }
+    if (stream->recv_done) {
+        return KYROS_QUIC_NO_ERROR;
+    }
+    auto recv = &stream->recv;
+    if (stream->stopped) {
+        // we asked the peer to stop, its bytes still count for the connection window
+        if (end > recv->base) {
+            kyros_quic_credit(connection, NULL, end - recv->base);
+            recv->base = end;
+        }
+        if (stream->final_size == recv->base) {
+            stream->recv_done = true;
+            kyros_quic_stream_check_done(connection, stream);
+        }
+        return KYROS_QUIC_NO_ERROR;
+    }
+    if (offset == recv->base && !recv->ranges.count) {
+        // in order, straight from the packet
+        if (!length && !fin) {
+            return KYROS_QUIC_NO_ERROR;
+        }
+        recv->base = end;
+        return kyros_quic_deliver(connection, stream, data, length, fin);
+    }
+    kyros_quic_recv_buffer_insert(recv, offset, data, length);
+    auto readable = kyros_quic_recv_buffer_readable(recv);
+    bool ended = stream->final_size != UINT64_MAX && recv->base + readable == stream->final_size;
+    if (!readable && !ended) {
+        return KYROS_QUIC_NO_ERROR;
+    }
+    // delivered from the buffer, consumed after the callback
+    if (connection->handler.onstream) {
+        connection->handler.onstream(connection, stream->id, recv->data, readable, ended, connection->handler.ctx);
+    }
+    if (ended) {
+        stream->recv_done = true;
+    }
+    if (connection->state >= KYROS_QUIC_STATE_CLOSING) {
+        return KYROS_QUIC_NO_ERROR;
+    }
+    kyros_quic_recv_buffer_consume(recv, readable);
+    kyros_quic_credit(connection, stream, readable);
+    if (ended) {
+        kyros_quic_stream_check_done(connection, stream);
+    }
+    return KYROS_QUIC_NO_ERROR;
+}
+
+static uint64_t kyros_quic_on_reset_stream(kyros_quic_connection* connection, uint64_t id, uint64_t code, uint64_t final_size)
+{
+    if (kyros_quic_stream_is_local(connection, id) && (id & 2)) {
+        return KYROS_QUIC_STREAM_STATE_ERROR;
+    }
+    uint64_t error;
+    auto stream = kyros_quic_stream_get(connection, id, &error);
+    if (!stream) {
+        return error;
+    }
+    if ((stream->final_size != UINT64_MAX && stream->final_size != final_size) || final_size < stream->recv_highest) {
+        return KYROS_QUIC_FINAL_SIZE_ERROR;
+    }
+    if (final_size > stream->recv_max) {
+        return KYROS_QUIC_FLOW_CONTROL_ERROR;
+    }
+    connection->recv_data += final_size - stream->recv_highest;
+    stream->recv_highest = final_size;
+    stream->final_size = final_size;
+    if (connection->recv_data > connection->recv_max_data) {
+        return KYROS_QUIC_FLOW_CONTROL_ERROR;
+    }
+    if (stream->recv_done) {
+        return KYROS_QUIC_NO_ERROR;
+    }
+    stream->recv_done = true;
+    stream->max_data_pending = false;
+    kyros_quic_credit(connection, NULL, final_size - stream->recv.base);
+    if (!stream->stopped && connection->handler.onreset) {
+        connection->handler.onreset(connection, id, code, connection->handler.ctx);
+        if (connection->state >= KYROS_QUIC_STATE_CLOSING) {
+            return KYROS_QUIC_NO_ERROR;
+        }
+    }
+    kyros_quic_stream_check_done(connection, stream);
+    return KYROS_QUIC_NO_ERROR;
+}
+
+static uint64_t kyros_quic_on_stop_sending(kyros_quic_connection* connection, uint64_t id, uint64_t code)
+{
+    if (!kyros_quic_stream_is_local(connection, id) && (id & 2)) {
+        return KYROS_QUIC_STREAM_STATE_ERROR;
+    }
+    uint64_t error;
+    auto stream = kyros_quic_stream_get(connection, id, &error);
+    if (!stream) {
+        return error;
+    }
+    if (stream->reset || stream->fin_acked) {
+        return KYROS_QUIC_NO_ERROR;
+    }
+    // our side is reset with the code of the peer (RFC 9000 3.5)
+    stream->reset = true;
+    stream->reset_pending = true;
+    stream->reset_code = code;
+    kyros_quic_ranges_free(&stream->send.lost);
+    kyros_quic_stream_queue(connection, stream);
+    if (connection->handler.onreset) {
+        connection->handler.onreset(connection, id, code, connection->handler.ctx);
+    }
+    return KYROS_QUIC_NO_ERROR;
+}
+
+static uint64_t kyros_quic_on_crypto_frame(kyros_quic_connection* connection, kyros_quic_space_id id, uint64_t offset, const uint8_t* data, uint64_t length)
+{
+    auto space = &connection->spaces[id];
+    auto recv = &space->crypto_recv;
+    if (offset + length > recv->base + KYROS_QUIC_MAX_CRYPTO_BUFFER) {
+        return KYROS_QUIC_CRYPTO_BUFFER_EXCEEDED;
+    }
+    kyros_quic_recv_buffer_insert(recv, offset, data, length);
+    auto readable = kyros_quic_recv_buffer_readable(recv);
+    if (!readable) {
+        return KYROS_QUIC_NO_ERROR;
+    }
+    if (!SSL_provide_quic_data(connection->ssl, kyros_quic_space_level(id), (const uint8_t*)recv->data, readable)) {
+        return KYROS_QUIC_CRYPTO_ERROR + connection->alert;
+    }
+    kyros_quic_recv_buffer_consume(recv, readable);
+    kyros_quic_do_handshake(connection);
+    return KYROS_QUIC_NO_ERROR;
+}
+
+static uint64_t kyros_quic_on_new_connection_id(kyros_quic_connection* connection, uint64_t sequence, uint64_t retire_prior_to,
+    const uint8_t* id, uint8_t length, const uint8_t* reset_token)
+{
+    if (!length || length > KYROS_QUIC_MAX_CID_LENGTH || retire_prior_to > sequence) {
+        return KYROS_QUIC_FRAME_ENCODING_ERROR;
+    }
+    for (uint32_t i = 0; i < connection->peer_cid_count; i++) {
+        if (connection->peer_cids[i].sequence == sequence) {
+            // sent again
+            return KYROS_QUIC_NO_ERROR;
+        }
+    }
+    // retired ids are kept until their RETIRE_CONNECTION_ID is acknowledged, so they count too
+    if (connection->peer_cid_count == KYROS_QUIC_PEER_CIDS) {
+        return KYROS_QUIC_CONNECTION_ID_LIMIT_ERROR;
+    }
+    auto cid = &connection->peer_cids[connection->peer_cid_count++];
+    *cid = (kyros_quic_peer_cid) { .sequence = sequence, .length = length, .has_reset_token = true };
+    memcpy(cid->id, id, length);
+    memcpy(cid->reset_token, reset_token, 16);
+    retire_prior_to = retire_prior_to > connection->peer_retire_prior_to ? retire_prior_to : connection->peer_retire_prior_to;
+    connection->peer_retire_prior_to = retire_prior_to;
+    for (uint32_t i = 0; i < connection->peer_cid_count; i++) {
+        auto peer_cid = &connection->peer_cids[i];
+        if (!peer_cid->retired && peer_cid->sequence < retire_prior_to) {
+            peer_cid->retired = true;
+            peer_cid->retire_pending = true;
+            kyros_quic_queue_send(connection);
+        }
+    }
+    if (connection->peer_cids[connection->peer_cid_current].retired) {
+        kyros_quic_peer_cid_switch(connection);
+    }
+    return KYROS_QUIC_NO_ERROR;
+}
+
+static uint64_t kyros_quic_on_retire_connection_id(kyros_quic_connection* connection, uint64_t sequence)
+{
+    if (sequence >= connection->next_cid_sequence) {
+        return KYROS_QUIC_PROTOCOL_VIOLATION;
+    }
+    for (uint32_t i = 0; i < KYROS_QUIC_ACTIVE_CIDS; i++) {
+        auto cid = &connection->cids[i];
+        if (cid->active && cid->sequence == sequence) {
+            kyros_quic_cid_remove(connection->endpoint, cid->id, KYROS_QUIC_CID_LENGTH, connection);
+            cid->active = false;
+            cid->pending = false;
+            // one more to replace it
+            kyros_quic_issue_cids(connection);
+            kyros_quic_queue_send(connection);
+            break;
+        }
+    }
+    return KYROS_QUIC_NO_ERROR;
+}
+
+/// @brief streams left out of the send list while the connection flow control was exhausted
+static void kyros_quic_requeue_blocked(kyros_quic_connection* connection)
+{
+    for (uint32_t i = 0; connection->streams && i <= connection->stream_mask; i++) {
+        auto stream = connection->streams[i];
+        if (stream && !stream->reset && stream->send.next < stream->send.end && stream->send_max > stream->send.next) {
+            kyros_quic_stream_queue(connection, stream);
+        }
+    }
+}
+
+/// @brief frames allowed in Initial and Handshake packets (RFC 9000 12.4)
+static inline bool kyros_quic_frame_allowed_in_handshake(uint64_t type)
+{
+    return type == KYROS_QUIC_FRAME_PADDING || type == KYROS_QUIC_FRAME_PING || type == KYROS_QUIC_FRAME_ACK || type == KYROS_QUIC_FRAME_ACK_ECN
+        || type == KYROS_QUIC_FRAME_CRYPTO || type == KYROS_QUIC_FRAME_CONNECTION_CLOSE;
+}
+
+static uint64_t kyros_quic_process_frames(kyros_quic_connection* connection, kyros_quic_space_id id, const uint8_t* p, const uint8_t* end,
+    uint64_t now, bool* ack_eliciting)
+{
+    // the handshake can complete in the middle, the space is gone with its keys then
+    while (p < end && connection->state < KYROS_QUIC_STATE_CLOSING && !connection->spaces[id].discarded) {
+        uint64_t type;
+        KYROS_QUIC_READ_VARINT(p, end, type);
+        if (id != KYROS_QUIC_SPACE_APPLICATION && !kyros_quic_frame_allowed_in_handshake(type)) {
+            return KYROS_QUIC_PROTOCOL_VIOLATION;
+        }
+        if (type != KYROS_QUIC_FRAME_PADDING && type != KYROS_QUIC_FRAME_ACK && type != KYROS_QUIC_FRAME_ACK_ECN
+            && type != KYROS_QUIC_FRAME_CONNECTION_CLOSE && type != KYROS_QUIC_FRAME_CONNECTION_CLOSE_APPLICATION) {
+            *ack_eliciting = true;
+        }
+        uint64_t error = KYROS_QUIC_NO_ERROR;
+        switch (type) {
+        case KYROS_QUIC_FRAME_PADDING:
+            while (p < end && !*p) {
+                p++;
+            }
+            break;
+        case KYROS_QUIC_FRAME_PING:
+            break;
+        case KYROS_QUIC_FRAME_ACK:
+        case KYROS_QUIC_FRAME_ACK_ECN:
+            error = kyros_quic_on_ack_frame(connection, id, &p, end, type == KYROS_QUIC_FRAME_ACK_ECN, now);
+            break;
+        case KYROS_QUIC_FRAME_RESET_STREAM: {
+            uint64_t stream_id, code, final_size;
+            KYROS_QUIC_READ_VARINT(p, end, stream_id);
+            KYROS_QUIC_READ_VARINT(p, end, code);
+            KYROS_QUIC_READ_VARINT(p, end, final_size);
+            error = kyros_quic_on_reset_stream(connection, stream_id, code, final_size);
+            break;
+        }
+        case KYROS_QUIC_FRAME_STOP_SENDING: {
+            uint64_t stream_id, code;
+            KYROS_QUIC_READ_VARINT(p, end, stream_id);
+            KYROS_QUIC_READ_VARINT(p, end, code);
+            error = kyros_quic_on_stop_sending(connection, stream_id, code);
+            break;
+        }
+        case KYROS_QUIC_FRAME_CRYPTO: {
+            uint64_t offset, length;
+            KYROS_QUIC_READ_VARINT(p, end, offset);
+            KYROS_QUIC_READ_VARINT(p, end, length);
+            if (length > (uint64_t)(end - p)) {
+                return KYROS_QUIC_FRAME_ENCODING_ERROR;
+            }
+            error = kyros_quic_on_crypto_frame(connection, id, offset, p, length);
+            p += length;
+            break;
+        }
+        case KYROS_QUIC_FRAME_NEW_TOKEN: {
+            uint64_t length;
+            KYROS_QUIC_READ_VARINT(p, end, length);
+            if (!connection->is_client || !length || length > (uint64_t)(end - p)) {
+                return connection->is_client ? KYROS_QUIC_FRAME_ENCODING_ERROR : KYROS_QUIC_PROTOCOL_VIOLATION;
+            }
+            // there is no 0-RTT to use it with
+            p += length;
+            break;
+        }
+        case KYROS_QUIC_FRAME_MAX_DATA: {
+            uint64_t max;
+            KYROS_QUIC_READ_VARINT(p, end, max);
+            if (max > connection->send_max_data) {
+                bool blocked = connection->send_data == connection->send_max_data;
+                connection->send_max_data = max;
+                if (blocked) {
+                    kyros_quic_requeue_blocked(connection);
+                }
+            }
+            break;
+        }
+        case KYROS_QUIC_FRAME_MAX_STREAM_DATA: {
+            uint64_t stream_id, max;
+            KYROS_QUIC_READ_VARINT(p, end, stream_id);
+            KYROS_QUIC_READ_VARINT(p, end, max);
+            if (!kyros_quic_stream_is_local(connection, stream_id) && (stream_id & 2)) {
+                return KYROS_QUIC_STREAM_STATE_ERROR;
+            }
+            auto stream = kyros_quic_stream_get(connection, stream_id, &error);
+            if (stream && max > stream->send_max) {
+                stream->send_max = max;
+                if (kyros_quic_send_buffer_pending(&stream->send) || (stream->fin && !stream->fin_sent)) {
+                    kyros_quic_stream_queue(connection, stream);
+                }
+            }
+            break;
+        }
+        case KYROS_QUIC_FRAME_MAX_STREAMS_BIDI:
+        case KYROS_QUIC_FRAME_MAX_STREAMS_UNI: {
+            uint64_t max;
+            KYROS_QUIC_READ_VARINT(p, end, max);
+            if (max > (1ULL << 60)) {
+                return KYROS_QUIC_FRAME_ENCODING_ERROR;
+            }
+            auto limit = &connection->local_max_streams[type == KYROS_QUIC_FRAME_MAX_STREAMS_UNI];
+            *limit = max > *limit ? max : *limit;
+            break;
+        }
+        case KYROS_QUIC_FRAME_DATA_BLOCKED:
+        case KYROS_QUIC_FRAME_STREAMS_BLOCKED_BIDI:
+        case KYROS_QUIC_FRAME_STREAMS_BLOCKED_UNI: {
+            // our limits move as data is delivered, nothing to do
+            uint64_t limit;
+            KYROS_QUIC_READ_VARINT(p, end, limit);
+            break;
+        }
+        case KYROS_QUIC_FRAME_STREAM_DATA_BLOCKED: {
+            uint64_t stream_id, limit;
+            KYROS_QUIC_READ_VARINT(p, end, stream_id);
+            KYROS_QUIC_READ_VARINT(p, end, limit);
+            if (kyros_quic_stream_is_local(connection, stream_id) && (stream_id & 2)) {
+                return KYROS_QUIC_STREAM_STATE_ERROR;
+            }
+            break;
+        }
+        case KYROS_QUIC_FRAME_NEW_CONNECTION_ID: {
+            uint64_t sequence, retire_prior_to;
+            KYROS_QUIC_READ_VARINT(p, end, sequence);
+            KYROS_QUIC_READ_VARINT(p, end, retire_prior_to);
+            if (p >= end || (uint64_t)(end - p) < 1u + *p + 16u) {
+                return KYROS_QUIC_FRAME_ENCODING_ERROR;
+            }
+            uint8_t length = *p++;
+            error = kyros_quic_on_new_connection_id(connection, sequence, retire_prior_to, p, length, p + length);
+            p += length + 16;
+            break;
+        }
+        case KYROS_QUIC_FRAME_RETIRE_CONNECTION_ID: {
+            uint64_t sequence;
+            KYROS_QUIC_READ_VARINT(p, end, sequence);
+            error = kyros_quic_on_retire_connection_id(connection, sequence);
+            break;
+        }
+        case KYROS_QUIC_FRAME_PATH_CHALLENGE:
+            if (end - p < 8) {
+                return KYROS_QUIC_FRAME_ENCODING_ERROR;
+            }
+            memcpy(connection->path_response, p, 8);
+            connection->response_pending = true;
+            kyros_quic_queue_send(connection);
+            p += 8;
+            break;
+        case KYROS_QUIC_FRAME_PATH_RESPONSE:
+            if (end - p < 8) {
+                return KYROS_QUIC_FRAME_ENCODING_ERROR;
+            }
+            if (!connection->address_validated && memcmp(connection->path_challenge, p, 8) == 0) {
+                connection->address_validated = true;
+                connection->challenge_pending = false;
+                kyros_quic_queue_send(connection);
+            }
+            p += 8;
+            break;
+        case KYROS_QUIC_FRAME_CONNECTION_CLOSE:
+        case KYROS_QUIC_FRAME_CONNECTION_CLOSE_APPLICATION: {
+            uint64_t code, frame_type, length;
+            KYROS_QUIC_READ_VARINT(p, end, code);
+            if (type == KYROS_QUIC_FRAME_CONNECTION_CLOSE) {
+                KYROS_QUIC_READ_VARINT(p, end, frame_type);
+            }
+            KYROS_QUIC_READ_VARINT(p, end, length);
+            if (length > (uint64_t)(end - p)) {
+                return KYROS_QUIC_FRAME_ENCODING_ERROR;
+            }
+            kyros_quic_drain(connection, code, type == KYROS_QUIC_FRAME_CONNECTION_CLOSE_APPLICATION, (const char*)p, (uint32_t)length, false);
+            return KYROS_QUIC_NO_ERROR;
+        }
+        case KYROS_QUIC_FRAME_HANDSHAKE_DONE:
+            if (!connection->is_client) {
+                return KYROS_QUIC_PROTOCOL_VIOLATION;
+            }
+            if (!connection->handshake_confirmed) {
+                connection->handshake_confirmed = true;
+                kyros_quic_discard_space(connection, KYROS_QUIC_SPACE_HANDSHAKE);
+            }
+            break;
+        default:
+            if (type >= KYROS_QUIC_FRAME_STREAM && type <= (KYROS_QUIC_FRAME_STREAM | 0x07)) {
+                uint64_t stream_id, offset = 0, length;
+                KYROS_QUIC_READ_VARINT(p, end, stream_id);
+                if (type & 0x04) {
+                    KYROS_QUIC_READ_VARINT(p, end, offset);
+                }
+                if (type & 0x02) {
+                    KYROS_QUIC_READ_VARINT(p, end, length);
+                    if (length > (uint64_t)(end - p)) {
+                        return KYROS_QUIC_FRAME_ENCODING_ERROR;
+                    }
+                } else {
+                    length = end - p;
+                }
+                error = kyros_quic_on_stream_frame(connection, stream_id, offset, p, length, type & 0x01);
+                p += length;
+                break;
+            }
+            return KYROS_QUIC_FRAME_ENCODING_ERROR;
+        }
+        if (error) {
+            return error;
+        }
+    }
+    return KYROS_QUIC_NO_ERROR;
+}
+
+///
+/// Receiving
+///
+
+/// @brief bytes of the datagram the packet takes, 0 if what is left can't be parsed (or the connection failed)
+static uint32_t kyros_quic_receive_packet(kyros_quic_connection* connection, uint8_t* packet, uint32_t remaining, uint64_t now, bool* processed,
+    bool* new_largest)
+{
+    auto end = packet + remaining;
+    if (!(packet[0] & 0x40)) {
+        // no fixed bit, padding after the last packet
+        return 0;
+    }
+    kyros_quic_space_id id;
+    uint32_t pn_offset;
+    uint32_t packet_length;
+    const uint8_t* scid = NULL;
+    uint8_t scid_length = 0;
+    bool long_header = packet[0] & 0x80;
+    if (long_header) {
+        if (remaining < 7 || kyros_quic_read_u32(packet + 1) != KYROS_QUIC_VERSION) {
+            return 0;
+        }
+        auto p = packet + 5;
+        uint8_t dcid_length = *p++;
+        if (dcid_length > KYROS_QUIC_MAX_CID_LENGTH || end - p < dcid_length + 1) {
+            return 0;
+        }
+        p += dcid_length;
+        scid_length = *p++;
+        if (scid_length > KYROS_QUIC_MAX_CID_LENGTH || end - p < scid_length) {
+            return 0;
+        }
+        scid = p;
+        p += scid_length;
+        auto type = (packet[0] >> 4) & 3;
+        if (type == KYROS_QUIC_PACKET_RETRY) {
+            // we never send a token it could be an answer to
+            return 0;
+        }
+        uint64_t value;
+        uint32_t read;
+        if (type == KYROS_QUIC_PACKET_INITIAL) {
+            if (!(read = kyros_quic_varint_read(p, end, &value)) || value > (uint64_t)(end - p - read)) {
+                return 0;
+            }
+            p += read + value;
+        }
+        if (!(read = kyros_quic_varint_read(p, end, &value)) || value > (uint64_t)(end - p - read)) {
+            return 0;
+        }
+        p += read;
+        pn_offset = (uint32_t)(p - packet);
+        packet_length = pn_offset + (uint32_t)value;
+        if (type == KYROS_QUIC_PACKET_0RTT) {
+            return packet_length;
+        }
+        id = type == KYROS_QUIC_PACKET_INITIAL ? KYROS_QUIC_SPACE_INITIAL : KYROS_QUIC_SPACE_HANDSHAKE;
+    } else {
+        if (remaining < 1 + KYROS_QUIC_CID_LENGTH) {
+            return 0;
+        }
+        pn_offset = 1 + KYROS_QUIC_CID_LENGTH;
+        packet_length = remaining;
+        id = KYROS_QUIC_SPACE_APPLICATION;
+    }
+    auto space = &connection->spaces[id];
+    if (space->discarded || !space->read_keys) {
+        return packet_length;
+    }
+    auto pn_length = kyros_quic_unprotect_header(space->read_keys, packet, pn_offset, packet_length);
+    if (!pn_length || packet_length < pn_offset + pn_length + KYROS_QUIC_TAG_LENGTH) {
+        return packet_length;
+    }
+    uint64_t truncated = 0;
+    for (uint32_t i = 0; i < pn_length; i++) {
+        truncated = (truncated << 8) | packet[pn_offset + i];
+    }
+    auto received = &space->received;
+    uint64_t largest = received->count ? received->items[received->count - 1][1] - 1 : UINT64_MAX;
+    auto pn = kyros_quic_decode_packet_number(largest, truncated, pn_length);
+    auto header_length = pn_offset + pn_length;
+    auto keys = space->read_keys;
+    bool next_phase = false;
+    if (id == KYROS_QUIC_SPACE_APPLICATION && (bool)((packet[0] >> 2) & 1) != connection->key_phase) {
+        if (pn < connection->key_phase_start) {
+            keys = connection->read_keys_previous;
+        } else {
+            if (!connection->read_keys_next) {
+                connection->read_keys_next = kyros_quic_keys_update(space->read_keys);
+            }
+            keys = connection->read_keys_next;
+            next_phase = true;
+        }
+        if (!keys) {
+            return packet_length;
+        }
+    }
+    if (!kyros_quic_open(keys, packet, header_length, packet_length, pn)) {
+        return packet_length;
+    }
+    // reserved bits are only checked once the packet is authentic (RFC 9000 17.2)
+    if ((packet[0] & (long_header ? 0x0c : 0x18)) || packet_length == header_length + KYROS_QUIC_TAG_LENGTH) {
+        kyros_quic_fail(connection, KYROS_QUIC_PROTOCOL_VIOLATION, "reserved bits or empty packet");
+        return 0;
+    }
+    if (next_phase) {
+        // the peer started a key update, we answer in the new phase (RFC 9001 6.2)
+        kyros_quic_keys_free(connection->read_keys_previous);
+        connection->read_keys_previous = space->read_keys;
+        space->read_keys = connection->read_keys_next;
+        connection->read_keys_next = NULL;
+        connection->key_phase = !connection->key_phase;
+        connection->key_phase_start = pn;
+        auto write_keys = kyros_quic_keys_update(space->write_keys);
+        kyros_quic_keys_free(space->write_keys);
+        space->write_keys = write_keys;
+    }
+    bool forgotten = received->count == KYROS_QUIC_ACK_RANGES && pn < received->items[0][0];
+    if (forgotten || kyros_quic_ranges_contains(received, pn)) {
+        return packet_length;
+    }
+    *processed = true;
+    connection->packets_received++;
+    if (connection->is_client && long_header && !connection->peer_cid_set) {
+        // the server picked its own id, the random one of the first Initial is gone
+        connection->peer_cid_set = true;
+        connection->peer_cids[0].length = scid_length;
+        memcpy(connection->peer_cids[0].id, scid, scid_length);
+    }
+    if (!connection->is_client && id == KYROS_QUIC_SPACE_HANDSHAKE) {
+        // only the client could have sent it, its address is valid and the Initial keys are done (RFC 9001 4.9.1)
+        connection->address_validated = true;
+        kyros_quic_discard_space(connection, KYROS_QUIC_SPACE_INITIAL);
+    }
+    bool ack_eliciting = false;
+    auto error = kyros_quic_process_frames(connection, id, packet + header_length, packet + packet_length - KYROS_QUIC_TAG_LENGTH, now, &ack_eliciting);
+    if (error) {
+        kyros_quic_fail(connection, error, "invalid frame");
+        return 0;
+    }
+    if (space->discarded || connection->state >= KYROS_QUIC_STATE_CLOSING) {
+        return packet_length;
+    }
+    kyros_quic_ranges_add(received, pn, pn + 1);
+    if (received->count > KYROS_QUIC_ACK_RANGES) {
+        kyros_quic_ranges_remove(received, received->items[0][0], received->items[0][1]);
+    }
+    if (largest == UINT64_MAX || pn > largest) {
+        space->largest_received_time = now;
+        *new_largest = id == KYROS_QUIC_SPACE_APPLICATION;
+    }
+    if (ack_eliciting) {
+        space->ack_pending = true;
+        space->ack_eliciting_received++;
+        // handshake packets, every second one and anything out of order are acknowledged right away (RFC 9000 13.2.1)
+        bool immediate = id != KYROS_QUIC_SPACE_APPLICATION || space->ack_eliciting_received >= KYROS_QUIC_ACK_ELICITING_THRESHOLD
+            || (largest != UINT64_MAX && pn != largest + 1);
+        if (immediate) {
+            connection->ack_deadline = id == KYROS_QUIC_SPACE_APPLICATION ? 0 : connection->ack_deadline;
+            kyros_quic_queue_send(connection);
+        } else if (!connection->ack_deadline) {
+            connection->ack_deadline = now + KYROS_QUIC_MAX_ACK_DELAY * 1000;
+        }
+    }
+    return packet_length;
+}
+
+/// @brief the last 16 bytes of a datagram that could not be decrypted are a token of the peer (RFC 9000 10.3.1)
+static bool kyros_quic_is_stateless_reset(kyros_quic_connection* connection, const uint8_t* tail)
+{
+    for (uint32_t i = 0; i < connection->peer_cid_count; i++) {
+        auto cid = &connection->peer_cids[i];
+        if (cid->has_reset_token && CRYPTO_memcmp(cid->reset_token, tail, 16) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/// @brief the peer moved (NAT rebinding), the new address is validated before it gets more than the anti-amplification limit
+static void kyros_quic_on_migration(kyros_quic_connection* connection, const struct sockaddr* peer, socklen_t peer_length, uint32_t datagram_length)
+{
+    memcpy(&connection->peer, peer, peer_length);
+    connection->peer_length = peer_length;
+    connection->address_validated = false;
+    connection->bytes_received = datagram_length;
+    connection->bytes_sent = 0;
+    RAND_bytes(connection->path_challenge, 8);
+    connection->challenge_pending = true;
+    kyros_quic_queue_send(connection);
+}
+
+static void kyros_quic_connection_receive(kyros_quic_connection* connection, uint8_t* data, uint32_t length, const struct sockaddr* peer,
+    socklen_t peer_length)
+{
+    if (connection->state == KYROS_QUIC_STATE_DRAINING) {
+        return;
+    }
+    if (connection->state == KYROS_QUIC_STATE_CLOSING) {
+        // the peer did not get our CONNECTION_CLOSE yet
+        connection->close_pending = true;
+        kyros_quic_queue_send(connection);
+        return;
+    }
+    auto now = kyros_quic_now();
+    uint8_t tail[16];
+    bool maybe_reset = !(data[0] & 0x80) && length >= 21;
+    if (maybe_reset) {
+        // decryption happens in place
+        memcpy(tail, data + length - 16, 16);
+    }
+    connection->bytes_received += length;
+    bool processed = false;
+    bool new_largest = false;
+    for (uint32_t offset = 0; offset < length && connection->state < KYROS_QUIC_STATE_CLOSING;) {
+        auto consumed = kyros_quic_receive_packet(connection, data + offset, length - offset, now, &processed, &new_largest);
+        if (!consumed) {
+            break;
+        }
+        offset += consumed;
+    }
+    if (!processed) {
+        if (maybe_reset && connection->state < KYROS_QUIC_STATE_CLOSING && kyros_quic_is_stateless_reset(connection, tail)) {
+            kyros_quic_drain(connection, KYROS_QUIC_NO_ERROR, false, "stateless reset", 15, true);
+        }
+        return;
+    }
+    if (connection->state >= KYROS_QUIC_STATE_CLOSING) {
+        return;
+    }
+    kyros_quic_restart_idle(connection, now);
+    connection->eliciting_since_receive = false;
+    if (!connection->is_client) {
+        if (new_largest && peer && !kyros_quic_same_address(peer, (const struct sockaddr*)&connection->peer)) {
+            kyros_quic_on_migration(connection, peer, peer_length, length);
+        } else if (!connection->address_validated) {
+            // the anti-amplification limit moved
+            kyros_quic_queue_send(connection);
+        }
+    }
+    kyros_quic_set_timer(connection);
+}
+
+///
+/// Sending
+///
+
+// frames of a packet being built, the ones to send again if it is lost are tracked in packet
+typedef struct {
+    uint8_t* p;
+    uint8_t* end;
+    kyros_quic_sent_packet* packet;
+    bool ack_eliciting;
+} kyros_quic_writer;
+
+// a packet of the datagram being built, sealed once the datagram is complete (the last one may be padded)
+typedef struct {
+    uint8_t* start;
+    kyros_quic_sent_packet* sent;
+    kyros_quic_space_id space;
+    uint32_t pn_offset;
+    uint32_t header_length;
+    uint32_t payload_length;
+    uint32_t length_offset; // of the 2 bytes Length of long headers, 0 for short ones
+    uint64_t packet_number;
+} kyros_quic_packet;
+
+static inline bool kyros_quic_writer_fits(kyros_quic_writer* writer, uint64_t bytes, bool tracked)
+{
+    return (uint64_t)(writer->end - writer->p) >= bytes && (!tracked || writer->packet->frame_count < KYROS_QUIC_PACKET_FRAMES);
+}
+
+static inline void kyros_quic_writer_track(kyros_quic_writer* writer, kyros_quic_sent_kind kind, uint64_t id, uint64_t offset, uint64_t length, bool fin)
+{
+    writer->packet->frames[writer->packet->frame_count++]
+        = (kyros_quic_sent_frame) { .id = id, .offset = offset, .length = (uint32_t)length, .kind = kind, .fin = fin };
+    writer->ack_eliciting = true;
+}
+
+/// @brief a frame made of integers (its type first), false if it does not fit
+static bool kyros_quic_write_integers(kyros_quic_writer* writer, const uint64_t* values, uint32_t count)
+{
+    uint32_t length = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        length += kyros_quic_varint_length(values[i]);
+    }
+    if (!kyros_quic_writer_fits(writer, length, true)) {
+        return false;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        writer->p = kyros_quic_varint_write(writer->p, values[i]);
+    }
+    return true;
+}
+
+/// @brief lengths of STREAM and CRYPTO frames always take 2 bytes, they are known after the header is written
+static inline uint8_t* kyros_quic_write_length(uint8_t* out, uint64_t length)
+{
+    out[0] = (uint8_t)(0x40 | (length >> 8));
+    out[1] = (uint8_t)length;
+    return out + 2;
+}
+
+static void kyros_quic_write_ack(kyros_quic_connection* connection, kyros_quic_space_id id, kyros_quic_writer* writer, uint64_t now)
+{
+    auto space = &connection->spaces[id];
+    auto items = space->received.items;
+    uint32_t last = space->received.count - 1;
+    uint64_t largest = items[last][1] - 1;
+    uint64_t delay = 0;
+    if (id == KYROS_QUIC_SPACE_APPLICATION && now > space->largest_received_time) {
+        delay = (now - space->largest_received_time) >> KYROS_QUIC_ACK_DELAY_EXPONENT;
+    }
+    // the oldest ranges are left out when they dont fit
+    uint32_t count = space->received.count;
+    while (count) {
+        uint64_t length = 1 + kyros_quic_varint_length(largest) + kyros_quic_varint_length(delay) + kyros_quic_varint_length(count - 1)
+            + kyros_quic_varint_length(largest - items[last][0]);
+        for (uint32_t i = 1; i < count; i++) {
+            length += kyros_quic_varint_length(items[last - i + 1][0] - items[last - i][1] - 1);
+            length += kyros_quic_varint_length(items[last - i][1] - 1 - items[last - i][0]);
+        }
+        if (kyros_quic_writer_fits(writer, length, false)) {
+            break;
+        }
+        count--;
+    }
+    if (!count) {
+        return;
+    }
+    auto p = writer->p;
+    *p++ = KYROS_QUIC_FRAME_ACK;
+    p = kyros_quic_varint_write(p, largest);
+    p = kyros_quic_varint_write(p, delay);
+    p = kyros_quic_varint_write(p, count - 1);
+    p = kyros_quic_varint_write(p, largest - items[last][0]);
+    for (uint32_t i = 1; i < count; i++) {
+        p = kyros_quic_varint_write(p, items[last - i + 1][0] - items[last - i][1] - 1);
+        p = kyros_quic_varint_write(p, items[last - i][1] - 1 - items[last - i][0]);
+    }
+    writer->p = p;
+    space->ack_pending = false;
+    space->ack_eliciting_received = 0;
+    if (id == KYROS_QUIC_SPACE_APPLICATION) {
+        connection->ack_deadline = 0;
+    }
+}
+
+static void kyros_quic_write_close(kyros_quic_connection* connection, kyros_quic_space_id id, kyros_quic_writer* writer)
+{
+    bool application = connection->close_application;
+    uint64_t code = connection->close_code;
+    uint64_t reason_length = connection->close_reason_length;
+    if (application && id != KYROS_QUIC_SPACE_APPLICATION) {
+        // not disclosed before the handshake is done (RFC 9000 10.2.3)
+        application = false;
+        code = KYROS_QUIC_APPLICATION_ERROR;
+        reason_length = 0;
+    }
+    uint64_t header = 1 + kyros_quic_varint_length(code) + (application ? 0 : 1) + 2;
+    if (!kyros_quic_writer_fits(writer, header, false)) {
+        return;
+    }
+    reason_length = kyros_quic_min(reason_length, (uint64_t)(writer->end - writer->p) - header);
+    auto p = writer->p;
+    *p++ = application ? KYROS_QUIC_FRAME_CONNECTION_CLOSE_APPLICATION : KYROS_QUIC_FRAME_CONNECTION_CLOSE;
+    p = kyros_quic_varint_write(p, code);
+    if (!application) {
+        // frame type, unknown
+        *p++ = 0;
+    }
+    p = kyros_quic_write_length(p, reason_length);
+    memcpy(p, connection->close_reason, reason_length);
+    writer->p = p + reason_length;
+}
+
+static void kyros_quic_write_crypto(kyros_quic_space* space, kyros_quic_writer* writer)
+{
+    auto buffer = &space->crypto_send;
+    while (true) {
+        uint64_t offset;
+        uint64_t available;
+        bool retransmit = buffer->lost.count;
+        if (retransmit) {
+            offset = buffer->lost.items[0][0];
+            available = buffer->lost.items[0][1] - offset;
+        } else if (buffer->next < buffer->end) {
+            offset = buffer->next;
+            available = buffer->end - offset;
+        } else {
+            return;
+        }
+        uint64_t header = 1 + kyros_quic_varint_length(offset) + 2;
+        if (!kyros_quic_writer_fits(writer, header + 1, true)) {
+            return;
+        }
+        uint64_t length = kyros_quic_min(available, (uint64_t)(writer->end - writer->p) - header);
+        auto p = writer->p;
+        *p++ = KYROS_QUIC_FRAME_CRYPTO;
+        p = kyros_quic_varint_write(p, offset);
+        p = kyros_quic_write_length(p, length);
+        memcpy(p, kyros_quic_send_buffer_at(buffer, offset), length);
+        writer->p = p + length;
+        kyros_quic_writer_track(writer, KYROS_QUIC_SENT_CRYPTO, 0, offset, length, false);
+        if (retransmit) {
+            kyros_quic_ranges_remove(&buffer->lost, offset, offset + length);
+        } else {
+            buffer->next += length;
+        }
+    }
+}
+
+static bool kyros_quic_stream_pending(kyros_quic_connection* connection, kyros_quic_stream* stream)
+{
+    if (stream->reset_pending || stream->stop_pending || stream->max_data_pending) {
+        return true;
+    }
+    if (stream->reset) {
+        return false;
+    }
+    auto buffer = &stream->send;
+    if (buffer->lost.count) {
+        return true;
+    }
+    // new bytes only while flow control allows them, MAX_DATA and MAX_STREAM_DATA queue the stream again
+    bool fin = stream->fin && !stream->fin_sent && buffer->next == buffer->end;
+    bool fresh = buffer->next < buffer->end && stream->send_max > buffer->next && connection->send_max_data > connection->send_data;
+    return fin || fresh;
+}
+
+/// @brief control frames then data of a stream, false once the packet is full
+static bool kyros_quic_write_stream(kyros_quic_connection* connection, kyros_quic_stream* stream, kyros_quic_writer* writer)
+{
+    auto id = stream->id;
+    if (stream->reset_pending) {
+        if (!kyros_quic_write_integers(writer, (uint64_t[]) { KYROS_QUIC_FRAME_RESET_STREAM, id, stream->reset_code, stream->send.next }, 4)) {
+            return false;
+        }
+        kyros_quic_writer_track(writer, KYROS_QUIC_SENT_RESET_STREAM, id, 0, 0, false);
+        stream->reset_pending = false;
+    }
+    if (stream->stop_pending) {
+        if (!kyros_quic_write_integers(writer, (uint64_t[]) { KYROS_QUIC_FRAME_STOP_SENDING, id, stream->stop_code }, 3)) {
+            return false;
+        }
+        kyros_quic_writer_track(writer, KYROS_QUIC_SENT_STOP_SENDING, id, 0, 0, false);
+        stream->stop_pending = false;
+    }
+    if (stream->max_data_pending) {
+        if (!kyros_quic_write_integers(writer, (uint64_t[]) { KYROS_QUIC_FRAME_MAX_STREAM_DATA, id, stream->recv_max }, 3)) {
+            return false;
+        }
+        kyros_quic_writer_track(writer, KYROS_QUIC_SENT_MAX_STREAM_DATA, id, 0, 0, false);
+        stream->max_data_pending = false;
+    }
+    if (stream->reset) {
+        return true;
+    }
+    auto buffer = &stream->send;
+    while (true) {
+        uint64_t offset;
+        uint64_t available;
+        bool retransmit = buffer->lost.count;
+        if (retransmit) {
+            offset = buffer->lost.items[0][0];
+            available = buffer->lost.items[0][1] - offset;
+        } else {
+            offset = buffer->next;
+            available = buffer->end - offset;
+            available = kyros_quic_min(available, stream->send_max > offset ? stream->send_max - offset : 0);
+            available = kyros_quic_min(available, connection->send_max_data - connection->send_data);
+            if (!available && !(stream->fin && !stream->fin_sent && offset == buffer->end)) {
+                return true;
+            }
+        }
+        uint64_t header = 1 + kyros_quic_varint_length(id) + (offset ? kyros_quic_varint_length(offset) : 0) + 2;
+        if (!kyros_quic_writer_fits(writer, header + (available ? 1 : 0), true)) {
+            return false;
+        }
+        uint64_t length = kyros_quic_min(available, (uint64_t)(writer->end - writer->p) - header);
+        bool fin = stream->fin && offset + length == buffer->end;
+        auto p = writer->p;
+        *p++ = KYROS_QUIC_FRAME_STREAM | 0x02 | (offset ? 0x04 : 0) | (fin ? 0x01 : 0);
+        p = kyros_quic_varint_write(p, id);
+        if (offset) {
+            p = kyros_quic_varint_write(p, offset);
+        }
+        p = kyros_quic_write_length(p, length);
+        // a bare fin on a stream that never had data has no buffer to point at
+        if (length) {
+            memcpy(p, kyros_quic_send_buffer_at(buffer, offset), length);
+        }
+        writer->p = p + length;
+        kyros_quic_writer_track(writer, KYROS_QUIC_SENT_STREAM, id, offset, length, fin);
+        stream->fin_sent |= fin;
+        if (retransmit) {
+            kyros_quic_ranges_remove(&buffer->lost, offset, offset + length);
+        } else {
+            buffer->next += length;
+            connection->send_data += length;
+        }
+        if (length < available) {
+            return false;
+        }
+        if (fin && !retransmit) {
+            return true;
+        }
+    }
+}
+
+/// @brief the streams of the send list in turn, each one that still has something goes back to the tail
+static void kyros_quic_write_streams(kyros_quic_connection* connection, kyros_quic_writer* writer)
+{
+    auto last = connection->send_tail;
+    while (connection->send_head) {
+        auto stream = connection->send_head;
+        bool room = kyros_quic_write_stream(connection, stream, writer);
+        kyros_quic_stream_unlink(connection, stream);
+        if (kyros_quic_stream_pending(connection, stream)) {
+            kyros_quic_stream_queue(connection, stream);
+        }
+        if (!room || stream == last) {
+            return;
+        }
+    }
+}
+
+static bool kyros_quic_write_path_frame(kyros_quic_writer* writer, uint8_t type, const uint8_t* data)
+{
+    if (!kyros_quic_writer_fits(writer, 9, false)) {
+        return false;
+    }
+    *writer->p++ = type;
+    memcpy(writer->p, data, 8);
+    writer->p += 8;
+    writer->ack_eliciting = true;
+    return true;
+}
+
+/// @brief frames of the connection itself in the 1-RTT space, false once the packet is full
+static bool kyros_quic_write_control(kyros_quic_connection* connection, kyros_quic_writer* writer)
+{
+    if (connection->handshake_done_pending) {
+        if (!kyros_quic_write_integers(writer, (uint64_t[]) { KYROS_QUIC_FRAME_HANDSHAKE_DONE }, 1)) {
+            return false;
+        }
+        kyros_quic_writer_track(writer, KYROS_QUIC_SENT_HANDSHAKE_DONE, 0, 0, 0, false);
+        connection->handshake_done_pending = false;
+    }
+    // path frames are not sent again when lost, a new challenge goes with the next PTO
+    if (connection->response_pending) {
+        if (!kyros_quic_write_path_frame(writer, KYROS_QUIC_FRAME_PATH_RESPONSE, connection->path_response)) {
+            return false;
+        }
+        connection->response_pending = false;
+    }
+    if (connection->challenge_pending) {
+        if (!kyros_quic_write_path_frame(writer, KYROS_QUIC_FRAME_PATH_CHALLENGE, connection->path_challenge)) {
+            return false;
+        }
+        connection->challenge_pending = false;
+    }
+    if (connection->max_data_pending) {
+        if (!kyros_quic_write_integers(writer, (uint64_t[]) { KYROS_QUIC_FRAME_MAX_DATA, connection->recv_max_data }, 2)) {
+            return false;
+        }
+        kyros_quic_writer_track(writer, KYROS_QUIC_SENT_MAX_DATA, 0, 0, 0, false);
+        connection->max_data_pending = false;
+    }
+    if (connection->max_streams_pending_bidi) {
+        if (!kyros_quic_write_integers(writer, (uint64_t[]) { KYROS_QUIC_FRAME_MAX_STREAMS_BIDI, connection->peer_max_streams[0] }, 2)) {
+            return false;
+        }
+        kyros_quic_writer_track(writer, KYROS_QUIC_SENT_MAX_STREAMS_BIDI, 0, 0, 0, false);
+        connection->max_streams_pending_bidi = false;
+    }
+    if (connection->max_streams_pending_uni) {
+        if (!kyros_quic_write_integers(writer, (uint64_t[]) { KYROS_QUIC_FRAME_MAX_STREAMS_UNI, connection->peer_max_streams[1] }, 2)) {
+            return false;
+        }
+        kyros_quic_writer_track(writer, KYROS_QUIC_SENT_MAX_STREAMS_UNI, 0, 0, 0, false);
+        connection->max_streams_pending_uni = false;
+    }
+    for (uint32_t i = 0; i < KYROS_QUIC_ACTIVE_CIDS; i++) {
+        auto cid = &connection->cids[i];
+        if (!cid->pending) {
+            continue;
+        }
+        uint64_t length = 1 + kyros_quic_varint_length(cid->sequence) + 1 + 1 + KYROS_QUIC_CID_LENGTH + 16;
+        if (!kyros_quic_writer_fits(writer, length, true)) {
+            return false;
+        }
+        auto p = writer->p;
+        *p++ = KYROS_QUIC_FRAME_NEW_CONNECTION_ID;
+        p = kyros_quic_varint_write(p, cid->sequence);
+        // retire prior to
+        *p++ = 0;
+        *p++ = KYROS_QUIC_CID_LENGTH;
+        memcpy(p, cid->id, KYROS_QUIC_CID_LENGTH);
+        p += KYROS_QUIC_CID_LENGTH;
+        kyros_quic_reset_token(connection->endpoint->secret, cid->id, KYROS_QUIC_CID_LENGTH, p);
+        writer->p = p + 16;
+        kyros_quic_writer_track(writer, KYROS_QUIC_SENT_NEW_CONNECTION_ID, cid->sequence, 0, 0, false);
+        cid->pending = false;
+    }
+    for (uint32_t i = 0; i < connection->peer_cid_count; i++) {
+        auto cid = &connection->peer_cids[i];
+        if (!cid->retire_pending) {
+            continue;
+        }
+        if (!kyros_quic_write_integers(writer, (uint64_t[]) { KYROS_QUIC_FRAME_RETIRE_CONNECTION_ID, cid->sequence }, 2)) {
+            return false;
+        }
+        kyros_quic_writer_track(writer, KYROS_QUIC_SENT_RETIRE_CONNECTION_ID, cid->sequence, 0, 0, false);
+        cid->retire_pending = false;
+    }
+    return true;
+}
+
+/// @brief something ack-eliciting is waiting in the space
+static bool kyros_quic_space_pending(kyros_quic_connection* connection, kyros_quic_space_id id)
+{
+    auto space = &connection->spaces[id];
+    if (kyros_quic_send_buffer_pending(&space->crypto_send)) {
+        return true;
+    }
+    if (id != KYROS_QUIC_SPACE_APPLICATION || !connection->handshake_complete) {
+        return false;
+    }
+    if (connection->send_head || connection->handshake_done_pending || connection->response_pending || connection->challenge_pending
+        || connection->max_data_pending || connection->max_streams_pending_bidi || connection->max_streams_pending_uni) {
+        return true;
+    }
+    for (uint32_t i = 0; i < KYROS_QUIC_ACTIVE_CIDS; i++) {
+        if (connection->cids[i].pending) {
+            return true;
+        }
+    }
+    for (uint32_t i = 0; i < connection->peer_cid_count; i++) {
+        if (connection->peer_cids[i].retire_pending) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/// @brief a packet of the space in out (unsealed), returns its length with the tag or 0 if there is nothing to send in it
+static uint32_t kyros_quic_write_packet(kyros_quic_connection* connection, kyros_quic_space_id id, uint8_t* out, uint32_t room, uint64_t now,
+    bool eliciting_allowed, kyros_quic_packet* packet)
+{
+    auto space = &connection->spaces[id];
+    bool closing = connection->state == KYROS_QUIC_STATE_CLOSING;
+    bool ack = space->ack_pending && space->received.count;
+    if (closing ? !connection->close_pending : !ack && !space->probe && !(eliciting_allowed && kyros_quic_space_pending(connection, id))) {
+        return 0;
+    }
+    if (room < KYROS_QUIC_MIN_PACKET) {
+        return 0;
+    }
+    auto cid = kyros_quic_current_peer_cid(connection);
+    uint64_t pn = space->next_packet_number;
+    // twice the distance to what the peer acknowledged (RFC 9000 17.1)
+    uint64_t unacked = space->largest_acked == UINT64_MAX ? pn + 1 : pn - space->largest_acked;
+    uint32_t pn_length = unacked < 128 ? 1 : unacked < 32768 ? 2 : unacked < 8388608 ? 3 : 4;
+    auto p = out;
+    uint32_t length_offset = 0;
+    if (id == KYROS_QUIC_SPACE_APPLICATION) {
+        *p++ = (uint8_t)(0x40 | (connection->key_phase << 2) | (pn_length - 1));
+        memcpy(p, cid->id, cid->length);
+        p += cid->length;
+    } else {
+        uint8_t type = id == KYROS_QUIC_SPACE_INITIAL ? KYROS_QUIC_PACKET_INITIAL : KYROS_QUIC_PACKET_HANDSHAKE;
+        *p++ = (uint8_t)(0xc0 | (type << 4) | (pn_length - 1));
+        p = kyros_quic_write_u32(p, KYROS_QUIC_VERSION);
+        *p++ = cid->length;
+        memcpy(p, cid->id, cid->length);
+        p += cid->length;
+        *p++ = KYROS_QUIC_CID_LENGTH;
+        memcpy(p, connection->cids[0].id, KYROS_QUIC_CID_LENGTH);
+        p += KYROS_QUIC_CID_LENGTH;
+        if (id == KYROS_QUIC_SPACE_INITIAL) {
+            // no token
+            *p++ = 0;
+        }
+        length_offset = (uint32_t)(p - out);
+        p += 2;
+    }
+    uint32_t pn_offset = (uint32_t)(p - out);
+    for (uint32_t i = 0; i < pn_length; i++) {
+        *p++ = (uint8_t)(pn >> ((pn_length - 1 - i) * 8));
+    }
+    kyros_quic_writer writer = { .p = p, .end = out + room - KYROS_QUIC_TAG_LENGTH, .packet = kyros_quic_sent_push(space, pn) };
+    if (ack) {
+        kyros_quic_write_ack(connection, id, &writer, now);
+    }
+    if (closing) {
+        kyros_quic_write_close(connection, id, &writer);
+    } else if (eliciting_allowed || space->probe) {
+        kyros_quic_write_crypto(space, &writer);
+        if (id == KYROS_QUIC_SPACE_APPLICATION && connection->handshake_complete && kyros_quic_write_control(connection, &writer)) {
+            kyros_quic_write_streams(connection, &writer);
+        }
+        if (space->probe && !writer.ack_eliciting && kyros_quic_writer_fits(&writer, 1, false)) {
+            *writer.p++ = KYROS_QUIC_FRAME_PING;
+            writer.ack_eliciting = true;
+        }
+    }
+    if (writer.p == p) {
+        space->sent_count--;
+        return 0;
+    }
+    // the header protection sample starts 4 bytes after the packet number
+    while (pn_length + (writer.p - p) < 4) {
+        *writer.p++ = KYROS_QUIC_FRAME_PADDING;
+    }
+    if (writer.ack_eliciting) {
+        space->probe = false;
+    }
+    space->next_packet_number++;
+    writer.packet->ack_eliciting = writer.ack_eliciting;
+    writer.packet->time_sent = now;
+    *packet = (kyros_quic_packet) {
+        .start = out,
+        .sent = writer.packet,
+        .space = id,
+        .pn_offset = pn_offset,
+        .header_length = (uint32_t)(p - out),
+        .payload_length = (uint32_t)(writer.p - p),
+        .length_offset = length_offset,
+        .packet_number = pn,
+    };
+    return (uint32_t)(writer.p - out) + KYROS_QUIC_TAG_LENGTH;
+}
+
+/// @brief one datagram with a packet per space that has something (coalesced, RFC 9000 12.2), 0 if there is nothing to send
+static uint32_t kyros_quic_build_datagram(kyros_quic_connection* connection, uint8_t* out, uint64_t now)
+{
+    uint32_t limit = KYROS_QUIC_MAX_DATAGRAM;
+    if (!connection->is_client && !connection->address_validated) {
+        uint64_t allowance = 3 * connection->bytes_received > connection->bytes_sent ? 3 * connection->bytes_received - connection->bytes_sent : 0;
+        limit = (uint32_t)kyros_quic_min(limit, allowance);
+    }
+    bool closing = connection->state == KYROS_QUIC_STATE_CLOSING;
+    // ack-eliciting frames wait for the congestion window and the pacer, the probes of the PTO dont
+    bool eliciting_allowed = !closing && (connection->probes || connection->bytes_in_flight + KYROS_QUIC_MAX_DATAGRAM <= connection->congestion_window);
+    if (eliciting_allowed && !connection->probes && !connection->options.disable_pacing) {
+        uint64_t next_send;
+        if (!kyros_quic_pacer_allows(connection, now, &next_send)) {
+            eliciting_allowed = false;
+            connection->pacing_deadline = next_send;
+        }
+    }
+    kyros_quic_packet packets[KYROS_QUIC_SPACES];
+    uint32_t count = 0;
+    uint32_t length = 0;
+    for (uint32_t i = 0; i < KYROS_QUIC_SPACES; i++) {
+        auto space = &connection->spaces[i];
+        if (space->discarded || !space->write_keys) {
+            continue;
+        }
+        auto written = kyros_quic_write_packet(connection, i, out + length, limit - length, now, eliciting_allowed, &packets[count]);
+        if (written) {
+            length += written;
+            count++;
+        }
+    }
+    if (!count) {
+        return 0;
+    }
+    // datagrams with an Initial of the client, or an ack-eliciting one of the server, are padded to 1200 (RFC 9000 14.1)
+    bool pad = false;
+    for (uint32_t i = 0; i < count; i++) {
+        pad |= packets[i].space == KYROS_QUIC_SPACE_INITIAL && (connection->is_client || packets[i].sent->ack_eliciting);
+    }
+    auto last = &packets[count - 1];
+    if (pad && length < limit) {
+        memset(last->start + last->header_length + last->payload_length, KYROS_QUIC_FRAME_PADDING, limit - length);
+        last->payload_length += limit - length;
+        length = limit;
+    }
+    bool ack_eliciting = false;
+    bool discard_initial = false;
+    for (uint32_t i = 0; i < count; i++) {
+        auto packet = &packets[i];
+        auto space = &connection->spaces[packet->space];
+        if (packet->length_offset) {
+            uint32_t remainder = packet->header_length - packet->pn_offset + packet->payload_length + KYROS_QUIC_TAG_LENGTH;
+            kyros_quic_write_length(packet->start + packet->length_offset, remainder);
+        }
+        kyros_quic_seal(space->write_keys, packet->start, packet->pn_offset, packet->header_length, packet->payload_length, packet->packet_number);
+        auto sent = packet->sent;
+        sent->size = (uint16_t)(packet->header_length + packet->payload_length + KYROS_QUIC_TAG_LENGTH);
+        sent->in_flight = !closing && (sent->ack_eliciting || (pad && packet == last));
+        if (!sent->in_flight) {
+            // nothing in it is sent again, and nothing waits for its ACK
+            sent->settled = true;
+            kyros_quic_sent_trim(space);
+            continue;
+        }
+        connection->bytes_in_flight += sent->size;
+        if (sent->ack_eliciting) {
+            space->ack_eliciting_in_flight++;
+            space->last_ack_eliciting_time = now;
+            ack_eliciting = true;
+        }
+        discard_initial |= connection->is_client && packet->space == KYROS_QUIC_SPACE_HANDSHAKE;
+    }
+    if (discard_initial) {
+        // a client is done with the Initial keys once it sends a Handshake packet (RFC 9001 4.9.1)
+        kyros_quic_discard_space(connection, KYROS_QUIC_SPACE_INITIAL);
+    }
+    connection->packets_sent += count;
+    connection->bytes_sent += length;
+    if (ack_eliciting) {
+        if (connection->probes) {
+            connection->probes--;
+        } else if (!connection->options.disable_pacing) {
+            kyros_quic_pacer_on_sent(connection, length);
+        }
+        if (!connection->eliciting_since_receive) {
+            connection->eliciting_since_receive = true;
+            kyros_quic_restart_idle(connection, now);
+        }
+    }
+    if (closing) {
+        connection->close_pending = false;
+    }
+    return length;
+}
+
+static void kyros_quic_send(kyros_quic_connection* connection)
+{
+    auto endpoint = connection->endpoint;
+    if (connection->state == KYROS_QUIC_STATE_DRAINING || endpoint->blocked) {
+        return;
+    }
+    auto udp = kyros_quic_endpoint_udp(endpoint);
+    auto peer = connection->is_client ? NULL : (const struct sockaddr*)&connection->peer;
+    auto now = kyros_quic_now();
+    uint8_t datagram[KYROS_QUIC_MAX_DATAGRAM];
+    uint32_t sent = 0;
+    for (; sent < KYROS_QUIC_SEND_BURST; sent++) {
+        auto length = kyros_quic_build_datagram(connection, datagram, now);
+        if (!length) {
+            break;
+        }
+        if (!kyros_udp_send(udp, (const char*)datagram, length, peer)) {
+            // lost as far as recovery knows, the ondrain of the socket sends again
+            endpoint->blocked = true;
+            break;
+        }
+    }
+    if (sent == KYROS_QUIC_SEND_BURST) {
+        // the rest goes on the next iteration, other sockets get their turn
+        connection->pacing_deadline = now;
+    }
+    kyros_quic_set_loss_timer(connection, now);
+    kyros_quic_set_timer(connection);
+}
+
+static void kyros_quic_queue_send(kyros_quic_connection* connection)
+{
+    if (connection->send_queued || connection->state == KYROS_QUIC_STATE_DRAINING) {
+        return;
+    }
+    auto internal = kyros_get_internal_loop(connection->endpoint->loop);
+    connection->send_queued = true;
+    connection->send_next = internal->quic_sends;
+    internal->quic_sends = connection;
+}
+
+void kyros_quic_flush_sends(kyros_loop_internal* internal)
+{
+    // connections queued while building are sent by the next hook
+    auto connection = internal->quic_sends;
+    internal->quic_sends = NULL;
+    while (connection) {
+        auto next = connection->send_next;
+        connection->send_next = NULL;
+        connection->send_queued = false;
+        kyros_quic_send(connection);
+        connection = next;
+    }
+}
+
+static void kyros_quic_on_timer(kyros_timer_entry* entry)
+{
+    auto connection = kyros_container_of(entry, kyros_quic_connection, timer);
+    auto now = kyros_quic_now();
+    if (connection->close_deadline && now >= connection->close_deadline) {
+        kyros_quic_connection_free(connection);
+        return;
+    }
+    if (connection->idle_deadline && now >= connection->idle_deadline) {
+        // silently, the peer finds out with its own timeout
+        kyros_quic_drain(connection, KYROS_QUIC_NO_ERROR, false, "", 0, true);
+        return;
+    }
+    if (connection->ack_deadline && now >= connection->ack_deadline) {
+        connection->ack_deadline = 0;
+        kyros_quic_queue_send(connection);
+    }
+    if (connection->pacing_deadline && now >= connection->pacing_deadline) {
+        connection->pacing_deadline = 0;
+        kyros_quic_queue_send(connection);
+    }
+    if (connection->loss_deadline && now >= connection->loss_deadline) {
+        connection->loss_deadline = 0;
+        kyros_quic_on_loss_timeout(connection, now);
+    }
+    kyros_quic_set_timer(connection);
+}
+
+///
+/// Endpoints
+///
+
+static void kyros_quic_set_transport_params(kyros_quic_connection* connection)
+{
+    auto options = &connection->options;
+    kyros_quic_transport_params params = {
+        .max_idle_timeout = options->idle_timeout,
+        .max_udp_payload_size = KYROS_QUIC_MAX_UDP_PAYLOAD,
+        .initial_max_data = options->max_data,
+        .initial_max_stream_data_bidi_local = options->max_stream_data,
+        .initial_max_stream_data_bidi_remote = options->max_stream_data,
+        .initial_max_stream_data_uni = options->max_stream_data,
+        .initial_max_streams_bidi = options->max_streams_bidi,
+        .initial_max_streams_uni = options->max_streams_uni,
+        .max_ack_delay = KYROS_QUIC_MAX_ACK_DELAY,
+        .active_connection_id_limit = KYROS_QUIC_PEER_CIDS,
+        .initial_scid_length = KYROS_QUIC_CID_LENGTH,
+    };
+    memcpy(params.initial_scid, connection->cids[0].id, KYROS_QUIC_CID_LENGTH);
+    if (!connection->is_client) {
+        memcpy(params.original_dcid, connection->original_dcid, connection->original_dcid_length);
+        params.original_dcid_length = connection->original_dcid_length;
+        kyros_quic_reset_token(connection->endpoint->secret, connection->cids[0].id, KYROS_QUIC_CID_LENGTH, params.stateless_reset_token);
+    }
+    uint8_t encoded[256];
+    auto length = kyros_quic_transport_params_encode(&params, !connection->is_client, encoded);
+    SSL_set_quic_transport_params(connection->ssl, encoded, length);
+}
+
+static kyros_quic_connection* kyros_quic_connection_create(kyros_quic_endpoint* endpoint)
+{
+    kyros_quic_connection* connection = kyros_calloc(1, sizeof(kyros_quic_connection));
+    connection->endpoint = endpoint;
+    endpoint->ref_count++;
+    connection->next = endpoint->connections;
+    if (endpoint->connections) {
+        endpoint->connections->prev = connection;
+    }
+    endpoint->connections = connection;
+    connection->is_client = endpoint->is_client;
+    connection->handler = endpoint->handler;
+    connection->options = endpoint->options;
+    for (uint32_t i = 0; i < KYROS_QUIC_SPACES; i++) {
+        connection->spaces[i].largest_acked = UINT64_MAX;
+    }
+    kyros_quic_recovery_init(connection);
+    // what the peer gets until its transport parameters are known
+    connection->peer_params.max_ack_delay = KYROS_QUIC_MAX_ACK_DELAY;
+    connection->peer_params.ack_delay_exponent = KYROS_QUIC_ACK_DELAY_EXPONENT;
+    connection->peer_params.active_connection_id_limit = 2;
+    connection->timer.callback = kyros_quic_on_timer;
+    connection->idle_timeout = (uint64_t)connection->options.idle_timeout * 1000;
+    connection->recv_max_data = connection->options.max_data;
+    connection->peer_max_streams[0] = connection->options.max_streams_bidi;
+    connection->peer_max_streams[1] = connection->options.max_streams_uni;
+    uv_once(&kyros_quic_index_once, kyros_quic_create_index);
+    connection->ssl = SSL_new(endpoint->tls);
+    SSL_set_ex_data(connection->ssl, kyros_quic_ssl_index, connection);
+    SSL_set_quic_method(connection->ssl, &kyros_quic_method);
+    SSL_set_min_proto_version(connection->ssl, TLS1_3_VERSION);
+    SSL_set_quic_use_legacy_codepoint(connection->ssl, 0);
+    kyros_quic_issue_cid(connection, &connection->cids[0]);
+    return connection;
+}
+
+/// @brief first Initial of a client, the connection is routed by the id the client picked until the handshake is done
+static kyros_quic_connection* kyros_quic_accept(kyros_quic_endpoint* endpoint, const uint8_t* dcid, uint8_t dcid_length, const uint8_t* scid,
+    uint8_t scid_length, const struct sockaddr* peer, socklen_t peer_length)
+{
+    auto connection = kyros_quic_connection_create(endpoint);
+    connection->peer_cids[0].length = scid_length;
+    memcpy(connection->peer_cids[0].id, scid, scid_length);
+    connection->peer_cid_count = 1;
+    memcpy(&connection->peer, peer, peer_length);
+    connection->peer_length = peer_length;
+    memcpy(connection->original_dcid, dcid, dcid_length);
+    connection->original_dcid_length = dcid_length;
+    kyros_quic_cid_insert(endpoint, dcid, dcid_length, connection);
+    auto initial = &connection->spaces[KYROS_QUIC_SPACE_INITIAL];
+    initial->read_keys = kyros_quic_keys_initial(dcid, dcid_length, false);
+    initial->write_keys = kyros_quic_keys_initial(dcid, dcid_length, true);
+    kyros_quic_set_transport_params(connection);
+    SSL_set_accept_state(connection->ssl);
+    kyros_quic_restart_idle(connection, kyros_quic_now());
+    return connection;
+}
+
+/// @brief the versions we speak, for a long header packet of a version we dont (RFC 9000 6)
+static void kyros_quic_send_version_negotiation(kyros_quic_endpoint* endpoint, const uint8_t* dcid, uint8_t dcid_length, const uint8_t* scid,
+    uint8_t scid_length, const struct sockaddr* peer)
+{
+    uint8_t packet[1 + 4 + 1 + KYROS_QUIC_MAX_CID_LENGTH + 1 + KYROS_QUIC_MAX_CID_LENGTH + 4];
+    auto p = packet;
+    RAND_bytes(p, 1);
+    *p++ |= 0x80;
+    p = kyros_quic_write_u32(p, 0);
+    // the ids of the client swapped
+    *p++ = scid_length;
+    memcpy(p, scid, scid_length);
+    p += scid_length;
+    *p++ = dcid_length;
+    memcpy(p, dcid, dcid_length);
+    p += dcid_length;
+    p = kyros_quic_write_u32(p, KYROS_QUIC_VERSION);
+    kyros_udp_send(kyros_quic_endpoint_udp(endpoint), (const char*)packet, (uint32_t)(p - packet), peer);
+}
+
+/// @brief a short header packet for a connection we dont know (RFC 9000 10.3), smaller than it so two endpoints dont loop
+static void kyros_quic_send_stateless_reset(kyros_quic_endpoint* endpoint, const uint8_t* dcid, uint32_t received, const struct sockaddr* peer)
+{
+    uint32_t length = (uint32_t)kyros_quic_min(received - 1, 43);
+    if (received < 22) {
+        return;
+    }
+    uint8_t packet[43];
+    RAND_bytes(packet, length - 16);
+    packet[0] = (packet[0] & 0x3f) | 0x40;
+    kyros_quic_reset_token(endpoint->secret, dcid, KYROS_QUIC_CID_LENGTH, packet + length - 16);
+    kyros_udp_send(kyros_quic_endpoint_udp(endpoint), (const char*)packet, length, peer);
+}
+
+/// @brief a client connection got a Version Negotiation packet before anything else, it gives up if version 1 is not in it
+static void kyros_quic_on_version_negotiation(kyros_quic_connection* connection, const uint8_t* versions, const uint8_t* end)
+{
+    if (connection->state != KYROS_QUIC_STATE_HANDSHAKE || connection->packets_received) {
+        return;
+    }
+    for (; end - versions >= 4; versions += 4) {
+        if (kyros_quic_read_u32(versions) == KYROS_QUIC_VERSION) {
+            // forged or stale, ignored (RFC 9000 6.2)
+            return;
+        }
+    }
+    kyros_quic_drain(connection, KYROS_QUIC_NO_ERROR, false, "no supported version", 20, true);
+}
+
+static void kyros_quic_endpoint_receive(kyros_quic_endpoint* endpoint, uint8_t* data, uint32_t length, const struct sockaddr* peer,
+    socklen_t peer_length)
+{
+    if (!length) {
+        return;
+    }
+    if (!(data[0] & 0x80)) {
+        if (length < 1 + KYROS_QUIC_CID_LENGTH) {
+            return;
+        }
+        auto connection = kyros_quic_cid_find(endpoint, data + 1, KYROS_QUIC_CID_LENGTH);
+        if (!connection) {
+            if (!endpoint->is_client) {
+                kyros_quic_send_stateless_reset(endpoint, data + 1, length, peer);
+                return;
+            }
+            // maybe a stateless reset, the connection checks its token
+            connection = endpoint->connections;
+        }
+        if (connection) {
+            kyros_quic_connection_receive(connection, data, length, peer, peer_length);
+        }
+        return;
+    }
+    if (length < 7) {
+        return;
+    }
+    auto end = data + length;
+    uint32_t version = kyros_quic_read_u32(data + 1);
+    const uint8_t* dcid = data + 6;
+    uint8_t dcid_length = data[5];
+    if (dcid_length > KYROS_QUIC_MAX_CID_LENGTH || end - dcid < dcid_length + 1) {
+        return;
+    }
+    const uint8_t* scid = dcid + dcid_length + 1;
+    uint8_t scid_length = dcid[dcid_length];
+    if (scid_length > KYROS_QUIC_MAX_CID_LENGTH || end - scid < scid_length) {
+        return;
+    }
+    if (version != KYROS_QUIC_VERSION) {
+        if (endpoint->is_client) {
+            auto connection = kyros_quic_cid_find(endpoint, dcid, dcid_length);
+            if (!version && connection) {
+                kyros_quic_on_version_negotiation(connection, scid + scid_length, end);
+            }
+        } else if (version && length >= KYROS_QUIC_MAX_DATAGRAM) {
+            kyros_quic_send_version_negotiation(endpoint, dcid, dcid_length, scid, scid_length, peer);
+        }
+        return;
+    }
+    auto connection = kyros_quic_cid_find(endpoint, dcid, dcid_length);
+    if (!connection) {
+        // only an Initial padded to 1200 bytes with an id of at least 8 bytes opens a connection (RFC 9000 7.2 and 14.1)
+        bool initial = ((data[0] >> 4) & 3) == KYROS_QUIC_PACKET_INITIAL;
+        if (endpoint->is_client || endpoint->closed || !initial || length < KYROS_QUIC_MAX_DATAGRAM || dcid_length < 8) {
+            return;
+        }
+        connection = kyros_quic_accept(endpoint, dcid, dcid_length, scid, scid_length, peer, peer_length);
+    }
+    kyros_quic_connection_receive(connection, data, length, peer, peer_length);
+}
+
+static void kyros_quic_on_socket_drain(kyros_socket socket, void* ctx)
+{
+    kyros_quic_endpoint* endpoint = ctx;
+    endpoint->blocked = false;
+    for (auto connection = endpoint->connections; connection; connection = connection->next) {
+        kyros_quic_queue_send(connection);
+    }
+}
+
+static void kyros_quic_on_socket_status(kyros_socket socket, kyros_socket_error error, void* ctx)
+{
+    kyros_quic_endpoint* endpoint = ctx;
+    if (error.type == KYROS_SOCKET_ERROR_NO_ERROR || !endpoint->is_client || !endpoint->connections) {
+        return;
+    }
+    // the socket of a client could not connect (or failed), there is nothing to wait for
+    auto message = error.message ? error.message : "socket error";
+    kyros_quic_drain(endpoint->connections, KYROS_QUIC_INTERNAL_ERROR, false, message, (uint32_t)strlen(message), true);
+}
+
+static void kyros_quic_on_datagrams(kyros_socket socket, const kyros_udp_datagram* datagrams, uint32_t count, void* ctx)
+{
+    kyros_quic_endpoint* endpoint = ctx;
+    // the last connection could be freed in the middle (and the listener closed)
+    endpoint->ref_count++;
+    for (uint32_t i = 0; i < count; i++) {
+        // the receive buffer of the loop, packets are decrypted in place
+        kyros_quic_endpoint_receive(endpoint, (uint8_t*)datagrams[i].data, datagrams[i].length, datagrams[i].peer, datagrams[i].peer_length);
+    }
+    kyros_quic_endpoint_release(endpoint);
+}
+
+static kyros_quic_endpoint* kyros_quic_endpoint_create(kyros_loop* loop, SSL_CTX* tls, kyros_quic_options options, kyros_quic_handler handler,
+    bool is_client)
+{
+    kyros_quic_endpoint* endpoint = kyros_calloc(1, sizeof(kyros_quic_endpoint));
+    endpoint->socket_handler = (kyros_socket_handler) {
+        .ctx = endpoint,
+        .ondrain = kyros_quic_on_socket_drain,
+        .onstatus = kyros_quic_on_socket_status,
+        .ondatagrams = kyros_quic_on_datagrams,
+        .ref_count = 1,
+    };
+    endpoint->loop = loop;
+    endpoint->tls = tls;
+    endpoint->is_client = is_client;
+    endpoint->handler = handler;
+    if (!options.idle_timeout) {
+        options.idle_timeout = KYROS_QUIC_IDLE_TIMEOUT;
+    }
+    if (!options.max_stream_data) {
+        options.max_stream_data = KYROS_QUIC_MAX_STREAM_DATA;
+    }
+    if (!options.max_data) {
+        options.max_data = KYROS_QUIC_MAX_DATA;
+    }
+    if (!options.max_streams_bidi) {
+        options.max_streams_bidi = KYROS_QUIC_MAX_STREAMS;
+    }
+    if (!options.max_streams_uni) {
+        options.max_streams_uni = KYROS_QUIC_MAX_STREAMS;
+    }
+    endpoint->options = options;
+    RAND_bytes(endpoint->secret, sizeof(endpoint->secret));
+    return endpoint;
+}
+
+///
+/// Public API
+///
+
+kyros_quic_listener* kyros_quic_listen(kyros_loop* loop, kyros_socket_source source, SSL_CTX* tls, kyros_quic_options options, kyros_quic_handler handler)
+{
+    if (!options.alpn || (source.type != KYROS_SOCKET_SOURCE_HOSTPORT && source.type != KYROS_SOCKET_SOURCE_FD)) {
+        return NULL;
+    }
+    auto endpoint = kyros_quic_endpoint_create(loop, tls, options, handler, false);
+    if (source.type == KYROS_SOCKET_SOURCE_HOSTPORT) {
+        source.value.host_port.use_udp = true;
+    }
+    endpoint->socket = kyros_udp_bind(loop, source, &endpoint->socket_handler);
+    if (!endpoint->socket.tagged_ptr) {
+        kyros_free(endpoint);
+        return NULL;
+    }
+    kyros_socket_ref(endpoint->socket);
+    // held by the listener
+    endpoint->ref_count = 1;
+    SSL_CTX_set_alpn_select_cb(tls, kyros_quic_alpn_select, NULL);
+    return endpoint;
+}
+
+void kyros_quic_listener_close(kyros_quic_listener* listener)
+{
+    if (listener->closed) {
+        return;
+    }
+    listener->closed = true;
+    for (auto connection = listener->connections; connection; connection = connection->next) {
+        kyros_quic_close_with(connection, KYROS_QUIC_NO_ERROR, false, "", 0);
+    }
+    kyros_quic_endpoint_release(listener);
+}
+
+kyros_quic_connection* kyros_quic_connect(kyros_loop* loop, kyros_socket_source source, SSL_CTX* tls, const char* server_name,
+    kyros_quic_options options, kyros_quic_handler handler)
+{
+    if (!options.alpn || (source.type != KYROS_SOCKET_SOURCE_HOSTPORT && source.type != KYROS_SOCKET_SOURCE_FD)) {
+        return NULL;
+    }
+    // a socket of its own, the connection is the only one of the endpoint
+    auto endpoint = kyros_quic_endpoint_create(loop, tls, options, handler, true);
+    if (source.type == KYROS_SOCKET_SOURCE_HOSTPORT) {
+        source.value.host_port.use_udp = true;
+    }
+    endpoint->socket = kyros_udp_connect(loop, source, &endpoint->socket_handler);
+    kyros_socket_ref(endpoint->socket);
+    auto connection = kyros_quic_connection_create(endpoint);
+    // the server replaces it with an id of its own, the Initial keys stay derived from it
+    auto original = &connection->peer_cids[0];
+    original->length = KYROS_QUIC_CID_LENGTH;
+    RAND_bytes(original->id, KYROS_QUIC_CID_LENGTH);
+    connection->peer_cid_count = 1;
+    memcpy(connection->original_dcid, original->id, KYROS_QUIC_CID_LENGTH);
+    connection->original_dcid_length = KYROS_QUIC_CID_LENGTH;
+    auto initial = &connection->spaces[KYROS_QUIC_SPACE_INITIAL];
+    initial->read_keys = kyros_quic_keys_initial(original->id, KYROS_QUIC_CID_LENGTH, true);
+    initial->write_keys = kyros_quic_keys_initial(original->id, KYROS_QUIC_CID_LENGTH, false);
+    // a single protocol in ALPN wire format
+    uint8_t alpn[256];
+    auto alpn_length = (uint8_t)kyros_quic_min(strlen(connection->options.alpn), 255);
+    alpn[0] = alpn_length;
+    memcpy(alpn + 1, connection->options.alpn, alpn_length);
+    SSL_set_alpn_protos(connection->ssl, alpn, alpn_length + 1);
+    if (server_name) {
+        SSL_set_tlsext_host_name(connection->ssl, server_name);
+    }
+    kyros_quic_set_transport_params(connection);
+    SSL_set_connect_state(connection->ssl);
+    // the ClientHello, sent by the loop hook
+    kyros_quic_do_handshake(connection);
+    kyros_quic_restart_idle(connection, kyros_quic_now());
+    kyros_quic_queue_send(connection);
+    kyros_quic_set_timer(connection);
+    return connection;
+}
+
+uint64_t kyros_quic_open_stream(kyros_quic_connection* connection, bool bidirectional)
+{
+    uint32_t uni = !bidirectional;
+    if (connection->state != KYROS_QUIC_STATE_OPEN || connection->local_streams[uni] >= connection->local_max_streams[uni]) {
+        return UINT64_MAX;
+    }
+    uint64_t id = (connection->local_streams[uni]++ << 2) | (uni << 1) | (connection->is_client ? 0 : 1);
+    kyros_quic_stream_create(connection, id);
+    return id;
+}
+
+bool kyros_quic_stream_write(kyros_quic_connection* connection, uint64_t stream_id, const char* data, uint64_t length, bool fin)
+{
+    if (connection->state != KYROS_QUIC_STATE_OPEN) {
+        return false;
+    }
+    auto stream = kyros_quic_stream_find(connection, stream_id);
+    if (!stream || !stream->has_send || stream->fin || stream->reset) {
+        return false;
+    }
+    if (length) {
+        kyros_quic_send_buffer_append(&stream->send, data, length);
+    }
+    stream->fin = fin;
+    kyros_quic_stream_queue(connection, stream);
+    if (stream->send.end - stream->send.base > KYROS_QUIC_STREAM_HIGH_WATERMARK) {
+        stream->drain_due = true;
+        return false;
+    }
+    return true;
+}
+
+static void kyros_quic_stream_stop_sending(kyros_quic_connection* connection, kyros_quic_stream* stream, uint64_t error_code)
+{
+    if (stream->has_recv && !stream->recv_done && !stream->stopped) {
+        // what the peer sends until its RESET_STREAM is dropped (and credited)
+        stream->stopped = true;
+        stream->stop_pending = true;
+        stream->stop_code = error_code;
+        stream->max_data_pending = false;
+    }
+}
+
+void kyros_quic_stream_reset(kyros_quic_connection* connection, uint64_t stream_id, uint64_t error_code)
+{
+    if (connection->state != KYROS_QUIC_STATE_OPEN) {
+        return;
+    }
+    auto stream = kyros_quic_stream_find(connection, stream_id);
+    if (!stream) {
+        return;
+    }
+    if (stream->has_send && !stream->reset && !stream->fin_acked) {
+        stream->reset = true;
+        stream->reset_pending = true;
+        stream->reset_code = error_code;
+        kyros_quic_ranges_free(&stream->send.lost);
+    }
+    kyros_quic_stream_stop_sending(connection, stream, error_code);
+    kyros_quic_stream_queue(connection, stream);
+}
+
+void kyros_quic_stream_stop(kyros_quic_connection* connection, uint64_t stream_id, uint64_t error_code)
+{
+    if (connection->state != KYROS_QUIC_STATE_OPEN) {
+        return;
+    }
+    auto stream = kyros_quic_stream_find(connection, stream_id);
+    if (!stream) {
+        return;
+    }
+    kyros_quic_stream_stop_sending(connection, stream, error_code);
+    kyros_quic_stream_queue(connection, stream);
+}
+
+void kyros_quic_stream_set_ctx(kyros_quic_connection* connection, uint64_t stream_id, void* ctx)
+{
+    auto stream = kyros_quic_stream_find(connection, stream_id);
+    if (stream) {
+        stream->ctx = ctx;
+    }
+}
+
+void* kyros_quic_stream_get_ctx(kyros_quic_connection* connection, uint64_t stream_id)
+{
+    auto stream = kyros_quic_stream_find(connection, stream_id);
+    return stream ? stream->ctx : NULL;
+}
+
+void kyros_quic_close(kyros_quic_connection* connection, uint64_t error_code, const char* reason, uint32_t reason_length)
+{
+    kyros_quic_close_with(connection, error_code, true, reason, reason_length);
+}
+
+void kyros_quic_set_ctx(kyros_quic_connection* connection, void* ctx)
+{
+    connection->handler.ctx = ctx;
+}
+
+kyros_socket kyros_quic_get_socket(kyros_quic_connection* connection)
+{
+    return connection->endpoint->socket;
+}
+
+SSL* kyros_quic_get_ssl(kyros_quic_connection* connection)
+{
+    return connection->ssl;
+}
+
+kyros_quic_stats kyros_quic_get_stats(kyros_quic_connection* connection)
+{
+    return (kyros_quic_stats) {
+        .smoothed_rtt = connection->smoothed_rtt,
+        .min_rtt = connection->min_rtt == UINT64_MAX ? 0 : connection->min_rtt,
+        .congestion_window = connection->congestion_window,
+        .bytes_in_flight = connection->bytes_in_flight,
+        .packets_sent = connection->packets_sent,
+        .packets_received = connection->packets_received,
+        .packets_lost = connection->packets_lost,
+    };
+}
+
+#else
+
+// the QUIC API of BoringSSL is required, OpenSSL builds only get the stubs
+
+kyros_quic_listener* kyros_quic_listen(kyros_loop* loop, kyros_socket_source source, SSL_CTX* tls, kyros_quic_options options, kyros_quic_handler handler)
+{
+    return NULL;
+}
+
+void kyros_quic_listener_close(kyros_quic_listener* listener)
+{
+}
+
+kyros_quic_connection* kyros_quic_connect(kyros_loop* loop, kyros_socket_source source, SSL_CTX* tls, const char* server_name,
+    kyros_quic_options options, kyros_quic_handler handler)
+{
+    return NULL;
+}
+
+uint64_t kyros_quic_open_stream(kyros_quic_connection* connection, bool bidirectional)
+{
+    return UINT64_MAX;
+}
+
+bool kyros_quic_stream_write(kyros_quic_connection* connection, uint64_t stream_id, const char* data, uint64_t length, bool fin)
+{
+    return false;
+}
+
+void kyros_quic_stream_reset(kyros_quic_connection* connection, uint64_t stream_id, uint64_t error_code)
+{
+}
+
+void kyros_quic_stream_stop(kyros_quic_connection* connection, uint64_t stream_id, uint64_t error_code)
+{
+}
+
+void kyros_quic_stream_set_ctx(kyros_quic_connection* connection, uint64_t stream_id, void* ctx)
+{
+}
+
+void* kyros_quic_stream_get_ctx(kyros_quic_connection* connection, uint64_t stream_id)
+{
+    return NULL;
+}
+
+void kyros_quic_close(kyros_quic_connection* connection, uint64_t error_code, const char* reason, uint32_t reason_length)
+{
+}
+
+void kyros_quic_set_ctx(kyros_quic_connection* connection, void* ctx)
+{
+}
+
+kyros_socket kyros_quic_get_socket(kyros_quic_connection* connection)
+{
+    return (kyros_socket) { 0 };
+}
+
+SSL* kyros_quic_get_ssl(kyros_quic_connection* connection)
+{
+    return NULL;
+}
+
+kyros_quic_stats kyros_quic_get_stats(kyros_quic_connection* connection)
+{
+    return (kyros_quic_stats) { 0 };
+}
+
+void kyros_quic_flush_sends(kyros_loop_internal* internal)
+{
+}
+
+#endif
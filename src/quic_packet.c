@@ -0,0 +1,457 @@
+#include <kyros.h>
+#include <kyros_internal.h>
+
+#include <string.h>
+
+// QUIC packet protection (RFC 9001 5) and transport parameters (RFC 9000 18), the AEAD, HKDF and ChaCha20
+// primitives come from BoringSSL like the TLS 1.3 secrets the keys are derived from
+
+#ifdef OPENSSL_IS_BORINGSSL
+#include <openssl/aead.h>
+#include <openssl/aes.h>
+#include <openssl/chacha.h>
+#include <openssl/hkdf.h>
+#include <openssl/hmac.h>
+
+// QUIC v1 salt of the Initial secrets
+static const uint8_t kyros_quic_initial_salt[20] = {
+    0x38, 0x76, 0x2c, 0xf7, 0xf5, 0x59, 0x34, 0xb3, 0x4d, 0x17,
+    0x9a, 0xe6, 0xa4, 0xc8, 0x0c, 0xad, 0xcc, 0xbb, 0x7f, 0x0a
+};
+
+struct kyros_quic_keys {
+    EVP_AEAD_CTX aead;
+    const EVP_AEAD* algorithm;
+    const EVP_MD* digest;
+    // kept for the key updates
+    uint8_t secret[EVP_MAX_MD_SIZE];
+    uint8_t secret_length;
+    uint8_t key_length;
+    uint8_t iv[12];
+    union {
+        AES_KEY aes;
+        uint8_t chacha[32];
+    } hp;
+    bool chacha;
+};
+
+static bool kyros_quic_expand_label(const EVP_MD* digest, const uint8_t* secret, uint8_t secret_length, const char* label, uint8_t* out, uint8_t length)
+{
+    uint8_t info[32];
+    auto label_length = strlen(label);
+    info[0] = 0;
+    info[1] = length;
+    info[2] = (uint8_t)(6 + label_length);
+    memcpy(info + 3, "tls13 ", 6);
+    memcpy(info + 9, label, label_length);
+    // empty context
+    info[9 + label_length] = 0;
+    return HKDF_expand(out, length, digest, secret, secret_length, info, 10 + label_length);
+}
+
+/// @brief the AEAD key and iv of the secret, hp_key is NULL when the header protection key is kept (key update)
+static bool kyros_quic_keys_derive(kyros_quic_keys* keys, uint8_t* hp_key)
+{
+    uint8_t key[32];
+    if (!kyros_quic_expand_label(keys->digest, keys->secret, keys->secret_length, "quic key", key, keys->key_length)
+        || !kyros_quic_expand_label(keys->digest, keys->secret, keys->secret_length, "quic iv", keys->iv, 12)
+        || (hp_key && !kyros_quic_expand_label(keys->digest, keys->secret, keys->secret_length, "quic hp", hp_key, keys->key_length))) {
+        return false;
+    }
+    return EVP_AEAD_CTX_init(&keys->aead, keys->algorithm, key, keys->key_length, KYROS_QUIC_TAG_LENGTH, NULL);
+}
+
+static kyros_quic_keys* kyros_quic_keys_new(const EVP_AEAD* algorithm, const EVP_MD* digest, uint8_t key_length, bool chacha, const uint8_t* secret, uint64_t secret_length)
+{
+    if (secret_length > EVP_MAX_MD_SIZE) {
+        return NULL;
+    }
+    auto keys = (kyros_quic_keys*)kyros_calloc(1, sizeof(kyros_quic_keys));
+    keys->algorithm = algorithm;
+    keys->digest = digest;
+    keys->key_length = key_length;
+    keys->chacha = chacha;
+    keys->secret_length = (uint8_t)secret_length;
+    memcpy(keys->secret, secret, secret_length);
+    uint8_t hp_key[32];
+    if (!kyros_quic_keys_derive(keys, hp_key)) {
+        kyros_free(keys);
+        return NULL;
+    }
+    if (chacha) {
+        memcpy(keys->hp.chacha, hp_key, 32);
+    } else {
+        AES_set_encrypt_key(hp_key, key_length * 8, &keys->hp.aes);
+    }
+    return keys;
+}
+
+kyros_quic_keys* kyros_quic_keys_create(const SSL_CIPHER* cipher, const uint8_t* secret, uint64_t secret_length)
+{
+    switch (SSL_CIPHER_get_protocol_id(cipher)) {
+    case 0x1301: // TLS_AES_128_GCM_SHA256
+        return kyros_quic_keys_new(EVP_aead_aes_128_gcm(), EVP_sha256(), 16, false, secret, secret_length);
+    case 0x1302: // TLS_AES_256_GCM_SHA384
+        return kyros_quic_keys_new(EVP_aead_aes_256_gcm(), EVP_sha384(), 32, false, secret, secret_length);
+    case 0x1303: // TLS_CHACHA20_POLY1305_SHA256
+        return kyros_quic_keys_new(EVP_aead_chacha20_poly1305(), EVP_sha256(), 32, true, secret, secret_length);
+    default:
+        return NULL;
+    }
+}
+
+kyros_quic_keys* kyros_quic_keys_initial(const uint8_t* cid, uint8_t cid_length, bool server)
+{
+    uint8_t initial_secret[32];
+    size_t initial_length;
+    uint8_t secret[32];
+    if (!HKDF_extract(initial_secret, &initial_length, EVP_sha256(), cid, cid_length, kyros_quic_initial_salt, sizeof(kyros_quic_initial_salt))
+        || !kyros_quic_expand_label(EVP_sha256(), initial_secret, (uint8_t)initial_length, server ? "server in" : "client in", secret, 32)) {
+        return NULL;
+    }
+    return kyros_quic_keys_new(EVP_aead_aes_128_gcm(), EVP_sha256(), 16, false, secret, 32);
+}
+
+kyros_quic_keys* kyros_quic_keys_update(const kyros_quic_keys* keys)
+{
+    auto next = (kyros_quic_keys*)kyros_calloc(1, sizeof(kyros_quic_keys));
+    next->algorithm = keys->algorithm;
+    next->digest = keys->digest;
+    next->key_length = keys->key_length;
+    next->chacha = keys->chacha;
+    next->secret_length = keys->secret_length;
+    next->hp = keys->hp;
+    if (!kyros_quic_expand_label(keys->digest, keys->secret, keys->secret_length, "quic ku", next->secret, next->secret_length)
+        || !kyros_quic_keys_derive(next, NULL)) {
+        kyros_free(next);
+        return NULL;
+    }
+    return next;
+}
+
+void kyros_quic_keys_free(kyros_quic_keys* keys)
+{
+    if (!keys) {
+        return;
+    }
+    EVP_AEAD_CTX_cleanup(&keys->aead);
+    // the secrets dont outlive the keys
+    OPENSSL_cleanse(keys, sizeof(kyros_quic_keys));
+    kyros_free(keys);
+}
+
+///
+/// Protection
+///
+
+static inline void kyros_quic_nonce(const kyros_quic_keys* keys, uint64_t packet_number, uint8_t* nonce)
+{
+    memcpy(nonce, keys->iv, 12);
+    for (uint32_t i = 0; i < 8; i++) {
+        nonce[11 - i] ^= (uint8_t)(packet_number >> (i * 8));
+    }
+}
+
+/// @brief 5 bytes of mask from the 16 bytes sample of the ciphertext
+static inline void kyros_quic_header_mask(const kyros_quic_keys* keys, const uint8_t* sample, uint8_t* mask)
+{
+    if (keys->chacha) {
+        static const uint8_t zeros[5] = { 0 };
+        uint32_t counter = (uint32_t)sample[0] | ((uint32_t)sample[1] << 8) | ((uint32_t)sample[2] << 16) | ((uint32_t)sample[3] << 24);
+        CRYPTO_chacha_20(mask, zeros, 5, keys->hp.chacha, sample + 4, counter);
+    } else {
+        uint8_t block[16];
+        AES_encrypt(sample, block, &keys->hp.aes);
+        memcpy(mask, block, 5);
+    }
+}
+
+void kyros_quic_seal(kyros_quic_keys* keys, uint8_t* packet, uint32_t pn_offset, uint32_t header_length, uint32_t payload_length, uint64_t packet_number)
+{
+    uint8_t nonce[12];
+    kyros_quic_nonce(keys, packet_number, nonce);
+    size_t length;
+    auto payload = packet + header_length;
+    EVP_AEAD_CTX_seal(&keys->aead, payload, &length, payload_length + KYROS_QUIC_TAG_LENGTH, nonce, 12, payload, payload_length, packet, header_length);
+    // the sample starts 4 bytes after the packet number, as if it was 4 bytes long
+    uint8_t mask[5];
+    kyros_quic_header_mask(keys, packet + pn_offset + 4, mask);
+    uint32_t pn_length = (packet[0] & 0x03) + 1;
+    packet[0] ^= mask[0] & (packet[0] & 0x80 ? 0x0f : 0x1f);
+    for (uint32_t i = 0; i < pn_length; i++) {
+        packet[pn_offset + i] ^= mask[1 + i];
+    }
+}
+
+uint32_t kyros_quic_unprotect_header(kyros_quic_keys* keys, uint8_t* packet, uint32_t pn_offset, uint32_t packet_length)
+{
+    if (pn_offset + 4 + 16 > packet_length) {
+        return 0;
+    }
+    uint8_t mask[5];
+    kyros_quic_header_mask(keys, packet + pn_offset + 4, mask);
+    packet[0] ^= mask[0] & (packet[0] & 0x80 ? 0x0f : 0x1f);
+    uint32_t pn_length = (packet[0] & 0x03) + 1;
+    for (uint32_t i = 0; i < pn_length; i++) {
+        packet[pn_offset + i] ^= mask[1 + i];
+    }
+    return pn_length;
+}
+
+bool kyros_quic_open(kyros_quic_keys* keys, uint8_t* packet, uint32_t header_length, uint32_t packet_length, uint64_t packet_number)
+{
+    if (packet_length < header_length + KYROS_QUIC_TAG_LENGTH) {
+        return false;
+    }
+    uint8_t nonce[12];
+    kyros_quic_nonce(keys, packet_number, nonce);
+    size_t length;
+    auto payload = packet + header_length;
+    return EVP_AEAD_CTX_open(&keys->aead, payload, &length, packet_length - header_length, nonce, 12, payload, packet_length - header_length, packet, header_length);
+}
+
+void kyros_quic_reset_token(const uint8_t* secret, const uint8_t* cid, uint8_t cid_length, uint8_t* token)
+{
+    uint8_t digest[EVP_MAX_MD_SIZE];
+    unsigned int length;
+    HMAC(EVP_sha256(), secret, 32, cid, cid_length, digest, &length);
+    memcpy(token, digest, 16);
+}
+
+#endif
+
+uint64_t kyros_quic_decode_packet_number(uint64_t largest, uint64_t truncated, uint32_t length)
+{
+    // largest is UINT64_MAX before the first packet, expected wraps to 0
+    uint64_t expected = largest + 1;
+    uint64_t window = 1ULL << (length * 8);
+    uint64_t half = window / 2;
+    uint64_t candidate = (expected & ~(window - 1)) | truncated;
+    if (candidate + half <= expected && candidate < (1ULL << 62) - window) {
+        return candidate + window;
+    }
+    if (candidate > expected + half && candidate >= window) {
+        return candidate - window;
+    }
+    return candidate;
+}
+
+///
+/// Transport parameters
+///
+
+#define KYROS_QUIC_TP_ORIGINAL_DCID 0x00
+#define KYROS_QUIC_TP_MAX_IDLE_TIMEOUT 0x01
+#define KYROS_QUIC_TP_STATELESS_RESET_TOKEN 0x02
+#define KYROS_QUIC_TP_MAX_UDP_PAYLOAD_SIZE 0x03
+#define KYROS_QUIC_TP_INITIAL_MAX_DATA 0x04
+#define KYROS_QUIC_TP_INITIAL_MAX_STREAM_DATA_BIDI_LOCAL 0x05
+#define KYROS_QUIC_TP_INITIAL_MAX_STREAM_DATA_BIDI_REMOTE 0x06
+#define KYROS_QUIC_TP_INITIAL_MAX_STREAM_DATA_UNI 0x07
+#define KYROS_QUIC_TP_INITIAL_MAX_STREAMS_BIDI 0x08
+#define KYROS_QUIC_TP_INITIAL_MAX_STREAMS_UNI 0x09
+#define KYROS_QUIC_TP_ACK_DELAY_EXPONENT 0x0a
+#define KYROS_QUIC_TP_MAX_ACK_DELAY 0x0b
+#define KYROS_QUIC_TP_DISABLE_ACTIVE_MIGRATION 0x0c
+#define KYROS_QUIC_TP_PREFERRED_ADDRESS 0x0d
+#define KYROS_QUIC_TP_ACTIVE_CONNECTION_ID_LIMIT 0x0e
+#define KYROS_QUIC_TP_INITIAL_SCID 0x0f
+#define KYROS_QUIC_TP_RETRY_SCID 0x10
+
+static uint8_t* kyros_quic_tp_write_integer(uint8_t* out, uint64_t id, uint64_t value)
+{
+    out = kyros_quic_varint_write(out, id);
+    out = kyros_quic_varint_write(out, kyros_quic_varint_length(value));
+    return kyros_quic_varint_write(out, value);
+}
+
+static uint8_t* kyros_quic_tp_write_bytes(uint8_t* out, uint64_t id, const uint8_t* value, uint32_t length)
+{
+    out = kyros_quic_varint_write(out, id);
+    out = kyros_quic_varint_write(out, length);
+    memcpy(out, value, length);
+    return out + length;
+}
+
+uint32_t kyros_quic_transport_params_encode(const kyros_quic_transport_params* params, bool server, uint8_t* out)
+{
+    auto p = out;
+    if (server) {
+        p = kyros_quic_tp_write_bytes(p, KYROS_QUIC_TP_ORIGINAL_DCID, params->original_dcid, params->original_dcid_length);
+        p = kyros_quic_tp_write_bytes(p, KYROS_QUIC_TP_STATELESS_RESET_TOKEN, params->stateless_reset_token, 16);
+    }
+    p = kyros_quic_tp_write_integer(p, KYROS_QUIC_TP_MAX_IDLE_TIMEOUT, params->max_idle_timeout);
+    p = kyros_quic_tp_write_integer(p, KYROS_QUIC_TP_MAX_UDP_PAYLOAD_SIZE, params->max_udp_payload_size);
+    p = kyros_quic_tp_write_integer(p, KYROS_QUIC_TP_INITIAL_MAX_DATA, params->initial_max_data);
+    p = kyros_quic_tp_write_integer(p, KYROS_QUIC_TP_INITIAL_MAX_STREAM_DATA_BIDI_LOCAL, params->initial_max_stream_data_bidi_local);
+    p = kyros_quic_tp_write_integer(p, KYROS_QUIC_TP_INITIAL_MAX_STREAM_DATA_BIDI_REMOTE, params->initial_max_stream_data_bidi_remote);
+    p = kyros_quic_tp_write_integer(p, KYROS_QUIC_TP_INITIAL_MAX_STREAM_DATA_UNI, params->initial_max_stream_data_uni);
+    p = kyros_quic_tp_write_integer(p, KYROS_QUIC_TP_INITIAL_MAX_STREAMS_BIDI, params->initial_max_streams_bidi);
+    p = kyros_quic_tp_write_integer(p, KYROS_QUIC_TP_INITIAL_MAX_STREAMS_UNI, params->initial_max_streams_uni);
+    p = kyros_quic_tp_write_integer(p, KYROS_QUIC_TP_MAX_ACK_DELAY, params->max_ack_delay);
+    p = kyros_quic_tp_write_integer(p, KYROS_QUIC_TP_ACTIVE_CONNECTION_ID_LIMIT, params->active_connection_id_limit);
+    p = kyros_quic_tp_write_bytes(p, KYROS_QUIC_TP_INITIAL_SCID, params->initial_scid, params->initial_scid_length);
+    return (uint32_t)(p - out);
+}
+
+static bool kyros_quic_tp_read_cid(const uint8_t* value, uint64_t length, uint8_t* out, uint8_t* out_length)
+{
+    if (length > KYROS_QUIC_MAX_CID_LENGTH) {
+        return false;
+    }
+    memcpy(out, value, length);
+    *out_length = (uint8_t)length;
+    return true;
+}
+
+bool kyros_quic_transport_params_decode(const uint8_t* data, uint64_t length, bool from_server, kyros_quic_transport_params* params)
+{
+    *params = (kyros_quic_transport_params) {
+        .max_udp_payload_size = 65527,
+        .ack_delay_exponent = 3,
+        .max_ack_delay = 25,
+        .active_connection_id_limit = 2,
+    };
+    auto end = data + length;
+    // the ones defined by RFC 9000 can appear only once
+    uint32_t seen = 0;
+    while (data < end) {
+        uint64_t id, size;
+        uint32_t read = kyros_quic_varint_read(data, end, &id);
+        if (!read) {
+            return false;
+        }
+        data += read;
+        if (!(read = kyros_quic_varint_read(data, end, &size)) || size > (uint64_t)(end - data - read)) {
+            return false;
+        }
+        data += read;
+        auto value = data;
+        data += size;
+        if (id <= KYROS_QUIC_TP_RETRY_SCID) {
+            if (seen & (1u << id)) {
+                return false;
+            }
+            seen |= 1u << id;
+        }
+        uint64_t integer = 0;
+        switch (id) {
+        case KYROS_QUIC_TP_MAX_IDLE_TIMEOUT:
+        case KYROS_QUIC_TP_MAX_UDP_PAYLOAD_SIZE:
+        case KYROS_QUIC_TP_INITIAL_MAX_DATA:
+        case KYROS_QUIC_TP_INITIAL_MAX_STREAM_DATA_BIDI_LOCAL:
+        case KYROS_QUIC_TP_INITIAL_MAX_STREAM_DATA_BIDI_REMOTE:
+        case KYROS_QUIC_TP_INITIAL_MAX_STREAM_DATA_UNI:
+        case KYROS_QUIC_TP_INITIAL_MAX_STREAMS_BIDI:
+        case KYROS_QUIC_TP_INITIAL_MAX_STREAMS_UNI:
+        case KYROS_QUIC_TP_ACK_DELAY_EXPONENT:
+        case KYROS_QUIC_TP_MAX_ACK_DELAY:
+        case KYROS_QUIC_TP_ACTIVE_CONNECTION_ID_LIMIT:
+            if (kyros_quic_varint_read(value, data, &integer) != size) {
+                return false;
+            }
+            break;
+        case KYROS_QUIC_TP_ORIGINAL_DCID:
+        case KYROS_QUIC_TP_STATELESS_RESET_TOKEN:
+        case KYROS_QUIC_TP_PREFERRED_ADDRESS:
+        case KYROS_QUIC_TP_RETRY_SCID:
+            // only servers send these
+            if (!from_server) {
+                return false;
+            }
+            break;
+        }
+        switch (id) {
+        case KYROS_QUIC_TP_ORIGINAL_DCID:
+            if (!kyros_quic_tp_read_cid(value, size, params->original_dcid, &params->original_dcid_length)) {
+                return false;
+            }
+            params->has_original_dcid = true;
+            break;
+        case KYROS_QUIC_TP_MAX_IDLE_TIMEOUT:
+            params->max_idle_timeout = integer;
+            break;
+        case KYROS_QUIC_TP_STATELESS_RESET_TOKEN:
+            if (size != 16) {
+                return false;
+            }
+            memcpy(params->stateless_reset_token, value, 16);
+            params->has_stateless_reset_token = true;
+            break;
+        case KYROS_QUIC_TP_MAX_UDP_PAYLOAD_SIZE:
+            if (integer < 1200) {
+                return false;
+            }
+            params->max_udp_payload_size = integer;
+            break;
+        case KYROS_QUIC_TP_INITIAL_MAX_DATA:
+            params->initial_max_data = integer;
+            break;
+        case KYROS_QUIC_TP_INITIAL_MAX_STREAM_DATA_BIDI_LOCAL:
+            params->initial_max_stream_data_bidi_local = integer;
+            break;
+        case KYROS_QUIC_TP_INITIAL_MAX_STREAM_DATA_BIDI_REMOTE:
+            params->initial_max_stream_data_bidi_remote = integer;
+            break;
+        case KYROS_QUIC_TP_INITIAL_MAX_STREAM_DATA_UNI:
+            params->initial_max_stream_data_uni = integer;
+            break;
+        case KYROS_QUIC_TP_INITIAL_MAX_STREAMS_BIDI:
+        case KYROS_QUIC_TP_INITIAL_MAX_STREAMS_UNI:
+            // stream ids must fit a varint
+            if (integer > (1ULL << 60)) {
+                return false;
+            }
+            if (id == KYROS_QUIC_TP_INITIAL_MAX_STREAMS_BIDI) {
+                params->initial_max_streams_bidi = integer;
+            } else {
+                params->initial_max_streams_uni = integer;
+            }
+            break;
+        case KYROS_QUIC_TP_ACK_DELAY_EXPONENT:
+            if (integer > 20) {
+                return false;
+            }
+            params->ack_delay_exponent = integer;
+            break;
+        case KYROS_QUIC_TP_MAX_ACK_DELAY:
+            if (integer >= 16384) {
+                return false;
+            }
+            params->max_ack_delay = integer;
+            break;
+        case KYROS_QUIC_TP_DISABLE_ACTIVE_MIGRATION:
+            if (size) {
+                return false;
+            }
+            params->disable_active_migration = true;
+            break;
+        case KYROS_QUIC_TP_PREFERRED_ADDRESS:
+            // parsed for its validity only, we stay on the handshake address
+            if (size < 4 + 2 + 16 + 2 + 1 + 16 || size != 4 + 2 + 16 + 2 + 1 + (uint64_t)value[24] + 16 || value[24] == 0 || value[24] > KYROS_QUIC_MAX_CID_LENGTH) {
+                return false;
+            }
+            params->has_preferred_address = true;
+            break;
+        case KYROS_QUIC_TP_ACTIVE_CONNECTION_ID_LIMIT:
+            if (integer < 2) {
+                return false;
+            }
+            params->active_connection_id_limit = integer;
+            break;
+        case KYROS_QUIC_TP_INITIAL_SCID:
+            if (!kyros_quic_tp_read_cid(value, size, params->initial_scid, &params->initial_scid_length)) {
+                return false;
+            }
+            params->has_initial_scid = true;
+            break;
+        case KYROS_QUIC_TP_RETRY_SCID:
+            params->has_retry_scid = true;
+            break;
+        default:
+            // unknown and reserved ones are ignored
+            break;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,303 @@
+#include <kyros.h>
+#include <kyros_internal.h>
+
+#include <string.h>
+
+// QUIC loss recovery helpers (RFC 9002): RTT estimation, NewReno and CUBIC congestion control and the pacer,
+// the loss detection itself lives in quic.c next to the sent packets
+
+#define KYROS_QUIC_CUBIC_C 0.4
+#define KYROS_QUIC_CUBIC_BETA 0.7
+
+///
+/// Ranges
+///
+
+static void kyros_quic_ranges_reserve(kyros_quic_ranges* ranges)
+{
+    if (ranges->count < ranges->capacity) {
+        return;
+    }
+    ranges->capacity = ranges->capacity ? ranges->capacity * 2 : 4;
+    ranges->items = kyros_resize(ranges->items, sizeof(uint64_t[2]) * ranges->capacity);
+}
+
+void kyros_quic_ranges_add(kyros_quic_ranges* ranges, uint64_t start, uint64_t end)
+{
+    if (start >= end) {
+        return;
+    }
+    auto items = ranges->items;
+    // first range ending at or after start, new ranges are almost always at the end
+    uint32_t first = ranges->count;
+    while (first > 0 && items[first - 1][1] >= start) {
+        first--;
+    }
+    uint32_t last = first;
+    while (last < ranges->count && items[last][0] <= end) {
+        start = items[last][0] < start ? items[last][0] : start;
+        end = items[last][1] > end ? items[last][1] : end;
+        last++;
+    }
+    if (first == last) {
+        kyros_quic_ranges_reserve(ranges);
+        items = ranges->items;
+        memmove(&items[first + 1], &items[first], sizeof(uint64_t[2]) * (ranges->count - first));
+        ranges->count++;
+    } else {
+        // merged into the first one
+        memmove(&items[first + 1], &items[last], sizeof(uint64_t[2]) * (ranges->count - last));
+        ranges->count -= last - first - 1;
+    }
+    items[first][0] = start;
+    items[first][1] = end;
+}
+
+void kyros_quic_ranges_remove(kyros_quic_ranges* ranges, uint64_t start, uint64_t end)
+{
+    for (uint32_t i = 0; i < ranges->count && start < end; i++) {
+        auto item = ranges->items[i];
+        if (item[1] <= start || item[0] >= end) {
+            continue;
+        }
+        if (item[0] < start && item[1] > end) {
+            // split in two
+            uint64_t tail = item[1];
+            item[1] = start;
+            kyros_quic_ranges_reserve(ranges);
+            memmove(&ranges->items[i + 2], &ranges->items[i + 1], sizeof(uint64_t[2]) * (ranges->count - i - 1));
+            ranges->items[i + 1][0] = end;
+            ranges->items[i + 1][1] = tail;
+            ranges->count++;
+            return;
+        }
+        if (item[0] < start) {
+            item[1] = start;
+        } else if (item[1] > end) {
+            item[0] = end;
+        } else {
+            memmove(&ranges->items[i], &ranges->items[i + 1], sizeof(uint64_t[2]) * (ranges->count - i - 1));
+            ranges->count--;
+            i--;
+        }
+    }
+}
+
+bool kyros_quic_ranges_contains(const kyros_quic_ranges* ranges, uint64_t value)
+{
+    for (uint32_t i = ranges->count; i > 0; i--) {
+        if (value >= ranges->items[i - 1][1]) {
+            return false;
+        }
+        if (value >= ranges->items[i - 1][0]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void kyros_quic_ranges_free(kyros_quic_ranges* ranges)
+{
+    kyros_free(ranges->items);
+    *ranges = (kyros_quic_ranges) { 0 };
+}
+
+///
+/// RTT
+///
+
+void kyros_quic_recovery_init(kyros_quic_connection* connection)
+{
+    connection->smoothed_rtt = KYROS_QUIC_INITIAL_RTT * 1000;
+    connection->rtt_variance = connection->smoothed_rtt / 2;
+    connection->min_rtt = UINT64_MAX;
+    connection->congestion_window = KYROS_QUIC_INITIAL_WINDOW * KYROS_QUIC_MAX_DATAGRAM;
+    connection->ssthresh = UINT64_MAX;
+    connection->pacing_tokens = KYROS_QUIC_PACING_BURST * KYROS_QUIC_MAX_DATAGRAM;
+}
+
+void kyros_quic_on_rtt_sample(kyros_quic_connection* connection, uint64_t latest_rtt, uint64_t ack_delay)
+{
+    latest_rtt = latest_rtt ? latest_rtt : 1;
+    connection->latest_rtt = latest_rtt;
+    if (connection->min_rtt == UINT64_MAX) {
+        connection->min_rtt = latest_rtt;
+        connection->smoothed_rtt = latest_rtt;
+        connection->rtt_variance = latest_rtt / 2;
+        return;
+    }
+    if (latest_rtt < connection->min_rtt) {
+        connection->min_rtt = latest_rtt;
+    }
+    if (connection->handshake_confirmed && ack_delay > connection->peer_params.max_ack_delay * 1000) {
+        ack_delay = connection->peer_params.max_ack_delay * 1000;
+    }
+    // the delay of the peer is only taken out when it does not go below the min
+    uint64_t adjusted = latest_rtt >= connection->min_rtt + ack_delay ? latest_rtt - ack_delay : latest_rtt;
+    uint64_t deviation = connection->smoothed_rtt > adjusted ? connection->smoothed_rtt - adjusted : adjusted - connection->smoothed_rtt;
+    connection->rtt_variance = (3 * connection->rtt_variance + deviation) / 4;
+    connection->smoothed_rtt = (7 * connection->smoothed_rtt + adjusted) / 8;
+}
+
+uint64_t kyros_quic_pto_duration(kyros_quic_connection* connection, kyros_quic_space_id space)
+{
+    uint64_t variance = 4 * connection->rtt_variance;
+    uint64_t duration = connection->smoothed_rtt + (variance > 1000 ? variance : 1000);
+    if (space == KYROS_QUIC_SPACE_APPLICATION) {
+        duration += connection->peer_params.max_ack_delay * 1000;
+    }
+    return duration;
+}
+
+///
+/// Congestion control
+///
+
+/// @brief Newton steps are enough for the window sizes involved, avoids libm
+static double kyros_quic_cbrt(double value)
+{
+    if (value <= 0) {
+        return 0;
+    }
+    double result = value > 1 ? value / 3 : 1;
+    for (uint32_t i = 0; i < 64; i++) {
+        double next = (2 * result + value / (result * result)) / 3;
+        if (next == result || (next > result ? next - result : result - next) < 1e-9) {
+            return next;
+        }
+        result = next;
+    }
+    return result;
+}
+
+/// @brief W_cubic(t) in bytes, t in µs since the start of the epoch
+static double kyros_quic_cubic_window(kyros_quic_connection* connection, uint64_t t)
+{
+    double seconds = ((double)t - (double)connection->cubic_k) / 1e6;
+    double segments = KYROS_QUIC_CUBIC_C * seconds * seconds * seconds;
+    return segments * KYROS_QUIC_MAX_DATAGRAM + (double)connection->cubic_w_max;
+}
+
+static void kyros_quic_cubic_start_epoch(kyros_quic_connection* connection, uint64_t now)
+{
+    connection->cubic_epoch = now;
+    connection->cubic_w_est = connection->congestion_window;
+    if (connection->congestion_window < connection->cubic_w_max) {
+        // time to grow back to w_max, in segments: K = cbrt((W_max - cwnd) / C)
+        double segments = (double)(connection->cubic_w_max - connection->congestion_window) / KYROS_QUIC_MAX_DATAGRAM;
+        connection->cubic_k = (uint64_t)(kyros_quic_cbrt(segments / KYROS_QUIC_CUBIC_C) * 1e6);
+    } else {
+        connection->cubic_k = 0;
+        connection->cubic_w_max = connection->congestion_window;
+    }
+}
+
+static void kyros_quic_cubic_on_ack(kyros_quic_connection* connection, uint64_t acked, uint64_t now)
+{
+    if (!connection->cubic_epoch) {
+        kyros_quic_cubic_start_epoch(connection, now);
+    }
+    double window = (double)connection->congestion_window;
+    // Reno friendly estimate, grows by alpha segments per window acknowledged
+    double alpha = 3 * (1 - KYROS_QUIC_CUBIC_BETA) / (1 + KYROS_QUIC_CUBIC_BETA);
+    connection->cubic_w_est += (uint64_t)(alpha * KYROS_QUIC_MAX_DATAGRAM * (double)acked / window);
+    uint64_t t = now - connection->cubic_epoch;
+    double cubic = kyros_quic_cubic_window(connection, t);
+    if (cubic < (double)connection->cubic_w_est) {
+        connection->congestion_window = connection->cubic_w_est;
+        return;
+    }
+    // aim at where the curve is one RTT from now, at most 1.5 times the window
+    double target = kyros_quic_cubic_window(connection, t + connection->smoothed_rtt);
+    target = target < window ? window : target > 1.5 * window ? 1.5 * window : target;
+    connection->congestion_window += (uint64_t)((target - window) * (double)acked / window);
+}
+
+void kyros_quic_on_packet_acked(kyros_quic_connection* connection, kyros_quic_sent_packet* packet, uint64_t now)
+{
+    if (!packet->in_flight) {
+        return;
+    }
+    connection->bytes_in_flight -= packet->size < connection->bytes_in_flight ? packet->size : connection->bytes_in_flight;
+    // packets sent before the last congestion event dont grow the window
+    if (packet->time_sent <= connection->recovery_start) {
+        return;
+    }
+    if (connection->congestion_window < connection->ssthresh) {
+        connection->congestion_window += packet->size;
+        return;
+    }
+    if (connection->options.congestion_control == KYROS_QUIC_CONGESTION_CUBIC) {
+        kyros_quic_cubic_on_ack(connection, packet->size, now);
+    } else {
+        connection->congestion_window += (uint64_t)KYROS_QUIC_MAX_DATAGRAM * packet->size / connection->congestion_window;
+    }
+}
+
+void kyros_quic_on_congestion(kyros_quic_connection* connection, uint64_t largest_time_sent, uint64_t now, bool persistent)
+{
+    uint64_t minimum = KYROS_QUIC_MINIMUM_WINDOW * KYROS_QUIC_MAX_DATAGRAM;
+    if (largest_time_sent > connection->recovery_start) {
+        // one reduction per round trip
+        connection->recovery_start = now;
+        auto window = connection->congestion_window;
+        if (connection->options.congestion_control == KYROS_QUIC_CONGESTION_CUBIC) {
+            // fast convergence, give up bandwidth when the last max was not reached again
+            if (window < connection->cubic_w_last_max) {
+                connection->cubic_w_last_max = window;
+                connection->cubic_w_max = (uint64_t)((double)window * (1 + KYROS_QUIC_CUBIC_BETA) / 2);
+            } else {
+                connection->cubic_w_last_max = window;
+                connection->cubic_w_max = window;
+            }
+            connection->ssthresh = (uint64_t)((double)window * KYROS_QUIC_CUBIC_BETA);
+            connection->cubic_epoch = 0;
+        } else {
+            connection->ssthresh = window / 2;
+        }
+        if (connection->ssthresh < minimum) {
+            connection->ssthresh = minimum;
+        }
+        connection->congestion_window = connection->ssthresh;
+    }
+    if (persistent) {
+        connection->congestion_window = minimum;
+        connection->cubic_epoch = 0;
+    }
+}
+
+///
+/// Pacer
+///
+
+// the rate is 5/4 of cwnd per smoothed RTT, so the window is used even with some timer slack
+static inline uint64_t kyros_quic_pacer_bytes(kyros_quic_connection* connection, uint64_t elapsed)
+{
+    return elapsed * connection->congestion_window * 5 / (4 * connection->smoothed_rtt);
+}
+
+bool kyros_quic_pacer_allows(kyros_quic_connection* connection, uint64_t now, uint64_t* next_send)
+{
+    uint64_t burst = kyros_quic_pacer_bytes(connection, 1000);
+    if (burst < KYROS_QUIC_PACING_BURST * KYROS_QUIC_MAX_DATAGRAM) {
+        burst = KYROS_QUIC_PACING_BURST * KYROS_QUIC_MAX_DATAGRAM;
+    }
+    if (now > connection->pacing_time) {
+        connection->pacing_tokens += kyros_quic_pacer_bytes(connection, now - connection->pacing_time);
+        connection->pacing_time = now;
+    }
+    if (connection->pacing_tokens > burst) {
+        connection->pacing_tokens = burst;
+    }
+    if (connection->pacing_tokens >= KYROS_QUIC_MAX_DATAGRAM) {
+        return true;
+    }
+    uint64_t missing = KYROS_QUIC_MAX_DATAGRAM - connection->pacing_tokens;
+    *next_send = now + missing * 4 * connection->smoothed_rtt / (5 * connection->congestion_window) + 1;
+    return false;
+}
+
+void kyros_quic_pacer_on_sent(kyros_quic_connection* connection, uint64_t bytes)
+{
+    connection->pacing_tokens -= bytes < connection->pacing_tokens ? bytes : connection->pacing_tokens;
+}
@@ -0,0 +1,508 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+// sched_setaffinity and the CPU_* macros
+#define _GNU_SOURCE
+#endif
+#include <kyros.h>
+#include <kyros_bsd.h>
+#include <kyros_internal.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// one loop per thread, each with its own SO_REUSEPORT listener on the same address. The kernel
+// spreads the connections between the listeners, so the loops never share a socket or a lock
+
+#ifdef __linux__
+#include <linux/filter.h>
+#include <sched.h>
+
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+#define SO_ATTACH_REUSEPORT_CBPF 51
+#endif
+
+// cpulist of a NUMA node, like "0-3,8-11"
+static void kyros_server_group_add_node_cpus(uint32_t node, cpu_set_t* set)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist", node);
+    auto file = fopen(path, "r");
+    if (!file) {
+        return;
+    }
+    char list[4096];
+    if (fgets(list, sizeof(list), file)) {
+        char* cursor = list;
+        while (*cursor >= '0' && *cursor <= '9') {
+            auto first = strtoul(cursor, &cursor, 10);
+            auto last = *cursor == '-' ? strtoul(cursor + 1, &cursor, 10) : first;
+            for (auto cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+                CPU_SET(cpu, set);
+            }
+            if (*cursor == ',') {
+                cursor++;
+            }
+        }
+    }
+    fclose(file);
+}
+
+/// @brief cpus the calling thread can run on restricted to numa_nodes (0 = all), ascending
+static uint32_t kyros_server_group_usable_cpus(uint64_t numa_nodes, int32_t* cpus)
+{
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        return 0;
+    }
+    if (numa_nodes) {
+        cpu_set_t nodes;
+        CPU_ZERO(&nodes);
+        for (uint32_t node = 0; node < 64; node++) {
+            if (numa_nodes & (1ULL << node)) {
+                kyros_server_group_add_node_cpus(node, &nodes);
+            }
+        }
+        CPU_AND(&allowed, &allowed, &nodes);
+    }
+    uint32_t count = 0;
+    for (int32_t cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed)) {
+            cpus[count++] = cpu;
+        }
+    }
+    return count;
+}
+
+static void kyros_server_group_pin(int32_t cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    // 0 is the calling thread
+    sched_setaffinity(0, sizeof(set), &set);
+}
+
+// the program returns the index of the listener to use, which is the order they joined the
+// reuseport group (the workers listen in index order), out of range falls back to the hash
+static void kyros_server_group_attach_steering(kyros_server_group* group, uv_os_sock_t fd)
+{
+    if (group->loop_count > KYROS_SERVER_GROUP_STEERING_MAX) {
+        return;
+    }
+    auto code = (struct sock_filter*)kyros_alloc(sizeof(struct sock_filter) * (2 * group->loop_count + 2));
+    uint16_t length = 0;
+    code[length++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU);
+    for (uint32_t i = 0; i < group->loop_count; i++) {
+        // a cpu running more than one loop always picks the first of them
+        code[length++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (uint32_t)group->workers[i].cpu, 0, 1);
+        code[length++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, i);
+    }
+    // cpus without a loop
+    code[length++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, UINT32_MAX);
+    struct sock_fprog program = { .len = length, .filter = code };
+    // the kernel copies it, older kernels keep hashing
+    setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof(program));
+    kyros_free(code);
+}
+#endif
+
+///
+/// Rebalance
+///
+
+// worker of the calling loop thread, the wrapped callbacks of the shared handler copies need it
+static thread_local kyros_server_group_worker* current_worker;
+
+static void kyros_server_group_track(kyros_server_group_worker* worker, kyros_socket socket)
+{
+    if (worker->socket_count == worker->socket_capacity) {
+        worker->socket_capacity = worker->socket_capacity ? worker->socket_capacity * 2 : 64;
+        worker->sockets = (kyros_socket*)kyros_resize(worker->sockets, sizeof(kyros_socket) * worker->socket_capacity);
+    }
+    kyros_socket_ref(socket);
+    worker->sockets[worker->socket_count++] = socket;
+}
+
+static void kyros_server_group_onstatus(kyros_socket socket, kyros_socket_error error, void* ctx)
+{
+    auto worker = current_worker;
+    auto state = kyros_socket_get_state(socket);
+    // accepted (tcp) or handshake done (tls), both only once per socket
+    if (state == KYROS_SOCKET_STATE_OPEN || state == KYROS_SOCKET_STATE_SECURE) {
+        kyros_server_group_track(worker, socket);
+    }
+    auto onstatus = worker->group->handler.onstatus;
+    if (onstatus) {
+        onstatus(socket, error, ctx);
+    }
+}
+
+static void kyros_server_group_onmigrate(kyros_socket socket, kyros_loop* loop, void* ctx)
+{
+    auto worker = current_worker;
+    kyros_server_group_track(worker, socket);
+    auto onmigrate = worker->group->handler.onmigrate;
+    if (onmigrate) {
+        onmigrate(socket, loop, ctx);
+    }
+}
+
+/// @brief loop of the group with the lowest latency below threshold (ns), NULL if none
+static kyros_server_group_worker* kyros_server_group_least_loaded(kyros_server_group_worker* worker, uint64_t threshold)
+{
+    auto group = worker->group;
+    kyros_server_group_worker* target = NULL;
+    uint64_t lowest = threshold;
+    for (uint32_t i = 0; i < group->loop_count; i++) {
+        auto latency = atomic_load_explicit(&group->workers[i].latency, memory_order_relaxed);
+        if (i != worker->index && latency < lowest) {
+            lowest = latency;
+            target = &group->workers[i];
+        }
+    }
+    return target;
+}
+
+static void kyros_server_group_rebalance(void* ctx)
+{
+    kyros_server_group_worker* worker = ctx;
+    auto group = worker->group;
+    auto stats = kyros_loop_get_stats(worker->loop);
+    auto iterations = stats.iterations - worker->last_iterations;
+    auto latency = iterations ? (stats.busy_time - worker->last_busy_time) / iterations : 0;
+    worker->last_iterations = stats.iterations;
+    worker->last_busy_time = stats.busy_time;
+    atomic_store_explicit(&worker->latency, latency, memory_order_relaxed);
+
+    // closed sockets are only released here
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < worker->socket_count; i++) {
+        auto socket = worker->sockets[i];
+        if (kyros_socket_is_closed(socket)) {
+            kyros_socket_unref(socket);
+        } else {
+            worker->sockets[count++] = socket;
+        }
+    }
+    worker->socket_count = count;
+
+    uint64_t threshold = (uint64_t)group->group_options.rebalance_threshold * 1000;
+    if (latency <= threshold) {
+        worker->periods_over = 0;
+        return;
+    }
+    if (++worker->periods_over < KYROS_SERVER_GROUP_REBALANCE_PERIODS) {
+        return;
+    }
+    worker->periods_over = 0;
+    uv_mutex_lock(&group->lock);
+    // the loops can exit once stopping, a socket posted to one of them would never arrive
+    auto stopping = group->stopping;
+    uv_mutex_unlock(&group->lock);
+    auto target = stopping ? NULL : kyros_server_group_least_loaded(worker, threshold);
+    if (!target) {
+        return;
+    }
+    auto batch = group->group_options.rebalance_batch ? group->group_options.rebalance_batch : KYROS_SERVER_GROUP_REBALANCE_BATCH;
+    uint32_t moved = 0;
+    // newest first, they are the most likely to be cheap to move (no backlog yet)
+    for (uint32_t i = worker->socket_count; i-- > 0 && moved < batch;) {
+        auto socket = worker->sockets[i];
+        // released before, once posted the socket belongs to the other loop thread
+        kyros_socket_unref(socket);
+        if (!kyros_socket_migrate(socket, target->loop, &target->handler)) {
+            kyros_socket_ref(socket);
+            continue;
+        }
+        worker->sockets[i] = worker->sockets[--worker->socket_count];
+        moved++;
+    }
+}
+
+static void kyros_server_group_release_sockets(kyros_server_group_worker* worker)
+{
+    for (uint32_t i = 0; i < worker->socket_count; i++) {
+        kyros_socket_unref(worker->sockets[i]);
+    }
+    kyros_free(worker->sockets);
+    worker->sockets = NULL;
+    worker->socket_count = 0;
+    worker->socket_capacity = 0;
+}
+
+///
+/// Loop threads
+///
+
+static void kyros_server_group_stop_timeout(void* ctx)
+{
+    kyros_loop_stop(ctx);
+}
+
+// runs in the loop of the worker, posted by kyros_server_group_stop
+static void kyros_server_group_stop_worker(void* ctx)
+{
+    kyros_server_group_worker* worker = ctx;
+    if (worker->listener.tagged_ptr) {
+        kyros_socket_close(worker->listener);
+        worker->listener = (kyros_socket) { 0 };
+    }
+    if (worker->rebalance_timer) {
+        kyros_timer_stop(worker->rebalance_timer);
+    }
+    auto timeout = worker->group->group_options.stop_timeout;
+    if (timeout) {
+        // does not keep the loop alive, a loop without sockets exits before it fires
+        worker->stop_timer = kyros_loop_timer(worker->loop, kyros_server_group_stop_timeout, worker->loop, timeout, 0, false);
+    }
+}
+
+static void kyros_server_group_run(void* arg)
+{
+    kyros_server_group_worker* worker = arg;
+    auto group = worker->group;
+#ifdef __linux__
+    if (worker->cpu >= 0) {
+        kyros_server_group_pin(worker->cpu);
+    }
+#endif
+    // created by the pinned thread, the first touch keeps the loop memory on its NUMA node
+    worker->loop = kyros_loop_create_with_options(NULL, group->group_options.loop_options);
+    if (group->group_options.onloop) {
+        group->group_options.onloop(worker->loop, worker->index, group->group_options.ctx);
+    }
+
+    uv_mutex_lock(&group->lock);
+    while (group->listened != worker->index) {
+        uv_cond_wait(&group->cond, &group->lock);
+    }
+    if (!group->failed) {
+        worker->listener = kyros_socket_listen(worker->loop, group->source, group->options, &worker->handler);
+        group->failed = !worker->listener.tagged_ptr;
+#ifdef __linux__
+        if (!group->failed && group->group_options.cpu_steering && worker->cpu >= 0 && worker->index == group->loop_count - 1) {
+            // every listener is in the reuseport group now
+            kyros_server_group_attach_steering(group, kyros_socket_listener_fd(worker->listener));
+        }
+#endif
+    }
+    group->listened++;
+    uv_cond_broadcast(&group->cond);
+    while (group->state == KYROS_SERVER_GROUP_STARTING) {
+        uv_cond_wait(&group->cond, &group->lock);
+    }
+    auto running = group->state == KYROS_SERVER_GROUP_RUNNING;
+    uv_mutex_unlock(&group->lock);
+
+    if (running) {
+        current_worker = worker;
+        auto interval = group->group_options.rebalance_interval ? group->group_options.rebalance_interval : KYROS_SERVER_GROUP_REBALANCE_INTERVAL;
+        if (group->group_options.rebalance_threshold) {
+            // does not keep the loop alive
+            worker->rebalance_timer = kyros_loop_timer(worker->loop, kyros_server_group_rebalance, worker, interval, interval, false);
+        }
+        // until the stop task closed the listener and the sockets are gone (or stop_timeout)
+        kyros_loop_run_forever(worker->loop);
+    } else if (worker->listener.tagged_ptr) {
+        kyros_socket_close(worker->listener);
+        worker->listener = (kyros_socket) { 0 };
+        kyros_loop_run_once(worker->loop);
+    }
+    if (worker->stop_timer) {
+        kyros_timer_unref(worker->stop_timer);
+        worker->stop_timer = NULL;
+    }
+    if (worker->rebalance_timer) {
+        kyros_timer_unref(worker->rebalance_timer);
+        worker->rebalance_timer = NULL;
+    }
+    kyros_server_group_release_sockets(worker);
+    current_worker = NULL;
+}
+
+// the thread of the loop is gone, the last atomic unref wakes the loop up so it is drained here
+// and the last unref frees the loop outside of uv_run
+static void kyros_server_group_free_loop(kyros_server_group_worker* worker)
+{
+    // a socket migrated while stopping can arrive in this drain
+    current_worker = worker;
+    kyros_loop_atomic_unref(worker->loop);
+    kyros_loop_run_once(worker->loop);
+    kyros_server_group_release_sockets(worker);
+    current_worker = NULL;
+    kyros_loop_unref(worker->loop);
+}
+
+///
+/// Group
+///
+
+kyros_server_group* kyros_server_group_create(kyros_socket_source source, kryos_socket_options options,
+    kyros_socket_handler* handler, kyros_server_group_options group_options)
+{
+    if (source.type != KYROS_SOCKET_SOURCE_HOSTPORT || source.value.host_port.use_udp) {
+        return NULL;
+    }
+    uint32_t cpu_count = 0;
+#ifdef __linux__
+    int32_t cpus[CPU_SETSIZE];
+    cpu_count = kyros_server_group_usable_cpus(group_options.numa_nodes, cpus);
+#endif
+    auto loop_count = group_options.loop_count;
+    if (!loop_count) {
+        loop_count = cpu_count ? cpu_count : uv_available_parallelism();
+    }
+    auto group = (kyros_server_group*)kyros_alloc(sizeof(kyros_server_group) + sizeof(kyros_server_group_worker) * loop_count);
+    *group = (kyros_server_group) {
+        .source = source,
+        .options = options,
+        .group_options = group_options,
+        .handler = handler ? *handler : (kyros_socket_handler) { 0 },
+        .state = KYROS_SERVER_GROUP_CREATED,
+        .loop_count = loop_count,
+    };
+    group->source.value.host_port.reuse_port = true;
+    if (source.value.host_port.host) {
+        auto length = strlen(source.value.host_port.host) + 1;
+        auto host = (char*)kyros_alloc(length);
+        memcpy(host, source.value.host_port.host, length);
+        group->source.value.host_port.host = host;
+    }
+    if (options.tls) {
+        SSL_CTX_up_ref(options.tls);
+    }
+    for (uint32_t i = 0; i < loop_count; i++) {
+        group->workers[i] = (kyros_server_group_worker) {
+            .group = group,
+            .handler = group->handler,
+            .index = i,
+            .cpu = -1,
+        };
+        group->workers[i].handler.ref_count = 1;
+        if (group_options.rebalance_threshold) {
+            group->workers[i].handler.onstatus = kyros_server_group_onstatus;
+            group->workers[i].handler.onmigrate = kyros_server_group_onmigrate;
+        }
+        atomic_init(&group->workers[i].latency, 0);
+#ifdef __linux__
+        if (group_options.pin_threads && cpu_count) {
+            group->workers[i].cpu = cpus[i % cpu_count];
+        }
+#endif
+    }
+    uv_mutex_init(&group->lock);
+    uv_cond_init(&group->cond);
+    return group;
+}
+
+// called with the lock held, only once every loop exists
+static void kyros_server_group_post_stop(kyros_server_group* group)
+{
+    for (uint32_t i = 0; i < group->loop_count; i++) {
+        kyros_loop_atomic_defer(group->workers[i].loop, kyros_server_group_stop_worker, &group->workers[i]);
+    }
+}
+
+bool kyros_server_group_start(kyros_server_group* group)
+{
+    uv_mutex_lock(&group->lock);
+    if (group->state != KYROS_SERVER_GROUP_CREATED) {
+        auto running = group->state == KYROS_SERVER_GROUP_RUNNING;
+        uv_mutex_unlock(&group->lock);
+        return running;
+    }
+    group->state = KYROS_SERVER_GROUP_STARTING;
+    uv_mutex_unlock(&group->lock);
+
+    for (uint32_t i = 0; i < group->loop_count; i++) {
+        if (uv_thread_create(&group->workers[i].thread, kyros_server_group_run, &group->workers[i]) != 0) {
+            // the threads already running still listen and report, then abort with the others
+            uv_mutex_lock(&group->lock);
+            group->failed = true;
+            group->loop_count = i;
+            uv_mutex_unlock(&group->lock);
+            break;
+        }
+    }
+
+    uv_mutex_lock(&group->lock);
+    while (group->listened < group->loop_count) {
+        uv_cond_wait(&group->cond, &group->lock);
+    }
+    group->state = group->failed ? KYROS_SERVER_GROUP_ABORTED : KYROS_SERVER_GROUP_RUNNING;
+    auto running = group->state == KYROS_SERVER_GROUP_RUNNING;
+    if (running && group->stopping) {
+        // stopped while starting
+        kyros_server_group_post_stop(group);
+    }
+    uv_cond_broadcast(&group->cond);
+    uv_mutex_unlock(&group->lock);
+    if (!running) {
+        kyros_server_group_join(group);
+    }
+    return running;
+}
+
+void kyros_server_group_stop(kyros_server_group* group)
+{
+    // join frees the loops only after taking the lock, so they are alive while the tasks are posted
+    uv_mutex_lock(&group->lock);
+    if (!group->stopping) {
+        group->stopping = true;
+        // otherwise start posts them once every loop exists
+        if (group->state == KYROS_SERVER_GROUP_RUNNING) {
+            kyros_server_group_post_stop(group);
+        }
+    }
+    uv_mutex_unlock(&group->lock);
+}
+
+void kyros_server_group_join(kyros_server_group* group)
+{
+    uv_mutex_lock(&group->lock);
+    auto state = group->state;
+    uv_mutex_unlock(&group->lock);
+    if (state != KYROS_SERVER_GROUP_RUNNING && state != KYROS_SERVER_GROUP_ABORTED) {
+        return;
+    }
+    for (uint32_t i = 0; i < group->loop_count; i++) {
+        uv_thread_join(&group->workers[i].thread);
+    }
+    uv_mutex_lock(&group->lock);
+    group->state = KYROS_SERVER_GROUP_JOINED;
+    uv_mutex_unlock(&group->lock);
+    for (uint32_t i = 0; i < group->loop_count; i++) {
+        kyros_server_group_free_loop(&group->workers[i]);
+        group->workers[i].loop = NULL;
+    }
+}
+
+uint32_t kyros_server_group_get_loop_count(kyros_server_group* group)
+{
+    return group->loop_count;
+}
+
+kyros_loop* kyros_server_group_get_loop(kyros_server_group* group, uint32_t index)
+{
+    return index < group->loop_count ? group->workers[index].loop : NULL;
+}
+
+int32_t kyros_server_group_get_cpu(kyros_server_group* group, uint32_t index)
+{
+    return index < group->loop_count ? group->workers[index].cpu : -1;
+}
+
+void kyros_server_group_destroy(kyros_server_group* group)
+{
+    kyros_server_group_stop(group);
+    kyros_server_group_join(group);
+    if (group->options.tls) {
+        SSL_CTX_free(group->options.tls);
+    }
+    if (group->source.value.host_port.host) {
+        kyros_free((char*)group->source.value.host_port.host);
+    }
+    uv_cond_destroy(&group->cond);
+    uv_mutex_destroy(&group->lock);
+    kyros_free(group);
+}
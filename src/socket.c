@@ -1,88 +1,2498 @@
 #include <kyros.h>
+#include <kyros_bsd.h>
 #include <kyros_internal.h>
 
+#include <stdio.h>
+#include <string.h>
+#ifdef _WIN32
+#include <io.h>
+#endif
 
-kyros_socket kyros_socket_connect(kyros_socket_source source, kryos_socket_options options, kyros_socket_handler* handler) {
-    return (kyros_socket){ 0 };
+static void kyros_socket_poll_callback(uv_poll_t* poll, int status, int events);
+static void kyros_socket_migrate_post(kyros_socket_internal_tcp* tcp);
+static void kyros_socket_uring_update(kyros_socket_internal_tcp* tcp);
+static void kyros_socket_uring_close(kyros_socket_internal_tcp* tcp);
+static void kyros_socket_on_accepted(kyros_socket_internal_listener* listener, kyros_loop* loop, uv_os_sock_t accepted);
+static void kyros_socket_race_cancel(kyros_socket_internal_tcp* tcp);
+static bool kyros_socket_internal_flush(kyros_socket_internal_tcp* tcp);
+
+static inline kyros_socket_internal_tcp* kyros_get_socket_internal_tcp(kyros_socket socket)
+{
+    return (kyros_socket_internal_tcp*)kyros_get_socket_internal(socket);
 }
 
-SSL* kyros_socket_get_ssl(kyros_socket socket) {
-    return NULL;
+static inline kyros_timer_wheel* kyros_socket_get_timer_wheel(kyros_socket_internal_tcp* tcp)
+{
+    return &kyros_get_internal_loop(kyros_socket_internal_get_loop(tcp))->timer_wheel;
 }
 
+static inline uv_os_sock_t kyros_socket_internal_fd(kyros_socket_internal_poll* poll)
+{
+    // the common part is always right before the poll
+    auto socket = (kyros_socket_internal*)((char*)poll - offsetof(kyros_socket_internal_tcp, poll));
+    if (socket->uring) {
+        return (uv_os_sock_t)poll->uring.fd;
+    }
+    uv_os_fd_t fd;
+    uv_fileno((uv_handle_t*)&poll->poll, &fd);
+    return (uv_os_sock_t)fd;
+}
 
-SSL_CTX* kyros_socket_get_ctx(kyros_socket socket) {
-    return NULL;
+static inline bool kyros_socket_status_is_readable(KYROS_SOCKET_STATUS status)
+{
+    return status == KYROS_SOCKET_STATE_OPEN || status == KYROS_SOCKET_STATE_SECURE || status == KYROS_SOCKET_STATE_WRITABLE_ENDED;
 }
 
-void kyros_socket_pause(kyros_socket socket) {
+static inline bool kyros_socket_status_is_writable(KYROS_SOCKET_STATUS status)
+{
+    return status == KYROS_SOCKET_STATE_OPEN || status == KYROS_SOCKET_STATE_SECURE || status == KYROS_SOCKET_STATE_READABLE_ENDED;
+}
 
+static inline kyros_socket_error kyros_socket_no_error()
+{
+    return (kyros_socket_error) { .type = KYROS_SOCKET_ERROR_NO_ERROR };
 }
-void kyros_socket_resume(kyros_socket socket) {
 
+void kyros_socket_notify_status(kyros_socket_internal_tcp* tcp, kyros_socket_error error)
+{
+    auto handler = tcp->handlers;
+    if (handler && handler->onstatus) {
+        handler->onstatus(kyros_socket_from_internal(&tcp->socket), error, handler->ctx);
+    }
 }
-bool kyros_socket_is_paused(kyros_socket socket) {
-    return false;
+
+static inline void kyros_socket_internal_ref(kyros_socket_internal* socket)
+{
+    socket->ref_count++;
+}
+
+static inline void kyros_socket_internal_unref(kyros_socket_internal* socket)
+{
+    m_assert(socket->ref_count, "kyros_socket double free detected");
+    if (--socket->ref_count == 0) {
+        if (socket->tag == KYROS_SOCKET_TLS) {
+            // only now, the socket can be closed from inside a SSL call (BIO write error)
+            kyros_tls_free((kyros_socket_internal_tls*)socket);
+        }
+        kyros_free(socket);
+    }
+}
+
+static void kyros_socket_poll_close_callback(uv_handle_t* handle)
+{
+    auto poll = kyros_container_of((uv_poll_t*)handle, kyros_socket_internal_poll, poll);
+    // the common part is always right before the poll
+    auto socket = (kyros_socket_internal*)((char*)poll - offsetof(kyros_socket_internal_tcp, poll));
+    kyros_socket_internal_unref(socket);
+}
+
+///
+/// Timeout
+///
+
+static void kyros_socket_timeout_callback(kyros_timer_entry* entry)
+{
+    auto tcp = kyros_container_of(entry, kyros_socket_internal_tcp, timeout_entry);
+    auto socket = kyros_socket_from_internal(&tcp->socket);
+    auto handler = tcp->handlers;
+    bool should_close = true;
+    if (handler && handler->ontimeout) {
+        should_close = handler->ontimeout(socket, handler->ctx);
+    }
+    if (should_close) {
+        kyros_socket_close(socket);
+    } else if (tcp->timeout && !kyros_timer_entry_is_armed(entry)) {
+        kyros_timer_wheel_insert(kyros_socket_get_timer_wheel(tcp), entry, tcp->timeout);
+    }
+}
+
+/// @brief push the inactivity deadline forward, called on every read/write (O(1) relink in the wheel)
+static inline void kyros_socket_refresh_timeout(kyros_socket_internal_tcp* tcp)
+{
+    if (tcp->timeout) {
+        kyros_timer_wheel_insert(kyros_socket_get_timer_wheel(tcp), &tcp->timeout_entry, tcp->timeout);
+    }
+}
+
+///
+/// Poll
+///
+
+/// @brief something the kernel can take now, a file being read waits for its piece
+static inline bool kyros_socket_can_flush(kyros_socket_internal_tcp* tcp)
+{
+    auto queue = tcp->write_queue;
+    if (queue && queue->length && !(tcp->socket.file_reading && kyros_write_chunk_get_file(queue->head))) {
+        return true;
+    }
+    return tcp->socket.tag == KYROS_SOCKET_TLS && kyros_tls_has_pending_writes((kyros_socket_internal_tls*)tcp);
+}
+
+void kyros_socket_update_poll(kyros_socket_internal_tcp* tcp)
+{
+    // migrating sockets are armed again by the new loop
+    if (!tcp->socket.has_poll || tcp->socket.migrating) {
+        return;
+    }
+    if (tcp->socket.uring) {
+        kyros_socket_uring_update(tcp);
+        return;
+    }
+    KYROS_SOCKET_STATUS status = tcp->socket.status;
+    int events = 0;
+    if (status == KYROS_SOCKET_STATE_CONNECTING) {
+        events = KYROS_SOCKET_WRITABLE;
+    } else {
+        if (kyros_socket_status_is_readable(status) && !tcp->socket.is_paused && !tcp->socket.backpressure_paused && !tcp->socket.pipe_paused) {
+            events |= KYROS_SOCKET_READABLE;
+        }
+        bool has_writes = kyros_socket_can_flush(tcp) || tcp->socket.pipe_waiting;
+        if (has_writes && status != KYROS_SOCKET_STATE_CLOSED) {
+            events |= KYROS_SOCKET_WRITABLE;
+        }
+    }
+    if (tcp->socket.poll_events == events) {
+        return;
+    }
+    tcp->socket.poll_events = events;
+    if (events) {
+        uv_poll_start(&tcp->poll.poll, events, kyros_socket_poll_callback);
+    } else {
+        uv_poll_stop(&tcp->poll.poll);
+    }
+}
+
+static inline kyros_write_chunk_pool* kyros_socket_get_write_pool(kyros_socket_internal_tcp* tcp)
+{
+    return &kyros_get_internal_loop(kyros_socket_internal_get_loop(tcp))->write_pool;
+}
+
+static void kyros_write_queue_release_chunk(kyros_write_chunk_pool* pool, kyros_write_chunk* chunk)
+{
+    auto shared = kyros_write_chunk_get_shared(chunk);
+    if (shared) {
+        kyros_shared_buffer_unref(shared->buffer);
+        kyros_free(chunk);
+        return;
+    }
+    auto file = kyros_write_chunk_get_file(chunk);
+    if (file) {
+        uv_fs_t request;
+        uv_fs_close(NULL, &request, file->fd, NULL);
+        uv_fs_req_cleanup(&request);
+    }
+    kyros_write_chunk_pool_release(pool, chunk);
+}
+
+void kyros_write_queue_clear(kyros_write_chunk_pool* pool, kyros_write_queue* queue)
+{
+    while (queue->head) {
+        auto chunk = queue->head;
+        queue->head = chunk->next;
+        kyros_write_queue_release_chunk(pool, chunk);
+    }
+    queue->tail = NULL;
+    queue->length = 0;
+}
+
+static kyros_write_queue* kyros_socket_get_write_queue(kyros_socket_internal_tcp* tcp)
+{
+    if (!tcp->write_queue) {
+        tcp->write_queue = (kyros_write_queue*)kyros_alloc(sizeof(kyros_write_queue));
+        *tcp->write_queue = (kyros_write_queue) { 0 };
+    }
+    return tcp->write_queue;
+}
+
+/// @brief give the queued chunks back to the pool, an idle socket keeps no queue
+static void kyros_socket_free_write_queue(kyros_socket_internal_tcp* tcp)
+{
+    if (tcp->write_queue) {
+        kyros_write_queue_clear(kyros_socket_get_write_pool(tcp), tcp->write_queue);
+        kyros_free(tcp->write_queue);
+        tcp->write_queue = NULL;
+    }
+}
+
+void kyros_socket_close_with_error(kyros_socket_internal_tcp* tcp, kyros_socket_error error)
+{
+    if (tcp->socket.status == KYROS_SOCKET_STATE_CLOSED) {
+        return;
+    }
+    tcp->socket.status = KYROS_SOCKET_STATE_CLOSED;
+    if (tcp->socket.migrating && tcp->socket.uring) {
+        // io_uring error before the operations were done, the socket never leaves this loop
+        tcp->socket.migrating = false;
+        kyros_free(tcp->poll.uring.data);
+        tcp->poll.uring.data = NULL;
+    }
+    kyros_timer_wheel_remove(kyros_socket_get_timer_wheel(tcp), &tcp->timeout_entry);
+    if ((!tcp->socket.uring || !tcp->poll.uring.send_armed) && !tcp->socket.file_reading) {
+        // otherwise the kernel can still be reading it (or the threadpool the file at its head), the completion clears it
+        kyros_socket_free_write_queue(tcp);
+    }
+    if (tcp->cork) {
+        // corked data is dropped, the arena reclaims it on the next flush
+        tcp->cork->socket = NULL;
+        tcp->cork = NULL;
+    }
+    if (tcp->socket.uring) {
+        kyros_socket_uring_close(tcp);
+    } else if (tcp->socket.has_poll) {
+        uv_poll_stop(&tcp->poll.poll);
+        tcp->socket.poll_events = 0;
+        kyros_bsd_close(kyros_socket_internal_fd(&tcp->poll));
+    } else if (tcp->socket.racing) {
+        kyros_socket_race_cancel(tcp);
+    }
+    kyros_socket_notify_status(tcp, error);
+    auto handler = tcp->handlers;
+    if (handler) {
+        handler->ref_count--;
+        tcp->handlers = NULL;
+    }
+    if (tcp->socket.has_poll && !tcp->socket.uring) {
+        // memory is released in the close callback (the migration one if it was already closing)
+        if (!tcp->socket.migrating) {
+            uv_close((uv_handle_t*)&tcp->poll.poll, kyros_socket_poll_close_callback);
+        }
+    } else {
+        // io_uring operations still in the kernel hold their own ref
+        kyros_socket_internal_unref(&tcp->socket);
+    }
+}
+
+///
+/// Write
+///
+
+kyros_shared_buffer* kyros_shared_buffer_create(uint64_t length)
+{
+    auto buffer = (kyros_shared_buffer*)kyros_alloc(sizeof(kyros_shared_buffer) + length);
+    atomic_init(&buffer->ref_count, 1);
+    buffer->length = length;
+    return buffer;
+}
+
+void kyros_shared_buffer_ref(kyros_shared_buffer* buffer)
+{
+    atomic_fetch_add_explicit(&buffer->ref_count, 1, memory_order_relaxed);
+}
+
+void kyros_shared_buffer_unref(kyros_shared_buffer* buffer)
+{
+    if (atomic_fetch_sub_explicit(&buffer->ref_count, 1, memory_order_acq_rel) == 1) {
+        kyros_free(buffer);
+    }
+}
+
+void kyros_write_queue_consume(kyros_write_chunk_pool* pool, kyros_write_queue* queue, uint64_t sent)
+{
+    queue->length -= sent;
+    while (sent) {
+        auto chunk = queue->head;
+        auto file = kyros_write_chunk_get_file(chunk);
+        auto shared = kyros_write_chunk_get_shared(chunk);
+        uint64_t available = file ? file->length : shared ? shared->length : chunk->end - chunk->start;
+        if (sent < available) {
+            if (file) {
+                file->offset += sent;
+                file->length -= sent;
+            } else if (shared) {
+                shared->data += sent;
+                shared->length -= sent;
+            } else {
+                chunk->start += sent;
+            }
+            return;
+        }
+        sent -= available;
+        queue->head = chunk->next;
+        if (!queue->head) {
+            queue->tail = NULL;
+        }
+        kyros_write_queue_release_chunk(pool, chunk);
+    }
+}
+
+static inline void kyros_write_queue_link(kyros_write_queue* queue, kyros_write_chunk* chunk)
+{
+    if (queue->tail) {
+        queue->tail->next = chunk;
+    } else {
+        queue->head = chunk;
+    }
+    queue->tail = chunk;
+}
+
+void kyros_write_queue_append(kyros_write_chunk_pool* pool, kyros_write_queue* queue, const char* data, uint64_t length)
+{
+    queue->length += length;
+    while (length) {
+        auto chunk = queue->tail;
+        if (!chunk || chunk->end == KYROS_WRITE_CHUNK_CAPACITY) {
+            chunk = kyros_write_chunk_pool_get(pool);
+            kyros_write_queue_link(queue, chunk);
+        }
+        uint64_t size = KYROS_WRITE_CHUNK_CAPACITY - chunk->end;
+        if (size > length) {
+            size = length;
+        }
+        memcpy(chunk->data + chunk->end, data, size);
+        chunk->end += size;
+        data += size;
+        length -= size;
+    }
+}
+
+static inline uv_file kyros_file_dup(uv_file fd)
+{
+#ifdef _WIN32
+    return _dup(fd);
+#else
+    return fcntl(fd, F_DUPFD_CLOEXEC, 0);
+#endif
+}
+
+bool kyros_write_queue_append_file(kyros_write_chunk_pool* pool, kyros_write_queue* queue, uv_file fd, uint64_t offset, uint64_t length)
+{
+    // the caller can close its fd right away
+    auto copy = kyros_file_dup(fd);
+    if (copy < 0) {
+        return false;
+    }
+    auto chunk = kyros_write_chunk_pool_get(pool);
+    chunk->start = KYROS_WRITE_CHUNK_FILE;
+    chunk->end = KYROS_WRITE_CHUNK_CAPACITY;
+    *(kyros_write_file*)chunk->data = (kyros_write_file) {
+        .fd = copy,
+        .offset = offset,
+        .length = length,
+    };
+    kyros_write_queue_link(queue, chunk);
+    queue->length += length;
+    return true;
+}
+
+void kyros_write_queue_append_shared(kyros_write_queue* queue, kyros_shared_buffer* buffer, const char* data, uint64_t length)
+{
+    auto chunk = (kyros_write_chunk*)kyros_alloc(sizeof(kyros_write_chunk) + sizeof(kyros_write_shared));
+    chunk->next = NULL;
+    chunk->start = KYROS_WRITE_CHUNK_SHARED;
+    chunk->end = KYROS_WRITE_CHUNK_CAPACITY;
+    kyros_shared_buffer_ref(buffer);
+    *(kyros_write_shared*)chunk->data = (kyros_write_shared) {
+        .buffer = buffer,
+        .data = data,
+        .length = length,
+    };
+    kyros_write_queue_link(queue, chunk);
+    queue->length += length;
+}
+
+/// @brief write queue plus what the tls layer keeps (plaintext waiting for the handshake or behind a file)
+static inline uint64_t kyros_socket_buffered(kyros_socket_internal_tcp* tcp)
+{
+    if (tcp->socket.tag == KYROS_SOCKET_TLS) {
+        return kyros_socket_queued(tcp) + kyros_tls_buffer_size((kyros_socket_internal_tls*)tcp);
+    }
+    return kyros_socket_queued(tcp);
+}
+
+void kyros_socket_check_high_watermark(kyros_socket_internal_tcp* tcp)
+{
+    if (!tcp->socket.over_high_watermark && kyros_socket_buffered(tcp) > tcp->write_high_watermark) {
+        tcp->socket.over_high_watermark = true;
+        // the caller updates the poll
+        tcp->socket.backpressure_paused = tcp->socket.pause_on_backpressure;
+    }
+}
+
+static void kyros_socket_buffer_append(kyros_socket_internal_tcp* tcp, const char* data, uint64_t length)
+{
+    kyros_write_queue_append(kyros_socket_get_write_pool(tcp), kyros_socket_get_write_queue(tcp), data, length);
+    kyros_socket_check_high_watermark(tcp);
+}
+
+static void kyros_socket_buffer_append_shared(kyros_socket_internal_tcp* tcp, kyros_shared_buffer* buffer, const char* data, uint64_t length)
+{
+    kyros_write_queue_append_shared(kyros_socket_get_write_queue(tcp), buffer, data, length);
+    kyros_socket_check_high_watermark(tcp);
+}
+
+void kyros_socket_check_low_watermark(kyros_socket_internal_tcp* tcp)
+{
+    if (!tcp->socket.over_high_watermark || kyros_socket_buffered(tcp) > tcp->write_low_watermark) {
+        return;
+    }
+    tcp->socket.over_high_watermark = false;
+    if (tcp->socket.backpressure_paused) {
+        tcp->socket.backpressure_paused = false;
+        kyros_socket_update_poll(tcp);
+    }
+    auto handler = tcp->handlers;
+    if (handler && handler->ondrain) {
+        handler->ondrain(kyros_socket_from_internal(&tcp->socket), handler->ctx);
+    }
+}
+
+static void kyros_socket_end_writable(kyros_socket_internal_tcp* tcp)
+{
+    tcp->socket.end_pending = false;
+    auto fd = kyros_socket_internal_fd(&tcp->poll);
+    if (tcp->socket.ktls_tx) {
+        // BoringSSL has no keys anymore, the kernel sends the close_notify
+        kyros_ktls_send_close_notify(fd);
+    }
+    kyros_bsd_shutdown_write(fd);
+    if (tcp->socket.status == KYROS_SOCKET_STATE_READABLE_ENDED) {
+        kyros_socket_close_with_error(tcp, kyros_socket_no_error());
+        return;
+    }
+    tcp->socket.status = KYROS_SOCKET_STATE_WRITABLE_ENDED;
+    kyros_socket_notify_status(tcp, kyros_socket_no_error());
+}
+
+/// @brief send as much as possible, returns how many bytes were sent or -1 if the socket was closed
+static int64_t kyros_socket_send(kyros_socket_internal_tcp* tcp, const char* data, uint64_t length)
+{
+    auto fd = kyros_socket_internal_fd(&tcp->poll);
+    uint64_t written = 0;
+    while (written < length) {
+        auto sent = kyros_bsd_send(fd, data + written, length - written);
+        if (sent < 0) {
+            auto error = kyros_bsd_errno();
+            if (kyros_bsd_would_block(error)) {
+                break;
+            }
+            kyros_socket_close_with_error(tcp, kyros_socket_system_error(KYROS_SOCKET_ERROR_SYSTEM_ERROR, error));
+            return -1;
+        }
+        written += sent;
+    }
+    if (written) {
+        kyros_socket_refresh_timeout(tcp);
+    }
+    return written;
+}
+
+// a piece of a queued file read on the uv threadpool, the loop thread never waits for the disk
+typedef struct {
+    uv_fs_t request;
+    kyros_socket_internal_tcp* socket;
+    kyros_socket_file_piece_callback callback;
+    kyros_write_queue piece;
+} kyros_socket_file_read;
+
+static void kyros_socket_file_read_callback(uv_fs_t* request)
+{
+    auto read = kyros_container_of(request, kyros_socket_file_read, request);
+    auto tcp = read->socket;
+    auto result = request->result;
+    uv_fs_req_cleanup(request);
+    auto pool = kyros_socket_get_write_pool(tcp);
+    tcp->socket.file_reading = false;
+    if (tcp->socket.status == KYROS_SOCKET_STATE_CLOSED) {
+        // kept by kyros_socket_close_with_error while the file at its head was read
+        kyros_write_queue_clear(pool, &read->piece);
+        kyros_socket_free_write_queue(tcp);
+    } else if (result <= 0) {
+        kyros_write_queue_clear(pool, &read->piece);
+        // 0 = the file is shorter than what was queued
+        kyros_socket_close_with_error(tcp, kyros_socket_uv_error(KYROS_SOCKET_ERROR_SYSTEM_ERROR, result ? (int)result : UV_EOF));
+    } else {
+        // a short read fills the first chunks, the others go back to the pool
+        kyros_write_queue piece = { 0 };
+        uint64_t left = (uint64_t)result;
+        while (read->piece.head) {
+            auto chunk = read->piece.head;
+            read->piece.head = chunk->next;
+            chunk->next = NULL;
+            if (!left) {
+                kyros_write_chunk_pool_release(pool, chunk);
+                continue;
+            }
+            if (left < chunk->end) {
+                chunk->end = (uint32_t)left;
+            }
+            left -= chunk->end;
+            piece.length += chunk->end;
+            kyros_write_queue_link(&piece, chunk);
+        }
+        read->callback(tcp, &piece);
+    }
+    kyros_socket_internal_unref(&tcp->socket);
+    kyros_free(read);
+}
+
+void kyros_socket_read_file_piece(kyros_socket_internal_tcp* tcp, kyros_write_file* file, kyros_socket_file_piece_callback callback)
+{
+    auto pool = kyros_socket_get_write_pool(tcp);
+    auto read = (kyros_socket_file_read*)kyros_alloc(sizeof(kyros_socket_file_read));
+    *read = (kyros_socket_file_read) { .socket = tcp, .callback = callback };
+    uint64_t wanted = file->length < KYROS_WRITE_FILE_READ_SIZE ? file->length : KYROS_WRITE_FILE_READ_SIZE;
+    uv_buf_t buffers[KYROS_WRITE_FILE_READ_SIZE / KYROS_WRITE_CHUNK_CAPACITY + 1];
+    uint32_t count = 0;
+    while (read->piece.length < wanted) {
+        auto chunk = kyros_write_chunk_pool_get(pool);
+        uint64_t size = wanted - read->piece.length < KYROS_WRITE_CHUNK_CAPACITY ? wanted - read->piece.length : KYROS_WRITE_CHUNK_CAPACITY;
+        // trimmed by the completion if the read stops short
+        chunk->end = (uint32_t)size;
+        kyros_write_queue_link(&read->piece, chunk);
+        read->piece.length += size;
+        buffers[count++] = uv_buf_init(chunk->data, size);
+    }
+    // the request keeps the socket, and with it the file at the head of its queue, until the completion
+    tcp->socket.file_reading = true;
+    kyros_socket_internal_ref(&tcp->socket);
+    auto status = uv_fs_read((uv_loop_t*)kyros_socket_internal_get_loop(tcp), &read->request, file->fd, buffers, count, (int64_t)file->offset,
+        kyros_socket_file_read_callback);
+    if (status < 0) {
+        tcp->socket.file_reading = false;
+        kyros_write_queue_clear(pool, &read->piece);
+        kyros_free(read);
+        kyros_socket_close_with_error(tcp, kyros_socket_uv_error(KYROS_SOCKET_ERROR_SYSTEM_ERROR, status));
+        kyros_socket_internal_unref(&tcp->socket);
+    }
+}
+
+/// @brief the piece read from the file at the head of the queue takes the place of its bytes, the queue length does not change
+static void kyros_socket_on_file_piece(kyros_socket_internal_tcp* tcp, kyros_write_queue* piece)
+{
+    auto queue = tcp->write_queue;
+    auto head = queue->head;
+    auto file = kyros_write_chunk_get_file(head);
+    file->offset += piece->length;
+    file->length -= piece->length;
+    queue->head = piece->head;
+    if (file->length) {
+        piece->tail->next = head;
+    } else {
+        piece->tail->next = head->next;
+        if (queue->tail == head) {
+            queue->tail = piece->tail;
+        }
+        kyros_write_queue_release_chunk(kyros_socket_get_write_pool(tcp), head);
+    }
+    kyros_socket_internal_flush(tcp);
+}
+
+/// @brief send the file at the head of the queue, returns 1 if all of it was taken, 0 if the socket is full (or a piece of the file
+/// is being read) and -1 if it was closed
+static int kyros_socket_flush_file(kyros_socket_internal_tcp* tcp)
+{
+    auto queue = tcp->write_queue;
+    auto file = kyros_write_chunk_get_file(queue->head);
+    if (tcp->socket.file_reading) {
+        // kyros_socket_on_file_piece goes on with the flush
+        return 0;
+    }
+#ifdef KYROS_HAS_SENDFILE
+    auto length = file->length;
+    auto sent = kyros_bsd_sendfile(kyros_socket_internal_fd(&tcp->poll), file->fd, file->offset, length);
+    if (sent > 0) {
+        kyros_socket_refresh_timeout(tcp);
+        kyros_write_queue_consume(kyros_socket_get_write_pool(tcp), queue, sent);
+        return (uint64_t)sent == length;
+    }
+    if (sent == 0) {
+        kyros_socket_close_with_error(tcp, kyros_socket_uv_error(KYROS_SOCKET_ERROR_SYSTEM_ERROR, UV_EOF));
+        return -1;
+    }
+    auto error = kyros_bsd_errno();
+    if (kyros_bsd_would_block(error)) {
+        return 0;
+    }
+    if (error != EINVAL && error != ENOSYS && error != EOPNOTSUPP) {
+        kyros_socket_close_with_error(tcp, kyros_socket_system_error(KYROS_SOCKET_ERROR_SYSTEM_ERROR, error));
+        return -1;
+    }
+    // this kind of file can't be sent from the page cache, read it instead
+#endif
+    kyros_socket_read_file_piece(tcp, file, kyros_socket_on_file_piece);
+    return tcp->socket.status == KYROS_SOCKET_STATE_CLOSED ? -1 : 0;
+}
+
+/// @brief try to flush the write queue, returns true if the queue is empty
+static bool kyros_socket_internal_flush(kyros_socket_internal_tcp* tcp)
+{
+    if (tcp->socket.uring) {
+        // sent with the next submit of the loop, see kyros_socket_uring_send
+        kyros_socket_uring_update(tcp);
+        return !kyros_socket_queued(tcp);
+    }
+    auto queue = tcp->write_queue;
+    auto fd = kyros_socket_internal_fd(&tcp->poll);
+    while (queue && queue->length) {
+        if (kyros_write_chunk_get_file(queue->head)) {
+            auto result = kyros_socket_flush_file(tcp);
+            if (result < 0) {
+                return false;
+            }
+            if (!result) {
+                break;
+            }
+            continue;
+        }
+        // up to KYROS_WRITE_QUEUE_IOV chunks per syscall, files are sent on their own
+        uv_buf_t iov[KYROS_WRITE_QUEUE_IOV];
+        uint32_t count = 0;
+        uint64_t total = 0;
+        for (auto chunk = queue->head; chunk && count < KYROS_WRITE_QUEUE_IOV && !kyros_write_chunk_get_file(chunk); chunk = chunk->next) {
+            iov[count] = kyros_write_chunk_bytes(chunk);
+            total += iov[count++].len;
+        }
+        auto sent = kyros_bsd_sendv(fd, iov, count);
+        if (sent < 0) {
+            auto error = kyros_bsd_errno();
+            if (kyros_bsd_would_block(error)) {
+                break;
+            }
+            kyros_socket_close_with_error(tcp, kyros_socket_system_error(KYROS_SOCKET_ERROR_SYSTEM_ERROR, error));
+            return false;
+        }
+        kyros_socket_refresh_timeout(tcp);
+        kyros_write_queue_consume(kyros_socket_get_write_pool(tcp), queue, sent);
+        if ((uint64_t)sent < total) {
+            // kernel buffer is full
+            break;
+        }
+    }
+    if (!kyros_socket_queued(tcp) && tcp->socket.tag == KYROS_SOCKET_TLS) {
+        // the kernel took everything, the tls layer can encrypt more of its plaintext queue
+        kyros_tls_on_writable((kyros_socket_internal_tls*)tcp);
+        if (tcp->socket.status == KYROS_SOCKET_STATE_CLOSED) {
+            return true;
+        }
+    }
+    if (!kyros_socket_queued(tcp)) {
+        kyros_socket_free_write_queue(tcp);
+        if (!tcp->cork && tcp->socket.end_pending) {
+            // with a cork, the shutdown happens after its flush
+            kyros_socket_end_writable(tcp);
+            if (tcp->socket.status == KYROS_SOCKET_STATE_CLOSED) {
+                return true;
+            }
+        }
+    }
+    kyros_socket_update_poll(tcp);
+    kyros_socket_check_low_watermark(tcp);
+    return !kyros_socket_queued(tcp);
+}
+
+///
+/// Auto cork
+///
+
+static inline kyros_cork_arena* kyros_socket_get_cork_arena(kyros_socket_internal_tcp* tcp)
+{
+    return &kyros_get_internal_loop(kyros_socket_internal_get_loop(tcp))->cork_arena;
+}
+
+/// @brief send the corked data (plus an optional extra buffer) with one syscall, returns false if the socket was closed
+static bool kyros_socket_flush_cork(kyros_socket_internal_tcp* tcp, const char* extra, uint64_t extra_length)
+{
+    auto cork = tcp->cork;
+    // the cork stays in the pending list until the arena is reset, only detach it
+    cork->socket = NULL;
+    tcp->cork = NULL;
+
+    uv_buf_t iov[KYROS_CORK_IOV_MAX + 1];
+    auto count = cork->iov_count;
+    memcpy(iov, cork->iov, sizeof(uv_buf_t) * count);
+    if (extra_length) {
+        iov[count++] = uv_buf_init((char*)extra, extra_length);
+    }
+    auto total = cork->length + extra_length;
+    if (cork->writes > 1) {
+        kyros_socket_get_cork_arena(tcp)->syscalls_saved += cork->writes - 1;
+    }
+
+    auto sent = kyros_bsd_sendv(kyros_socket_internal_fd(&tcp->poll), iov, count);
+    if (sent < 0) {
+        auto error = kyros_bsd_errno();
+        if (!kyros_bsd_would_block(error)) {
+            kyros_socket_close_with_error(tcp, kyros_socket_system_error(KYROS_SOCKET_ERROR_SYSTEM_ERROR, error));
+            return false;
+        }
+        sent = 0;
+    }
+    if (sent) {
+        kyros_socket_refresh_timeout(tcp);
+    }
+    if ((uint64_t)sent < total) {
+        // keep whatever the kernel did not take, the cork memory is only valid until the arena reset
+        for (uint32_t i = 0; i < count; i++) {
+            if ((uint64_t)sent >= iov[i].len) {
+                sent -= iov[i].len;
+                continue;
+            }
+            kyros_socket_buffer_append(tcp, iov[i].base + sent, iov[i].len - sent);
+            sent = 0;
+        }
+    } else if (tcp->socket.end_pending) {
+        kyros_socket_end_writable(tcp);
+    }
+    kyros_socket_update_poll(tcp);
+    return true;
+}
+
+/// @brief gather a write until the after IO hook, returns false if the socket was closed
+static bool kyros_socket_cork_write(kyros_socket_internal_tcp* tcp, const char* data, uint64_t length)
+{
+    auto arena = kyros_socket_get_cork_arena(tcp);
+    auto cork = tcp->cork;
+    if (!cork) {
+        cork = tcp->cork = kyros_cork_arena_new_cork(arena, tcp);
+    }
+    cork->writes++;
+    if (length > KYROS_CORK_COPY_LIMIT || cork->iov_count == KYROS_CORK_IOV_MAX) {
+        // not worth copying, send it now in the same syscall as the gathered data
+        return kyros_socket_flush_cork(tcp, data, length);
+    }
+    auto copy = kyros_cork_arena_copy(arena, data, length);
+    auto last = cork->iov_count ? &cork->iov[cork->iov_count - 1] : NULL;
+    if (last && last->base + last->len == copy) {
+        // consecutive writes of the same socket end up contiguous in the arena
+        last->len += length;
+    } else {
+        cork->iov[cork->iov_count++] = uv_buf_init(copy, length);
+    }
+    cork->length += length;
+    return true;
+}
+
+/// @brief gather bytes of a shared buffer by reference, the arena keeps the buffer until the flush, returns false if the socket was closed
+static bool kyros_socket_cork_shared(kyros_socket_internal_tcp* tcp, kyros_shared_buffer* buffer, const char* data, uint64_t length)
+{
+    auto arena = kyros_socket_get_cork_arena(tcp);
+    auto cork = tcp->cork;
+    if (cork && cork->iov_count == KYROS_CORK_IOV_MAX) {
+        // send what was gathered, this write starts a new cork (or is queued behind what the kernel did not take)
+        if (!kyros_socket_flush_cork(tcp, NULL, 0)) {
+            return false;
+        }
+        if (kyros_socket_queued(tcp)) {
+            kyros_socket_buffer_append_shared(tcp, buffer, data, length);
+            return true;
+        }
+        cork = NULL;
+    }
+    if (!cork) {
+        cork = tcp->cork = kyros_cork_arena_new_cork(arena, tcp);
+    }
+    kyros_cork_arena_hold(arena, buffer);
+    cork->writes++;
+    cork->iov[cork->iov_count++] = uv_buf_init((char*)data, length);
+    cork->length += length;
+    return true;
+}
+
+void kyros_socket_flush_corked(kyros_loop_internal* internal)
+{
+    auto arena = &internal->cork_arena;
+    // callbacks triggered by a flush (onstatus) can cork new writes, keep going until nothing is pending
+    while (arena->pending) {
+        auto cork = arena->pending;
+        arena->pending = NULL;
+        while (cork) {
+            auto next = cork->next;
+            if (cork->socket) {
+                kyros_socket_flush_cork((kyros_socket_internal_tcp*)cork->socket, NULL, 0);
+            }
+            cork->next = arena->free_list;
+            arena->free_list = cork;
+            cork = next;
+        }
+    }
+    kyros_cork_arena_reset(arena);
+}
+
+bool kyros_socket_internal_write(kyros_socket_internal_tcp* tcp, const char* data, uint64_t length, bool end)
+{
+    KYROS_SOCKET_STATUS status = tcp->socket.status;
+    if (status != KYROS_SOCKET_STATE_CONNECTING && !kyros_socket_status_is_writable(status)) {
+        return false;
+    }
+    if (tcp->socket.end_pending) {
+        // writes after end are ignored
+        return false;
+    }
+    if (length) {
+        // keep ordering, only write directly if nothing is waiting
+        // (io_uring sockets always queue, the loop submits one send per socket for all of it)
+        if (kyros_socket_queued(tcp) || status == KYROS_SOCKET_STATE_CONNECTING || tcp->socket.uring) {
+            kyros_socket_buffer_append(tcp, data, length);
+        } else if (tcp->cork_behavior == KYROS_SOCKET_AUTO_CORK) {
+            if (!kyros_socket_cork_write(tcp, data, length)) {
+                return false;
+            }
+        } else {
+            auto sent = kyros_socket_send(tcp, data, length);
+            if (sent < 0) {
+                return false;
+            }
+            if ((uint64_t)sent < length) {
+                kyros_socket_buffer_append(tcp, data + sent, length - sent);
+            }
+        }
+    }
+    if (end) {
+        tcp->socket.end_pending = true;
+        // otherwise shutdown after the write buffer or the cork is flushed
+        if (!kyros_socket_queued(tcp) && !tcp->cork && status != KYROS_SOCKET_STATE_CONNECTING) {
+            kyros_socket_end_writable(tcp);
+        }
+    }
+    kyros_socket_update_poll(tcp);
+    return !tcp->socket.over_high_watermark;
+}
+
+bool kyros_socket_internal_write_shared(kyros_socket_internal_tcp* tcp, kyros_shared_buffer* buffer, const char* data, uint64_t length)
+{
+    KYROS_SOCKET_STATUS status = tcp->socket.status;
+    if ((status != KYROS_SOCKET_STATE_CONNECTING && !kyros_socket_status_is_writable(status)) || tcp->socket.end_pending) {
+        return false;
+    }
+    // same order rules as kyros_socket_internal_write, only what is kept is a reference instead of a copy
+    if (kyros_socket_queued(tcp) || status == KYROS_SOCKET_STATE_CONNECTING || tcp->socket.uring) {
+        kyros_socket_buffer_append_shared(tcp, buffer, data, length);
+    } else if (tcp->cork_behavior == KYROS_SOCKET_AUTO_CORK) {
+        if (!kyros_socket_cork_shared(tcp, buffer, data, length)) {
+            return false;
+        }
+    } else {
+        auto sent = kyros_socket_send(tcp, data, length);
+        if (sent < 0) {
+            return false;
+        }
+        if ((uint64_t)sent < length) {
+            kyros_socket_buffer_append_shared(tcp, buffer, data + sent, length - sent);
+        }
+    }
+    kyros_socket_update_poll(tcp);
+    return !tcp->socket.over_high_watermark;
+}
+
+bool kyros_socket_internal_write_file(kyros_socket_internal_tcp* tcp, uv_file fd, uint64_t offset, uint64_t length, bool end)
+{
+    KYROS_SOCKET_STATUS status = tcp->socket.status;
+    if ((status != KYROS_SOCKET_STATE_CONNECTING && !kyros_socket_status_is_writable(status)) || tcp->socket.end_pending) {
+        return false;
+    }
+    // corked bytes go before the file
+    if (tcp->cork && !kyros_socket_flush_cork(tcp, NULL, 0)) {
+        return false;
+    }
+    if (length && !kyros_write_queue_append_file(kyros_socket_get_write_pool(tcp), kyros_socket_get_write_queue(tcp), fd, offset, length)) {
+        kyros_socket_close_with_error(tcp, kyros_socket_system_error(KYROS_SOCKET_ERROR_SYSTEM_ERROR, errno));
+        return false;
+    }
+    if (end) {
+        tcp->socket.end_pending = true;
+    }
+    if (status == KYROS_SOCKET_STATE_CONNECTING) {
+        kyros_socket_check_high_watermark(tcp);
+        kyros_socket_update_poll(tcp);
+        return !tcp->socket.over_high_watermark;
+    }
+    // no need to wait for the poll, the kernel probably takes a good part of it now
+    kyros_socket_internal_flush(tcp);
+    if (tcp->socket.status == KYROS_SOCKET_STATE_CLOSED) {
+        return false;
+    }
+    // checked after the flush, a file the kernel takes right away never crosses the watermark
+    kyros_socket_check_high_watermark(tcp);
+    kyros_socket_update_poll(tcp);
+    return !tcp->socket.over_high_watermark;
+}
+
+///
+/// Read
+///
+
+bool kyros_socket_emit_data(kyros_socket_internal_tcp* tcp, const char* data, uint64_t length)
+{
+    auto handler = tcp->handlers;
+    if (handler && handler->ondata) {
+        if (!handler->ondata(kyros_socket_from_internal(&tcp->socket), data, length, handler->ctx)) {
+            kyros_socket_close_with_error(tcp, kyros_socket_no_error());
+        }
+    }
+    return tcp->socket.status != KYROS_SOCKET_STATE_CLOSED;
+}
+
+void kyros_socket_on_end(kyros_socket_internal_tcp* tcp)
+{
+    if (!tcp->socket.allow_half_open || tcp->socket.status == KYROS_SOCKET_STATE_WRITABLE_ENDED) {
+        kyros_socket_close_with_error(tcp, kyros_socket_no_error());
+        return;
+    }
+    tcp->socket.status = KYROS_SOCKET_STATE_READABLE_ENDED;
+    kyros_socket_update_poll(tcp);
+    kyros_socket_notify_status(tcp, kyros_socket_no_error());
+}
+
+static void kyros_socket_on_readable(kyros_socket_internal_tcp* tcp)
+{
+    if (tcp->socket.pipe_splice) {
+        // the pipe moves the bytes, they never reach the recv buffer
+        kyros_socket_refresh_timeout(tcp);
+        kyros_socket_pipe_on_readable(tcp);
+        return;
+    }
+    auto loop = kyros_socket_internal_get_loop(tcp);
+    auto buffer = kyros_loop_get_recv_buffer(loop);
+    auto fd = kyros_socket_internal_fd(&tcp->poll);
+    uint8_t record_type = 0;
+    auto received = tcp->socket.ktls_rx ? kyros_ktls_recv(fd, buffer, KYROS_RECV_BUFFER_SIZE, &record_type) : kyros_bsd_recv(fd, buffer, KYROS_RECV_BUFFER_SIZE);
+    if (received > 0) {
+        kyros_socket_refresh_timeout(tcp);
+        if (tcp->socket.ktls_rx) {
+            // already decrypted by the kernel
+            kyros_tls_on_record((kyros_socket_internal_tls*)tcp, record_type, buffer, received);
+        } else if (tcp->socket.tag == KYROS_SOCKET_TLS) {
+            kyros_tls_on_data((kyros_socket_internal_tls*)tcp, buffer, received);
+        } else {
+            kyros_socket_emit_data(tcp, buffer, received);
+        }
+        return;
+    }
+    if (received == 0) {
+        // FIN received
+        kyros_socket_on_end(tcp);
+        return;
+    }
+    auto error = kyros_bsd_errno();
+    if (!kyros_bsd_would_block(error)) {
+        kyros_socket_close_with_error(tcp, kyros_socket_system_error(KYROS_SOCKET_ERROR_SYSTEM_ERROR, error));
+    }
+}
+
+static void kyros_socket_on_connect(kyros_socket_internal_tcp* tcp)
+{
+    auto error = kyros_bsd_socket_error(kyros_socket_internal_fd(&tcp->poll));
+    if (error) {
+        kyros_socket_close_with_error(tcp, kyros_socket_system_error(KYROS_SOCKET_ERROR_CONNECTING_ERROR, error));
+        return;
+    }
+    tcp->socket.status = KYROS_SOCKET_STATE_OPEN;
+    kyros_socket_refresh_timeout(tcp);
+    if (tcp->socket.tag == KYROS_SOCKET_TLS) {
+        // onstatus is called with KYROS_SOCKET_STATE_SECURE once the handshake is done
+        kyros_tls_start((kyros_socket_internal_tls*)tcp);
+        return;
+    }
+    kyros_socket_notify_status(tcp, kyros_socket_no_error());
+    if (tcp->socket.status == KYROS_SOCKET_STATE_CLOSED) {
+        return;
+    }
+    // flush whatever was written while connecting
+    kyros_socket_internal_flush(tcp);
+}
+
+static void kyros_socket_poll_callback(uv_poll_t* poll, int status, int events)
+{
+    auto tcp = kyros_container_of(poll, kyros_socket_internal_tcp, poll.poll);
+    if (status < 0) {
+        auto type = tcp->socket.status == KYROS_SOCKET_STATE_CONNECTING ? KYROS_SOCKET_ERROR_CONNECTING_ERROR : KYROS_SOCKET_ERROR_SYSTEM_ERROR;
+        kyros_socket_close_with_error(tcp, kyros_socket_uv_error(type, status));
+        return;
+    }
+    if (tcp->socket.status == KYROS_SOCKET_STATE_CONNECTING) {
+        kyros_socket_on_connect(tcp);
+        return;
+    }
+    if (events & KYROS_SOCKET_WRITABLE) {
+        kyros_socket_internal_flush(tcp);
+        if (tcp->socket.status == KYROS_SOCKET_STATE_CLOSED) {
+            return;
+        }
+        if (tcp->socket.pipe_waiting && !kyros_socket_queued(tcp)) {
+            kyros_socket_pipe_on_writable(tcp);
+            if (tcp->socket.status == KYROS_SOCKET_STATE_CLOSED) {
+                return;
+            }
+        }
+    }
+    if ((events & KYROS_SOCKET_READABLE) && !tcp->socket.migrating) {
+        kyros_socket_on_readable(tcp);
+    }
+}
+
+///
+/// io_uring
+///
+
+static inline kyros_uring* kyros_socket_get_uring(kyros_uring_io* io)
+{
+    return kyros_get_internal_loop((kyros_loop*)io->loop)->uring;
+}
+
+/// @brief account a new operation, it holds a ref (and keeps the loop alive) until its last completion
+static kyros_uring* kyros_socket_uring_hold(kyros_socket_internal* socket, kyros_uring_io* io)
+{
+    auto uring = kyros_socket_get_uring(io);
+    kyros_socket_internal_ref(socket);
+    io->inflight++;
+    if (!io->loop_unref) {
+        kyros_uring_keep_alive(uring, 1);
+    }
+    return uring;
+}
+
+static void kyros_socket_uring_release(kyros_socket_internal* socket, kyros_uring_io* io)
+{
+    io->inflight--;
+    if (!io->loop_unref) {
+        kyros_uring_keep_alive(kyros_socket_get_uring(io), -1);
+    }
+    // a migrating socket leaves once the kernel is done with it, after its last use in this thread
+    bool migrated = socket->migrating && !io->inflight;
+    kyros_socket_internal_unref(socket);
+    if (migrated) {
+        kyros_socket_migrate_post((kyros_socket_internal_tcp*)socket);
+    }
+}
+
+static void kyros_socket_uring_queue_send(kyros_socket_internal_tcp* tcp)
+{
+    auto io = &tcp->poll.uring;
+    if (io->send_queued || tcp->socket.migrating) {
+        return;
+    }
+    auto internal = kyros_get_internal_loop(kyros_socket_internal_get_loop(tcp));
+    io->send_queued = true;
+    io->next_send = internal->uring_sends;
+    internal->uring_sends = io;
+    // counted like an operation until the before/after IO hook prepares it
+    kyros_socket_uring_hold(&tcp->socket, io);
+}
+
+static inline bool kyros_socket_uring_wants_data(kyros_socket_internal_tcp* tcp)
+{
+    // while migrating, whatever still arrives is stashed for the new loop
+    return kyros_socket_status_is_readable(tcp->socket.status) && !tcp->socket.is_paused && !tcp->socket.backpressure_paused && !tcp->socket.pipe_paused && !tcp->socket.migrating;
+}
+
+/// @brief the io_uring version of the poll events, arms what the socket needs and cancels what it does not
+static void kyros_socket_uring_update(kyros_socket_internal_tcp* tcp)
+{
+    auto io = &tcp->poll.uring;
+    KYROS_SOCKET_STATUS status = tcp->socket.status;
+    if (status == KYROS_SOCKET_STATE_CLOSED) {
+        return;
+    }
+    if (status == KYROS_SOCKET_STATE_CONNECTING) {
+        if (!io->connect_armed) {
+            io->connect_armed = true;
+            kyros_uring_poll_writable(kyros_socket_uring_hold(&tcp->socket, io), io->fd, tcp);
+        }
+        return;
+    }
+    if (kyros_socket_uring_wants_data(tcp)) {
+        if (io->stash.length || io->stash_end) {
+            // what arrived while paused goes first, the recv is armed again after it
+            if (!io->stash_scheduled) {
+                io->stash_scheduled = true;
+                kyros_uring_nop(kyros_socket_uring_hold(&tcp->socket, io), tcp, KYROS_URING_STASH);
+            }
+        } else if (!io->recv_armed) {
+            io->recv_armed = true;
+            kyros_uring_recv(kyros_socket_uring_hold(&tcp->socket, io), io->fd, tcp);
+        }
+    } else if (io->recv_armed && !io->recv_canceling) {
+        // the recv can still complete before the cancel, that data is stashed
+        io->recv_canceling = true;
+        kyros_uring_cancel(kyros_socket_get_uring(io), tcp, KYROS_URING_RECV);
+    }
+    if (kyros_socket_can_flush(tcp) && !io->send_armed) {
+        kyros_socket_uring_queue_send(tcp);
+    }
+}
+
+static void kyros_socket_uring_close(kyros_socket_internal_tcp* tcp)
+{
+    auto io = &tcp->poll.uring;
+    auto uring = kyros_socket_get_uring(io);
+    // the last completion of each canceled operation releases its ref
+    if (io->recv_armed && !io->recv_canceling) {
+        io->recv_canceling = true;
+        kyros_uring_cancel(uring, tcp, KYROS_URING_RECV);
+    }
+    if (io->send_armed) {
+        kyros_uring_cancel(uring, tcp, KYROS_URING_SEND);
+    }
+    if (io->connect_armed) {
+        kyros_uring_cancel(uring, tcp, KYROS_URING_CONNECT);
+    }
+    kyros_write_queue_clear(kyros_socket_get_write_pool(tcp), &io->stash);
+    // the kernel keeps its own reference to the socket until the operations are done
+    kyros_bsd_close((uv_os_sock_t)io->fd);
+}
+
+/// @brief send the head of the write queue, what is written until the completion goes in the next send
+static void kyros_socket_uring_send(kyros_socket_internal_tcp* tcp)
+{
+    auto io = &tcp->poll.uring;
+    KYROS_SOCKET_STATUS status = tcp->socket.status;
+    if (status == KYROS_SOCKET_STATE_CLOSED || status == KYROS_SOCKET_STATE_CONNECTING || io->send_armed || tcp->socket.migrating || tcp->socket.file_reading) {
+        return;
+    }
+    if (!kyros_socket_queued(tcp) && tcp->socket.tag == KYROS_SOCKET_TLS) {
+        // everything was sent, the tls layer can encrypt more of its plaintext queue
+        kyros_tls_on_writable((kyros_socket_internal_tls*)tcp);
+        if (tcp->socket.status == KYROS_SOCKET_STATE_CLOSED) {
+            return;
+        }
+    }
+    auto queue = tcp->write_queue;
+    // no sendfile here, files are read in pieces in front of their chunk and sent from kyros_socket_on_file_piece
+    if (queue && queue->length && kyros_write_chunk_get_file(queue->head)) {
+        kyros_socket_read_file_piece(tcp, kyros_write_chunk_get_file(queue->head), kyros_socket_on_file_piece);
+        return;
+    }
+    if (!kyros_socket_queued(tcp)) {
+        // no send is armed, the kernel holds nothing of it
+        kyros_socket_free_write_queue(tcp);
+        if (tcp->socket.end_pending) {
+            kyros_socket_end_writable(tcp);
+            if (tcp->socket.status == KYROS_SOCKET_STATE_CLOSED) {
+                return;
+            }
+        }
+        kyros_socket_check_low_watermark(tcp);
+        return;
+    }
+    uv_buf_t iov[KYROS_WRITE_QUEUE_IOV];
+    uint32_t count = 0;
+    for (auto chunk = queue->head; chunk && count < KYROS_WRITE_QUEUE_IOV && !kyros_write_chunk_get_file(chunk); chunk = chunk->next) {
+        iov[count++] = kyros_write_chunk_bytes(chunk);
+    }
+    io->send_armed = true;
+    kyros_uring_send(kyros_socket_uring_hold(&tcp->socket, io), io->fd, iov, count, tcp);
+}
+
+void kyros_socket_uring_prepare_sends(kyros_loop_internal* internal)
+{
+    // sends can queue more sockets (tls, ondrain), keep going until nothing is left
+    while (internal->uring_sends) {
+        auto io = internal->uring_sends;
+        internal->uring_sends = io->next_send;
+        io->next_send = NULL;
+        io->send_queued = false;
+        auto tcp = kyros_container_of(io, kyros_socket_internal_tcp, poll.uring);
+        kyros_socket_uring_send(tcp);
+        kyros_socket_uring_release(&tcp->socket, io);
+    }
+}
+
+static void kyros_socket_uring_on_send(kyros_socket_internal_tcp* tcp, int32_t result)
+{
+    auto pool = kyros_socket_get_write_pool(tcp);
+    tcp->poll.uring.send_armed = false;
+    if (tcp->socket.status == KYROS_SOCKET_STATE_CLOSED) {
+        // kept by kyros_socket_close_with_error while the kernel could still read it
+        kyros_socket_free_write_queue(tcp);
+        return;
+    }
+    if (result < 0) {
+        kyros_socket_close_with_error(tcp, kyros_socket_system_error(KYROS_SOCKET_ERROR_SYSTEM_ERROR, -result));
+        return;
+    }
+    kyros_socket_refresh_timeout(tcp);
+    kyros_write_queue_consume(pool, tcp->write_queue, result);
+    // the rest, the tls plaintext or the pending end go with the next submit
+    kyros_socket_uring_queue_send(tcp);
+    kyros_socket_check_low_watermark(tcp);
+}
+
+static void kyros_socket_uring_deliver(kyros_socket_internal_tcp* tcp, const char* data, uint64_t length)
+{
+    if (tcp->socket.tag == KYROS_SOCKET_TLS) {
+        kyros_tls_on_data((kyros_socket_internal_tls*)tcp, data, length);
+    } else {
+        kyros_socket_emit_data(tcp, data, length);
+    }
+}
+
+/// @brief copy data received while paused, chunks keep KYROS_RECV_BUFFER_PADDING free so they are delivered in place
+static void kyros_socket_uring_stash(kyros_socket_internal_tcp* tcp, const char* data, uint64_t length)
+{
+    auto pool = kyros_socket_get_write_pool(tcp);
+    auto stash = &tcp->poll.uring.stash;
+    stash->length += length;
+    while (length) {
+        auto chunk = kyros_write_chunk_pool_get(pool);
+        uint64_t size = length < KYROS_WRITE_CHUNK_CAPACITY - KYROS_RECV_BUFFER_PADDING ? length : KYROS_WRITE_CHUNK_CAPACITY - KYROS_RECV_BUFFER_PADDING;
+        memcpy(chunk->data, data, size);
+        chunk->end = size;
+        kyros_write_queue_link(stash, chunk);
+        data += size;
+        length -= size;
+    }
+}
+
+static void kyros_socket_uring_on_recv(kyros_socket_internal_tcp* tcp, int32_t result, const char* buffer, bool more)
+{
+    auto io = &tcp->poll.uring;
+    if (!more) {
+        io->recv_armed = false;
+        io->recv_canceling = false;
+    }
+    if (tcp->socket.status != KYROS_SOCKET_STATE_CLOSED) {
+        if (result > 0) {
+            kyros_socket_refresh_timeout(tcp);
+            if (kyros_socket_uring_wants_data(tcp) && !io->stash.length) {
+                kyros_socket_uring_deliver(tcp, buffer, result);
+            } else {
+                kyros_socket_uring_stash(tcp, buffer, result);
+            }
+        } else if (result == 0) {
+            // FIN received
+            if (kyros_socket_uring_wants_data(tcp) && !io->stash.length) {
+                kyros_socket_on_end(tcp);
+            } else {
+                io->stash_end = true;
+            }
+        } else if (result != -ENOBUFS && result != -ECANCELED) {
+            kyros_socket_close_with_error(tcp, kyros_socket_system_error(KYROS_SOCKET_ERROR_SYSTEM_ERROR, -result));
+        }
+        if (!more && tcp->socket.status != KYROS_SOCKET_STATE_CLOSED) {
+            // armed again if still wanted (out of provided buffers, or paused and resumed before the cancel)
+            kyros_socket_uring_update(tcp);
+        }
+    }
+    if (!more) {
+        kyros_socket_uring_release(&tcp->socket, io);
+    }
+}
+
+static void kyros_socket_uring_on_stash(kyros_socket_internal_tcp* tcp)
+{
+    auto io = &tcp->poll.uring;
+    auto pool = kyros_socket_get_write_pool(tcp);
+    io->stash_scheduled = false;
+    while (io->stash.head && tcp->socket.status != KYROS_SOCKET_STATE_CLOSED && kyros_socket_uring_wants_data(tcp)) {
+        // detached first, ondata can pause or close the socket
+        auto chunk = io->stash.head;
+        io->stash.head = chunk->next;
+        if (!io->stash.head) {
+            io->stash.tail = NULL;
+        }
+        io->stash.length -= chunk->end;
+        kyros_socket_uring_deliver(tcp, chunk->data, chunk->end);
+        kyros_write_chunk_pool_release(pool, chunk);
+    }
+    if (io->stash_end && !io->stash.head && tcp->socket.status != KYROS_SOCKET_STATE_CLOSED && kyros_socket_uring_wants_data(tcp)) {
+        io->stash_end = false;
+        kyros_socket_on_end(tcp);
+    }
+    if (tcp->socket.status != KYROS_SOCKET_STATE_CLOSED) {
+        kyros_socket_uring_update(tcp);
+    }
+    kyros_socket_uring_release(&tcp->socket, io);
+}
+
+static void kyros_socket_uring_on_connect(kyros_socket_internal_tcp* tcp, int32_t result)
+{
+    tcp->poll.uring.connect_armed = false;
+    if (tcp->socket.status == KYROS_SOCKET_STATE_CONNECTING) {
+        if (result < 0) {
+            kyros_socket_close_with_error(tcp, kyros_socket_system_error(KYROS_SOCKET_ERROR_CONNECTING_ERROR, -result));
+        } else {
+            // checks SO_ERROR, POLLOUT also comes with a refused connection
+            kyros_socket_on_connect(tcp);
+        }
+    }
+    kyros_socket_uring_release(&tcp->socket, &tcp->poll.uring);
+}
+
+static void kyros_socket_uring_listen(kyros_socket_internal_listener* listener)
+{
+    auto io = &listener->poll.uring;
+    io->recv_armed = true;
+    kyros_uring_accept(kyros_socket_uring_hold(&listener->socket, io), io->fd, listener);
+}
+
+static void kyros_socket_uring_on_accept(kyros_socket_internal_listener* listener, int32_t result, bool more)
+{
+    auto io = &listener->poll.uring;
+    if (!more) {
+        io->recv_armed = false;
+    }
+    if (result >= 0) {
+        if (listener->socket.status == KYROS_SOCKET_STATE_CLOSED) {
+            kyros_bsd_close((uv_os_sock_t)result);
+        } else {
+            kyros_socket_on_accepted(listener, (kyros_loop*)io->loop, (uv_os_sock_t)result);
+        }
+    }
+    // errors (EMFILE) end the multishot accept, it is armed again like the poll engine retries on the next readiness
+    if (!io->recv_armed && listener->socket.status != KYROS_SOCKET_STATE_CLOSED) {
+        kyros_socket_uring_listen(listener);
+    }
+    if (!more) {
+        kyros_socket_uring_release(&listener->socket, io);
+    }
 }
 
-uint64_t kyros_socket_flush(kyros_socket socket) {
-    return 0;    
+void kyros_socket_uring_complete(void* target, kyros_uring_op op, int32_t result, const char* buffer, bool more)
+{
+    auto tcp = (kyros_socket_internal_tcp*)target;
+    switch (op) {
+    case KYROS_URING_RECV:
+        kyros_socket_uring_on_recv(tcp, result, buffer, more);
+        break;
+    case KYROS_URING_SEND:
+        kyros_socket_uring_on_send(tcp, result);
+        kyros_socket_uring_release(&tcp->socket, &tcp->poll.uring);
+        break;
+    case KYROS_URING_CONNECT:
+        kyros_socket_uring_on_connect(tcp, result);
+        break;
+    case KYROS_URING_ACCEPT:
+        kyros_socket_uring_on_accept((kyros_socket_internal_listener*)target, result, more);
+        break;
+    case KYROS_URING_STASH:
+        kyros_socket_uring_on_stash(tcp);
+        break;
+    default:
+        break;
+    }
 }
 
-uint64_t kyros_socket_buffer_size(kyros_socket socket) {
-    /// writable buffer size waiting to be flushed on drain event
+///
+/// Connect
+///
+
+static kyros_socket_internal_tcp* kyros_socket_create_tcp(kyros_loop* loop, kryos_socket_options options, kyros_socket_handler* handler, bool is_client)
+{
+    // tls sockets extend the tcp one
+    auto tcp = (kyros_socket_internal_tcp*)kyros_alloc(options.tls ? sizeof(kyros_socket_internal_tls) : sizeof(kyros_socket_internal_tcp));
+    *tcp = (kyros_socket_internal_tcp) {
+        .socket = {
+            .ref_count = 1,
+            .status = KYROS_SOCKET_STATE_CONNECTING,
+            .allow_half_open = options.allow_half_open,
+            .is_paused = options.start_paused,
+            .is_client = is_client,
+            .tag = options.tls ? KYROS_SOCKET_TLS : KYROS_SOCKET_TCP,
+            .pause_on_backpressure = options.pause_on_backpressure,
+            // kernel tls needs the readiness path (recvmsg with the record type, sendfile)
+            .kernel_tls = options.tls && options.kernel_tls && !kyros_get_internal_loop(loop)->uring,
+        },
+        .handlers = handler,
+        .timeout_entry = { .callback = kyros_socket_timeout_callback },
+        .timeout = options.timeout,
+        .write_high_watermark = options.write_high_watermark ? options.write_high_watermark : KYROS_WRITE_HIGH_WATERMARK,
+        .write_low_watermark = options.write_low_watermark ? options.write_low_watermark : KYROS_WRITE_LOW_WATERMARK,
+        .cork_behavior = options.cork_behavior,
+        .enable_write_buffer = options.enable_write_buffer,
+    };
+    if (tcp->write_low_watermark > tcp->write_high_watermark) {
+        tcp->write_low_watermark = tcp->write_high_watermark;
+    }
+    // uv_poll_init will set it again, but we need the loop before having a fd (resolving)
+    tcp->poll.poll.loop = (uv_loop_t*)loop;
+    if (handler) {
+        handler->ref_count++;
+    }
+    if (options.tls) {
+        kyros_tls_init((kyros_socket_internal_tls*)tcp, options.tls, is_client);
+    }
+    return tcp;
+}
+
+static void kyros_socket_apply_options(uv_os_sock_t fd, int family, kryos_socket_options options)
+{
+    if (family == AF_INET || family == AF_INET6) {
+        if (options.no_delay) {
+            kyros_bsd_set_nodelay(fd, true);
+        }
+        if (options.keep_alive) {
+            kyros_bsd_set_keepalive(fd, true, options.keep_alive_initial_delay);
+        }
+    }
+}
+
+static void kyros_socket_attach_fd(kyros_socket_internal_tcp* tcp, uv_os_sock_t fd)
+{
+    auto loop = kyros_socket_internal_get_loop(tcp);
+    if (kyros_get_internal_loop(loop)->uring) {
+        tcp->poll.uring = (kyros_uring_io) { .loop = (uv_loop_t*)loop, .fd = (int)fd };
+        tcp->socket.uring = true;
+    } else {
+        uv_poll_init_socket((uv_loop_t*)loop, &tcp->poll.poll, fd);
+    }
+    tcp->socket.has_poll = true;
+    kyros_socket_refresh_timeout(tcp);
+    kyros_socket_update_poll(tcp);
+}
+
+/// @brief create a socket and start a non-blocking connect, returns 0 or a system error
+static int kyros_socket_open_connect(const struct sockaddr* address, socklen_t length, kryos_socket_options options, uv_os_sock_t* fd)
+{
+    *fd = kyros_bsd_create_socket(address->sa_family, SOCK_STREAM);
+    if (*fd == KYROS_INVALID_SOCKET) {
+        return kyros_bsd_errno();
+    }
+    kyros_socket_apply_options(*fd, address->sa_family, options);
+    if (connect(*fd, address, length) != 0) {
+        auto error = kyros_bsd_errno();
+        // an interrupted connect goes on in the background like one in progress
+        if (error != KYROS_SOCKET_ERROR_IN_PROGRESS && error != KYROS_SOCKET_ERROR_INTERRUPTED && !kyros_bsd_would_block(error)) {
+            kyros_bsd_close(*fd);
+            return error;
+        }
+    }
     return 0;
 }
 
-void kyros_socket_ref(kyros_socket socket) {
+/// @brief start a non-blocking connect, returns 0 or a system error
+static int kyros_socket_start_connect(kyros_socket_internal_tcp* tcp, const struct sockaddr* address, socklen_t length, kryos_socket_options options)
+{
+    uv_os_sock_t fd;
+    auto error = kyros_socket_open_connect(address, length, options, &fd);
+    if (!error) {
+        kyros_socket_attach_fd(tcp, fd);
+    }
+    return error;
+}
+
+static inline socklen_t kyros_socket_address_length(const struct sockaddr_storage* address)
+{
+    return address->ss_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+}
+
+typedef struct {
+    kyros_socket_internal_tcp* socket;
+    kyros_socket_error error;
+} kyros_socket_deferred_status;
+
+static void kyros_socket_deferred_status_callback(void* ctx)
+{
+    kyros_socket_deferred_status* deferred = ctx;
+    auto tcp = deferred->socket;
+    if (tcp->socket.status != KYROS_SOCKET_STATE_CLOSED) {
+        if (deferred->error.type != KYROS_SOCKET_ERROR_NO_ERROR) {
+            kyros_socket_close_with_error(tcp, deferred->error);
+        } else {
+            kyros_socket_notify_status(tcp, deferred->error);
+        }
+    }
+    kyros_socket_internal_unref(&tcp->socket);
+    kyros_free(deferred);
+}
+
+/// @brief report a status on the next tick, so the caller of kyros_socket_connect has the socket first
+static void kyros_socket_defer_status(kyros_socket_internal_tcp* tcp, kyros_socket_error error)
+{
+    auto deferred = (kyros_socket_deferred_status*)kyros_alloc(sizeof(kyros_socket_deferred_status));
+    deferred->socket = tcp;
+    deferred->error = error;
+    kyros_socket_internal_ref(&tcp->socket);
+    kyros_loop_defer(kyros_socket_internal_get_loop(tcp), kyros_socket_deferred_status_callback, deferred);
+}
+
+///
+/// Happy Eyeballs
+///
+
+typedef struct kyros_socket_race kyros_socket_race;
+
+typedef struct {
+    uv_poll_t poll;
+    kyros_socket_race* race;
+    uv_os_sock_t fd;
+    bool connecting : 1;
+} kyros_socket_race_attempt;
+
+// RFC 8305 connection race of a tcp socket that has no fd yet, the first attempt that connects gives its fd to the socket
+struct kyros_socket_race {
+    // holds a reference until the last attempt poll is closed
+    kyros_socket_internal_tcp* socket;
+    kyros_loop* loop;
+    // Connection Attempt Delay, armed while there are addresses left
+    kyros_timer_entry delay_entry;
+    kryos_socket_options options;
+    uint32_t count;
+    // next address to try
+    uint32_t next;
+    uint32_t connecting;
+    uint32_t open_polls;
+    // libuv error of the last failed attempt
+    int error;
+    // the socket has its fd or its error, what is left is closing
+    bool finished;
+    struct sockaddr_storage addresses[KYROS_HAPPY_EYEBALLS_MAX_ATTEMPTS];
+    kyros_socket_race_attempt attempts[KYROS_HAPPY_EYEBALLS_MAX_ATTEMPTS];
+};
+
+static inline kyros_timer_wheel* kyros_socket_race_get_timer_wheel(kyros_socket_race* race)
+{
+    return &kyros_get_internal_loop(race->loop)->timer_wheel;
+}
+
+/// @brief interleave the families starting with the one of the first address (RFC 8305 section 4, First Address Family Count of 1)
+static uint32_t kyros_socket_race_order(const struct sockaddr_storage* addresses, uint32_t count, struct sockaddr_storage* ordered, uint32_t capacity)
+{
+    auto first_family = addresses[0].ss_family;
+    // next address to look at for the first family (0) and for the other one (1)
+    uint32_t cursors[2] = { 0, 0 };
+    uint32_t length = 0;
+    for (uint32_t turn = 0; length < capacity; turn ^= 1) {
+        bool found = false;
+        // the other family takes the turn once this one has nothing left
+        for (uint32_t k = 0; k < 2 && !found; k++) {
+            auto side = turn ^ k;
+            while (cursors[side] < count && !found) {
+                auto address = &addresses[cursors[side]++];
+                if ((address->ss_family == first_family) == (side == 0)) {
+                    ordered[length++] = *address;
+                    found = true;
+                }
+            }
+        }
+        if (!found) {
+            break;
+        }
+    }
+    return length;
+}
+
+static void kyros_socket_race_poll_close_callback(uv_handle_t* handle)
+{
+    auto attempt = kyros_container_of((uv_poll_t*)handle, kyros_socket_race_attempt, poll);
+    auto race = attempt->race;
+    if (--race->open_polls == 0 && race->finished) {
+        kyros_socket_internal_unref(&race->socket->socket);
+        kyros_free(race);
+    }
+}
+
+/// @brief the fd is closed too unless it is the one of the winner
+static void kyros_socket_race_close_attempt(kyros_socket_race* race, kyros_socket_race_attempt* attempt, bool keep_fd)
+{
+    attempt->connecting = false;
+    race->connecting--;
+    uv_close((uv_handle_t*)&attempt->poll, kyros_socket_race_poll_close_callback);
+    if (!keep_fd) {
+        kyros_bsd_close(attempt->fd);
+    }
+}
+
+/// @brief stop racing, the attempts still connecting are closed
+static void kyros_socket_race_finish(kyros_socket_race* race)
+{
+    race->finished = true;
+    race->socket->socket.racing = false;
+    race->socket->poll.poll.data = NULL;
+    kyros_timer_wheel_remove(kyros_socket_race_get_timer_wheel(race), &race->delay_entry);
+    for (uint32_t i = 0; i < race->next; i++) {
+        if (race->attempts[i].connecting) {
+            kyros_socket_race_close_attempt(race, &race->attempts[i], false);
+        }
+    }
+    if (!race->open_polls) {
+        kyros_socket_internal_unref(&race->socket->socket);
+        kyros_free(race);
+    }
+}
+
+/// @brief called by kyros_socket_close_with_error
+static void kyros_socket_race_cancel(kyros_socket_internal_tcp* tcp)
+{
+    kyros_socket_race_finish((kyros_socket_race*)tcp->poll.poll.data);
+}
+
+static void kyros_socket_race_fail(kyros_socket_race* race)
+{
+    kyros_socket_defer_status(race->socket, kyros_socket_uv_error(KYROS_SOCKET_ERROR_CONNECTING_ERROR, race->error));
+    kyros_socket_race_finish(race);
+}
+
+static void kyros_socket_race_poll_callback(uv_poll_t* poll, int status, int events);
+
+/// @brief start the next address that does not fail right away, false if none is left
+static bool kyros_socket_race_next(kyros_socket_race* race)
+{
+    while (race->next < race->count) {
+        auto index = race->next++;
+        auto address = &race->addresses[index];
+        auto attempt = &race->attempts[index];
+        auto error = kyros_socket_open_connect((struct sockaddr*)address, kyros_socket_address_length(address), race->options, &attempt->fd);
+        if (error) {
+            race->error = uv_translate_sys_error(error);
+            continue;
+        }
+        attempt->race = race;
+        attempt->connecting = true;
+        race->connecting++;
+        race->open_polls++;
+        uv_poll_init_socket((uv_loop_t*)race->loop, &attempt->poll, attempt->fd);
+        uv_poll_start(&attempt->poll, UV_WRITABLE, kyros_socket_race_poll_callback);
+        if (race->next < race->count) {
+            kyros_timer_wheel_insert(kyros_socket_race_get_timer_wheel(race), &race->delay_entry, KYROS_HAPPY_EYEBALLS_ATTEMPT_DELAY);
+        } else {
+            kyros_timer_wheel_remove(kyros_socket_race_get_timer_wheel(race), &race->delay_entry);
+        }
+        return true;
+    }
+    return false;
+}
+
+static void kyros_socket_race_poll_callback(uv_poll_t* poll, int status, int events)
+{
+    auto attempt = kyros_container_of(poll, kyros_socket_race_attempt, poll);
+    auto race = attempt->race;
+    // libuv reports a refused connect as UV_EBADF, the socket knows why it failed
+    auto error = uv_translate_sys_error(kyros_bsd_socket_error(attempt->fd));
+    if (!error && status < 0) {
+        error = status;
+    }
+    if (!error) {
+        auto tcp = race->socket;
+        auto fd = attempt->fd;
+        kyros_socket_race_close_attempt(race, attempt, true);
+        kyros_socket_race_finish(race);
+        // the poll of the socket finds it connected and goes on like any other connect
+        kyros_socket_attach_fd(tcp, fd);
+        return;
+    }
+    race->error = error;
+    kyros_socket_race_close_attempt(race, attempt, false);
+    // a failed attempt does not wait for the delay
+    if (!kyros_socket_race_next(race) && !race->connecting) {
+        kyros_socket_race_fail(race);
+    }
+}
+
+static void kyros_socket_race_delay_callback(kyros_timer_entry* entry)
+{
+    auto race = kyros_container_of(entry, kyros_socket_race, delay_entry);
+    if (!kyros_socket_race_next(race) && !race->connecting) {
+        kyros_socket_race_fail(race);
+    }
+}
+
+static void kyros_socket_race_start(kyros_socket_internal_tcp* tcp, const struct sockaddr_storage* addresses, uint32_t count, kryos_socket_options options)
+{
+    auto race = (kyros_socket_race*)kyros_alloc(sizeof(kyros_socket_race));
+    race->socket = tcp;
+    race->loop = kyros_socket_internal_get_loop(tcp);
+    race->delay_entry = (kyros_timer_entry) { .callback = kyros_socket_race_delay_callback };
+    race->options = options;
+    race->count = kyros_socket_race_order(addresses, count, race->addresses, KYROS_HAPPY_EYEBALLS_MAX_ATTEMPTS);
+    race->next = 0;
+    race->connecting = 0;
+    race->open_polls = 0;
+    race->error = UV_ECONNREFUSED;
+    race->finished = false;
+    kyros_socket_internal_ref(&tcp->socket);
+    tcp->socket.racing = true;
+    // the poll room is unused until the socket has a fd
+    tcp->poll.poll.data = race;
+    if (!kyros_socket_race_next(race)) {
+        kyros_socket_race_fail(race);
+    }
+}
+
+///
+/// DNS
+///
+
+typedef struct {
+    kyros_dns_waiter waiter;
+    kyros_socket_internal_tcp* socket;
+    kryos_socket_options options;
+    uint16_t port;
+    kyros_socket_ip_family family;
+    bool happy_eyeballs;
+} kyros_socket_dns_request;
+
+/// @brief connect to what the host name resolved to (takes the record reference), errors are reported on the next tick
+static void kyros_socket_connect_resolved(kyros_socket_internal_tcp* tcp, kyros_dns_record* record, int32_t error, kyros_socket_dns_request* request)
+{
+    if (record) {
+        struct sockaddr_storage addresses[KYROS_DNS_MAX_ADDRESSES];
+        auto count = kyros_dns_record_addresses(record, request->family, request->port, addresses, KYROS_DNS_MAX_ADDRESSES);
+        kyros_dns_record_unref(record);
+        error = UV_EAI_ADDRFAMILY;
+        if (count > 1 && request->happy_eyeballs) {
+            kyros_socket_race_start(tcp, addresses, count, request->options);
+            return;
+        }
+        // without happy eyeballs only the addresses that fail right away are skipped
+        for (uint32_t i = 0; i < count; i++) {
+            auto result = kyros_socket_start_connect(tcp, (struct sockaddr*)&addresses[i], kyros_socket_address_length(&addresses[i]), request->options);
+            if (!result) {
+                return;
+            }
+            error = uv_translate_sys_error(result);
+        }
+    }
+    kyros_socket_defer_status(tcp, kyros_socket_uv_error(KYROS_SOCKET_ERROR_CONNECTING_ERROR, error));
+}
+
+static void kyros_socket_dns_callback(kyros_dns_waiter* waiter, kyros_dns_record* record, int32_t error)
+{
+    auto request = kyros_container_of(waiter, kyros_socket_dns_request, waiter);
+    auto tcp = request->socket;
+    if (tcp->socket.status != KYROS_SOCKET_STATE_CLOSED) {
+        kyros_socket_connect_resolved(tcp, record, error, request);
+    } else if (record) {
+        kyros_dns_record_unref(record);
+    }
+    kyros_socket_internal_unref(&tcp->socket);
+    kyros_free(request);
+}
 
+int kyros_socket_family_hint(kyros_socket_ip_family family)
+{
+    switch (family) {
+    case KYROS_SOCKET_IP_FAMILY_IPV4:
+        return AF_INET;
+    case KYROS_SOCKET_IP_FAMILY_IPV6:
+        return AF_INET6;
+    default:
+        return AF_UNSPEC;
+    }
 }
-void kyros_socket_unref(kyros_socket socket) {
 
+/// @brief parse a literal ip, returns false if host is a name
+bool kyros_socket_parse_ip(const char* host, uint16_t port, kyros_socket_ip_family family, struct sockaddr_storage* address, socklen_t* length)
+{
+    if (family != KYROS_SOCKET_IP_FAMILY_IPV6 && uv_ip4_addr(host, port, (struct sockaddr_in*)address) == 0) {
+        *length = sizeof(struct sockaddr_in);
+        return true;
+    }
+    if (family != KYROS_SOCKET_IP_FAMILY_IPV4 && uv_ip6_addr(host, port, (struct sockaddr_in6*)address) == 0) {
+        *length = sizeof(struct sockaddr_in6);
+        return true;
+    }
+    return false;
 }
 
-void kyros_socket_write(kyros_socket socket, const char* buffer, uint64_t size, bool end) {
+static void kyros_socket_connect_host_port(kyros_socket_internal_tcp* tcp, kyros_socket_source source, kryos_socket_options options)
+{
+    auto host = source.value.host_port.host ? source.value.host_port.host : "localhost";
+    auto port = source.value.host_port.port;
+    struct sockaddr_storage address;
+    socklen_t length;
+    auto is_ip = kyros_socket_parse_ip(host, port, source.value.host_port.family, &address, &length);
+    if (tcp->socket.tag == KYROS_SOCKET_TLS) {
+        kyros_tls_set_peer((kyros_socket_internal_tls*)tcp, host, port, !is_ip);
+    }
+    if (is_ip) {
+        auto error = kyros_socket_start_connect(tcp, (struct sockaddr*)&address, length, options);
+        if (error) {
+            kyros_socket_defer_status(tcp, kyros_socket_system_error(KYROS_SOCKET_ERROR_CONNECTING_ERROR, error));
+        }
+        return;
+    }
+    // cached names connect right away, the others wait for a resolver thread (the request keeps the socket alive)
+    auto request = (kyros_socket_dns_request*)kyros_alloc(sizeof(kyros_socket_dns_request));
+    *request = (kyros_socket_dns_request) {
+        .waiter = { .loop = kyros_socket_internal_get_loop(tcp), .callback = kyros_socket_dns_callback },
+        .socket = tcp,
+        .options = options,
+        .port = port,
+        .family = source.value.host_port.family,
+        .happy_eyeballs = source.value.host_port.use_happy_eyeballs,
+    };
+    kyros_dns_record* record;
+    int32_t error;
+    if (kyros_dns_resolve(host, &request->waiter, &record, &error)) {
+        kyros_socket_connect_resolved(tcp, record, error, request);
+        kyros_free(request);
+        return;
+    }
+    kyros_socket_internal_ref(&tcp->socket);
+}
 
+static inline bool kyros_socket_source_is_udp(kyros_socket_source source)
+{
+    return (source.type == KYROS_SOCKET_SOURCE_HOSTPORT && source.value.host_port.use_udp)
+        || (source.type == KYROS_SOCKET_SOURCE_FD && source.value.fd.type == KYROS_SOCKET_FD_TYPE_UDP);
 }
 
-void kyros_socket_close(kyros_socket socket) {
+#ifndef _WIN32
+static bool kyros_socket_unix_address(const char* path, struct sockaddr_un* address, socklen_t* length)
+{
+    auto path_length = strlen(path);
+    if (path_length >= sizeof(address->sun_path)) {
+        return false;
+    }
+    memset(address, 0, sizeof(struct sockaddr_un));
+    address->sun_family = AF_UNIX;
+    memcpy(address->sun_path, path, path_length);
+    *length = offsetof(struct sockaddr_un, sun_path) + path_length + 1;
+    return true;
+}
+#endif
 
+kyros_socket kyros_socket_connect(kyros_loop* loop, kyros_socket_source source, kryos_socket_options options, kyros_socket_handler* handler)
+{
+    if (kyros_socket_source_is_udp(source)) {
+        return kyros_udp_connect(loop, source, handler);
+    }
+    auto tcp = kyros_socket_create_tcp(loop, options, handler, true);
+    switch (source.type) {
+    case KYROS_SOCKET_SOURCE_HOSTPORT:
+        kyros_socket_connect_host_port(tcp, source, options);
+        break;
+#ifndef _WIN32
+    case KYROS_SOCKET_SOURCE_UNIXSOCKET: {
+        struct sockaddr_un address;
+        socklen_t length;
+        if (!kyros_socket_unix_address(source.value.path, &address, &length)) {
+            kyros_socket_defer_status(tcp, kyros_socket_uv_error(KYROS_SOCKET_ERROR_CONNECTING_ERROR, UV_ENAMETOOLONG));
+            break;
+        }
+        auto error = kyros_socket_start_connect(tcp, (struct sockaddr*)&address, length, options);
+        if (error) {
+            kyros_socket_defer_status(tcp, kyros_socket_system_error(KYROS_SOCKET_ERROR_CONNECTING_ERROR, error));
+        }
+        break;
+    }
+#endif
+    case KYROS_SOCKET_SOURCE_FD: {
+        // already connected, only wrap it
+        auto fd = kyros_bsd_set_nonblocking((uv_os_sock_t)source.value.fd.fd);
+        tcp->socket.status = KYROS_SOCKET_STATE_OPEN;
+        kyros_socket_attach_fd(tcp, fd);
+        if (tcp->socket.tag == KYROS_SOCKET_TLS) {
+            kyros_tls_start((kyros_socket_internal_tls*)tcp);
+        } else {
+            kyros_socket_defer_status(tcp, kyros_socket_no_error());
+        }
+        break;
+    }
+    default:
+        kyros_socket_defer_status(tcp, kyros_socket_uv_error(KYROS_SOCKET_ERROR_CONNECTING_ERROR, UV_ENOTSUP));
+        break;
+    }
+    return kyros_socket_from_internal(&tcp->socket);
 }
 
-void kyros_socket_keepalive_loop(kyros_socket socket, bool keep_alive) {
+///
+/// Listen
+///
+
+/// @brief wrap a socket accepted by the listener (poll or io_uring engine)
+static void kyros_socket_on_accepted(kyros_socket_internal_listener* listener, kyros_loop* loop, uv_os_sock_t accepted)
+{
+    auto tcp = kyros_socket_create_tcp(loop, listener->options, listener->handlers, false);
+    tcp->socket.status = KYROS_SOCKET_STATE_OPEN;
+    struct sockaddr_storage address;
+    socklen_t length = sizeof(address);
+    auto family = getsockname(accepted, (struct sockaddr*)&address, &length) == 0 ? address.ss_family : AF_UNSPEC;
+    kyros_socket_apply_options(accepted, family, listener->options);
+    kyros_socket_attach_fd(tcp, accepted);
+    if (tcp->socket.tag == KYROS_SOCKET_TLS) {
+        kyros_tls_start((kyros_socket_internal_tls*)tcp);
+    } else {
+        kyros_socket_notify_status(tcp, kyros_socket_no_error());
+    }
+}
 
+static void kyros_socket_listener_callback(uv_poll_t* poll, int status, int events)
+{
+    auto listener = kyros_container_of(poll, kyros_socket_internal_listener, poll.poll);
+    if (status < 0) {
+        return;
+    }
+    auto loop = (kyros_loop*)poll->loop;
+    auto fd = kyros_socket_internal_fd(&listener->poll);
+    for (uint32_t i = 0; i < KYROS_ACCEPT_BATCH && listener->socket.status != KYROS_SOCKET_STATE_CLOSED; i++) {
+        auto accepted = kyros_bsd_accept(fd);
+        if (accepted == KYROS_INVALID_SOCKET) {
+            break;
+        }
+        kyros_socket_on_accepted(listener, loop, accepted);
+    }
 }
 
-void kyros_socket_nodelay(kyros_socket socket, bool nodelay) {
+static uv_os_sock_t kyros_socket_bind_listen(const struct sockaddr* address, socklen_t length, bool reuse_port, bool dual_stack)
+{
+    auto fd = kyros_bsd_create_socket(address->sa_family, SOCK_STREAM);
+    if (fd == KYROS_INVALID_SOCKET) {
+        return fd;
+    }
+    if (address->sa_family != AF_UNIX) {
+        kyros_bsd_set_reuse(fd, reuse_port);
+    }
+#ifdef IPV6_V6ONLY
+    if (address->sa_family == AF_INET6) {
+        int v6_only = !dual_stack;
+        setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, (const char*)&v6_only, sizeof(int));
+    }
+#endif
+    if (bind(fd, address, length) != 0 || listen(fd, SOMAXCONN) != 0) {
+        kyros_bsd_close(fd);
+        return KYROS_INVALID_SOCKET;
+    }
+    return fd;
+}
 
+static uv_os_sock_t kyros_socket_listen_host_port(kyros_loop* loop, kyros_socket_source source)
+{
+    kyros_socket_ip_family family = source.value.host_port.family;
+    bool reuse_port = source.value.host_port.reuse_port;
+    struct addrinfo hints = {
+        .ai_family = kyros_socket_family_hint(family),
+        .ai_socktype = SOCK_STREAM,
+        .ai_flags = AI_PASSIVE,
+    };
+    char port_string[8];
+    snprintf(port_string, sizeof(port_string), "%u", source.value.host_port.port);
+    // listening happens at startup, resolve synchronously (NULL callback)
+    uv_getaddrinfo_t request;
+    if (uv_getaddrinfo((uv_loop_t*)loop, &request, NULL, source.value.host_port.host, port_string, &hints) < 0) {
+        return KYROS_INVALID_SOCKET;
+    }
+    uv_os_sock_t fd = KYROS_INVALID_SOCKET;
+    // prefer a dual stack ipv6 socket when both families are allowed
+    for (auto address = request.addrinfo; address && fd == KYROS_INVALID_SOCKET; address = address->ai_next) {
+        if (address->ai_family == AF_INET6) {
+            fd = kyros_socket_bind_listen(address->ai_addr, address->ai_addrlen, reuse_port, family == KYROS_SOCKET_IP_FAMILY_ANY);
+        }
+    }
+    for (auto address = request.addrinfo; address && fd == KYROS_INVALID_SOCKET; address = address->ai_next) {
+        if (address->ai_family == AF_INET) {
+            fd = kyros_socket_bind_listen(address->ai_addr, address->ai_addrlen, reuse_port, false);
+        }
+    }
+    uv_freeaddrinfo(request.addrinfo);
+    return fd;
 }
 
-void kyros_socket_keepalive(kyros_socket socket, bool nodelay) {
+kyros_socket kyros_socket_listen(kyros_loop* loop, kyros_socket_source source, kryos_socket_options options, kyros_socket_handler* handler)
+{
+    if (kyros_socket_source_is_udp(source)) {
+        // udp has nothing to accept, the bound socket gets the datagrams of every peer
+        return kyros_udp_bind(loop, source, handler);
+    }
+    uv_os_sock_t fd = KYROS_INVALID_SOCKET;
+    switch (source.type) {
+    case KYROS_SOCKET_SOURCE_HOSTPORT:
+        fd = kyros_socket_listen_host_port(loop, source);
+        break;
+#ifndef _WIN32
+    case KYROS_SOCKET_SOURCE_UNIXSOCKET: {
+        struct sockaddr_un address;
+        socklen_t length;
+        if (kyros_socket_unix_address(source.value.path, &address, &length)) {
+            fd = kyros_socket_bind_listen((struct sockaddr*)&address, length, false, false);
+        }
+        break;
+    }
+#endif
+    case KYROS_SOCKET_SOURCE_FD:
+        fd = kyros_bsd_set_nonblocking((uv_os_sock_t)source.value.fd.fd);
+        break;
+    default:
+        break;
+    }
+    if (fd == KYROS_INVALID_SOCKET) {
+        return (kyros_socket) { 0 };
+    }
+    auto listener = (kyros_socket_internal_listener*)kyros_alloc(sizeof(kyros_socket_internal_listener));
+    *listener = (kyros_socket_internal_listener) {
+        .socket = {
+            .ref_count = 1,
+            .status = KYROS_SOCKET_STATE_OPEN,
+            .tag = options.tls ? KYROS_SOCKET_TLS_LISTENER : KYROS_SOCKET_TCP_LISTENER,
+            .has_poll = true,
+            .poll_events = KYROS_SOCKET_READABLE,
+        },
+        .handlers = handler,
+        .options = options,
+    };
+    if (handler) {
+        handler->ref_count++;
+    }
+    if (options.tls) {
+        // every accepted socket creates its SSL from it
+        SSL_CTX_up_ref(options.tls);
+    }
+    if (kyros_get_internal_loop(loop)->uring) {
+        listener->socket.uring = true;
+        listener->poll.uring = (kyros_uring_io) { .loop = (uv_loop_t*)loop, .fd = (int)fd };
+        kyros_socket_uring_listen(listener);
+    } else {
+        uv_poll_init_socket((uv_loop_t*)loop, &listener->poll.poll, fd);
+        uv_poll_start(&listener->poll.poll, KYROS_SOCKET_READABLE, kyros_socket_listener_callback);
+    }
+    return kyros_socket_from_internal(&listener->socket);
+}
+
+uv_os_sock_t kyros_socket_listener_fd(kyros_socket socket)
+{
+    auto listener = (kyros_socket_internal_listener*)kyros_get_socket_internal(socket);
+    return kyros_socket_internal_fd(&listener->poll);
+}
+
+static void kyros_socket_close_listener(kyros_socket_internal_listener* listener)
+{
+    if (listener->socket.status == KYROS_SOCKET_STATE_CLOSED) {
+        return;
+    }
+    listener->socket.status = KYROS_SOCKET_STATE_CLOSED;
+    if (listener->socket.uring) {
+        auto uring = kyros_socket_get_uring(&listener->poll.uring);
+        if (listener->poll.uring.recv_armed) {
+            kyros_uring_cancel(uring, listener, KYROS_URING_ACCEPT);
+            // the accept keeps the port bound until the cancel, dont wait for the end of the iteration
+            kyros_uring_submit(uring);
+        }
+    } else {
+        uv_poll_stop(&listener->poll.poll);
+    }
+    kyros_bsd_close(kyros_socket_internal_fd(&listener->poll));
+    if (listener->handlers) {
+        listener->handlers->ref_count--;
+        listener->handlers = NULL;
+    }
+    if (listener->options.tls) {
+        SSL_CTX_free(listener->options.tls);
+        listener->options.tls = NULL;
+    }
+    if (listener->socket.uring) {
+        kyros_socket_internal_unref(&listener->socket);
+        return;
+    }
+    uv_close((uv_handle_t*)&listener->poll.poll, kyros_socket_poll_close_callback);
+}
+
+static_assert(offsetof(kyros_socket_internal_listener, poll) == offsetof(kyros_socket_internal_tcp, poll), "listeners share the poll close callback with tcp sockets");
+
+static inline bool kyros_socket_is_listener(kyros_socket socket)
+{
+    auto tag = kyros_get_socket_internal_tag(socket);
+    return tag == KYROS_SOCKET_TCP_LISTENER || tag == KYROS_SOCKET_TLS_LISTENER;
+}
+
+///
+/// Migration
+///
+
+// travels with kyros_loop_atomic_defer to the new loop, kept in the data of the poll/uring room meanwhile
+typedef struct {
+    kyros_socket_internal_tcp* socket;
+    kyros_loop* loop;
+    // NULL keeps the current handler
+    kyros_socket_handler* handler;
+    uv_os_sock_t fd;
+    // chunks of the queues, accounted in the write pool of the old loop until the attach
+    uint32_t chunks;
+    bool keep_alive;
+} kyros_socket_migration;
+
+static uint32_t kyros_write_queue_chunk_count(kyros_write_queue* queue)
+{
+    uint32_t count = 0;
+    for (auto chunk = queue->head; chunk; chunk = chunk->next) {
+        // shared chunks are not from the pool
+        count += !kyros_write_chunk_get_shared(chunk);
+    }
+    return count;
+}
+
+// runs in the new loop, the socket memory (tls SSL and queues included) is used as it is
+static void kyros_socket_migrate_attach(void* ctx)
+{
+    kyros_socket_migration* migration = ctx;
+    auto tcp = migration->socket;
+    auto loop = migration->loop;
+    tcp->socket.migrating = false;
+    if (tcp->socket.uring) {
+        // every operation completed, the stash and loop_unref stay
+        tcp->poll.uring.loop = (uv_loop_t*)loop;
+        tcp->poll.uring.data = NULL;
+    } else {
+        uv_poll_init_socket((uv_loop_t*)loop, &tcp->poll.poll, migration->fd);
+        tcp->socket.poll_events = 0;
+        if (!migration->keep_alive) {
+            uv_unref((uv_handle_t*)&tcp->poll.poll);
+        }
+    }
+    kyros_get_internal_loop(loop)->write_pool.in_use += migration->chunks;
+    if (migration->handler) {
+        migration->handler->ref_count++;
+        tcp->handlers = migration->handler;
+    }
+    kyros_free(migration);
+    kyros_socket_refresh_timeout(tcp);
+    kyros_socket_update_poll(tcp);
+    auto handler = tcp->handlers;
+    if (handler && handler->onmigrate) {
+        handler->onmigrate(kyros_socket_from_internal(&tcp->socket), loop, handler->ctx);
+    }
+}
+
+// last thing the old loop does with the socket
+static void kyros_socket_migrate_post(kyros_socket_internal_tcp* tcp)
+{
+    auto migration = (kyros_socket_migration*)(tcp->socket.uring ? tcp->poll.uring.data : tcp->poll.poll.data);
+    uint32_t chunks = tcp->write_queue ? kyros_write_queue_chunk_count(tcp->write_queue) : 0;
+    if (tcp->socket.uring) {
+        chunks += kyros_write_queue_chunk_count(&tcp->poll.uring.stash);
+    }
+    if (tcp->socket.tag == KYROS_SOCKET_TLS && ((kyros_socket_internal_tls*)tcp)->plaintext_queue) {
+        chunks += kyros_write_queue_chunk_count(((kyros_socket_internal_tls*)tcp)->plaintext_queue);
+    }
+    kyros_socket_get_write_pool(tcp)->in_use -= chunks;
+    migration->chunks = chunks;
+    if (migration->handler && tcp->handlers) {
+        // handler refs are not atomic, each loop counts its own
+        tcp->handlers->ref_count--;
+    }
+    kyros_loop_atomic_defer(migration->loop, kyros_socket_migrate_attach, migration);
+}
+
+static void kyros_socket_migrate_close_callback(uv_handle_t* handle)
+{
+    auto poll = kyros_container_of((uv_poll_t*)handle, kyros_socket_internal_poll, poll);
+    auto tcp = kyros_container_of(poll, kyros_socket_internal_tcp, poll);
+    if (tcp->socket.status == KYROS_SOCKET_STATE_CLOSED) {
+        // closed in the same iteration it was migrated, it never leaves
+        kyros_free(handle->data);
+        kyros_socket_internal_unref(&tcp->socket);
+        return;
+    }
+    kyros_socket_migrate_post(tcp);
+}
+
+bool kyros_socket_migrate(kyros_socket socket, kyros_loop* loop, kyros_socket_handler* handler)
+{
+    auto tag = kyros_get_socket_internal_tag(socket);
+    if (tag != KYROS_SOCKET_TCP && tag != KYROS_SOCKET_TLS) {
+        return false;
+    }
+    auto tcp = kyros_get_socket_internal_tcp(socket);
+    KYROS_SOCKET_STATUS status = tcp->socket.status;
+    if (!tcp->socket.has_poll || status == KYROS_SOCKET_STATE_CONNECTING || status == KYROS_SOCKET_STATE_CLOSED || tcp->socket.migrating || tcp->socket.has_pipe_link
+        || tcp->socket.file_reading) {
+        return false;
+    }
+    auto current = kyros_socket_internal_get_loop(tcp);
+    // the poll/uring room is reused as it is, io_uring leftovers (stash) can't be handed to a poll loop
+    if (current == loop || kyros_loop_get_io_engine(current) != kyros_loop_get_io_engine(loop)) {
+        return false;
+    }
+    if (tcp->cork && !kyros_socket_flush_cork(tcp, NULL, 0)) {
+        return false;
+    }
+    kyros_timer_wheel_remove(kyros_socket_get_timer_wheel(tcp), &tcp->timeout_entry);
+    auto migration = (kyros_socket_migration*)kyros_alloc(sizeof(kyros_socket_migration));
+    *migration = (kyros_socket_migration) { .socket = tcp, .loop = loop, .handler = handler };
+    tcp->socket.migrating = true;
+    if (tcp->socket.uring) {
+        auto io = &tcp->poll.uring;
+        io->data = migration;
+        // cancels the recv, no new operation is armed, the last completion posts it
+        kyros_socket_uring_update(tcp);
+        if (!io->inflight) {
+            kyros_socket_migrate_post(tcp);
+        }
+        return true;
+    }
+    migration->fd = kyros_socket_internal_fd(&tcp->poll);
+    migration->keep_alive = uv_has_ref((uv_handle_t*)&tcp->poll.poll);
+    uv_poll_stop(&tcp->poll.poll);
+    tcp->poll.poll.data = migration;
+    // the fd stays open, only the handle of the old loop goes away
+    uv_close((uv_handle_t*)&tcp->poll.poll, kyros_socket_migrate_close_callback);
+    return true;
+}
+
+bool kyros_socket_internal_is_reusable(kyros_socket_internal_tcp* tcp)
+{
+    KYROS_SOCKET_STATUS status = tcp->socket.status;
+    if ((status != KYROS_SOCKET_STATE_OPEN && status != KYROS_SOCKET_STATE_SECURE) || !tcp->socket.has_poll || tcp->socket.migrating || kyros_socket_queued(tcp)) {
+        return false;
+    }
+    if (tcp->socket.uring && tcp->poll.uring.stash.length) {
+        return false;
+    }
+    if (tcp->socket.tag == KYROS_SOCKET_TLS) {
+        auto plaintext_queue = ((kyros_socket_internal_tls*)tcp)->plaintext_queue;
+        if (plaintext_queue && plaintext_queue->length) {
+            return false;
+        }
+    }
+    // a FIN (or bytes nobody asked for) the loop did not read yet
+    char byte;
+    auto read = kyros_bsd_peek(kyros_socket_internal_fd(&tcp->poll), &byte, 1);
+    if (read < 0) {
+        return kyros_bsd_would_block(kyros_bsd_errno());
+    }
+    // tls records can be session tickets, a close_notify is seen by the next read
+    return read > 0 && tcp->socket.tag == KYROS_SOCKET_TLS;
+}
+
+///
+/// Public API
+///
+
+SSL* kyros_socket_get_ssl(kyros_socket socket)
+{
+    if (kyros_get_socket_internal_tag(socket) != KYROS_SOCKET_TLS) {
+        return NULL;
+    }
+    return ((kyros_socket_internal_tls*)kyros_get_socket_internal(socket))->ssl;
+}
+
+SSL_CTX* kyros_socket_get_ctx(kyros_socket socket)
+{
+    auto tag = kyros_get_socket_internal_tag(socket);
+    if (tag == KYROS_SOCKET_TLS_LISTENER) {
+        return ((kyros_socket_internal_listener*)kyros_get_socket_internal(socket))->options.tls;
+    }
+    auto ssl = kyros_socket_get_ssl(socket);
+    return ssl ? SSL_get_SSL_CTX(ssl) : NULL;
+}
+
+kyros_socket_state kyros_socket_get_state(kyros_socket socket)
+{
+    return kyros_get_socket_internal(socket)->status;
+}
+
+kyros_loop* kyros_socket_get_loop(kyros_socket socket)
+{
+    if (kyros_socket_is_listener(socket)) {
+        return (kyros_loop*)((kyros_socket_internal_listener*)kyros_get_socket_internal(socket))->poll.poll.loop;
+    }
+    return kyros_socket_internal_get_loop(kyros_get_socket_internal_tcp(socket));
+}
+
+bool kyros_socket_is_readable(kyros_socket socket)
+{
+    return kyros_socket_status_is_readable(kyros_socket_get_state(socket));
+}
+
+bool kyros_socket_is_writable(kyros_socket socket)
+{
+    return kyros_socket_status_is_writable(kyros_socket_get_state(socket));
+}
+
+bool kyros_socket_is_closed(kyros_socket socket)
+{
+    return kyros_socket_get_state(socket) == KYROS_SOCKET_STATE_CLOSED;
+}
+
+bool kyros_socket_is_secure(kyros_socket socket)
+{
+    return kyros_socket_get_state(socket) == KYROS_SOCKET_STATE_SECURE;
+}
+
+bool kyros_socket_is_kernel_tls(kyros_socket socket)
+{
+    return kyros_get_socket_internal(socket)->ktls_tx;
+}
+
+bool kyros_socket_is_open(kyros_socket socket)
+{
+    auto state = kyros_socket_get_state(socket);
+    return state != KYROS_SOCKET_STATE_CONNECTING && state != KYROS_SOCKET_STATE_CLOSED;
+}
+
+bool kyros_socket_is_connecting(kyros_socket socket)
+{
+    return kyros_socket_get_state(socket) == KYROS_SOCKET_STATE_CONNECTING;
+}
+
+static inline bool kyros_socket_is_udp(kyros_socket socket)
+{
+    return kyros_get_socket_internal_tag(socket) == KYROS_SOCKET_UDP;
+}
+
+static inline kyros_socket_internal_udp* kyros_get_socket_internal_udp(kyros_socket socket)
+{
+    return (kyros_socket_internal_udp*)kyros_get_socket_internal(socket);
+}
+
+void kyros_socket_pause(kyros_socket socket)
+{
+    if (kyros_socket_is_udp(socket)) {
+        auto udp = kyros_get_socket_internal_udp(socket);
+        udp->socket.is_paused = true;
+        kyros_udp_update_poll(udp);
+        return;
+    }
+    auto tcp = kyros_get_socket_internal_tcp(socket);
+    tcp->socket.is_paused = true;
+    kyros_socket_update_poll(tcp);
+}
+
+void kyros_socket_resume(kyros_socket socket)
+{
+    if (kyros_socket_is_udp(socket)) {
+        auto udp = kyros_get_socket_internal_udp(socket);
+        udp->socket.is_paused = false;
+        kyros_udp_update_poll(udp);
+        return;
+    }
+    auto tcp = kyros_get_socket_internal_tcp(socket);
+    tcp->socket.is_paused = false;
+    kyros_socket_update_poll(tcp);
+}
+
+bool kyros_socket_is_paused(kyros_socket socket)
+{
+    return kyros_get_socket_internal(socket)->is_paused;
+}
+
+uint64_t kyros_socket_flush(kyros_socket socket)
+{
+    if (kyros_socket_is_udp(socket)) {
+        auto udp = kyros_get_socket_internal_udp(socket);
+        kyros_udp_flush(udp);
+        return kyros_udp_buffer_size(udp);
+    }
+    auto tcp = kyros_get_socket_internal_tcp(socket);
+    if (tcp->cork && !kyros_socket_flush_cork(tcp, NULL, 0)) {
+        return 0;
+    }
+    if (kyros_socket_status_is_writable(tcp->socket.status)) {
+        kyros_socket_internal_flush(tcp);
+    }
+    return kyros_socket_buffer_size(socket);
+}
+
+uint64_t kyros_socket_buffer_size(kyros_socket socket)
+{
+    if (kyros_socket_is_udp(socket)) {
+        return kyros_udp_buffer_size(kyros_get_socket_internal_udp(socket));
+    }
+    return kyros_socket_buffered(kyros_get_socket_internal_tcp(socket));
+}
+
+void kyros_socket_ref(kyros_socket socket)
+{
+    kyros_socket_internal_ref(kyros_get_socket_internal(socket));
+}
+
+void kyros_socket_unref(kyros_socket socket)
+{
+    kyros_socket_internal_unref(kyros_get_socket_internal(socket));
+}
+
+bool kyros_socket_write(kyros_socket socket, const char* buffer, uint64_t size, bool end)
+{
+    if (kyros_socket_is_udp(socket)) {
+        // one datagram to the connected peer, there is no end to send
+        return size <= UINT32_MAX && kyros_udp_send(kyros_get_socket_internal_udp(socket), buffer, (uint32_t)size, NULL);
+    }
+    auto tcp = kyros_get_socket_internal_tcp(socket);
+    if (tcp->socket.tag == KYROS_SOCKET_TLS) {
+        return kyros_tls_write((kyros_socket_internal_tls*)tcp, buffer, size, end);
+    }
+    return kyros_socket_internal_write(tcp, buffer, size, end);
+}
+
+bool kyros_socket_write_shared(kyros_socket socket, kyros_shared_buffer* buffer, const char* data, uint64_t length)
+{
+    if (kyros_socket_is_udp(socket)) {
+        return kyros_socket_write(socket, data, length, false);
+    }
+    auto tcp = kyros_get_socket_internal_tcp(socket);
+    if (tcp->socket.tag == KYROS_SOCKET_TLS) {
+        return kyros_tls_write_shared((kyros_socket_internal_tls*)tcp, buffer, data, length);
+    }
+    return kyros_socket_internal_write_shared(tcp, buffer, data, length);
+}
+
+bool kyros_socket_write4(kyros_socket socket, int fd, uint64_t offset, uint64_t length, bool end)
+{
+    if (kyros_socket_is_udp(socket)) {
+        return false;
+    }
+    auto tcp = kyros_get_socket_internal_tcp(socket);
+    if (!length) {
+        uv_fs_t request;
+        auto result = uv_fs_fstat(NULL, &request, fd, NULL);
+        uint64_t size = request.statbuf.st_size;
+        uv_fs_req_cleanup(&request);
+        if (result < 0) {
+            return false;
+        }
+        length = size > offset ? size - offset : 0;
+    }
+    if (tcp->socket.tag == KYROS_SOCKET_TLS) {
+        return kyros_tls_write_file((kyros_socket_internal_tls*)tcp, fd, offset, length, end);
+    }
+    return kyros_socket_internal_write_file(tcp, fd, offset, length, end);
+}
+
+void kyros_socket_close(kyros_socket socket)
+{
+    if (kyros_socket_is_listener(socket)) {
+        kyros_socket_close_listener((kyros_socket_internal_listener*)kyros_get_socket_internal(socket));
+        return;
+    }
+    if (kyros_socket_is_udp(socket)) {
+        kyros_udp_close(kyros_get_socket_internal_udp(socket));
+        return;
+    }
+    kyros_socket_close_with_error(kyros_get_socket_internal_tcp(socket), kyros_socket_no_error());
+}
+
+void kyros_socket_keepalive_loop(kyros_socket socket, bool keep_alive)
+{
+    auto tcp = kyros_get_socket_internal_tcp(socket);
+    if (!tcp->socket.has_poll) {
+        return;
+    }
+    if (tcp->socket.uring) {
+        auto io = &tcp->poll.uring;
+        if (io->loop_unref != !keep_alive) {
+            io->loop_unref = !keep_alive;
+            // operations already in the kernel follow
+            kyros_uring_keep_alive(kyros_socket_get_uring(io), keep_alive ? (int32_t)io->inflight : -(int32_t)io->inflight);
+        }
+        return;
+    }
+    if (keep_alive) {
+        uv_ref((uv_handle_t*)&tcp->poll.poll);
+    } else {
+        uv_unref((uv_handle_t*)&tcp->poll.poll);
+    }
+}
+
+void kyros_socket_nodelay(kyros_socket socket, bool nodelay)
+{
+    auto tcp = kyros_get_socket_internal_tcp(socket);
+    if (tcp->socket.has_poll && !kyros_socket_is_udp(socket)) {
+        kyros_bsd_set_nodelay(kyros_socket_internal_fd(&tcp->poll), nodelay);
+    }
+}
 
+void kyros_socket_keepalive(kyros_socket socket, bool keep_alive)
+{
+    auto tcp = kyros_get_socket_internal_tcp(socket);
+    if (tcp->socket.has_poll && !kyros_socket_is_udp(socket)) {
+        kyros_bsd_set_keepalive(kyros_socket_internal_fd(&tcp->poll), keep_alive, 0);
+    }
 }
-void kyros_socket_timeout(kyros_socket socket, uint32_t timeout) {
 
+void kyros_socket_timeout(kyros_socket socket, uint32_t timeout)
+{
+    if (kyros_socket_is_udp(socket)) {
+        return;
+    }
+    auto tcp = kyros_get_socket_internal_tcp(socket);
+    tcp->timeout = timeout;
+    if (timeout) {
+        kyros_timer_wheel_insert(kyros_socket_get_timer_wheel(tcp), &tcp->timeout_entry, timeout);
+    } else {
+        kyros_timer_wheel_remove(kyros_socket_get_timer_wheel(tcp), &tcp->timeout_entry);
+    }
 }
 
 // kyros_socket_write2(socket, origin_socket, end); // end = true close the writable side of the socket
 // kyros_socket_write3(socket, origin_duplex, end);
-// kyros_socket_write4(socket, fd, end); // may optimize sendfile / SSL_sendfile (or not)
 
-// kyros_socket_pipe(socket, dst_socket, end: bool);
 // kyros_socket_pipe2(socket, dst_duplex, end: bool); //end = true close the writable side of the dst
-// kyros_socket_pipe3(socket, fd, end: bool);
-// kyros_socket_unpipe(socket);
-
-//  kyros_socket_is_readable(socket) // readable side is open
-//  kyros_socket_is_writable(socket) // writable side is open
-//  kyros_socket_is_closed(socket)  // is closed
-//  kyros_socket_is_secure(socket) // tls handshake ok
-//  kyros_socket_is_open(socket) // opened/connected
-//  kytos_socket_is_connecting(socket) // connecting
- // const state =  kyros_socket_get_state(socket);
- // state == .connecting
- // state == .open
- // state == .secure
- // state == .redable_ended,
- // state == .writeble_ended,
- // state == .closed
@@ -0,0 +1,761 @@
+#include <kyros.h>
+#include <kyros_internal.h>
+
+#include <string.h>
+
+static void kyros_socket_pool_start(kyros_socket_pool* pool, kyros_socket_pool_endpoint* endpoint, kyros_socket_pool_request checkout);
+
+static inline kyros_socket_error kyros_socket_pool_error(int uv_error)
+{
+    return kyros_socket_uv_error(KYROS_SOCKET_ERROR_CONNECTING_ERROR, uv_error);
+}
+
+static inline kyros_socket_internal_tcp* kyros_socket_pool_get_tcp(kyros_socket socket)
+{
+    return (kyros_socket_internal_tcp*)kyros_get_socket_internal(socket);
+}
+
+static inline uint32_t kyros_socket_pool_bucket(kyros_socket_pool_endpoint* endpoint)
+{
+    return (uint32_t)endpoint->hash & (KYROS_SOCKET_POOL_STEAL_BUCKETS - 1);
+}
+
+/// @brief frees a destroyed pool once nothing refers to it anymore
+static void kyros_socket_pool_try_free(kyros_socket_pool* pool)
+{
+    if (!pool->destroyed || pool->connections) {
+        return;
+    }
+    kyros_free(pool->endpoints);
+    kyros_free(pool);
+}
+
+///
+/// Endpoints
+///
+
+// FNV-1a of the host, the rest of the key is mixed in after it
+static uint64_t kyros_socket_pool_hash(const char* host, uint32_t host_length, uint16_t port, kyros_socket_ip_family family, SSL_CTX* tls)
+{
+    uint64_t hash = 14695981039346656037ull;
+    for (uint32_t i = 0; i < host_length; i++) {
+        hash = (hash ^ (uint8_t)host[i]) * 1099511628211ull;
+    }
+    hash = (hash ^ ((uint64_t)port << 8 | (uint64_t)family)) * 1099511628211ull;
+    hash = (hash ^ (uint64_t)(uintptr_t)tls) * 1099511628211ull;
+    return hash ^ (hash >> 29);
+}
+
+static kyros_socket_pool_endpoint* kyros_socket_pool_find(kyros_socket_pool* pool, uint64_t hash, const char* host, uint32_t host_length, uint16_t port,
+    kyros_socket_ip_family family, SSL_CTX* tls)
+{
+    for (auto endpoint = pool->endpoints[hash & pool->endpoint_mask]; endpoint; endpoint = endpoint->next) {
+        if (endpoint->hash == hash && endpoint->port == port && endpoint->family == family && endpoint->tls == tls && endpoint->host_length == host_length
+            && !memcmp(endpoint->host, host, host_length)) {
+            return endpoint;
+        }
+    }
+    return NULL;
+}
+
+static kyros_socket_pool_endpoint* kyros_socket_pool_insert(kyros_socket_pool* pool, uint64_t hash, const char* host, uint32_t host_length, uint16_t port,
+    kyros_socket_ip_family family, SSL_CTX* tls)
+{
+    if (pool->endpoint_count > pool->endpoint_mask) {
+        // one endpoint per bucket on average
+        auto capacity = (pool->endpoint_mask + 1) * 2;
+        auto endpoints = (kyros_socket_pool_endpoint**)kyros_calloc(capacity, sizeof(kyros_socket_pool_endpoint*));
+        for (uint32_t i = 0; i <= pool->endpoint_mask; i++) {
+            auto endpoint = pool->endpoints[i];
+            while (endpoint) {
+                auto next = endpoint->next;
+                auto bucket = &endpoints[endpoint->hash & (capacity - 1)];
+                endpoint->next = *bucket;
+                *bucket = endpoint;
+                endpoint = next;
+            }
+        }
+        kyros_free(pool->endpoints);
+        pool->endpoints = endpoints;
+        pool->endpoint_mask = capacity - 1;
+    }
+    auto endpoint = (kyros_socket_pool_endpoint*)kyros_alloc(sizeof(kyros_socket_pool_endpoint) + host_length + 1);
+    *endpoint = (kyros_socket_pool_endpoint) {
+        .hash = hash,
+        .tls = tls,
+        .port = port,
+        .family = family,
+        .host_length = host_length,
+    };
+    memcpy(endpoint->host, host, host_length);
+    endpoint->host[host_length] = 0;
+    auto bucket = &pool->endpoints[hash & pool->endpoint_mask];
+    endpoint->next = *bucket;
+    *bucket = endpoint;
+    pool->endpoint_count++;
+    return endpoint;
+}
+
+/// @brief forget endpoint once it has no connection and no checkout waiting
+static void kyros_socket_pool_release_endpoint(kyros_socket_pool* pool, kyros_socket_pool_endpoint* endpoint)
+{
+    if (endpoint->total || endpoint->waiters_head) {
+        return;
+    }
+    auto link = &pool->endpoints[endpoint->hash & pool->endpoint_mask];
+    while (*link != endpoint) {
+        link = &(*link)->next;
+    }
+    *link = endpoint->next;
+    pool->endpoint_count--;
+    kyros_free(endpoint);
+}
+
+/// @brief a connection of endpoint closed (or was given away), the oldest waiting checkout takes its place
+static void kyros_socket_pool_serve(kyros_socket_pool* pool, kyros_socket_pool_endpoint* endpoint)
+{
+    auto waiter = endpoint->waiters_head;
+    if (!waiter || pool->destroyed || endpoint->total >= pool->options.max_per_host) {
+        kyros_socket_pool_release_endpoint(pool, endpoint);
+        return;
+    }
+    endpoint->waiters_head = waiter->next;
+    if (!endpoint->waiters_head) {
+        endpoint->waiters_tail = NULL;
+    }
+    auto checkout = *waiter;
+    kyros_free(waiter);
+    endpoint->total++;
+    kyros_socket_pool_start(pool, endpoint, checkout);
+}
+
+///
+/// Connections
+///
+
+static void kyros_socket_pool_idle_push(kyros_socket_pool* pool, kyros_socket_pool_connection* connection)
+{
+    auto endpoint = connection->endpoint;
+    connection->state = KYROS_SOCKET_POOL_IDLE;
+    connection->prev = NULL;
+    connection->next = endpoint->idle;
+    if (endpoint->idle) {
+        endpoint->idle->prev = connection;
+    }
+    endpoint->idle = connection;
+    endpoint->idle_count++;
+    pool->idle_count++;
+    if (pool->slot) {
+        atomic_fetch_add_explicit(&pool->slot->idle[kyros_socket_pool_bucket(endpoint)], 1, memory_order_relaxed);
+    }
+}
+
+static void kyros_socket_pool_idle_remove(kyros_socket_pool* pool, kyros_socket_pool_connection* connection)
+{
+    auto endpoint = connection->endpoint;
+    if (connection->prev) {
+        connection->prev->next = connection->next;
+    } else {
+        endpoint->idle = connection->next;
+    }
+    if (connection->next) {
+        connection->next->prev = connection->prev;
+    }
+    connection->prev = NULL;
+    connection->next = NULL;
+    endpoint->idle_count--;
+    pool->idle_count--;
+    if (pool->slot) {
+        atomic_fetch_sub_explicit(&pool->slot->idle[kyros_socket_pool_bucket(endpoint)], 1, memory_order_relaxed);
+    }
+}
+
+/// @brief most recently released idle connection of endpoint that passes the health check (out of the idle list), the others are closed
+/// the caller holds endpoint (total counts it) so closing its last idle connection can't release it
+static kyros_socket_pool_connection* kyros_socket_pool_pop_idle(kyros_socket_pool* pool, kyros_socket_pool_endpoint* endpoint)
+{
+    while (endpoint->idle) {
+        auto connection = endpoint->idle;
+        if (kyros_socket_internal_is_reusable(kyros_socket_pool_get_tcp(connection->socket))) {
+            kyros_socket_pool_idle_remove(pool, connection);
+            return connection;
+        }
+        // onstatus counts it and takes it out of the idle list
+        kyros_socket_close(connection->socket);
+    }
+    return NULL;
+}
+
+/// @brief the handler kyros_socket_close_with_error releases once the connection leaves the pool, under the pipe link if piped
+static void kyros_socket_pool_detach(kyros_socket_internal_tcp* tcp, kyros_socket_handler* handler)
+{
+    tcp->socket.pooled = false;
+    if (tcp->socket.has_pipe_link) {
+        kyros_container_of(tcp->handlers, kyros_socket_pipe_link, handler)->original = handler;
+        return;
+    }
+    tcp->handlers = handler;
+}
+
+/// @brief the socket of connection closed, its endpoint can take a waiting checkout
+static void kyros_socket_pool_closed(kyros_socket_pool_connection* connection)
+{
+    auto pool = connection->pool;
+    auto endpoint = connection->endpoint;
+    kyros_free(connection);
+    endpoint->total--;
+    pool->connections--;
+    kyros_socket_pool_serve(pool, endpoint);
+    kyros_socket_pool_try_free(pool);
+}
+
+static void kyros_socket_pool_hand_out(kyros_socket_pool_connection* connection)
+{
+    auto checkout = connection->checkout;
+    connection->state = KYROS_SOCKET_POOL_IN_USE;
+    if (checkout.handler) {
+        checkout.handler->ref_count++;
+    }
+    kyros_socket_timeout(connection->socket, connection->pool->options.socket_options.timeout);
+    kyros_socket_keepalive_loop(connection->socket, true);
+    checkout.callback(connection->socket, (kyros_socket_error) { .type = KYROS_SOCKET_ERROR_NO_ERROR }, checkout.ctx);
+}
+
+static bool kyros_socket_pool_connection_ondata(kyros_socket socket, const char* data, uint64_t length, void* ctx)
+{
+    kyros_socket_pool_connection* connection = ctx;
+    if (connection->state == KYROS_SOCKET_POOL_IDLE) {
+        // nobody asked for it, the connection can't be trusted anymore
+        return false;
+    }
+    auto handler = connection->checkout.handler;
+    if (connection->state == KYROS_SOCKET_POOL_IN_USE && handler && handler->ondata) {
+        return handler->ondata(socket, data, length, handler->ctx);
+    }
+    return true;
+}
+
+static bool kyros_socket_pool_connection_ontimeout(kyros_socket socket, void* ctx)
+{
+    kyros_socket_pool_connection* connection = ctx;
+    if (connection->state == KYROS_SOCKET_POOL_IDLE) {
+        connection->pool->stats.evicted++;
+        connection->closing = true;
+        return true;
+    }
+    auto handler = connection->checkout.handler;
+    if (connection->state == KYROS_SOCKET_POOL_IN_USE && handler && handler->ontimeout) {
+        return handler->ontimeout(socket, handler->ctx);
+    }
+    return true;
+}
+
+static void kyros_socket_pool_connection_ondrain(kyros_socket socket, void* ctx)
+{
+    kyros_socket_pool_connection* connection = ctx;
+    auto handler = connection->checkout.handler;
+    if (connection->state == KYROS_SOCKET_POOL_IN_USE && handler && handler->ondrain) {
+        handler->ondrain(socket, handler->ctx);
+    }
+}
+
+static void kyros_socket_pool_steal_miss_task(void* ctx);
+static void kyros_socket_pool_steal_settle(kyros_socket_pool_steal* steal);
+
+static void kyros_socket_pool_connection_onstatus(kyros_socket socket, kyros_socket_error error, void* ctx)
+{
+    kyros_socket_pool_connection* connection = ctx;
+    auto tcp = kyros_socket_pool_get_tcp(socket);
+    KYROS_SOCKET_STATUS status = tcp->socket.status;
+    switch (connection->state) {
+    case KYROS_SOCKET_POOL_CONNECTING: {
+        // tls connections are handed out once the handshake is done
+        if (status == KYROS_SOCKET_STATE_SECURE || (status == KYROS_SOCKET_STATE_OPEN && tcp->socket.tag == KYROS_SOCKET_TCP)) {
+            kyros_socket_pool_hand_out(connection);
+            return;
+        }
+        if (status != KYROS_SOCKET_STATE_CLOSED) {
+            return;
+        }
+        auto checkout = connection->checkout;
+        kyros_socket_pool_detach(tcp, NULL);
+        kyros_socket_pool_closed(connection);
+        checkout.callback((kyros_socket) { 0 }, error, checkout.ctx);
+        return;
+    }
+    case KYROS_SOCKET_POOL_IN_USE: {
+        auto handler = connection->checkout.handler;
+        if (handler && handler->onstatus) {
+            handler->onstatus(socket, error, handler->ctx);
+        }
+        if (status == KYROS_SOCKET_STATE_CLOSED) {
+            // the checkout handler ref is released by the close
+            kyros_socket_pool_detach(tcp, handler);
+            kyros_socket_pool_closed(connection);
+        }
+        return;
+    }
+    case KYROS_SOCKET_POOL_IDLE:
+        if (status == KYROS_SOCKET_STATE_CLOSED) {
+            if (!connection->closing) {
+                connection->pool->stats.unhealthy++;
+            }
+            kyros_socket_pool_idle_remove(connection->pool, connection);
+            kyros_socket_pool_detach(tcp, NULL);
+            kyros_socket_pool_closed(connection);
+        } else if (status == KYROS_SOCKET_STATE_READABLE_ENDED || status == KYROS_SOCKET_STATE_WRITABLE_ENDED) {
+            kyros_socket_close(socket);
+        }
+        return;
+    case KYROS_SOCKET_POOL_STOLEN:
+        if (status == KYROS_SOCKET_STATE_CLOSED) {
+            // closed before it left this loop, the asking pool connects instead
+            auto steal = connection->steal;
+            kyros_socket_pool_detach(tcp, NULL);
+            kyros_free(connection);
+            kyros_loop_atomic_defer(steal->loop, kyros_socket_pool_steal_miss_task, steal);
+        }
+        return;
+    }
+}
+
+static void kyros_socket_pool_connection_onmigrate(kyros_socket socket, kyros_loop* loop, void* ctx)
+{
+    kyros_socket_pool_connection* connection = ctx;
+    if (connection->state != KYROS_SOCKET_POOL_STOLEN) {
+        auto handler = connection->checkout.handler;
+        if (handler && handler->onmigrate) {
+            handler->onmigrate(socket, loop, handler->ctx);
+        }
+        return;
+    }
+    // in the loop of the pool that asked for it, the reserved place in its endpoint becomes this connection
+    auto steal = connection->steal;
+    auto pool = steal->pool;
+    if (!pool) {
+        // too late, the checkout connected (or failed with its pool) meanwhile
+        kyros_free(steal);
+        kyros_socket_pool_detach(kyros_socket_pool_get_tcp(socket), NULL);
+        kyros_free(connection);
+        kyros_socket_close(socket);
+        return;
+    }
+    connection->pool = pool;
+    connection->endpoint = steal->endpoint;
+    connection->checkout = steal->checkout;
+    connection->steal = NULL;
+    kyros_socket_pool_steal_settle(steal);
+    kyros_free(steal);
+    pool->connections++;
+    pool->stats.stolen++;
+    kyros_socket_pool_hand_out(connection);
+}
+
+/// @brief new connection for checkout, endpoint already counts it
+static void kyros_socket_pool_connect(kyros_socket_pool* pool, kyros_socket_pool_endpoint* endpoint, kyros_socket_pool_request checkout)
+{
+    auto connection = (kyros_socket_pool_connection*)kyros_alloc(sizeof(kyros_socket_pool_connection));
+    *connection = (kyros_socket_pool_connection) {
+        .handler = {
+            .ctx = connection,
+            .ondata = kyros_socket_pool_connection_ondata,
+            .ontimeout = kyros_socket_pool_connection_ontimeout,
+            .ondrain = kyros_socket_pool_connection_ondrain,
+            .onstatus = kyros_socket_pool_connection_onstatus,
+            .onmigrate = kyros_socket_pool_connection_onmigrate,
+            .ref_count = 1,
+        },
+        .pool = pool,
+        .endpoint = endpoint,
+        .checkout = checkout,
+        .state = KYROS_SOCKET_POOL_CONNECTING,
+    };
+    pool->connections++;
+    pool->stats.connected++;
+    auto options = pool->options.socket_options;
+    options.tls = endpoint->tls;
+    kyros_socket_source source = {
+        .type = KYROS_SOCKET_SOURCE_HOSTPORT,
+        .value.host_port = {
+            .host = endpoint->host,
+            .port = endpoint->port,
+            .family = endpoint->family,
+            .use_happy_eyeballs = checkout.use_happy_eyeballs,
+        },
+    };
+    // errors are reported by onstatus on the next tick, the socket is set before
+    connection->socket = kyros_socket_connect(pool->loop, source, options, &connection->handler);
+    kyros_get_socket_internal(connection->socket)->pooled = true;
+}
+
+///
+/// Stealing
+///
+
+/// @brief the checkout of steal stops waiting for the answer, which only frees it when it comes
+static void kyros_socket_pool_steal_settle(kyros_socket_pool_steal* steal)
+{
+    auto pool = steal->pool;
+    if (steal->prev) {
+        steal->prev->next = steal->next;
+    } else {
+        pool->steals = steal->next;
+    }
+    if (steal->next) {
+        steal->next->prev = steal->prev;
+    }
+    kyros_timer_unref(steal->timer);
+    steal->timer = NULL;
+    steal->pool = NULL;
+}
+
+// in the loop of the asking pool, the other pool had nothing to give
+static void kyros_socket_pool_steal_miss_task(void* ctx)
+{
+    kyros_socket_pool_steal* steal = ctx;
+    auto pool = steal->pool;
+    if (pool) {
+        auto endpoint = steal->endpoint;
+        auto checkout = steal->checkout;
+        kyros_socket_pool_steal_settle(steal);
+        kyros_socket_pool_connect(pool, endpoint, checkout);
+    }
+    kyros_free(steal);
+}
+
+// in the loop of the asking pool, the other loop did not answer in time (busy or stopped)
+static void kyros_socket_pool_steal_timeout(void* ctx)
+{
+    kyros_socket_pool_steal* steal = ctx;
+    auto pool = steal->pool;
+    auto endpoint = steal->endpoint;
+    auto checkout = steal->checkout;
+    kyros_socket_pool_steal_settle(steal);
+    kyros_socket_pool_connect(pool, endpoint, checkout);
+}
+
+// in the loop of the pool that was asked, the idle connection (if any) goes to the asking loop with kyros_socket_migrate
+static void kyros_socket_pool_steal_task(void* ctx)
+{
+    kyros_socket_pool_steal* steal = ctx;
+    auto slot = steal->slot;
+    // the pool can only leave its slot in this thread, if the generation still matches it is alive
+    auto pool = atomic_load_explicit(&slot->generation, memory_order_acquire) == steal->generation
+        ? atomic_load_explicit(&slot->pool, memory_order_acquire)
+        : NULL;
+    kyros_socket_pool_connection* connection = NULL;
+    kyros_socket_pool_endpoint* endpoint = NULL;
+    if (pool) {
+        endpoint = kyros_socket_pool_find(pool, steal->hash, steal->host, steal->host_length, steal->port, steal->family, steal->tls);
+    }
+    if (endpoint) {
+        endpoint->total++;
+        connection = kyros_socket_pool_pop_idle(pool, endpoint);
+        endpoint->total -= connection ? 2 : 1;
+        if (connection) {
+            pool->connections--;
+            pool->stats.given++;
+        }
+        kyros_socket_pool_serve(pool, endpoint);
+    }
+    if (!connection) {
+        kyros_loop_atomic_defer(steal->loop, kyros_socket_pool_steal_miss_task, steal);
+        return;
+    }
+    connection->state = KYROS_SOCKET_POOL_STOLEN;
+    connection->steal = steal;
+    connection->pool = NULL;
+    connection->endpoint = NULL;
+    if (!kyros_socket_migrate(connection->socket, steal->loop, &connection->handler)) {
+        // onstatus sends the miss
+        kyros_socket_close(connection->socket);
+    }
+}
+
+/// @brief ask the first other pool of the group that has idle connections in the bucket of endpoint, false if none has
+static bool kyros_socket_pool_try_steal(kyros_socket_pool* pool, kyros_socket_pool_endpoint* endpoint, kyros_socket_pool_request checkout)
+{
+    if (!pool->slot) {
+        return false;
+    }
+    auto slots = pool->options.group->slots;
+    uint32_t index = (uint32_t)(pool->slot - slots);
+    auto bucket = kyros_socket_pool_bucket(endpoint);
+    uint32_t io_engine = kyros_loop_get_io_engine(pool->loop);
+    for (uint32_t i = 1; i < KYROS_SOCKET_POOL_GROUP_SIZE; i++) {
+        auto slot = &slots[(index + i) % KYROS_SOCKET_POOL_GROUP_SIZE];
+        auto generation = atomic_load_explicit(&slot->generation, memory_order_acquire);
+        if (!(generation & 1) || !atomic_load_explicit(&slot->idle[bucket], memory_order_relaxed)
+            || !atomic_load_explicit(&slot->pool, memory_order_acquire)) {
+            continue;
+        }
+        auto loop = atomic_load_explicit(&slot->loop, memory_order_relaxed);
+        // kyros_socket_migrate can't move a socket between engines (or to the same loop)
+        if (loop == pool->loop || atomic_load_explicit(&slot->io_engine, memory_order_relaxed) != io_engine) {
+            continue;
+        }
+        auto steal = (kyros_socket_pool_steal*)kyros_alloc(sizeof(kyros_socket_pool_steal) + endpoint->host_length + 1);
+        *steal = (kyros_socket_pool_steal) {
+            .pool = pool,
+            .endpoint = endpoint,
+            .checkout = checkout,
+            .next = pool->steals,
+            .loop = pool->loop,
+            .slot = slot,
+            .generation = generation,
+            .hash = endpoint->hash,
+            .tls = endpoint->tls,
+            .port = endpoint->port,
+            .family = endpoint->family,
+            .host_length = endpoint->host_length,
+        };
+        memcpy(steal->host, endpoint->host, endpoint->host_length + 1);
+        if (pool->steals) {
+            pool->steals->prev = steal;
+        }
+        pool->steals = steal;
+        // a stopped (or busy) loop can't keep the checkout waiting
+        steal->timer = kyros_loop_timer(pool->loop, kyros_socket_pool_steal_timeout, steal, pool->options.steal_timeout, 0, true);
+        kyros_loop_atomic_defer(loop, kyros_socket_pool_steal_task, steal);
+        return true;
+    }
+    return false;
+}
+
+/// @brief connection for checkout without an idle one at hand, endpoint already counts it
+static void kyros_socket_pool_start(kyros_socket_pool* pool, kyros_socket_pool_endpoint* endpoint, kyros_socket_pool_request checkout)
+{
+    if (!kyros_socket_pool_try_steal(pool, endpoint, checkout)) {
+        kyros_socket_pool_connect(pool, endpoint, checkout);
+    }
+}
+
+///
+/// Group
+///
+
+static bool kyros_socket_pool_register(kyros_socket_pool* pool, kyros_socket_pool_group* group)
+{
+    for (uint32_t i = 0; i < KYROS_SOCKET_POOL_GROUP_SIZE; i++) {
+        auto slot = &group->slots[i];
+        auto generation = atomic_load_explicit(&slot->generation, memory_order_relaxed);
+        if ((generation & 1) || !atomic_compare_exchange_strong_explicit(&slot->generation, &generation, generation + 1, memory_order_acq_rel, memory_order_relaxed)) {
+            continue;
+        }
+        for (uint32_t bucket = 0; bucket < KYROS_SOCKET_POOL_STEAL_BUCKETS; bucket++) {
+            atomic_store_explicit(&slot->idle[bucket], 0, memory_order_relaxed);
+        }
+        atomic_store_explicit(&slot->loop, pool->loop, memory_order_relaxed);
+        atomic_store_explicit(&slot->io_engine, (uint32_t)kyros_loop_get_io_engine(pool->loop), memory_order_relaxed);
+        atomic_store_explicit(&slot->pool, pool, memory_order_release);
+        pool->slot = slot;
+        return true;
+    }
+    return false;
+}
+
+static void kyros_socket_pool_unregister(kyros_socket_pool* pool)
+{
+    auto slot = pool->slot;
+    if (!slot) {
+        return;
+    }
+    atomic_store_explicit(&slot->pool, NULL, memory_order_release);
+    atomic_fetch_add_explicit(&slot->generation, 1, memory_order_acq_rel);
+    pool->slot = NULL;
+}
+
+kyros_socket_pool_group* kyros_socket_pool_group_create()
+{
+    auto group = (kyros_socket_pool_group*)kyros_alloc(sizeof(kyros_socket_pool_group));
+    for (uint32_t i = 0; i < KYROS_SOCKET_POOL_GROUP_SIZE; i++) {
+        auto slot = &group->slots[i];
+        atomic_init(&slot->generation, 0);
+        atomic_init(&slot->pool, NULL);
+        atomic_init(&slot->loop, NULL);
+        atomic_init(&slot->io_engine, 0);
+        for (uint32_t bucket = 0; bucket < KYROS_SOCKET_POOL_STEAL_BUCKETS; bucket++) {
+            atomic_init(&slot->idle[bucket], 0);
+        }
+    }
+    return group;
+}
+
+void kyros_socket_pool_group_destroy(kyros_socket_pool_group* group)
+{
+    kyros_free(group);
+}
+
+///
+/// Public API
+///
+
+kyros_socket_pool* kyros_socket_pool_create(kyros_loop* loop, kyros_socket_pool_options options)
+{
+    auto pool = (kyros_socket_pool*)kyros_alloc(sizeof(kyros_socket_pool));
+    *pool = (kyros_socket_pool) {
+        .loop = loop,
+        .options = options,
+        .endpoints = (kyros_socket_pool_endpoint**)kyros_calloc(KYROS_SOCKET_POOL_ENDPOINTS, sizeof(kyros_socket_pool_endpoint*)),
+        .endpoint_mask = KYROS_SOCKET_POOL_ENDPOINTS - 1,
+    };
+    if (!pool->options.max_per_host) {
+        pool->options.max_per_host = KYROS_SOCKET_POOL_MAX_PER_HOST;
+    }
+    if (!pool->options.idle_timeout) {
+        pool->options.idle_timeout = KYROS_SOCKET_POOL_IDLE_TIMEOUT;
+    }
+    if (!pool->options.steal_timeout) {
+        pool->options.steal_timeout = KYROS_SOCKET_POOL_STEAL_TIMEOUT;
+    }
+    if (options.group && !kyros_socket_pool_register(pool, options.group)) {
+        kyros_free(pool->endpoints);
+        kyros_free(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+void kyros_socket_pool_destroy(kyros_socket_pool* pool)
+{
+    pool->destroyed = true;
+    kyros_socket_pool_unregister(pool);
+    // the last close can't free the pool before the loop is done
+    pool->connections++;
+    while (pool->steals) {
+        auto steal = pool->steals;
+        auto endpoint = steal->endpoint;
+        auto checkout = steal->checkout;
+        kyros_socket_pool_steal_settle(steal);
+        endpoint->total--;
+        kyros_socket_pool_release_endpoint(pool, endpoint);
+        checkout.callback((kyros_socket) { 0 }, kyros_socket_pool_error(UV_ECANCELED), checkout.ctx);
+    }
+    for (uint32_t i = 0; i <= pool->endpoint_mask; i++) {
+        auto endpoint = pool->endpoints[i];
+        while (endpoint) {
+            auto next = endpoint->next;
+            endpoint->total++;
+            while (endpoint->waiters_head) {
+                auto waiter = endpoint->waiters_head;
+                endpoint->waiters_head = waiter->next;
+                auto checkout = *waiter;
+                kyros_free(waiter);
+                checkout.callback((kyros_socket) { 0 }, kyros_socket_pool_error(UV_ECANCELED), checkout.ctx);
+            }
+            endpoint->waiters_tail = NULL;
+            while (endpoint->idle) {
+                endpoint->idle->closing = true;
+                kyros_socket_close(endpoint->idle->socket);
+            }
+            endpoint->total--;
+            kyros_socket_pool_release_endpoint(pool, endpoint);
+            endpoint = next;
+        }
+    }
+    pool->connections--;
+    kyros_socket_pool_try_free(pool);
+}
+
+void kyros_socket_pool_checkout(kyros_socket_pool* pool, kyros_socket_source source, SSL_CTX* tls, kyros_socket_handler* handler,
+    kyros_socket_pool_callback callback, void* ctx)
+{
+    if (pool->destroyed) {
+        callback((kyros_socket) { 0 }, kyros_socket_pool_error(UV_ECANCELED), ctx);
+        return;
+    }
+    if (source.type != KYROS_SOCKET_SOURCE_HOSTPORT || source.value.host_port.use_udp) {
+        callback((kyros_socket) { 0 }, kyros_socket_pool_error(UV_EINVAL), ctx);
+        return;
+    }
+    auto host = source.value.host_port.host ? source.value.host_port.host : "localhost";
+    uint32_t host_length = (uint32_t)strlen(host);
+    auto port = source.value.host_port.port;
+    kyros_socket_ip_family family = source.value.host_port.family;
+    auto hash = kyros_socket_pool_hash(host, host_length, port, family, tls);
+    auto endpoint = kyros_socket_pool_find(pool, hash, host, host_length, port, family, tls);
+    if (!endpoint) {
+        endpoint = kyros_socket_pool_insert(pool, hash, host, host_length, port, family, tls);
+    }
+    kyros_socket_pool_request checkout = {
+        .handler = handler,
+        .callback = callback,
+        .ctx = ctx,
+        .use_happy_eyeballs = source.value.host_port.use_happy_eyeballs,
+    };
+    // counted right away, so dropping unhealthy idle connections can't release the endpoint
+    endpoint->total++;
+    auto connection = kyros_socket_pool_pop_idle(pool, endpoint);
+    if (connection) {
+        endpoint->total--;
+        pool->stats.reused++;
+        connection->checkout = checkout;
+        kyros_socket_pool_hand_out(connection);
+        return;
+    }
+    if (endpoint->total > pool->options.max_per_host) {
+        endpoint->total--;
+        auto waiter = (kyros_socket_pool_request*)kyros_alloc(sizeof(kyros_socket_pool_request));
+        *waiter = checkout;
+        if (endpoint->waiters_tail) {
+            endpoint->waiters_tail->next = waiter;
+        } else {
+            endpoint->waiters_head = waiter;
+        }
+        endpoint->waiters_tail = waiter;
+        pool->stats.waited++;
+        return;
+    }
+    kyros_socket_pool_start(pool, endpoint, checkout);
+}
+
+void kyros_socket_pool_release(kyros_socket socket, bool reusable)
+{
+    auto tcp = kyros_socket_pool_get_tcp(socket);
+    if (!tcp->socket.pooled) {
+        return;
+    }
+    auto handler = tcp->socket.has_pipe_link ? kyros_container_of(tcp->handlers, kyros_socket_pipe_link, handler)->original : tcp->handlers;
+    auto connection = kyros_container_of(handler, kyros_socket_pool_connection, handler);
+    if (connection->state != KYROS_SOCKET_POOL_IN_USE) {
+        return;
+    }
+    auto pool = connection->pool;
+    if (!reusable || pool->destroyed || tcp->socket.has_pipe_link || !kyros_socket_internal_is_reusable(tcp)) {
+        kyros_socket_close(socket);
+        return;
+    }
+    if (connection->checkout.handler) {
+        connection->checkout.handler->ref_count--;
+    }
+    connection->checkout = (kyros_socket_pool_request) { 0 };
+    if (tcp->socket.is_paused) {
+        kyros_socket_resume(socket);
+    }
+    // the oldest checkout waiting for this endpoint takes it right away
+    auto endpoint = connection->endpoint;
+    auto waiter = endpoint->waiters_head;
+    if (waiter) {
+        endpoint->waiters_head = waiter->next;
+        if (!endpoint->waiters_head) {
+            endpoint->waiters_tail = NULL;
+        }
+        connection->checkout = *waiter;
+        kyros_free(waiter);
+        pool->stats.reused++;
+        kyros_socket_pool_hand_out(connection);
+        return;
+    }
+    // idle connections don't keep the loop alive, the socket timeout evicts them
+    kyros_socket_timeout(socket, pool->options.idle_timeout);
+    kyros_socket_keepalive_loop(socket, false);
+    kyros_socket_pool_idle_push(pool, connection);
+}
+
+kyros_socket_pool_stats kyros_socket_pool_get_stats(kyros_socket_pool* pool)
+{
+    auto stats = pool->stats;
+    stats.connections = pool->connections;
+    stats.idle = pool->idle_count;
+    return stats;
+}
@@ -0,0 +1,336 @@
+#include <kyros.h>
+#include <kyros_bitset.h>
+#include <kyros_internal.h>
+
+#include <uv.h>
+
+#include <stdint.h>
+#include <stdio.h>
+
+// entries further than this are parked at the last level and cascaded again
+#define TIMER_WHEEL_RANGE ((uint64_t)1 << (TIMER_WHEEL_SLOT_BITS * TIMER_WHEEL_LEVELS))
+#define TIMER_WHEEL_SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+
+static inline uint32_t kyros_timer_wheel_slot(uint64_t tick, uint32_t level)
+{
+    return (tick >> (level * TIMER_WHEEL_SLOT_BITS)) & TIMER_WHEEL_SLOT_MASK;
+}
+
+static inline uint64_t kyros_timer_wheel_current_tick(kyros_timer_wheel* wheel)
+{
+    return uv_now(wheel->driver.loop) / wheel->granularity;
+}
+
+static inline void kyros_timer_wheel_link(kyros_timer_wheel* wheel, kyros_timer_entry* entry)
+{
+    auto delta = entry->expires > wheel->now ? entry->expires - wheel->now : 0;
+    auto expires = delta >= TIMER_WHEEL_RANGE ? wheel->now + TIMER_WHEEL_RANGE - 1 : entry->expires;
+    uint32_t level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 && delta >= ((uint64_t)1 << ((level + 1) * TIMER_WHEEL_SLOT_BITS))) {
+        level++;
+    }
+    auto slot = kyros_timer_wheel_slot(expires, level);
+    auto head = &wheel->slots[level][slot];
+    entry->next = *head;
+    if (entry->next) {
+        entry->next->pprev = &entry->next;
+    }
+    entry->pprev = head;
+    *head = entry;
+    kyros_bitset_set(&wheel->occupied[level], slot);
+}
+
+static inline void kyros_timer_wheel_unlink(kyros_timer_wheel* wheel, kyros_timer_entry* entry)
+{
+    *entry->pprev = entry->next;
+    if (entry->next) {
+        entry->next->pprev = entry->pprev;
+    }
+    // the slot head is inside the wheel, so we can find out if the slot became empty
+    auto first = &wheel->slots[0][0];
+    auto slot_head = (kyros_timer_entry**)entry->pprev;
+    if (slot_head >= first && slot_head < first + TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOTS && !*slot_head) {
+        auto index = (uint32_t)(slot_head - first);
+        kyros_bitset_unset(&wheel->occupied[index / TIMER_WHEEL_SLOTS], index % TIMER_WHEEL_SLOTS);
+    }
+    entry->next = NULL;
+    entry->pprev = NULL;
+}
+
+// first tick after now where something must be processed (fire or cascade), UINT64_MAX if empty
+static uint64_t kyros_timer_wheel_next_tick(kyros_timer_wheel* wheel)
+{
+    uint64_t next = UINT64_MAX;
+    for (uint32_t level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        auto mask = wheel->occupied[level].mask;
+        if (!mask) {
+            continue;
+        }
+        const uint32_t shift = level * TIMER_WHEEL_SLOT_BITS;
+        const uint32_t start = (kyros_timer_wheel_slot(wheel->now, level) + 1) & TIMER_WHEEL_SLOT_MASK;
+        // rotate so the slot after the current one is bit 0
+        auto rotated = start ? (mask >> start) | (mask << (TIMER_WHEEL_SLOTS - start)) : mask;
+        uint64_t offset = __builtin_ctzg(rotated) + 1;
+        uint64_t tick = level ? ((wheel->now >> shift) + offset) << shift : wheel->now + offset;
+        if (tick < next) {
+            next = tick;
+        }
+    }
+    return next;
+}
+
+static void kyros_timer_wheel_cascade(kyros_timer_wheel* wheel, uint32_t level)
+{
+    auto slot = kyros_timer_wheel_slot(wheel->now, level);
+    auto entry = wheel->slots[level][slot];
+    wheel->slots[level][slot] = NULL;
+    kyros_bitset_unset(&wheel->occupied[level], slot);
+    while (entry) {
+        auto next = entry->next;
+        kyros_timer_wheel_link(wheel, entry);
+        entry = next;
+    }
+}
+
+static void kyros_timer_wheel_arm(kyros_timer_wheel* wheel);
+
+static void kyros_timer_wheel_advance(kyros_timer_wheel* wheel, uint64_t target)
+{
+    while (wheel->count) {
+        auto tick = kyros_timer_wheel_next_tick(wheel);
+        if (tick > target) {
+            break;
+        }
+        wheel->now = tick;
+        // lower levels first, entries from upper levels never land in a slot we already cascaded
+        for (uint32_t level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+            if (tick & (((uint64_t)1 << (level * TIMER_WHEEL_SLOT_BITS)) - 1)) {
+                break;
+            }
+            kyros_timer_wheel_cascade(wheel, level);
+        }
+        // fire one by one, callbacks are allowed to remove or insert any entry
+        auto head = &wheel->slots[0][kyros_timer_wheel_slot(tick, 0)];
+        kyros_timer_entry* entry;
+        while ((entry = *head)) {
+            kyros_timer_wheel_unlink(wheel, entry);
+            wheel->count--;
+            entry->callback(entry);
+        }
+    }
+    if (target > wheel->now) {
+        wheel->now = target;
+    }
+}
+
+static void kyros_timer_wheel_driver_callback(uv_timer_t* driver)
+{
+    auto wheel = kyros_container_of(driver, kyros_timer_wheel, driver);
+    wheel->armed = UINT64_MAX;
+    kyros_timer_wheel_advance(wheel, kyros_timer_wheel_current_tick(wheel));
+    kyros_timer_wheel_arm(wheel);
+}
+
+static void kyros_timer_wheel_arm(kyros_timer_wheel* wheel)
+{
+    auto tick = kyros_timer_wheel_next_tick(wheel);
+    if (tick == wheel->armed) {
+        return;
+    }
+    wheel->armed = tick;
+    if (tick == UINT64_MAX) {
+        uv_timer_stop(&wheel->driver);
+        return;
+    }
+    const uint64_t now = uv_now(wheel->driver.loop);
+    const uint64_t at = tick * wheel->granularity;
+    uv_timer_start(&wheel->driver, kyros_timer_wheel_driver_callback, at > now ? at - now : 0, 0);
+}
+
+void kyros_timer_wheel_init(kyros_timer_wheel* wheel, uv_loop_t* loop, uint32_t granularity)
+{
+    *wheel = (kyros_timer_wheel) {
+        .armed = UINT64_MAX,
+        .granularity = granularity ? granularity : TIMER_WHEEL_DEFAULT_GRANULARITY,
+    };
+    uv_timer_init(loop, &wheel->driver);
+    uv_unref((uv_handle_t*)&wheel->driver);
+    wheel->now = kyros_timer_wheel_current_tick(wheel);
+}
+
+void kyros_timer_wheel_deinit(kyros_timer_wheel* wheel)
+{
+    // detach everything so late kyros_timer_stop calls are no-ops
+    for (uint32_t level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        for (uint32_t slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+            auto entry = wheel->slots[level][slot];
+            while (entry) {
+                auto next = entry->next;
+                entry->next = NULL;
+                entry->pprev = NULL;
+                entry = next;
+            }
+            wheel->slots[level][slot] = NULL;
+        }
+        wheel->occupied[level] = kyros_bitset_empty;
+    }
+    wheel->count = 0;
+    uv_timer_stop(&wheel->driver);
+    uv_close((uv_handle_t*)&wheel->driver, NULL);
+}
+
+void kyros_timer_wheel_insert(kyros_timer_wheel* wheel, kyros_timer_entry* entry, uint64_t timeout)
+{
+    if (kyros_timer_entry_is_armed(entry)) {
+        kyros_timer_wheel_unlink(wheel, entry);
+    } else {
+        if (!wheel->count) {
+            // nothing armed, fast forward instead of walking the idle ticks later
+            auto current = kyros_timer_wheel_current_tick(wheel);
+            if (current > wheel->now) {
+                wheel->now = current;
+            }
+        }
+        wheel->count++;
+    }
+    const uint64_t now = uv_now(wheel->driver.loop);
+    auto expires = (now + timeout + wheel->granularity - 1) / wheel->granularity;
+    entry->expires = expires > wheel->now ? expires : wheel->now + 1;
+    kyros_timer_wheel_link(wheel, entry);
+    // the driver only moves when this entry is due before the current deadline
+    if (entry->expires < wheel->armed) {
+        kyros_timer_wheel_arm(wheel);
+    }
+}
+
+void kyros_timer_wheel_remove(kyros_timer_wheel* wheel, kyros_timer_entry* entry)
+{
+    if (!kyros_timer_entry_is_armed(entry)) {
+        return;
+    }
+    kyros_timer_wheel_unlink(wheel, entry);
+    // keep the driver armed, a spurious wakeup is cheaper than recomputing on every cancel
+    wheel->count--;
+}
+
+void kyros_timer_wheel_keep_alive(kyros_timer_wheel* wheel, int32_t delta)
+{
+    auto before = wheel->keep_alive_count;
+    wheel->keep_alive_count += delta;
+    if (!before && wheel->keep_alive_count) {
+        uv_ref((uv_handle_t*)&wheel->driver);
+    } else if (before && !wheel->keep_alive_count) {
+        uv_unref((uv_handle_t*)&wheel->driver);
+    }
+}
+
+///
+/// kyros_timer on top of the loop timer wheel
+///
+
+static inline kyros_timer_wheel* kyros_timer_get_wheel(kyros_timer_internal* timer)
+{
+    return &kyros_get_internal_loop(timer->loop)->timer_wheel;
+}
+
+static inline void kyros_timer_disarm(kyros_timer_internal* timer)
+{
+    if (kyros_timer_entry_is_armed(&timer->entry)) {
+        auto wheel = kyros_timer_get_wheel(timer);
+        kyros_timer_wheel_remove(wheel, &timer->entry);
+        if (timer->keep_alive) {
+            kyros_timer_wheel_keep_alive(wheel, -1);
+        }
+    }
+}
+
+static inline void kyros_timer_arm(kyros_timer_internal* timer, uint64_t timeout)
+{
+    auto wheel = kyros_timer_get_wheel(timer);
+    if (!kyros_timer_entry_is_armed(&timer->entry) && timer->keep_alive) {
+        kyros_timer_wheel_keep_alive(wheel, 1);
+    }
+    kyros_timer_wheel_insert(wheel, &timer->entry, timeout);
+}
+
+static void kyros_internal_timer_callback(kyros_timer_entry* entry)
+{
+    auto timer = kyros_container_of(entry, kyros_timer_internal, entry);
+    if (timer->keep_alive) {
+        kyros_timer_wheel_keep_alive(kyros_timer_get_wheel(timer), -1);
+    }
+    // re-arm before the callback (like uv_timer_again) so the task can still stop or change it
+    if (timer->repeat) {
+        kyros_timer_arm(timer, timer->repeat);
+    }
+    timer->ref_count++;
+    timer->task(timer->ctx);
+    kyros_timer_unref((kyros_timer*)timer);
+}
+
+kyros_timer* kyros_loop_timer(kyros_loop* loop, void (*task)(void* ctx), void* ctx, uint64_t timeout, uint64_t repeat, bool keep_alive)
+{
+    auto timer = (kyros_timer_internal*)kyros_alloc(sizeof(kyros_timer_internal));
+    *timer = (kyros_timer_internal) {
+        .entry = { .callback = kyros_internal_timer_callback },
+        .loop = loop,
+        .task = task,
+        .ctx = ctx,
+        .repeat = repeat,
+        .ref_count = 1,
+        .keep_alive = keep_alive,
+    };
+    kyros_timer_arm(timer, timeout);
+    return (kyros_timer*)timer;
+}
+
+void kyros_timer_set_callback(kyros_timer* timer, void (*task)(void* ctx), void* ctx)
+{
+    auto internal = kyros_get_internal_timer(timer);
+    internal->task = task;
+    internal->ctx = ctx;
+}
+
+void kyros_timer_set_times(kyros_timer* timer, uint64_t timeout, uint64_t repeat)
+{
+    auto internal = kyros_get_internal_timer(timer);
+    internal->repeat = repeat;
+    // re-arm is a relink in the wheel, no need to stop first
+    kyros_timer_arm(internal, timeout);
+}
+
+void kyros_timer_stop(kyros_timer* timer)
+{
+    kyros_timer_disarm(kyros_get_internal_timer(timer));
+}
+
+uint64_t kyros_timer_ref(kyros_timer* timer)
+{
+    auto internal = kyros_get_internal_timer(timer);
+    internal->ref_count++;
+    return internal->ref_count;
+}
+
+uint64_t kyros_timer_unref(kyros_timer* timer)
+{
+    auto internal = kyros_get_internal_timer(timer);
+    m_assert(internal->ref_count, "kyros_timer double free detected");
+    if (--internal->ref_count == 0) {
+        kyros_timer_disarm(internal);
+        kyros_free(internal);
+        return 0;
+    }
+    return internal->ref_count;
+}
+
+void kyros_timer_keepalive_loop(kyros_timer* timer, bool keep_alive)
+{
+    auto internal = kyros_get_internal_timer(timer);
+    if (internal->keep_alive == keep_alive) {
+        return;
+    }
+    internal->keep_alive = keep_alive;
+    if (kyros_timer_entry_is_armed(&internal->entry)) {
+        kyros_timer_wheel_keep_alive(kyros_timer_get_wheel(internal), keep_alive ? 1 : -1);
+    }
+}
@@ -0,0 +1,516 @@
+#include <kyros.h>
+#include <kyros_internal.h>
+
+#include <openssl/bio.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+
+// the BIO reads ciphertext straight from the loop recv buffer and writes it straight to the
+// tcp socket (sent, corked or queued in the pooled chunks), no memory BIO in between
+
+static uv_once_t kyros_tls_bio_once = UV_ONCE_INIT;
+static BIO_METHOD* kyros_tls_bio_method = NULL;
+static int kyros_tls_bio_type = 0;
+
+static int kyros_tls_bio_create(BIO* bio)
+{
+    BIO_set_init(bio, 1);
+    return 1;
+}
+
+static int kyros_tls_bio_destroy(BIO* bio)
+{
+    BIO_set_data(bio, NULL);
+    return 1;
+}
+
+static int kyros_tls_bio_read(BIO* bio, char* out, int length)
+{
+    kyros_socket_internal_tls* tls = BIO_get_data(bio);
+    auto internal = kyros_get_internal_loop(kyros_socket_internal_get_loop(&tls->tcp));
+    BIO_clear_retry_flags(bio);
+    if (!internal->ssl_input_length) {
+        BIO_set_retry_read(bio);
+        return -1;
+    }
+    uint64_t size = (uint64_t)length < internal->ssl_input_length ? (uint64_t)length : internal->ssl_input_length;
+    memcpy(out, internal->ssl_input, size);
+    internal->ssl_input += size;
+    internal->ssl_input_length -= size;
+    return (int)size;
+}
+
+static int kyros_tls_bio_write(BIO* bio, const char* data, int length)
+{
+    kyros_socket_internal_tls* tls = BIO_get_data(bio);
+    BIO_clear_retry_flags(bio);
+    if (tls->tcp.socket.status == KYROS_SOCKET_STATE_CLOSED) {
+        return -1;
+    }
+    // never refused, backpressure is handled by the write queue watermarks
+    kyros_socket_internal_write(&tls->tcp, data, length, false);
+    return length;
+}
+
+static long kyros_tls_bio_ctrl(BIO* bio, int command, long larg, void* parg)
+{
+    switch (command) {
+    case BIO_CTRL_FLUSH:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+static void kyros_tls_create_bio_method()
+{
+    kyros_tls_bio_type = BIO_get_new_index() | BIO_TYPE_SOURCE_SINK;
+    auto method = BIO_meth_new(kyros_tls_bio_type, "kyros");
+    BIO_meth_set_create(method, kyros_tls_bio_create);
+    BIO_meth_set_destroy(method, kyros_tls_bio_destroy);
+    BIO_meth_set_read(method, kyros_tls_bio_read);
+    BIO_meth_set_write(method, kyros_tls_bio_write);
+    BIO_meth_set_ctrl(method, kyros_tls_bio_ctrl);
+    kyros_tls_bio_method = method;
+}
+
+static kyros_socket_error kyros_tls_error(int ssl_error)
+{
+    auto code = ERR_get_error();
+    ERR_clear_error();
+    if (!code) {
+        // no error in the queue (eg. SSL_ERROR_SYSCALL on an unexpected EOF)
+        return (kyros_socket_error) {
+            .type = KYROS_SOCKET_ERROR_TLS_ERROR,
+            .code = (uint32_t)ssl_error,
+        };
+    }
+    return (kyros_socket_error) {
+        .type = KYROS_SOCKET_ERROR_TLS_ERROR,
+        .code = ERR_GET_REASON(code),
+        .code_s = ERR_reason_error_string(code),
+        .message = ERR_lib_error_string(code),
+    };
+}
+
+static inline kyros_write_chunk_pool* kyros_tls_get_write_pool(kyros_socket_internal_tls* tls)
+{
+    return &kyros_get_internal_loop(kyros_socket_internal_get_loop(&tls->tcp))->write_pool;
+}
+
+kyros_socket_internal_tls* kyros_tls_from_ssl(const SSL* ssl)
+{
+    auto bio = SSL_get_wbio(ssl);
+    if (!bio || BIO_method_type(bio) != kyros_tls_bio_type) {
+        return NULL;
+    }
+    return (kyros_socket_internal_tls*)BIO_get_data(bio);
+}
+
+void kyros_tls_init(kyros_socket_internal_tls* tls, SSL_CTX* ctx, bool is_client)
+{
+    tls->plaintext_queue = NULL;
+    tls->traffic_secrets = NULL;
+    tls->ssl = SSL_new(ctx);
+    if (!tls->ssl) {
+        // reported by kyros_tls_start
+        return;
+    }
+    if (tls->tcp.socket.kernel_tls) {
+        kyros_ktls_prepare_ctx(ctx);
+    }
+    uv_once(&kyros_tls_bio_once, kyros_tls_create_bio_method);
+    auto bio = BIO_new(kyros_tls_bio_method);
+    BIO_set_data(bio, tls);
+    // takes a single reference when rbio == wbio
+    SSL_set_bio(tls->ssl, bio, bio);
+    // no-op on BoringSSL (record buffers are always released when empty), needed on OpenSSL
+    SSL_set_mode(tls->ssl, SSL_MODE_RELEASE_BUFFERS);
+#ifdef OPENSSL_IS_BORINGSSL
+    // free the copied handshake configuration (certificates, keys, ciphers) once the handshake is done
+    SSL_set_shed_handshake_config(tls->ssl, 1);
+#endif
+    if (is_client) {
+        SSL_set_connect_state(tls->ssl);
+    } else {
+        SSL_set_accept_state(tls->ssl);
+    }
+}
+
+void kyros_tls_set_peer(kyros_socket_internal_tls* tls, const char* host, uint16_t port, bool is_name)
+{
+    if (!tls->ssl || !host) {
+        return;
+    }
+    if (is_name) {
+        SSL_set_tlsext_host_name(tls->ssl, host);
+    }
+    kyros_tls_session_cache_prepare_client(tls->ssl, host, port);
+}
+
+static bool kyros_tls_ssl_write(kyros_socket_internal_tls* tls, const char* data, uint64_t length)
+{
+    while (length) {
+        int size = length > INT_MAX ? INT_MAX : (int)length;
+        auto written = SSL_write(tls->ssl, data, size);
+        if (written <= 0) {
+            kyros_socket_close_with_error(&tls->tcp, kyros_tls_error(SSL_get_error(tls->ssl, written)));
+            return false;
+        }
+        data += written;
+        length -= written;
+    }
+    return true;
+}
+
+/// @brief encrypted by BoringSSL or by the kernel, returns false if the socket was closed
+static bool kyros_tls_send(kyros_socket_internal_tls* tls, const char* data, uint64_t length)
+{
+    if (tls->tcp.socket.ktls_tx) {
+        kyros_socket_internal_write(&tls->tcp, data, length, false);
+        return tls->tcp.socket.status != KYROS_SOCKET_STATE_CLOSED;
+    }
+    return kyros_tls_ssl_write(tls, data, length);
+}
+
+static void kyros_tls_end(kyros_socket_internal_tls* tls)
+{
+    if (!tls->tcp.socket.ktls_tx) {
+        // close_notify goes through the BIO, then the writable side is shutdown after the flush
+        // with kernel tls it is sent by the tcp layer right before the shutdown
+        SSL_shutdown(tls->ssl);
+        ERR_clear_error();
+    }
+    if (tls->tcp.socket.status != KYROS_SOCKET_STATE_CLOSED) {
+        kyros_socket_internal_write(&tls->tcp, NULL, 0, true);
+    }
+}
+
+static inline bool kyros_tls_is_handshake_done(kyros_socket_internal_tls* tls)
+{
+    KYROS_SOCKET_STATUS status = tls->tcp.socket.status;
+    return (status == KYROS_SOCKET_STATE_SECURE || status == KYROS_SOCKET_STATE_READABLE_ENDED) && !SSL_in_init(tls->ssl);
+}
+
+static void kyros_tls_flush_plaintext_queue(kyros_socket_internal_tls* tls);
+
+/// @brief the piece read from the file at the head of the plaintext queue goes through SSL_write, then the queue goes on
+static void kyros_tls_on_file_piece(kyros_socket_internal_tcp* tcp, kyros_write_queue* piece)
+{
+    auto tls = (kyros_socket_internal_tls*)tcp;
+    auto pool = kyros_tls_get_write_pool(tls);
+    bool open = true;
+    for (auto chunk = piece->head; chunk && open; chunk = chunk->next) {
+        open = kyros_tls_ssl_write(tls, chunk->data, chunk->end);
+        if (open) {
+            kyros_write_queue_consume(pool, tls->plaintext_queue, chunk->end);
+        }
+    }
+    kyros_write_queue_clear(pool, piece);
+    if (open) {
+        kyros_tls_flush_plaintext_queue(tls);
+    }
+}
+
+/// @brief write the plaintext queue once the handshake is done, files are encrypted a piece at a time
+/// while the tcp socket keeps up (more on the next writable event) or handed to the tcp layer with kernel tls
+static void kyros_tls_flush_plaintext_queue(kyros_socket_internal_tls* tls)
+{
+    auto tcp = &tls->tcp;
+    auto pool = kyros_tls_get_write_pool(tls);
+    for (;;) {
+        // re-read every time, a flush of the tcp layer can get back here and finish the queue
+        auto queue = tls->plaintext_queue;
+        if (!queue) {
+            break;
+        }
+        if (!queue->head) {
+            tls->plaintext_queue = NULL;
+            kyros_free(queue);
+            break;
+        }
+        auto chunk = queue->head;
+        auto file = kyros_write_chunk_get_file(chunk);
+        if (!file) {
+            uint64_t length = chunk->end - chunk->start;
+            if (!kyros_tls_send(tls, chunk->data + chunk->start, length)) {
+                return;
+            }
+            kyros_write_queue_consume(pool, queue, length);
+            continue;
+        }
+        if (tcp->socket.ktls_tx) {
+            // unlinked first so the tcp flush can't see it again, the tcp queue takes its own copy of the fd
+            queue->head = chunk->next;
+            if (!queue->head) {
+                queue->tail = NULL;
+            }
+            queue->length -= file->length;
+            chunk->next = NULL;
+            kyros_socket_internal_write_file(tcp, file->fd, file->offset, file->length, false);
+            kyros_write_queue_clear(pool, &(kyros_write_queue) { .head = chunk });
+            if (tcp->socket.status == KYROS_SOCKET_STATE_CLOSED) {
+                return;
+            }
+            continue;
+        }
+        uint64_t buffered = kyros_socket_queued(tcp) + (tcp->cork ? tcp->cork->length : 0);
+        if (buffered >= tcp->write_low_watermark || tcp->socket.file_reading) {
+            // the next writable event continues (kyros_tls_has_pending_writes), or kyros_tls_on_file_piece once the piece is read
+            kyros_socket_update_poll(tcp);
+            return;
+        }
+        kyros_socket_read_file_piece(tcp, file, kyros_tls_on_file_piece);
+        if (tcp->socket.status != KYROS_SOCKET_STATE_CLOSED) {
+            kyros_socket_update_poll(tcp);
+        }
+        return;
+    }
+    if (tcp->socket.tls_end_pending) {
+        tcp->socket.tls_end_pending = false;
+        kyros_tls_end(tls);
+        if (tcp->socket.status == KYROS_SOCKET_STATE_CLOSED) {
+            return;
+        }
+    }
+    kyros_socket_update_poll(tcp);
+    kyros_socket_check_low_watermark(tcp);
+}
+
+/// @brief returns true once the handshake is done and the socket is still open
+static bool kyros_tls_handshake(kyros_socket_internal_tls* tls)
+{
+    auto result = SSL_do_handshake(tls->ssl);
+    if (result != 1) {
+        auto error = SSL_get_error(tls->ssl, result);
+        if (error != SSL_ERROR_WANT_READ && error != SSL_ERROR_WANT_WRITE) {
+            kyros_socket_close_with_error(&tls->tcp, kyros_tls_error(error));
+        }
+        return false;
+    }
+    if (tls->tcp.socket.kernel_tls) {
+        // falls back to BoringSSL for whatever the kernel does not take
+        kyros_ktls_enable(tls);
+        if (tls->tcp.socket.status == KYROS_SOCKET_STATE_CLOSED) {
+            return false;
+        }
+    }
+    tls->tcp.socket.status = KYROS_SOCKET_STATE_SECURE;
+    kyros_socket_notify_status(&tls->tcp, (kyros_socket_error) { .type = KYROS_SOCKET_ERROR_NO_ERROR });
+    if (tls->tcp.socket.status == KYROS_SOCKET_STATE_CLOSED) {
+        return false;
+    }
+    kyros_tls_flush_plaintext_queue(tls);
+    return tls->tcp.socket.status != KYROS_SOCKET_STATE_CLOSED;
+}
+
+void kyros_tls_start(kyros_socket_internal_tls* tls)
+{
+    if (!tls->ssl) {
+        kyros_socket_close_with_error(&tls->tcp, kyros_tls_error(SSL_ERROR_SSL));
+        return;
+    }
+    // the client sends its hello right away, the server waits for it
+    kyros_tls_handshake(tls);
+}
+
+void kyros_tls_on_data(kyros_socket_internal_tls* tls, const char* data, uint64_t length)
+{
+    auto loop = kyros_socket_internal_get_loop(&tls->tcp);
+    auto internal = kyros_get_internal_loop(loop);
+    internal->ssl_input = data;
+    internal->ssl_input_length = length;
+    if (SSL_in_init(tls->ssl) && (!kyros_tls_handshake(tls) || tls->tcp.socket.ktls_rx)) {
+        // with kernel tls nothing was left after the handshake, the next reads are plaintext
+        internal->ssl_input = NULL;
+        internal->ssl_input_length = 0;
+        return;
+    }
+    // the rest of the ciphertext may already hold application data
+    auto buffer = kyros_loop_get_ssl_read_buffer(loop);
+    for (;;) {
+        int read = 0;
+        uint64_t total = 0;
+        while (total < KYROS_SSL_READ_BUFFER_SIZE) {
+            read = SSL_read(tls->ssl, buffer + total, (int)(KYROS_SSL_READ_BUFFER_SIZE - total));
+            if (read <= 0) {
+                break;
+            }
+            total += read;
+        }
+        // before ondata, a write there resets the error state of the SSL
+        auto error = read > 0 ? SSL_ERROR_NONE : SSL_get_error(tls->ssl, read);
+        if (total && !kyros_socket_emit_data(&tls->tcp, buffer, total)) {
+            break;
+        }
+        if (read > 0) {
+            // decrypt buffer was full
+            continue;
+        }
+        if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) {
+            break;
+        }
+        if (error == SSL_ERROR_ZERO_RETURN) {
+            // close_notify
+            kyros_socket_on_end(&tls->tcp);
+        } else {
+            kyros_socket_close_with_error(&tls->tcp, kyros_tls_error(error));
+        }
+        break;
+    }
+    internal->ssl_input = NULL;
+    internal->ssl_input_length = 0;
+}
+
+void kyros_tls_on_record(kyros_socket_internal_tls* tls, uint8_t type, const char* data, uint64_t length)
+{
+    if (type == SSL3_RT_APPLICATION_DATA) {
+        kyros_socket_emit_data(&tls->tcp, data, length);
+        return;
+    }
+    if (type == SSL3_RT_ALERT && length >= 2) {
+        auto description = (uint8_t)data[1];
+        if (description == SSL3_AD_CLOSE_NOTIFY) {
+            kyros_socket_on_end(&tls->tcp);
+            return;
+        }
+        kyros_socket_close_with_error(&tls->tcp, (kyros_socket_error) {
+            .type = KYROS_SOCKET_ERROR_TLS_ERROR,
+            .code = description,
+            .code_s = SSL_alert_desc_string(description),
+            .message = SSL_alert_desc_string_long(description),
+        });
+        return;
+    }
+    // post handshake messages (KeyUpdate) can't go back to BoringSSL once the kernel has the keys
+    kyros_socket_close_with_error(&tls->tcp, (kyros_socket_error) {
+        .type = KYROS_SOCKET_ERROR_TLS_ERROR,
+        .code = SSL_AD_UNEXPECTED_MESSAGE,
+        .message = "unexpected tls record with kernel tls",
+    });
+}
+
+static inline bool kyros_tls_can_write(kyros_socket_internal_tls* tls)
+{
+    auto tcp = &tls->tcp;
+    KYROS_SOCKET_STATUS status = tcp->socket.status;
+    return status != KYROS_SOCKET_STATE_CLOSED && status != KYROS_SOCKET_STATE_WRITABLE_ENDED && !tcp->socket.end_pending && !tcp->socket.tls_end_pending && tls->ssl;
+}
+
+static inline kyros_write_queue* kyros_tls_get_plaintext_queue(kyros_socket_internal_tls* tls)
+{
+    if (!tls->plaintext_queue) {
+        tls->plaintext_queue = (kyros_write_queue*)kyros_alloc(sizeof(kyros_write_queue));
+        *tls->plaintext_queue = (kyros_write_queue) { 0 };
+    }
+    return tls->plaintext_queue;
+}
+
+bool kyros_tls_write(kyros_socket_internal_tls* tls, const char* data, uint64_t length, bool end)
+{
+    auto tcp = &tls->tcp;
+    if (!kyros_tls_can_write(tls)) {
+        return false;
+    }
+    if (!kyros_tls_is_handshake_done(tls) || tls->plaintext_queue) {
+        // keep the plaintext until the handshake is done or the file in front of it is sent
+        if (length) {
+            kyros_write_queue_append(kyros_tls_get_write_pool(tls), kyros_tls_get_plaintext_queue(tls), data, length);
+        }
+        if (end) {
+            tcp->socket.tls_end_pending = true;
+        }
+        kyros_socket_check_high_watermark(tcp);
+        kyros_socket_update_poll(tcp);
+        return !tcp->socket.over_high_watermark;
+    }
+    if (tcp->socket.ktls_tx) {
+        return kyros_socket_internal_write(tcp, data, length, end);
+    }
+    if (!kyros_tls_ssl_write(tls, data, length)) {
+        return false;
+    }
+    if (end) {
+        kyros_tls_end(tls);
+    }
+    return !tcp->socket.over_high_watermark;
+}
+
+bool kyros_tls_write_shared(kyros_socket_internal_tls* tls, kyros_shared_buffer* buffer, const char* data, uint64_t length)
+{
+    if (tls->tcp.socket.ktls_tx && kyros_tls_can_write(tls) && kyros_tls_is_handshake_done(tls) && !tls->plaintext_queue) {
+        // plaintext for the kernel, it can be queued by reference like on a plain socket
+        return kyros_socket_internal_write_shared(&tls->tcp, buffer, data, length);
+    }
+    // encrypted for this connection only
+    return kyros_tls_write(tls, data, length, false);
+}
+
+bool kyros_tls_write_file(kyros_socket_internal_tls* tls, uv_file fd, uint64_t offset, uint64_t length, bool end)
+{
+    auto tcp = &tls->tcp;
+    if (!kyros_tls_can_write(tls)) {
+        return false;
+    }
+    auto is_handshake_done = kyros_tls_is_handshake_done(tls);
+    if (is_handshake_done && tcp->socket.ktls_tx && !tls->plaintext_queue) {
+        // plaintext from the page cache, the kernel encrypts it
+        return kyros_socket_internal_write_file(tcp, fd, offset, length, end);
+    }
+    if (length && !kyros_write_queue_append_file(kyros_tls_get_write_pool(tls), kyros_tls_get_plaintext_queue(tls), fd, offset, length)) {
+        kyros_socket_close_with_error(tcp, kyros_socket_system_error(KYROS_SOCKET_ERROR_SYSTEM_ERROR, errno));
+        return false;
+    }
+    if (end) {
+        tcp->socket.tls_end_pending = true;
+    }
+    if (is_handshake_done) {
+        kyros_tls_flush_plaintext_queue(tls);
+        if (tcp->socket.status == KYROS_SOCKET_STATE_CLOSED) {
+            return false;
+        }
+    }
+    kyros_socket_check_high_watermark(tcp);
+    kyros_socket_update_poll(tcp);
+    return !tcp->socket.over_high_watermark;
+}
+
+void kyros_tls_on_writable(kyros_socket_internal_tls* tls)
+{
+    if (tls->plaintext_queue && kyros_tls_is_handshake_done(tls)) {
+        kyros_tls_flush_plaintext_queue(tls);
+    }
+}
+
+bool kyros_tls_has_pending_writes(kyros_socket_internal_tls* tls)
+{
+    // a file piece being read is encrypted by kyros_tls_on_file_piece, not on writable
+    return tls->plaintext_queue && kyros_tls_is_handshake_done(tls) && !tls->tcp.socket.file_reading;
+}
+
+uint64_t kyros_tls_buffer_size(kyros_socket_internal_tls* tls)
+{
+    return tls->plaintext_queue ? tls->plaintext_queue->length : 0;
+}
+
+void kyros_tls_free(kyros_socket_internal_tls* tls)
+{
+    if (tls->plaintext_queue) {
+        kyros_write_queue_clear(kyros_tls_get_write_pool(tls), tls->plaintext_queue);
+        kyros_free(tls->plaintext_queue);
+        tls->plaintext_queue = NULL;
+    }
+    if (tls->traffic_secrets) {
+        OPENSSL_cleanse(tls->traffic_secrets, sizeof(kyros_tls_traffic_secrets));
+        kyros_free(tls->traffic_secrets);
+        tls->traffic_secrets = NULL;
+    }
+    if (tls->ssl) {
+        SSL_free(tls->ssl);
+        tls->ssl = NULL;
+    }
+}
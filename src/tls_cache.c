@@ -0,0 +1,378 @@
+#include <kyros.h>
+#include <kyros_internal.h>
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <openssl/ssl.h>
+
+#include <string.h>
+#include <time.h>
+
+static uv_once_t kyros_tls_cache_index_once = UV_ONCE_INIT;
+// SSL_CTX -> kyros_tls_session_cache
+static int kyros_tls_cache_ctx_index = -1;
+// SSL -> hash of host:port (client)
+static int kyros_tls_cache_ssl_index = -1;
+
+static void kyros_tls_cache_create_indexes()
+{
+    kyros_tls_cache_ctx_index = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+    kyros_tls_cache_ssl_index = SSL_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+}
+
+static inline kyros_tls_session_cache* kyros_tls_cache_from_ctx(SSL_CTX* ctx)
+{
+    if (kyros_tls_cache_ctx_index < 0) {
+        return NULL;
+    }
+    return SSL_CTX_get_ex_data(ctx, kyros_tls_cache_ctx_index);
+}
+
+/// @brief FNV-1a, never 0 so it can be stored as ex_data
+static uint64_t kyros_tls_cache_hash(const uint8_t* key, uint64_t length, uint64_t hash)
+{
+    for (uint64_t i = 0; i < length; i++) {
+        hash = (hash ^ key[i]) * 0x100000001b3ULL;
+    }
+    return hash | 1;
+}
+
+static inline kyros_tls_cache_shard* kyros_tls_cache_shard_of(kyros_tls_session_cache* cache, uint64_t hash)
+{
+    return &cache->shards[(hash >> 1) & (KYROS_TLS_CACHE_SHARDS - 1)];
+}
+
+static inline bool kyros_tls_cache_entry_matches(kyros_tls_cache_entry* entry, uint64_t hash, const uint8_t* key, uint8_t length)
+{
+    return entry->session && entry->hash == hash && entry->key_length == length && !memcmp(entry->key, key, length);
+}
+
+/// @brief returns a new reference or NULL
+static SSL_SESSION* kyros_tls_cache_lookup(kyros_tls_session_cache* cache, const uint8_t* key, uint8_t length)
+{
+    auto hash = kyros_tls_cache_hash(key, length, 0xcbf29ce484222325ULL);
+    auto shard = kyros_tls_cache_shard_of(cache, hash);
+    auto now = (uint64_t)time(NULL);
+    SSL_SESSION* session = NULL;
+    uv_rwlock_rdlock(&shard->lock);
+    auto index = (uint32_t)(hash >> 7);
+    for (uint32_t i = 0; i < KYROS_TLS_CACHE_PROBES; i++) {
+        auto entry = &shard->entries[(index + i) & shard->mask];
+        if (kyros_tls_cache_entry_matches(entry, hash, key, length)) {
+            if (entry->expires > now) {
+                session = entry->session;
+                SSL_SESSION_up_ref(session);
+            }
+            break;
+        }
+    }
+    uv_rwlock_rdunlock(&shard->lock);
+    atomic_fetch_add_explicit(session ? &shard->hits : &shard->misses, 1, memory_order_relaxed);
+    return session;
+}
+
+/// @brief takes the session reference
+static void kyros_tls_cache_store(kyros_tls_session_cache* cache, const uint8_t* key, uint8_t length, SSL_SESSION* session)
+{
+    auto hash = kyros_tls_cache_hash(key, length, 0xcbf29ce484222325ULL);
+    auto shard = kyros_tls_cache_shard_of(cache, hash);
+    auto now = (uint64_t)time(NULL);
+    SSL_SESSION* replaced = NULL;
+    bool evicted = false;
+    uv_rwlock_wrlock(&shard->lock);
+    auto index = (uint32_t)(hash >> 7);
+    kyros_tls_cache_entry* target = NULL;
+    for (uint32_t i = 0; i < KYROS_TLS_CACHE_PROBES; i++) {
+        auto entry = &shard->entries[(index + i) & shard->mask];
+        if (kyros_tls_cache_entry_matches(entry, hash, key, length)) {
+            target = entry;
+            break;
+        }
+        // first free or expired slot, otherwise the one closest to expire
+        if (!target || (target->session && target->expires > now && (!entry->session || entry->expires < target->expires))) {
+            target = entry;
+        }
+    }
+    if (target->session) {
+        replaced = target->session;
+        evicted = !kyros_tls_cache_entry_matches(target, hash, key, length) && target->expires > now;
+    }
+    target->hash = hash;
+    target->expires = now + cache->session_timeout;
+    target->session = session;
+    target->key_length = length;
+    memcpy(target->key, key, length);
+    uv_rwlock_wrunlock(&shard->lock);
+    // free outside the lock
+    if (replaced) {
+        SSL_SESSION_free(replaced);
+    }
+    atomic_fetch_add_explicit(&shard->stored, 1, memory_order_relaxed);
+    if (evicted) {
+        atomic_fetch_add_explicit(&shard->evicted, 1, memory_order_relaxed);
+    }
+}
+
+static void kyros_tls_cache_remove(kyros_tls_session_cache* cache, const uint8_t* key, uint8_t length)
+{
+    auto hash = kyros_tls_cache_hash(key, length, 0xcbf29ce484222325ULL);
+    auto shard = kyros_tls_cache_shard_of(cache, hash);
+    SSL_SESSION* removed = NULL;
+    uv_rwlock_wrlock(&shard->lock);
+    auto index = (uint32_t)(hash >> 7);
+    for (uint32_t i = 0; i < KYROS_TLS_CACHE_PROBES; i++) {
+        auto entry = &shard->entries[(index + i) & shard->mask];
+        if (kyros_tls_cache_entry_matches(entry, hash, key, length)) {
+            removed = entry->session;
+            entry->session = NULL;
+            break;
+        }
+    }
+    uv_rwlock_wrunlock(&shard->lock);
+    if (removed) {
+        SSL_SESSION_free(removed);
+    }
+}
+
+///
+/// Server, session ids
+///
+
+static int kyros_tls_cache_server_new(SSL* ssl, SSL_SESSION* session)
+{
+    auto cache = kyros_tls_cache_from_ctx(SSL_get_SSL_CTX(ssl));
+    unsigned int length = 0;
+    auto id = SSL_SESSION_get_id(session, &length);
+    if (!cache || !length || length > SSL_MAX_SSL_SESSION_ID_LENGTH) {
+        return 0;
+    }
+    kyros_tls_cache_store(cache, id, (uint8_t)length, session);
+    // we keep the reference
+    return 1;
+}
+
+static SSL_SESSION* kyros_tls_cache_server_get(SSL* ssl, const uint8_t* id, int length, int* copy)
+{
+    *copy = 0;
+    auto cache = kyros_tls_cache_from_ctx(SSL_get_SSL_CTX(ssl));
+    if (!cache || length <= 0 || length > SSL_MAX_SSL_SESSION_ID_LENGTH) {
+        return NULL;
+    }
+    return kyros_tls_cache_lookup(cache, id, (uint8_t)length);
+}
+
+static void kyros_tls_cache_server_remove(SSL_CTX* ctx, SSL_SESSION* session)
+{
+    auto cache = kyros_tls_cache_from_ctx(ctx);
+    unsigned int length = 0;
+    auto id = SSL_SESSION_get_id(session, &length);
+    if (cache && length && length <= SSL_MAX_SSL_SESSION_ID_LENGTH) {
+        kyros_tls_cache_remove(cache, id, (uint8_t)length);
+    }
+}
+
+///
+/// Server, session tickets
+///
+
+static void kyros_tls_ticket_key_generate(kyros_tls_ticket_key* key)
+{
+    RAND_bytes(key->name, sizeof(key->name));
+    RAND_bytes(key->aes_key, sizeof(key->aes_key));
+    RAND_bytes(key->hmac_key, sizeof(key->hmac_key));
+}
+
+static int kyros_tls_ticket_key_callback(SSL* ssl, uint8_t* name, uint8_t* iv, EVP_CIPHER_CTX* cipher, HMAC_CTX* hmac, int encrypt)
+{
+    auto cache = kyros_tls_cache_from_ctx(SSL_get_SSL_CTX(ssl));
+    if (!cache) {
+        return 0;
+    }
+    // only freed one full rotation after being replaced, much longer than this call
+    auto keys = atomic_load_explicit(&cache->ticket_keys, memory_order_acquire);
+    if (encrypt) {
+        auto key = &keys->current;
+        if (!RAND_bytes(iv, 16)) {
+            return -1;
+        }
+        memcpy(name, key->name, sizeof(key->name));
+        if (!EVP_EncryptInit_ex(cipher, EVP_aes_256_cbc(), NULL, key->aes_key, iv)
+            || !HMAC_Init_ex(hmac, key->hmac_key, sizeof(key->hmac_key), EVP_sha256(), NULL)) {
+            return -1;
+        }
+        return 1;
+    }
+    kyros_tls_ticket_key* key = NULL;
+    if (!memcmp(name, keys->current.name, sizeof(keys->current.name))) {
+        key = &keys->current;
+    } else if (!memcmp(name, keys->previous.name, sizeof(keys->previous.name))) {
+        key = &keys->previous;
+    }
+    if (!key) {
+        // unknown or too old, full handshake
+        return 0;
+    }
+    if (!HMAC_Init_ex(hmac, key->hmac_key, sizeof(key->hmac_key), EVP_sha256(), NULL)
+        || !EVP_DecryptInit_ex(cipher, EVP_aes_256_cbc(), NULL, key->aes_key, iv)) {
+        return -1;
+    }
+    // 2 = accept but issue a new ticket with the current key, always on TLS 1.3 where clients
+    // use each ticket once and OpenSSL only sends one after a resumption when asked to
+    return key == &keys->current && SSL_version(ssl) != TLS1_3_VERSION ? 1 : 2;
+}
+
+void kyros_tls_session_cache_rotate_ticket_keys(kyros_tls_session_cache* cache)
+{
+    auto keys = (kyros_tls_ticket_keys*)kyros_alloc(sizeof(kyros_tls_ticket_keys));
+    kyros_tls_ticket_key_generate(&keys->current);
+    uv_mutex_lock(&cache->rotation_lock);
+    auto old = atomic_load_explicit(&cache->ticket_keys, memory_order_relaxed);
+    keys->previous = old->current;
+    atomic_store_explicit(&cache->ticket_keys, keys, memory_order_release);
+    // the keys replaced last time were unpublished a whole period ago, no reader can still hold them
+    if (cache->retired_ticket_keys) {
+        kyros_free(cache->retired_ticket_keys);
+    }
+    cache->retired_ticket_keys = old;
+    uv_mutex_unlock(&cache->rotation_lock);
+    atomic_fetch_add_explicit(&cache->rotations, 1, memory_order_relaxed);
+}
+
+static void kyros_tls_session_cache_rotation_task(void* ctx)
+{
+    kyros_tls_session_cache_rotate_ticket_keys((kyros_tls_session_cache*)ctx);
+}
+
+///
+/// Client, sessions by host:port
+///
+
+static int kyros_tls_cache_client_new(SSL* ssl, SSL_SESSION* session)
+{
+    auto cache = kyros_tls_cache_from_ctx(SSL_get_SSL_CTX(ssl));
+    auto hash = (uint64_t)(uintptr_t)SSL_get_ex_data(ssl, kyros_tls_cache_ssl_index);
+    if (!cache || !hash) {
+        return 0;
+    }
+    kyros_tls_cache_store(cache, (const uint8_t*)&hash, sizeof(hash), session);
+    return 1;
+}
+
+void kyros_tls_session_cache_prepare_client(SSL* ssl, const char* host, uint16_t port)
+{
+    auto cache = kyros_tls_cache_from_ctx(SSL_get_SSL_CTX(ssl));
+    if (!cache) {
+        return;
+    }
+    auto hash = kyros_tls_cache_hash((const uint8_t*)host, strlen(host), 0xcbf29ce484222325ULL);
+    hash = kyros_tls_cache_hash((const uint8_t*)&port, sizeof(port), hash);
+    SSL_set_ex_data(ssl, kyros_tls_cache_ssl_index, (void*)(uintptr_t)hash);
+    auto session = kyros_tls_cache_lookup(cache, (const uint8_t*)&hash, sizeof(hash));
+    if (session) {
+        // SSL_set_session takes its own reference
+        SSL_set_session(ssl, session);
+        SSL_SESSION_free(session);
+    }
+}
+
+///
+/// Public API
+///
+
+kyros_tls_session_cache* kyros_tls_session_cache_create(kyros_tls_session_cache_options options)
+{
+    uv_once(&kyros_tls_cache_index_once, kyros_tls_cache_create_indexes);
+    auto cache = (kyros_tls_session_cache*)kyros_alloc_aligned(sizeof(kyros_tls_session_cache), KYROS_CACHE_LINE);
+    auto max_sessions = options.max_sessions ? options.max_sessions : KYROS_TLS_CACHE_DEFAULT_SESSIONS;
+    // power of 2 slots per shard, at least the probe window
+    uint32_t slots = KYROS_TLS_CACHE_PROBES;
+    while ((uint64_t)slots * KYROS_TLS_CACHE_SHARDS < max_sessions) {
+        slots <<= 1;
+    }
+    for (uint32_t i = 0; i < KYROS_TLS_CACHE_SHARDS; i++) {
+        auto shard = &cache->shards[i];
+        uv_rwlock_init(&shard->lock);
+        shard->entries = (kyros_tls_cache_entry*)kyros_alloc(sizeof(kyros_tls_cache_entry) * slots);
+        memset(shard->entries, 0, sizeof(kyros_tls_cache_entry) * slots);
+        shard->mask = slots - 1;
+        atomic_init(&shard->hits, 0);
+        atomic_init(&shard->misses, 0);
+        atomic_init(&shard->stored, 0);
+        atomic_init(&shard->evicted, 0);
+    }
+    cache->session_timeout = options.session_timeout ? options.session_timeout : KYROS_TLS_CACHE_DEFAULT_TIMEOUT;
+    cache->ticket_key_rotation = options.ticket_key_rotation ? options.ticket_key_rotation : KYROS_TLS_TICKET_KEY_ROTATION;
+    auto keys = (kyros_tls_ticket_keys*)kyros_alloc(sizeof(kyros_tls_ticket_keys));
+    kyros_tls_ticket_key_generate(&keys->current);
+    // never matches a real ticket
+    kyros_tls_ticket_key_generate(&keys->previous);
+    atomic_init(&cache->ticket_keys, keys);
+    cache->retired_ticket_keys = NULL;
+    uv_mutex_init(&cache->rotation_lock);
+    atomic_init(&cache->rotations, 0);
+    cache->rotation_timer = NULL;
+    return cache;
+}
+
+void kyros_tls_session_cache_attach_server(kyros_tls_session_cache* cache, SSL_CTX* ctx, kyros_loop* loop)
+{
+    SSL_CTX_set_ex_data(ctx, kyros_tls_cache_ctx_index, cache);
+    // only our sharded cache, the internal one has a single lock per SSL_CTX
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL);
+    SSL_CTX_set_timeout(ctx, cache->session_timeout);
+    SSL_CTX_sess_set_new_cb(ctx, kyros_tls_cache_server_new);
+    SSL_CTX_sess_set_get_cb(ctx, kyros_tls_cache_server_get);
+    SSL_CTX_sess_set_remove_cb(ctx, kyros_tls_cache_server_remove);
+    SSL_CTX_set_tlsext_ticket_key_cb(ctx, kyros_tls_ticket_key_callback);
+    if (!cache->rotation_timer && loop) {
+        // does not keep the loop alive
+        cache->rotation_timer = kyros_loop_timer(loop, kyros_tls_session_cache_rotation_task, cache, cache->ticket_key_rotation, cache->ticket_key_rotation, false);
+    }
+}
+
+void kyros_tls_session_cache_attach_client(kyros_tls_session_cache* cache, SSL_CTX* ctx)
+{
+    SSL_CTX_set_ex_data(ctx, kyros_tls_cache_ctx_index, cache);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL);
+    SSL_CTX_sess_set_new_cb(ctx, kyros_tls_cache_client_new);
+}
+
+kyros_tls_session_cache_stats kyros_tls_session_cache_get_stats(kyros_tls_session_cache* cache)
+{
+    kyros_tls_session_cache_stats stats = {
+        .ticket_key_rotations = atomic_load_explicit(&cache->rotations, memory_order_relaxed),
+    };
+    for (uint32_t i = 0; i < KYROS_TLS_CACHE_SHARDS; i++) {
+        auto shard = &cache->shards[i];
+        stats.hits += atomic_load_explicit(&shard->hits, memory_order_relaxed);
+        stats.misses += atomic_load_explicit(&shard->misses, memory_order_relaxed);
+        stats.stored += atomic_load_explicit(&shard->stored, memory_order_relaxed);
+        stats.evicted += atomic_load_explicit(&shard->evicted, memory_order_relaxed);
+    }
+    return stats;
+}
+
+void kyros_tls_session_cache_destroy(kyros_tls_session_cache* cache)
+{
+    if (cache->rotation_timer) {
+        kyros_timer_stop(cache->rotation_timer);
+        kyros_timer_unref(cache->rotation_timer);
+    }
+    for (uint32_t i = 0; i < KYROS_TLS_CACHE_SHARDS; i++) {
+        auto shard = &cache->shards[i];
+        for (uint32_t j = 0; j <= shard->mask; j++) {
+            if (shard->entries[j].session) {
+                SSL_SESSION_free(shard->entries[j].session);
+            }
+        }
+        kyros_free(shard->entries);
+        uv_rwlock_destroy(&shard->lock);
+    }
+    kyros_free(atomic_load(&cache->ticket_keys));
+    if (cache->retired_ticket_keys) {
+        kyros_free(cache->retired_ticket_keys);
+    }
+    uv_mutex_destroy(&cache->rotation_lock);
+    kyros_free_aligned(cache);
+}
@@ -0,0 +1,833 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+// recvmmsg, sendmmsg and struct mmsghdr
+#define _GNU_SOURCE
+#endif
+#include <kyros.h>
+#include <kyros_bsd.h>
+#include <kyros_internal.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <netinet/udp.h>
+#define KYROS_HAS_MMSG 1
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+#endif
+
+static void kyros_udp_poll_callback(uv_poll_t* poll, int status, int events);
+
+static_assert(offsetof(kyros_socket_internal_udp, poll) == offsetof(kyros_socket_internal_tcp, poll), "kyros_socket_get_loop reads udp sockets like tcp ones");
+
+static inline kyros_loop* kyros_udp_get_loop(kyros_socket_internal_udp* udp)
+{
+    // set by uv_poll_init, or by hand while the socket is still resolving (see kyros_udp_create)
+    return (kyros_loop*)udp->poll.poll.loop;
+}
+
+static inline uv_os_sock_t kyros_udp_fd(kyros_socket_internal_udp* udp)
+{
+    uv_os_fd_t fd;
+    uv_fileno((uv_handle_t*)&udp->poll.poll, &fd);
+    return (uv_os_sock_t)fd;
+}
+
+static inline kyros_socket kyros_udp_socket(kyros_socket_internal_udp* udp)
+{
+    return kyros_socket_from_internal(&udp->socket);
+}
+
+static void kyros_udp_notify_status(kyros_socket_internal_udp* udp, kyros_socket_error error)
+{
+    auto handler = udp->handlers;
+    if (handler && handler->onstatus) {
+        handler->onstatus(kyros_udp_socket(udp), error, handler->ctx);
+    }
+}
+
+static void kyros_udp_close_callback(uv_handle_t* handle)
+{
+    auto udp = kyros_container_of((uv_poll_t*)handle, kyros_socket_internal_udp, poll.poll);
+    kyros_socket_unref(kyros_udp_socket(udp));
+}
+
+///
+/// Batch
+///
+
+static void kyros_udp_batch_reset(kyros_socket_internal_udp* udp)
+{
+    auto batch = udp->batch;
+    if (batch->data) {
+        kyros_buffer_pool_release(&kyros_get_internal_loop(kyros_udp_get_loop(udp))->buffer_pool, batch->data, batch->capacity);
+        batch->data = NULL;
+    }
+    batch->length = 0;
+    batch->count = 0;
+    batch->sent = 0;
+}
+
+/// @brief copy peer as the socket family wants it (ipv4 peers of a dual stack socket are mapped), returns 0 if it can't be reached
+static socklen_t kyros_udp_peer_address(kyros_socket_internal_udp* udp, const struct sockaddr* peer, struct sockaddr_storage* address)
+{
+    if (peer->sa_family == AF_INET && udp->family == AF_INET6) {
+        auto in = (const struct sockaddr_in*)peer;
+        auto in6 = (struct sockaddr_in6*)address;
+        *in6 = (struct sockaddr_in6) { .sin6_family = AF_INET6, .sin6_port = in->sin_port };
+        in6->sin6_addr.s6_addr[10] = 0xff;
+        in6->sin6_addr.s6_addr[11] = 0xff;
+        memcpy(&in6->sin6_addr.s6_addr[12], &in->sin_addr, 4);
+        return sizeof(struct sockaddr_in6);
+    }
+    if (peer->sa_family != udp->family) {
+        return 0;
+    }
+    socklen_t length = peer->sa_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+    memcpy(address, peer, length);
+    return length;
+}
+
+/// @brief a datagram can join the last message as one more GSO segment if it goes to the same peer and is not bigger than
+/// the segments already there (only the last segment can be shorter)
+static inline bool kyros_udp_can_coalesce(kyros_socket_internal_udp* udp, kyros_udp_message* last, uint32_t length, const struct sockaddr_storage* peer, socklen_t peer_length)
+{
+    if (!udp->gso || last->peer_length != peer_length || (peer_length && memcmp(&last->peer, peer, peer_length))) {
+        return false;
+    }
+    if (last->segments == KYROS_UDP_GSO_SEGMENTS || last->length + length > KYROS_UDP_GSO_MAX_BYTES) {
+        return false;
+    }
+    uint32_t segment_size = last->segments == 1 ? last->length : last->segment_size;
+    return length && length <= segment_size && segment_size < udp->gso_limit && last->length == segment_size * last->segments;
+}
+
+/// @brief false if the batch has no room for it
+static bool kyros_udp_batch_append(kyros_socket_internal_udp* udp, const char* data, uint32_t length, const struct sockaddr_storage* peer, socklen_t peer_length)
+{
+    auto batch = udp->batch;
+    if (!batch->data) {
+        batch->capacity = KYROS_UDP_SEND_BUFFER;
+        batch->data = kyros_buffer_pool_get(&kyros_get_internal_loop(kyros_udp_get_loop(udp))->buffer_pool, &batch->capacity);
+    }
+    if (batch->length + length > batch->capacity) {
+        return false;
+    }
+    auto last = batch->count > batch->sent ? &batch->messages[batch->count - 1] : NULL;
+    if (last && kyros_udp_can_coalesce(udp, last, length, peer, peer_length)) {
+        if (last->segments == 1) {
+            last->segment_size = (uint16_t)last->length;
+        }
+        last->segments++;
+        last->length += length;
+    } else {
+        if (batch->count == KYROS_UDP_SEND_BATCH) {
+            return false;
+        }
+        auto message = &batch->messages[batch->count++];
+        message->offset = batch->length;
+        message->length = length;
+        message->segment_size = 0;
+        message->segments = 1;
+        message->peer_length = peer_length;
+        memcpy(&message->peer, peer, peer_length);
+    }
+    memcpy(batch->data + batch->length, data, length);
+    batch->length += length;
+    return true;
+}
+
+///
+/// Send
+///
+
+/// @brief messages the kernel took starting at first, -1 with the error of the first one
+static int kyros_udp_send_messages(uv_os_sock_t fd, kyros_udp_batch* batch, uint32_t first, uint32_t count)
+{
+#ifdef KYROS_HAS_MMSG
+    struct mmsghdr messages[KYROS_UDP_SEND_BATCH];
+    struct iovec iovs[KYROS_UDP_SEND_BATCH];
+    union {
+        char buffer[CMSG_SPACE(sizeof(uint16_t))];
+        struct cmsghdr align;
+    } controls[KYROS_UDP_SEND_BATCH];
+    for (uint32_t i = 0; i < count; i++) {
+        auto message = &batch->messages[first + i];
+        iovs[i] = (struct iovec) { .iov_base = batch->data + message->offset, .iov_len = message->length };
+        messages[i] = (struct mmsghdr) {
+            .msg_hdr = {
+                .msg_name = message->peer_length ? &message->peer : NULL,
+                .msg_namelen = message->peer_length,
+                .msg_iov = &iovs[i],
+                .msg_iovlen = 1,
+            },
+        };
+        if (message->segments > 1) {
+            // the kernel cuts it in segment_size datagrams (in the NIC when it can)
+            auto header = &messages[i].msg_hdr;
+            header->msg_control = controls[i].buffer;
+            header->msg_controllen = sizeof(controls[i].buffer);
+            auto control = CMSG_FIRSTHDR(header);
+            control->cmsg_level = SOL_UDP;
+            control->cmsg_type = UDP_SEGMENT;
+            control->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            memcpy(CMSG_DATA(control), &message->segment_size, sizeof(uint16_t));
+        }
+    }
+    int sent;
+    do {
+        sent = sendmmsg(fd, messages, count, 0);
+    } while (kyros_bsd_interrupted(sent));
+    return sent;
+#else
+    // one sendto per datagram where there is no batch syscall (no GSO either, messages are single datagrams)
+    for (uint32_t i = 0; i < count; i++) {
+        auto message = &batch->messages[first + i];
+        auto peer = message->peer_length ? (const struct sockaddr*)&message->peer : NULL;
+        int64_t sent;
+        do {
+            sent = sendto(fd, batch->data + message->offset, message->length, 0, peer, message->peer_length);
+        } while (kyros_bsd_interrupted(sent));
+        if (sent < 0) {
+            return i ? (int)i : -1;
+        }
+    }
+    return (int)count;
+#endif
+}
+
+/// @brief a message the kernel refused is dropped like the network would, GSO runs are retried one datagram at a time
+static void kyros_udp_on_send_error(kyros_socket_internal_udp* udp, uv_os_sock_t fd, kyros_udp_message* message, int error)
+{
+#ifdef KYROS_HAS_MMSG
+    if (message->segments == 1 || (error != EIO && error != EINVAL)) {
+        return;
+    }
+    if (error == EIO) {
+        // the device can't checksum the segments
+        udp->gso = false;
+    } else {
+        // segments bigger than the path mtu
+        udp->gso_limit = message->segment_size;
+    }
+    auto data = udp->batch->data + message->offset;
+    auto peer = message->peer_length ? (const struct sockaddr*)&message->peer : NULL;
+    for (uint32_t offset = 0; offset < message->length; offset += message->segment_size) {
+        auto length = message->length - offset < message->segment_size ? message->length - offset : message->segment_size;
+        sendto(fd, data + offset, length, 0, peer, message->peer_length);
+    }
+#endif
+}
+
+bool kyros_udp_flush(kyros_socket_internal_udp* udp)
+{
+    auto batch = udp->batch;
+    if (!batch || batch->sent == batch->count) {
+        return true;
+    }
+    if (!udp->socket.has_poll || udp->blocked) {
+        return false;
+    }
+    auto fd = kyros_udp_fd(udp);
+    while (batch->sent < batch->count) {
+        auto count = kyros_udp_send_messages(fd, batch, batch->sent, batch->count - batch->sent);
+        if (count < 0) {
+            auto error = kyros_bsd_errno();
+            if (kyros_bsd_would_block(error)) {
+                udp->blocked = true;
+                kyros_udp_update_poll(udp);
+                return false;
+            }
+            kyros_udp_on_send_error(udp, fd, &batch->messages[batch->sent], error);
+            count = 1;
+        }
+        batch->sent += (uint32_t)count;
+    }
+    kyros_udp_batch_reset(udp);
+    return true;
+}
+
+/// @brief ondrain once a batch that refused datagrams was sent
+static void kyros_udp_check_drain(kyros_socket_internal_udp* udp)
+{
+    if (!udp->socket.over_high_watermark) {
+        return;
+    }
+    udp->socket.over_high_watermark = false;
+    auto handler = udp->handlers;
+    if (handler && handler->ondrain) {
+        handler->ondrain(kyros_udp_socket(udp), handler->ctx);
+    }
+}
+
+static void kyros_udp_queue(kyros_socket_internal_udp* udp)
+{
+    // blocked sockets are flushed by the writable poll
+    if (udp->send_queued || udp->blocked) {
+        return;
+    }
+    auto internal = kyros_get_internal_loop(kyros_udp_get_loop(udp));
+    udp->send_queued = true;
+    udp->send_next = internal->udp_sends;
+    internal->udp_sends = udp;
+    // the list holds a ref, sockets closed meanwhile are skipped
+    udp->socket.ref_count++;
+}
+
+void kyros_udp_flush_sends(kyros_loop_internal* internal)
+{
+    while (internal->udp_sends) {
+        auto udp = internal->udp_sends;
+        internal->udp_sends = udp->send_next;
+        udp->send_next = NULL;
+        udp->send_queued = false;
+        // still resolving, queued again once it has a fd
+        if (udp->socket.status != KYROS_SOCKET_STATE_CLOSED && udp->socket.has_poll && kyros_udp_flush(udp)) {
+            kyros_udp_check_drain(udp);
+        }
+        kyros_socket_unref(kyros_udp_socket(udp));
+    }
+}
+
+bool kyros_udp_send(kyros_socket_internal_udp* udp, const char* data, uint32_t length, const struct sockaddr* peer)
+{
+    if (udp->socket.status == KYROS_SOCKET_STATE_CLOSED || length > KYROS_UDP_MAX_DATAGRAM || (!peer && !udp->connected)) {
+        return false;
+    }
+    struct sockaddr_storage address;
+    socklen_t address_length = 0;
+    if (peer && !(address_length = kyros_udp_peer_address(udp, peer, &address))) {
+        return false;
+    }
+    if (!udp->batch) {
+        udp->batch = (kyros_udp_batch*)kyros_calloc(1, sizeof(kyros_udp_batch));
+    }
+    if (!kyros_udp_batch_append(udp, data, length, &address, address_length)) {
+        // full, what is there goes out now to make room
+        if (!kyros_udp_flush(udp) || !kyros_udp_batch_append(udp, data, length, &address, address_length)) {
+            udp->socket.over_high_watermark = true;
+            return false;
+        }
+    }
+    kyros_udp_queue(udp);
+    return true;
+}
+
+uint64_t kyros_udp_buffer_size(kyros_socket_internal_udp* udp)
+{
+    auto batch = udp->batch;
+    if (!batch || batch->sent == batch->count) {
+        return 0;
+    }
+    return batch->length - batch->messages[batch->sent].offset;
+}
+
+///
+/// Receive
+///
+
+typedef struct {
+    uint32_t length;
+    // UDP GRO, the message holds datagrams of this size (the last one can be shorter), 0 for a single datagram
+    uint32_t segment_size;
+    socklen_t peer_length;
+    bool truncated;
+} kyros_udp_received;
+
+/// @brief read up to slots datagrams in slot_size pieces of buffer, returns how many or -1 (errno)
+static int kyros_udp_receive(uv_os_sock_t fd, char* buffer, uint32_t slots, uint32_t slot_size, struct sockaddr_storage* peers, kyros_udp_received* received)
+{
+#ifdef KYROS_HAS_MMSG
+    struct mmsghdr messages[KYROS_UDP_RECV_BATCH];
+    struct iovec iovs[KYROS_UDP_RECV_BATCH];
+    union {
+        char buffer[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } controls[KYROS_UDP_RECV_BATCH];
+    for (uint32_t i = 0; i < slots; i++) {
+        iovs[i] = (struct iovec) { .iov_base = buffer + (uint64_t)i * slot_size, .iov_len = slot_size };
+        messages[i] = (struct mmsghdr) {
+            .msg_hdr = {
+                .msg_name = &peers[i],
+                .msg_namelen = sizeof(struct sockaddr_storage),
+                .msg_iov = &iovs[i],
+                .msg_iovlen = 1,
+                .msg_control = controls[i].buffer,
+                .msg_controllen = sizeof(controls[i].buffer),
+            },
+        };
+    }
+    int count;
+    do {
+        count = recvmmsg(fd, messages, slots, 0, NULL);
+    } while (kyros_bsd_interrupted(count));
+    for (int i = 0; i < count; i++) {
+        auto header = &messages[i].msg_hdr;
+        received[i] = (kyros_udp_received) {
+            .length = messages[i].msg_len,
+            .peer_length = header->msg_namelen,
+            .truncated = (header->msg_flags & MSG_TRUNC) != 0,
+        };
+        for (auto control = CMSG_FIRSTHDR(header); control; control = CMSG_NXTHDR(header, control)) {
+            if (control->cmsg_level == SOL_UDP && control->cmsg_type == UDP_GRO) {
+                int segment_size;
+                memcpy(&segment_size, CMSG_DATA(control), sizeof(int));
+                received[i].segment_size = (uint32_t)segment_size;
+            }
+        }
+    }
+    return count;
+#else
+    // slots are big enough for any datagram here, recvfrom can't tell if one was cut
+    uint32_t count = 0;
+    for (; count < slots; count++) {
+        socklen_t peer_length = sizeof(struct sockaddr_storage);
+        int64_t length;
+        do {
+            length = recvfrom(fd, buffer + (uint64_t)count * slot_size, slot_size, 0, (struct sockaddr*)&peers[count], &peer_length);
+        } while (kyros_bsd_interrupted(length));
+        if (length < 0) {
+            break;
+        }
+        received[count] = (kyros_udp_received) { .length = (uint32_t)length, .peer_length = peer_length };
+    }
+    return count ? (int)count : -1;
+#endif
+}
+
+/// @brief returns false if the socket was closed
+static bool kyros_udp_deliver(kyros_socket_internal_udp* udp, const kyros_udp_datagram* datagrams, uint32_t count)
+{
+    auto handler = udp->handlers;
+    if (count && handler && handler->ondatagrams) {
+        handler->ondatagrams(kyros_udp_socket(udp), datagrams, count, handler->ctx);
+    }
+    return udp->socket.status != KYROS_SOCKET_STATE_CLOSED;
+}
+
+static void kyros_udp_on_readable(kyros_socket_internal_udp* udp)
+{
+    auto fd = kyros_udp_fd(udp);
+    auto buffer = kyros_loop_get_recv_buffer(kyros_udp_get_loop(udp));
+#ifdef KYROS_HAS_MMSG
+    // GRO messages can be 64 KiB, otherwise bigger datagrams are cut (and dropped)
+    uint32_t slots = udp->gro ? KYROS_UDP_GRO_BATCH : KYROS_UDP_RECV_BATCH;
+#else
+    uint32_t slots = KYROS_UDP_GRO_BATCH;
+#endif
+    uint32_t slot_size = KYROS_RECV_BUFFER_SIZE / slots;
+    struct sockaddr_storage peers[KYROS_UDP_RECV_BATCH];
+    kyros_udp_received received[KYROS_UDP_RECV_BATCH];
+    kyros_udp_datagram datagrams[KYROS_UDP_DELIVER_MAX];
+    for (uint32_t round = 0; round < KYROS_UDP_RECV_ROUNDS && !udp->socket.is_paused; round++) {
+        auto count = kyros_udp_receive(fd, buffer, slots, slot_size, peers, received);
+        if (count < 0) {
+            // would block, or an icmp error of a connected socket (consumed by the read)
+            if (kyros_bsd_would_block(kyros_bsd_errno())) {
+                return;
+            }
+            continue;
+        }
+        uint32_t pending = 0;
+        for (int i = 0; i < count; i++) {
+            if (received[i].truncated) {
+                continue;
+            }
+            auto data = buffer + (uint64_t)i * slot_size;
+            auto length = received[i].length;
+            auto segment_size = received[i].segment_size ? received[i].segment_size : length;
+            uint32_t offset = 0;
+            do {
+                auto size = length - offset < segment_size ? length - offset : segment_size;
+                datagrams[pending++] = (kyros_udp_datagram) {
+                    .data = data + offset,
+                    .length = size,
+                    .peer = (const struct sockaddr*)&peers[i],
+                    .peer_length = received[i].peer_length,
+                };
+                offset += size;
+                if (pending == KYROS_UDP_DELIVER_MAX) {
+                    if (!kyros_udp_deliver(udp, datagrams, pending)) {
+                        return;
+                    }
+                    pending = 0;
+                }
+            } while (offset < length);
+        }
+        if (!kyros_udp_deliver(udp, datagrams, pending) || (uint32_t)count < slots) {
+            return;
+        }
+    }
+}
+
+///
+/// Poll
+///
+
+void kyros_udp_update_poll(kyros_socket_internal_udp* udp)
+{
+    if (!udp->socket.has_poll) {
+        return;
+    }
+    int events = 0;
+    if (udp->socket.status != KYROS_SOCKET_STATE_CLOSED) {
+        if (!udp->socket.is_paused) {
+            events |= KYROS_SOCKET_READABLE;
+        }
+        if (udp->blocked) {
+            events |= KYROS_SOCKET_WRITABLE;
+        }
+    }
+    if (udp->socket.poll_events == events) {
+        return;
+    }
+    udp->socket.poll_events = events;
+    if (events) {
+        uv_poll_start(&udp->poll.poll, events, kyros_udp_poll_callback);
+    } else {
+        uv_poll_stop(&udp->poll.poll);
+    }
+}
+
+static void kyros_udp_poll_callback(uv_poll_t* poll, int status, int events)
+{
+    auto udp = kyros_container_of(poll, kyros_socket_internal_udp, poll.poll);
+    if (status < 0) {
+        // libuv stops the handle on POLLERR, for udp that is an icmp error of a connected socket and it does not end it
+        kyros_bsd_socket_error(kyros_udp_fd(udp));
+        udp->socket.poll_events = 0;
+        kyros_udp_update_poll(udp);
+        return;
+    }
+    if (events & KYROS_SOCKET_WRITABLE) {
+        udp->blocked = false;
+        if (kyros_udp_flush(udp)) {
+            kyros_udp_update_poll(udp);
+            kyros_udp_check_drain(udp);
+        }
+        if (udp->socket.status == KYROS_SOCKET_STATE_CLOSED) {
+            return;
+        }
+    }
+    if (events & KYROS_SOCKET_READABLE) {
+        kyros_udp_on_readable(udp);
+    }
+}
+
+///
+/// Create
+///
+
+static kyros_socket_internal_udp* kyros_udp_create(kyros_loop* loop, kyros_socket_handler* handler, bool connected)
+{
+    auto udp = (kyros_socket_internal_udp*)kyros_alloc(sizeof(kyros_socket_internal_udp));
+    *udp = (kyros_socket_internal_udp) {
+        .socket = {
+            .ref_count = 1,
+            .status = KYROS_SOCKET_STATE_CONNECTING,
+            .is_client = connected,
+            .tag = KYROS_SOCKET_UDP,
+        },
+        .handlers = handler,
+        .gso_limit = UINT16_MAX,
+        .connected = connected,
+    };
+    // uv_poll_init will set it again, but we need the loop before having a fd (resolving)
+    udp->poll.poll.loop = (uv_loop_t*)loop;
+    if (handler) {
+        handler->ref_count++;
+    }
+    return udp;
+}
+
+static void kyros_udp_attach_fd(kyros_socket_internal_udp* udp, uv_os_sock_t fd, int family)
+{
+    udp->family = family;
+#ifdef KYROS_HAS_MMSG
+    int value = 1;
+    socklen_t length = sizeof(int);
+    udp->gro = setsockopt(fd, SOL_UDP, UDP_GRO, &value, sizeof(int)) == 0;
+    // kernels that know UDP_SEGMENT can answer it (4.18+), the first EIO still turns it off
+    udp->gso = getsockopt(fd, SOL_UDP, UDP_SEGMENT, &value, &length) == 0;
+#endif
+    udp->socket.status = KYROS_SOCKET_STATE_OPEN;
+    uv_poll_init_socket((uv_loop_t*)kyros_udp_get_loop(udp), &udp->poll.poll, fd);
+    udp->socket.has_poll = true;
+    kyros_udp_update_poll(udp);
+    if (udp->batch && udp->batch->count) {
+        // written while resolving
+        kyros_udp_queue(udp);
+    }
+}
+
+static void kyros_udp_close_with_error(kyros_socket_internal_udp* udp, kyros_socket_error error)
+{
+    if (udp->socket.status == KYROS_SOCKET_STATE_CLOSED) {
+        return;
+    }
+    udp->socket.status = KYROS_SOCKET_STATE_CLOSED;
+    if (udp->batch) {
+        // datagrams not sent yet are dropped
+        kyros_udp_batch_reset(udp);
+        kyros_free(udp->batch);
+        udp->batch = NULL;
+    }
+    if (udp->socket.has_poll) {
+        uv_poll_stop(&udp->poll.poll);
+        udp->socket.poll_events = 0;
+        kyros_bsd_close(kyros_udp_fd(udp));
+    }
+    kyros_udp_notify_status(udp, error);
+    auto handler = udp->handlers;
+    if (handler) {
+        handler->ref_count--;
+        udp->handlers = NULL;
+    }
+    if (udp->socket.has_poll) {
+        // memory is released in the close callback
+        uv_close((uv_handle_t*)&udp->poll.poll, kyros_udp_close_callback);
+    } else {
+        kyros_socket_unref(kyros_udp_socket(udp));
+    }
+}
+
+void kyros_udp_close(kyros_socket_internal_udp* udp)
+{
+    kyros_udp_close_with_error(udp, (kyros_socket_error) { .type = KYROS_SOCKET_ERROR_NO_ERROR });
+}
+
+typedef struct {
+    kyros_socket_internal_udp* socket;
+    kyros_socket_error error;
+} kyros_udp_deferred_status;
+
+static void kyros_udp_deferred_status_callback(void* ctx)
+{
+    kyros_udp_deferred_status* deferred = ctx;
+    auto udp = deferred->socket;
+    if (udp->socket.status != KYROS_SOCKET_STATE_CLOSED) {
+        if (deferred->error.type != KYROS_SOCKET_ERROR_NO_ERROR) {
+            kyros_udp_close_with_error(udp, deferred->error);
+        } else {
+            kyros_udp_notify_status(udp, deferred->error);
+        }
+    }
+    kyros_socket_unref(kyros_udp_socket(udp));
+    kyros_free(deferred);
+}
+
+/// @brief report a status on the next tick, so the caller of kyros_socket_connect has the socket first
+static void kyros_udp_defer_status(kyros_socket_internal_udp* udp, kyros_socket_error error)
+{
+    auto deferred = (kyros_udp_deferred_status*)kyros_alloc(sizeof(kyros_udp_deferred_status));
+    deferred->socket = udp;
+    deferred->error = error;
+    udp->socket.ref_count++;
+    kyros_loop_defer(kyros_udp_get_loop(udp), kyros_udp_deferred_status_callback, deferred);
+}
+
+///
+/// Connect
+///
+
+/// @brief a connected udp socket only talks to address, returns 0 or a system error
+static int kyros_udp_start_connect(kyros_socket_internal_udp* udp, const struct sockaddr* address, socklen_t length)
+{
+    auto fd = kyros_bsd_create_socket(address->sa_family, SOCK_DGRAM);
+    if (fd == KYROS_INVALID_SOCKET) {
+        return kyros_bsd_errno();
+    }
+    if (connect(fd, address, length) != 0) {
+        auto error = kyros_bsd_errno();
+        kyros_bsd_close(fd);
+        return error;
+    }
+    kyros_udp_attach_fd(udp, fd, address->sa_family);
+    return 0;
+}
+
+typedef struct {
+    uv_getaddrinfo_t request;
+    kyros_socket_internal_udp* socket;
+} kyros_udp_dns_request;
+
+static void kyros_udp_dns_callback(uv_getaddrinfo_t* request, int status, struct addrinfo* addresses)
+{
+    auto dns = kyros_container_of(request, kyros_udp_dns_request, request);
+    auto udp = dns->socket;
+    if (udp->socket.status != KYROS_SOCKET_STATE_CLOSED) {
+        if (status < 0) {
+            kyros_udp_close_with_error(udp, kyros_socket_uv_error(KYROS_SOCKET_ERROR_CONNECTING_ERROR, status));
+        } else {
+            int error = 0;
+            for (auto address = addresses; address; address = address->ai_next) {
+                error = kyros_udp_start_connect(udp, address->ai_addr, address->ai_addrlen);
+                if (!error) {
+                    break;
+                }
+            }
+            if (error) {
+                kyros_udp_close_with_error(udp, kyros_socket_system_error(KYROS_SOCKET_ERROR_CONNECTING_ERROR, error));
+            } else {
+                kyros_udp_notify_status(udp, (kyros_socket_error) { .type = KYROS_SOCKET_ERROR_NO_ERROR });
+            }
+        }
+    }
+    uv_freeaddrinfo(addresses);
+    kyros_socket_unref(kyros_udp_socket(udp));
+    kyros_free(dns);
+}
+
+static void kyros_udp_connect_host_port(kyros_socket_internal_udp* udp, kyros_socket_source source)
+{
+    auto host = source.value.host_port.host ? source.value.host_port.host : "localhost";
+    auto port = source.value.host_port.port;
+    struct sockaddr_storage address;
+    socklen_t length;
+    if (kyros_socket_parse_ip(host, port, source.value.host_port.family, &address, &length)) {
+        auto error = kyros_udp_start_connect(udp, (struct sockaddr*)&address, length);
+        kyros_udp_defer_status(udp, error ? kyros_socket_system_error(KYROS_SOCKET_ERROR_CONNECTING_ERROR, error) : (kyros_socket_error) { 0 });
+        return;
+    }
+    // resolve off the loop thread, the request keeps the socket alive
+    auto dns = (kyros_udp_dns_request*)kyros_alloc(sizeof(kyros_udp_dns_request));
+    dns->socket = udp;
+    udp->socket.ref_count++;
+    char port_string[8];
+    snprintf(port_string, sizeof(port_string), "%u", port);
+    struct addrinfo hints = {
+        .ai_family = kyros_socket_family_hint(source.value.host_port.family),
+        .ai_socktype = SOCK_DGRAM,
+    };
+    auto status = uv_getaddrinfo((uv_loop_t*)kyros_udp_get_loop(udp), &dns->request, kyros_udp_dns_callback, host, port_string, &hints);
+    if (status < 0) {
+        kyros_socket_unref(kyros_udp_socket(udp));
+        kyros_free(dns);
+        kyros_udp_defer_status(udp, kyros_socket_uv_error(KYROS_SOCKET_ERROR_CONNECTING_ERROR, status));
+    }
+}
+
+static int kyros_udp_fd_family(uv_os_sock_t fd)
+{
+    struct sockaddr_storage address;
+    socklen_t length = sizeof(address);
+    return getsockname(fd, (struct sockaddr*)&address, &length) == 0 ? address.ss_family : AF_INET;
+}
+
+kyros_socket kyros_udp_connect(kyros_loop* loop, kyros_socket_source source, kyros_socket_handler* handler)
+{
+    auto udp = kyros_udp_create(loop, handler, true);
+    if (source.type == KYROS_SOCKET_SOURCE_FD) {
+        // only wrap it, connected or not
+        auto fd = kyros_bsd_set_nonblocking((uv_os_sock_t)source.value.fd.fd);
+        struct sockaddr_storage peer;
+        socklen_t peer_length = sizeof(peer);
+        udp->connected = getpeername(fd, (struct sockaddr*)&peer, &peer_length) == 0;
+        kyros_udp_attach_fd(udp, fd, kyros_udp_fd_family(fd));
+        kyros_udp_defer_status(udp, (kyros_socket_error) { .type = KYROS_SOCKET_ERROR_NO_ERROR });
+    } else {
+        kyros_udp_connect_host_port(udp, source);
+    }
+    return kyros_udp_socket(udp);
+}
+
+///
+/// Bind
+///
+
+static uv_os_sock_t kyros_udp_bind_address(const struct sockaddr* address, socklen_t length, bool reuse_port, bool dual_stack)
+{
+    auto fd = kyros_bsd_create_socket(address->sa_family, SOCK_DGRAM);
+    if (fd == KYROS_INVALID_SOCKET) {
+        return fd;
+    }
+    // no SO_REUSEADDR, for udp it lets another process bind the same port
+#ifdef SO_REUSEPORT
+    if (reuse_port) {
+        int enabled = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (const char*)&enabled, sizeof(int));
+    }
+#endif
+#ifdef IPV6_V6ONLY
+    if (address->sa_family == AF_INET6) {
+        int v6_only = !dual_stack;
+        setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, (const char*)&v6_only, sizeof(int));
+    }
+#endif
+    if (bind(fd, address, length) != 0) {
+        kyros_bsd_close(fd);
+        return KYROS_INVALID_SOCKET;
+    }
+    return fd;
+}
+
+static uv_os_sock_t kyros_udp_bind_host_port(kyros_loop* loop, kyros_socket_source source, int* family)
+{
+    kyros_socket_ip_family ip_family = source.value.host_port.family;
+    bool reuse_port = source.value.host_port.reuse_port;
+    struct addrinfo hints = {
+        .ai_family = kyros_socket_family_hint(ip_family),
+        .ai_socktype = SOCK_DGRAM,
+        .ai_flags = AI_PASSIVE,
+    };
+    char port_string[8];
+    snprintf(port_string, sizeof(port_string), "%u", source.value.host_port.port);
+    // binding happens at startup, resolve synchronously (NULL callback)
+    uv_getaddrinfo_t request;
+    if (uv_getaddrinfo((uv_loop_t*)loop, &request, NULL, source.value.host_port.host, port_string, &hints) < 0) {
+        return KYROS_INVALID_SOCKET;
+    }
+    uv_os_sock_t fd = KYROS_INVALID_SOCKET;
+    // prefer a dual stack ipv6 socket when both families are allowed
+    for (auto address = request.addrinfo; address && fd == KYROS_INVALID_SOCKET; address = address->ai_next) {
+        if (address->ai_family == AF_INET6) {
+            fd = kyros_udp_bind_address(address->ai_addr, address->ai_addrlen, reuse_port, ip_family == KYROS_SOCKET_IP_FAMILY_ANY);
+            *family = AF_INET6;
+        }
+    }
+    for (auto address = request.addrinfo; address && fd == KYROS_INVALID_SOCKET; address = address->ai_next) {
+        if (address->ai_family == AF_INET) {
+            fd = kyros_udp_bind_address(address->ai_addr, address->ai_addrlen, reuse_port, false);
+            *family = AF_INET;
+        }
+    }
+    uv_freeaddrinfo(request.addrinfo);
+    return fd;
+}
+
+kyros_socket kyros_udp_bind(kyros_loop* loop, kyros_socket_source source, kyros_socket_handler* handler)
+{
+    uv_os_sock_t fd;
+    int family = AF_INET;
+    if (source.type == KYROS_SOCKET_SOURCE_FD) {
+        fd = kyros_bsd_set_nonblocking((uv_os_sock_t)source.value.fd.fd);
+        family = kyros_udp_fd_family(fd);
+    } else {
+        fd = kyros_udp_bind_host_port(loop, source, &family);
+    }
+    if (fd == KYROS_INVALID_SOCKET) {
+        return (kyros_socket) { 0 };
+    }
+    auto udp = kyros_udp_create(loop, handler, false);
+    kyros_udp_attach_fd(udp, fd, family);
+    return kyros_udp_socket(udp);
+}
+
+///
+/// Public API
+///
+
+bool kyros_socket_send_datagram(kyros_socket socket, const char* data, uint32_t length, const struct sockaddr* peer)
+{
+    if (kyros_get_socket_internal_tag(socket) != KYROS_SOCKET_UDP) {
+        return false;
+    }
+    return kyros_udp_send((kyros_socket_internal_udp*)kyros_get_socket_internal(socket), data, length, peer);
+}
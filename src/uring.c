@@ -0,0 +1,434 @@
+#include <kyros.h>
+#include <kyros_internal.h>
+
+#include <string.h>
+
+// io_uring engine: the sockets of the loop dont poll, their recvs/accepts are multishot operations
+// reading into buffers provided to the kernel and their sends are prepared once per loop iteration
+// and submitted with a single io_uring_enter. Completions are reaped by a uv_poll_t on the ring fd,
+// so timers, kyros_loop_defer and everything else of the uv loop keep working as before
+// the ring is set up with raw syscalls, liburing is not needed for the few operations we use
+
+#ifdef __linux__
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define KYROS_URING_BUFFER_GROUP 0
+#define KYROS_URING_BUFFER_STRIDE (KYROS_URING_BUFFER_SIZE + KYROS_RECV_BUFFER_PADDING)
+
+struct kyros_uring {
+    int fd;
+    // submission queue, sqe_tail is ours until the submit publishes it
+    _Atomic(unsigned)* sq_head;
+    _Atomic(unsigned)* sq_tail;
+    _Atomic(unsigned)* sq_flags;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sqe_tail;
+    // prepared sqes up to here were taken by the kernel
+    unsigned sqe_submitted;
+    struct io_uring_sqe* sqes;
+    // completion queue
+    _Atomic(unsigned)* cq_head;
+    _Atomic(unsigned)* cq_tail;
+    unsigned cq_mask;
+    unsigned cq_entries;
+    struct io_uring_cqe* cqes;
+    // mmaped rings, cq_ring is sq_ring when the kernel has IORING_FEAT_SINGLE_MMAP
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    // sendmsg arguments of each sqe slot, read by the kernel when the sqe is submitted (IORING_FEAT_SUBMIT_STABLE)
+    struct msghdr* messages;
+    struct iovec* iovecs;
+    // provided buffers for the recvs, recycled right after their completion is dispatched
+    struct io_uring_buf_ring* buffer_ring;
+    char* buffers;
+    uint16_t buffer_tail;
+    // readable when the completion queue has something
+    uv_poll_t poll;
+    kyros_loop* loop;
+    // operations that keep the loop alive, the poll is only ref'd while there is one
+    int32_t keep_alive;
+};
+
+static inline int kyros_uring_setup(unsigned entries, struct io_uring_params* params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static inline int kyros_uring_enter(int fd, unsigned to_submit, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, 0, flags, NULL, 0);
+}
+
+static inline int kyros_uring_register(int fd, unsigned opcode, void* arg, unsigned count)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+/// @brief multishot recv (6.0) came with IORING_OP_SEND_ZC, so a kernel knowing that op has everything we use
+static bool kyros_uring_probe(int fd)
+{
+    const unsigned count = 256;
+    auto size = sizeof(struct io_uring_probe) + count * sizeof(struct io_uring_probe_op);
+    auto probe = (struct io_uring_probe*)kyros_calloc(1, size);
+    auto supported = kyros_uring_register(fd, IORING_REGISTER_PROBE, probe, count) == 0 && probe->last_op >= IORING_OP_SEND_ZC;
+    kyros_free(probe);
+    return supported;
+}
+
+static inline void kyros_uring_provide_buffer(kyros_uring* uring, uint16_t id)
+{
+    auto buffer = &uring->buffer_ring->bufs[uring->buffer_tail & (KYROS_URING_BUFFER_COUNT - 1)];
+    buffer->addr = (uint64_t)(uintptr_t)(uring->buffers + (uint64_t)id * KYROS_URING_BUFFER_STRIDE);
+    buffer->len = KYROS_URING_BUFFER_SIZE;
+    buffer->bid = id;
+    uring->buffer_tail++;
+    atomic_store_explicit((_Atomic(uint16_t)*)&uring->buffer_ring->tail, uring->buffer_tail, memory_order_release);
+}
+
+static bool kyros_uring_map(kyros_uring* uring, struct io_uring_params* params)
+{
+    uring->sq_ring_size = params->sq_off.array + params->sq_entries * sizeof(unsigned);
+    uring->cq_ring_size = params->cq_off.cqes + params->cq_entries * sizeof(struct io_uring_cqe);
+    auto single_mmap = (params->features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_mmap && uring->cq_ring_size > uring->sq_ring_size) {
+        uring->sq_ring_size = uring->cq_ring_size;
+    }
+    uring->sq_ring = mmap(NULL, uring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQ_RING);
+    if (uring->sq_ring == MAP_FAILED) {
+        uring->sq_ring = NULL;
+        return false;
+    }
+    uring->cq_ring = uring->sq_ring;
+    if (!single_mmap) {
+        uring->cq_ring = mmap(NULL, uring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_CQ_RING);
+        if (uring->cq_ring == MAP_FAILED) {
+            uring->cq_ring = NULL;
+            return false;
+        }
+    }
+    uring->sqes_size = params->sq_entries * sizeof(struct io_uring_sqe);
+    uring->sqes = mmap(NULL, uring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQES);
+    if (uring->sqes == MAP_FAILED) {
+        uring->sqes = NULL;
+        return false;
+    }
+    auto sq = (char*)uring->sq_ring;
+    uring->sq_head = (_Atomic(unsigned)*)(sq + params->sq_off.head);
+    uring->sq_tail = (_Atomic(unsigned)*)(sq + params->sq_off.tail);
+    uring->sq_flags = (_Atomic(unsigned)*)(sq + params->sq_off.flags);
+    uring->sq_mask = *(unsigned*)(sq + params->sq_off.ring_mask);
+    uring->sq_entries = *(unsigned*)(sq + params->sq_off.ring_entries);
+    // sqe i always goes in slot i, so the array is never touched again
+    auto array = (unsigned*)(sq + params->sq_off.array);
+    for (unsigned i = 0; i < uring->sq_entries; i++) {
+        array[i] = i;
+    }
+    auto cq = (char*)uring->cq_ring;
+    uring->cq_head = (_Atomic(unsigned)*)(cq + params->cq_off.head);
+    uring->cq_tail = (_Atomic(unsigned)*)(cq + params->cq_off.tail);
+    uring->cq_mask = *(unsigned*)(cq + params->cq_off.ring_mask);
+    uring->cq_entries = *(unsigned*)(cq + params->cq_off.ring_entries);
+    uring->cqes = (struct io_uring_cqe*)(cq + params->cq_off.cqes);
+    uring->sqe_tail = atomic_load_explicit(uring->sq_tail, memory_order_relaxed);
+    uring->sqe_submitted = uring->sqe_tail;
+    return true;
+}
+
+static bool kyros_uring_register_buffers(kyros_uring* uring)
+{
+    auto ring_size = KYROS_URING_BUFFER_COUNT * sizeof(struct io_uring_buf);
+    uring->buffer_ring = (struct io_uring_buf_ring*)kyros_alloc_aligned(ring_size, 4096);
+    if (!uring->buffer_ring) {
+        return false;
+    }
+    memset(uring->buffer_ring, 0, ring_size);
+    struct io_uring_buf_reg registration = {
+        .ring_addr = (uint64_t)(uintptr_t)uring->buffer_ring,
+        .ring_entries = KYROS_URING_BUFFER_COUNT,
+        .bgid = KYROS_URING_BUFFER_GROUP,
+    };
+    if (kyros_uring_register(uring->fd, IORING_REGISTER_PBUF_RING, &registration, 1) != 0) {
+        return false;
+    }
+    uring->buffers = (char*)kyros_alloc((uint64_t)KYROS_URING_BUFFER_COUNT * KYROS_URING_BUFFER_STRIDE);
+    for (uint16_t i = 0; i < KYROS_URING_BUFFER_COUNT; i++) {
+        kyros_uring_provide_buffer(uring, i);
+    }
+    return true;
+}
+
+static void kyros_uring_release(kyros_uring* uring)
+{
+    if (uring->sqes) {
+        munmap(uring->sqes, uring->sqes_size);
+    }
+    if (uring->cq_ring && uring->cq_ring != uring->sq_ring) {
+        munmap(uring->cq_ring, uring->cq_ring_size);
+    }
+    if (uring->sq_ring) {
+        munmap(uring->sq_ring, uring->sq_ring_size);
+    }
+    // closing the ring cancels whatever the kernel still has and drops the buffer registration
+    if (uring->fd >= 0) {
+        close(uring->fd);
+    }
+    if (uring->buffer_ring) {
+        kyros_free_aligned(uring->buffer_ring);
+    }
+    if (uring->buffers) {
+        kyros_free(uring->buffers);
+    }
+    if (uring->messages) {
+        kyros_free(uring->messages);
+    }
+    if (uring->iovecs) {
+        kyros_free(uring->iovecs);
+    }
+    kyros_free(uring);
+}
+
+static void kyros_uring_reap(kyros_uring* uring)
+{
+    auto internal = kyros_get_internal_loop(uring->loop);
+    if (atomic_load_explicit(uring->sq_flags, memory_order_relaxed) & IORING_SQ_CQ_OVERFLOW) {
+        // completions the kernel kept aside (IORING_FEAT_NODROP), bring them to the ring
+        kyros_uring_enter(uring->fd, 0, IORING_ENTER_GETEVENTS);
+    }
+    auto head = atomic_load_explicit(uring->cq_head, memory_order_relaxed);
+    // one ring worth per callback, a busy multishot recv can't keep the loop here forever
+    for (unsigned reaped = 0; reaped < uring->cq_entries; reaped++) {
+        if (head == atomic_load_explicit(uring->cq_tail, memory_order_acquire)) {
+            break;
+        }
+        auto cqe = &uring->cqes[head & uring->cq_mask];
+        auto user_data = cqe->user_data;
+        auto result = cqe->res;
+        auto flags = cqe->flags;
+        // free the slot before the dispatch, handlers can prepare and submit more operations
+        atomic_store_explicit(uring->cq_head, ++head, memory_order_release);
+        internal->uring_completions++;
+        kyros_uring_op op = user_data & KYROS_URING_OP_MASK;
+        if (op == KYROS_URING_CANCEL) {
+            continue;
+        }
+        const char* buffer = NULL;
+        uint16_t buffer_id = flags >> IORING_CQE_BUFFER_SHIFT;
+        if (flags & IORING_CQE_F_BUFFER) {
+            buffer = uring->buffers + (uint64_t)buffer_id * KYROS_URING_BUFFER_STRIDE;
+        }
+        kyros_socket_uring_complete((void*)(uintptr_t)(user_data & ~(uint64_t)KYROS_URING_OP_MASK), op, result, buffer, flags & IORING_CQE_F_MORE);
+        if (buffer) {
+            kyros_uring_provide_buffer(uring, buffer_id);
+        }
+    }
+}
+
+static void kyros_uring_poll_callback(uv_poll_t* poll, int status, int events)
+{
+    kyros_uring_reap(kyros_container_of(poll, kyros_uring, poll));
+}
+
+kyros_uring* kyros_uring_create(kyros_loop* loop)
+{
+    // default setup on purpose: no SQPOLL thread and no DEFER_TASKRUN, completions must wake up the epoll of the uv loop
+    struct io_uring_params params = {
+        .flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP | IORING_SETUP_SUBMIT_ALL,
+        .cq_entries = KYROS_URING_ENTRIES * 4,
+    };
+    auto fd = kyros_uring_setup(KYROS_URING_ENTRIES, &params);
+    if (fd < 0) {
+        // ENOSYS, EPERM (io_uring_disabled, seccomp) or a kernel older than 5.18 (SUBMIT_ALL)
+        return NULL;
+    }
+    auto uring = (kyros_uring*)kyros_calloc(1, sizeof(kyros_uring));
+    uring->fd = fd;
+    uring->loop = loop;
+    const unsigned required = IORING_FEAT_NODROP | IORING_FEAT_SUBMIT_STABLE | IORING_FEAT_FAST_POLL;
+    if ((params.features & required) != required || !kyros_uring_probe(fd) || !kyros_uring_map(uring, &params) || !kyros_uring_register_buffers(uring)) {
+        kyros_uring_release(uring);
+        return NULL;
+    }
+    uring->messages = (struct msghdr*)kyros_calloc(uring->sq_entries, sizeof(struct msghdr));
+    uring->iovecs = (struct iovec*)kyros_alloc(sizeof(struct iovec) * uring->sq_entries * KYROS_WRITE_QUEUE_IOV);
+    uv_poll_init((uv_loop_t*)loop, &uring->poll, fd);
+    uv_poll_start(&uring->poll, UV_READABLE, kyros_uring_poll_callback);
+    uv_unref((uv_handle_t*)&uring->poll);
+    return uring;
+}
+
+void kyros_uring_destroy(kyros_uring* uring)
+{
+    uv_poll_stop(&uring->poll);
+    uv_close((uv_handle_t*)&uring->poll, NULL);
+    kyros_uring_release(uring);
+}
+
+void kyros_uring_submit(kyros_uring* uring)
+{
+    auto pending = uring->sqe_tail - uring->sqe_submitted;
+    if (!pending) {
+        return;
+    }
+    atomic_store_explicit(uring->sq_tail, uring->sqe_tail, memory_order_release);
+    auto internal = kyros_get_internal_loop(uring->loop);
+    while (pending) {
+        auto submitted = kyros_uring_enter(uring->fd, pending, 0);
+        if (submitted < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // EAGAIN/EBUSY, the kernel is short on memory or on completion room, the next hook tries again
+            return;
+        }
+        internal->uring_submits++;
+        if (!submitted) {
+            return;
+        }
+        uring->sqe_submitted += submitted;
+        pending -= submitted;
+    }
+}
+
+static struct io_uring_sqe* kyros_uring_get_sqe(kyros_uring* uring, void* target, kyros_uring_op op)
+{
+    if (uring->sqe_tail - atomic_load_explicit(uring->sq_head, memory_order_acquire) >= uring->sq_entries) {
+        // full, the kernel takes the whole batch synchronously so the slots are free again after this
+        kyros_uring_submit(uring);
+        if (uring->sqe_tail - atomic_load_explicit(uring->sq_head, memory_order_acquire) >= uring->sq_entries) {
+            panic("io_uring submission queue is full and the kernel does not take it");
+        }
+    }
+    auto sqe = &uring->sqes[uring->sqe_tail & uring->sq_mask];
+    uring->sqe_tail++;
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->user_data = (uint64_t)(uintptr_t)target | op;
+    return sqe;
+}
+
+void kyros_uring_recv(kyros_uring* uring, int fd, void* target)
+{
+    auto sqe = kyros_uring_get_sqe(uring, target, KYROS_URING_RECV);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = KYROS_URING_BUFFER_GROUP;
+}
+
+void kyros_uring_send(kyros_uring* uring, int fd, const uv_buf_t* iov, uint32_t count, void* target)
+{
+    auto index = uring->sqe_tail & uring->sq_mask;
+    auto sqe = kyros_uring_get_sqe(uring, target, KYROS_URING_SEND);
+    auto iovecs = &uring->iovecs[index * KYROS_WRITE_QUEUE_IOV];
+    for (uint32_t i = 0; i < count; i++) {
+        iovecs[i] = (struct iovec) { .iov_base = iov[i].base, .iov_len = iov[i].len };
+    }
+    auto message = &uring->messages[index];
+    *message = (struct msghdr) { .msg_iov = iovecs, .msg_iovlen = count };
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)message;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+}
+
+void kyros_uring_poll_writable(kyros_uring* uring, int fd, void* target)
+{
+    auto sqe = kyros_uring_get_sqe(uring, target, KYROS_URING_CONNECT);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLOUT;
+}
+
+void kyros_uring_accept(kyros_uring* uring, int fd, void* target)
+{
+    auto sqe = kyros_uring_get_sqe(uring, target, KYROS_URING_ACCEPT);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+}
+
+void kyros_uring_nop(kyros_uring* uring, void* target, kyros_uring_op op)
+{
+    auto sqe = kyros_uring_get_sqe(uring, target, op);
+    sqe->opcode = IORING_OP_NOP;
+}
+
+void kyros_uring_cancel(kyros_uring* uring, void* target, kyros_uring_op op)
+{
+    auto sqe = kyros_uring_get_sqe(uring, target, KYROS_URING_CANCEL);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t)(uintptr_t)target | op;
+}
+
+void kyros_uring_keep_alive(kyros_uring* uring, int32_t delta)
+{
+    auto was_alive = uring->keep_alive > 0;
+    uring->keep_alive += delta;
+    auto is_alive = uring->keep_alive > 0;
+    if (is_alive && !was_alive) {
+        uv_ref((uv_handle_t*)&uring->poll);
+    } else if (!is_alive && was_alive) {
+        uv_unref((uv_handle_t*)&uring->poll);
+    }
+}
+
+#else
+
+// no io_uring, kyros_uring_create always fails so the loop uses the poll engine and nothing else is called
+
+kyros_uring* kyros_uring_create(kyros_loop* loop)
+{
+    return NULL;
+}
+
+void kyros_uring_destroy(kyros_uring* uring)
+{
+}
+
+void kyros_uring_submit(kyros_uring* uring)
+{
+}
+
+void kyros_uring_recv(kyros_uring* uring, int fd, void* target)
+{
+}
+
+void kyros_uring_send(kyros_uring* uring, int fd, const uv_buf_t* iov, uint32_t count, void* target)
+{
+}
+
+void kyros_uring_poll_writable(kyros_uring* uring, int fd, void* target)
+{
+}
+
+void kyros_uring_accept(kyros_uring* uring, int fd, void* target)
+{
+}
+
+void kyros_uring_nop(kyros_uring* uring, void* target, kyros_uring_op op)
+{
+}
+
+void kyros_uring_cancel(kyros_uring* uring, void* target, kyros_uring_op op)
+{
+}
+
+void kyros_uring_keep_alive(kyros_uring* uring, int32_t delta)
+{
+}
+
+#endif
@@ -0,0 +1,795 @@
+#include <kyros.h>
+#include <kyros_internal.h>
+
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
+#include <stdio.h>
+#include <string.h>
+
+// RFC 6455, frames are parsed where they were received and unmasked in place, a message that came in one
+// read reaches onmessage without being copied, partial frames and fragments go to buffers of the loop pool
+
+#define KYROS_WEBSOCKET_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define KYROS_WEBSOCKET_MAX_CONTROL 125 // payload of ping, pong and close frames
+#define KYROS_WEBSOCKET_MAX_HEADER 14
+#define KYROS_WEBSOCKET_RSV1 0x40 // first byte bit of a compressed message (permessage-deflate)
+
+typedef enum {
+    KYROS_WEBSOCKET_CONTINUATION = 0x0,
+    KYROS_WEBSOCKET_CLOSE = 0x8,
+    KYROS_WEBSOCKET_PING = 0x9,
+    KYROS_WEBSOCKET_PONG = 0xa,
+} kyros_websocket_control;
+
+typedef enum {
+    KYROS_WEBSOCKET_NORMAL_CLOSURE = 1000,
+    KYROS_WEBSOCKET_PROTOCOL_ERROR = 1002,
+    KYROS_WEBSOCKET_NO_STATUS = 1005,
+    KYROS_WEBSOCKET_ABNORMAL_CLOSURE = 1006,
+    KYROS_WEBSOCKET_INVALID_PAYLOAD = 1007,
+    KYROS_WEBSOCKET_MESSAGE_TOO_BIG = 1009,
+} kyros_websocket_close_code;
+
+// client masks come from the tls random generator, fetched in batches
+static thread_local uint8_t kyros_websocket_random[256];
+static thread_local uint32_t kyros_websocket_random_used = sizeof(kyros_websocket_random);
+
+static uint32_t kyros_websocket_random_mask()
+{
+    if (kyros_websocket_random_used == sizeof(kyros_websocket_random)) {
+        RAND_bytes(kyros_websocket_random, sizeof(kyros_websocket_random));
+        kyros_websocket_random_used = 0;
+    }
+    uint32_t mask;
+    memcpy(&mask, kyros_websocket_random + kyros_websocket_random_used, 4);
+    kyros_websocket_random_used += 4;
+    return mask;
+}
+
+/// @brief Sec-WebSocket-Accept of key (28 bytes, not null-terminated)
+static void kyros_websocket_accept(const char* key, uint32_t key_length, char* out)
+{
+    char input[24 + sizeof(KYROS_WEBSOCKET_GUID) - 1];
+    m_assert(key_length == 24, "Sec-WebSocket-Key must have 24 bytes");
+    memcpy(input, key, 24);
+    memcpy(input + 24, KYROS_WEBSOCKET_GUID, sizeof(KYROS_WEBSOCKET_GUID) - 1);
+    uint8_t digest[SHA_DIGEST_LENGTH];
+    SHA1((const uint8_t*)input, sizeof(input), digest);
+    uint8_t encoded[29];
+    EVP_EncodeBlock(encoded, digest, SHA_DIGEST_LENGTH);
+    memcpy(out, encoded, 28);
+}
+
+///
+/// Buffers
+///
+
+static inline kyros_buffer_pool* kyros_websocket_pool(kyros_websocket* websocket)
+{
+    return &kyros_get_internal_loop(websocket->loop)->buffer_pool;
+}
+
+/// @brief room for needed bytes in a pooled buffer, the used ones are kept
+static void kyros_websocket_reserve(kyros_websocket* websocket, char** buffer, uint64_t* capacity, uint64_t used, uint64_t needed)
+{
+    if (needed <= *capacity) {
+        return;
+    }
+    // pooled sizes are powers of two already, the ones from the allocator grow the same way
+    auto size = needed < *capacity * 2 ? *capacity * 2 : needed;
+    auto pool = kyros_websocket_pool(websocket);
+    auto grown = kyros_buffer_pool_get(pool, &size);
+    if (*buffer) {
+        memcpy(grown, *buffer, used);
+        kyros_buffer_pool_release(pool, *buffer, *capacity);
+    }
+    *buffer = grown;
+    *capacity = size;
+}
+
+static void kyros_websocket_release(kyros_websocket* websocket, char** buffer, uint64_t* capacity)
+{
+    if (*buffer) {
+        kyros_buffer_pool_release(kyros_websocket_pool(websocket), *buffer, *capacity);
+        *buffer = NULL;
+        *capacity = 0;
+    }
+}
+
+static void kyros_websocket_free(kyros_websocket* websocket)
+{
+    kyros_websocket_release(websocket, &websocket->input, &websocket->input_capacity);
+    kyros_websocket_release(websocket, &websocket->message, &websocket->message_capacity);
+    kyros_websocket_deflate_release(websocket);
+    kyros_free(websocket);
+}
+
+/// @brief end of a call made with in_use set by entered, returns false if the websocket was freed
+static bool kyros_websocket_leave(kyros_websocket* websocket, bool entered)
+{
+    if (!entered) {
+        return !websocket->closed;
+    }
+    websocket->in_use = false;
+    if (websocket->closed) {
+        kyros_websocket_free(websocket);
+        return false;
+    }
+    return true;
+}
+
+///
+/// Sending
+///
+
+/// @brief one whole frame, masked by clients, returns what the last kyros_socket_write returned (in_use must be set)
+/// opcode can have KYROS_WEBSOCKET_RSV1
+static bool kyros_websocket_send_frame(kyros_websocket* websocket, uint8_t opcode, const char* data, uint64_t length, bool end)
+{
+    char small[KYROS_WEBSOCKET_MAX_HEADER + KYROS_WEBSOCKET_COPY_LIMIT];
+    bool is_client = websocket->is_client;
+    uint32_t mask = is_client ? kyros_websocket_random_mask() : 0;
+    auto header = kyros_websocket_format_frame(small, 0x80 | opcode, length, is_client, mask);
+    if (length <= KYROS_WEBSOCKET_COPY_LIMIT) {
+        if (is_client) {
+            kyros_websocket_mask(small + header, data, length, mask);
+        } else if (length) {
+            memcpy(small + header, data, length);
+        }
+        return kyros_socket_write(websocket->socket, small, header + length, end);
+    }
+    if (is_client) {
+        // the caller keeps its data, the masked payload is a copy
+        uint64_t capacity = header + length;
+        auto pool = kyros_websocket_pool(websocket);
+        auto out = kyros_buffer_pool_get(pool, &capacity);
+        memcpy(out, small, header);
+        kyros_websocket_mask(out + header, data, length, mask);
+        auto result = kyros_socket_write(websocket->socket, out, header + length, end);
+        kyros_buffer_pool_release(pool, out, capacity);
+        return result;
+    }
+    // the payload is written as it is, auto corked sockets still send both with one syscall
+    kyros_socket_write(websocket->socket, small, header, false);
+    if (websocket->closed) {
+        return false;
+    }
+    return kyros_socket_write(websocket->socket, data, length, end);
+}
+
+static bool kyros_websocket_send_compressed(kyros_websocket* websocket, uint8_t opcode, const char* data, uint64_t length)
+{
+    uint64_t compressed_length;
+    uint64_t capacity;
+    auto compressed = kyros_websocket_deflate(websocket, data, length, KYROS_WEBSOCKET_MAX_HEADER, &compressed_length, &capacity);
+    auto payload = compressed + KYROS_WEBSOCKET_MAX_HEADER;
+    bool result;
+    if (websocket->is_client) {
+        result = kyros_websocket_send_frame(websocket, KYROS_WEBSOCKET_RSV1 | opcode, payload, compressed_length, false);
+    } else {
+        // the header goes in the room left before the payload, the frame is one write
+        char header[KYROS_WEBSOCKET_MAX_HEADER];
+        auto header_length = kyros_websocket_format_frame(header, 0x80 | KYROS_WEBSOCKET_RSV1 | opcode, compressed_length, false, 0);
+        memcpy(payload - header_length, header, header_length);
+        result = kyros_socket_write(websocket->socket, payload - header_length, header_length + compressed_length, false);
+    }
+    kyros_buffer_pool_release(kyros_websocket_pool(websocket), compressed, capacity);
+    return result;
+}
+
+static void kyros_websocket_send_close(kyros_websocket* websocket, uint16_t code, const char* reason, uint32_t reason_length, bool end)
+{
+    char payload[KYROS_WEBSOCKET_MAX_CONTROL];
+    uint32_t length = 0;
+    if (code != KYROS_WEBSOCKET_NO_STATUS) {
+        payload[0] = (char)(code >> 8);
+        payload[1] = (char)code;
+        if (reason_length) {
+            memcpy(payload + 2, reason, reason_length);
+        }
+        length = 2 + reason_length;
+    }
+    websocket->close_sent = true;
+    kyros_websocket_send_frame(websocket, KYROS_WEBSOCKET_CLOSE, payload, length, end);
+    if (!websocket->closed) {
+        // the peer has some time to answer (or to close its side) before the socket is closed
+        kyros_socket_timeout(websocket->socket, KYROS_WEBSOCKET_CLOSE_TIMEOUT);
+    }
+}
+
+/// @brief close frame with code then the writable side is ended, nothing else is read
+static void kyros_websocket_fail(kyros_websocket* websocket, uint16_t code)
+{
+    websocket->ended = true;
+    if (websocket->close_sent) {
+        kyros_socket_close(websocket->socket);
+        return;
+    }
+    websocket->close_code = code;
+    kyros_websocket_send_close(websocket, code, NULL, 0, true);
+}
+
+///
+/// Receiving
+///
+
+static inline bool kyros_websocket_close_code_is_valid(uint16_t code)
+{
+    return (code >= 1000 && code <= 1003) || (code >= 1007 && code <= 1014) || (code >= 3000 && code <= 4999);
+}
+
+static void kyros_websocket_on_close(kyros_websocket* websocket, const char* payload, uint64_t length)
+{
+    uint16_t code = KYROS_WEBSOCKET_NO_STATUS;
+    if (length == 1) {
+        kyros_websocket_fail(websocket, KYROS_WEBSOCKET_PROTOCOL_ERROR);
+        return;
+    }
+    if (length >= 2) {
+        code = (uint16_t)((uint8_t)payload[0] << 8 | (uint8_t)payload[1]);
+        if (!kyros_websocket_close_code_is_valid(code)) {
+            kyros_websocket_fail(websocket, KYROS_WEBSOCKET_PROTOCOL_ERROR);
+            return;
+        }
+        if (!kyros_websocket_utf8_is_valid(payload + 2, length - 2)) {
+            kyros_websocket_fail(websocket, KYROS_WEBSOCKET_INVALID_PAYLOAD);
+            return;
+        }
+        websocket->close_reason_length = (uint8_t)(length - 2);
+        memcpy(websocket->close_reason, payload + 2, length - 2);
+    }
+    websocket->close_received = true;
+    websocket->ended = true;
+    websocket->close_code = code;
+    if (websocket->close_sent) {
+        // both sides sent theirs
+        kyros_socket_write(websocket->socket, NULL, 0, true);
+        return;
+    }
+    // the same code goes back, then the writable side is ended
+    kyros_websocket_send_close(websocket, code, NULL, 0, true);
+}
+
+static void kyros_websocket_deliver(kyros_websocket* websocket, uint8_t opcode, const char* data, uint64_t length, bool compressed)
+{
+    char* inflated = NULL;
+    uint64_t capacity = 0;
+    if (compressed) {
+        bool too_big;
+        inflated = kyros_websocket_inflate(websocket, data, length, &length, &capacity, &too_big);
+        if (!inflated) {
+            kyros_websocket_fail(websocket, too_big ? KYROS_WEBSOCKET_MESSAGE_TOO_BIG : KYROS_WEBSOCKET_INVALID_PAYLOAD);
+            return;
+        }
+        data = inflated;
+    }
+    if (opcode == KYROS_WEBSOCKET_TEXT && !kyros_websocket_utf8_is_valid(data, length)) {
+        kyros_websocket_fail(websocket, KYROS_WEBSOCKET_INVALID_PAYLOAD);
+    } else if (websocket->options.onmessage) {
+        websocket->options.onmessage(websocket, data, length, (kyros_websocket_opcode)opcode, websocket->options.ctx);
+    }
+    if (inflated) {
+        kyros_buffer_pool_release(kyros_websocket_pool(websocket), inflated, capacity);
+    }
+}
+
+static void kyros_websocket_on_frame(kyros_websocket* websocket, const kyros_websocket_frame* frame, const char* payload)
+{
+    auto length = frame->payload_length;
+    switch (frame->opcode) {
+    case KYROS_WEBSOCKET_CONTINUATION:
+        if (!websocket->message_opcode) {
+            kyros_websocket_fail(websocket, KYROS_WEBSOCKET_PROTOCOL_ERROR);
+            return;
+        }
+        kyros_websocket_reserve(websocket, &websocket->message, &websocket->message_capacity, websocket->message_length, websocket->message_length + length);
+        memcpy(websocket->message + websocket->message_length, payload, length);
+        websocket->message_length += length;
+        if (frame->fin) {
+            auto opcode = websocket->message_opcode;
+            websocket->message_opcode = 0;
+            kyros_websocket_deliver(websocket, opcode, websocket->message, websocket->message_length, websocket->message_compressed);
+            websocket->message_length = 0;
+            kyros_websocket_release(websocket, &websocket->message, &websocket->message_capacity);
+        }
+        return;
+    case KYROS_WEBSOCKET_TEXT:
+    case KYROS_WEBSOCKET_BINARY:
+        if (websocket->message_opcode) {
+            kyros_websocket_fail(websocket, KYROS_WEBSOCKET_PROTOCOL_ERROR);
+            return;
+        }
+        if (frame->fin) {
+            // the common case, delivered where it was unmasked
+            kyros_websocket_deliver(websocket, frame->opcode, payload, length, frame->rsv);
+            return;
+        }
+        websocket->message_opcode = frame->opcode;
+        websocket->message_compressed = frame->rsv;
+        kyros_websocket_reserve(websocket, &websocket->message, &websocket->message_capacity, 0, length);
+        memcpy(websocket->message, payload, length);
+        websocket->message_length = length;
+        return;
+    case KYROS_WEBSOCKET_CLOSE:
+        kyros_websocket_on_close(websocket, payload, length);
+        return;
+    case KYROS_WEBSOCKET_PING:
+        if (!websocket->close_sent) {
+            kyros_websocket_send_frame(websocket, KYROS_WEBSOCKET_PONG, payload, length, false);
+        }
+        return;
+    default:
+        // pong, receiving anything already cleared ping_sent
+        return;
+    }
+}
+
+static inline bool kyros_websocket_frame_is_valid(kyros_websocket* websocket, const kyros_websocket_frame* frame)
+{
+    // clients mask and servers don't, RSV1 is only for the first frame of a message with permessage-deflate
+    if (frame->masked == websocket->is_client) {
+        return false;
+    }
+    if (frame->rsv && (frame->rsv != 4 || !websocket->compression || frame->opcode == KYROS_WEBSOCKET_CONTINUATION || (frame->opcode & 0x8))) {
+        return false;
+    }
+    if (frame->opcode & 0x8) {
+        return frame->opcode <= KYROS_WEBSOCKET_PONG && frame->fin && frame->payload_length <= KYROS_WEBSOCKET_MAX_CONTROL;
+    }
+    return frame->opcode <= KYROS_WEBSOCKET_BINARY;
+}
+
+/// @brief handle the whole frames of data, returns the bytes consumed
+static uint64_t kyros_websocket_process(kyros_websocket* websocket, char* data, uint64_t length)
+{
+    auto max_message_size = websocket->options.max_message_size;
+    uint64_t consumed = 0;
+    while (consumed < length && !websocket->ended && !websocket->closed) {
+        auto p = data + consumed;
+        auto available = length - consumed;
+        kyros_websocket_frame frame;
+        auto header = kyros_websocket_parse_frame(p, available, &frame);
+        if (header == KYROS_WEBSOCKET_PARSE_INCOMPLETE) {
+            break;
+        }
+        if (header < 0 || !kyros_websocket_frame_is_valid(websocket, &frame)) {
+            kyros_websocket_fail(websocket, KYROS_WEBSOCKET_PROTOCOL_ERROR);
+            break;
+        }
+        auto message_length = frame.opcode == KYROS_WEBSOCKET_CONTINUATION ? websocket->message_length : 0;
+        if (frame.payload_length > max_message_size - message_length) {
+            kyros_websocket_fail(websocket, KYROS_WEBSOCKET_MESSAGE_TOO_BIG);
+            break;
+        }
+        if (available - (uint64_t)header < frame.payload_length) {
+            break;
+        }
+        auto payload = p + header;
+        consumed += (uint64_t)header + frame.payload_length;
+        if (frame.masked) {
+            kyros_websocket_mask(payload, payload, frame.payload_length, frame.mask);
+        }
+        kyros_websocket_on_frame(websocket, &frame, payload);
+    }
+    return consumed;
+}
+
+/// @brief process what the input has and keep the partial frame at its start
+static void kyros_websocket_process_input(kyros_websocket* websocket)
+{
+    auto consumed = kyros_websocket_process(websocket, websocket->input, websocket->input_length);
+    if (websocket->closed || websocket->ended) {
+        websocket->input_length = 0;
+        return;
+    }
+    websocket->input_length -= consumed;
+    if (!websocket->input_length) {
+        kyros_websocket_release(websocket, &websocket->input, &websocket->input_capacity);
+    } else if (consumed) {
+        memmove(websocket->input, websocket->input + consumed, websocket->input_length);
+    }
+}
+
+static void kyros_websocket_buffer(kyros_websocket* websocket, const char* data, uint64_t length)
+{
+    auto needed = websocket->input_length + length;
+    kyros_websocket_frame frame;
+    if (!websocket->input_length && !websocket->handshaking && kyros_websocket_parse_frame(data, length, &frame) > 0
+        && frame.payload_length <= websocket->options.max_message_size) {
+        // the room for the whole frame is taken once instead of growing with every read
+        auto whole = frame.header_length + frame.payload_length;
+        needed = whole > needed ? whole : needed;
+    }
+    kyros_websocket_reserve(websocket, &websocket->input, &websocket->input_capacity, websocket->input_length, needed);
+    memcpy(websocket->input + websocket->input_length, data, length);
+    websocket->input_length += length;
+}
+
+///
+/// Client handshake
+///
+
+/// @brief true if the head of the response accepts the upgrade
+static bool kyros_websocket_check_response(kyros_websocket* websocket, const char* head, uint64_t length)
+{
+    if (length < 12 || memcmp(head, "HTTP/1.1 101", 12) || (head[12] != ' ' && head[12] != '\r')) {
+        return false;
+    }
+    bool upgrade = false;
+    bool connection = false;
+    bool accept = false;
+    auto end = head + length;
+    auto line = (const char*)memchr(head, '\n', length) + 1;
+    while (line < end) {
+        auto line_end = (const char*)memchr(line, '\n', (uint64_t)(end - line));
+        if (!line_end) {
+            break;
+        }
+        auto colon = (const char*)memchr(line, ':', (uint64_t)(line_end - line));
+        if (colon) {
+            auto value = colon + 1;
+            auto value_end = line_end;
+            while (value < value_end && (*value == ' ' || *value == '\t')) {
+                value++;
+            }
+            while (value_end > value && (value_end[-1] == '\r' || value_end[-1] == ' ' || value_end[-1] == '\t')) {
+                value_end--;
+            }
+            auto name_length = (uint32_t)(colon - line);
+            auto value_length = (uint32_t)(value_end - value);
+            if (kyros_http_header_name_equals(line, name_length, "upgrade", 7)) {
+                upgrade = kyros_http_value_has_token(value, value_length, "websocket", 9);
+            } else if (kyros_http_header_name_equals(line, name_length, "connection", 10)) {
+                connection = kyros_http_value_has_token(value, value_length, "upgrade", 7);
+            } else if (kyros_http_header_name_equals(line, name_length, "sec-websocket-accept", 20)) {
+                accept = value_length == 28 && !memcmp(value, websocket->accept, 28);
+            } else if (kyros_http_header_name_equals(line, name_length, "sec-websocket-extensions", 24)) {
+                // permessage-deflate is the only one offered (when options.compression is set)
+                if (!kyros_websocket_deflate_accept(websocket, value, value_length)) {
+                    return false;
+                }
+            } else if (kyros_http_header_name_equals(line, name_length, "sec-websocket-protocol", 22)) {
+                // none was offered
+                return false;
+            }
+        }
+        line = line_end + 1;
+    }
+    return upgrade && connection && accept;
+}
+
+static void kyros_websocket_on_handshake(kyros_websocket* websocket, const char* data, uint64_t length)
+{
+    kyros_websocket_buffer(websocket, data, length);
+    auto input = websocket->input;
+    auto input_length = websocket->input_length;
+    uint64_t head = 0;
+    for (uint64_t i = 3; i < input_length; i++) {
+        if (input[i] == '\n' && input[i - 1] == '\r' && input[i - 2] == '\n' && input[i - 3] == '\r') {
+            head = i + 1;
+            break;
+        }
+    }
+    if (!head) {
+        if (input_length > KYROS_WEBSOCKET_MAX_HANDSHAKE) {
+            kyros_socket_close(websocket->socket);
+        }
+        return;
+    }
+    if (!kyros_websocket_check_response(websocket, input, head)) {
+        kyros_socket_close(websocket->socket);
+        return;
+    }
+    websocket->handshaking = false;
+    websocket->input_length -= head;
+    memmove(websocket->input, websocket->input + head, websocket->input_length);
+    if (websocket->options.onopen) {
+        websocket->options.onopen(websocket, websocket->options.ctx);
+        if (websocket->closed) {
+            return;
+        }
+    }
+    // frames sent right after the response
+    kyros_websocket_process_input(websocket);
+}
+
+///
+/// Socket handler
+///
+
+static bool kyros_websocket_ondata(kyros_socket socket, const char* data, uint64_t length, void* ctx)
+{
+    kyros_websocket* websocket = ctx;
+    if (websocket->ended) {
+        return true;
+    }
+    websocket->ping_sent = false;
+    auto entered = !websocket->in_use;
+    websocket->in_use = true;
+    if (websocket->handshaking) {
+        kyros_websocket_on_handshake(websocket, data, length);
+    } else if (websocket->input_length) {
+        // behind a partial frame
+        kyros_websocket_buffer(websocket, data, length);
+        kyros_websocket_process_input(websocket);
+    } else {
+        // every input of a socket is writable, the payloads are unmasked in place
+        auto consumed = kyros_websocket_process(websocket, (char*)data, length);
+        if (consumed < length && !websocket->ended && !websocket->closed) {
+            kyros_websocket_buffer(websocket, data + consumed, length - consumed);
+        }
+    }
+    kyros_websocket_leave(websocket, entered);
+    return true;
+}
+
+static void kyros_websocket_onstatus(kyros_socket socket, kyros_socket_error error, void* ctx)
+{
+    kyros_websocket* websocket = ctx;
+    auto state = kyros_socket_get_state(socket);
+    if (state == KYROS_SOCKET_STATE_READABLE_ENDED) {
+        // the peer is done, what is queued is still sent
+        websocket->ended = true;
+        kyros_socket_write(socket, NULL, 0, true);
+        return;
+    }
+    if (state != KYROS_SOCKET_STATE_CLOSED) {
+        return;
+    }
+    // the handler goes away with the websocket, the socket must not release it again
+    auto tcp = (kyros_socket_internal_tcp*)kyros_get_socket_internal(socket);
+    tcp->handlers = NULL;
+    websocket->closed = true;
+    websocket->ended = true;
+    if (websocket->subscriptions) {
+        kyros_pubsub_remove_websocket(websocket);
+    }
+    if (websocket->options.onclose) {
+        auto code = websocket->close_code ? websocket->close_code : KYROS_WEBSOCKET_ABNORMAL_CLOSURE;
+        websocket->options.onclose(websocket, code, websocket->close_reason, websocket->close_reason_length, websocket->options.ctx);
+    }
+    if (!websocket->in_use) {
+        kyros_websocket_free(websocket);
+    }
+}
+
+static void kyros_websocket_ondrain(kyros_socket socket, void* ctx)
+{
+    kyros_websocket* websocket = ctx;
+    if (websocket->options.ondrain && !websocket->close_sent) {
+        websocket->options.ondrain(websocket, websocket->options.ctx);
+    }
+}
+
+static bool kyros_websocket_ontimeout(kyros_socket socket, void* ctx)
+{
+    kyros_websocket* websocket = ctx;
+    if (websocket->close_sent || websocket->ping_sent || websocket->handshaking) {
+        return true;
+    }
+    // idle, the pong (or anything else) received before the next timeout keeps it open
+    websocket->ping_sent = true;
+    auto entered = !websocket->in_use;
+    websocket->in_use = true;
+    kyros_websocket_send_frame(websocket, KYROS_WEBSOCKET_PING, NULL, 0, false);
+    kyros_websocket_leave(websocket, entered);
+    return false;
+}
+
+static kyros_websocket* kyros_websocket_create(kyros_loop* loop, kyros_websocket_options options)
+{
+    auto websocket = (kyros_websocket*)kyros_calloc(1, sizeof(kyros_websocket));
+    websocket->handler = (kyros_socket_handler) {
+        .ctx = websocket,
+        .ondata = kyros_websocket_ondata,
+        .onstatus = kyros_websocket_onstatus,
+        .ondrain = kyros_websocket_ondrain,
+        .ontimeout = kyros_websocket_ontimeout,
+        .ref_count = 1,
+    };
+    websocket->options = options;
+    if (!websocket->options.max_message_size) {
+        websocket->options.max_message_size = KYROS_WEBSOCKET_MAX_MESSAGE_SIZE;
+    }
+    websocket->loop = loop;
+    return websocket;
+}
+
+///
+/// Broadcast
+///
+
+kyros_shared_buffer* kyros_websocket_frame_shared(kyros_loop* loop, const char* data, uint64_t length, kyros_websocket_opcode opcode, bool compress)
+{
+    uint8_t first_byte = 0x80 | (uint8_t)opcode;
+    char* compressed = NULL;
+    uint64_t capacity;
+    if (compress) {
+        compressed = kyros_websocket_deflate_shared(loop, data, length, 0, &length, &capacity);
+        data = compressed;
+        first_byte |= KYROS_WEBSOCKET_RSV1;
+    }
+    char header[KYROS_WEBSOCKET_MAX_HEADER];
+    auto header_length = kyros_websocket_format_frame(header, first_byte, length, false, 0);
+    auto frame = kyros_shared_buffer_create(header_length + length);
+    memcpy(frame->data, header, header_length);
+    if (length) {
+        memcpy(frame->data + header_length, data, length);
+    }
+    if (compressed) {
+        kyros_buffer_pool_release(&kyros_get_internal_loop(loop)->buffer_pool, compressed, capacity);
+    }
+    return frame;
+}
+
+void kyros_websocket_broadcast(kyros_websocket** websockets, uint32_t count, kyros_shared_buffer* frame, kyros_shared_buffer* compressed)
+{
+    // a write can close any of them (the onclose of one can close the others), all are held until the last write
+    bool stack[KYROS_PUBSUB_STACK_SUBSCRIBERS];
+    auto entered = count <= KYROS_PUBSUB_STACK_SUBSCRIBERS ? stack : (bool*)kyros_alloc(count);
+    for (uint32_t i = 0; i < count; i++) {
+        entered[i] = !websockets[i]->in_use;
+        websockets[i]->in_use = true;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        auto websocket = websockets[i];
+        if (websocket->closed || websocket->close_sent) {
+            continue;
+        }
+        if (compressed && websocket->compression && !websocket->send_uncompressed) {
+            if (websocket->deflate_takeover) {
+                kyros_websocket_deflate_restart(websocket);
+            }
+            kyros_socket_write_shared(websocket->socket, compressed, compressed->data, compressed->length);
+        } else {
+            kyros_socket_write_shared(websocket->socket, frame, frame->data, frame->length);
+        }
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        kyros_websocket_leave(websockets[i], entered[i]);
+    }
+    if (entered != stack) {
+        kyros_free(entered);
+    }
+}
+
+///
+/// Public API
+///
+
+const char* kyros_websocket_get_key(kyros_http_request* request, uint32_t* length)
+{
+    if (request->http2 || request->minor_version != 1 || request->method_length != 3 || memcmp(request->method, "GET", 3)) {
+        return NULL;
+    }
+    uint32_t upgrade_length;
+    uint32_t connection_length;
+    uint32_t version_length;
+    uint32_t key_length;
+    auto upgrade = kyros_http_request_get_header(request, "upgrade", 7, &upgrade_length);
+    auto connection = kyros_http_request_get_header(request, "connection", 10, &connection_length);
+    auto version = kyros_http_request_get_header(request, "sec-websocket-version", 21, &version_length);
+    auto key = kyros_http_request_get_header(request, "sec-websocket-key", 17, &key_length);
+    if (!upgrade || !kyros_http_value_has_token(upgrade, upgrade_length, "websocket", 9)
+        || !connection || !kyros_http_value_has_token(connection, connection_length, "upgrade", 7)
+        || !version || version_length != 2 || memcmp(version, "13", 2) || !key || key_length != 24) {
+        return NULL;
+    }
+    *length = key_length;
+    return key;
+}
+
+kyros_websocket* kyros_websocket_upgrade(kyros_http_response* response, const char* key, uint32_t key_length,
+    const char* extensions, uint32_t extensions_length, kyros_websocket_options options)
+{
+    static const char prefix[] = "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: ";
+    static const char extensions_prefix[] = "\r\nSec-WebSocket-Extensions: ";
+    m_assert(response->version == 1, "kyros_websocket_upgrade needs a HTTP/1.1 response");
+    auto socket = kyros_http_response_get_socket(response);
+    auto websocket = kyros_websocket_create(kyros_socket_get_loop(socket), options);
+    websocket->socket = socket;
+    char head[sizeof(prefix) - 1 + 28 + sizeof(extensions_prefix) - 1 + 128 + 4];
+    uint32_t length = sizeof(prefix) - 1;
+    memcpy(head, prefix, length);
+    kyros_websocket_accept(key, key_length, head + length);
+    length += 28;
+    char response_extensions[128];
+    uint32_t response_extensions_length;
+    if (kyros_websocket_deflate_negotiate(websocket, extensions, extensions_length, response_extensions, &response_extensions_length)) {
+        memcpy(head + length, extensions_prefix, sizeof(extensions_prefix) - 1);
+        length += sizeof(extensions_prefix) - 1;
+        memcpy(head + length, response_extensions, response_extensions_length);
+        length += response_extensions_length;
+    }
+    memcpy(head + length, "\r\n\r\n", 4);
+    length += 4;
+    if (!kyros_http_connection_upgrade(response, head, length, &websocket->handler)) {
+        kyros_free(websocket);
+        return NULL;
+    }
+    return websocket;
+}
+
+kyros_websocket* kyros_websocket_connect(kyros_loop* loop, kyros_socket_source source, kryos_socket_options options, const char* host, const char* path, kyros_websocket_options websocket_options)
+{
+    auto websocket = kyros_websocket_create(loop, websocket_options);
+    websocket->is_client = true;
+    websocket->handshaking = true;
+    uint8_t nonce[16];
+    RAND_bytes(nonce, sizeof(nonce));
+    uint8_t key[25];
+    EVP_EncodeBlock(key, nonce, sizeof(nonce));
+    kyros_websocket_accept((const char*)key, 24, websocket->accept);
+
+    // Host is the source host and its port unless it is the default one
+    char port[8] = "";
+    if (!host) {
+        host = "localhost";
+        if (source.type == KYROS_SOCKET_SOURCE_HOSTPORT) {
+            host = source.value.host_port.host;
+            if (source.value.host_port.port != (options.tls ? 443 : 80)) {
+                snprintf(port, sizeof(port), ":%u", source.value.host_port.port);
+            }
+        }
+    }
+    auto bracket = strchr(host, ':') != NULL && host[0] != '[';
+    static const char format[] = "GET %s HTTP/1.1\r\nHost: %s%s%s%s\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                                 "Sec-WebSocket-Key: %s\r\nSec-WebSocket-Version: 13\r\n%s%s%s\r\n";
+    path = path && *path ? path : "/";
+    char offer[128] = "";
+    if (websocket_options.compression != KYROS_WEBSOCKET_COMPRESSION_NONE) {
+        offer[kyros_websocket_deflate_offer(websocket_options.compression, offer)] = '\0';
+    }
+    auto extensions = *offer ? "Sec-WebSocket-Extensions: " : "";
+    auto extensions_end = *offer ? "\r\n" : "";
+    auto length = snprintf(NULL, 0, format, path, bracket ? "[" : "", host, bracket ? "]" : "", port, key, extensions, offer, extensions_end);
+    auto request = (char*)kyros_alloc((uint64_t)length + 1);
+    snprintf(request, (uint64_t)length + 1, format, path, bracket ? "[" : "", host, bracket ? "]" : "", port, key, extensions, offer, extensions_end);
+
+    websocket->socket = kyros_socket_connect(loop, source, options, &websocket->handler);
+    // queued until the socket is connected (and secure)
+    kyros_socket_write(websocket->socket, request, (uint64_t)length, false);
+    kyros_free(request);
+    return websocket;
+}
+
+bool kyros_websocket_send(kyros_websocket* websocket, const char* data, uint64_t length, kyros_websocket_opcode opcode)
+{
+    if (websocket->closed || websocket->close_sent || websocket->handshaking) {
+        return false;
+    }
+    auto entered = !websocket->in_use;
+    websocket->in_use = true;
+    bool result;
+    if (websocket->compression && !websocket->send_uncompressed && length >= KYROS_WEBSOCKET_DEFLATE_MIN_SIZE && length <= UINT32_MAX) {
+        result = kyros_websocket_send_compressed(websocket, (uint8_t)opcode, data, length);
+    } else {
+        result = kyros_websocket_send_frame(websocket, (uint8_t)opcode, data, length, false);
+    }
+    if (!kyros_websocket_leave(websocket, entered)) {
+        return false;
+    }
+    return result;
+}
+
+void kyros_websocket_close(kyros_websocket* websocket, uint16_t code, const char* reason, uint32_t reason_length)
+{
+    m_assert(reason_length <= KYROS_WEBSOCKET_MAX_CONTROL - 2, "kyros_websocket_close reason is too long");
+    if (websocket->closed || websocket->close_sent) {
+        return;
+    }
+    auto entered = !websocket->in_use;
+    websocket->in_use = true;
+    if (websocket->handshaking) {
+        kyros_socket_close(websocket->socket);
+    } else {
+        kyros_websocket_send_close(websocket, code, reason, reason_length, false);
+    }
+    kyros_websocket_leave(websocket, entered);
+}
+
+kyros_socket kyros_websocket_get_socket(kyros_websocket* websocket)
+{
+    return websocket->socket;
+}
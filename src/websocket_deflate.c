@@ -0,0 +1,470 @@
+#include <kyros.h>
+#include <kyros_internal.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <zlib.h>
+
+// RFC 7692, messages are (de)compressed whole once the last fragment is there, so a stream without context
+// takeover is only used during one call and the loop shares one per direction between all its websockets,
+// streams that keep their window across messages belong to one websocket and come from a pool of the loop
+
+#define KYROS_WEBSOCKET_DEFLATE_WINDOW_BITS 15
+
+typedef enum {
+    KYROS_WEBSOCKET_DEFLATER = 0,
+    KYROS_WEBSOCKET_INFLATER = 1,
+} kyros_websocket_zstream_kind;
+
+struct kyros_websocket_zstream {
+    kyros_websocket_zstream* next;
+    z_stream stream;
+};
+
+struct kyros_websocket_deflate_pool {
+    // no context takeover, reset after every message
+    kyros_websocket_zstream* shared[2];
+    // reset dedicated streams
+    kyros_websocket_zstream* idle[2];
+    uint32_t idle_count[2];
+};
+
+// parameters of one offer (or of the response of the server), window bits are 0 when absent
+typedef struct {
+    uint8_t server_max_window_bits;
+    uint8_t client_max_window_bits;
+    bool client_max_window_bits_present : 1; // clients can offer it without a value
+    bool server_no_context_takeover : 1;
+    bool client_no_context_takeover : 1;
+} kyros_websocket_deflate_params;
+
+///
+/// Negotiation
+///
+
+static inline void kyros_websocket_deflate_trim(const char** start, const char** end)
+{
+    while (*start < *end && (**start == ' ' || **start == '\t')) {
+        (*start)++;
+    }
+    while (*end > *start && ((*end)[-1] == ' ' || (*end)[-1] == '\t')) {
+        (*end)--;
+    }
+}
+
+static inline bool kyros_websocket_deflate_is(const char* start, const char* end, const char* name, uint32_t name_length)
+{
+    return (uint64_t)(end - start) == name_length && kyros_http_header_name_equals(start, name_length, name, name_length);
+}
+
+/// @brief 8 to 15, quoted or not, 0 if value is anything else
+static uint8_t kyros_websocket_deflate_window_bits(const char* start, const char* end)
+{
+    if (end - start >= 2 && *start == '"' && end[-1] == '"') {
+        start++;
+        end--;
+    }
+    if (end - start == 1 && *start >= '8' && *start <= '9') {
+        return (uint8_t)(*start - '0');
+    }
+    if (end - start == 2 && *start == '1' && start[1] >= '0' && start[1] <= '5') {
+        return (uint8_t)(10 + start[1] - '0');
+    }
+    return 0;
+}
+
+/// @brief false if it is not permessage-deflate or one of its parameters is unknown, repeated or invalid
+static bool kyros_websocket_deflate_parse(const char* start, const char* end, kyros_websocket_deflate_params* params)
+{
+    *params = (kyros_websocket_deflate_params) { 0 };
+    auto separator = (const char*)memchr(start, ';', (uint64_t)(end - start));
+    auto name_end = separator ? separator : end;
+    kyros_websocket_deflate_trim(&start, &name_end);
+    if (!kyros_websocket_deflate_is(start, name_end, "permessage-deflate", 18)) {
+        return false;
+    }
+    while (separator) {
+        auto param = separator + 1;
+        separator = (const char*)memchr(param, ';', (uint64_t)(end - param));
+        auto param_end = separator ? separator : end;
+        auto equals = (const char*)memchr(param, '=', (uint64_t)(param_end - param));
+        auto param_name_end = equals ? equals : param_end;
+        kyros_websocket_deflate_trim(&param, &param_name_end);
+        const char* value = NULL;
+        auto value_end = param_end;
+        if (equals) {
+            value = equals + 1;
+            kyros_websocket_deflate_trim(&value, &value_end);
+        }
+        if (kyros_websocket_deflate_is(param, param_name_end, "server_no_context_takeover", 26)) {
+            if (params->server_no_context_takeover || value) {
+                return false;
+            }
+            params->server_no_context_takeover = true;
+        } else if (kyros_websocket_deflate_is(param, param_name_end, "client_no_context_takeover", 26)) {
+            if (params->client_no_context_takeover || value) {
+                return false;
+            }
+            params->client_no_context_takeover = true;
+        } else if (kyros_websocket_deflate_is(param, param_name_end, "server_max_window_bits", 22)) {
+            if (params->server_max_window_bits || !value) {
+                return false;
+            }
+            params->server_max_window_bits = kyros_websocket_deflate_window_bits(value, value_end);
+            if (!params->server_max_window_bits) {
+                return false;
+            }
+        } else if (kyros_websocket_deflate_is(param, param_name_end, "client_max_window_bits", 22)) {
+            if (params->client_max_window_bits_present) {
+                return false;
+            }
+            params->client_max_window_bits_present = true;
+            if (value) {
+                params->client_max_window_bits = kyros_websocket_deflate_window_bits(value, value_end);
+                if (!params->client_max_window_bits) {
+                    return false;
+                }
+            }
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+uint32_t kyros_websocket_deflate_offer(kyros_websocket_compression mode, char* out)
+{
+    static const char shared[] = "permessage-deflate; server_no_context_takeover; client_no_context_takeover";
+    static const char dedicated[] = "permessage-deflate; client_max_window_bits";
+    if (mode == KYROS_WEBSOCKET_COMPRESSION_SHARED) {
+        memcpy(out, shared, sizeof(shared) - 1);
+        return sizeof(shared) - 1;
+    }
+    memcpy(out, dedicated, sizeof(dedicated) - 1);
+    return sizeof(dedicated) - 1;
+}
+
+bool kyros_websocket_deflate_negotiate(kyros_websocket* websocket, const char* offers, uint32_t length, char* out, uint32_t* out_length)
+{
+    auto mode = websocket->options.compression;
+    if (mode == KYROS_WEBSOCKET_COMPRESSION_NONE || !offers) {
+        return false;
+    }
+    auto end = offers + length;
+    auto offer = offers;
+    while (offer < end) {
+        auto comma = (const char*)memchr(offer, ',', (uint64_t)(end - offer));
+        auto offer_end = comma ? comma : end;
+        kyros_websocket_deflate_params params;
+        if (kyros_websocket_deflate_parse(offer, offer_end, &params)) {
+            // the shared mode tells the client it can drop its windows too, both directions are reset after every message
+            websocket->deflate_takeover = mode == KYROS_WEBSOCKET_COMPRESSION_DEDICATED && !params.server_no_context_takeover;
+            websocket->inflate_takeover = mode == KYROS_WEBSOCKET_COMPRESSION_DEDICATED && !params.client_no_context_takeover;
+            // a smaller window than the one of our streams is honored by sending everything uncompressed
+            websocket->send_uncompressed = params.server_max_window_bits && params.server_max_window_bits < KYROS_WEBSOCKET_DEFLATE_WINDOW_BITS;
+            websocket->compression = true;
+            auto written = snprintf(out, 128, "permessage-deflate%s%s", websocket->deflate_takeover ? "" : "; server_no_context_takeover",
+                websocket->inflate_takeover ? "" : "; client_no_context_takeover");
+            if (params.server_max_window_bits) {
+                written += snprintf(out + written, 128 - (uint32_t)written, "; server_max_window_bits=%u", params.server_max_window_bits);
+            }
+            *out_length = (uint32_t)written;
+            return true;
+        }
+        offer = offer_end + 1;
+    }
+    return false;
+}
+
+bool kyros_websocket_deflate_accept(kyros_websocket* websocket, const char* response, uint32_t length)
+{
+    auto mode = websocket->options.compression;
+    kyros_websocket_deflate_params params;
+    // a list of extensions fails to parse as one, only permessage-deflate was offered
+    if (mode == KYROS_WEBSOCKET_COMPRESSION_NONE || !kyros_websocket_deflate_parse(response, response + length, &params)
+        || (params.client_max_window_bits_present && !params.client_max_window_bits)) {
+        return false;
+    }
+    websocket->deflate_takeover = mode == KYROS_WEBSOCKET_COMPRESSION_DEDICATED && !params.client_no_context_takeover;
+    // a server can keep its context even when asked not to in the shared mode, its messages then get a dedicated inflater
+    websocket->inflate_takeover = !params.server_no_context_takeover;
+    websocket->send_uncompressed = params.client_max_window_bits && params.client_max_window_bits < KYROS_WEBSOCKET_DEFLATE_WINDOW_BITS;
+    websocket->compression = true;
+    return true;
+}
+
+///
+/// Streams
+///
+
+static voidpf kyros_websocket_zalloc(voidpf opaque, uInt items, uInt size)
+{
+    return kyros_alloc((uint64_t)items * size);
+}
+
+static void kyros_websocket_zfree(voidpf opaque, voidpf address)
+{
+    kyros_free(address);
+}
+
+static kyros_websocket_zstream* kyros_websocket_zstream_create(kyros_websocket_zstream_kind kind)
+{
+    auto zstream = (kyros_websocket_zstream*)kyros_calloc(1, sizeof(kyros_websocket_zstream));
+    zstream->stream.zalloc = kyros_websocket_zalloc;
+    zstream->stream.zfree = kyros_websocket_zfree;
+    // raw deflate, the zlib header and trailer are not part of the protocol
+    auto result = kind == KYROS_WEBSOCKET_DEFLATER
+        ? deflateInit2(&zstream->stream, KYROS_WEBSOCKET_DEFLATE_LEVEL, Z_DEFLATED, -KYROS_WEBSOCKET_DEFLATE_WINDOW_BITS,
+              KYROS_WEBSOCKET_DEFLATE_MEM_LEVEL, Z_DEFAULT_STRATEGY)
+        : inflateInit2(&zstream->stream, -KYROS_WEBSOCKET_DEFLATE_WINDOW_BITS);
+    if (result != Z_OK) {
+        panic("zlib stream could not be initialized");
+    }
+    return zstream;
+}
+
+static void kyros_websocket_zstream_destroy(kyros_websocket_zstream* zstream, kyros_websocket_zstream_kind kind)
+{
+    if (kind == KYROS_WEBSOCKET_DEFLATER) {
+        deflateEnd(&zstream->stream);
+    } else {
+        inflateEnd(&zstream->stream);
+    }
+    kyros_free(zstream);
+}
+
+static inline void kyros_websocket_zstream_reset(z_stream* stream, kyros_websocket_zstream_kind kind)
+{
+    if (kind == KYROS_WEBSOCKET_DEFLATER) {
+        deflateReset(stream);
+    } else {
+        inflateReset(stream);
+    }
+}
+
+static kyros_websocket_deflate_pool* kyros_websocket_deflate_pool_get(kyros_loop* loop)
+{
+    auto internal = kyros_get_internal_loop(loop);
+    if (!internal->deflate_pool) {
+        internal->deflate_pool = (kyros_websocket_deflate_pool*)kyros_calloc(1, sizeof(kyros_websocket_deflate_pool));
+    }
+    return internal->deflate_pool;
+}
+
+static inline z_stream* kyros_websocket_zstream_shared(kyros_websocket_deflate_pool* pool, kyros_websocket_zstream_kind kind)
+{
+    if (!pool->shared[kind]) {
+        pool->shared[kind] = kyros_websocket_zstream_create(kind);
+    }
+    return &pool->shared[kind]->stream;
+}
+
+/// @brief the stream a message of websocket is (de)compressed with, takeover picks its dedicated one
+static z_stream* kyros_websocket_zstream_get(kyros_websocket* websocket, kyros_websocket_zstream_kind kind, bool takeover)
+{
+    auto pool = kyros_websocket_deflate_pool_get(websocket->loop);
+    if (!takeover) {
+        return kyros_websocket_zstream_shared(pool, kind);
+    }
+    auto dedicated = kind == KYROS_WEBSOCKET_DEFLATER ? &websocket->deflater : &websocket->inflater;
+    if (!*dedicated) {
+        if (pool->idle[kind]) {
+            *dedicated = pool->idle[kind];
+            pool->idle[kind] = (*dedicated)->next;
+            pool->idle_count[kind]--;
+        } else {
+            *dedicated = kyros_websocket_zstream_create(kind);
+        }
+    }
+    return &(*dedicated)->stream;
+}
+
+static void kyros_websocket_zstream_release(kyros_websocket_deflate_pool* pool, kyros_websocket_zstream* zstream, kyros_websocket_zstream_kind kind)
+{
+    if (!zstream) {
+        return;
+    }
+    if (pool->idle_count[kind] >= KYROS_WEBSOCKET_DEFLATE_IDLE) {
+        kyros_websocket_zstream_destroy(zstream, kind);
+        return;
+    }
+    // reset keeps the allocations, the next connection does not pay for them again
+    kyros_websocket_zstream_reset(&zstream->stream, kind);
+    zstream->next = pool->idle[kind];
+    pool->idle[kind] = zstream;
+    pool->idle_count[kind]++;
+}
+
+void kyros_websocket_deflate_release(kyros_websocket* websocket)
+{
+    if (!websocket->deflater && !websocket->inflater) {
+        return;
+    }
+    auto pool = kyros_get_internal_loop(websocket->loop)->deflate_pool;
+    kyros_websocket_zstream_release(pool, websocket->deflater, KYROS_WEBSOCKET_DEFLATER);
+    kyros_websocket_zstream_release(pool, websocket->inflater, KYROS_WEBSOCKET_INFLATER);
+    websocket->deflater = NULL;
+    websocket->inflater = NULL;
+}
+
+void kyros_websocket_deflate_restart(kyros_websocket* websocket)
+{
+    if (!websocket->deflater) {
+        return;
+    }
+    // the next message starts a new window, it never points back past the one the peer got from elsewhere
+    kyros_websocket_zstream_release(kyros_get_internal_loop(websocket->loop)->deflate_pool, websocket->deflater, KYROS_WEBSOCKET_DEFLATER);
+    websocket->deflater = NULL;
+}
+
+void kyros_websocket_deflate_pool_destroy(kyros_websocket_deflate_pool* pool)
+{
+    for (uint32_t kind = 0; kind < 2; kind++) {
+        if (pool->shared[kind]) {
+            kyros_websocket_zstream_destroy(pool->shared[kind], kind);
+        }
+        auto zstream = pool->idle[kind];
+        while (zstream) {
+            auto next = zstream->next;
+            kyros_websocket_zstream_destroy(zstream, kind);
+            zstream = next;
+        }
+    }
+    kyros_free(pool);
+}
+
+///
+/// Messages
+///
+
+/// @brief bigger pooled buffer with the used bytes of buffer, z_stream sizes are 32 bits
+static char* kyros_websocket_deflate_grow(kyros_buffer_pool* pool, char* buffer, uint64_t used, uint64_t* capacity)
+{
+    uint64_t size = *capacity * 2;
+    auto grown = kyros_buffer_pool_get(pool, &size);
+    memcpy(grown, buffer, used);
+    kyros_buffer_pool_release(pool, buffer, *capacity);
+    *capacity = size;
+    return grown;
+}
+
+static inline uInt kyros_websocket_deflate_avail(uint64_t available)
+{
+    return available > UINT32_MAX ? UINT32_MAX : (uInt)available;
+}
+
+static char* kyros_websocket_deflate_with(z_stream* stream, bool takeover, kyros_buffer_pool* pool, const char* data, uint64_t length,
+    uint32_t header_room, uint64_t* out_length, uint64_t* capacity)
+{
+    m_assert(length <= UINT32_MAX, "kyros_websocket_deflate of more than 4 GiB");
+    // deflateBound is for Z_FINISH, the sync flush adds a few bytes
+    *capacity = header_room + deflateBound(stream, length) + 16;
+    auto out = kyros_buffer_pool_get(pool, capacity);
+    uint64_t used = header_room;
+    stream->next_in = (Bytef*)data;
+    stream->avail_in = (uInt)length;
+    while (true) {
+        stream->next_out = (Bytef*)out + used;
+        stream->avail_out = kyros_websocket_deflate_avail(*capacity - used);
+        auto available = stream->avail_out;
+        auto result = deflate(stream, Z_SYNC_FLUSH);
+        m_assert(result == Z_OK || result == Z_BUF_ERROR, "deflate failed");
+        used += available - stream->avail_out;
+        if (stream->avail_out) {
+            break;
+        }
+        out = kyros_websocket_deflate_grow(pool, out, used, capacity);
+    }
+    if (!takeover) {
+        deflateReset(stream);
+    }
+    // the 00 00 ff ff of the sync flush is left out (7.2.1)
+    *out_length = used - header_room - 4;
+    return out;
+}
+
+char* kyros_websocket_deflate(kyros_websocket* websocket, const char* data, uint64_t length, uint32_t header_room, uint64_t* out_length, uint64_t* capacity)
+{
+    bool takeover = websocket->deflate_takeover;
+    auto stream = kyros_websocket_zstream_get(websocket, KYROS_WEBSOCKET_DEFLATER, takeover);
+    auto pool = &kyros_get_internal_loop(websocket->loop)->buffer_pool;
+    return kyros_websocket_deflate_with(stream, takeover, pool, data, length, header_room, out_length, capacity);
+}
+
+char* kyros_websocket_deflate_shared(kyros_loop* loop, const char* data, uint64_t length, uint32_t header_room, uint64_t* out_length, uint64_t* capacity)
+{
+    auto stream = kyros_websocket_zstream_shared(kyros_websocket_deflate_pool_get(loop), KYROS_WEBSOCKET_DEFLATER);
+    return kyros_websocket_deflate_with(stream, false, &kyros_get_internal_loop(loop)->buffer_pool, data, length, header_room, out_length, capacity);
+}
+
+char* kyros_websocket_inflate(kyros_websocket* websocket, const char* data, uint64_t length, uint64_t* out_length, uint64_t* capacity, bool* too_big)
+{
+    static const uint8_t tail[4] = { 0x00, 0x00, 0xff, 0xff };
+    bool takeover = websocket->inflate_takeover;
+    auto stream = kyros_websocket_zstream_get(websocket, KYROS_WEBSOCKET_INFLATER, takeover);
+    auto pool = &kyros_get_internal_loop(websocket->loop)->buffer_pool;
+    auto max = websocket->options.max_message_size;
+    *too_big = false;
+    *capacity = length * 4 < max ? length * 4 : max;
+    auto out = kyros_buffer_pool_get(pool, capacity);
+    uint64_t used = 0;
+    auto input = (const Bytef*)data;
+    auto remaining = length;
+    // the tail removed by the sender goes in after the payload
+    bool tail_given = false;
+    bool failed = false;
+    while (true) {
+        if (!stream->avail_in && remaining) {
+            stream->next_in = (Bytef*)input;
+            stream->avail_in = kyros_websocket_deflate_avail(remaining);
+            input += stream->avail_in;
+            remaining -= stream->avail_in;
+        } else if (!stream->avail_in && !tail_given) {
+            stream->next_in = (Bytef*)tail;
+            stream->avail_in = sizeof(tail);
+            tail_given = true;
+        }
+        if (used > max) {
+            *too_big = true;
+            failed = true;
+            break;
+        }
+        if (used == *capacity) {
+            out = kyros_websocket_deflate_grow(pool, out, used, capacity);
+        }
+        // one byte past max is enough to know it is too big
+        auto limit = *capacity < max + 1 ? *capacity : max + 1;
+        stream->next_out = (Bytef*)out + used;
+        stream->avail_out = kyros_websocket_deflate_avail(limit - used);
+        auto available = stream->avail_out;
+        auto result = inflate(stream, Z_SYNC_FLUSH);
+        used += available - stream->avail_out;
+        if (result == Z_STREAM_END) {
+            // a final block ends the message, the window can not be kept past it
+            inflateReset(stream);
+            break;
+        }
+        if (result != Z_OK && result != Z_BUF_ERROR) {
+            failed = true;
+            break;
+        }
+        // done once everything went in and inflate stopped for lack of input rather than of room
+        if (!remaining && tail_given && !stream->avail_in && stream->avail_out) {
+            break;
+        }
+    }
+    if (used > max) {
+        *too_big = true;
+        failed = true;
+    }
+    if (failed || !takeover) {
+        inflateReset(stream);
+        stream->avail_in = 0;
+    }
+    if (failed) {
+        kyros_buffer_pool_release(pool, out, *capacity);
+        return NULL;
+    }
+    *out_length = used;
+    return out;
+}
@@ -0,0 +1,387 @@
+#include <kyros.h>
+#include <kyros_internal.h>
+
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+// payloads are unmasked and validated in place where they were received (loop recv buffer, io_uring
+// buffers, decrypt buffer, pooled buffers), unlike the http scanner nothing is read past the end
+
+///
+/// Frames
+///
+
+int32_t kyros_websocket_parse_frame(const char* data, uint64_t length, kyros_websocket_frame* frame)
+{
+    if (length < 2) {
+        return KYROS_WEBSOCKET_PARSE_INCOMPLETE;
+    }
+    auto bytes = (const uint8_t*)data;
+    frame->fin = bytes[0] & 0x80;
+    frame->rsv = (bytes[0] >> 4) & 7;
+    frame->opcode = bytes[0] & 0x0f;
+    frame->masked = bytes[1] & 0x80;
+    uint32_t header = 2;
+    uint64_t payload = bytes[1] & 0x7f;
+    if (payload == 126) {
+        header = 4;
+    } else if (payload == 127) {
+        header = 10;
+    }
+    if (frame->masked) {
+        header += 4;
+    }
+    if (length < header) {
+        return KYROS_WEBSOCKET_PARSE_INCOMPLETE;
+    }
+    if (payload == 126) {
+        payload = (uint64_t)bytes[2] << 8 | bytes[3];
+    } else if (payload == 127) {
+        payload = 0;
+        for (uint32_t i = 2; i < 10; i++) {
+            payload = payload << 8 | bytes[i];
+        }
+        // the most significant bit must be 0
+        if (payload >> 63) {
+            return KYROS_WEBSOCKET_PARSE_ERROR;
+        }
+    }
+    frame->payload_length = payload;
+    frame->mask = 0;
+    if (frame->masked) {
+        memcpy(&frame->mask, data + header - 4, 4);
+    }
+    frame->header_length = (uint8_t)header;
+    return (int32_t)header;
+}
+
+uint32_t kyros_websocket_format_frame(char* out, uint8_t first_byte, uint64_t length, bool masked, uint32_t mask)
+{
+    auto bytes = (uint8_t*)out;
+    bytes[0] = first_byte;
+    uint8_t mask_bit = masked ? 0x80 : 0;
+    uint32_t header;
+    if (length < 126) {
+        bytes[1] = mask_bit | (uint8_t)length;
+        header = 2;
+    } else if (length <= 0xffff) {
+        bytes[1] = mask_bit | 126;
+        bytes[2] = (uint8_t)(length >> 8);
+        bytes[3] = (uint8_t)length;
+        header = 4;
+    } else {
+        bytes[1] = mask_bit | 127;
+        for (uint32_t i = 0; i < 8; i++) {
+            bytes[2 + i] = (uint8_t)(length >> (56 - 8 * i));
+        }
+        header = 10;
+    }
+    if (masked) {
+        memcpy(out + header, &mask, 4);
+        header += 4;
+    }
+    return header;
+}
+
+///
+/// Masking
+///
+
+void kyros_websocket_mask(char* out, const char* in, uint64_t length, uint32_t mask)
+{
+    // mask holds the 4 key bytes in memory order, so any vector of it repeats them the same way
+    uint64_t i = 0;
+#if defined(__AVX2__)
+    auto key = _mm256_set1_epi32((int)mask);
+    for (; i + 32 <= length; i += 32) {
+        auto bytes = _mm256_loadu_si256((const __m256i*)(in + i));
+        _mm256_storeu_si256((__m256i*)(out + i), _mm256_xor_si256(bytes, key));
+    }
+#elif defined(__SSE2__) || defined(_M_X64)
+    auto key = _mm_set1_epi32((int)mask);
+    for (; i + 16 <= length; i += 16) {
+        auto bytes = _mm_loadu_si128((const __m128i*)(in + i));
+        _mm_storeu_si128((__m128i*)(out + i), _mm_xor_si128(bytes, key));
+    }
+#elif defined(__ARM_NEON)
+    auto key = vreinterpretq_u8_u32(vdupq_n_u32(mask));
+    for (; i + 16 <= length; i += 16) {
+        vst1q_u8((uint8_t*)out + i, veorq_u8(vld1q_u8((const uint8_t*)in + i), key));
+    }
+#endif
+    // every step above is a multiple of 4 so the key is still aligned with i
+    uint64_t wide = (uint64_t)mask << 32 | mask;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t value;
+        memcpy(&value, in + i, 8);
+        value ^= wide;
+        memcpy(out + i, &value, 8);
+    }
+    auto key_bytes = (const uint8_t*)&mask;
+    for (; i < length; i++) {
+        out[i] = (char)(in[i] ^ key_bytes[i & 3]);
+    }
+}
+
+///
+/// UTF-8
+///
+
+#if !defined(__AVX2__) && !(defined(__ARM_NEON) && defined(__aarch64__))
+/// @brief end of the sequence starting at p, NULL if it is invalid (overlong, surrogate, above U+10FFFF) or truncated
+static inline const uint8_t* kyros_utf8_sequence(const uint8_t* p, const uint8_t* end)
+{
+    auto lead = p[0];
+    if (lead < 0x80) {
+        return p + 1;
+    }
+    uint32_t continuations;
+    uint8_t low = 0x80;
+    uint8_t high = 0xbf;
+    if (lead >= 0xc2 && lead <= 0xdf) {
+        continuations = 1;
+    } else if (lead >= 0xe0 && lead <= 0xef) {
+        continuations = 2;
+        if (lead == 0xe0) {
+            low = 0xa0;
+        } else if (lead == 0xed) {
+            high = 0x9f;
+        }
+    } else if (lead >= 0xf0 && lead <= 0xf4) {
+        continuations = 3;
+        if (lead == 0xf0) {
+            low = 0x90;
+        } else if (lead == 0xf4) {
+            high = 0x8f;
+        }
+    } else {
+        return NULL;
+    }
+    if ((uint64_t)(end - p) <= continuations || p[1] < low || p[1] > high) {
+        return NULL;
+    }
+    for (uint32_t i = 2; i <= continuations; i++) {
+        if ((p[i] & 0xc0) != 0x80) {
+            return NULL;
+        }
+    }
+    return p + continuations + 1;
+}
+
+/// @brief sequence by sequence from p until stop (or past it when a sequence crosses it), NULL if invalid
+static const uint8_t* kyros_utf8_scalar(const uint8_t* p, const uint8_t* stop, const uint8_t* end)
+{
+    while (p < stop) {
+        if (end - p >= 8) {
+            uint64_t value;
+            memcpy(&value, p, 8);
+            if (!(value & 0x8080808080808080ull)) {
+                p += 8;
+                continue;
+            }
+        }
+        p = kyros_utf8_sequence(p, end);
+        if (!p) {
+            return NULL;
+        }
+    }
+    return p;
+}
+
+#endif
+
+#if defined(__AVX2__) || (defined(__ARM_NEON) && defined(__aarch64__))
+// Keiser and Lemire, "Validating UTF-8 In Less Than One Instruction Per Byte": each byte is checked
+// against the one before it with 3 nibble lookups, the 2 bytes before that only for 3 and 4 byte sequences
+#define KYROS_UTF8_TOO_SHORT (1 << 0) // lead byte followed by a lead byte or ascii
+#define KYROS_UTF8_TOO_LONG (1 << 1) // ascii followed by a continuation
+#define KYROS_UTF8_OVERLONG_3 (1 << 2) // 11100000 100_____
+#define KYROS_UTF8_TOO_LARGE (1 << 3) // 11110100 1001____ and above
+#define KYROS_UTF8_SURROGATE (1 << 4) // 11101101 101_____
+#define KYROS_UTF8_OVERLONG_2 (1 << 5) // 1100000_ 10______
+#define KYROS_UTF8_TOO_LARGE_1000 (1 << 6) // 11110101 1000____ and above
+#define KYROS_UTF8_OVERLONG_4 (1 << 6) // 11110000 1000____
+#define KYROS_UTF8_TWO_CONTS (1 << 7) // continuation after a continuation, only fine in 3 and 4 byte sequences
+#define KYROS_UTF8_CARRY (KYROS_UTF8_TOO_SHORT | KYROS_UTF8_TOO_LONG | KYROS_UTF8_TWO_CONTS)
+
+// indexed by the high nibble of the previous byte
+static const uint8_t kyros_utf8_byte_1_high[16] = {
+    KYROS_UTF8_TOO_LONG, KYROS_UTF8_TOO_LONG, KYROS_UTF8_TOO_LONG, KYROS_UTF8_TOO_LONG,
+    KYROS_UTF8_TOO_LONG, KYROS_UTF8_TOO_LONG, KYROS_UTF8_TOO_LONG, KYROS_UTF8_TOO_LONG,
+    KYROS_UTF8_TWO_CONTS, KYROS_UTF8_TWO_CONTS, KYROS_UTF8_TWO_CONTS, KYROS_UTF8_TWO_CONTS,
+    KYROS_UTF8_TOO_SHORT | KYROS_UTF8_OVERLONG_2,
+    KYROS_UTF8_TOO_SHORT,
+    KYROS_UTF8_TOO_SHORT | KYROS_UTF8_OVERLONG_3 | KYROS_UTF8_SURROGATE,
+    KYROS_UTF8_TOO_SHORT | KYROS_UTF8_TOO_LARGE | KYROS_UTF8_TOO_LARGE_1000 | KYROS_UTF8_OVERLONG_4,
+};
+
+// indexed by the low nibble of the previous byte
+static const uint8_t kyros_utf8_byte_1_low[16] = {
+    KYROS_UTF8_CARRY | KYROS_UTF8_OVERLONG_3 | KYROS_UTF8_OVERLONG_2 | KYROS_UTF8_OVERLONG_4,
+    KYROS_UTF8_CARRY | KYROS_UTF8_OVERLONG_2,
+    KYROS_UTF8_CARRY,
+    KYROS_UTF8_CARRY,
+    KYROS_UTF8_CARRY | KYROS_UTF8_TOO_LARGE,
+    KYROS_UTF8_CARRY | KYROS_UTF8_TOO_LARGE | KYROS_UTF8_TOO_LARGE_1000,
+    KYROS_UTF8_CARRY | KYROS_UTF8_TOO_LARGE | KYROS_UTF8_TOO_LARGE_1000,
+    KYROS_UTF8_CARRY | KYROS_UTF8_TOO_LARGE | KYROS_UTF8_TOO_LARGE_1000,
+    KYROS_UTF8_CARRY | KYROS_UTF8_TOO_LARGE | KYROS_UTF8_TOO_LARGE_1000,
+    KYROS_UTF8_CARRY | KYROS_UTF8_TOO_LARGE | KYROS_UTF8_TOO_LARGE_1000,
+    KYROS_UTF8_CARRY | KYROS_UTF8_TOO_LARGE | KYROS_UTF8_TOO_LARGE_1000,
+    KYROS_UTF8_CARRY | KYROS_UTF8_TOO_LARGE | KYROS_UTF8_TOO_LARGE_1000,
+    KYROS_UTF8_CARRY | KYROS_UTF8_TOO_LARGE | KYROS_UTF8_TOO_LARGE_1000,
+    KYROS_UTF8_CARRY | KYROS_UTF8_TOO_LARGE | KYROS_UTF8_TOO_LARGE_1000 | KYROS_UTF8_SURROGATE,
+    KYROS_UTF8_CARRY | KYROS_UTF8_TOO_LARGE | KYROS_UTF8_TOO_LARGE_1000,
+    KYROS_UTF8_CARRY | KYROS_UTF8_TOO_LARGE | KYROS_UTF8_TOO_LARGE_1000,
+};
+
+// indexed by the high nibble of the current byte
+static const uint8_t kyros_utf8_byte_2_high[16] = {
+    KYROS_UTF8_TOO_SHORT, KYROS_UTF8_TOO_SHORT, KYROS_UTF8_TOO_SHORT, KYROS_UTF8_TOO_SHORT,
+    KYROS_UTF8_TOO_SHORT, KYROS_UTF8_TOO_SHORT, KYROS_UTF8_TOO_SHORT, KYROS_UTF8_TOO_SHORT,
+    KYROS_UTF8_TOO_LONG | KYROS_UTF8_OVERLONG_2 | KYROS_UTF8_TWO_CONTS | KYROS_UTF8_OVERLONG_3 | KYROS_UTF8_TOO_LARGE_1000 | KYROS_UTF8_OVERLONG_4,
+    KYROS_UTF8_TOO_LONG | KYROS_UTF8_OVERLONG_2 | KYROS_UTF8_TWO_CONTS | KYROS_UTF8_OVERLONG_3 | KYROS_UTF8_TOO_LARGE,
+    KYROS_UTF8_TOO_LONG | KYROS_UTF8_OVERLONG_2 | KYROS_UTF8_TWO_CONTS | KYROS_UTF8_SURROGATE | KYROS_UTF8_TOO_LARGE,
+    KYROS_UTF8_TOO_LONG | KYROS_UTF8_OVERLONG_2 | KYROS_UTF8_TWO_CONTS | KYROS_UTF8_SURROGATE | KYROS_UTF8_TOO_LARGE,
+    KYROS_UTF8_TOO_SHORT, KYROS_UTF8_TOO_SHORT, KYROS_UTF8_TOO_SHORT, KYROS_UTF8_TOO_SHORT,
+};
+
+// the last 3 bytes of a block can't start a sequence longer than what is left of it
+static const uint8_t kyros_utf8_max_tail[32] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xf0 - 1, 0xe0 - 1, 0xc0 - 1,
+};
+#endif
+
+#if defined(__AVX2__)
+// the 32 bytes ending n bytes before the end of input
+#define KYROS_UTF8_PREVIOUS(input, previous, n) _mm256_alignr_epi8(input, _mm256_permute2x128_si256(previous, input, 0x21), 16 - (n))
+
+static inline __m256i kyros_utf8_lookup(const uint8_t table[16], __m256i nibbles)
+{
+    return _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)table)), nibbles);
+}
+
+/// @brief non zero bytes where input (after previous) is not valid, sequences cut at the end are checked with the next block
+static inline __m256i kyros_utf8_check_block(__m256i input, __m256i previous)
+{
+    auto nibble = _mm256_set1_epi8(0x0f);
+    auto previous1 = KYROS_UTF8_PREVIOUS(input, previous, 1);
+    auto byte_1_high = kyros_utf8_lookup(kyros_utf8_byte_1_high, _mm256_and_si256(_mm256_srli_epi16(previous1, 4), nibble));
+    auto byte_1_low = kyros_utf8_lookup(kyros_utf8_byte_1_low, _mm256_and_si256(previous1, nibble));
+    auto byte_2_high = kyros_utf8_lookup(kyros_utf8_byte_2_high, _mm256_and_si256(_mm256_srli_epi16(input, 4), nibble));
+    auto special = _mm256_and_si256(_mm256_and_si256(byte_1_high, byte_1_low), byte_2_high);
+    // TWO_CONTS is only an error if no 3 or 4 byte lead is 2 or 3 bytes back
+    auto third = _mm256_subs_epu8(KYROS_UTF8_PREVIOUS(input, previous, 2), _mm256_set1_epi8((char)(0xe0 - 1)));
+    auto fourth = _mm256_subs_epu8(KYROS_UTF8_PREVIOUS(input, previous, 3), _mm256_set1_epi8((char)(0xf0 - 1)));
+    auto expected = _mm256_cmpgt_epi8(_mm256_or_si256(third, fourth), _mm256_setzero_si256());
+    return _mm256_xor_si256(_mm256_and_si256(expected, _mm256_set1_epi8((char)0x80)), special);
+}
+
+bool kyros_websocket_utf8_is_valid(const char* data, uint64_t length)
+{
+    auto p = (const uint8_t*)data;
+    auto end = p + length;
+    auto error = _mm256_setzero_si256();
+    auto previous = _mm256_setzero_si256();
+    auto incomplete = _mm256_setzero_si256();
+    auto max_tail = _mm256_loadu_si256((const __m256i*)kyros_utf8_max_tail);
+    uint8_t last[32];
+    while (p < end) {
+        __m256i input;
+        if (end - p >= 32) {
+            input = _mm256_loadu_si256((const __m256i*)p);
+        } else {
+            // zeros are ascii, they end whatever sequence is cut
+            memset(last, 0, sizeof(last));
+            memcpy(last, p, (uint64_t)(end - p));
+            input = _mm256_loadu_si256((const __m256i*)last);
+        }
+        p += 32;
+        if (!_mm256_movemask_epi8(input)) {
+            // a sequence cut by the previous block can't be finished by ascii
+            error = _mm256_or_si256(error, incomplete);
+            incomplete = _mm256_setzero_si256();
+        } else {
+            error = _mm256_or_si256(error, kyros_utf8_check_block(input, previous));
+            incomplete = _mm256_subs_epu8(input, max_tail);
+        }
+        previous = input;
+    }
+    error = _mm256_or_si256(error, incomplete);
+    return _mm256_testz_si256(error, error);
+}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+static inline uint8x16_t kyros_utf8_check_block(uint8x16_t input, uint8x16_t previous)
+{
+    auto previous1 = vextq_u8(previous, input, 15);
+    auto byte_1_high = vqtbl1q_u8(vld1q_u8(kyros_utf8_byte_1_high), vshrq_n_u8(previous1, 4));
+    auto byte_1_low = vqtbl1q_u8(vld1q_u8(kyros_utf8_byte_1_low), vandq_u8(previous1, vdupq_n_u8(0x0f)));
+    auto byte_2_high = vqtbl1q_u8(vld1q_u8(kyros_utf8_byte_2_high), vshrq_n_u8(input, 4));
+    auto special = vandq_u8(vandq_u8(byte_1_high, byte_1_low), byte_2_high);
+    auto third = vqsubq_u8(vextq_u8(previous, input, 14), vdupq_n_u8(0xe0 - 1));
+    auto fourth = vqsubq_u8(vextq_u8(previous, input, 13), vdupq_n_u8(0xf0 - 1));
+    auto expected = vcgtq_u8(vorrq_u8(third, fourth), vdupq_n_u8(0));
+    return veorq_u8(vandq_u8(expected, vdupq_n_u8(0x80)), special);
+}
+
+bool kyros_websocket_utf8_is_valid(const char* data, uint64_t length)
+{
+    auto p = (const uint8_t*)data;
+    auto end = p + length;
+    auto error = vdupq_n_u8(0);
+    auto previous = vdupq_n_u8(0);
+    auto incomplete = vdupq_n_u8(0);
+    auto max_tail = vld1q_u8(kyros_utf8_max_tail + 16);
+    uint8_t last[16];
+    while (p < end) {
+        uint8x16_t input;
+        if (end - p >= 16) {
+            input = vld1q_u8(p);
+        } else {
+            memset(last, 0, sizeof(last));
+            memcpy(last, p, (uint64_t)(end - p));
+            input = vld1q_u8(last);
+        }
+        p += 16;
+        if (vmaxvq_u8(input) < 0x80) {
+            error = vorrq_u8(error, incomplete);
+            incomplete = vdupq_n_u8(0);
+        } else {
+            error = vorrq_u8(error, kyros_utf8_check_block(input, previous));
+            incomplete = vqsubq_u8(input, max_tail);
+        }
+        previous = input;
+    }
+    error = vorrq_u8(error, incomplete);
+    return vmaxvq_u8(error) == 0;
+}
+#else
+bool kyros_websocket_utf8_is_valid(const char* data, uint64_t length)
+{
+    auto p = (const uint8_t*)data;
+    auto end = p + length;
+#if defined(__SSE2__) || defined(_M_X64)
+    // no byte shuffle in SSE2, ascii runs are skipped 16 bytes at a time and the rest is decoded
+    while (end - p >= 16) {
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)p));
+        if (!mask) {
+            p += 16;
+            continue;
+        }
+        p = kyros_utf8_scalar(p + __builtin_ctzg(mask), p + 16, end);
+        if (!p) {
+            return false;
+        }
+    }
+#endif
+    return kyros_utf8_scalar(p, end, end) != NULL;
+}
+#endif
@@ -0,0 +1,200 @@
+// cross thread tasks: the MPSC async queue of the loop and the Treiber stack that recycles its tasks
+#include "test.h"
+#include <kyros.h>
+#include <kyros_internal.h>
+#include <uv.h>
+
+#define PRODUCERS 4
+#define TASKS_PER_PRODUCER 50'000
+#define BATCH_SIZE 64
+
+static kyros_loop* loop;
+static uint64_t expected_sequence[PRODUCERS];
+static uint64_t executed;
+static uint64_t order_errors;
+// producer of the batch being run and how many of its tasks are still due, defer_many splices a whole batch at once
+static uint32_t batch_producer;
+static uint32_t batch_left;
+static uint64_t batch_errors;
+
+static inline void* encode_task(uint32_t producer, uint64_t sequence)
+{
+    return (void*)(((uint64_t)producer << 32) | sequence);
+}
+
+static void order_task(void* ctx)
+{
+    auto producer = (uint32_t)((uint64_t)ctx >> 32);
+    auto sequence = (uint64_t)ctx & UINT32_MAX;
+    // every producer sees its tasks run in the order it sent them
+    order_errors += expected_sequence[producer] != sequence;
+    expected_sequence[producer] = sequence + 1;
+    if (batch_left) {
+        batch_errors += batch_producer != producer;
+        batch_left--;
+    } else if (sequence % BATCH_SIZE == 0) {
+        batch_producer = producer;
+        // the last batch of a producer is shorter
+        batch_left = (TASKS_PER_PRODUCER - sequence < BATCH_SIZE ? TASKS_PER_PRODUCER - sequence : BATCH_SIZE) - 1;
+    }
+    if (++executed == (uint64_t)PRODUCERS * TASKS_PER_PRODUCER) {
+        kyros_loop_stop(loop);
+    }
+}
+
+static void defer_producer(void* arg)
+{
+    auto producer = (uint32_t)(uintptr_t)arg;
+    for (uint64_t i = 0; i < TASKS_PER_PRODUCER; i++) {
+        kyros_loop_atomic_defer(loop, order_task, encode_task(producer, i));
+    }
+}
+
+static void defer_many_producer(void* arg)
+{
+    auto producer = (uint32_t)(uintptr_t)arg;
+    kyros_task_entry tasks[BATCH_SIZE];
+    for (uint64_t i = 0; i < TASKS_PER_PRODUCER; i += BATCH_SIZE) {
+        uint64_t count = TASKS_PER_PRODUCER - i < BATCH_SIZE ? TASKS_PER_PRODUCER - i : BATCH_SIZE;
+        for (uint64_t j = 0; j < count; j++) {
+            tasks[j] = (kyros_task_entry) { .task = order_task, .ctx = encode_task(producer, i + j) };
+        }
+        kyros_loop_atomic_defer_many(loop, tasks, count);
+    }
+}
+
+static void submit_producer(void* arg)
+{
+    auto producer = (uint32_t)(uintptr_t)arg;
+    for (uint64_t i = 0; i < TASKS_PER_PRODUCER; i++) {
+        kyros_loop_atomic_submit(loop, order_task, encode_task(producer, i));
+    }
+    kyros_loop_atomic_flush(loop);
+}
+
+static void noop(void* ctx)
+{
+}
+
+/// @brief run the producers against a fresh loop until every task ran
+static void run_producers(void (*producer)(void*))
+{
+    loop = kyros_loop_create(NULL);
+    executed = 0;
+    order_errors = 0;
+    batch_left = 0;
+    batch_errors = 0;
+    for (uint32_t i = 0; i < PRODUCERS; i++) {
+        expected_sequence[i] = 0;
+    }
+    // the loop keeps waiting while the producers are between wakeups
+    auto keep_alive = kyros_loop_timer(loop, noop, NULL, 3'600'000, 0, true);
+    uv_thread_t threads[PRODUCERS];
+    for (uint32_t i = 0; i < PRODUCERS; i++) {
+        uv_thread_create(&threads[i], producer, (void*)(uintptr_t)i);
+    }
+    kyros_loop_run_forever(loop);
+    for (uint32_t i = 0; i < PRODUCERS; i++) {
+        uv_thread_join(&threads[i]);
+    }
+    kyros_timer_unref(keep_alive);
+}
+
+static void test_atomic_defer_order()
+{
+    run_producers(defer_producer);
+    test_assert(executed == (uint64_t)PRODUCERS * TASKS_PER_PRODUCER);
+    test_assert(order_errors == 0);
+    // 200k tasks in flight at most, far below the chunk limit
+    test_assert(kyros_loop_get_stats(loop).async_task_heap_fallbacks == 0);
+    kyros_loop_unref(loop);
+}
+
+static void test_atomic_defer_many_order()
+{
+    run_producers(defer_many_producer);
+    test_assert(executed == (uint64_t)PRODUCERS * TASKS_PER_PRODUCER);
+    test_assert(order_errors == 0);
+    // nothing of another producer runs in the middle of a batch
+    test_assert(batch_errors == 0);
+    kyros_loop_unref(loop);
+}
+
+static void test_atomic_submit_order()
+{
+    run_producers(submit_producer);
+    test_assert(executed == (uint64_t)PRODUCERS * TASKS_PER_PRODUCER);
+    test_assert(order_errors == 0);
+    kyros_loop_unref(loop);
+}
+
+static void count_task(void* ctx)
+{
+    (*(uint64_t*)ctx)++;
+}
+
+static void test_async_task_recycling()
+{
+    auto recycle_loop = kyros_loop_create(NULL);
+    uint64_t count = 0;
+    // one chunk is enough when fewer tasks than a chunk are ever in flight, the rest is recycled through the free list
+    for (uint32_t round = 0; round < 100; round++) {
+        for (uint32_t i = 0; i < ASYNC_TASK_CHUNK_SIZE - 1; i++) {
+            kyros_loop_atomic_defer(recycle_loop, count_task, &count);
+        }
+        kyros_loop_run_once(recycle_loop);
+    }
+    test_assert(count == 100ull * (ASYNC_TASK_CHUNK_SIZE - 1));
+    auto stats = kyros_loop_get_stats(recycle_loop);
+    test_assert(stats.async_task_capacity == ASYNC_TASK_CHUNK_SIZE);
+    test_assert(stats.async_task_heap_fallbacks == 0);
+    kyros_loop_unref(recycle_loop);
+}
+
+static void buffering_thread(void* arg)
+{
+    // never flushed, the thread exit sends them
+    for (uint32_t i = 0; i < 5; i++) {
+        kyros_loop_atomic_submit(arg, count_task, &executed);
+    }
+}
+
+static void test_submission_buffer_lifetime()
+{
+    // what an exiting thread still buffers is sent
+    loop = kyros_loop_create(NULL);
+    executed = 0;
+    uv_thread_t thread;
+    uv_thread_create(&thread, buffering_thread, loop);
+    uv_thread_join(&thread);
+    kyros_loop_run_once(loop);
+    test_assert(executed == 5);
+    kyros_loop_unref(loop);
+
+    // destroyed by its own thread with tasks buffered for it, they run with the last drain instead of going to freed memory
+    auto doomed = kyros_loop_create(NULL);
+    uint64_t count = 0;
+    for (uint32_t i = 0; i < 3; i++) {
+        kyros_loop_atomic_submit(doomed, count_task, &count);
+    }
+    // the atomic ref of the creator goes first, the one of the buffer keeps the loop until the last unref
+    test_assert(!kyros_loop_atomic_unref(doomed));
+    kyros_loop_unref(doomed);
+    test_assert(count == 3);
+    // the buffer that held them is free for another loop
+    auto next = kyros_loop_create(NULL);
+    kyros_loop_atomic_submit(next, count_task, &count);
+    kyros_loop_atomic_flush(NULL);
+    kyros_loop_run_once(next);
+    test_assert(count == 4);
+    kyros_loop_unref(next);
+}
+
+void test_async_queue()
+{
+    test_atomic_defer_order();
+    test_atomic_defer_many_order();
+    test_atomic_submit_order();
+    test_async_task_recycling();
+    test_submission_buffer_lifetime();
+}
@@ -0,0 +1,117 @@
+// kyros_loop_defer lanes: microtasks before and after every normal task, normal tasks in FIFO order under the loop budgets
+#include "test.h"
+#include <kyros.h>
+#include <kyros_internal.h>
+#include <string.h>
+
+static kyros_loop* loop;
+static char order[64];
+static uint32_t order_length;
+
+static void record(char name)
+{
+    if (order_length < sizeof(order) - 1) {
+        order[order_length++] = name;
+        order[order_length] = 0;
+    }
+}
+
+static void record_task(void* ctx)
+{
+    record((char)(uintptr_t)ctx);
+}
+
+static void spawning_task(void* ctx)
+{
+    record('a');
+    // the microtask runs before b, c waits for the next tick
+    kyros_loop_defer(loop, record_task, (void*)'c');
+    kyros_loop_defer_with_priority(loop, record_task, (void*)'m', KYROS_TASK_PRIORITY_MICROTASK);
+}
+
+static void test_microtasks_first()
+{
+    loop = kyros_loop_create(NULL);
+    order_length = 0;
+    order[0] = 0;
+    kyros_loop_defer(loop, spawning_task, NULL);
+    kyros_loop_defer(loop, record_task, (void*)'b');
+    kyros_loop_defer_with_priority(loop, record_task, (void*)'x', KYROS_TASK_PRIORITY_MICROTASK);
+    kyros_loop_run_once(loop);
+    test_assert(!strcmp(order, "xamb"));
+    kyros_loop_run_once(loop);
+    test_assert(!strcmp(order, "xambc"));
+    test_assert(kyros_loop_get_stats(loop).tasks_pending == 0);
+    kyros_loop_unref(loop);
+}
+
+static void count_task(void* ctx)
+{
+    (*(uint64_t*)ctx)++;
+}
+
+static void microtask_spawner(void* ctx)
+{
+    for (uint32_t i = 0; i < 5; i++) {
+        kyros_loop_defer_with_priority(loop, count_task, ctx, KYROS_TASK_PRIORITY_MICROTASK);
+    }
+}
+
+static void test_defer_budget()
+{
+    loop = kyros_loop_create_with_options(NULL, (kyros_loop_options) { .defer_budget = 10 });
+    uint64_t count = 0;
+    for (uint32_t i = 0; i < 25; i++) {
+        kyros_loop_defer(loop, count_task, &count);
+    }
+    // what is over the budget waits for the next iteration, IO runs in between
+    kyros_loop_run_once(loop);
+    test_assert(count == 10);
+    test_assert(kyros_loop_get_stats(loop).tasks_pending == 15);
+    kyros_loop_run_once(loop);
+    test_assert(count == 20);
+    kyros_loop_run_once(loop);
+    test_assert(count == 25);
+    kyros_loop_unref(loop);
+
+    // microtasks don't count
+    loop = kyros_loop_create_with_options(NULL, (kyros_loop_options) { .defer_budget = 1 });
+    count = 0;
+    kyros_loop_defer(loop, microtask_spawner, &count);
+    kyros_loop_defer(loop, count_task, &count);
+    kyros_loop_run_once(loop);
+    test_assert(count == 5);
+    kyros_loop_run_once(loop);
+    test_assert(count == 6);
+    kyros_loop_unref(loop);
+}
+
+static void slow_task(void* ctx)
+{
+    (*(uint64_t*)ctx)++;
+    auto start = uv_hrtime();
+    while (uv_hrtime() - start < 500'000) {
+    }
+}
+
+static void test_defer_time_budget()
+{
+    // 0.5 ms per task against 2 ms, the clock is read every 16 tasks so the first check stops it
+    loop = kyros_loop_create_with_options(NULL, (kyros_loop_options) { .defer_time_budget = 2000 });
+    uint64_t count = 0;
+    for (uint32_t i = 0; i < 64; i++) {
+        kyros_loop_defer(loop, slow_task, &count);
+    }
+    kyros_loop_run_once(loop);
+    test_assert(count == 16);
+    kyros_loop_run_forever(loop);
+    test_assert(count == 64);
+    kyros_loop_unref(loop);
+}
+
+void test_defer_lanes()
+{
+    test_microtasks_first();
+    test_defer_budget();
+    test_defer_time_budget();
+}
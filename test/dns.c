@@ -0,0 +1,251 @@
+// dns cache with a stub resolver: ttl and negative ttl expiry, stale answers while one refresh runs, hosts file entries
+// surviving kyros_dns_clear and happy eyeballs moving to the next address when the first one is refused
+#include "test.h"
+#include <kyros.h>
+#include <kyros_internal.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HOSTS_FILE "kyros_test_hosts"
+#define HE_PORT 39631
+// a second past the ttl and the stale ttl of 1 second each
+#define EXPIRY_WAIT 2100
+
+typedef enum {
+    STUB_EXPIRE,
+    STUB_MISSING,
+    STUB_STALE,
+    STUB_HAPPY_EYEBALLS,
+    STUB_PINNED,
+    STUB_HOSTS,
+} stub_host;
+
+static const char* stub_names[STUB_HOSTS] = { "expire.test", "missing.test", "stale.test", "he.test", "pinned.test" };
+static _Atomic(uint32_t) stub_calls[STUB_HOSTS];
+// the refresh of stale.test waits for it, so lookups made meanwhile can't race a finished refresh
+static uv_sem_t stale_refresh;
+
+static void ipv4(struct sockaddr_storage* address, const char* ip)
+{
+    memset(address, 0, sizeof(struct sockaddr_storage));
+    uv_ip4_addr(ip, 0, (struct sockaddr_in*)address);
+}
+
+static int32_t stub_resolver(const char* host, struct sockaddr_storage* addresses, uint32_t capacity, uint32_t* ttl, void* ctx)
+{
+    uint32_t index = 0;
+    while (index < STUB_HOSTS && strcmp(host, stub_names[index])) {
+        index++;
+    }
+    if (index == STUB_HOSTS) {
+        return UV_EAI_NONAME;
+    }
+    auto call = atomic_fetch_add(&stub_calls[index], 1) + 1;
+    char ip[32];
+    switch ((stub_host)index) {
+    case STUB_EXPIRE:
+        // a new address every time it is resolved
+        *ttl = 1;
+        snprintf(ip, sizeof(ip), "10.0.0.%u", call);
+        ipv4(&addresses[0], ip);
+        return 1;
+    case STUB_STALE:
+        // expired as soon as it is stored, the refresh lives long
+        if (call == 1) {
+            *ttl = 0;
+        } else {
+            uv_sem_wait(&stale_refresh);
+        }
+        snprintf(ip, sizeof(ip), "10.0.1.%u", call);
+        ipv4(&addresses[0], ip);
+        return 1;
+    case STUB_HAPPY_EYEBALLS:
+        // nothing listens on the first one
+        ipv4(&addresses[0], "127.0.0.1");
+        ipv4(&addresses[1], "127.0.0.2");
+        return 2;
+    default:
+        return UV_EAI_NONAME;
+    }
+}
+
+static kyros_loop* loop;
+
+typedef struct {
+    bool called;
+    int32_t error;
+    uint32_t count;
+    char first[32];
+} lookup_result;
+
+static void lookup_callback(const struct sockaddr_storage* addresses, uint32_t count, int32_t error, void* ctx)
+{
+    lookup_result* result = ctx;
+    result->called = true;
+    result->error = error;
+    result->count = count;
+    result->first[0] = 0;
+    if (count) {
+        uv_ip4_name((const struct sockaddr_in*)&addresses[0], result->first, sizeof(result->first));
+    }
+}
+
+/// @brief lookup answered from the cache, before kyros_dns_lookup returns
+static lookup_result lookup_cached(const char* host)
+{
+    lookup_result result = { 0 };
+    kyros_dns_lookup(loop, host, KYROS_SOCKET_IP_FAMILY_IPV4, lookup_callback, &result);
+    return result;
+}
+
+/// @brief lookup that waits for the resolver if it has to, cached tells which one it was
+static lookup_result lookup(const char* host, bool* cached)
+{
+    lookup_result result = { 0 };
+    kyros_dns_lookup(loop, host, KYROS_SOCKET_IP_FAMILY_IPV4, lookup_callback, &result);
+    *cached = result.called;
+    while (!result.called) {
+        kyros_loop_run_once(loop);
+    }
+    return result;
+}
+
+static void test_ttl_and_negative_ttl()
+{
+    bool cached;
+    auto before = kyros_dns_get_stats();
+    auto result = lookup("expire.test", &cached);
+    test_assert(!cached && result.count == 1 && !strcmp(result.first, "10.0.0.1"));
+    result = lookup_cached("EXPIRE.test");
+    test_assert(result.called && !strcmp(result.first, "10.0.0.1"));
+
+    // failures are remembered too
+    result = lookup("missing.test", &cached);
+    test_assert(!cached && result.error == UV_EAI_NONAME && result.count == 0);
+    result = lookup_cached("missing.test");
+    test_assert(result.called && result.error == UV_EAI_NONAME);
+    auto stats = kyros_dns_get_stats();
+    test_assert(stats.hits - before.hits == 1);
+    test_assert(stats.negative_hits - before.negative_hits == 1);
+    test_assert(atomic_load(&stub_calls[STUB_EXPIRE]) == 1 && atomic_load(&stub_calls[STUB_MISSING]) == 1);
+
+    // past the ttl and the stale ttl the answer is resolved again, and so is the failure past the negative ttl
+    uv_sleep(EXPIRY_WAIT);
+    result = lookup("expire.test", &cached);
+    test_assert(!cached && !strcmp(result.first, "10.0.0.2"));
+    result = lookup("missing.test", &cached);
+    test_assert(!cached && result.error == UV_EAI_NONAME);
+    test_assert(atomic_load(&stub_calls[STUB_EXPIRE]) == 2 && atomic_load(&stub_calls[STUB_MISSING]) == 2);
+}
+
+static void test_stale_while_revalidate()
+{
+    bool cached;
+    auto result = lookup("stale.test", &cached);
+    test_assert(!cached && !strcmp(result.first, "10.0.1.1"));
+    // expired: the stale answer is given right away and a single refresh starts whatever the number of lookups
+    auto before = kyros_dns_get_stats();
+    for (uint32_t i = 0; i < 3; i++) {
+        result = lookup_cached("stale.test");
+        test_assert(result.called && !strcmp(result.first, "10.0.1.1"));
+    }
+    auto stats = kyros_dns_get_stats();
+    test_assert(stats.stale_hits - before.stale_hits == 3);
+    test_assert(stats.resolutions - before.resolutions == 1);
+    // the refresh replaces the answer once it is done
+    uv_sem_post(&stale_refresh);
+    for (uint32_t i = 0; i < 2000 && strcmp(result.first, "10.0.1.2"); i++) {
+        uv_sleep(1);
+        result = lookup_cached("stale.test");
+    }
+    test_assert(!strcmp(result.first, "10.0.1.2"));
+    test_assert(atomic_load(&stub_calls[STUB_STALE]) == 2);
+}
+
+static void test_hosts_survive_clear()
+{
+    auto result = lookup_cached("pinned.test");
+    test_assert(result.called && !strcmp(result.first, "127.0.0.3"));
+    result = lookup_cached("alias.test");
+    test_assert(result.called && !strcmp(result.first, "127.0.0.3"));
+    kyros_dns_clear();
+    result = lookup_cached("pinned.test");
+    test_assert(result.called && !strcmp(result.first, "127.0.0.3"));
+    test_assert(atomic_load(&stub_calls[STUB_PINNED]) == 0);
+    // what came from the resolver is gone
+    bool cached;
+    result = lookup("expire.test", &cached);
+    test_assert(!cached && !strcmp(result.first, "10.0.0.3"));
+}
+
+static bool he_opened;
+static uint64_t he_open_time;
+static uint32_t he_accepted;
+
+static void he_client_status(kyros_socket socket, kyros_socket_error error, void* ctx)
+{
+    auto state = kyros_socket_get_state(socket);
+    if (state == KYROS_SOCKET_STATE_OPEN) {
+        he_opened = true;
+        he_open_time = uv_hrtime() - *(uint64_t*)ctx;
+        kyros_socket_close(socket);
+    } else if (state == KYROS_SOCKET_STATE_CLOSED) {
+        kyros_loop_stop(loop);
+    }
+}
+
+static void he_server_status(kyros_socket socket, kyros_socket_error error, void* ctx)
+{
+    if (kyros_socket_get_state(socket) == KYROS_SOCKET_STATE_OPEN) {
+        he_accepted++;
+    }
+}
+
+static void test_happy_eyeballs_refused()
+{
+    kyros_socket_handler server = { .onstatus = he_server_status, .ref_count = 1 };
+    auto listener = kyros_socket_listen(loop,
+        (kyros_socket_source) { .type = KYROS_SOCKET_SOURCE_HOSTPORT, .value.host_port = { .host = "127.0.0.2", .port = HE_PORT } },
+        (kryos_socket_options) { 0 }, &server);
+    test_assert(listener.tagged_ptr);
+    uint64_t start = uv_hrtime();
+    kyros_socket_handler client = { .onstatus = he_client_status, .ctx = &start, .ref_count = 1 };
+    kyros_socket_connect(loop,
+        (kyros_socket_source) { .type = KYROS_SOCKET_SOURCE_HOSTPORT, .value.host_port = { .host = "he.test", .port = HE_PORT, .use_happy_eyeballs = true } },
+        (kryos_socket_options) { 0 }, &client);
+    kyros_loop_run_forever(loop);
+    kyros_socket_close(listener);
+    kyros_loop_run_once(loop);
+    test_assert(he_opened && he_accepted == 1);
+    // the refusal moves on at once instead of after the 250 ms attempt delay
+    test_assert(he_open_time < 250'000'000);
+}
+
+void test_dns()
+{
+    auto hosts = fopen(HOSTS_FILE, "w");
+    fputs("# pinned names\n127.0.0.3 pinned.test alias.test\n", hosts);
+    fclose(hosts);
+    uv_sem_init(&stale_refresh, 0);
+    for (uint32_t i = 0; i < STUB_HOSTS; i++) {
+        atomic_store(&stub_calls[i], 0);
+    }
+    he_opened = false;
+    he_accepted = 0;
+    test_assert(kyros_dns_configure((kyros_dns_options) { .resolver = stub_resolver, .hosts_file = HOSTS_FILE, .ttl = 60, .negative_ttl = 1, .stale_ttl = 1 }));
+    // nothing left in the cache by an earlier run
+    kyros_dns_clear();
+    loop = kyros_loop_create(NULL);
+
+    test_ttl_and_negative_ttl();
+    test_stale_while_revalidate();
+    test_hosts_survive_clear();
+    test_happy_eyeballs_refused();
+
+    kyros_loop_unref(loop);
+    // back to getaddrinfo for whatever runs next
+    kyros_dns_configure((kyros_dns_options) { 0 });
+    uv_sem_destroy(&stale_refresh);
+    remove(HOSTS_FILE);
+}
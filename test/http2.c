@@ -0,0 +1,379 @@
+// HTTP/2 with prior knowledge against a client that writes the frames by hand: requests, flow control windows, resets and connection errors
+#include "test.h"
+#include <kyros.h>
+#include <kyros_internal.h>
+#include <string.h>
+
+#define H2_PORT 39695
+#define BIG_BODY 1000
+#define FRAME_HEADER 9
+
+enum {
+    DATA = 0x0,
+    HEADERS = 0x1,
+    RST_STREAM = 0x3,
+    SETTINGS = 0x4,
+    PING = 0x6,
+    GOAWAY = 0x7,
+    WINDOW_UPDATE = 0x8,
+};
+
+enum {
+    END_STREAM = 0x1,
+    ACK = 0x1,
+    END_HEADERS = 0x4,
+};
+
+typedef struct {
+    uint8_t type;
+    uint8_t flags;
+    uint32_t stream_id;
+    uint32_t length;
+    const char* payload;
+} frame;
+
+static kyros_loop* loop;
+static kyros_socket client;
+static char input[256 * 1024];
+static uint64_t input_length;
+static uint64_t input_offset;
+static bool client_closed;
+static struct lshpack_enc encoder;
+static struct lshpack_dec decoder;
+static char big_body[BIG_BODY];
+static uint32_t aborted;
+static kyros_http_response* held;
+
+static void hold_abort(kyros_http_response* response, void* ctx)
+{
+    aborted++;
+}
+
+static void onrequest(kyros_http_request* request, kyros_http_response* response, void* ctx)
+{
+    test_assert(request->http2 && !request->http3);
+    uint32_t length;
+    auto host = kyros_http_request_get_header(request, "host", 4, &length);
+    test_assert(host && length == 9 && !memcmp(host, "localhost", 9));
+    if (request->target_length == 4 && !memcmp(request->target, "/big", 4)) {
+        kyros_http_response_end(response, big_body, BIG_BODY);
+    } else if (request->target_length == 5 && !memcmp(request->target, "/echo", 5)) {
+        // the DATA frames joined
+        kyros_http_response_end(response, request->body, request->body_length);
+    } else if (request->target_length == 5 && !memcmp(request->target, "/hold", 5)) {
+        // answered later, if the stream is still there
+        held = response;
+        kyros_http_response_onabort(response, hold_abort, NULL);
+    } else {
+        kyros_http_response_write_header(response, "x-kyros", 7, "1", 1);
+        kyros_http_response_end(response, "hello h2", 8);
+    }
+}
+
+static bool client_data(kyros_socket socket, const char* data, uint64_t length, void* ctx)
+{
+    test_assert(input_length + length <= sizeof(input));
+    memcpy(input + input_length, data, length);
+    input_length += length;
+    return true;
+}
+
+static void client_status(kyros_socket socket, kyros_socket_error error, void* ctx)
+{
+    if (kyros_socket_get_state(socket) == KYROS_SOCKET_STATE_CLOSED) {
+        client_closed = true;
+    }
+}
+
+static void send_frame(uint8_t type, uint8_t flags, uint32_t stream_id, const char* payload, uint32_t length)
+{
+    char header[FRAME_HEADER] = {
+        (char)(length >> 16), (char)(length >> 8), (char)length, (char)type, (char)flags,
+        (char)(stream_id >> 24), (char)(stream_id >> 16), (char)(stream_id >> 8), (char)stream_id
+    };
+    kyros_socket_write(client, header, FRAME_HEADER, false);
+    if (length) {
+        kyros_socket_write(client, payload, length, false);
+    }
+}
+
+static void send_u32(uint8_t type, uint32_t stream_id, uint32_t value)
+{
+    char payload[4] = { (char)(value >> 24), (char)(value >> 16), (char)(value >> 8), (char)value };
+    send_frame(type, 0, stream_id, payload, 4);
+}
+
+static void send_setting(uint16_t setting, uint32_t value)
+{
+    char payload[6] = { (char)(setting >> 8), (char)setting, (char)(value >> 24), (char)(value >> 16), (char)(value >> 8), (char)value };
+    send_frame(SETTINGS, 0, 0, payload, 6);
+}
+
+static unsigned char* encode(unsigned char* dst, unsigned char* end, const char* name, const char* value)
+{
+    char field[128];
+    auto name_length = (uint32_t)strlen(name);
+    auto value_length = (uint32_t)strlen(value);
+    memcpy(field, name, name_length);
+    memcpy(field + name_length, value, value_length);
+    lsxpack_header_t header;
+    lsxpack_header_set_offset2(&header, field, 0, name_length, name_length, value_length);
+    return lshpack_enc_encode(&encoder, dst, end, &header);
+}
+
+static void send_request(uint32_t stream_id, const char* method, const char* path, const char* content_length, bool end_stream)
+{
+    unsigned char block[512];
+    auto end = block + sizeof(block);
+    auto dst = encode(block, end, ":method", method);
+    dst = encode(dst, end, ":scheme", "http");
+    dst = encode(dst, end, ":authority", "localhost");
+    dst = encode(dst, end, ":path", path);
+    if (content_length) {
+        dst = encode(dst, end, "content-length", content_length);
+    }
+    send_frame(HEADERS, END_HEADERS | (end_stream ? END_STREAM : 0), stream_id, (const char*)block, (uint32_t)(dst - block));
+}
+
+/// @brief next whole frame from the server, false if none came in time (or the connection closed)
+static bool next_frame(frame* out)
+{
+    for (uint32_t i = 0; i < 2000; i++) {
+        auto available = input_length - input_offset;
+        if (available >= FRAME_HEADER) {
+            auto p = (const uint8_t*)input + input_offset;
+            uint32_t length = (uint32_t)p[0] << 16 | (uint32_t)p[1] << 8 | p[2];
+            if (available >= FRAME_HEADER + length) {
+                *out = (frame) {
+                    .type = p[3],
+                    .flags = p[4],
+                    .stream_id = ((uint32_t)p[5] << 24 | (uint32_t)p[6] << 16 | (uint32_t)p[7] << 8 | p[8]) & 0x7fffffff,
+                    .length = length,
+                    .payload = input + input_offset + FRAME_HEADER,
+                };
+                input_offset += FRAME_HEADER + length;
+                return true;
+            }
+        }
+        if (client_closed) {
+            return false;
+        }
+        kyros_loop_run_once(loop);
+        uv_sleep(1);
+    }
+    return false;
+}
+
+/// @brief next frame that is not one of the connection housekeeping ones (SETTINGS, PING ACK and WINDOW_UPDATE)
+static bool next_stream_frame(frame* out)
+{
+    while (next_frame(out)) {
+        if (out->type != SETTINGS && out->type != WINDOW_UPDATE && !(out->type == PING && out->flags & ACK)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static uint32_t read_u32(const char* p)
+{
+    auto u = (const uint8_t*)p;
+    return (uint32_t)u[0] << 24 | (uint32_t)u[1] << 16 | (uint32_t)u[2] << 8 | u[3];
+}
+
+/// @brief value of name in a response header block, the whole block is decoded to keep the table in sync
+static bool decode_header(const frame* headers, const char* name, const char* value)
+{
+    auto src = (const unsigned char*)headers->payload;
+    auto end = src + headers->length;
+    bool found = false;
+    char buffer[1024];
+    while (src < end) {
+        lsxpack_header_t header;
+        lsxpack_header_prepare_decode(&header, buffer, 0, sizeof(buffer));
+        if (lshpack_dec_decode(&decoder, &src, end, &header) != LSHPACK_OK) {
+            return false;
+        }
+        if (header.name_len == strlen(name) && !memcmp(buffer + header.name_offset, name, header.name_len)) {
+            found = header.val_len == strlen(value) && !memcmp(buffer + header.val_offset, value, header.val_len);
+        }
+    }
+    return found;
+}
+
+/// @brief a fresh connection with the preface and our SETTINGS, the server preface is read before it returns
+static void connect_client(uint32_t initial_window)
+{
+    input_length = 0;
+    input_offset = 0;
+    client_closed = false;
+    lshpack_enc_init(&encoder);
+    lshpack_dec_init(&decoder);
+    static kyros_socket_handler handler = { .ondata = client_data, .onstatus = client_status, .ref_count = 1 };
+    client = kyros_socket_connect(loop,
+        (kyros_socket_source) { .type = KYROS_SOCKET_SOURCE_HOSTPORT, .value.host_port = { .host = "127.0.0.1", .port = H2_PORT } },
+        (kryos_socket_options) { 0 }, &handler);
+    kyros_socket_ref(client);
+    kyros_socket_write(client, "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n", 24, false);
+    send_setting(0x4, initial_window);
+    frame settings;
+    test_assert(next_frame(&settings) && settings.type == SETTINGS && !(settings.flags & ACK));
+    // max concurrent streams, initial window, max header list size
+    test_assert(settings.length == 18);
+    test_assert(read_u32(settings.payload + 8) == KYROS_HTTP2_STREAM_WINDOW);
+    frame window;
+    test_assert(next_frame(&window) && window.type == WINDOW_UPDATE && window.stream_id == 0);
+    test_assert(read_u32(window.payload) == KYROS_HTTP2_CONNECTION_WINDOW - 65535);
+    frame ack;
+    test_assert(next_frame(&ack) && ack.type == SETTINGS && ack.flags & ACK);
+    send_frame(SETTINGS, ACK, 0, NULL, 0);
+}
+
+static void disconnect_client()
+{
+    kyros_socket_close(client);
+    kyros_socket_unref(client);
+    kyros_loop_run_once(loop);
+    lshpack_enc_cleanup(&encoder);
+    lshpack_dec_cleanup(&decoder);
+}
+
+static void test_request()
+{
+    connect_client(65535);
+    send_frame(PING, 0, 0, "12345678", 8);
+    send_request(1, "GET", "/", NULL, true);
+    frame ping;
+    do {
+        test_assert(next_frame(&ping));
+    } while (ping.type != PING);
+    test_assert(ping.flags & ACK && !memcmp(ping.payload, "12345678", 8));
+    frame headers;
+    test_assert(next_stream_frame(&headers) && headers.type == HEADERS && headers.stream_id == 1);
+    test_assert(headers.flags & END_HEADERS && !(headers.flags & END_STREAM));
+    test_assert(decode_header(&headers, ":status", "200"));
+    frame data;
+    test_assert(next_stream_frame(&data) && data.type == DATA && data.stream_id == 1 && data.flags & END_STREAM);
+    test_assert(data.length == 8 && !memcmp(data.payload, "hello h2", 8));
+
+    // the encoder of the server indexed the fields of the first response
+    send_request(3, "GET", "/", NULL, true);
+    test_assert(next_stream_frame(&headers) && headers.type == HEADERS && headers.stream_id == 3);
+    test_assert(decode_header(&headers, "x-kyros", "1"));
+    test_assert(next_stream_frame(&data) && data.stream_id == 3 && data.length == 8);
+
+    // a body in two DATA frames
+    send_request(5, "POST", "/echo", "11", false);
+    send_frame(DATA, 0, 5, "hello ", 6);
+    send_frame(DATA, END_STREAM, 5, "world", 5);
+    test_assert(next_stream_frame(&headers) && headers.stream_id == 5);
+    test_assert(decode_header(&headers, "content-length", "11"));
+    test_assert(next_stream_frame(&data) && data.stream_id == 5 && data.length == 11 && !memcmp(data.payload, "hello world", 11));
+    disconnect_client();
+}
+
+static void test_flow_control()
+{
+    // every stream starts with 100 bytes of window
+    connect_client(100);
+    send_request(1, "GET", "/big", NULL, true);
+    frame headers;
+    test_assert(next_stream_frame(&headers) && headers.type == HEADERS);
+    test_assert(decode_header(&headers, "content-length", "1000"));
+    frame data;
+    test_assert(next_stream_frame(&data) && data.type == DATA && data.length == 100 && !(data.flags & END_STREAM));
+    test_assert(!memcmp(data.payload, big_body, 100));
+    // nothing more until the window grows
+    for (uint32_t i = 0; i < 5; i++) {
+        kyros_loop_run_once(loop);
+    }
+    test_assert(input_offset == input_length);
+
+    send_u32(WINDOW_UPDATE, 1, 400);
+    test_assert(next_stream_frame(&data) && data.type == DATA && data.length == 400 && !(data.flags & END_STREAM));
+    test_assert(!memcmp(data.payload, big_body + 100, 400));
+    // a bigger initial window applies to the open streams too
+    send_setting(0x4, 1000);
+    uint32_t received = 0;
+    while (received < 500) {
+        test_assert(next_stream_frame(&data) && data.type == DATA);
+        test_assert(!memcmp(data.payload, big_body + 500 + received, data.length));
+        received += data.length;
+    }
+    test_assert(received == 500 && data.flags & END_STREAM);
+    disconnect_client();
+}
+
+static void test_reset()
+{
+    aborted = 0;
+    held = NULL;
+    connect_client(65535);
+    send_request(1, "GET", "/hold", NULL, true);
+    while (!held) {
+        kyros_loop_run_once(loop);
+    }
+    send_u32(RST_STREAM, 1, 0x8);
+    for (uint32_t i = 0; i < 100 && !aborted; i++) {
+        kyros_loop_run_once(loop);
+    }
+    test_assert(aborted == 1);
+    // the connection goes on
+    send_request(3, "GET", "/", NULL, true);
+    frame headers;
+    test_assert(next_stream_frame(&headers) && headers.type == HEADERS && headers.stream_id == 3);
+    disconnect_client();
+}
+
+/// @brief the GOAWAY error code the server answers frame with, the connection closes after it
+static uint32_t goaway_error(uint8_t type, uint8_t flags, uint32_t stream_id, const char* payload, uint32_t length)
+{
+    connect_client(65535);
+    send_frame(type, flags, stream_id, payload, length);
+    frame goaway;
+    if (!next_stream_frame(&goaway) || goaway.type != GOAWAY || goaway.length < 8) {
+        disconnect_client();
+        return UINT32_MAX;
+    }
+    auto code = read_u32(goaway.payload + 4);
+    for (uint32_t i = 0; i < 100 && !client_closed; i++) {
+        kyros_loop_run_once(loop);
+        uv_sleep(1);
+    }
+    test_assert(client_closed);
+    disconnect_client();
+    return code;
+}
+
+static void test_connection_errors()
+{
+    // PROTOCOL_ERROR: DATA on stream 0, even stream ids
+    test_assert(goaway_error(DATA, 0, 0, "x", 1) == 0x1);
+    test_assert(goaway_error(HEADERS, END_HEADERS, 2, "", 0) == 0x1);
+    // FRAME_SIZE_ERROR: a PING of 4 bytes
+    test_assert(goaway_error(PING, 0, 0, "1234", 4) == 0x6);
+    // FLOW_CONTROL_ERROR: the connection window overflows
+    char increment[4] = { 0x7f, (char)0xff, (char)0xff, (char)0xff };
+    test_assert(goaway_error(WINDOW_UPDATE, 0, 0, increment, 4) == 0x3);
+    // COMPRESSION_ERROR: an index past the tables
+    test_assert(goaway_error(HEADERS, END_HEADERS | END_STREAM, 1, "\xff\x80\x01", 3) == 0x9);
+}
+
+void test_http2()
+{
+    for (uint32_t i = 0; i < BIG_BODY; i++) {
+        big_body[i] = (char)('a' + i % 26);
+    }
+    loop = kyros_loop_create(NULL);
+    auto server = kyros_http_server_listen(loop,
+        (kyros_socket_source) { .type = KYROS_SOCKET_SOURCE_HOSTPORT, .value.host_port = { .host = "127.0.0.1", .port = H2_PORT } },
+        (kryos_socket_options) { 0 }, (kyros_http_server_options) { .onrequest = onrequest, .http2 = true });
+    test_assert(server);
+    test_request();
+    test_flow_control();
+    test_reset();
+    test_connection_errors();
+    kyros_http_server_close(server);
+    kyros_loop_run_once(loop);
+    kyros_loop_unref(loop);
+}
@@ -0,0 +1,181 @@
+// HTTP/1 request heads and chunked bodies, every input is copied to its own padded allocation so overreads show up
+#include "test.h"
+#include <kyros.h>
+#include <kyros_internal.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_HEADERS 8
+
+static kyros_http_request request;
+static kyros_http_header headers[MAX_HEADERS];
+static kyros_http_framing framing;
+// the request points into it, kept until the next parse
+static char* input;
+
+/// @brief parse the first length bytes of text like a partial read would hand them
+static int64_t parse_prefix(const char* text, uint64_t length)
+{
+    free(input);
+    input = (char*)malloc(length + KYROS_RECV_BUFFER_PADDING);
+    memcpy(input, text, length);
+    memset(input + length, 0, KYROS_RECV_BUFFER_PADDING);
+    // a reused request must not keep anything of a previous HTTP/2 stream
+    request = (kyros_http_request) { .http2 = true, .http3 = true };
+    return kyros_http_parse_request(input, length, &request, headers, MAX_HEADERS, &framing);
+}
+
+static int64_t parse(const char* text)
+{
+    return parse_prefix(text, strlen(text));
+}
+
+/// @brief scan the first length bytes of text, state goes on from an earlier call with fewer bytes
+static int64_t chunked_scan_prefix(const char* text, uint64_t length, uint64_t max_body, kyros_http_chunked_state* state)
+{
+    auto data = (char*)malloc(length + KYROS_RECV_BUFFER_PADDING);
+    memcpy(data, text, length);
+    memset(data + length, 0, KYROS_RECV_BUFFER_PADDING);
+    auto result = kyros_http_chunked_scan(data, length, max_body, state);
+    free(data);
+    return result;
+}
+
+static int64_t chunked_scan(const char* text, uint64_t max_body, uint64_t* body_length)
+{
+    kyros_http_chunked_state state = { 0 };
+    auto result = chunked_scan_prefix(text, strlen(text), max_body, &state);
+    *body_length = state.body_length;
+    return result;
+}
+
+static void test_request_head()
+{
+    // the value is longer than one scanner block
+    const char* text = "POST /upload?a=1 HTTP/1.1\r\nHost: example.com\r\nUser-Agent: \t a-user-agent-longer-than-thirty-two-bytes/1.0 \t\r\n"
+                       "Content-Length: 5\r\n\r\nhello";
+    auto head_length = (int64_t)(strlen(text) - 5);
+    test_assert(parse(text) == head_length);
+    test_assert(request.method_length == 4 && !memcmp(request.method, "POST", 4));
+    test_assert(request.target_length == 11 && !memcmp(request.target, "/upload?a=1", 11));
+    test_assert(request.minor_version == 1);
+    test_assert(request.keep_alive);
+    test_assert(!request.http2 && !request.http3);
+    test_assert(request.header_count == 3);
+    // optional whitespace around the value is not part of it
+    test_assert(headers[1].value_length == 45 && !memcmp(headers[1].value, "a-user-agent-longer-than-thirty-two-bytes/1.0", 45));
+    test_assert(framing.content_length == 5 && !framing.chunked);
+    // every shorter read is incomplete, never an error
+    uint32_t early_results = 0;
+    for (int64_t i = 0; i < head_length; i++) {
+        early_results += parse_prefix(text, (uint64_t)i) != KYROS_HTTP_PARSE_INCOMPLETE;
+    }
+    test_assert(early_results == 0);
+}
+
+static void test_keep_alive()
+{
+    test_assert(parse("GET / HTTP/1.0\r\n\r\n") > 0);
+    test_assert(request.minor_version == 0 && !request.keep_alive);
+    test_assert(parse("GET / HTTP/1.0\r\nConnection: Keep-Alive\r\n\r\n") > 0);
+    test_assert(request.keep_alive);
+    test_assert(parse("GET / HTTP/1.1\r\nConnection: upgrade, close\r\n\r\n") > 0);
+    test_assert(!request.keep_alive);
+}
+
+static void test_malformed_heads()
+{
+    const char* malformed[] = {
+        "GET / HTTP/2.0\r\n\r\n",
+        "GET  / HTTP/1.1\r\n\r\n",
+        "GET / HTTP/1.1\n\r\n",
+        "GET / HTTP/1.1\r\nHost : a\r\n\r\n",
+        // obsolete line folding
+        "GET / HTTP/1.1\r\nX-A: a\r\n b\r\n\r\n",
+        "GET / HTTP/1.1\r\nX-A: a\nX-B: b\r\n\r\n",
+        "GET / HTTP/1.1\r\nX-A: a\x01b\r\n\r\n",
+        "GET / HTTP/1.1\r\nContent-Length: 1x\r\n\r\n",
+        "GET / HTTP/1.1\r\nContent-Length: -1\r\n\r\n",
+    };
+    for (uint32_t i = 0; i < sizeof(malformed) / sizeof(malformed[0]); i++) {
+        test_assert(parse(malformed[i]) == KYROS_HTTP_PARSE_ERROR);
+    }
+    // a version that can't be valid is rejected before the line is complete
+    test_assert(parse("GET / HTTX") == KYROS_HTTP_PARSE_ERROR);
+}
+
+static void test_request_smuggling()
+{
+    // a body framed both ways, in either order, could be read differently by a proxy in front
+    test_assert(parse("POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\nContent-Length: 4\r\n\r\n") == KYROS_HTTP_PARSE_ERROR);
+    test_assert(parse("POST / HTTP/1.1\r\nContent-Length: 4\r\nTransfer-Encoding: chunked\r\n\r\n") == KYROS_HTTP_PARSE_ERROR);
+    // chunked has to be the only coding
+    test_assert(parse("POST / HTTP/1.1\r\nTransfer-Encoding: gzip, chunked\r\n\r\n") == KYROS_HTTP_PARSE_ERROR);
+    test_assert(parse("POST / HTTP/1.1\r\nTransfer-Encoding: CHUNKED\r\n\r\n") > 0);
+    test_assert(framing.chunked && framing.content_length == -1);
+    // repeated lengths must agree
+    test_assert(parse("POST / HTTP/1.1\r\nContent-Length: 4\r\nContent-Length: 5\r\n\r\n") == KYROS_HTTP_PARSE_ERROR);
+    test_assert(parse("POST / HTTP/1.1\r\nContent-Length: 4\r\ncontent-length: 4\r\n\r\n") > 0);
+    test_assert(framing.content_length == 4);
+}
+
+static void test_header_limit()
+{
+    test_assert(parse("GET / HTTP/1.1\r\nA: 1\r\nB: 2\r\nC: 3\r\nD: 4\r\nE: 5\r\nF: 6\r\nG: 7\r\nH: 8\r\n\r\n") > 0);
+    test_assert(request.header_count == MAX_HEADERS);
+    test_assert(parse("GET / HTTP/1.1\r\nA: 1\r\nB: 2\r\nC: 3\r\nD: 4\r\nE: 5\r\nF: 6\r\nG: 7\r\nH: 8\r\nI: 9\r\n\r\n") == KYROS_HTTP_PARSE_TOO_LARGE);
+}
+
+static void test_chunked_body()
+{
+    const char* body = "4\r\nWiki\r\n5;name=value\r\npedia\r\nE\r\n in\r\n\r\nchunks.\r\n0\r\nTrailer: x\r\n\r\n";
+    uint64_t body_length = 0;
+    test_assert(chunked_scan(body, 1024, &body_length) == (int64_t)strlen(body));
+    test_assert(body_length == 23);
+    char decoded[23];
+    kyros_http_chunked_decode(body, strlen(body), decoded);
+    test_assert(!memcmp(decoded, "Wikipedia in\r\n\r\nchunks.", 23));
+    // limits and malformed bodies
+    test_assert(chunked_scan(body, 22, &body_length) == KYROS_HTTP_PARSE_TOO_LARGE);
+    test_assert(chunked_scan("4\r\nWiki\r\n0\r\n\r", 1024, &body_length) == KYROS_HTTP_PARSE_INCOMPLETE);
+    test_assert(chunked_scan("4\r\nWikiX\r\n0\r\n\r\n", 1024, &body_length) == KYROS_HTTP_PARSE_ERROR);
+    test_assert(chunked_scan("x\r\n", 1024, &body_length) == KYROS_HTTP_PARSE_ERROR);
+    // more digits than a size can have
+    test_assert(chunked_scan("1000000000000000\r\n", UINT64_MAX, &body_length) == KYROS_HTTP_PARSE_ERROR);
+}
+
+static void test_chunked_body_in_pieces()
+{
+    // a byte more per read, like a slow client, the scan never goes back over a whole chunk
+    const char* body = "4\r\nWiki\r\n5;name=value\r\npedia\r\nE\r\n in\r\n\r\nchunks.\r\n0\r\nTrailer: x\r\nOther: y\r\n\r\n";
+    auto length = strlen(body);
+    kyros_http_chunked_state state = { 0 };
+    uint64_t offset = 0;
+    for (uint64_t i = 0; i < length; i++) {
+        test_assert(chunked_scan_prefix(body, i, 1024, &state) == KYROS_HTTP_PARSE_INCOMPLETE);
+        test_assert(state.offset >= offset && state.offset <= i);
+        offset = state.offset;
+    }
+    // the first chunk and the trailers before the last line were taken on the way
+    test_assert(offset == length - 2);
+    test_assert(chunked_scan_prefix(body, length, 1024, &state) == (int64_t)length);
+    test_assert(state.body_length == 23 && state.last_chunk);
+    // the limit counts the chunks of earlier calls
+    state = (kyros_http_chunked_state) { 0 };
+    test_assert(chunked_scan_prefix(body, 20, 10, &state) == KYROS_HTTP_PARSE_INCOMPLETE);
+    test_assert(state.body_length == 4);
+    test_assert(chunked_scan_prefix(body, length, 10, &state) == KYROS_HTTP_PARSE_TOO_LARGE);
+}
+
+void test_http_parser()
+{
+    test_request_head();
+    test_keep_alive();
+    test_malformed_heads();
+    test_request_smuggling();
+    test_header_limit();
+    test_chunked_body();
+    test_chunked_body_in_pieces();
+    free(input);
+    input = NULL;
+}
@@ -0,0 +1,198 @@
+// route precedence through kyros_http_router_match, the 404 and 405 answers through a loopback server
+#include "test.h"
+#include <kyros.h>
+#include <kyros_internal.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ROUTER_PORT 39611
+
+static kyros_http_router* router;
+static kyros_http_header params[KYROS_HTTP_ROUTER_MAX_PARAMS];
+static uint32_t param_count;
+
+// the ctx of every route is its name
+static void route_handler(kyros_http_request* request, kyros_http_response* response, const kyros_http_header* params, uint32_t param_count, void* ctx)
+{
+    kyros_http_response_end(response, ctx, strlen(ctx));
+}
+
+static void router_setup()
+{
+    router = kyros_http_router_create();
+    const char* routes[][2] = {
+        { "GET", "/users/me" },
+        { "GET", "/users/:id" },
+        { "PUT", "/users/:id" },
+        { "GET", "/users/:id/posts/:post" },
+        { "GET", "/users/me/settings" },
+        { "GET", "/files/readme" },
+        { "GET", "/files/*path" },
+        { "GET", "/static/:name" },
+        { "GET", "/static/*rest" },
+        { "POST", "/upload" },
+        { NULL, "/any/:x" },
+        { "DELETE", "/any/:x" },
+    };
+    for (uint32_t i = 0; i < sizeof(routes) / sizeof(routes[0]); i++) {
+        char name[64];
+        snprintf(name, sizeof(name), "%s %s", routes[i][0] ? routes[i][0] : "*", routes[i][1]);
+        test_assert(kyros_http_router_add(router, routes[i][0], routes[i][1], route_handler, strdup(name)));
+    }
+}
+
+/// @brief name of the route of method and path, NULL if there is none
+static const char* match(const char* method, const char* path)
+{
+    void* ctx = NULL;
+    auto handler = kyros_http_router_match(router, method, (uint32_t)strlen(method), path, (uint32_t)strlen(path), params, &param_count, &ctx);
+    return handler ? ctx : NULL;
+}
+
+static bool param_is(uint32_t index, const char* name, const char* value)
+{
+    return index < param_count && params[index].name_length == strlen(name) && !memcmp(params[index].name, name, strlen(name))
+        && params[index].value_length == strlen(value) && !memcmp(params[index].value, value, strlen(value));
+}
+
+static bool route_is(const char* name, const char* expected)
+{
+    return name && !strcmp(name, expected);
+}
+
+static void test_add_rejects()
+{
+    test_assert(!kyros_http_router_add(router, "GET", "/users/:id", route_handler, NULL));
+    test_assert(!kyros_http_router_add(router, "GET", "users", route_handler, NULL));
+    test_assert(!kyros_http_router_add(router, "GET", "/a/:/b", route_handler, NULL));
+    test_assert(!kyros_http_router_add(router, "GET", "/a/*rest/b", route_handler, NULL));
+    test_assert(!kyros_http_router_add(router, "BREW", "/coffee", route_handler, NULL));
+}
+
+static void test_precedence()
+{
+    // static beats param
+    test_assert(route_is(match("GET", "/users/me"), "GET /users/me"));
+    test_assert(route_is(match("GET", "/users/42"), "GET /users/:id") && param_count == 1 && param_is(0, "id", "42"));
+    test_assert(match("GET", "/users/") == NULL);
+    // a static prefix that leads nowhere falls back to the param
+    test_assert(route_is(match("GET", "/users/me/settings"), "GET /users/me/settings"));
+    test_assert(route_is(match("GET", "/users/me/posts/7"), "GET /users/:id/posts/:post"));
+    test_assert(param_count == 2 && param_is(0, "id", "me") && param_is(1, "post", "7"));
+    // static beats wildcard, the wildcard takes the rest (maybe empty)
+    test_assert(route_is(match("GET", "/files/readme"), "GET /files/readme"));
+    test_assert(route_is(match("GET", "/files/readme/old"), "GET /files/*path") && param_is(0, "path", "readme/old"));
+    test_assert(route_is(match("GET", "/files/"), "GET /files/*path") && param_is(0, "path", ""));
+    // param beats wildcard for one segment only
+    test_assert(route_is(match("GET", "/static/app.js"), "GET /static/:name") && param_is(0, "name", "app.js"));
+    test_assert(route_is(match("GET", "/static/js/app.js"), "GET /static/*rest") && param_is(0, "rest", "js/app.js"));
+    test_assert(match("GET", "/nothing") == NULL);
+}
+
+static void test_methods()
+{
+    // HEAD uses GET, a method route wins over the any one, unknown methods only get the any one
+    test_assert(route_is(match("HEAD", "/users/1"), "GET /users/:id"));
+    test_assert(route_is(match("PUT", "/users/1"), "PUT /users/:id"));
+    test_assert(route_is(match("DELETE", "/any/1"), "DELETE /any/:x"));
+    test_assert(route_is(match("GET", "/any/1"), "* /any/:x"));
+    test_assert(route_is(match("BREW", "/any/1"), "* /any/:x"));
+    test_assert(match("POST", "/users/1") == NULL);
+}
+
+///
+/// 404 and 405 over HTTP/1
+///
+
+static kyros_loop* loop;
+static char received[4096];
+static uint64_t received_length;
+
+static bool client_data(kyros_socket socket, const char* data, uint64_t length, void* ctx)
+{
+    if (received_length + length < sizeof(received)) {
+        memcpy(received + received_length, data, length);
+        received_length += length;
+    }
+    return true;
+}
+
+static void client_status(kyros_socket socket, kyros_socket_error error, void* ctx)
+{
+    auto state = kyros_socket_get_state(socket);
+    if (state == KYROS_SOCKET_STATE_OPEN) {
+        // pipelined, answered in order, the server closes after the last one
+        const char* requests = "GET /missing HTTP/1.1\r\nHost: a\r\n\r\n"
+                               "DELETE /users/1 HTTP/1.1\r\nHost: a\r\n\r\n"
+                               "GET /upload HTTP/1.1\r\nHost: a\r\n\r\n"
+                               "GET /users/7?tab=posts HTTP/1.1\r\nHost: a\r\nConnection: close\r\n\r\n";
+        kyros_socket_write(socket, requests, strlen(requests), false);
+    } else if (state == KYROS_SOCKET_STATE_CLOSED) {
+        kyros_loop_stop(loop);
+    }
+}
+
+/// @brief start of the nth response (from 0), NULL if there are fewer
+static const char* nth_response(uint32_t n)
+{
+    received[received_length] = 0;
+    auto p = strstr(received, "HTTP/1.1 ");
+    while (p && n--) {
+        p = strstr(p + 1, "HTTP/1.1 ");
+    }
+    return p;
+}
+
+/// @brief text is in the response starting at response, before the next one
+static bool response_has(const char* response, const char* text)
+{
+    auto next = strstr(response + 1, "HTTP/1.1 ");
+    auto found = strstr(response, text);
+    return found && (!next || found < next);
+}
+
+static void test_not_found_and_not_allowed()
+{
+    loop = kyros_loop_create(NULL);
+    kyros_socket_source source = { .type = KYROS_SOCKET_SOURCE_HOSTPORT, .value.host_port = { .host = "127.0.0.1", .port = ROUTER_PORT } };
+    auto server = kyros_http_server_listen(loop, source, (kryos_socket_options) { 0 },
+        (kyros_http_server_options) { .onrequest = kyros_http_router_onrequest, .ctx = router });
+    test_assert(server);
+    if (!server) {
+        kyros_loop_unref(loop);
+        return;
+    }
+    kyros_socket_handler client = { .ondata = client_data, .onstatus = client_status, .ref_count = 1 };
+    received_length = 0;
+    kyros_socket_connect(loop, source, (kryos_socket_options) { 0 }, &client);
+    kyros_loop_run_forever(loop);
+    kyros_http_server_close(server);
+    kyros_loop_run_once(loop);
+    kyros_loop_unref(loop);
+
+    auto missing = nth_response(0);
+    auto wrong_method = nth_response(1);
+    auto post_only = nth_response(2);
+    auto found = nth_response(3);
+    test_assert(missing && !strncmp(missing, "HTTP/1.1 404", 12) && !response_has(missing, "Allow:"));
+    // every method the path has, HEAD with GET
+    test_assert(wrong_method && !strncmp(wrong_method, "HTTP/1.1 405", 12) && response_has(wrong_method, "Allow: GET, HEAD, PUT\r\n"));
+    test_assert(post_only && !strncmp(post_only, "HTTP/1.1 405", 12) && response_has(post_only, "Allow: POST\r\n"));
+    // the query is not part of the path
+    test_assert(found && !strncmp(found, "HTTP/1.1 200", 12) && response_has(found, "GET /users/:id"));
+}
+
+void test_http_router()
+{
+    router_setup();
+    test_add_rejects();
+    kyros_http_router_compile(router);
+    test_assert(!kyros_http_router_add(router, "GET", "/late", route_handler, NULL));
+    test_precedence();
+    test_methods();
+    test_not_found_and_not_allowed();
+    for (uint32_t i = 0; i < router->route_count; i++) {
+        free(router->routes[i].ctx);
+    }
+    kyros_http_router_destroy(router);
+}
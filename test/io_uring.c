@@ -0,0 +1,130 @@
+// KYROS_LOOP_IO_URING: echo over multishot accept and recv with batched sends, tls on top, timers and defer on the same loop
+#include "test.h"
+#include <kyros.h>
+#include <kyros_internal.h>
+#include <string.h>
+
+#define ECHO_PORT 39681
+#define TLS_PORT 39682
+#define CLIENTS 8
+#define ECHO_SIZE (512 * 1024 + 3)
+
+static kyros_loop* loop;
+static char echo_data[ECHO_SIZE];
+static uint64_t received[CLIENTS];
+static uint64_t errors;
+static uint32_t clients_done;
+static const char* read_at;
+
+static bool server_data(kyros_socket socket, const char* data, uint64_t length, void* ctx)
+{
+    kyros_socket_write(socket, data, length, false);
+    return true;
+}
+
+static bool client_data(kyros_socket socket, const char* data, uint64_t length, void* ctx)
+{
+    auto total = (uint64_t*)ctx;
+    read_at = data;
+    errors += *total + length > ECHO_SIZE || memcmp(data, echo_data + *total, length);
+    *total += length;
+    if (*total == ECHO_SIZE) {
+        kyros_socket_close(socket);
+    }
+    return true;
+}
+
+static void client_status(kyros_socket socket, kyros_socket_error error, void* ctx)
+{
+    auto state = kyros_socket_get_state(socket);
+    if (state == KYROS_SOCKET_STATE_OPEN || state == KYROS_SOCKET_STATE_SECURE) {
+        kyros_socket_write(socket, echo_data, ECHO_SIZE, false);
+    } else if (state == KYROS_SOCKET_STATE_CLOSED && ++clients_done == CLIENTS) {
+        kyros_loop_stop(loop);
+    }
+}
+
+static void run_echo(uint16_t port, SSL_CTX* server_tls, SSL_CTX* client_tls)
+{
+    errors = 0;
+    clients_done = 0;
+    kyros_socket_source source = { .type = KYROS_SOCKET_SOURCE_HOSTPORT, .value.host_port = { .host = "127.0.0.1", .port = port } };
+    kyros_socket_handler server = { .ondata = server_data, .ref_count = 1 };
+    auto listener = kyros_socket_listen(loop, source, (kryos_socket_options) { .tls = server_tls }, &server);
+    kyros_socket_handler clients[CLIENTS];
+    for (uint32_t i = 0; i < CLIENTS; i++) {
+        received[i] = 0;
+        clients[i] = (kyros_socket_handler) { .ondata = client_data, .onstatus = client_status, .ctx = &received[i], .ref_count = 1 };
+        kyros_socket_connect(loop, source, (kryos_socket_options) { .tls = client_tls }, &clients[i]);
+    }
+    kyros_loop_run_forever(loop);
+    kyros_socket_close(listener);
+    for (uint32_t i = 0; i < 5; i++) {
+        kyros_loop_run_once(loop);
+    }
+    for (uint32_t i = 0; i < CLIENTS; i++) {
+        test_assert(received[i] == ECHO_SIZE);
+    }
+    test_assert(errors == 0);
+}
+
+static void test_echo()
+{
+    auto before = kyros_loop_get_stats(loop);
+    run_echo(ECHO_PORT, NULL, NULL);
+    auto stats = kyros_loop_get_stats(loop);
+    test_assert(stats.uring_submits > before.uring_submits);
+    test_assert(stats.uring_completions > before.uring_completions);
+    // the data came in a buffer the kernel picked from the ring, not in the poll engine buffer
+    test_assert(read_at && read_at != kyros_get_internal_loop(loop)->recv_buffer);
+}
+
+static void test_tls_echo()
+{
+    run_echo(TLS_PORT, test_tls_server_context(), test_tls_client_context());
+}
+
+static uint32_t timer_calls;
+static uint32_t deferred;
+
+static void timer_task(void* ctx)
+{
+    timer_calls++;
+    kyros_loop_stop(loop);
+}
+
+static void deferred_task(void* ctx)
+{
+    deferred++;
+}
+
+static void test_timers_and_defer()
+{
+    // the ring sits in the uv loop, the rest of the loop keeps working
+    timer_calls = 0;
+    deferred = 0;
+    auto timer = kyros_loop_timer(loop, timer_task, NULL, 20, 0, true);
+    kyros_loop_defer(loop, deferred_task, NULL);
+    kyros_loop_run_forever(loop);
+    test_assert(timer_calls == 1);
+    test_assert(deferred == 1);
+    kyros_timer_unref(timer);
+}
+
+void test_io_uring()
+{
+    for (uint32_t i = 0; i < ECHO_SIZE; i++) {
+        echo_data[i] = (char)(i * 13 + i / 1021);
+    }
+    loop = kyros_loop_create_with_options(NULL, (kyros_loop_options) { .io_engine = KYROS_LOOP_IO_URING });
+    if (kyros_loop_get_io_engine(loop) != KYROS_LOOP_IO_URING) {
+        // old kernel or io_uring disabled, the loop polls
+        test_assert(kyros_loop_get_io_engine(loop) == KYROS_LOOP_IO_POLL);
+        kyros_loop_unref(loop);
+        return;
+    }
+    test_echo();
+    test_tls_echo();
+    test_timers_and_defer();
+    kyros_loop_unref(loop);
+}
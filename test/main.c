@@ -1,7 +1,10 @@
+#include "test.h"
 #include "uv.h"
 #include <kyros.h>
 #include <stdio.h>
 
+uint32_t test_failures = 0;
+
 void task(void* ctx) {
     auto value = ((uint64_t)ctx);
     // printf("Task: %llu\n", value);
@@ -18,6 +21,32 @@ int main() {
     kyros_loop_run_forever(loop); 
     kyros_loop_unref(loop);
     uv_update_time(uv_default_loop());
-    printf("time %llu", uv_now(uv_default_loop()) - start);
+    printf("time %llu\n", uv_now(uv_default_loop()) - start);
 
-}
\ No newline at end of file
+    test_async_queue();
+    test_timer_wheel();
+    test_task_slab();
+    test_defer_lanes();
+    test_tcp_socket();
+    test_socket_cork();
+    test_socket_write_queue();
+    test_tls_socket();
+    test_tls_session_cache();
+    test_socket_write4();
+    test_socket_pipe();
+    test_io_uring();
+    test_server_group();
+    test_socket_migrate();
+    test_http_parser();
+    test_http2();
+    test_websocket_utf8();
+    test_websocket_deflate();
+    test_pubsub();
+    test_udp();
+    test_http_router();
+    test_quic();
+    test_dns();
+    test_socket_pool();
+    printf("%u failures\n", test_failures);
+    return test_failures ? 1 : 0;
+}
@@ -0,0 +1,236 @@
+// kyros_pubsub: topic levels with + and # subscriptions, one delivery per websocket, unsubscribe and close, compressed subscribers
+#include "test.h"
+#include <kyros.h>
+#include <kyros_internal.h>
+#include <string.h>
+
+#define PUBSUB_PORT 39698
+#define CLIENTS 5
+#define BIG_MESSAGE 1000
+
+static kyros_loop* loop;
+static kyros_pubsub* pubsub;
+static kyros_websocket* clients[CLIENTS];
+static uint32_t opened;
+static uint32_t received[CLIENTS];
+static uint32_t mismatches;
+static char last_reply[CLIENTS][64];
+static uint32_t replies[CLIENTS];
+static char expected[BIG_MESSAGE + 1];
+static uint32_t closed;
+
+static bool command(const char* data, uint64_t length, const char* name)
+{
+    auto name_length = strlen(name);
+    return length > name_length && !memcmp(data, name, name_length);
+}
+
+static void server_message(kyros_websocket* websocket, const char* data, uint64_t length, kyros_websocket_opcode opcode, void* ctx)
+{
+    // sub:topic and unsub:topic, answered with ok or no
+    bool done = false;
+    if (command(data, length, "sub:")) {
+        done = kyros_pubsub_subscribe(pubsub, websocket, data + 4, (uint32_t)length - 4);
+    } else if (command(data, length, "unsub:")) {
+        done = kyros_pubsub_unsubscribe(pubsub, websocket, data + 6, (uint32_t)length - 6);
+    }
+    kyros_websocket_send(websocket, done ? "ok" : "no", 2, KYROS_WEBSOCKET_TEXT);
+}
+
+static void onrequest(kyros_http_request* request, kyros_http_response* response, void* ctx)
+{
+    uint32_t key_length;
+    auto key = kyros_websocket_get_key(request, &key_length);
+    uint32_t extensions_length = 0;
+    auto extensions = kyros_http_request_get_header(request, "sec-websocket-extensions", 24, &extensions_length);
+    kyros_websocket_upgrade(response, key, key_length, extensions, extensions_length,
+        (kyros_websocket_options) { .onmessage = server_message, .compression = KYROS_WEBSOCKET_COMPRESSION_SHARED });
+}
+
+static void client_open(kyros_websocket* websocket, void* ctx)
+{
+    opened++;
+}
+
+static void client_message(kyros_websocket* websocket, const char* data, uint64_t length, kyros_websocket_opcode opcode, void* ctx)
+{
+    auto index = (uint32_t)(uintptr_t)ctx;
+    if (length == 2 && (!memcmp(data, "ok", 2) || !memcmp(data, "no", 2))) {
+        memcpy(last_reply[index], data, 2);
+        last_reply[index][2] = 0;
+        replies[index]++;
+        return;
+    }
+    received[index]++;
+    mismatches += length != strlen(expected) || memcmp(data, expected, length);
+}
+
+static void client_close(kyros_websocket* websocket, uint16_t code, const char* reason, uint32_t reason_length, void* ctx)
+{
+    closed++;
+}
+
+/// @brief sends a command from client and waits for the answer of its server websocket
+static bool ask(uint32_t client, const char* text)
+{
+    auto before = replies[client];
+    kyros_websocket_send(clients[client], text, strlen(text), KYROS_WEBSOCKET_TEXT);
+    while (replies[client] == before) {
+        kyros_loop_run_once(loop);
+    }
+    return !strcmp(last_reply[client], "ok");
+}
+
+/// @brief publish and wait until every subscriber the loop wrote to got the message, returns the subscriber count
+static uint32_t publish(const char* topic, const char* data)
+{
+    strcpy(expected, data);
+    uint32_t before = 0;
+    for (uint32_t i = 0; i < CLIENTS; i++) {
+        before += received[i];
+    }
+    auto count = kyros_pubsub_publish(pubsub, loop, topic, (uint32_t)strlen(topic), data, strlen(data), KYROS_WEBSOCKET_TEXT);
+    for (uint32_t i = 0; i < 2000; i++) {
+        uint32_t after = 0;
+        for (uint32_t j = 0; j < CLIENTS; j++) {
+            after += received[j];
+        }
+        // with no subscriber a stray delivery still has some time to show up
+        if (after - before == count && (count || i >= 20)) {
+            break;
+        }
+        kyros_loop_run_once(loop);
+        uv_sleep(1);
+    }
+    return count;
+}
+
+/// @brief bit i set if client i got the last message (received is compared to a snapshot)
+static uint32_t got_since(const uint32_t* snapshot)
+{
+    uint32_t mask = 0;
+    for (uint32_t i = 0; i < CLIENTS; i++) {
+        mask |= (uint32_t)(received[i] != snapshot[i]) << i;
+    }
+    return mask;
+}
+
+static uint32_t publish_mask(const char* topic, uint32_t expected_count)
+{
+    uint32_t snapshot[CLIENTS];
+    memcpy(snapshot, received, sizeof(snapshot));
+    test_assert(publish(topic, "message") == expected_count);
+    return got_since(snapshot);
+}
+
+static void test_wildcards()
+{
+    test_assert(ask(0, "sub:a/b/c"));
+    test_assert(ask(1, "sub:a/+/c"));
+    test_assert(ask(2, "sub:a/#"));
+    test_assert(ask(3, "sub:#"));
+    // two subscriptions matching a/b, the message comes once
+    test_assert(ask(4, "sub:a/+"));
+    test_assert(ask(4, "sub:a/b"));
+
+    test_assert(publish_mask("a/b/c", 4) == 0b01111);
+    test_assert(publish_mask("a/x/c", 3) == 0b01110);
+    // "a/#" takes "a" itself
+    test_assert(publish_mask("a", 2) == 0b01100);
+    test_assert(publish_mask("a/b", 3) == 0b11100);
+    test_assert(publish_mask("b", 1) == 0b01000);
+    test_assert(publish_mask("a/b/c/d", 2) == 0b01100);
+    // empty levels are levels too
+    test_assert(publish_mask("a//c", 3) == 0b01110);
+    test_assert(mismatches == 0);
+}
+
+static void test_invalid()
+{
+    // # is only valid as the whole last level, + as a whole level
+    test_assert(!ask(0, "sub:a/#/b"));
+    test_assert(!ask(0, "sub:a+/b"));
+    test_assert(!ask(0, "sub:a/b#"));
+    // already subscribed
+    test_assert(!ask(0, "sub:a/b/c"));
+    // not subscribed
+    test_assert(!ask(0, "unsub:x/y"));
+    // a publish goes to a topic, not a pattern
+    test_assert(publish("a/+", "message") == 0);
+    test_assert(publish("#", "message") == 0);
+}
+
+static void test_unsubscribe_and_close()
+{
+    test_assert(ask(3, "unsub:#"));
+    test_assert(!ask(3, "unsub:#"));
+    test_assert(publish_mask("b", 0) == 0);
+    test_assert(ask(4, "unsub:a/+"));
+    // still there with a/b
+    test_assert(publish_mask("a/b", 2) == 0b10100);
+    // a closed websocket loses its subscriptions
+    kyros_websocket_close(clients[2], 1000, NULL, 0);
+    while (closed < 1) {
+        kyros_loop_run_once(loop);
+    }
+    for (uint32_t i = 0; i < 5; i++) {
+        kyros_loop_run_once(loop);
+    }
+    test_assert(publish_mask("a", 0) == 0);
+    test_assert(publish_mask("a/b/c", 2) == 0b00011);
+}
+
+static void test_compressed()
+{
+    // big enough to be compressed once for the websockets that negotiated it, the others get it as it is
+    char big[BIG_MESSAGE + 1];
+    for (uint32_t i = 0; i < BIG_MESSAGE; i++) {
+        big[i] = (char)('a' + i % 7);
+    }
+    big[BIG_MESSAGE] = 0;
+    uint32_t snapshot[CLIENTS];
+    memcpy(snapshot, received, sizeof(snapshot));
+    test_assert(publish("a/b/c", big) == 2);
+    test_assert(got_since(snapshot) == 0b00011);
+    test_assert(mismatches == 0);
+}
+
+void test_pubsub()
+{
+    opened = 0;
+    closed = 0;
+    mismatches = 0;
+    memset(received, 0, sizeof(received));
+    loop = kyros_loop_create(NULL);
+    pubsub = kyros_pubsub_create();
+    auto server = kyros_http_server_listen(loop,
+        (kyros_socket_source) { .type = KYROS_SOCKET_SOURCE_HOSTPORT, .value.host_port = { .host = "127.0.0.1", .port = PUBSUB_PORT } },
+        (kryos_socket_options) { 0 }, (kyros_http_server_options) { .onrequest = onrequest });
+    for (uint32_t i = 0; i < CLIENTS; i++) {
+        // the first one takes permessage-deflate
+        clients[i] = kyros_websocket_connect(loop,
+            (kyros_socket_source) { .type = KYROS_SOCKET_SOURCE_HOSTPORT, .value.host_port = { .host = "127.0.0.1", .port = PUBSUB_PORT } },
+            (kryos_socket_options) { 0 }, NULL, "/",
+            (kyros_websocket_options) { .onmessage = client_message, .onopen = client_open, .onclose = client_close, .ctx = (void*)(uintptr_t)i,
+                .compression = i == 0 ? KYROS_WEBSOCKET_COMPRESSION_SHARED : KYROS_WEBSOCKET_COMPRESSION_NONE });
+    }
+    while (opened < CLIENTS) {
+        kyros_loop_run_once(loop);
+    }
+    test_wildcards();
+    test_invalid();
+    test_unsubscribe_and_close();
+    test_compressed();
+    for (uint32_t i = 0; i < CLIENTS; i++) {
+        if (i != 2) {
+            kyros_websocket_close(clients[i], 1000, NULL, 0);
+        }
+    }
+    while (closed < CLIENTS) {
+        kyros_loop_run_once(loop);
+    }
+    kyros_http_server_close(server);
+    kyros_loop_run_once(loop);
+    kyros_pubsub_destroy(pubsub);
+    kyros_loop_unref(loop);
+}
@@ -0,0 +1,523 @@
+// QUIC: packet protection against RFC 9001 Appendix A, the ranges of acks and stream data, then over loopback a handshake
+// with one HTTP/3 request and a transfer through a proxy that drops datagrams
+#include "test.h"
+#include <kyros.h>
+#include <kyros_internal.h>
+#include <openssl/ec.h>
+#include <openssl/evp.h>
+#include <openssl/obj_mac.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define H3_TCP_PORT 39620
+#define H3_UDP_PORT 39621
+#define ECHO_PORT 39622
+#define PROXY_PORT 39623
+#define ECHO_SIZE (200 * 1024)
+// every DROP_PERIOD-th datagram of each direction is lost, the first ones of the handshake included
+#define DROP_PERIOD 7
+#define DROP_PHASE 3
+// the tests end long before, this only turns a hang into a failure
+#define DEADLINE 20'000
+
+static uint8_t* hex_decode(const char* hex, uint32_t* length)
+{
+    auto count = (uint32_t)strlen(hex) / 2;
+    auto out = (uint8_t*)malloc(count);
+    for (uint32_t i = 0; i < count; i++) {
+        unsigned int byte;
+        sscanf(hex + i * 2, "%2x", &byte);
+        out[i] = (uint8_t)byte;
+    }
+    *length = count;
+    return out;
+}
+
+static void test_decode_packet_number()
+{
+    // RFC 9000 A.3
+    test_assert(kyros_quic_decode_packet_number(0xa82f30ea, 0x9b32, 2) == 0xa82f9b32);
+    // the first packet, and a truncated number that wrapped past the expected one
+    test_assert(kyros_quic_decode_packet_number(UINT64_MAX, 0, 1) == 0);
+    test_assert(kyros_quic_decode_packet_number(0xff, 0x02, 1) == 0x102);
+}
+
+///
+/// Ranges
+///
+
+static bool ranges_are(const kyros_quic_ranges* ranges, const uint64_t (*expected)[2], uint32_t count)
+{
+    if (ranges->count != count) {
+        return false;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        if (ranges->items[i][0] != expected[i][0] || ranges->items[i][1] != expected[i][1]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void test_ranges_edges()
+{
+    kyros_quic_ranges ranges = { 0 };
+    // empty and inverted ranges are nothing
+    kyros_quic_ranges_add(&ranges, 5, 5);
+    kyros_quic_ranges_add(&ranges, 6, 2);
+    test_assert(ranges.count == 0);
+    kyros_quic_ranges_add(&ranges, 10, 20);
+    kyros_quic_ranges_add(&ranges, 30, 40);
+    // touching ranges merge, in front and out of order too
+    kyros_quic_ranges_add(&ranges, 20, 25);
+    kyros_quic_ranges_add(&ranges, 0, 2);
+    test_assert(ranges_are(&ranges, (const uint64_t[][2]) { { 0, 2 }, { 10, 25 }, { 30, 40 } }, 3));
+    // one add bridging several, and one inside an existing range
+    kyros_quic_ranges_add(&ranges, 1, 35);
+    kyros_quic_ranges_add(&ranges, 12, 13);
+    test_assert(ranges_are(&ranges, (const uint64_t[][2]) { { 0, 40 } }, 1));
+    test_assert(kyros_quic_ranges_contains(&ranges, 0) && kyros_quic_ranges_contains(&ranges, 39));
+    test_assert(!kyros_quic_ranges_contains(&ranges, 40));
+    // a remove in the middle splits, at the edges it trims
+    kyros_quic_ranges_remove(&ranges, 10, 20);
+    kyros_quic_ranges_remove(&ranges, 0, 1);
+    kyros_quic_ranges_remove(&ranges, 39, 100);
+    test_assert(ranges_are(&ranges, (const uint64_t[][2]) { { 1, 10 }, { 20, 39 } }, 2));
+    // empty, outside and in a gap remove nothing
+    kyros_quic_ranges_remove(&ranges, 15, 15);
+    kyros_quic_ranges_remove(&ranges, 10, 20);
+    kyros_quic_ranges_remove(&ranges, 50, 60);
+    test_assert(ranges_are(&ranges, (const uint64_t[][2]) { { 1, 10 }, { 20, 39 } }, 2));
+    // one remove across several ranges
+    kyros_quic_ranges_remove(&ranges, 0, UINT64_MAX);
+    test_assert(ranges.count == 0);
+    test_assert(!kyros_quic_ranges_contains(&ranges, 1));
+    kyros_quic_ranges_free(&ranges);
+}
+
+static uint64_t random_state = 0x2545f4914f6cdd1dull;
+
+static uint64_t random_next()
+{
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 7;
+    random_state ^= random_state << 17;
+    return random_state;
+}
+
+static void test_ranges_against_bitmap()
+{
+    // random adds and removes over a small space, compared with one bool per value after every step
+    kyros_quic_ranges ranges = { 0 };
+    bool bitmap[256] = { 0 };
+    uint32_t mismatches = 0;
+    for (uint32_t step = 0; step < 20'000; step++) {
+        auto start = random_next() % 256;
+        auto end = start + random_next() % 24;
+        end = end > 256 ? 256 : end;
+        auto add = random_next() % 3 != 0;
+        if (add) {
+            kyros_quic_ranges_add(&ranges, start, end);
+        } else {
+            kyros_quic_ranges_remove(&ranges, start, end);
+        }
+        for (auto i = start; i < end; i++) {
+            bitmap[i] = add;
+        }
+        // sorted, disjoint and not touching
+        for (uint32_t i = 0; i < ranges.count; i++) {
+            mismatches += ranges.items[i][0] >= ranges.items[i][1];
+            mismatches += i && ranges.items[i - 1][1] >= ranges.items[i][0];
+        }
+        for (uint32_t i = 0; i < 256; i++) {
+            mismatches += kyros_quic_ranges_contains(&ranges, i) != bitmap[i];
+        }
+    }
+    test_assert(mismatches == 0);
+    kyros_quic_ranges_free(&ranges);
+}
+
+#ifdef OPENSSL_IS_BORINGSSL
+
+///
+/// Packet protection
+///
+
+static void test_initial_protection()
+{
+    // RFC 9001 A.1 and A.3, the server Initial carrying the ServerHello, packet number 1 on 2 bytes
+    const uint8_t client_dcid[] = { 0x83, 0x94, 0xc8, 0xf0, 0x3e, 0x51, 0x57, 0x08 };
+    uint32_t header_length, payload_length, protected_length;
+    auto header = hex_decode("c1000000010008f067a5502a4262b50040750001", &header_length);
+    auto payload = hex_decode("02000000000600405a020000560303eefce7f7b37ba1d1632e96677825ddf73988cfc79825df566dc5430b9a045a1200130100002e00330024001d"
+                              "00209d3c940d89690b84d08a60993c144eca684d1081287c834d5311bcf32bb9da1a002b00020304",
+        &payload_length);
+    auto expected = hex_decode("cf000000010008f067a5502a4262b5004075c0d95a482cd0991cd25b0aac406a5816b6394100f37a1c69797554780bb38cc5a99f5ede4cf73c3ec"
+                               "2493a1839b3dbcba3f6ea46c5b7684df3548e7ddeb9c3bf9c73cc3f3bded74b562bfb19fb84022f8ef4cdd93795d77d06edbb7aaf2f58891850abbdc"
+                               "a3d20398c276456cbc42158407dd074ee",
+        &protected_length);
+    test_assert(header_length + payload_length + KYROS_QUIC_TAG_LENGTH == protected_length);
+    const uint32_t pn_offset = header_length - 2;
+
+    auto server_keys = kyros_quic_keys_initial(client_dcid, sizeof(client_dcid), true);
+    auto client_keys = kyros_quic_keys_initial(client_dcid, sizeof(client_dcid), false);
+    uint8_t packet[256];
+    memcpy(packet, header, header_length);
+    memcpy(packet + header_length, payload, payload_length);
+    kyros_quic_seal(server_keys, packet, pn_offset, header_length, payload_length, 1);
+    test_assert(!memcmp(packet, expected, protected_length));
+
+    // the receiving side undoes it
+    uint8_t received[256];
+    memcpy(received, expected, protected_length);
+    test_assert(kyros_quic_unprotect_header(server_keys, received, pn_offset, protected_length) == 2);
+    test_assert(!memcmp(received, header, header_length));
+    test_assert(kyros_quic_open(server_keys, received, header_length, protected_length, 1));
+    test_assert(!memcmp(received + header_length, payload, payload_length));
+
+    // the keys of the other direction, a flipped bit or the wrong packet number are not authentic
+    memcpy(received, expected, protected_length);
+    kyros_quic_unprotect_header(server_keys, received, pn_offset, protected_length);
+    uint8_t copy[256];
+    memcpy(copy, received, protected_length);
+    test_assert(!kyros_quic_open(client_keys, copy, header_length, protected_length, 1));
+    memcpy(copy, received, protected_length);
+    copy[header_length + 10] ^= 0x01;
+    test_assert(!kyros_quic_open(server_keys, copy, header_length, protected_length, 1));
+    memcpy(copy, received, protected_length);
+    test_assert(!kyros_quic_open(server_keys, copy, header_length, protected_length, 2));
+    // too short to be sampled
+    test_assert(kyros_quic_unprotect_header(server_keys, copy, pn_offset, pn_offset + 19) == 0);
+
+    kyros_quic_keys_free(server_keys);
+    kyros_quic_keys_free(client_keys);
+    free(header);
+    free(payload);
+    free(expected);
+}
+
+///
+/// Loopback
+///
+
+static kyros_loop* loop;
+static SSL_CTX* server_tls;
+static SSL_CTX* client_tls;
+static bool timed_out;
+
+static void create_tls()
+{
+    auto ec_key = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
+    EC_KEY_generate_key(ec_key);
+    auto key = EVP_PKEY_new();
+    EVP_PKEY_assign_EC_KEY(key, ec_key);
+    auto certificate = X509_new();
+    X509_set_version(certificate, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(certificate), 1);
+    X509_gmtime_adj(X509_getm_notBefore(certificate), 0);
+    X509_gmtime_adj(X509_getm_notAfter(certificate), 3600);
+    X509_set_pubkey(certificate, key);
+    auto name = X509_get_subject_name(certificate);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char*)"localhost", -1, -1, 0);
+    X509_set_issuer_name(certificate, name);
+    X509_sign(certificate, key, EVP_sha256());
+    server_tls = SSL_CTX_new(TLS_method());
+    SSL_CTX_use_certificate(server_tls, certificate);
+    SSL_CTX_use_PrivateKey(server_tls, key);
+    client_tls = SSL_CTX_new(TLS_method());
+    X509_free(certificate);
+    EVP_PKEY_free(key);
+}
+
+static kyros_socket_source loopback(uint16_t port, bool udp)
+{
+    return (kyros_socket_source) { .type = KYROS_SOCKET_SOURCE_HOSTPORT, .value.host_port = { .host = "127.0.0.1", .port = port, .use_udp = udp } };
+}
+
+// HTTP/3 over the listener of a http server
+static kyros_http_server* h3_server;
+static kyros_quic_connection* h3_client;
+static uint64_t h3_request;
+static uint8_t h3_response[4096];
+static uint64_t h3_response_length;
+static bool h3_response_ended;
+
+static void h3_onrequest(kyros_http_request* request, kyros_http_response* response, void* ctx)
+{
+    auto valid = request->http3 && request->method_length == 4 && !memcmp(request->method, "POST", 4) && request->target_length == 6
+        && !memcmp(request->target, "/hello", 6) && request->body_length == 4 && !memcmp(request->body, "ping", 4);
+    kyros_http_response_write_status(response, valid ? 201 : 400);
+    kyros_http_response_write_header(response, "X-Test", 6, "yes", 3);
+    kyros_http_response_end(response, "pong", 4);
+}
+
+static uint8_t* h3_frame_header(uint8_t* out, uint64_t type, uint64_t length)
+{
+    return kyros_quic_varint_write(kyros_quic_varint_write(out, type), length);
+}
+
+static void h3_client_open(kyros_quic_connection* connection, void* ctx)
+{
+    // control stream with empty SETTINGS
+    auto control = kyros_quic_open_stream(connection, false);
+    const uint8_t settings[] = { 0x00, 0x04, 0x00 };
+    kyros_quic_stream_write(connection, control, (const char*)settings, sizeof(settings), false);
+
+    uint8_t section[256];
+    // required insert count and base, no dynamic table
+    auto p = section;
+    *p++ = 0;
+    *p++ = 0;
+    p = kyros_qpack_encode_field(p, ":method", 7, "POST", 4);
+    p = kyros_qpack_encode_field(p, ":scheme", 7, "https", 5);
+    p = kyros_qpack_encode_field(p, ":authority", 10, "localhost", 9);
+    p = kyros_qpack_encode_field(p, ":path", 5, "/hello", 6);
+    p = kyros_qpack_encode_field(p, "content-length", 14, "4", 1);
+    uint8_t message[512];
+    auto m = h3_frame_header(message, 0x01, (uint64_t)(p - section));
+    memcpy(m, section, p - section);
+    m += p - section;
+    m = h3_frame_header(m, 0x00, 4);
+    memcpy(m, "ping", 4);
+    m += 4;
+    h3_request = kyros_quic_open_stream(connection, true);
+    kyros_quic_stream_write(connection, h3_request, (const char*)message, (uint64_t)(m - message), true);
+}
+
+static void h3_client_stream(kyros_quic_connection* connection, uint64_t stream_id, const char* data, uint64_t length, bool fin, void* ctx)
+{
+    // the control and qpack streams of the server are not looked at
+    if (stream_id != h3_request) {
+        return;
+    }
+    if (h3_response_length + length <= sizeof(h3_response)) {
+        memcpy(h3_response + h3_response_length, data, length);
+        h3_response_length += length;
+    }
+    if (fin) {
+        h3_response_ended = true;
+        // H3_NO_ERROR
+        kyros_quic_close(connection, 0x100, NULL, 0);
+    }
+}
+
+static void h3_client_close(kyros_quic_connection* connection, uint64_t error_code, bool application, const char* reason, uint32_t reason_length, void* ctx)
+{
+    h3_client = NULL;
+    kyros_http_server_close(h3_server);
+}
+
+static void h3_deadline(void* ctx)
+{
+    timed_out = true;
+    if (h3_client) {
+        kyros_quic_close(h3_client, 0x100, NULL, 0);
+    }
+}
+
+static void test_http3_request()
+{
+    loop = kyros_loop_create(NULL);
+    timed_out = false;
+    h3_response_length = 0;
+    h3_response_ended = false;
+    h3_server = kyros_http_server_listen(loop, loopback(H3_TCP_PORT, false), (kryos_socket_options) { 0 },
+        (kyros_http_server_options) { .onrequest = h3_onrequest });
+    test_assert(h3_server);
+    if (!h3_server || !kyros_http_server_listen_http3(h3_server, loopback(H3_UDP_PORT, true), server_tls, (kyros_quic_options) { 0 })) {
+        test_assert(!"could not listen for HTTP/3");
+        if (h3_server) {
+            kyros_http_server_close(h3_server);
+        }
+        kyros_loop_run_once(loop);
+        kyros_loop_unref(loop);
+        return;
+    }
+    h3_client = kyros_quic_connect(loop, loopback(H3_UDP_PORT, true), client_tls, "localhost", (kyros_quic_options) { .alpn = "h3" },
+        (kyros_quic_handler) { .onopen = h3_client_open, .onstream = h3_client_stream, .onclose = h3_client_close });
+    auto deadline = kyros_loop_timer(loop, h3_deadline, NULL, DEADLINE, 0, false);
+    kyros_loop_run_forever(loop);
+    kyros_timer_unref(deadline);
+    kyros_loop_unref(loop);
+
+    test_assert(!timed_out && h3_response_ended);
+    // HEADERS then DATA
+    kyros_http_server decoder = { .options.max_header_size = 16384 };
+    uint16_t status = 0;
+    bool has_header = false;
+    uint64_t body_length = 0;
+    char body[16];
+    auto p = (const uint8_t*)h3_response;
+    auto end = p + h3_response_length;
+    while (p < end) {
+        uint64_t type, length;
+        p += kyros_quic_varint_read(p, end, &type);
+        p += kyros_quic_varint_read(p, end, &length);
+        if (length > (uint64_t)(end - p)) {
+            test_assert(!"truncated frame");
+            break;
+        }
+        if (type == 0x01) {
+            uint32_t size;
+            auto count = kyros_qpack_decode(&decoder, p, length, &size);
+            test_assert(count > 0);
+            for (int32_t i = 0; i < count; i++) {
+                auto field = decoder.field_offsets[i];
+                auto name = decoder.decoded + field[0];
+                auto value = decoder.decoded + field[2];
+                if (field[1] == 7 && !memcmp(name, ":status", 7)) {
+                    status = (uint16_t)atoi(value);
+                }
+                has_header = has_header || (field[1] == 6 && !memcmp(name, "x-test", 6) && field[3] == 3 && !memcmp(value, "yes", 3));
+            }
+        } else if (type == 0x00 && body_length + length <= sizeof(body)) {
+            memcpy(body + body_length, p, length);
+            body_length += length;
+        }
+        p += length;
+    }
+    kyros_free(decoder.decoded);
+    test_assert(status == 201);
+    test_assert(has_header);
+    test_assert(body_length == 4 && !memcmp(body, "pong", 4));
+}
+
+// echo through a proxy losing datagrams both ways
+static kyros_quic_listener* echo_listener;
+static kyros_quic_connection* echo_client;
+static char* echo_payload;
+static char* echo_received;
+static uint64_t echo_received_length;
+static uint64_t echo_server_length;
+static bool echo_ended;
+static kyros_quic_stats echo_stats;
+static kyros_socket proxy_in;
+static kyros_socket proxy_out;
+static struct sockaddr_storage proxy_client;
+static uint64_t proxy_datagrams[2];
+static uint64_t proxy_dropped;
+
+static bool proxy_drops(uint32_t direction)
+{
+    auto drop = ++proxy_datagrams[direction] % DROP_PERIOD == DROP_PHASE;
+    proxy_dropped += drop;
+    return drop;
+}
+
+static void proxy_from_client(kyros_socket socket, const kyros_udp_datagram* datagrams, uint32_t count, void* ctx)
+{
+    for (uint32_t i = 0; i < count; i++) {
+        memcpy(&proxy_client, datagrams[i].peer, datagrams[i].peer_length);
+        if (!proxy_drops(0)) {
+            kyros_socket_write(proxy_out, datagrams[i].data, datagrams[i].length, false);
+        }
+    }
+}
+
+static void proxy_from_server(kyros_socket socket, const kyros_udp_datagram* datagrams, uint32_t count, void* ctx)
+{
+    for (uint32_t i = 0; i < count; i++) {
+        if (!proxy_drops(1)) {
+            kyros_socket_send_datagram(proxy_in, datagrams[i].data, datagrams[i].length, (const struct sockaddr*)&proxy_client);
+        }
+    }
+}
+
+static void echo_server_stream(kyros_quic_connection* connection, uint64_t stream_id, const char* data, uint64_t length, bool fin, void* ctx)
+{
+    // the stream is written back as it comes, it stays below the 256 KiB a stream buffers
+    echo_server_length += length;
+    kyros_quic_stream_write(connection, stream_id, data, length, fin);
+}
+
+static void echo_client_open(kyros_quic_connection* connection, void* ctx)
+{
+    auto stream = kyros_quic_open_stream(connection, true);
+    kyros_quic_stream_write(connection, stream, echo_payload, ECHO_SIZE, true);
+}
+
+static void echo_client_stream(kyros_quic_connection* connection, uint64_t stream_id, const char* data, uint64_t length, bool fin, void* ctx)
+{
+    if (echo_received_length + length <= ECHO_SIZE) {
+        memcpy(echo_received + echo_received_length, data, length);
+    }
+    echo_received_length += length;
+    if (fin) {
+        echo_ended = true;
+        echo_stats = kyros_quic_get_stats(connection);
+        kyros_quic_close(connection, 0, NULL, 0);
+    }
+}
+
+static void echo_client_close(kyros_quic_connection* connection, uint64_t error_code, bool application, const char* reason, uint32_t reason_length, void* ctx)
+{
+    echo_client = NULL;
+    kyros_quic_listener_close(echo_listener);
+    kyros_socket_close(proxy_in);
+    kyros_socket_close(proxy_out);
+}
+
+static void echo_deadline(void* ctx)
+{
+    timed_out = true;
+    if (echo_client) {
+        kyros_quic_close(echo_client, 0, NULL, 0);
+    }
+}
+
+static void test_loss_recovery()
+{
+    loop = kyros_loop_create(NULL);
+    timed_out = false;
+    echo_received_length = 0;
+    echo_server_length = 0;
+    echo_ended = false;
+    proxy_datagrams[0] = proxy_datagrams[1] = 0;
+    proxy_dropped = 0;
+    echo_payload = (char*)malloc(ECHO_SIZE);
+    echo_received = (char*)malloc(ECHO_SIZE);
+    for (uint32_t i = 0; i < ECHO_SIZE; i++) {
+        echo_payload[i] = (char)(i * 7 + (i >> 10));
+    }
+    kyros_quic_options options = { .alpn = "echo" };
+    echo_listener = kyros_quic_listen(loop, loopback(ECHO_PORT, true), server_tls, options, (kyros_quic_handler) { .onstream = echo_server_stream });
+    static kyros_socket_handler from_client = { .ondatagrams = proxy_from_client, .ref_count = 1 };
+    static kyros_socket_handler from_server = { .ondatagrams = proxy_from_server, .ref_count = 1 };
+    proxy_in = kyros_socket_listen(loop, loopback(PROXY_PORT, true), (kryos_socket_options) { 0 }, &from_client);
+    proxy_out = kyros_socket_connect(loop, loopback(ECHO_PORT, true), (kryos_socket_options) { 0 }, &from_server);
+    test_assert(echo_listener && proxy_in.tagged_ptr && proxy_out.tagged_ptr);
+    echo_client = kyros_quic_connect(loop, loopback(PROXY_PORT, true), client_tls, "localhost", options,
+        (kyros_quic_handler) { .onopen = echo_client_open, .onstream = echo_client_stream, .onclose = echo_client_close });
+    auto deadline = kyros_loop_timer(loop, echo_deadline, NULL, DEADLINE, 0, false);
+    kyros_loop_run_forever(loop);
+    kyros_timer_unref(deadline);
+    kyros_loop_unref(loop);
+
+    test_assert(!timed_out && echo_ended);
+    test_assert(echo_server_length == ECHO_SIZE);
+    test_assert(echo_received_length == ECHO_SIZE && !memcmp(echo_received, echo_payload, ECHO_SIZE));
+    // the drops were seen as losses and sent again, not only recovered by chance
+    test_assert(proxy_dropped > 0);
+    test_assert(echo_stats.packets_lost > 0);
+    free(echo_payload);
+    free(echo_received);
+}
+
+#endif
+
+void test_quic()
+{
+    test_decode_packet_number();
+    test_ranges_edges();
+    test_ranges_against_bitmap();
+#ifdef OPENSSL_IS_BORINGSSL
+    test_initial_protection();
+    create_tls();
+    test_http3_request();
+    test_loss_recovery();
+    SSL_CTX_free(client_tls);
+    SSL_CTX_free(server_tls);
+#endif
+}
@@ -0,0 +1,181 @@
+// kyros_server_group: one reuseport listener per loop thread, start and stop across threads, pinning and listen failures
+#include "test.h"
+#include <kyros.h>
+#include <kyros_internal.h>
+#include <stdatomic.h>
+#include <string.h>
+
+#define GROUP_PORT 39685
+#define TAKEN_PORT 39686
+#define GROUP_LOOPS 4
+#define CLIENTS 32
+
+static kyros_loop* client_loop;
+static kyros_loop* group_loops[GROUP_LOOPS];
+static atomic_uint onloop_calls;
+static atomic_uint accepted[GROUP_LOOPS];
+static atomic_uint server_opened;
+static atomic_uint server_closed;
+static uint32_t echoed;
+static uint32_t clients_closed;
+
+static void group_onloop(kyros_loop* loop, uint32_t index, void* ctx)
+{
+    // each loop thread calls it once before listening
+    test_assert(ctx == &onloop_calls);
+    group_loops[index] = loop;
+    atomic_fetch_add(&onloop_calls, 1);
+}
+
+static bool server_data(kyros_socket socket, const char* data, uint64_t length, void* ctx)
+{
+    kyros_socket_write(socket, data, length, false);
+    return true;
+}
+
+static void server_status(kyros_socket socket, kyros_socket_error error, void* ctx)
+{
+    auto state = kyros_socket_get_state(socket);
+    if (state == KYROS_SOCKET_STATE_OPEN) {
+        atomic_fetch_add(&server_opened, 1);
+        for (uint32_t i = 0; i < GROUP_LOOPS; i++) {
+            if (group_loops[i] == kyros_socket_get_loop(socket)) {
+                atomic_fetch_add(&accepted[i], 1);
+            }
+        }
+    } else if (state == KYROS_SOCKET_STATE_CLOSED) {
+        atomic_fetch_add(&server_closed, 1);
+    }
+}
+
+static bool client_data(kyros_socket socket, const char* data, uint64_t length, void* ctx)
+{
+    echoed += length == 4 && memcmp(data, "ping", 4) == 0;
+    kyros_socket_close(socket);
+    return true;
+}
+
+static void client_status(kyros_socket socket, kyros_socket_error error, void* ctx)
+{
+    auto state = kyros_socket_get_state(socket);
+    if (state == KYROS_SOCKET_STATE_OPEN) {
+        kyros_socket_write(socket, "ping", 4, false);
+    } else if (state == KYROS_SOCKET_STATE_CLOSED && ++clients_closed == CLIENTS) {
+        kyros_loop_stop(client_loop);
+    }
+}
+
+static kyros_socket_source group_source(uint16_t port)
+{
+    return (kyros_socket_source) { .type = KYROS_SOCKET_SOURCE_HOSTPORT, .value.host_port = { .host = "127.0.0.1", .port = port } };
+}
+
+static void test_spread_and_stop()
+{
+    atomic_store(&onloop_calls, 0);
+    atomic_store(&server_closed, 0);
+    for (uint32_t i = 0; i < GROUP_LOOPS; i++) {
+        atomic_store(&accepted[i], 0);
+    }
+    echoed = 0;
+    clients_closed = 0;
+    kyros_socket_handler server = { .ondata = server_data, .onstatus = server_status };
+    auto group = kyros_server_group_create(group_source(GROUP_PORT), (kryos_socket_options) { 0 }, &server,
+        (kyros_server_group_options) { .loop_count = GROUP_LOOPS, .onloop = group_onloop, .ctx = &onloop_calls });
+    test_assert(group);
+    test_assert(kyros_server_group_start(group));
+    // every loop listens once start returns
+    test_assert(atomic_load(&onloop_calls) == GROUP_LOOPS);
+    test_assert(kyros_server_group_get_loop_count(group) == GROUP_LOOPS);
+    for (uint32_t i = 0; i < GROUP_LOOPS; i++) {
+        test_assert(kyros_server_group_get_loop(group, i) == group_loops[i]);
+        test_assert(kyros_server_group_get_cpu(group, i) == -1);
+    }
+    test_assert(!kyros_server_group_get_loop(group, GROUP_LOOPS));
+
+    kyros_socket_handler client = { .ondata = client_data, .onstatus = client_status, .ref_count = 1 };
+    for (uint32_t i = 0; i < CLIENTS; i++) {
+        kyros_socket_connect(client_loop, group_source(GROUP_PORT), (kryos_socket_options) { 0 }, &client);
+    }
+    kyros_loop_run_forever(client_loop);
+    test_assert(echoed == CLIENTS);
+
+    // graceful: the loops exit once their sockets closed
+    kyros_server_group_stop(group);
+    kyros_server_group_join(group);
+    uint32_t total = 0;
+    uint32_t loops_used = 0;
+    for (uint32_t i = 0; i < GROUP_LOOPS; i++) {
+        total += atomic_load(&accepted[i]);
+        loops_used += atomic_load(&accepted[i]) > 0;
+    }
+    test_assert(total == CLIENTS);
+    // the kernel hashes the connections over the listeners, all 32 on one loop is (1/4)^31
+    test_assert(loops_used > 1);
+    test_assert(atomic_load(&server_closed) == CLIENTS);
+    kyros_server_group_destroy(group);
+}
+
+static void test_stop_timeout()
+{
+    atomic_store(&server_opened, 0);
+    kyros_socket_handler server = { .onstatus = server_status };
+    auto group = kyros_server_group_create(group_source(GROUP_PORT), (kryos_socket_options) { 0 }, &server,
+        (kyros_server_group_options) { .loop_count = 2, .stop_timeout = 100 });
+    test_assert(kyros_server_group_start(group));
+    // a connection that never closes on its own
+    auto idle = kyros_socket_connect(client_loop, group_source(GROUP_PORT), (kryos_socket_options) { 0 }, NULL);
+    kyros_socket_ref(idle);
+    // accepted, not only queued in the backlog of a listener about to close
+    while (!atomic_load(&server_opened)) {
+        kyros_loop_run_once(client_loop);
+    }
+    auto start = uv_hrtime();
+    kyros_server_group_stop(group);
+    kyros_server_group_join(group);
+    // the loop holding it stopped anyway after stop_timeout
+    test_assert(uv_hrtime() - start >= 90 * 1'000'000ull);
+    kyros_server_group_destroy(group);
+    kyros_socket_close(idle);
+    kyros_socket_unref(idle);
+    kyros_loop_run_once(client_loop);
+}
+
+static void test_pinned()
+{
+    auto group = kyros_server_group_create(group_source(GROUP_PORT), (kryos_socket_options) { 0 }, NULL,
+        (kyros_server_group_options) { .loop_count = 2, .pin_threads = true });
+    test_assert(kyros_server_group_start(group));
+    for (uint32_t i = 0; i < 2; i++) {
+        test_assert(kyros_server_group_get_cpu(group, i) >= 0);
+    }
+    kyros_server_group_destroy(group);
+}
+
+static void test_listen_failure()
+{
+    // only tcp listeners can be spread
+    test_assert(!kyros_server_group_create((kyros_socket_source) { .type = KYROS_SOCKET_SOURCE_HOSTPORT, .value.host_port = { .host = "127.0.0.1", .port = GROUP_PORT, .use_udp = true } },
+        (kryos_socket_options) { 0 }, NULL, (kyros_server_group_options) { .loop_count = 2 }));
+    // the port is held by a listener without SO_REUSEPORT, no loop of the group can join it
+    auto taken = kyros_socket_listen(client_loop, group_source(TAKEN_PORT), (kryos_socket_options) { 0 }, NULL);
+    test_assert(taken.tagged_ptr);
+    auto group = kyros_server_group_create(group_source(TAKEN_PORT), (kryos_socket_options) { 0 }, NULL,
+        (kyros_server_group_options) { .loop_count = 3 });
+    test_assert(!kyros_server_group_start(group));
+    // the aborted group is joined already
+    test_assert(!kyros_server_group_start(group));
+    kyros_server_group_destroy(group);
+    kyros_socket_close(taken);
+    kyros_loop_run_once(client_loop);
+}
+
+void test_server_group()
+{
+    client_loop = kyros_loop_create(NULL);
+    test_spread_and_stop();
+    test_stop_timeout();
+    test_pinned();
+    test_listen_failure();
+    kyros_loop_unref(client_loop);
+}
@@ -0,0 +1,121 @@
+// KYROS_SOCKET_AUTO_CORK: the writes of an iteration leave with one writev per socket in the after IO hook, in order
+#include "test.h"
+#include <kyros.h>
+#include <kyros_internal.h>
+#include <string.h>
+
+#define CORK_PORT 39651
+#define LARGE_PORT 39652
+#define UNCORKED_PORT 39653
+#define CLIENTS 2
+#define LARGE_SIZE (KYROS_CORK_COPY_LIMIT + 4000)
+
+static kyros_loop* loop;
+static uint32_t clients_done;
+
+typedef struct {
+    char data[LARGE_SIZE + 64];
+    uint64_t length;
+} received_bytes;
+
+static received_bytes received[CLIENTS];
+
+static kyros_socket_source local(uint16_t port)
+{
+    return (kyros_socket_source) { .type = KYROS_SOCKET_SOURCE_HOSTPORT, .value.host_port = { .host = "127.0.0.1", .port = port } };
+}
+
+static bool client_data(kyros_socket socket, const char* data, uint64_t length, void* ctx)
+{
+    received_bytes* bytes = ctx;
+    if (bytes->length + length <= sizeof(bytes->data)) {
+        memcpy(bytes->data + bytes->length, data, length);
+    }
+    bytes->length += length;
+    return true;
+}
+
+static void client_status(kyros_socket socket, kyros_socket_error error, void* ctx)
+{
+    if (kyros_socket_get_state(socket) == KYROS_SOCKET_STATE_CLOSED && ++clients_done == CLIENTS) {
+        kyros_loop_stop(loop);
+    }
+}
+
+/// @brief connect CLIENTS clients to port and run until the server closed all of them
+static void run_clients(uint16_t port)
+{
+    clients_done = 0;
+    kyros_socket_handler handlers[CLIENTS];
+    for (uint32_t i = 0; i < CLIENTS; i++) {
+        received[i].length = 0;
+        handlers[i] = (kyros_socket_handler) { .ondata = client_data, .onstatus = client_status, .ctx = &received[i], .ref_count = 1 };
+        kyros_socket_connect(loop, local(port), (kryos_socket_options) { 0 }, &handlers[i]);
+    }
+    kyros_loop_run_forever(loop);
+}
+
+static void small_writes_status(kyros_socket socket, kyros_socket_error error, void* ctx)
+{
+    if (kyros_socket_get_state(socket) == KYROS_SOCKET_STATE_OPEN) {
+        char digit[1];
+        for (uint32_t i = 0; i < 10; i++) {
+            digit[0] = (char)('0' + i);
+            kyros_socket_write(socket, digit, 1, i == 9);
+        }
+    }
+}
+
+static void test_coalesced_writes(kryos_socket_options options, uint16_t port, uint64_t saved_per_socket)
+{
+    kyros_socket_handler server = { .onstatus = small_writes_status, .ref_count = 1 };
+    auto listener = kyros_socket_listen(loop, local(port), options, &server);
+    auto before = kyros_loop_get_stats(loop).cork_syscalls_saved;
+    run_clients(port);
+    kyros_socket_close(listener);
+    kyros_loop_run_once(loop);
+    for (uint32_t i = 0; i < CLIENTS; i++) {
+        test_assert(received[i].length == 10 && !memcmp(received[i].data, "0123456789", 10));
+    }
+    // every corked socket is flushed on its own
+    test_assert(kyros_loop_get_stats(loop).cork_syscalls_saved - before == CLIENTS * saved_per_socket);
+}
+
+static char large[LARGE_SIZE];
+
+static void large_write_status(kyros_socket socket, kyros_socket_error error, void* ctx)
+{
+    if (kyros_socket_get_state(socket) == KYROS_SOCKET_STATE_OPEN) {
+        kyros_socket_write(socket, "head", 4, false);
+        // too big to copy, it leaves at once together with head
+        kyros_socket_write(socket, large, LARGE_SIZE, false);
+        kyros_socket_write(socket, "tail", 4, true);
+    }
+}
+
+static void test_large_write_keeps_order()
+{
+    memset(large, 'x', LARGE_SIZE);
+    kyros_socket_handler server = { .onstatus = large_write_status, .ref_count = 1 };
+    auto listener = kyros_socket_listen(loop, local(LARGE_PORT), (kryos_socket_options) { .cork_behavior = KYROS_SOCKET_AUTO_CORK }, &server);
+    run_clients(LARGE_PORT);
+    kyros_socket_close(listener);
+    kyros_loop_run_once(loop);
+    for (uint32_t i = 0; i < CLIENTS; i++) {
+        auto bytes = &received[i];
+        test_assert(bytes->length == LARGE_SIZE + 8);
+        test_assert(!memcmp(bytes->data, "head", 4));
+        test_assert(!memcmp(bytes->data + 4, large, LARGE_SIZE));
+        test_assert(!memcmp(bytes->data + 4 + LARGE_SIZE, "tail", 4));
+    }
+}
+
+void test_socket_cork()
+{
+    loop = kyros_loop_create(NULL);
+    test_coalesced_writes((kryos_socket_options) { .cork_behavior = KYROS_SOCKET_AUTO_CORK }, CORK_PORT, 9);
+    // without auto cork every write is a send
+    test_coalesced_writes((kryos_socket_options) { 0 }, UNCORKED_PORT, 0);
+    test_large_write_keeps_order();
+    kyros_loop_unref(loop);
+}
@@ -0,0 +1,292 @@
+// kyros_socket_migrate: a socket moves to a loop on another thread with its write queue and tls state, and server groups move the sockets of a slow loop
+#include "test.h"
+#include <kyros.h>
+#include <kyros_internal.h>
+#include <stdatomic.h>
+#include <string.h>
+
+#define MIGRATE_PORT 39690
+#define REBALANCE_PORT 39691
+#define STREAM_SIZE (1024 * 1024 + 11)
+#define REBALANCE_CLIENTS 16
+
+static kyros_loop* loop;
+static kyros_loop* worker_loop;
+static kyros_timer* worker_keep_alive;
+static uv_thread_t worker_thread;
+static uv_thread_t main_thread;
+
+static void worker_run(void* arg)
+{
+    kyros_loop_run_forever(worker_loop);
+}
+
+static void worker_stop(void* ctx)
+{
+    kyros_timer_unref(worker_keep_alive);
+    kyros_loop_stop(worker_loop);
+}
+
+static void noop(void* ctx)
+{
+}
+
+static char stream[STREAM_SIZE];
+static uint64_t received;
+static uint64_t errors;
+static bool pong;
+static bool refused;
+static kyros_loop* migrated_to;
+static bool migrated_off_thread;
+static atomic_uint worker_closed;
+
+/// @brief byte position of what the client should see: the stream queued before the move, :END written after it, then pong
+static char expected_byte(uint64_t position)
+{
+    if (position < STREAM_SIZE) {
+        return stream[position];
+    }
+    return ":END"[position - STREAM_SIZE];
+}
+
+static bool moved_data(kyros_socket socket, const char* data, uint64_t length, void* ctx)
+{
+    if (length == 4 && memcmp(data, "ping", 4) == 0) {
+        kyros_socket_write(socket, "pong", 4, true);
+    }
+    return true;
+}
+
+static void moved_status(kyros_socket socket, kyros_socket_error error, void* ctx)
+{
+    if (kyros_socket_get_state(socket) == KYROS_SOCKET_STATE_CLOSED) {
+        atomic_fetch_add(&worker_closed, 1);
+    }
+}
+
+static void moved_onmigrate(kyros_socket socket, kyros_loop* to, void* ctx)
+{
+    auto self = uv_thread_self();
+    migrated_to = to;
+    migrated_off_thread = !uv_thread_equal(&main_thread, &self);
+    test_assert(kyros_socket_get_loop(socket) == worker_loop);
+    kyros_socket_write(socket, ":END", 4, false);
+}
+
+static kyros_socket_handler moved_handler = { .ondata = moved_data, .onstatus = moved_status, .onmigrate = moved_onmigrate, .ref_count = 1 };
+
+static void server_status(kyros_socket socket, kyros_socket_error error, void* ctx)
+{
+    auto state = kyros_socket_get_state(socket);
+    if ((state == KYROS_SOCKET_STATE_OPEN && !kyros_socket_is_secure(socket)) || state == KYROS_SOCKET_STATE_SECURE) {
+        // most of it is still queued when the socket leaves
+        kyros_socket_write(socket, stream, STREAM_SIZE, false);
+        refused = !kyros_socket_migrate(socket, loop, NULL);
+        test_assert(kyros_socket_migrate(socket, worker_loop, &moved_handler));
+        // on its way already
+        refused &= !kyros_socket_migrate(socket, worker_loop, &moved_handler);
+    }
+}
+
+static bool client_data(kyros_socket socket, const char* data, uint64_t length, void* ctx)
+{
+    if (received == STREAM_SIZE + 4) {
+        pong = length == 4 && memcmp(data, "pong", 4) == 0;
+        return true;
+    }
+    for (uint64_t i = 0; i < length; i++) {
+        errors += data[i] != expected_byte(received + i);
+    }
+    received += length;
+    if (received == STREAM_SIZE + 4) {
+        kyros_socket_write(socket, "ping", 4, false);
+    }
+    return true;
+}
+
+static void client_status(kyros_socket socket, kyros_socket_error error, void* ctx)
+{
+    if (kyros_socket_get_state(socket) == KYROS_SOCKET_STATE_CLOSED) {
+        kyros_loop_stop(loop);
+    }
+}
+
+static void migrate_connection(SSL_CTX* server_tls, SSL_CTX* client_tls)
+{
+    received = 0;
+    errors = 0;
+    pong = false;
+    refused = false;
+    migrated_to = NULL;
+    migrated_off_thread = false;
+    atomic_store(&worker_closed, 0);
+    kyros_socket_source source = { .type = KYROS_SOCKET_SOURCE_HOSTPORT, .value.host_port = { .host = "127.0.0.1", .port = MIGRATE_PORT } };
+    kyros_socket_handler server = { .onstatus = server_status, .ref_count = 1 };
+    kyros_socket_handler client = { .ondata = client_data, .onstatus = client_status, .ref_count = 1 };
+    auto listener = kyros_socket_listen(loop, source, (kryos_socket_options) { .tls = server_tls }, &server);
+    // listeners and sockets still connecting stay where they are
+    test_assert(!kyros_socket_migrate(listener, worker_loop, NULL));
+    auto connecting = kyros_socket_connect(loop, source, (kryos_socket_options) { .tls = client_tls }, &client);
+    test_assert(!kyros_socket_migrate(connecting, worker_loop, NULL));
+    kyros_loop_run_forever(loop);
+    kyros_socket_close(listener);
+    kyros_loop_run_once(loop);
+    // the server side closes in the worker thread once the client is gone
+    for (uint32_t i = 0; i < 2000 && !atomic_load(&worker_closed); i++) {
+        uv_sleep(1);
+    }
+    test_assert(atomic_load(&worker_closed) == 1);
+    test_assert(refused);
+    test_assert(migrated_to == worker_loop);
+    test_assert(migrated_off_thread);
+    test_assert(received == STREAM_SIZE + 4 && errors == 0);
+    test_assert(pong);
+    // the chunks of the queue left with the socket
+    test_assert(kyros_get_internal_loop(loop)->write_pool.in_use == 0);
+}
+
+static void test_migrate()
+{
+    for (uint32_t i = 0; i < STREAM_SIZE; i++) {
+        stream[i] = (char)(i * 11 + i / 4093);
+    }
+    main_thread = uv_thread_self();
+    worker_loop = kyros_loop_create(NULL);
+    worker_keep_alive = kyros_loop_timer(worker_loop, noop, NULL, 3'600'000, 0, true);
+    uv_thread_create(&worker_thread, worker_run, NULL);
+
+    migrate_connection(NULL, NULL);
+    migrate_connection(test_tls_server_context(), test_tls_client_context());
+
+    kyros_loop_atomic_defer(worker_loop, worker_stop, NULL);
+    uv_thread_join(&worker_thread);
+    // the queue of the moved sockets was accounted to the worker loop and given back there
+    test_assert(kyros_get_internal_loop(worker_loop)->write_pool.in_use == 0);
+    // like a server group loop, drained once its thread is gone
+    kyros_loop_atomic_unref(worker_loop);
+    kyros_loop_run_once(worker_loop);
+    kyros_loop_unref(worker_loop);
+}
+
+static void test_other_engine()
+{
+    auto uring = kyros_loop_create_with_options(NULL, (kyros_loop_options) { .io_engine = KYROS_LOOP_IO_URING });
+    if (kyros_loop_get_io_engine(uring) != KYROS_LOOP_IO_URING) {
+        kyros_loop_unref(uring);
+        return;
+    }
+    kyros_socket_source source = { .type = KYROS_SOCKET_SOURCE_HOSTPORT, .value.host_port = { .host = "127.0.0.1", .port = MIGRATE_PORT } };
+    auto listener = kyros_socket_listen(loop, source, (kryos_socket_options) { 0 }, NULL);
+    auto client = kyros_socket_connect(loop, source, (kryos_socket_options) { 0 }, NULL);
+    while (kyros_socket_get_state(client) != KYROS_SOCKET_STATE_OPEN) {
+        kyros_loop_run_once(loop);
+    }
+    // the io_uring stash can't be handed to a poll loop, nor the other way around
+    test_assert(!kyros_socket_migrate(client, uring, NULL));
+    kyros_socket_close(client);
+    kyros_socket_close(listener);
+    kyros_loop_run_once(loop);
+    kyros_loop_unref(uring);
+}
+
+static kyros_loop* group_loops[2];
+static atomic_uint rebalanced;
+static atomic_bool rebalanced_elsewhere;
+static kyros_socket clients[REBALANCE_CLIENTS];
+static uint64_t bytes_sent;
+static uint64_t bytes_echoed;
+static uint32_t ticks;
+static uint32_t ticks_after;
+
+static void group_onloop(kyros_loop* group_loop, uint32_t index, void* ctx)
+{
+    group_loops[index] = group_loop;
+}
+
+static bool slow_echo(kyros_socket socket, const char* data, uint64_t length, void* ctx)
+{
+    // loop 0 is slow, a loop above the threshold for 3 checks moves its sockets to loop 1
+    if (kyros_socket_get_loop(socket) == group_loops[0]) {
+        auto until = uv_hrtime() + 1'000'000;
+        while (uv_hrtime() < until) {
+        }
+    }
+    kyros_socket_write(socket, data, length, false);
+    return true;
+}
+
+static void group_onmigrate(kyros_socket socket, kyros_loop* to, void* ctx)
+{
+    if (to != group_loops[1]) {
+        atomic_store(&rebalanced_elsewhere, true);
+    }
+    atomic_fetch_add(&rebalanced, 1);
+}
+
+static bool rebalance_client_data(kyros_socket socket, const char* data, uint64_t length, void* ctx)
+{
+    bytes_echoed += length;
+    return true;
+}
+
+static void rebalance_tick(void* ctx)
+{
+    ticks++;
+    // keep the traffic going a bit after the first move, then wait for the last echo
+    if (atomic_load(&rebalanced) || ticks > 300) {
+        ticks_after++;
+    }
+    if (ticks_after < 20) {
+        for (uint32_t i = 0; i < REBALANCE_CLIENTS; i++) {
+            if (kyros_socket_get_state(clients[i]) == KYROS_SOCKET_STATE_OPEN) {
+                kyros_socket_write(clients[i], "x", 1, false);
+                bytes_sent++;
+            }
+        }
+    } else if (bytes_echoed == bytes_sent || ticks_after > 500) {
+        kyros_loop_stop(loop);
+    }
+}
+
+static void test_rebalance()
+{
+    atomic_store(&rebalanced, 0);
+    atomic_store(&rebalanced_elsewhere, false);
+    bytes_sent = 0;
+    bytes_echoed = 0;
+    ticks = 0;
+    ticks_after = 0;
+    kyros_socket_source source = { .type = KYROS_SOCKET_SOURCE_HOSTPORT, .value.host_port = { .host = "127.0.0.1", .port = REBALANCE_PORT } };
+    kyros_socket_handler server = { .ondata = slow_echo, .onmigrate = group_onmigrate };
+    auto group = kyros_server_group_create(source, (kryos_socket_options) { 0 }, &server,
+        (kyros_server_group_options) { .loop_count = 2, .onloop = group_onloop, .rebalance_threshold = 300, .rebalance_interval = 10 });
+    test_assert(kyros_server_group_start(group));
+    kyros_socket_handler client = { .ondata = rebalance_client_data, .ref_count = 1 };
+    for (uint32_t i = 0; i < REBALANCE_CLIENTS; i++) {
+        clients[i] = kyros_socket_connect(loop, source, (kryos_socket_options) { 0 }, &client);
+        kyros_socket_ref(clients[i]);
+    }
+    auto tick = kyros_loop_timer(loop, rebalance_tick, NULL, 10, 10, true);
+    kyros_loop_run_forever(loop);
+    kyros_timer_unref(tick);
+    // with 16 connections both loops got some (all on loop 1 is 2^-16)
+    test_assert(atomic_load(&rebalanced) > 0);
+    test_assert(!atomic_load(&rebalanced_elsewhere));
+    // the moved sockets kept answering
+    test_assert(bytes_echoed == bytes_sent);
+    for (uint32_t i = 0; i < REBALANCE_CLIENTS; i++) {
+        kyros_socket_close(clients[i]);
+        kyros_socket_unref(clients[i]);
+    }
+    kyros_loop_run_once(loop);
+    kyros_server_group_destroy(group);
+}
+
+void test_socket_migrate()
+{
+    loop = kyros_loop_create(NULL);
+    test_migrate();
+    test_other_engine();
+    test_rebalance();
+    kyros_loop_unref(loop);
+}
@@ -0,0 +1,181 @@
+// kyros_socket_pipe: a proxy between a client and a sink, spliced for tcp, through userspace for a tls source, to a file with pipe3
+#include "test.h"
+#include <kyros.h>
+#include <kyros_internal.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SINK_PORT 39676
+#define PROXY_PORT 39677
+#define PIPE_FILE "kyros_test_pipe"
+#define TOTAL (2 * 1024 * 1024 + 77)
+#define PIECE_SIZE 70'000
+
+typedef enum {
+    PIPE_TO_SOCKET,
+    PIPE_TO_FILE,
+    UNPIPE,
+} pipe_mode;
+
+static kyros_loop* loop;
+static pipe_mode mode;
+static int file_fd;
+static uint64_t sent;
+static uint64_t received;
+static uint64_t errors;
+static uint64_t proxy_data_calls;
+static char piece[PIECE_SIZE];
+
+static inline char pattern(uint64_t position)
+{
+    return (char)(position * 7 + position / 65'521);
+}
+
+static void check(const char* data, uint64_t length)
+{
+    for (uint64_t i = 0; i < length; i++) {
+        errors += data[i] != pattern(received + i);
+    }
+    received += length;
+}
+
+static void fill(kyros_socket socket)
+{
+    while (sent < TOTAL) {
+        uint64_t size = TOTAL - sent < PIECE_SIZE ? TOTAL - sent : PIECE_SIZE;
+        for (uint64_t i = 0; i < size; i++) {
+            piece[i] = pattern(sent + i);
+        }
+        sent += size;
+        if (!kyros_socket_write(socket, piece, size, sent == TOTAL)) {
+            return;
+        }
+    }
+}
+
+static void client_drain(kyros_socket socket, void* ctx)
+{
+    fill(socket);
+}
+
+static void client_status(kyros_socket socket, kyros_socket_error error, void* ctx)
+{
+    auto state = kyros_socket_get_state(socket);
+    if (state == KYROS_SOCKET_STATE_OPEN || state == KYROS_SOCKET_STATE_SECURE) {
+        fill(socket);
+    }
+}
+
+static bool sink_data(kyros_socket socket, const char* data, uint64_t length, void* ctx)
+{
+    check(data, length);
+    return true;
+}
+
+static void sink_status(kyros_socket socket, kyros_socket_error error, void* ctx)
+{
+    auto state = kyros_socket_get_state(socket);
+    if (mode == PIPE_TO_SOCKET && (state == KYROS_SOCKET_STATE_READABLE_ENDED || state == KYROS_SOCKET_STATE_CLOSED)) {
+        kyros_loop_stop(loop);
+    }
+}
+
+static bool proxy_data(kyros_socket socket, const char* data, uint64_t length, void* ctx)
+{
+    // only reached once unpiped
+    proxy_data_calls++;
+    check(data, length);
+    return true;
+}
+
+static void proxy_status(kyros_socket socket, kyros_socket_error error, void* ctx)
+{
+    auto state = kyros_socket_get_state(socket);
+    if (state == KYROS_SOCKET_STATE_OPEN || state == KYROS_SOCKET_STATE_SECURE) {
+        if (mode == PIPE_TO_FILE) {
+            test_assert(kyros_socket_pipe3(socket, file_fd, false));
+            return;
+        }
+        kyros_socket_source sink = { .type = KYROS_SOCKET_SOURCE_HOSTPORT, .value.host_port = { .host = "127.0.0.1", .port = SINK_PORT } };
+        auto upstream = kyros_socket_connect(loop, sink, (kryos_socket_options) { .allow_half_open = true, .write_high_watermark = 4096 }, NULL);
+        test_assert(kyros_socket_pipe(socket, upstream, true));
+        if (mode == UNPIPE) {
+            // back to ondata before anything moved, upstream is not needed anymore
+            kyros_socket_unpipe(socket);
+            kyros_socket_close(upstream);
+        }
+    } else if (state == KYROS_SOCKET_STATE_READABLE_ENDED || state == KYROS_SOCKET_STATE_CLOSED) {
+        if (mode != PIPE_TO_SOCKET) {
+            kyros_loop_stop(loop);
+        }
+    }
+}
+
+static void run_proxy(pipe_mode pipe_mode, SSL_CTX* server_tls, SSL_CTX* client_tls)
+{
+    mode = pipe_mode;
+    sent = 0;
+    received = 0;
+    errors = 0;
+    proxy_data_calls = 0;
+    kyros_socket_handler sink = { .ondata = sink_data, .onstatus = sink_status, .ref_count = 1 };
+    kyros_socket_handler proxy = { .ondata = proxy_data, .onstatus = proxy_status, .ref_count = 1 };
+    kyros_socket_handler client = { .ondrain = client_drain, .onstatus = client_status, .ref_count = 1 };
+    auto sink_listener = kyros_socket_listen(loop,
+        (kyros_socket_source) { .type = KYROS_SOCKET_SOURCE_HOSTPORT, .value.host_port = { .host = "127.0.0.1", .port = SINK_PORT } },
+        (kryos_socket_options) { .allow_half_open = true }, &sink);
+    kyros_socket_source proxy_source = { .type = KYROS_SOCKET_SOURCE_HOSTPORT, .value.host_port = { .host = "127.0.0.1", .port = PROXY_PORT } };
+    auto proxy_listener = kyros_socket_listen(loop, proxy_source, (kryos_socket_options) { .tls = server_tls }, &proxy);
+    kyros_socket_connect(loop, proxy_source, (kryos_socket_options) { .tls = client_tls, .allow_half_open = true }, &client);
+    kyros_loop_run_forever(loop);
+    kyros_socket_close(sink_listener);
+    kyros_socket_close(proxy_listener);
+    for (uint32_t i = 0; i < 5; i++) {
+        kyros_loop_run_once(loop);
+    }
+}
+
+static void test_pipe_to_socket()
+{
+    // spliced, the bytes never reach the proxy
+    run_proxy(PIPE_TO_SOCKET, NULL, NULL);
+    test_assert(received == TOTAL && errors == 0);
+    test_assert(proxy_data_calls == 0);
+    // decrypted by the proxy and written to upstream
+    run_proxy(PIPE_TO_SOCKET, test_tls_server_context(), test_tls_client_context());
+    test_assert(received == TOTAL && errors == 0);
+    test_assert(proxy_data_calls == 0);
+}
+
+static void test_pipe_to_file()
+{
+    file_fd = open(PIPE_FILE, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    run_proxy(PIPE_TO_FILE, NULL, NULL);
+    test_assert(proxy_data_calls == 0);
+    char buffer[65536];
+    ssize_t length;
+    lseek(file_fd, 0, SEEK_SET);
+    while ((length = read(file_fd, buffer, sizeof(buffer))) > 0) {
+        check(buffer, length);
+    }
+    test_assert(received == TOTAL && errors == 0);
+    close(file_fd);
+    remove(PIPE_FILE);
+}
+
+static void test_unpipe()
+{
+    run_proxy(UNPIPE, NULL, NULL);
+    test_assert(proxy_data_calls > 0);
+    test_assert(received == TOTAL && errors == 0);
+}
+
+void test_socket_pipe()
+{
+    loop = kyros_loop_create(NULL);
+    test_pipe_to_socket();
+    test_pipe_to_file();
+    test_unpipe();
+    kyros_loop_unref(loop);
+}
@@ -0,0 +1,472 @@
+// kyros_socket_pool: checkout and reuse, max_per_host waiters, health checks, idle eviction, destroy and stealing between the loops of a group,
+// also when the loop asked for a connection does not answer
+#include "test.h"
+#include <kyros.h>
+#include <kyros_internal.h>
+#include <stdatomic.h>
+#include <string.h>
+
+#define POOL_PORT 39705
+#define POOL_TLS_PORT 39706
+#define SERVER_SOCKETS 16
+
+static kyros_loop* loop;
+static kyros_socket server_sockets[SERVER_SOCKETS];
+static uint32_t server_count;
+
+static bool server_data(kyros_socket socket, const char* data, uint64_t length, void* ctx)
+{
+    kyros_socket_write(socket, "pong", 4, false);
+    return true;
+}
+
+static void server_status(kyros_socket socket, kyros_socket_error error, void* ctx)
+{
+    auto state = kyros_socket_get_state(socket);
+    if ((state == KYROS_SOCKET_STATE_OPEN && !kyros_socket_is_secure(socket)) || state == KYROS_SOCKET_STATE_SECURE) {
+        server_sockets[server_count++] = socket;
+    } else if (state == KYROS_SOCKET_STATE_CLOSED) {
+        for (uint32_t i = 0; i < server_count; i++) {
+            if (server_sockets[i].tagged_ptr == socket.tagged_ptr) {
+                server_sockets[i] = server_sockets[--server_count];
+                break;
+            }
+        }
+    }
+}
+
+static kyros_socket_handler server_handler = { .ondata = server_data, .onstatus = server_status, .ref_count = 1 };
+
+typedef struct {
+    kyros_socket_handler handler;
+    kyros_socket socket;
+    kyros_socket_error error;
+    bool done;
+    uint32_t pongs;
+    bool closed;
+} pool_client;
+
+static pool_client clients[4];
+
+static bool client_data(kyros_socket socket, const char* data, uint64_t length, void* ctx)
+{
+    pool_client* client = ctx;
+    client->pongs += length == 4 && memcmp(data, "pong", 4) == 0;
+    return true;
+}
+
+static void client_status(kyros_socket socket, kyros_socket_error error, void* ctx)
+{
+    pool_client* client = ctx;
+    client->closed |= kyros_socket_get_state(socket) == KYROS_SOCKET_STATE_CLOSED;
+}
+
+static void on_checkout(kyros_socket socket, kyros_socket_error error, void* ctx)
+{
+    pool_client* client = ctx;
+    client->socket = socket;
+    client->error = error;
+    client->done = true;
+}
+
+static kyros_socket_source pool_source(uint16_t port)
+{
+    return (kyros_socket_source) { .type = KYROS_SOCKET_SOURCE_HOSTPORT, .value.host_port = { .host = "127.0.0.1", .port = port } };
+}
+
+static void checkout(kyros_socket_pool* pool, uint32_t index, uint16_t port, SSL_CTX* tls)
+{
+    auto client = &clients[index];
+    *client = (pool_client) { .handler = { .ctx = client, .ondata = client_data, .onstatus = client_status, .ref_count = 1 } };
+    kyros_socket_pool_checkout(pool, pool_source(port), tls, &client->handler, on_checkout, client);
+}
+
+static bool wait_for(bool* flag)
+{
+    for (uint32_t i = 0; i < 3000 && !*flag; i++) {
+        kyros_loop_run_once(loop);
+        uv_sleep(1);
+    }
+    return *flag;
+}
+
+/// @brief the checkout of client answered with a socket that still talks to the server
+static bool ping(uint32_t index)
+{
+    auto client = &clients[index];
+    if (!wait_for(&client->done) || !client->socket.tagged_ptr) {
+        return false;
+    }
+    auto before = client->pongs;
+    kyros_socket_write(client->socket, "ping", 4, false);
+    for (uint32_t i = 0; i < 3000 && client->pongs == before; i++) {
+        kyros_loop_run_once(loop);
+        uv_sleep(1);
+    }
+    return client->pongs == before + 1;
+}
+
+static void close_server_sockets()
+{
+    while (server_count) {
+        kyros_socket_close(server_sockets[server_count - 1]);
+    }
+}
+
+static void test_reuse()
+{
+    auto pool = kyros_socket_pool_create(loop, (kyros_socket_pool_options) { 0 });
+    checkout(pool, 0, POOL_PORT, NULL);
+    test_assert(!clients[0].done);
+    test_assert(ping(0));
+    auto first = clients[0].socket;
+    kyros_socket_pool_release(first, true);
+    auto stats = kyros_socket_pool_get_stats(pool);
+    test_assert(stats.connected == 1 && stats.connections == 1 && stats.idle == 1);
+
+    // an idle connection is handed out before checkout returns
+    checkout(pool, 1, POOL_PORT, NULL);
+    test_assert(clients[1].done && clients[1].socket.tagged_ptr == first.tagged_ptr);
+    test_assert(ping(1));
+    // the handler of the first checkout is not called anymore
+    test_assert(clients[0].pongs == 1);
+    stats = kyros_socket_pool_get_stats(pool);
+    test_assert(stats.reused == 1 && stats.connected == 1 && stats.idle == 0);
+
+    // tls connections are their own endpoint, handed out once the handshake is done
+    auto tls = test_tls_client_context();
+    checkout(pool, 2, POOL_TLS_PORT, tls);
+    test_assert(ping(2));
+    test_assert(kyros_socket_is_secure(clients[2].socket) && kyros_socket_get_ssl(clients[2].socket));
+    kyros_socket_pool_release(clients[2].socket, true);
+    checkout(pool, 3, POOL_TLS_PORT, tls);
+    test_assert(clients[3].done && ping(3));
+    stats = kyros_socket_pool_get_stats(pool);
+    test_assert(stats.reused == 2 && stats.connected == 2);
+
+    kyros_socket_pool_release(clients[1].socket, true);
+    kyros_socket_pool_release(clients[3].socket, true);
+    test_assert(kyros_socket_pool_get_stats(pool).idle == 2);
+    kyros_socket_pool_destroy(pool);
+    kyros_loop_run_once(loop);
+}
+
+static void test_max_per_host()
+{
+    auto pool = kyros_socket_pool_create(loop, (kyros_socket_pool_options) { .max_per_host = 2 });
+    checkout(pool, 0, POOL_PORT, NULL);
+    checkout(pool, 1, POOL_PORT, NULL);
+    checkout(pool, 2, POOL_PORT, NULL);
+    test_assert(kyros_socket_pool_get_stats(pool).waited == 1);
+    test_assert(ping(0) && ping(1));
+    test_assert(!clients[2].done);
+    // the waiter takes the released connection as it is
+    kyros_socket_pool_release(clients[0].socket, true);
+    test_assert(clients[2].done && clients[2].socket.tagged_ptr == clients[0].socket.tagged_ptr);
+    test_assert(ping(2));
+    // one not reusable is closed, its place goes to the next waiter
+    checkout(pool, 3, POOL_PORT, NULL);
+    kyros_socket_pool_release(clients[1].socket, false);
+    test_assert(ping(3));
+    auto stats = kyros_socket_pool_get_stats(pool);
+    test_assert(stats.waited == 2 && stats.connected == 3 && stats.connections == 2);
+
+    kyros_socket_pool_release(clients[2].socket, true);
+    kyros_socket_pool_release(clients[3].socket, true);
+    test_assert(kyros_socket_pool_get_stats(pool).idle == 2);
+    // idle connections the peer closed are dropped, not handed out
+    close_server_sockets();
+    for (uint32_t i = 0; i < 3000 && kyros_socket_pool_get_stats(pool).unhealthy < 2; i++) {
+        kyros_loop_run_once(loop);
+        uv_sleep(1);
+    }
+    stats = kyros_socket_pool_get_stats(pool);
+    test_assert(stats.unhealthy == 2 && stats.idle == 0 && stats.connections == 0);
+    checkout(pool, 0, POOL_PORT, NULL);
+    test_assert(ping(0));
+    test_assert(kyros_socket_pool_get_stats(pool).connected == 4);
+    kyros_socket_pool_release(clients[0].socket, true);
+    kyros_socket_pool_destroy(pool);
+    kyros_loop_run_once(loop);
+}
+
+static void test_eviction()
+{
+    auto pool = kyros_socket_pool_create(loop, (kyros_socket_pool_options) { .idle_timeout = 300 });
+    checkout(pool, 0, POOL_PORT, NULL);
+    test_assert(ping(0));
+    kyros_socket_pool_release(clients[0].socket, true);
+    auto start = uv_hrtime();
+    for (uint32_t i = 0; i < 3000 && !kyros_socket_pool_get_stats(pool).evicted; i++) {
+        kyros_loop_run_once(loop);
+        uv_sleep(1);
+    }
+    auto stats = kyros_socket_pool_get_stats(pool);
+    test_assert(stats.evicted == 1 && stats.unhealthy == 0 && stats.connections == 0);
+    test_assert(uv_hrtime() - start >= 250 * 1'000'000ull);
+    kyros_socket_pool_destroy(pool);
+    kyros_loop_run_once(loop);
+}
+
+static void test_destroy()
+{
+    auto pool = kyros_socket_pool_create(loop, (kyros_socket_pool_options) { .max_per_host = 1 });
+    // only tcp host and port sources
+    clients[1] = (pool_client) { 0 };
+    kyros_socket_pool_checkout(pool, (kyros_socket_source) { .type = KYROS_SOCKET_SOURCE_HOSTPORT, .value.host_port = { .host = "127.0.0.1", .port = POOL_PORT, .use_udp = true } },
+        NULL, NULL, on_checkout, &clients[1]);
+    test_assert(clients[1].done && !clients[1].socket.tagged_ptr && clients[1].error.code == (uint32_t)-UV_EINVAL);
+
+    checkout(pool, 0, POOL_PORT, NULL);
+    test_assert(ping(0));
+    checkout(pool, 1, POOL_PORT, NULL);
+    kyros_socket_pool_destroy(pool);
+    // the waiter is failed, so is a checkout after destroy
+    test_assert(clients[1].done && !clients[1].socket.tagged_ptr && clients[1].error.code == (uint32_t)-UV_ECANCELED);
+    checkout(pool, 2, POOL_PORT, NULL);
+    test_assert(clients[2].done && !clients[2].socket.tagged_ptr && clients[2].error.code == (uint32_t)-UV_ECANCELED);
+    // the checked out connection still works and is closed once released, the pool memory goes with it
+    test_assert(ping(0));
+    kyros_socket_pool_release(clients[0].socket, true);
+    test_assert(clients[0].closed);
+    kyros_loop_run_once(loop);
+}
+
+static kyros_socket_pool_group* group;
+static kyros_loop* group_loops[2];
+static kyros_socket_pool* group_pools[2];
+static kyros_timer* keep_alive[2];
+static uv_thread_t threads[2];
+static pool_client steal_clients[2];
+static atomic_uint phase;
+static atomic_bool wrong_loop;
+
+static void group_run(void* arg)
+{
+    kyros_loop_run_forever(arg);
+}
+
+static void group_stop(void* ctx)
+{
+    auto index = (uint32_t)(uintptr_t)ctx;
+    kyros_timer_unref(keep_alive[index]);
+    kyros_loop_stop(group_loops[index]);
+}
+
+static void noop(void* ctx)
+{
+}
+
+static bool steal_data(kyros_socket socket, const char* data, uint64_t length, void* ctx)
+{
+    pool_client* client = ctx;
+    auto index = (uint32_t)(client - steal_clients);
+    if (kyros_socket_get_loop(socket) != group_loops[index]) {
+        atomic_store(&wrong_loop, true);
+    }
+    kyros_socket_pool_release(socket, true);
+    atomic_fetch_add(&phase, 1);
+    return true;
+}
+
+static void steal_checkout(kyros_socket socket, kyros_socket_error error, void* ctx)
+{
+    pool_client* client = ctx;
+    auto index = (uint32_t)(client - steal_clients);
+    if (!socket.tagged_ptr || kyros_socket_get_loop(socket) != group_loops[index]) {
+        atomic_store(&wrong_loop, true);
+        atomic_fetch_add(&phase, 1);
+        return;
+    }
+    kyros_socket_write(socket, "ping", 4, false);
+}
+
+static void steal_start(void* ctx)
+{
+    auto index = (uint32_t)(uintptr_t)ctx;
+    auto client = &steal_clients[index];
+    *client = (pool_client) { .handler = { .ctx = client, .ondata = steal_data, .ref_count = 1 } };
+    kyros_socket_pool_checkout(group_pools[index], pool_source(POOL_PORT), NULL, &client->handler, steal_checkout, client);
+}
+
+static void steal_destroy(void* ctx)
+{
+    kyros_socket_pool_destroy(group_pools[(uintptr_t)ctx]);
+    atomic_fetch_add(&phase, 1);
+}
+
+static kyros_socket_pool_stats stats_of[2];
+
+static void steal_stats(void* ctx)
+{
+    stats_of[(uintptr_t)ctx] = kyros_socket_pool_get_stats(group_pools[(uintptr_t)ctx]);
+    atomic_fetch_add(&phase, 1);
+}
+
+static bool wait_phase(uint32_t target)
+{
+    // the server side of the connections lives on the main loop
+    for (uint32_t i = 0; i < 3000 && atomic_load(&phase) < target; i++) {
+        kyros_loop_run_once(loop);
+        uv_sleep(1);
+    }
+    return atomic_load(&phase) == target;
+}
+
+static void group_start()
+{
+    atomic_store(&phase, 0);
+    atomic_store(&wrong_loop, false);
+    // the connections of the earlier tests are gone from the server too
+    close_server_sockets();
+    group = kyros_socket_pool_group_create();
+    for (uint32_t i = 0; i < 2; i++) {
+        group_loops[i] = kyros_loop_create(NULL);
+        keep_alive[i] = kyros_loop_timer(group_loops[i], noop, NULL, 3'600'000, 0, true);
+        group_pools[i] = kyros_socket_pool_create(group_loops[i], (kyros_socket_pool_options) { .group = group });
+        test_assert(group_pools[i]);
+        uv_thread_create(&threads[i], group_run, group_loops[i]);
+    }
+}
+
+/// @brief the pools must be destroyed first
+static void group_end()
+{
+    for (uint32_t i = 0; i < 2; i++) {
+        kyros_loop_atomic_defer(group_loops[i], group_stop, (void*)(uintptr_t)i);
+        uv_thread_join(&threads[i]);
+        kyros_loop_atomic_unref(group_loops[i]);
+        kyros_loop_run_once(group_loops[i]);
+        kyros_loop_unref(group_loops[i]);
+    }
+    kyros_socket_pool_group_destroy(group);
+    close_server_sockets();
+    kyros_loop_run_once(loop);
+}
+
+static void test_steal()
+{
+    group_start();
+    // pool 0 connects and keeps it idle, pool 1 has none and takes it over
+    kyros_loop_atomic_defer(group_loops[0], steal_start, (void*)0);
+    test_assert(wait_phase(1));
+    kyros_loop_atomic_defer(group_loops[1], steal_start, (void*)1);
+    test_assert(wait_phase(2));
+    kyros_loop_atomic_defer(group_loops[0], steal_stats, (void*)0);
+    kyros_loop_atomic_defer(group_loops[1], steal_stats, (void*)1);
+    test_assert(wait_phase(4));
+    test_assert(!atomic_load(&wrong_loop));
+    test_assert(stats_of[0].given == 1 && stats_of[0].connections == 0 && stats_of[0].idle == 0);
+    test_assert(stats_of[1].stolen == 1 && stats_of[1].connected == 0 && stats_of[1].idle == 1);
+    test_assert(server_count == 1);
+
+    // its own idle connection comes first
+    kyros_loop_atomic_defer(group_loops[1], steal_start, (void*)1);
+    test_assert(wait_phase(5));
+    kyros_loop_atomic_defer(group_loops[1], steal_stats, (void*)1);
+    test_assert(wait_phase(6));
+    test_assert(!atomic_load(&wrong_loop));
+    test_assert(stats_of[1].reused == 1 && stats_of[1].stolen == 1 && stats_of[1].connected == 0);
+
+    for (uint32_t i = 0; i < 2; i++) {
+        kyros_loop_atomic_defer(group_loops[i], steal_destroy, (void*)(uintptr_t)i);
+    }
+    test_assert(wait_phase(8));
+    group_end();
+}
+
+static atomic_bool blocked;
+static kyros_socket_error canceled_error;
+
+// the loop is stuck in a task, like a busy (or stopped) one it answers nothing
+static void steal_block(void* ctx)
+{
+    while (atomic_load(&blocked)) {
+        uv_sleep(1);
+    }
+}
+
+static void canceled_checkout(kyros_socket socket, kyros_socket_error error, void* ctx)
+{
+    if (socket.tagged_ptr) {
+        atomic_store(&wrong_loop, true);
+    }
+    canceled_error = error;
+}
+
+static void steal_start_and_destroy(void* ctx)
+{
+    auto index = (uint32_t)(uintptr_t)ctx;
+    auto client = &steal_clients[index];
+    *client = (pool_client) { .handler = { .ctx = client, .ondata = steal_data, .ref_count = 1 } };
+    canceled_error = (kyros_socket_error) { 0 };
+    kyros_socket_pool_checkout(group_pools[index], pool_source(POOL_PORT), NULL, &client->handler, canceled_checkout, client);
+    kyros_socket_pool_destroy(group_pools[index]);
+    atomic_fetch_add(&phase, 1);
+}
+
+/// @brief run the main loop (the server side) until count connections are left
+static bool wait_server_count(uint32_t count)
+{
+    for (uint32_t i = 0; i < 3000 && server_count != count; i++) {
+        kyros_loop_run_once(loop);
+        uv_sleep(1);
+    }
+    return server_count == count;
+}
+
+static void test_steal_timeout()
+{
+    group_start();
+    kyros_loop_atomic_defer(group_loops[0], steal_start, (void*)0);
+    test_assert(wait_phase(1));
+    // pool 0 has an idle connection but its loop does not answer, pool 1 connects once the steal times out
+    atomic_store(&blocked, true);
+    kyros_loop_atomic_defer(group_loops[0], steal_block, NULL);
+    kyros_loop_atomic_defer(group_loops[1], steal_start, (void*)1);
+    test_assert(wait_phase(2));
+    kyros_loop_atomic_defer(group_loops[1], steal_stats, (void*)1);
+    test_assert(wait_phase(3));
+    test_assert(stats_of[1].connected == 1 && stats_of[1].stolen == 0 && stats_of[1].idle == 1);
+    test_assert(server_count == 2);
+    // the late answer still moves the connection to loop 1, nobody waits for it there and it is closed
+    atomic_store(&blocked, false);
+    test_assert(wait_server_count(1));
+    kyros_loop_atomic_defer(group_loops[0], steal_stats, (void*)0);
+    kyros_loop_atomic_defer(group_loops[1], steal_stats, (void*)1);
+    test_assert(wait_phase(5));
+    test_assert(stats_of[0].given == 1 && stats_of[0].idle == 0);
+    test_assert(stats_of[1].stolen == 0 && stats_of[1].connections == 1 && stats_of[1].idle == 1);
+
+    // a pool destroyed while its steal is on its way fails the checkout right away, the answer comes after the pool is freed
+    atomic_store(&blocked, true);
+    kyros_loop_atomic_defer(group_loops[1], steal_block, NULL);
+    kyros_loop_atomic_defer(group_loops[0], steal_start_and_destroy, (void*)0);
+    test_assert(wait_phase(6));
+    test_assert(canceled_error.code == (uint32_t)-UV_ECANCELED);
+    atomic_store(&blocked, false);
+    test_assert(wait_server_count(0));
+    kyros_loop_atomic_defer(group_loops[1], steal_destroy, (void*)1);
+    test_assert(wait_phase(7));
+    test_assert(!atomic_load(&wrong_loop));
+    group_end();
+}
+
+void test_socket_pool()
+{
+    server_count = 0;
+    loop = kyros_loop_create(NULL);
+    auto listener = kyros_socket_listen(loop, pool_source(POOL_PORT), (kryos_socket_options) { 0 }, &server_handler);
+    auto tls_listener = kyros_socket_listen(loop, pool_source(POOL_TLS_PORT), (kryos_socket_options) { .tls = test_tls_server_context() }, &server_handler);
+    test_reuse();
+    test_max_per_host();
+    test_eviction();
+    test_destroy();
+    test_steal();
+    test_steal_timeout();
+    close_server_sockets();
+    kyros_socket_close(listener);
+    kyros_socket_close(tls_listener);
+    kyros_loop_run_once(loop);
+    kyros_loop_unref(loop);
+}
@@ -0,0 +1,110 @@
+// kyros_socket_write4: file ranges between plain writes over tcp (sendfile), userspace tls and kernel tls when the kernel takes the keys
+#include "test.h"
+#include <kyros.h>
+#include <kyros_internal.h>
+#include <fcntl.h>
+#include <string.h>
+
+#define WRITE4_PORT 39671
+#define FILE_NAME "kyros_test_write4"
+#define FILE_SIZE (3 * 1024 * 1024 + 123)
+
+static kyros_loop* loop;
+static uint64_t range_offset;
+static uint64_t range_length;
+static uint64_t received;
+static uint64_t errors;
+static bool kernel_tls;
+
+static inline char file_byte(uint64_t position)
+{
+    return (char)(position * 7 + position / 4099);
+}
+
+/// @brief byte position of the stream the client should see: HDR: + the range + :END
+static char expected_byte(uint64_t position)
+{
+    if (position < 4) {
+        return "HDR:"[position];
+    }
+    if (position < 4 + range_length) {
+        return file_byte(range_offset + position - 4);
+    }
+    return ":END"[position - 4 - range_length];
+}
+
+static void server_status(kyros_socket socket, kyros_socket_error error, void* ctx)
+{
+    auto state = kyros_socket_get_state(socket);
+    if (state == KYROS_SOCKET_STATE_OPEN || state == KYROS_SOCKET_STATE_SECURE) {
+        kernel_tls = kyros_socket_is_kernel_tls(socket);
+        auto fd = open(FILE_NAME, O_RDONLY);
+        kyros_socket_write(socket, "HDR:", 4, false);
+        // length 0 sends up to the end of the file, false is only backpressure while userspace tls reads the file in pieces
+        auto sent = kyros_socket_write4(socket, fd, range_offset, range_length == FILE_SIZE - range_offset ? 0 : range_length, false);
+        test_assert(sent || kyros_socket_is_writable(socket));
+        // the socket keeps what it needs of the fd
+        close(fd);
+        kyros_socket_write(socket, ":END", 4, true);
+    }
+}
+
+static bool client_data(kyros_socket socket, const char* data, uint64_t length, void* ctx)
+{
+    for (uint64_t i = 0; i < length; i++) {
+        errors += data[i] != expected_byte(received + i);
+    }
+    received += length;
+    return true;
+}
+
+static void client_status(kyros_socket socket, kyros_socket_error error, void* ctx)
+{
+    if (kyros_socket_get_state(socket) == KYROS_SOCKET_STATE_CLOSED) {
+        kyros_loop_stop(loop);
+    }
+}
+
+static void send_range(SSL_CTX* server_tls, SSL_CTX* client_tls, bool use_kernel_tls, uint64_t offset, uint64_t length)
+{
+    range_offset = offset;
+    range_length = length;
+    received = 0;
+    errors = 0;
+    kernel_tls = false;
+    kyros_socket_source source = { .type = KYROS_SOCKET_SOURCE_HOSTPORT, .value.host_port = { .host = "127.0.0.1", .port = WRITE4_PORT } };
+    kyros_socket_handler server = { .onstatus = server_status, .ref_count = 1 };
+    kyros_socket_handler client = { .ondata = client_data, .onstatus = client_status, .ref_count = 1 };
+    auto listener = kyros_socket_listen(loop, source, (kryos_socket_options) { .tls = server_tls, .kernel_tls = use_kernel_tls }, &server);
+    kyros_socket_connect(loop, source, (kryos_socket_options) { .tls = client_tls }, &client);
+    kyros_loop_run_forever(loop);
+    kyros_socket_close(listener);
+    for (uint32_t i = 0; i < 5; i++) {
+        kyros_loop_run_once(loop);
+    }
+    test_assert(received == length + 8);
+    test_assert(errors == 0);
+}
+
+void test_socket_write4()
+{
+    auto file = fopen(FILE_NAME, "wb");
+    for (uint64_t i = 0; i < FILE_SIZE; i++) {
+        fputc(file_byte(i), file);
+    }
+    fclose(file);
+    loop = kyros_loop_create(NULL);
+
+    // sendfile
+    send_range(NULL, NULL, false, 100, FILE_SIZE - 100);
+    send_range(NULL, NULL, false, 5000, 70'000);
+    // read and encrypted in pieces as the socket drains
+    send_range(test_tls_server_context(), test_tls_client_context(), false, 100, FILE_SIZE - 100);
+    send_range(test_tls_server_context(), test_tls_client_context(), false, 5000, 70'000);
+    test_assert(!kernel_tls);
+    // sendfile through kernel tls, the same bytes through the userspace path where the kernel can't
+    send_range(test_tls_server_context(), test_tls_client_context(), true, 100, FILE_SIZE - 100);
+
+    kyros_loop_unref(loop);
+    remove(FILE_NAME);
+}
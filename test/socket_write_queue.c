@@ -0,0 +1,151 @@
+// write queue of a slow reader: watermarks, ondrain, pause_on_backpressure and chunks going back to the loop pool
+#include "test.h"
+#include <kyros.h>
+#include <kyros_internal.h>
+
+#define QUEUE_PORT 39656
+#define HIGH_WATERMARK (256 * 1024)
+#define LOW_WATERMARK (64 * 1024)
+#define PIECE_SIZE (64 * 1024)
+// far more than the kernel takes on loopback
+#define FILL_LIMIT (64 * 1024 * 1024)
+#define TAIL_SIZE (1024 * 1024)
+
+static kyros_loop* loop;
+static char piece[PIECE_SIZE];
+static uint64_t sent;
+static bool write_refused;
+static uint64_t queued_when_refused;
+static uint32_t chunks_when_refused;
+static uint32_t drains;
+static uint64_t server_received;
+static uint64_t server_received_at_drain;
+static uint64_t client_received;
+static uint64_t client_errors;
+static bool server_closed;
+
+static inline char pattern(uint64_t position)
+{
+    return (char)(position * 7 ^ position >> 12);
+}
+
+/// @brief write the next length bytes of the pattern, returns what kyros_socket_write returned for the last piece
+static bool write_pattern(kyros_socket socket, uint64_t length, bool end)
+{
+    bool result = true;
+    while (length) {
+        uint64_t size = length < PIECE_SIZE ? length : PIECE_SIZE;
+        for (uint64_t i = 0; i < size; i++) {
+            piece[i] = pattern(sent + i);
+        }
+        sent += size;
+        length -= size;
+        result = kyros_socket_write(socket, piece, size, end && !length);
+    }
+    return result;
+}
+
+static void server_status(kyros_socket socket, kyros_socket_error error, void* ctx)
+{
+    auto state = kyros_socket_get_state(socket);
+    if (state == KYROS_SOCKET_STATE_OPEN) {
+        // the client does not read, everything past the kernel buffer stays in the queue
+        while (sent < FILL_LIMIT) {
+            if (!write_pattern(socket, PIECE_SIZE, false)) {
+                write_refused = true;
+                break;
+            }
+        }
+        queued_when_refused = kyros_socket_buffer_size(socket);
+        chunks_when_refused = kyros_loop_get_stats(loop).write_chunks_in_use;
+    } else if (state == KYROS_SOCKET_STATE_CLOSED) {
+        server_closed = true;
+        kyros_loop_stop(loop);
+    }
+}
+
+static bool server_data(kyros_socket socket, const char* data, uint64_t length, void* ctx)
+{
+    server_received += length;
+    return true;
+}
+
+static void server_drain(kyros_socket socket, void* ctx)
+{
+    drains++;
+    server_received_at_drain = server_received;
+    test_assert(kyros_socket_buffer_size(socket) <= LOW_WATERMARK);
+    write_pattern(socket, TAIL_SIZE, true);
+}
+
+static bool client_data(kyros_socket socket, const char* data, uint64_t length, void* ctx)
+{
+    for (uint64_t i = 0; i < length; i++) {
+        client_errors += data[i] != pattern(client_received + i);
+    }
+    client_received += length;
+    return true;
+}
+
+static void client_status(kyros_socket socket, kyros_socket_error error, void* ctx)
+{
+    if (kyros_socket_get_state(socket) == KYROS_SOCKET_STATE_OPEN) {
+        // the server reads it once it is back under the low watermark
+        kyros_socket_write(socket, "hi", 2, false);
+    }
+}
+
+static void test_watermarks()
+{
+    sent = 0;
+    write_refused = false;
+    drains = 0;
+    server_received = 0;
+    client_received = 0;
+    client_errors = 0;
+    server_closed = false;
+    kyros_socket_handler server = { .ondata = server_data, .ondrain = server_drain, .onstatus = server_status, .ref_count = 1 };
+    kyros_socket_handler client = { .ondata = client_data, .onstatus = client_status, .ref_count = 1 };
+    auto listener = kyros_socket_listen(loop,
+        (kyros_socket_source) { .type = KYROS_SOCKET_SOURCE_HOSTPORT, .value.host_port = { .host = "127.0.0.1", .port = QUEUE_PORT } },
+        (kryos_socket_options) { .pause_on_backpressure = true, .write_high_watermark = HIGH_WATERMARK, .write_low_watermark = LOW_WATERMARK },
+        &server);
+    auto socket = kyros_socket_connect(loop,
+        (kyros_socket_source) { .type = KYROS_SOCKET_SOURCE_HOSTPORT, .value.host_port = { .host = "127.0.0.1", .port = QUEUE_PORT } },
+        (kryos_socket_options) { .start_paused = true }, &client);
+    while (!write_refused && sent < FILL_LIMIT) {
+        kyros_loop_run_once(loop);
+    }
+    for (uint32_t i = 0; i < 20; i++) {
+        kyros_loop_run_once(loop);
+    }
+    test_assert(write_refused);
+    test_assert(queued_when_refused > HIGH_WATERMARK);
+    // the queue is made of 16 KiB chunks of the loop pool
+    test_assert(chunks_when_refused >= queued_when_refused / KYROS_WRITE_CHUNK_SIZE);
+    test_assert(drains == 0);
+    // over the high watermark the server stopped reading
+    test_assert(server_received == 0);
+
+    kyros_socket_resume(socket);
+    kyros_loop_run_forever(loop);
+    kyros_socket_close(listener);
+    kyros_loop_run_once(loop);
+    test_assert(drains == 1);
+    test_assert(server_received_at_drain == 0);
+    test_assert(server_received == 2);
+    test_assert(server_closed);
+    test_assert(client_received == sent);
+    test_assert(client_errors == 0);
+    // drained chunks wait in the pool for the next slow socket
+    auto stats = kyros_loop_get_stats(loop);
+    test_assert(stats.write_chunks_in_use == 0);
+    test_assert(stats.write_chunks_idle > 0);
+}
+
+void test_socket_write_queue()
+{
+    loop = kyros_loop_create(NULL);
+    test_watermarks();
+    kyros_loop_unref(loop);
+}
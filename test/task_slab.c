@@ -0,0 +1,93 @@
+// kyros_loop_defer tasks come from a slab of the loop: chunks of 64 slots, freed slots are taken again before it grows
+#include "test.h"
+#include <kyros.h>
+#include <kyros_internal.h>
+
+#define TASKS 1000
+
+static uint64_t sequence_errors;
+static uint64_t next_sequence;
+
+static void count_task(void* ctx)
+{
+    (*(uint64_t*)ctx)++;
+}
+
+static void sequence_task(void* ctx)
+{
+    sequence_errors += (uint64_t)ctx != next_sequence;
+    next_sequence++;
+}
+
+static void test_slab_growth_and_reuse()
+{
+    auto loop = kyros_loop_create(NULL);
+    uint64_t count = 0;
+    for (uint32_t i = 0; i < TASKS; i++) {
+        kyros_loop_defer(loop, count_task, &count);
+    }
+    auto stats = kyros_loop_get_stats(loop);
+    test_assert(stats.task_slab_in_use == TASKS);
+    test_assert(stats.task_slab_chunks == (TASKS + TASK_SLAB_CHUNK_SIZE - 1) / TASK_SLAB_CHUNK_SIZE);
+    test_assert(stats.task_slab_capacity == (uint64_t)stats.task_slab_chunks * TASK_SLAB_CHUNK_SIZE);
+    kyros_loop_run_once(loop);
+    test_assert(count == TASKS);
+    stats = kyros_loop_get_stats(loop);
+    test_assert(stats.task_slab_in_use == 0);
+    // the chunks are kept, the next burst of the same size does not grow the slab
+    auto chunks = stats.task_slab_chunks;
+    for (uint32_t i = 0; i < TASKS; i++) {
+        kyros_loop_defer(loop, count_task, &count);
+    }
+    test_assert(kyros_loop_get_stats(loop).task_slab_chunks == chunks);
+    kyros_loop_run_once(loop);
+    test_assert(count == 2 * TASKS);
+    // every loop has its own slab
+    auto other = kyros_loop_create(NULL);
+    test_assert(kyros_loop_get_stats(other).task_slab_chunks == 0);
+    kyros_loop_unref(other);
+    kyros_loop_unref(loop);
+}
+
+static void chain_task(void* ctx)
+{
+    auto left = (uint64_t*)ctx;
+    if (--*left) {
+        kyros_loop_defer(kyros_loop_default(), chain_task, ctx);
+    }
+}
+
+static void test_slab_recycles_running_tasks()
+{
+    // a task that defers the next one while it runs needs two slots at most, one chunk for the whole chain
+    auto loop = kyros_loop_default();
+    uint64_t left = 10'000;
+    kyros_loop_defer(loop, chain_task, &left);
+    kyros_loop_run_forever(loop);
+    test_assert(left == 0);
+    auto stats = kyros_loop_get_stats(loop);
+    test_assert(stats.task_slab_in_use == 0);
+    test_assert(stats.task_slab_chunks == 1);
+}
+
+static void test_fifo_across_chunks()
+{
+    // the slot a task takes has nothing to do with when it runs
+    auto loop = kyros_loop_create(NULL);
+    sequence_errors = 0;
+    next_sequence = 0;
+    for (uint64_t i = 0; i < 3 * TASK_SLAB_CHUNK_SIZE + 5; i++) {
+        kyros_loop_defer(loop, sequence_task, (void*)i);
+    }
+    kyros_loop_run_once(loop);
+    test_assert(next_sequence == 3 * TASK_SLAB_CHUNK_SIZE + 5);
+    test_assert(sequence_errors == 0);
+    kyros_loop_unref(loop);
+}
+
+void test_task_slab()
+{
+    test_slab_growth_and_reuse();
+    test_slab_recycles_running_tasks();
+    test_fifo_across_chunks();
+}
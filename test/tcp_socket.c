@@ -0,0 +1,268 @@
+// plain tcp sockets on uv_poll_t: echo through the loop receive buffer, half open, refused connects, pause, timeouts and interrupted calls
+#include "test.h"
+#include <kyros.h>
+#include <kyros_bsd.h>
+#include <kyros_internal.h>
+#include <string.h>
+
+#define ECHO_PORT 39641
+#define HALF_OPEN_PORT 39642
+#define REFUSED_PORT 39643
+#define PAUSE_PORT 39644
+#define TIMEOUT_PORT 39645
+#define ECHO_SIZE (256 * 1024 + 13)
+
+static kyros_loop* loop;
+
+static kyros_socket_source local(uint16_t port)
+{
+    return (kyros_socket_source) { .type = KYROS_SOCKET_SOURCE_HOSTPORT, .value.host_port = { .host = "127.0.0.1", .port = port } };
+}
+
+static char echo_data[ECHO_SIZE];
+static uint64_t echo_received;
+static uint64_t echo_errors;
+// ondata of both ends must see the same loop buffer
+static const char* server_read_at;
+static const char* client_read_at;
+
+static bool echo_server_data(kyros_socket socket, const char* data, uint64_t length, void* ctx)
+{
+    server_read_at = data;
+    kyros_socket_write(socket, data, length, false);
+    return true;
+}
+
+static bool echo_client_data(kyros_socket socket, const char* data, uint64_t length, void* ctx)
+{
+    client_read_at = data;
+    echo_errors += echo_received + length > ECHO_SIZE || memcmp(data, echo_data + echo_received, length);
+    echo_received += length;
+    if (echo_received >= ECHO_SIZE) {
+        kyros_socket_close(socket);
+        kyros_loop_stop(loop);
+    }
+    return true;
+}
+
+static void echo_client_status(kyros_socket socket, kyros_socket_error error, void* ctx)
+{
+    if (kyros_socket_get_state(socket) == KYROS_SOCKET_STATE_OPEN) {
+        kyros_socket_write(socket, echo_data, ECHO_SIZE, false);
+    }
+}
+
+static void test_echo()
+{
+    echo_received = 0;
+    echo_errors = 0;
+    for (uint32_t i = 0; i < ECHO_SIZE; i++) {
+        echo_data[i] = (char)(i * 7 + i / 251);
+    }
+    kyros_socket_handler server = { .ondata = echo_server_data, .ref_count = 1 };
+    kyros_socket_handler client = { .ondata = echo_client_data, .onstatus = echo_client_status, .ref_count = 1 };
+    auto listener = kyros_socket_listen(loop, local(ECHO_PORT), (kryos_socket_options) { 0 }, &server);
+    test_assert(listener.tagged_ptr);
+    kyros_socket_connect(loop, local(ECHO_PORT), (kryos_socket_options) { 0 }, &client);
+    kyros_loop_run_forever(loop);
+    kyros_socket_close(listener);
+    kyros_loop_run_once(loop);
+    test_assert(echo_received == ECHO_SIZE);
+    test_assert(echo_errors == 0);
+    // no per read allocation, every read lands in the receive buffer of the loop
+    test_assert(server_read_at == kyros_loop_get_recv_buffer(loop));
+    test_assert(client_read_at == kyros_loop_get_recv_buffer(loop));
+}
+
+static char half_open_reply[16];
+static uint32_t half_open_reply_length;
+static bool half_open_server_ended;
+static bool half_open_client_closed;
+
+static bool half_open_server_data(kyros_socket socket, const char* data, uint64_t length, void* ctx)
+{
+    test_assert(length == 4 && !memcmp(data, "ping", 4));
+    return true;
+}
+
+static void half_open_server_status(kyros_socket socket, kyros_socket_error error, void* ctx)
+{
+    if (kyros_socket_get_state(socket) == KYROS_SOCKET_STATE_READABLE_ENDED) {
+        // the peer is done writing, this side can still answer
+        half_open_server_ended = true;
+        test_assert(kyros_socket_is_writable(socket));
+        kyros_socket_write(socket, "pong", 4, true);
+    }
+}
+
+static bool half_open_client_data(kyros_socket socket, const char* data, uint64_t length, void* ctx)
+{
+    if (half_open_reply_length + length <= sizeof(half_open_reply)) {
+        memcpy(half_open_reply + half_open_reply_length, data, length);
+        half_open_reply_length += length;
+    }
+    return true;
+}
+
+static void half_open_client_status(kyros_socket socket, kyros_socket_error error, void* ctx)
+{
+    auto state = kyros_socket_get_state(socket);
+    if (state == KYROS_SOCKET_STATE_OPEN) {
+        kyros_socket_write(socket, "ping", 4, true);
+    } else if (state == KYROS_SOCKET_STATE_CLOSED) {
+        half_open_client_closed = true;
+        kyros_loop_stop(loop);
+    }
+}
+
+static void test_half_open()
+{
+    half_open_reply_length = 0;
+    half_open_server_ended = false;
+    half_open_client_closed = false;
+    kyros_socket_handler server = { .ondata = half_open_server_data, .onstatus = half_open_server_status, .ref_count = 1 };
+    kyros_socket_handler client = { .ondata = half_open_client_data, .onstatus = half_open_client_status, .ref_count = 1 };
+    auto listener = kyros_socket_listen(loop, local(HALF_OPEN_PORT), (kryos_socket_options) { .allow_half_open = true }, &server);
+    kyros_socket_connect(loop, local(HALF_OPEN_PORT), (kryos_socket_options) { 0 }, &client);
+    kyros_loop_run_forever(loop);
+    kyros_socket_close(listener);
+    kyros_loop_run_once(loop);
+    test_assert(half_open_server_ended);
+    test_assert(half_open_reply_length == 4 && !memcmp(half_open_reply, "pong", 4));
+    test_assert(half_open_client_closed);
+}
+
+static kyros_socket_error refused_error;
+static bool refused_closed;
+
+static void refused_status(kyros_socket socket, kyros_socket_error error, void* ctx)
+{
+    if (kyros_socket_get_state(socket) == KYROS_SOCKET_STATE_CLOSED) {
+        refused_closed = true;
+        refused_error = error;
+        kyros_loop_stop(loop);
+    }
+}
+
+static void test_connect_refused()
+{
+    refused_closed = false;
+    kyros_socket_handler client = { .onstatus = refused_status, .ref_count = 1 };
+    auto socket = kyros_socket_connect(loop, local(REFUSED_PORT), (kryos_socket_options) { 0 }, &client);
+    test_assert(kyros_socket_is_connecting(socket));
+    kyros_loop_run_forever(loop);
+    test_assert(refused_closed);
+    test_assert(refused_error.type == KYROS_SOCKET_ERROR_CONNECTING_ERROR);
+}
+
+static kyros_socket paused_server;
+static uint64_t paused_received;
+
+static bool paused_server_data(kyros_socket socket, const char* data, uint64_t length, void* ctx)
+{
+    paused_received += length;
+    if (paused_received == 5) {
+        kyros_loop_stop(loop);
+    }
+    return true;
+}
+
+static void paused_server_status(kyros_socket socket, kyros_socket_error error, void* ctx)
+{
+    if (kyros_socket_get_state(socket) == KYROS_SOCKET_STATE_OPEN) {
+        paused_server = socket;
+    }
+}
+
+static void test_start_paused()
+{
+    paused_server = (kyros_socket) { 0 };
+    paused_received = 0;
+    kyros_socket_handler server = { .ondata = paused_server_data, .onstatus = paused_server_status, .ref_count = 1 };
+    auto listener = kyros_socket_listen(loop, local(PAUSE_PORT), (kryos_socket_options) { .start_paused = true }, &server);
+    auto client = kyros_socket_connect(loop, local(PAUSE_PORT), (kryos_socket_options) { 0 }, NULL);
+    kyros_socket_write(client, "hello", 5, false);
+    for (uint32_t i = 0; i < 100 && !paused_server.tagged_ptr; i++) {
+        kyros_loop_run_once(loop);
+        uv_sleep(1);
+    }
+    test_assert(paused_server.tagged_ptr && kyros_socket_is_paused(paused_server));
+    for (uint32_t i = 0; i < 20; i++) {
+        kyros_loop_run_once(loop);
+    }
+    // the bytes wait in the kernel until it is resumed
+    test_assert(paused_received == 0);
+    kyros_socket_resume(paused_server);
+    kyros_loop_run_forever(loop);
+    test_assert(paused_received == 5);
+    kyros_socket_close(client);
+    kyros_socket_close(listener);
+    kyros_loop_run_once(loop);
+}
+
+static uint32_t timeouts;
+static uint64_t timeout_start;
+static uint64_t timeout_elapsed;
+
+static bool timeout_server_timeout(kyros_socket socket, void* ctx)
+{
+    // the first one keeps the socket, the second one closes it
+    return ++timeouts == 2;
+}
+
+static void timeout_server_status(kyros_socket socket, kyros_socket_error error, void* ctx)
+{
+    auto state = kyros_socket_get_state(socket);
+    if (state == KYROS_SOCKET_STATE_OPEN) {
+        timeout_start = uv_hrtime();
+        kyros_socket_timeout(socket, 50);
+    } else if (state == KYROS_SOCKET_STATE_CLOSED) {
+        timeout_elapsed = uv_hrtime() - timeout_start;
+    }
+}
+
+static void timeout_client_status(kyros_socket socket, kyros_socket_error error, void* ctx)
+{
+    // the server closing it is the end of the test
+    if (kyros_socket_get_state(socket) == KYROS_SOCKET_STATE_CLOSED) {
+        kyros_loop_stop(loop);
+    }
+}
+
+static void test_timeout()
+{
+    timeouts = 0;
+    kyros_socket_handler server = { .ontimeout = timeout_server_timeout, .onstatus = timeout_server_status, .ref_count = 1 };
+    kyros_socket_handler client = { .onstatus = timeout_client_status, .ref_count = 1 };
+    auto listener = kyros_socket_listen(loop, local(TIMEOUT_PORT), (kryos_socket_options) { 0 }, &server);
+    kyros_socket_connect(loop, local(TIMEOUT_PORT), (kryos_socket_options) { 0 }, &client);
+    kyros_loop_run_forever(loop);
+    test_assert(timeouts == 2);
+    test_assert(timeout_elapsed >= 90'000'000);
+    kyros_socket_close(listener);
+    kyros_loop_run_once(loop);
+}
+
+static void test_interrupted()
+{
+    // a signal is not a full buffer, the call is made again instead of waiting for the next poll event
+    test_assert(kyros_bsd_would_block(EAGAIN) && kyros_bsd_would_block(EWOULDBLOCK));
+    test_assert(!kyros_bsd_would_block(EINTR));
+    errno = EINTR;
+    test_assert(kyros_bsd_interrupted(-1));
+    test_assert(!kyros_bsd_interrupted(0));
+    errno = EAGAIN;
+    test_assert(!kyros_bsd_interrupted(-1));
+}
+
+void test_tcp_socket()
+{
+    loop = kyros_loop_create(NULL);
+    test_echo();
+    test_half_open();
+    test_connect_refused();
+    test_start_paused();
+    test_timeout();
+    test_interrupted();
+    kyros_loop_unref(loop);
+}
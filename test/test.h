@@ -0,0 +1,71 @@
+#ifndef KYROS_TEST_H
+#define KYROS_TEST_H
+#include <stdint.h>
+#include <openssl/ssl.h>
+#include <stdio.h>
+
+// failed checks of every suite, main returns non zero if any
+extern uint32_t test_failures;
+
+// reports the failed condition and keeps going with the rest of the suite
+#define test_assert(condition)                                        \
+    do {                                                              \
+        if (!(condition)) {                                           \
+            printf("%s:%d: %s\n", __FILE__, __LINE__, #condition);    \
+            test_failures++;                                          \
+        }                                                             \
+    } while (0)
+
+// async_queue.c
+void test_async_queue();
+// timer_wheel.c
+void test_timer_wheel();
+// task_slab.c
+void test_task_slab();
+// defer_lanes.c
+void test_defer_lanes();
+// tcp_socket.c
+void test_tcp_socket();
+// socket_cork.c
+void test_socket_cork();
+// socket_write_queue.c
+void test_socket_write_queue();
+// tls_socket.c
+void test_tls_socket();
+// self signed server context and a client context that does not verify, for every suite that needs tls
+SSL_CTX* test_tls_server_context();
+SSL_CTX* test_tls_client_context();
+// tls_session_cache.c
+void test_tls_session_cache();
+// socket_write4.c
+void test_socket_write4();
+// socket_pipe.c
+void test_socket_pipe();
+// io_uring.c
+void test_io_uring();
+// server_group.c
+void test_server_group();
+// socket_migrate.c
+void test_socket_migrate();
+// http_parser.c
+void test_http_parser();
+// http2.c
+void test_http2();
+// websocket_utf8.c
+void test_websocket_utf8();
+// websocket_deflate.c
+void test_websocket_deflate();
+// pubsub.c
+void test_pubsub();
+// udp.c
+void test_udp();
+// http_router.c
+void test_http_router();
+// quic.c
+void test_quic();
+// dns.c
+void test_dns();
+// socket_pool.c
+void test_socket_pool();
+
+#endif
@@ -0,0 +1,196 @@
+// timer wheel driven by a fake clock: uv_now is the loop time field, the driver callback is called by hand at its deadline
+#include "test.h"
+#include <kyros.h>
+#include <kyros_internal.h>
+#include <uv.h>
+
+#define MAX_ENTRIES 16
+
+typedef struct {
+    kyros_timer_entry entry;
+    uint64_t deadline; // expected fire time in ms
+    uint64_t fired_at; // 0 if not fired
+    uint32_t fire_count;
+} test_timer;
+
+static uv_loop_t clock_loop;
+static kyros_timer_wheel wheel;
+static uint64_t fire_order[MAX_ENTRIES];
+static uint32_t fired;
+// the first of the two to fire cancels the other one
+static test_timer* cancel_pair[2];
+static test_timer* insert_on_fire;
+static uint64_t insert_timeout;
+
+static void record_callback(kyros_timer_entry* entry)
+{
+    auto timer = kyros_container_of(entry, test_timer, entry);
+    timer->fired_at = uv_now(&clock_loop);
+    timer->fire_count++;
+    if (fired < MAX_ENTRIES) {
+        fire_order[fired] = timer->deadline;
+    }
+    fired++;
+    // callbacks can change other entries of the same tick
+    if (cancel_pair[0] == timer || cancel_pair[1] == timer) {
+        auto other = cancel_pair[0] == timer ? cancel_pair[1] : cancel_pair[0];
+        kyros_timer_wheel_remove(&wheel, &other->entry);
+        cancel_pair[0] = cancel_pair[1] = NULL;
+    }
+    if (insert_on_fire) {
+        insert_on_fire->deadline = uv_now(&clock_loop) + insert_timeout;
+        kyros_timer_wheel_insert(&wheel, &insert_on_fire->entry, insert_timeout);
+        insert_on_fire = NULL;
+    }
+}
+
+static void wheel_start(uint32_t granularity, uint64_t now)
+{
+    uv_loop_init(&clock_loop);
+    clock_loop.time = now;
+    kyros_timer_wheel_init(&wheel, &clock_loop, granularity);
+    fired = 0;
+    cancel_pair[0] = cancel_pair[1] = NULL;
+    insert_on_fire = NULL;
+}
+
+static void wheel_stop()
+{
+    kyros_timer_wheel_deinit(&wheel);
+    uv_run(&clock_loop, UV_RUN_NOWAIT);
+    uv_loop_close(&clock_loop);
+}
+
+static void timer_insert(test_timer* timer, uint64_t timeout)
+{
+    *timer = (test_timer) { .entry = { .callback = record_callback }, .deadline = uv_now(&clock_loop) + timeout };
+    kyros_timer_wheel_insert(&wheel, &timer->entry, timeout);
+}
+
+/// @brief move the clock to the driver deadline and fire it, false once the wheel is empty
+static bool wheel_step()
+{
+    // the driver is not stopped when the wheel empties, it only wakes up for nothing
+    if (!wheel.count || !uv_is_active((uv_handle_t*)&wheel.driver)) {
+        return false;
+    }
+    clock_loop.time += uv_timer_get_due_in(&wheel.driver);
+    wheel.driver.timer_cb(&wheel.driver);
+    return true;
+}
+
+/// @brief the clock jumps to time (a late wakeup) and the driver runs once
+static void wheel_jump(uint64_t time)
+{
+    clock_loop.time = time;
+    wheel.driver.timer_cb(&wheel.driver);
+}
+
+static void test_fire_on_time()
+{
+    wheel_start(1, 1000);
+    // every level, the level boundaries and past the range of the last one (64^4 ticks)
+    const uint64_t timeouts[] = { 1, 5, 63, 64, 65, 4095, 4096, 4097, 262143, 262144, 300000, 16777215, 20000000 };
+    const uint32_t count = sizeof(timeouts) / sizeof(timeouts[0]);
+    test_timer timers[sizeof(timeouts) / sizeof(timeouts[0])];
+    // inserted from the longest, the order of the inserts must not matter
+    for (uint32_t i = count; i-- > 0;) {
+        timer_insert(&timers[i], timeouts[i]);
+    }
+    test_assert(wheel.count == count);
+    while (wheel_step()) {
+    }
+    test_assert(fired == count);
+    test_assert(wheel.count == 0);
+    for (uint32_t i = 0; i < count; i++) {
+        test_assert(timers[i].fire_count == 1);
+        test_assert(timers[i].fired_at == timers[i].deadline);
+        test_assert(fire_order[i] == timers[i].deadline);
+    }
+    wheel_stop();
+}
+
+static void test_remove_and_rearm()
+{
+    wheel_start(1, 0);
+    test_timer removed, moved, kept;
+    timer_insert(&removed, 10);
+    timer_insert(&moved, 20);
+    timer_insert(&kept, 30);
+    kyros_timer_wheel_remove(&wheel, &removed.entry);
+    test_assert(!kyros_timer_entry_is_armed(&removed.entry));
+    // removing twice is a no-op
+    kyros_timer_wheel_remove(&wheel, &removed.entry);
+    // re-arm relinks, the entry fires once at its new deadline
+    kyros_timer_wheel_insert(&wheel, &moved.entry, 5000);
+    moved.deadline = 5000;
+    test_assert(wheel.count == 2);
+    while (wheel_step()) {
+    }
+    test_assert(removed.fire_count == 0);
+    test_assert(kept.fire_count == 1 && kept.fired_at == 30);
+    test_assert(moved.fire_count == 1 && moved.fired_at == 5000);
+    test_assert(fire_order[0] == 30 && fire_order[1] == 5000);
+    wheel_stop();
+}
+
+static void test_callback_changes_the_wheel()
+{
+    wheel_start(1, 0);
+    test_timer first, second, inserted;
+    timer_insert(&first, 100);
+    timer_insert(&second, 100);
+    // the entry that fires first cancels the other one of the same tick and arms a new one
+    cancel_pair[0] = &first;
+    cancel_pair[1] = &second;
+    insert_on_fire = &inserted;
+    insert_timeout = 70;
+    inserted = (test_timer) { .entry = { .callback = record_callback } };
+    while (wheel_step()) {
+    }
+    test_assert(first.fire_count + second.fire_count == 1);
+    test_assert(inserted.fire_count == 1 && inserted.fired_at == 170);
+    test_assert(wheel.count == 0);
+    wheel_stop();
+}
+
+static void test_late_wakeup()
+{
+    wheel_start(1, 0);
+    test_timer timers[4];
+    const uint64_t timeouts[] = { 3, 70, 5000, 9000 };
+    for (uint32_t i = 0; i < 4; i++) {
+        timer_insert(&timers[i], timeouts[i]);
+    }
+    // the loop was blocked, everything due fires in deadline order on the next run
+    wheel_jump(6000);
+    test_assert(fired == 3);
+    test_assert(fire_order[0] == 3 && fire_order[1] == 70 && fire_order[2] == 5000);
+    test_assert(timers[3].fire_count == 0);
+    while (wheel_step()) {
+    }
+    test_assert(timers[3].fired_at == 9000);
+    wheel_stop();
+}
+
+static void test_granularity()
+{
+    wheel_start(10, 1003);
+    test_timer timer;
+    timer_insert(&timer, 15);
+    while (wheel_step()) {
+    }
+    // rounded up to the next tick, never early
+    test_assert(timer.fire_count == 1);
+    test_assert(timer.fired_at == 1020);
+    wheel_stop();
+}
+
+void test_timer_wheel()
+{
+    test_fire_on_time();
+    test_remove_and_rearm();
+    test_callback_changes_the_wheel();
+    test_late_wakeup();
+    test_granularity();
+}
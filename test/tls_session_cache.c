@@ -0,0 +1,199 @@
+// tls session resumption: tickets across key rotations, session ids until they expire, and the sharded table itself
+#include "test.h"
+#include <kyros.h>
+#include <kyros_internal.h>
+#include <string.h>
+
+#define TICKET_PORT 39666
+#define SESSION_ID_PORT 39667
+// slots of a cache created with max_sessions 1, the probe window of every shard
+#define SMALL_CACHE_SLOTS (KYROS_TLS_CACHE_SHARDS * KYROS_TLS_CACHE_PROBES)
+
+static kyros_loop* loop;
+static bool reused;
+static SSL_SESSION* last_session;
+
+static bool client_data(kyros_socket socket, const char* data, uint64_t length, void* ctx)
+{
+    // the tickets came before the data, the session is complete
+    auto ssl = kyros_socket_get_ssl(socket);
+    reused = SSL_session_reused(ssl);
+    if (last_session) {
+        SSL_SESSION_free(last_session);
+    }
+    last_session = SSL_get1_session(ssl);
+    // OpenSSL does not resume the session of a connection cut short, end it with close_notify
+    kyros_socket_write(socket, NULL, 0, true);
+    return true;
+}
+
+static void client_status(kyros_socket socket, kyros_socket_error error, void* ctx)
+{
+    if (kyros_socket_get_state(socket) == KYROS_SOCKET_STATE_CLOSED) {
+        kyros_loop_stop(loop);
+    }
+}
+
+static void server_status(kyros_socket socket, kyros_socket_error error, void* ctx)
+{
+    auto state = kyros_socket_get_state(socket);
+    if (state == KYROS_SOCKET_STATE_SECURE) {
+        kyros_socket_write(socket, "x", 1, false);
+    } else if (state == KYROS_SOCKET_STATE_READABLE_ENDED) {
+        // both sides end with close_notify
+        kyros_socket_write(socket, NULL, 0, true);
+    }
+}
+
+/// @brief one connection to port, returns if the session was resumed
+static bool handshake(uint16_t port, SSL_CTX* client_tls)
+{
+    reused = false;
+    kyros_socket_handler client = { .ondata = client_data, .onstatus = client_status, .ref_count = 1 };
+    kyros_socket_connect(loop,
+        (kyros_socket_source) { .type = KYROS_SOCKET_SOURCE_HOSTPORT, .value.host_port = { .host = "127.0.0.1", .port = port } },
+        (kryos_socket_options) { .tls = client_tls }, &client);
+    kyros_loop_run_forever(loop);
+    return reused;
+}
+
+/// @brief a server context of its own with the certificate of the shared one
+static SSL_CTX* server_context()
+{
+    auto ctx = SSL_CTX_new(TLS_method());
+    SSL_CTX_use_certificate(ctx, SSL_CTX_get0_certificate(test_tls_server_context()));
+    SSL_CTX_use_PrivateKey(ctx, SSL_CTX_get0_privatekey(test_tls_server_context()));
+    return ctx;
+}
+
+static void test_ticket_rotation()
+{
+    auto server_cache = kyros_tls_session_cache_create((kyros_tls_session_cache_options) { 0 });
+    auto client_cache = kyros_tls_session_cache_create((kyros_tls_session_cache_options) { 0 });
+    auto server_tls = server_context();
+    auto client_tls = SSL_CTX_new(TLS_method());
+    kyros_tls_session_cache_attach_server(server_cache, server_tls, loop);
+    kyros_tls_session_cache_attach_client(client_cache, client_tls);
+    kyros_socket_handler server = { .onstatus = server_status, .ref_count = 1 };
+    auto listener = kyros_socket_listen(loop,
+        (kyros_socket_source) { .type = KYROS_SOCKET_SOURCE_HOSTPORT, .value.host_port = { .host = "127.0.0.1", .port = TICKET_PORT } },
+        (kryos_socket_options) { .tls = server_tls, .allow_half_open = true }, &server);
+
+    test_assert(!handshake(TICKET_PORT, client_tls));
+    test_assert(kyros_tls_session_cache_get_stats(client_cache).stored > 0);
+    // the client finds the session of 127.0.0.1:port
+    test_assert(handshake(TICKET_PORT, client_tls));
+    // a ticket of the previous key is still good
+    kyros_tls_session_cache_rotate_ticket_keys(server_cache);
+    test_assert(handshake(TICKET_PORT, client_tls));
+    // two rotations later it is unknown
+    kyros_tls_session_cache_rotate_ticket_keys(server_cache);
+    kyros_tls_session_cache_rotate_ticket_keys(server_cache);
+    test_assert(!handshake(TICKET_PORT, client_tls));
+    test_assert(kyros_tls_session_cache_get_stats(server_cache).ticket_key_rotations == 3);
+    test_assert(kyros_tls_session_cache_get_stats(client_cache).hits >= 3);
+
+    kyros_socket_close(listener);
+    kyros_loop_run_once(loop);
+    SSL_CTX_free(server_tls);
+    SSL_CTX_free(client_tls);
+    kyros_tls_session_cache_destroy(server_cache);
+    kyros_tls_session_cache_destroy(client_cache);
+}
+
+static void test_session_id_expiry()
+{
+    // TLS 1.2 without tickets, the server resumes from its own table
+    // (expiry is in whole seconds, with 2 the second handshake can't fall past it)
+    auto server_cache = kyros_tls_session_cache_create((kyros_tls_session_cache_options) { .session_timeout = 2 });
+    auto client_cache = kyros_tls_session_cache_create((kyros_tls_session_cache_options) { 0 });
+    auto server_tls = server_context();
+    SSL_CTX_set_max_proto_version(server_tls, TLS1_2_VERSION);
+    SSL_CTX_set_options(server_tls, SSL_OP_NO_TICKET);
+    auto client_tls = SSL_CTX_new(TLS_method());
+    kyros_tls_session_cache_attach_server(server_cache, server_tls, loop);
+    kyros_tls_session_cache_attach_client(client_cache, client_tls);
+    kyros_socket_handler server = { .onstatus = server_status, .ref_count = 1 };
+    auto listener = kyros_socket_listen(loop,
+        (kyros_socket_source) { .type = KYROS_SOCKET_SOURCE_HOSTPORT, .value.host_port = { .host = "127.0.0.1", .port = SESSION_ID_PORT } },
+        (kryos_socket_options) { .tls = server_tls, .allow_half_open = true }, &server);
+
+    test_assert(!handshake(SESSION_ID_PORT, client_tls));
+    auto stats = kyros_tls_session_cache_get_stats(server_cache);
+    test_assert(stats.stored == 1);
+    test_assert(handshake(SESSION_ID_PORT, client_tls));
+    test_assert(kyros_tls_session_cache_get_stats(server_cache).hits == 1);
+    // past the session timeout the id is a miss and the handshake a full one
+    uv_sleep(3100);
+    test_assert(!handshake(SESSION_ID_PORT, client_tls));
+    test_assert(kyros_tls_session_cache_get_stats(server_cache).misses >= 1);
+
+    kyros_socket_close(listener);
+    kyros_loop_run_once(loop);
+    SSL_CTX_free(server_tls);
+    SSL_CTX_free(client_tls);
+    kyros_tls_session_cache_destroy(server_cache);
+    kyros_tls_session_cache_destroy(client_cache);
+}
+
+static void session_id(uint8_t id[32], uint32_t value)
+{
+    memset(id, 0, 32);
+    memcpy(id, &value, sizeof(value));
+}
+
+static void test_table_eviction()
+{
+    // the smallest table: one probe window per shard
+    auto cache = kyros_tls_session_cache_create((kyros_tls_session_cache_options) { .max_sessions = 1 });
+    auto tls = SSL_CTX_new(TLS_method());
+    kyros_tls_session_cache_attach_server(cache, tls, NULL);
+    auto ssl = SSL_new(tls);
+    auto store = SSL_CTX_sess_get_new_cb(tls);
+    auto get = SSL_CTX_sess_get_get_cb(tls);
+    uint8_t id[32];
+    // the table copies the id, one session object can stand for all of them
+    for (uint32_t i = 0; i < 4 * SMALL_CACHE_SLOTS; i++) {
+        session_id(id, i);
+        SSL_SESSION_set1_id(last_session, id, sizeof(id));
+        SSL_SESSION_up_ref(last_session);
+        test_assert(store(ssl, last_session));
+        // just stored, always found
+        int copy;
+        auto found = get(ssl, id, sizeof(id), &copy);
+        test_assert(found == last_session);
+        SSL_SESSION_free(found);
+    }
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < 4 * SMALL_CACHE_SLOTS; i++) {
+        session_id(id, i);
+        int copy;
+        auto found = get(ssl, id, sizeof(id), &copy);
+        if (found) {
+            kept++;
+            SSL_SESSION_free(found);
+        }
+    }
+    // full shards evict, they don't grow
+    test_assert(kept > 0 && kept <= SMALL_CACHE_SLOTS);
+    auto stats = kyros_tls_session_cache_get_stats(cache);
+    test_assert(stats.stored == 4 * SMALL_CACHE_SLOTS);
+    test_assert(stats.evicted >= 3 * SMALL_CACHE_SLOTS);
+    test_assert(stats.hits == 4 * SMALL_CACHE_SLOTS + kept);
+    SSL_free(ssl);
+    SSL_CTX_free(tls);
+    kyros_tls_session_cache_destroy(cache);
+}
+
+void test_tls_session_cache()
+{
+    loop = kyros_loop_create(NULL);
+    test_ticket_rotation();
+    test_session_id_expiry();
+    if (last_session) {
+        test_table_eviction();
+        SSL_SESSION_free(last_session);
+        last_session = NULL;
+    }
+    kyros_loop_unref(loop);
+}
@@ -0,0 +1,180 @@
+// tls sockets on the custom BIO: echo through the loop read buffers, close_notify and handshake failures
+#include "test.h"
+#include <kyros.h>
+#include <kyros_internal.h>
+#include <openssl/ec.h>
+#include <openssl/x509.h>
+#include <string.h>
+
+#define ECHO_PORT 39661
+#define VERIFY_PORT 39662
+#define ECHO_SIZE (1024 * 1024 + 29)
+
+static SSL_CTX* server_context;
+static SSL_CTX* client_context;
+
+SSL_CTX* test_tls_server_context()
+{
+    if (server_context) {
+        return server_context;
+    }
+    // self signed P-256 certificate made once for every suite
+    auto ec = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
+    EC_KEY_generate_key(ec);
+    auto key = EVP_PKEY_new();
+    EVP_PKEY_assign_EC_KEY(key, ec);
+    auto certificate = X509_new();
+    X509_set_version(certificate, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(certificate), 1);
+    X509_gmtime_adj(X509_getm_notBefore(certificate), 0);
+    X509_gmtime_adj(X509_getm_notAfter(certificate), 3600);
+    X509_set_pubkey(certificate, key);
+    X509_sign(certificate, key, EVP_sha256());
+    server_context = SSL_CTX_new(TLS_method());
+    SSL_CTX_use_certificate(server_context, certificate);
+    SSL_CTX_use_PrivateKey(server_context, key);
+    X509_free(certificate);
+    EVP_PKEY_free(key);
+    return server_context;
+}
+
+SSL_CTX* test_tls_client_context()
+{
+    if (!client_context) {
+        // no verification, the certificate is self signed
+        client_context = SSL_CTX_new(TLS_method());
+    }
+    return client_context;
+}
+
+static kyros_loop* loop;
+
+static kyros_socket_source local(uint16_t port)
+{
+    return (kyros_socket_source) { .type = KYROS_SOCKET_SOURCE_HOSTPORT, .value.host_port = { .host = "127.0.0.1", .port = port } };
+}
+
+static char echo_data[ECHO_SIZE];
+static uint64_t echo_received;
+static uint64_t echo_errors;
+static const char* server_read_at;
+static const char* client_read_at;
+static bool server_secure;
+static bool release_buffers;
+static bool server_ended;
+static bool client_closed;
+
+static bool echo_server_data(kyros_socket socket, const char* data, uint64_t length, void* ctx)
+{
+    server_read_at = data;
+    kyros_socket_write(socket, data, length, false);
+    return true;
+}
+
+static void echo_server_status(kyros_socket socket, kyros_socket_error error, void* ctx)
+{
+    auto state = kyros_socket_get_state(socket);
+    if (state == KYROS_SOCKET_STATE_SECURE) {
+        server_secure = kyros_socket_is_secure(socket);
+        release_buffers = SSL_get_mode(kyros_socket_get_ssl(socket)) & SSL_MODE_RELEASE_BUFFERS;
+    } else if (state == KYROS_SOCKET_STATE_READABLE_ENDED) {
+        // close_notify of the client, answered with ours
+        server_ended = true;
+        kyros_socket_write(socket, NULL, 0, true);
+    }
+}
+
+static bool echo_client_data(kyros_socket socket, const char* data, uint64_t length, void* ctx)
+{
+    client_read_at = data;
+    echo_errors += echo_received + length > ECHO_SIZE || memcmp(data, echo_data + echo_received, length);
+    echo_received += length;
+    if (echo_received == ECHO_SIZE) {
+        kyros_socket_write(socket, NULL, 0, true);
+    }
+    return true;
+}
+
+static void echo_client_status(kyros_socket socket, kyros_socket_error error, void* ctx)
+{
+    auto state = kyros_socket_get_state(socket);
+    if (state == KYROS_SOCKET_STATE_SECURE) {
+        kyros_socket_write(socket, echo_data, ECHO_SIZE, false);
+    } else if (state == KYROS_SOCKET_STATE_CLOSED) {
+        client_closed = true;
+        kyros_loop_stop(loop);
+    }
+}
+
+static void test_echo()
+{
+    echo_received = 0;
+    echo_errors = 0;
+    server_secure = false;
+    release_buffers = false;
+    server_ended = false;
+    client_closed = false;
+    for (uint32_t i = 0; i < ECHO_SIZE; i++) {
+        echo_data[i] = (char)(i * 31 + i / 509);
+    }
+    kyros_socket_handler server = { .ondata = echo_server_data, .onstatus = echo_server_status, .ref_count = 1 };
+    kyros_socket_handler client = { .ondata = echo_client_data, .onstatus = echo_client_status, .ref_count = 1 };
+    auto listener = kyros_socket_listen(loop, local(ECHO_PORT), (kryos_socket_options) { .tls = test_tls_server_context(), .allow_half_open = true }, &server);
+    test_assert(listener.tagged_ptr);
+    auto socket = kyros_socket_connect(loop, local(ECHO_PORT), (kryos_socket_options) { .tls = test_tls_client_context() }, &client);
+    test_assert(kyros_socket_get_ctx(socket) == test_tls_client_context());
+    kyros_loop_run_forever(loop);
+    kyros_socket_close(listener);
+    kyros_loop_run_once(loop);
+    test_assert(server_secure);
+    test_assert(release_buffers);
+    test_assert(echo_received == ECHO_SIZE);
+    test_assert(echo_errors == 0);
+    test_assert(server_ended);
+    test_assert(client_closed);
+    // plaintext is decrypted into the buffer the loop shares with every tls socket
+    test_assert(server_read_at == kyros_loop_get_ssl_read_buffer(loop));
+    test_assert(client_read_at == kyros_loop_get_ssl_read_buffer(loop));
+}
+
+static kyros_socket_error verify_error;
+static bool verify_secure;
+
+static void verify_client_status(kyros_socket socket, kyros_socket_error error, void* ctx)
+{
+    auto state = kyros_socket_get_state(socket);
+    if (state == KYROS_SOCKET_STATE_SECURE) {
+        verify_secure = true;
+    } else if (state == KYROS_SOCKET_STATE_CLOSED) {
+        verify_error = error;
+        kyros_loop_stop(loop);
+    }
+}
+
+static void test_handshake_failure()
+{
+    verify_error = (kyros_socket_error) { 0 };
+    verify_secure = false;
+    // a client that verifies the chain refuses the self signed certificate
+    auto verifying = SSL_CTX_new(TLS_method());
+    SSL_CTX_set_verify(verifying, SSL_VERIFY_PEER, NULL);
+    kyros_socket_handler client = { .onstatus = verify_client_status, .ref_count = 1 };
+    auto listener = kyros_socket_listen(loop, local(VERIFY_PORT), (kryos_socket_options) { .tls = test_tls_server_context() }, NULL);
+    kyros_socket_connect(loop, local(VERIFY_PORT), (kryos_socket_options) { .tls = verifying }, &client);
+    kyros_loop_run_forever(loop);
+    kyros_socket_close(listener);
+    for (uint32_t i = 0; i < 5; i++) {
+        kyros_loop_run_once(loop);
+    }
+    test_assert(!verify_secure);
+    test_assert(verify_error.type == KYROS_SOCKET_ERROR_TLS_ERROR);
+    SSL_CTX_free(verifying);
+}
+
+void test_tls_socket()
+{
+    loop = kyros_loop_create(NULL);
+    test_echo();
+    test_handshake_failure();
+    kyros_loop_unref(loop);
+}
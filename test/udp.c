@@ -0,0 +1,135 @@
+// udp sockets: a bound socket answers every peer with kyros_socket_send_datagram, a connected one writes, runs of equal datagrams come back split
+#include "test.h"
+#include <kyros.h>
+#include <kyros_internal.h>
+#include <string.h>
+
+#define UDP_PORT 39700
+#define RUN_COUNT 64
+#define RUN_SIZE 1000
+#define TOTAL_COUNT (RUN_COUNT + 3)
+
+static kyros_loop* loop;
+static uint32_t server_batches;
+static uint32_t largest_batch;
+static uint32_t echoed;
+static uint32_t received;
+static uint32_t mismatches;
+static bool seen[TOTAL_COUNT];
+
+/// @brief the equal run first, then a few odd sizes so the batch is not one GSO send
+static uint32_t datagram_size(uint32_t index)
+{
+    static const uint32_t odd_sizes[] = { 4, 3000, 17 };
+    return index < RUN_COUNT ? RUN_SIZE : odd_sizes[index - RUN_COUNT];
+}
+
+static void fill_datagram(char* data, uint32_t index)
+{
+    memcpy(data, &index, sizeof(index));
+    for (uint32_t i = sizeof(index); i < datagram_size(index); i++) {
+        data[i] = (char)(index * 7 + i);
+    }
+}
+
+static void server_datagrams(kyros_socket socket, const kyros_udp_datagram* datagrams, uint32_t count, void* ctx)
+{
+    server_batches++;
+    if (count > largest_batch) {
+        largest_batch = count;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        echoed += kyros_socket_send_datagram(socket, datagrams[i].data, datagrams[i].length, datagrams[i].peer);
+    }
+}
+
+static void client_datagrams(kyros_socket socket, const kyros_udp_datagram* datagrams, uint32_t count, void* ctx)
+{
+    char expected[3000];
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t index;
+        if (datagrams[i].length < sizeof(index)) {
+            mismatches++;
+            continue;
+        }
+        memcpy(&index, datagrams[i].data, sizeof(index));
+        if (index >= TOTAL_COUNT || seen[index] || datagrams[i].length != datagram_size(index)) {
+            mismatches++;
+            continue;
+        }
+        fill_datagram(expected, index);
+        mismatches += memcmp(datagrams[i].data, expected, datagrams[i].length) != 0;
+        seen[index] = true;
+        received++;
+    }
+    if (received == TOTAL_COUNT) {
+        kyros_loop_stop(loop);
+    }
+}
+
+static void stop_loop(void* ctx)
+{
+    kyros_loop_stop(loop);
+}
+
+static void test_echo()
+{
+    kyros_socket_source source = { .type = KYROS_SOCKET_SOURCE_HOSTPORT, .value.host_port = { .host = "127.0.0.1", .port = UDP_PORT, .use_udp = true } };
+    kyros_socket_handler server_handler = { .ondatagrams = server_datagrams, .ref_count = 1 };
+    kyros_socket_handler client_handler = { .ondatagrams = client_datagrams, .ref_count = 1 };
+    auto server = kyros_socket_listen(loop, source, (kryos_socket_options) { 0 }, &server_handler);
+    test_assert(server.tagged_ptr);
+    auto client = kyros_socket_connect(loop, source, (kryos_socket_options) { 0 }, &client_handler);
+    // one iteration of writes, they leave together in the after IO hook
+    char data[3000];
+    for (uint32_t i = 0; i < TOTAL_COUNT; i++) {
+        fill_datagram(data, i);
+        test_assert(kyros_socket_write(client, data, datagram_size(i), false));
+    }
+    // loopback does not drop this little, the timer only keeps a lost datagram from hanging the suite
+    auto timeout = kyros_loop_timer(loop, stop_loop, NULL, 5000, 0, true);
+    kyros_loop_run_forever(loop);
+    kyros_timer_unref(timeout);
+    test_assert(received == TOTAL_COUNT);
+    test_assert(echoed == TOTAL_COUNT);
+    test_assert(mismatches == 0);
+    // recvmmsg (or a GRO message split again) hands more than one datagram per call
+    test_assert(largest_batch > 1);
+    test_assert(server_batches < TOTAL_COUNT);
+
+    // a bound socket needs a peer, and nothing goes past the largest udp payload
+    test_assert(!kyros_socket_send_datagram(server, "x", 1, NULL));
+    static char too_big[KYROS_UDP_MAX_DATAGRAM + 1];
+    test_assert(!kyros_socket_send_datagram(client, too_big, sizeof(too_big), NULL));
+    kyros_socket_ref(client);
+    kyros_socket_close(client);
+    test_assert(!kyros_socket_send_datagram(client, "x", 1, NULL));
+    test_assert(!kyros_socket_write(client, "x", 1, false));
+    kyros_socket_unref(client);
+    kyros_socket_close(server);
+    kyros_loop_run_once(loop);
+}
+
+static void test_not_udp()
+{
+    kyros_socket_source source = { .type = KYROS_SOCKET_SOURCE_HOSTPORT, .value.host_port = { .host = "127.0.0.1", .port = UDP_PORT } };
+    auto listener = kyros_socket_listen(loop, source, (kryos_socket_options) { 0 }, NULL);
+    // datagrams are for udp sockets only
+    test_assert(!kyros_socket_send_datagram(listener, "x", 1, NULL));
+    kyros_socket_close(listener);
+    kyros_loop_run_once(loop);
+}
+
+void test_udp()
+{
+    server_batches = 0;
+    largest_batch = 0;
+    echoed = 0;
+    received = 0;
+    mismatches = 0;
+    memset(seen, 0, sizeof(seen));
+    loop = kyros_loop_create(NULL);
+    test_echo();
+    test_not_udp();
+    kyros_loop_unref(loop);
+}
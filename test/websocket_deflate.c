@@ -0,0 +1,224 @@
+// permessage-deflate: the shared and dedicated streams round trip, and websockets echo through both modes and without compression
+#include "test.h"
+#include <kyros.h>
+#include <kyros_internal.h>
+#include <string.h>
+
+#define DEFLATE_PORT 39697
+#define TEXT_SIZE (200 * 1024 + 17)
+#define BINARY_SIZE (100 * 1024 + 5)
+
+static kyros_loop* loop;
+static char text[TEXT_SIZE];
+static char binary[BINARY_SIZE];
+
+static void fill_messages()
+{
+    // repetitive text that compresses well and bytes that do not
+    static const char words[] = "the quick brown fox jumps over the lazy dog ";
+    for (uint32_t i = 0; i < TEXT_SIZE; i++) {
+        text[i] = words[(i + i / 997) % (sizeof(words) - 1)];
+    }
+    uint64_t state = 0x9e3779b97f4a7c15;
+    for (uint32_t i = 0; i < BINARY_SIZE; i++) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        binary[i] = (char)state;
+    }
+}
+
+/// @brief a websocket with only what the deflate functions look at
+static kyros_websocket* stub_websocket(bool takeover)
+{
+    auto websocket = (kyros_websocket*)kyros_calloc(1, sizeof(kyros_websocket));
+    websocket->loop = loop;
+    websocket->options.max_message_size = 16 * 1024 * 1024;
+    websocket->compression = true;
+    websocket->deflate_takeover = takeover;
+    websocket->inflate_takeover = takeover;
+    return websocket;
+}
+
+static void free_stub(kyros_websocket* websocket)
+{
+    kyros_websocket_deflate_release(websocket);
+    kyros_free(websocket);
+}
+
+/// @brief compressed size of data sent by sender, checked by inflating it in receiver
+static uint64_t round_trip(kyros_websocket* sender, kyros_websocket* receiver, const char* data, uint64_t length)
+{
+    auto pool = &kyros_get_internal_loop(loop)->buffer_pool;
+    uint64_t compressed_length;
+    uint64_t compressed_capacity;
+    // the frame header goes in front of the compressed bytes
+    auto compressed = kyros_websocket_deflate(sender, data, length, 14, &compressed_length, &compressed_capacity);
+    uint64_t inflated_length;
+    uint64_t inflated_capacity;
+    bool too_big;
+    auto inflated = kyros_websocket_inflate(receiver, compressed + 14, compressed_length, &inflated_length, &inflated_capacity, &too_big);
+    test_assert(inflated && !too_big);
+    test_assert(inflated_length == length && !memcmp(inflated, data, length));
+    kyros_buffer_pool_release(pool, inflated, inflated_capacity);
+    kyros_buffer_pool_release(pool, compressed, compressed_capacity);
+    return compressed_length;
+}
+
+static void test_streams()
+{
+    auto sender = stub_websocket(false);
+    auto receiver = stub_websocket(false);
+    auto text_size = round_trip(sender, receiver, text, TEXT_SIZE);
+    test_assert(text_size < TEXT_SIZE / 10);
+    // random bytes grow a little, they still round trip
+    test_assert(round_trip(sender, receiver, binary, BINARY_SIZE) >= BINARY_SIZE);
+    test_assert(round_trip(sender, receiver, "x", 1) > 0);
+    // without context takeover every message starts from nothing
+    test_assert(round_trip(sender, receiver, text, 4096) == round_trip(sender, receiver, text, 4096));
+    // the shared streams are per loop, the stubs never took dedicated ones
+    test_assert(!sender->deflater && !receiver->inflater);
+    free_stub(sender);
+    free_stub(receiver);
+
+    // a sliding window across messages, the second copy points back into the first
+    sender = stub_websocket(true);
+    receiver = stub_websocket(true);
+    auto first = round_trip(sender, receiver, binary, 8192);
+    auto second = round_trip(sender, receiver, binary, 8192);
+    test_assert(second < first / 10);
+    test_assert(sender->deflater && receiver->inflater);
+    free_stub(sender);
+    free_stub(receiver);
+}
+
+static void test_inflate_errors()
+{
+    auto pool = &kyros_get_internal_loop(loop)->buffer_pool;
+    auto websocket = stub_websocket(false);
+    uint64_t length;
+    uint64_t capacity;
+    bool too_big;
+    // a reserved block type
+    test_assert(!kyros_websocket_inflate(websocket, "\xff\xff\xff\xff", 4, &length, &capacity, &too_big));
+    test_assert(!too_big);
+    // past max_message_size
+    websocket->options.max_message_size = 1024;
+    uint64_t compressed_length;
+    uint64_t compressed_capacity;
+    auto compressed = kyros_websocket_deflate(websocket, text, TEXT_SIZE, 0, &compressed_length, &compressed_capacity);
+    test_assert(!kyros_websocket_inflate(websocket, compressed, compressed_length, &length, &capacity, &too_big));
+    test_assert(too_big);
+    kyros_buffer_pool_release(pool, compressed, compressed_capacity);
+    free_stub(websocket);
+}
+
+static kyros_websocket_compression server_mode;
+static kyros_websocket_compression client_mode;
+static bool server_compression;
+static bool client_compression;
+static uint32_t echoed;
+static uint32_t mismatches;
+
+static const struct {
+    const char* data;
+    uint64_t length;
+    kyros_websocket_opcode opcode;
+} messages[] = {
+    { text, TEXT_SIZE, KYROS_WEBSOCKET_TEXT },
+    { binary, BINARY_SIZE, KYROS_WEBSOCKET_BINARY },
+    // below KYROS_WEBSOCKET_DEFLATE_MIN_SIZE, sent as it is
+    { "small", 5, KYROS_WEBSOCKET_TEXT },
+    { "", 0, KYROS_WEBSOCKET_BINARY },
+    // the same again, with a dedicated window it is a few back references
+    { text, TEXT_SIZE, KYROS_WEBSOCKET_TEXT },
+};
+
+#define MESSAGE_COUNT (sizeof(messages) / sizeof(messages[0]))
+
+static void server_message(kyros_websocket* websocket, const char* data, uint64_t length, kyros_websocket_opcode opcode, void* ctx)
+{
+    kyros_websocket_send(websocket, data, length, opcode);
+}
+
+static void onrequest(kyros_http_request* request, kyros_http_response* response, void* ctx)
+{
+    uint32_t key_length;
+    auto key = kyros_websocket_get_key(request, &key_length);
+    uint32_t extensions_length = 0;
+    auto extensions = kyros_http_request_get_header(request, "sec-websocket-extensions", 24, &extensions_length);
+    auto websocket = kyros_websocket_upgrade(response, key, key_length, extensions, extensions_length,
+        (kyros_websocket_options) { .onmessage = server_message, .compression = server_mode });
+    test_assert(websocket);
+    server_compression = websocket->compression;
+}
+
+static void client_open(kyros_websocket* websocket, void* ctx)
+{
+    client_compression = websocket->compression;
+    kyros_websocket_send(websocket, messages[0].data, messages[0].length, messages[0].opcode);
+}
+
+static void client_message(kyros_websocket* websocket, const char* data, uint64_t length, kyros_websocket_opcode opcode, void* ctx)
+{
+    auto expected = &messages[echoed];
+    mismatches += length != expected->length || opcode != expected->opcode || memcmp(data, expected->data, length);
+    // one at a time, every message is inflated with what came before it
+    if (++echoed == MESSAGE_COUNT) {
+        kyros_websocket_close(websocket, 1000, NULL, 0);
+        return;
+    }
+    kyros_websocket_send(websocket, messages[echoed].data, messages[echoed].length, messages[echoed].opcode);
+}
+
+static void client_close(kyros_websocket* websocket, uint16_t code, const char* reason, uint32_t reason_length, void* ctx)
+{
+    kyros_loop_stop(loop);
+}
+
+static void echo(kyros_websocket_compression server, kyros_websocket_compression client)
+{
+    server_mode = server;
+    client_mode = client;
+    server_compression = false;
+    client_compression = false;
+    echoed = 0;
+    mismatches = 0;
+    kyros_websocket_connect(loop,
+        (kyros_socket_source) { .type = KYROS_SOCKET_SOURCE_HOSTPORT, .value.host_port = { .host = "127.0.0.1", .port = DEFLATE_PORT } },
+        (kryos_socket_options) { 0 }, NULL, "/", (kyros_websocket_options) { .onmessage = client_message, .onopen = client_open, .onclose = client_close, .compression = client });
+    kyros_loop_run_forever(loop);
+    test_assert(echoed == MESSAGE_COUNT);
+    test_assert(mismatches == 0);
+}
+
+static void test_echo()
+{
+    auto server = kyros_http_server_listen(loop,
+        (kyros_socket_source) { .type = KYROS_SOCKET_SOURCE_HOSTPORT, .value.host_port = { .host = "127.0.0.1", .port = DEFLATE_PORT } },
+        (kryos_socket_options) { 0 }, (kyros_http_server_options) { .onrequest = onrequest });
+
+    echo(KYROS_WEBSOCKET_COMPRESSION_SHARED, KYROS_WEBSOCKET_COMPRESSION_SHARED);
+    test_assert(server_compression && client_compression);
+    echo(KYROS_WEBSOCKET_COMPRESSION_DEDICATED, KYROS_WEBSOCKET_COMPRESSION_DEDICATED);
+    test_assert(server_compression && client_compression);
+    // each side picks the streams of its own mode
+    echo(KYROS_WEBSOCKET_COMPRESSION_SHARED, KYROS_WEBSOCKET_COMPRESSION_DEDICATED);
+    test_assert(server_compression && client_compression);
+    // not offered, not used
+    echo(KYROS_WEBSOCKET_COMPRESSION_DEDICATED, KYROS_WEBSOCKET_COMPRESSION_NONE);
+    test_assert(!server_compression && !client_compression);
+
+    kyros_http_server_close(server);
+    kyros_loop_run_once(loop);
+}
+
+void test_websocket_deflate()
+{
+    fill_messages();
+    loop = kyros_loop_create(NULL);
+    test_streams();
+    test_inflate_errors();
+    test_echo();
+    kyros_loop_unref(loop);
+}
@@ -0,0 +1,180 @@
+// text frame validation: the vectorized validator must agree with a byte by byte decoder of RFC 3629 on every input
+#include "test.h"
+#include <kyros.h>
+#include <kyros_internal.h>
+#include <string.h>
+
+#define FUZZ_ROUNDS 20'000
+#define FUZZ_MAX_LENGTH 200
+
+/// @brief reference decoder, slow and obvious
+static bool reference_is_valid(const uint8_t* data, uint64_t length)
+{
+    uint64_t i = 0;
+    while (i < length) {
+        auto lead = data[i];
+        uint32_t continuations;
+        uint32_t code_point;
+        uint32_t minimum;
+        if (lead < 0x80) {
+            i++;
+            continue;
+        } else if ((lead & 0xe0) == 0xc0) {
+            continuations = 1;
+            code_point = lead & 0x1f;
+            minimum = 0x80;
+        } else if ((lead & 0xf0) == 0xe0) {
+            continuations = 2;
+            code_point = lead & 0x0f;
+            minimum = 0x800;
+        } else if ((lead & 0xf8) == 0xf0) {
+            continuations = 3;
+            code_point = lead & 0x07;
+            minimum = 0x10000;
+        } else {
+            return false;
+        }
+        if (length - i <= continuations) {
+            return false;
+        }
+        for (uint32_t j = 1; j <= continuations; j++) {
+            if ((data[i + j] & 0xc0) != 0x80) {
+                return false;
+            }
+            code_point = (code_point << 6) | (data[i + j] & 0x3f);
+        }
+        // overlong, surrogate or past the last code point
+        if (code_point < minimum || (code_point >= 0xd800 && code_point <= 0xdfff) || code_point > 0x10ffff) {
+            return false;
+        }
+        i += continuations + 1;
+    }
+    return true;
+}
+
+static bool is_valid(const char* text)
+{
+    return kyros_websocket_utf8_is_valid(text, strlen(text));
+}
+
+static void test_known_sequences()
+{
+    test_assert(kyros_websocket_utf8_is_valid("", 0));
+    test_assert(is_valid("plain ascii"));
+    test_assert(is_valid("\xc2\x80 \xdf\xbf \xe0\xa0\x80 \xef\xbf\xbf \xf0\x90\x80\x80 \xf4\x8f\xbf\xbf"));
+    // a nul is a valid code point
+    test_assert(kyros_websocket_utf8_is_valid("a\0b", 3));
+    const char* invalid[] = {
+        "\x80", // lone continuation
+        "\xc2", // truncated
+        "\xe2\x82", // truncated
+        "\xc2\x41", // lead followed by ascii
+        "\xc0\xaf", // overlong /
+        "\xc1\xbf",
+        "\xe0\x9f\xbf", // overlong 3 bytes
+        "\xf0\x8f\xbf\xbf", // overlong 4 bytes
+        "\xed\xa0\x80", // surrogate
+        "\xed\xbf\xbf",
+        "\xf4\x90\x80\x80", // above U+10FFFF
+        "\xf5\x80\x80\x80",
+        "\xff",
+        "\xe2\x82\xac\xac", // continuation after a whole sequence
+    };
+    for (uint32_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) {
+        test_assert(!is_valid(invalid[i]));
+    }
+}
+
+static void test_block_boundaries()
+{
+    // every sequence at every offset around the 16 and 32 byte blocks, whole and cut at the end of the input
+    const char* sequences[] = { "\xc3\xa9", "\xe2\x82\xac", "\xf0\x9f\x98\x80", "\xed\xa0\x80", "\xc0\x80", "\xf4\x90\x80\x80" };
+    uint8_t buffer[128];
+    uint32_t mismatches = 0;
+    for (uint32_t s = 0; s < sizeof(sequences) / sizeof(sequences[0]); s++) {
+        auto sequence_length = (uint32_t)strlen(sequences[s]);
+        for (uint32_t offset = 0; offset < 80; offset++) {
+            for (uint32_t cut = 0; cut <= sequence_length; cut++) {
+                memset(buffer, 'a', sizeof(buffer));
+                memcpy(buffer + offset, sequences[s], sequence_length);
+                // followed by ascii or ending right after what is kept of the sequence
+                uint64_t lengths[] = { offset + sequence_length - cut, sizeof(buffer) };
+                for (uint32_t l = 0; l < 2; l++) {
+                    if (l) {
+                        memset(buffer + offset + sequence_length - cut, 'a', cut);
+                    }
+                    mismatches += kyros_websocket_utf8_is_valid((const char*)buffer, lengths[l]) != reference_is_valid(buffer, lengths[l]);
+                }
+            }
+        }
+    }
+    test_assert(mismatches == 0);
+}
+
+static void test_every_short_sequence()
+{
+    // every 1 and 2 byte input, every 3 byte input with an ascii or continuation third byte
+    uint8_t buffer[3];
+    uint32_t mismatches = 0;
+    for (uint32_t a = 0; a < 256; a++) {
+        buffer[0] = (uint8_t)a;
+        mismatches += kyros_websocket_utf8_is_valid((const char*)buffer, 1) != reference_is_valid(buffer, 1);
+        for (uint32_t b = 0; b < 256; b++) {
+            buffer[1] = (uint8_t)b;
+            mismatches += kyros_websocket_utf8_is_valid((const char*)buffer, 2) != reference_is_valid(buffer, 2);
+            for (uint32_t c = 0x7f; c < 0xc1; c++) {
+                buffer[2] = (uint8_t)c;
+                mismatches += kyros_websocket_utf8_is_valid((const char*)buffer, 3) != reference_is_valid(buffer, 3);
+            }
+        }
+    }
+    test_assert(mismatches == 0);
+}
+
+static uint64_t random_state = 0x9e3779b97f4a7c15ull;
+
+static uint64_t random_next()
+{
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 7;
+    random_state ^= random_state << 17;
+    return random_state;
+}
+
+static void test_random_inputs()
+{
+    // mostly valid text with a few flipped bytes, fixed seed so a failure always reproduces
+    const char* pieces[] = { "a", "hello ", "\xc3\xa9", "\xe2\x82\xac", "\xf0\x9f\x98\x80", "\xef\xbf\xbd", "\xf4\x8f\xbf\xbf" };
+    const uint8_t corruptions[] = { 0x80, 0xbf, 0xc0, 0xc2, 0xe0, 0xed, 0xf0, 0xf4, 0xf5, 0xff, 0x00 };
+    uint8_t buffer[FUZZ_MAX_LENGTH + 8];
+    uint32_t mismatches = 0;
+    uint32_t valid = 0;
+    for (uint32_t round = 0; round < FUZZ_ROUNDS; round++) {
+        uint32_t length = 0;
+        auto target = (uint32_t)(random_next() % FUZZ_MAX_LENGTH);
+        while (length < target) {
+            auto piece = pieces[random_next() % (sizeof(pieces) / sizeof(pieces[0]))];
+            auto piece_length = (uint32_t)strlen(piece);
+            memcpy(buffer + length, piece, piece_length);
+            length += piece_length;
+        }
+        auto flips = (uint32_t)(random_next() % 3);
+        for (uint32_t i = 0; i < flips && length; i++) {
+            buffer[random_next() % length] = corruptions[random_next() % sizeof(corruptions)];
+        }
+        auto expected = reference_is_valid(buffer, length);
+        valid += expected;
+        mismatches += kyros_websocket_utf8_is_valid((const char*)buffer, length) != expected;
+    }
+    test_assert(mismatches == 0);
+    // both outcomes were exercised
+    test_assert(valid > FUZZ_ROUNDS / 10 && valid < FUZZ_ROUNDS - FUZZ_ROUNDS / 10);
+}
+
+void test_websocket_utf8()
+{
+    test_known_sequences();
+    test_block_boundaries();
+    test_every_short_sequence();
+    test_random_inputs();
+}